@@ -45,11 +45,11 @@ int probe_82802ab(struct flashctx *flash)
 
 	/* Reset to get a clean state */
 	chip_writeb(flash, 0xFF, bios);
-	programmer_delay(10);
+	programmer_delay(flash, 10);
 
 	/* Enter ID mode */
 	chip_writeb(flash, 0x90, bios);
-	programmer_delay(10);
+	programmer_delay(flash, 10);
 
 	id1 = chip_readb(flash, bios + (0x00 << shifted));
 	id2 = chip_readb(flash, bios + (0x01 << shifted));
@@ -57,7 +57,7 @@ int probe_82802ab(struct flashctx *flash)
 	/* Leave ID mode */
 	chip_writeb(flash, 0xFF, bios);
 
-	programmer_delay(10);
+	programmer_delay(flash, 10);
 
 	msg_cdbg("%s: id1 0x%02x, id2 0x%02x", __func__, id1, id2);
 
@@ -83,18 +83,47 @@ int probe_82802ab(struct flashctx *flash)
 	return 1;
 }
 
-/* FIXME: needs timeout */
-uint8_t wait_82802ab(struct flashctx *flash)
+/*
+ * Wait for the status register to report ready. The duration of the
+ * last operation of the same kind is taken as typical time, so we sleep
+ * through most of it first and then poll with exponentially increasing
+ * intervals, like spi_poll_wip(). Without a good estimate, polling starts
+ * right away, so fast chips aren't slowed down.
+ */
+uint8_t wait_82802ab(struct flashctx *flash, const enum wait_82802ab_op op)
 {
+	static const unsigned int max_us[NUM_WAIT_82802AB_OPS] = {
+		[WAIT_82802AB_PROGRAM]		=        10 * 1000,
+		[WAIT_82802AB_ERASE]		= 10 * 1000 * 1000,
+		[WAIT_82802AB_ERASE_SECTOR]	= 10 * 1000 * 1000,
+	};
+	unsigned int *const typ_us = &flash->wait_82802ab_us[op];
+	const unsigned int max_delay = min(max(*typ_us / 2, 1), 100 * 1000);
+	unsigned int delay = max(*typ_us / 16, 1);
+	unsigned int waited = 0;
 	uint8_t status;
 	chipaddr bios = flash->virtual_memory;
 
 	chip_writeb(flash, 0x70, bios);
 
-	while ((chip_readb(flash, bios) & 0x80) == 0)	// it's busy
-		;
+	if (*typ_us >= 4) {
+		waited = *typ_us / 4 * 3;
+		programmer_delay(flash, waited);
+	}
+
+	while (!((status = chip_readb(flash, bios)) & 0x80)) {	// it's busy
+		++flash->stats.wip_polls;
+		if (waited >= max_us[op]) {
+			msg_cerr("Timeout: Chip still busy after %u us.\n", waited);
+			break;
+		}
+		programmer_delay(flash, delay);
+		waited += delay;
+		delay = min(delay * 2, max_delay);
+	}
 
-	status = chip_readb(flash, bios);
+	/* Follow faster operations right away, slower ones only gradually. */
+	*typ_us = waited < *typ_us ? waited : (*typ_us * 3 + waited) / 4;
 
 	/* Reset to get a clean state */
 	chip_writeb(flash, 0xFF, bios);
@@ -114,10 +143,9 @@ int erase_block_82802ab(struct flashctx *flash, unsigned int page,
 	// now start it
 	chip_writeb(flash, 0x20, bios + page);
 	chip_writeb(flash, 0xd0, bios + page);
-	programmer_delay(10);
 
 	// now let's see what the register is
-	status = wait_82802ab(flash);
+	status = wait_82802ab(flash, WAIT_82802AB_ERASE);
 	print_status_82802ab(status);
 
 	/* FIXME: Check the status register for errors. */
@@ -134,7 +162,7 @@ int write_82802ab(struct flashctx *flash, const uint8_t *src, unsigned int start
 		/* transfer data from source to destination */
 		chip_writeb(flash, 0x40, dst);
 		chip_writeb(flash, *src++, dst++);
-		wait_82802ab(flash);
+		wait_82802ab(flash, WAIT_82802AB_PROGRAM);
 		flashprog_progress_add(flash, 1);
 	}
 
@@ -203,7 +231,7 @@ int unlock_lh28f008bjt(struct flashctx *flash)
 	unsigned int i;
 
 	/* Wait if chip is busy */
-	wait_82802ab(flash);
+	wait_82802ab(flash, WAIT_82802AB_ERASE);
 
 	/* Read identifier codes */
 	chip_writeb(flash, 0x90, bios);
@@ -237,7 +265,7 @@ int unlock_lh28f008bjt(struct flashctx *flash)
 		chip_writeb(flash, 0x60, bios);
 		chip_writeb(flash, 0xD0, bios);
 		chip_writeb(flash, 0xFF, bios);
-		wait_82802ab(flash);
+		wait_82802ab(flash, WAIT_82802AB_ERASE);
 		msg_cdbg("Done!\n");
 	}
 
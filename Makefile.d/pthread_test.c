@@ -0,0 +1,16 @@
+#include <pthread.h>
+
+static void *thread(void *arg)
+{
+	return arg;
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	pthread_t t;
+	if (pthread_create(&t, NULL, thread, NULL))
+		return 1;
+	return pthread_join(t, NULL);
+}
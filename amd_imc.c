@@ -63,7 +63,7 @@ static int mbox_wait_ack(uint16_t mbox_port)
 			msg_pwarn("IMC MBOX: Timeout!\n");
 			return 1;
 		}
-		programmer_delay(1000);
+		programmer_delay(NULL, 1000);
 	}
 	return 0;
 }
@@ -154,7 +154,7 @@ static int amd_imc_shutdown(struct pci_dev *dev)
 	return ret;
 }
 
-int handle_imc(struct pci_dev *dev)
+int handle_imc(struct flashprog_programmer *prog, struct pci_dev *dev)
 {
 	bool amd_imc_force = false;
 	char *arg = extract_programmer_param("amd_imc_force");
@@ -182,7 +182,7 @@ int handle_imc(struct pci_dev *dev)
 	}
 
 	if (!amd_imc_force)
-		programmer_may_write = false;
+		prog->may_write = false;
 	msg_pinfo("Writes have been disabled for safety reasons because the presence of the IMC\n"
 		  "was detected and it could interfere with accessing flash memory. Flashprog will\n"
 		  "try to disable it temporarily but even then this might not be safe:\n"
@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include "flash.h"
+#include "chipdrivers.h"
 #include "hwaccess_physmap.h"
 #include "programmer.h"
 #include "spi.h"
@@ -29,6 +30,8 @@ struct spi100 {
 	uint8_t *memory;
 	size_t mapped_len;
 	bool no_4ba_mmap;
+	bool remap_checked;
+	bool remap_ok;
 
 	unsigned int altspeed;
 };
@@ -131,7 +134,7 @@ static int spi100_send_command(const struct flashctx *const flash,
 	int timeout_us = 10*1000*1000;
 	uint32_t spistatus;
 	while (((spistatus = spi100_read32(spi100, 0x4c)) & BIT(31)) && timeout_us--)
-		programmer_delay(1);
+		programmer_delay(flash, 1);
 	if (spistatus & BIT(31)) {
 		msg_perr("ERROR: SPI transfer timed out (0x%08x)!\n", spistatus);
 		return SPI_PROGRAMMER_ERROR;
@@ -144,6 +147,67 @@ static int spi100_send_command(const struct flashctx *const flash,
 	return 0;
 }
 
+/* The ROM page bits are xor'ed into address bits 31:24 of memory-mapped accesses. */
+static void spi100_set_rom_page(const struct spi100 *spi100, uint8_t page)
+{
+	spi100_write8(spi100, 0x5c, page);
+}
+
+/* Read below the 16 MiB window by remapping it to the respective segment. */
+static int spi100_remapped_read(struct flashctx *const flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const struct spi100 *const spi100 = flash->mst.spi->data;
+	const unsigned int segments = flashprog_flash_getsize(flash) / (16*MiB);
+	int ret = 0;
+
+	while (len > 0 && !ret) {
+		const unsigned int segment = start / (16*MiB);
+		const unsigned int offset = start % (16*MiB);
+		const unsigned int seg_len = MIN(len, 16*MiB - offset);
+
+		spi100_set_rom_page(spi100, (segments - 1) ^ segment);
+		ret = flashprog_read_chunked(flash, buf, offset, seg_len, MAX_DATA_READ_UNLIMITED, spi100_mmap_read);
+		start += seg_len;
+		buf += seg_len;
+		len -= seg_len;
+	}
+	spi100_set_rom_page(spi100, 0);
+
+	return ret;
+}
+
+/*
+ * Check once that remapping the window works by comparing the start of
+ * the chip, read through the remapped window and through the FIFO. The
+ * top segment must differ, otherwise we couldn't tell if the remapping
+ * took effect.
+ */
+static bool spi100_can_remap(struct flashctx *const flash)
+{
+	struct spi100 *const spi100 = flash->mst.spi->data;
+	const chipsize_t chip_size = flashprog_flash_getsize(flash);
+	uint8_t top[64], mapped[64], fifo[64];
+
+	if (spi100->remap_checked)
+		return spi100->remap_ok;
+	spi100->remap_checked = true;
+
+	if (spi100->mapped_len != 16*MiB || chip_size % (16*MiB) || chip_size > 256*MiB)
+		return false;
+
+	mmio_readn_aligned(spi100->memory, top, sizeof(top), 8);
+	spi100_set_rom_page(spi100, chip_size / (16*MiB) - 1);
+	mmio_readn_aligned(spi100->memory, mapped, sizeof(mapped), 8);
+	spi100_set_rom_page(spi100, 0);
+	if (spi_nbyte_read(flash, fifo, 0, sizeof(fifo)))
+		return false;
+
+	spi100->remap_ok = !memcmp(mapped, fifo, sizeof(fifo)) && memcmp(top, fifo, sizeof(fifo));
+	msg_pdbg("Remapping the memory-mapped window %s.\n",
+		 spi100->remap_ok ? "works" : "can't be confirmed, using the FIFO");
+	return spi100->remap_ok;
+}
+
 static int spi100_read(struct flashctx *const flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
 	const struct spi100 *const spi100 = flash->mst.spi->data;
@@ -158,10 +222,12 @@ static int spi100_read(struct flashctx *const flash, uint8_t *buf, unsigned int
 	   Can be negative if the mapping is bigger than the chip. */
 	const long long mapped_start = chip_size - spi100->mapped_len;
 
-	/* Use SPI100 engine for data outside the memory-mapped range. */
+	/* Use remapped window or SPI100 engine for data outside the memory-mapped range. */
 	if ((long long)start < mapped_start) {
 		const chipsize_t unmapped_len = MIN(len, mapped_start - start);
-		const int ret = default_spi_read(flash, buf, start, unmapped_len);
+		const int ret = spi100_can_remap(flash)
+			? spi100_remapped_read(flash, buf, start, unmapped_len)
+			: default_spi_read(flash, buf, start, unmapped_len);
 		if (ret)
 			return ret;
 		start += unmapped_len;
@@ -309,6 +375,8 @@ int amd_spi100_probe(void *const spibar, void *const memory_mapping, const size_
 	spi100->spibar = spibar;
 	spi100->memory = memory_mapping;
 	spi100->mapped_len = mapped_len;
+	spi100->remap_checked = false;
+	spi100->remap_ok = false;
 
 	spi100_print(spi100);
 
@@ -40,10 +40,8 @@
 #define AT45DB_CHIP_ERASE_ADDR 0x94809A /* Magic address. See usage. */
 #define AT45DB_BUFFER1_WRITE 0x84
 #define AT45DB_BUFFER1_PAGE_PROGRAM 0x88
-/* Buffer 2 is unused yet.
 #define AT45DB_BUFFER2_WRITE 0x87
 #define AT45DB_BUFFER2_PAGE_PROGRAM 0x89
-*/
 
 static uint8_t at45db_read_status_register(struct flashctx *flash, uint8_t *status)
 {
@@ -311,7 +309,7 @@ static int at45db_wait_ready (struct flashctx *flash, unsigned int us, unsigned
 			return 0;
 		if (ret != 0 || retries-- == 0)
 			return 1;
-		programmer_delay(us);
+		programmer_delay(flash, us);
 	}
 }
 
@@ -455,7 +453,8 @@ int spi_erase_at45cs_sector(struct flashctx *flash, unsigned int addr, unsigned
 	return at45db_erase(flash, opcode, at45db_convert_addr(addr, page_size), 200000, 100);
 }
 
-static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, unsigned int off, unsigned int len)
+static int at45db_fill_buffer(struct flashctx *flash, unsigned int buffer, const uint8_t *bytes,
+			      unsigned int off, unsigned int len)
 {
 	const unsigned int page_size = flash->chip->page_size;
 	if ((off + len) > page_size) {
@@ -464,13 +463,13 @@ static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, uns
 		return 1;
 	}
 
-	/* Create a suitable buffer to store opcode, address and data chunks for buffer1. */
+	/* Create a suitable buffer to store opcode, address and data chunks for the buffer. */
 	const unsigned int max_data_write = flash->mst.spi->max_data_write;
 	const unsigned int max_chunk = max_data_write > 4 && max_data_write - 4 <= page_size ?
 				       max_data_write - 4 : page_size;
 	uint8_t buf[4 + max_chunk];
 
-	buf[0] = AT45DB_BUFFER1_WRITE;
+	buf[0] = buffer == 2 ? AT45DB_BUFFER2_WRITE : AT45DB_BUFFER1_WRITE;
 	while (off < page_size) {
 		unsigned int cur_chunk = min(max_chunk, page_size - off);
 		buf[1] = (off >> 16) & 0xff;
@@ -487,10 +486,11 @@ static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, uns
 	return 0;
 }
 
-static int at45db_commit_buffer1(struct flashctx *flash, unsigned int at45db_addr)
+/* Starts programming a page from the buffer, the caller has to wait for completion. */
+static int at45db_commit_buffer(struct flashctx *flash, unsigned int buffer, unsigned int at45db_addr)
 {
 	const uint8_t cmd[] = {
-		AT45DB_BUFFER1_PAGE_PROGRAM,
+		buffer == 2 ? AT45DB_BUFFER2_PAGE_PROGRAM : AT45DB_BUFFER1_PAGE_PROGRAM,
 		(at45db_addr >> 16) & 0xff,
 		(at45db_addr >> 8) & 0xff,
 		(at45db_addr >> 0) & 0xff
@@ -498,30 +498,49 @@ static int at45db_commit_buffer1(struct flashctx *flash, unsigned int at45db_add
 
 	/* Send buffer to device. */
 	int ret = spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
-	if (ret != 0) {
+	if (ret != 0)
 		msg_cerr("%s: error sending buffer to main memory command!\n", __func__);
-		return ret;
-	}
+	return ret;
+}
 
+static int at45db_wait_page_program(struct flashctx *flash)
+{
 	/* Wait for completion (typically a few ms). */
-	ret = at45db_wait_ready(flash, 250, 200); // 50 ms
-	if (ret != 0) {
+	int ret = at45db_wait_ready(flash, 250, 200); // 50 ms
+	if (ret != 0)
 		msg_cerr("%s: chip did not become ready again!\n", __func__);
-		return ret;
-	}
-
-	return 0;
+	return ret;
 }
 
-static int at45db_program_page(struct flashctx *flash, const uint8_t *buf, unsigned int at45db_addr)
+/*
+ * Fills a buffer and starts programming it. With two buffers, the other one
+ * stays accessible while one is programmed. Then we only have to wait for
+ * the previous page program right before the commit.
+ */
+static int at45db_program_page(struct flashctx *flash, unsigned int buffer, bool ping_pong,
+			       const uint8_t *buf, unsigned int at45db_addr)
 {
-	int ret = at45db_fill_buffer1(flash, buf, 0, flash->chip->page_size);
+	int ret;
+
+	if (!ping_pong) {
+		ret = at45db_wait_page_program(flash);
+		if (ret != 0)
+			return ret;
+	}
+
+	ret = at45db_fill_buffer(flash, buffer, buf, 0, flash->chip->page_size);
 	if (ret != 0) {
 		msg_cerr("%s: filling the buffer failed!\n", __func__);
 		return ret;
 	}
 
-	ret = at45db_commit_buffer1(flash, at45db_addr);
+	if (ping_pong) {
+		ret = at45db_wait_page_program(flash);
+		if (ret != 0)
+			return ret;
+	}
+
+	ret = at45db_commit_buffer(flash, buffer, at45db_addr);
 	if (ret != 0) {
 		msg_cerr("%s: committing page failed!\n", __func__);
 		return ret;
@@ -546,13 +565,17 @@ int spi_write_at45db(struct flashctx *flash, const uint8_t *buf, unsigned int st
 		return 1;
 	}
 
-	unsigned int i;
+	/* The small AT45DB011D and AT45DB021D have only a single buffer. */
+	const bool ping_pong = total_size > 256;
+	unsigned int i, buffer = 1;
 	for (i = 0; i < len; i += page_size) {
-		if (at45db_program_page(flash, buf + i, at45db_convert_addr(start + i, page_size)) != 0) {
+		if (at45db_program_page(flash, buffer, ping_pong, buf + i, at45db_convert_addr(start + i, page_size)) != 0) {
 			msg_cerr("Writing page %u failed!\n", i);
 			return 1;
 		}
 		flashprog_progress_add(flash, page_size);
+		if (ping_pong)
+			buffer = buffer == 1 ? 2 : 1;
 	}
-	return 0;
+	return at45db_wait_page_program(flash);
 }
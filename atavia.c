@@ -105,7 +105,7 @@ static bool atavia_ready(struct pci_dev *pcidev_dev)
 			ready = true;
 			break;
 		} else {
-			programmer_delay(1);
+			programmer_delay(NULL, 1);
 			continue;
 		}
 	}
@@ -147,7 +147,7 @@ static int atavia_init(struct flashprog_programmer *const prog)
 
 	/* Test if a flash chip is attached. */
 	pci_write_long(dev, PCI_ROM_ADDRESS, (uint32_t)PCI_ROM_ADDRESS_MASK);
-	programmer_delay(90);
+	programmer_delay(NULL, 90);
 	uint32_t base = pci_read_long(dev, PCI_ROM_ADDRESS);
 	msg_pdbg2("BROM base=0x%08x\n", base);
 	if ((base & PCI_ROM_ADDRESS_MASK) == 0) {
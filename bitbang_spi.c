@@ -130,7 +130,8 @@ int register_spi_bitbang_master(const struct bitbang_spi_master *master, void *s
 	return 0;
 }
 
-static uint8_t bitbang_spi_read_byte(const struct bitbang_spi_master *master, void *spi_data)
+static uint8_t bitbang_spi_read_byte(const struct flashctx *flash,
+				     const struct bitbang_spi_master *master, void *spi_data)
 {
 	uint8_t ret = 0;
 	int i;
@@ -140,23 +141,24 @@ static uint8_t bitbang_spi_read_byte(const struct bitbang_spi_master *master, vo
 			bitbang_spi_set_sck_set_mosi(master, 0, 0, spi_data);
 		else
 			bitbang_spi_set_sck(master, 0, spi_data);
-		programmer_delay(master->half_period);
+		programmer_delay(flash, master->half_period);
 		ret <<= 1;
 		ret |= bitbang_spi_set_sck_get_miso(master, 1, spi_data);
-		programmer_delay(master->half_period);
+		programmer_delay(flash, master->half_period);
 	}
 	return ret;
 }
 
-static void bitbang_spi_write_byte(const struct bitbang_spi_master *master, uint8_t val, void *spi_data)
+static void bitbang_spi_write_byte(const struct flashctx *flash,
+				   const struct bitbang_spi_master *master, uint8_t val, void *spi_data)
 {
 	int i;
 
 	for (i = 7; i >= 0; i--) {
 		bitbang_spi_set_sck_set_mosi(master, 0, (val >> i) & 1, spi_data);
-		programmer_delay(master->half_period);
+		programmer_delay(flash, master->half_period);
 		bitbang_spi_set_sck(master, 1, spi_data);
-		programmer_delay(master->half_period);
+		programmer_delay(flash, master->half_period);
 	}
 }
 
@@ -175,15 +177,22 @@ static int bitbang_spi_send_command(const struct flashctx *flash,
 	 */
 	bitbang_spi_request_bus(master, data->spi_data);
 	bitbang_spi_set_cs(master, 0, data->spi_data);
-	for (i = 0; i < writecnt; i++)
-		bitbang_spi_write_byte(master, writearr[i], data->spi_data);
-	for (i = 0; i < readcnt; i++)
-		readarr[i] = bitbang_spi_read_byte(master, data->spi_data);
+	if (master->shift_bytes) {
+		if (writecnt)
+			master->shift_bytes(writearr, NULL, writecnt, data->spi_data);
+		if (readcnt)
+			master->shift_bytes(NULL, readarr, readcnt, data->spi_data);
+	} else {
+		for (i = 0; i < writecnt; i++)
+			bitbang_spi_write_byte(flash, master, writearr[i], data->spi_data);
+		for (i = 0; i < readcnt; i++)
+			readarr[i] = bitbang_spi_read_byte(flash, master, data->spi_data);
+	}
 
 	bitbang_spi_set_sck(master, 0, data->spi_data);
-	programmer_delay(master->half_period);
+	programmer_delay(flash, master->half_period);
 	bitbang_spi_set_cs(master, 1, data->spi_data);
-	programmer_delay(master->half_period);
+	programmer_delay(flash, master->half_period);
 	/* FIXME: Run bitbang_spi_release_bus here or in programmer init? */
 	bitbang_spi_release_bus(master, data->spi_data);
 
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include "flash.h"
 #include "programmer.h"
+#include "chipdrivers.h"
 #include "spi.h"
 
 /* Change this to #define if you want to test without a serial implementation */
@@ -34,13 +35,18 @@ struct buspirate_speeds {
 
 #define BP_DEFAULTBAUD 115200
 
+/* Default buffer size is 19: 16 bytes data, 3 bytes control. */
+#define DEFAULT_BUFSIZE (16 + 3)
+
 #ifndef FAKE_COMMUNICATION
-static int buspirate_serialport_setup(char *dev)
+static int buspirate_serialport_setup(char *dev, bool low_latency)
 {
 	/* 115200bps, 8 databits, no parity, 1 stopbit */
 	sp_fd = sp_openserport(dev, BP_DEFAULTBAUD);
 	if (sp_fd == SER_INV_FD)
 		return 1;
+	if (low_latency)
+		sp_set_low_latency(dev);
 	return 0;
 }
 #else
@@ -51,9 +57,16 @@ static int buspirate_serialport_setup(char *dev)
 #define sp_flush_incoming(...) 0
 #endif
 
+/* Maximum of write plus read length of a write-then-read command. */
+#define BP_MAX_TRANSFER		4096
+
 struct bp_spi_data {
 	unsigned char *commbuf;
 	int commbufsize;
+	/* Write-then-read commands kept in flight by buspirate_spi_read(), 0 if unsupported. */
+	unsigned int read_depth;
+	/* Usable entries of spispeeds[], the firmware may not support all of them. */
+	unsigned int spispeed_count;
 };
 
 static int buspirate_commbuf_grow(int bufsize, unsigned char **bp_commbuf, int *bp_commbufsize)
@@ -131,11 +144,37 @@ static int buspirate_wait_for_string(unsigned char *buf, const char *key)
 	return ret;
 }
 
+/* Like buspirate_wait_for_string(), but give up after `timeout_ms` without a match. */
+static int buspirate_wait_for_string_timeout(unsigned char *buf, const char *key, unsigned int timeout_ms)
+{
+	const unsigned int keylen = strlen(key);
+	unsigned int got = 0, i;
+
+	for (i = 0; i < timeout_ms; ++i) {
+		unsigned int rd = 0;
+		const int ret = serialport_read_nonblock(buf + got, 1, 1, &rd);
+		if (ret < 0)
+			return ret;
+		if (!rd)
+			continue;
+		if (++got == keylen) {
+			if (!memcmp(buf, key, keylen))
+				return 0;
+			memmove(buf, buf + 1, keylen - 1);
+			--got;
+		}
+	}
+	return 1;
+}
+
 static int buspirate_spi_send_command_v1(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 					 const unsigned char *writearr, unsigned char *readarr);
 static int buspirate_spi_send_command_v2(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 					 const unsigned char *writearr, unsigned char *readarr);
+static int buspirate_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 static int buspirate_spi_shutdown(void *data);
+static size_t buspirate_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds);
+static int buspirate_spi_set_speed(const struct flashctx *flash, unsigned long hz);
 
 static struct spi_master spi_master_buspirate = {
 	.features	= SPI_MASTER_4BA,
@@ -143,10 +182,12 @@ static struct spi_master spi_master_buspirate = {
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
 	.command	= NULL,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= buspirate_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= buspirate_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= buspirate_spi_list_speeds,
+	.set_speed	= buspirate_spi_set_speed,
 };
 
 static const struct buspirate_speeds spispeeds[] = {
@@ -161,6 +202,11 @@ static const struct buspirate_speeds spispeeds[] = {
 	{NULL,		0x0}
 };
 
+/* The clocks of spispeeds[] in Hz. */
+static const unsigned long spispeeds_hz[] = {
+	30000, 125000, 250000, 1000000, 2000000, 2600000, 4000000, 8000000,
+};
+
 static const struct buspirate_speeds serialspeeds[] = {
 	{"115200",  115200},
 	{"230400",  230400},
@@ -221,21 +267,131 @@ out_shutdown:
  */
 #define BP_DIVISOR(baud) ((4000000/(baud)) - 1)
 
+/* Timeout and number of prompts to test a new serial speed with. */
+#define BP_SYNC_TIMEOUT_MS	200
+#define BP_SYNC_ROUNDS		8
+
+/*
+ * Switch the serial speed of the Bus Pirate and the host. The Bus Pirate
+ * has to wait at its "HiZ>" prompt. With `test` set, the new speed has
+ * to answer a number of prompts in time, otherwise 1 is returned.
+ */
+static int buspirate_set_serialspeed(unsigned char *bp_commbuf, int speed, bool test)
+{
+	int cnt, i, ret;
+
+	/* Enter baud rate configuration mode */
+	cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "b\n");
+	if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
+		return ret;
+	if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
+		return ret;
+
+	/* Enter manual clock divisor entry mode */
+	cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "10\n");
+	if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
+		return ret;
+	if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
+		return ret;
+
+	/* Set the clock divisor to the value calculated from the user's input */
+	cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "%d\n", BP_DIVISOR(speed));
+	if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
+		return ret;
+	sleep(1);
+
+	/* Reconfigure the host's serial baud rate to the new value */
+	if ((ret = serialport_config(sp_fd, speed))) {
+		msg_perr("Unable to configure system baud rate to specified value.");
+		return ret;
+	}
+
+	/* Return to the main prompt */
+	bp_commbuf[0] = ' ';
+	if ((ret = buspirate_sendrecv(bp_commbuf, 1, 0)))
+		return ret;
+	if (!test)
+		return buspirate_wait_for_string(bp_commbuf, "HiZ>");
+
+	if ((ret = buspirate_wait_for_string_timeout(bp_commbuf, "HiZ>", BP_SYNC_TIMEOUT_MS)))
+		return ret;
+	/* Every newline should be answered with a fresh prompt. */
+	for (i = 0; i < BP_SYNC_ROUNDS; i++) {
+		bp_commbuf[0] = '\n';
+		if ((ret = buspirate_sendrecv(bp_commbuf, 1, 0)))
+			return ret;
+		if ((ret = buspirate_wait_for_string_timeout(bp_commbuf, "HiZ>", BP_SYNC_TIMEOUT_MS)))
+			return ret;
+	}
+	return 0;
+}
+
+/* Reset the Bus Pirate, which returns it to the default speed, and wait for its prompt. */
+static int buspirate_revert_serialspeed(unsigned char *bp_commbuf)
+{
+	int cnt, ret;
+
+	cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "#\n");
+	if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
+		return ret;
+	if ((ret = serialport_config(sp_fd, BP_DEFAULTBAUD)))
+		return ret;
+	if (!buspirate_wait_for_string_timeout(bp_commbuf, "HiZ>", 10 * BP_SYNC_TIMEOUT_MS))
+		return 0;
+
+	/* Maybe it never left the default speed. */
+	bp_commbuf[0] = '\n';
+	if ((ret = buspirate_sendrecv(bp_commbuf, 1, 0)))
+		return ret;
+	return buspirate_wait_for_string_timeout(bp_commbuf, "HiZ>", 10 * BP_SYNC_TIMEOUT_MS);
+}
+
+/* Try the serial speeds from the fastest down, and stay at the first one that works reliably. */
+static int buspirate_ramp_serialspeed(unsigned char *bp_commbuf)
+{
+	int i, last = 0;
+
+	for (i = ARRAY_SIZE(serialspeeds) - 2; i >= 0; i--) {
+		const int speed = serialspeeds[i].speed;
+
+		if (speed == last)
+			continue;
+		last = speed;
+		if (speed == BP_DEFAULTBAUD)
+			break;
+
+		if (!buspirate_set_serialspeed(bp_commbuf, speed, true)) {
+			msg_pdbg("Serial speed is %d baud\n", speed);
+			return 0;
+		}
+		msg_pdbg("Serial speed %d baud is unstable, reverting.\n", speed);
+		if (buspirate_revert_serialspeed(bp_commbuf)) {
+			msg_perr("Lost connection to the Bus Pirate while probing serial speeds.\n"
+				 "Please reconnect it and select a speed with the `serialspeed' parameter.\n");
+			return 1;
+		}
+	}
+	msg_pdbg("Serial speed is %d baud\n", BP_DEFAULTBAUD);
+	return 0;
+}
+
 static int buspirate_spi_init(struct flashprog_programmer *const prog)
 {
 	char *tmp;
 	char *dev;
 	int i;
-	int cnt;
 	unsigned int fw_version_major = 0;
 	unsigned int fw_version_minor = 0;
 	unsigned int hw_version_major = 0;
 	unsigned int hw_version_minor = 0;
 	int spispeed = 0x7;
+	bool auto_speed = false;
 	int serialspeed_index = -1;
+	bool serialspeed_auto = false;
 	int ret = 0;
 	bool pullup = false;
 	bool psu = false;
+	bool low_latency = false;
 	unsigned char *bp_commbuf;
 	int bp_commbufsize;
 
@@ -250,7 +406,9 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 	}
 
 	tmp = extract_programmer_param("spispeed");
-	if (tmp) {
+	if (tmp && !strcasecmp(tmp, "auto")) {
+		auto_speed = true;
+	} else if (tmp) {
 		for (i = 0; spispeeds[i].name; i++) {
 			if (!strncasecmp(spispeeds[i].name, tmp, strlen(spispeeds[i].name))) {
 				spispeed = spispeeds[i].speed;
@@ -264,7 +422,9 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 
 	/* Extract serialspeed parameter */
 	tmp = extract_programmer_param("serialspeed");
-	if (tmp) {
+	if (tmp && !strcasecmp(tmp, "auto")) {
+		serialspeed_auto = true;
+	} else if (tmp) {
 		for (i = 0; serialspeeds[i].name; i++) {
 			if (!strncasecmp(serialspeeds[i].name, tmp, strlen(serialspeeds[i].name))) {
 				serialspeed_index = i;
@@ -287,6 +447,15 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 	}
 	free(tmp);
 
+	tmp = extract_programmer_param("lowlatency");
+	if (tmp) {
+		if (strcasecmp("yes", tmp) == 0)
+			low_latency = true;
+		else if (strcasecmp("no", tmp) != 0)
+			msg_perr("Invalid lowlatency value, not using it.\n");
+	}
+	free(tmp);
+
 	tmp = extract_programmer_param("psus");
 	if (tmp) {
 		if (strcasecmp("on", tmp) == 0)
@@ -298,8 +467,6 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 	}
 	free(tmp);
 
-	/* Default buffer size is 19: 16 bytes data, 3 bytes control. */
-#define DEFAULT_BUFSIZE (16 + 3)
 	bp_commbuf = malloc(DEFAULT_BUFSIZE);
 	if (!bp_commbuf) {
 		msg_perr("Out of memory!\n");
@@ -308,7 +475,7 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 	}
 	bp_commbufsize = DEFAULT_BUFSIZE;
 
-	ret = buspirate_serialport_setup(dev);
+	ret = buspirate_serialport_setup(dev, low_latency);
 	free(dev);
 	if (ret) {
 		free(bp_commbuf);
@@ -430,6 +597,14 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 		spi_master_buspirate.max_data_read = 2048;
 		spi_master_buspirate.max_data_write = 256;
 		spi_master_buspirate.command = buspirate_spi_send_command_v2;
+		/*
+		 * The UART of older hardware can't buffer a second command while
+		 * the first is answered. Hardware 4.0 and newer talks USB natively.
+		 */
+		if (BP_HWVERSION(hw_version_major, hw_version_minor) >= BP_HWVERSION(4, 0))
+			bp_data->read_depth = 2;
+		else
+			bp_data->read_depth = 1;
 	} else {
 		msg_pinfo("Bus Pirate firmware 5.4 and older does not support fast SPI access.\n");
 		msg_pinfo("Reading/writing a flash chip may take hours.\n");
@@ -447,29 +622,38 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 	}
 
 	/* Workaround for broken speed settings in firmware 6.1 and older. */
-	if (BP_FWVERSION(fw_version_major, fw_version_minor) < BP_FWVERSION(6, 2))
+	bp_data->spispeed_count = ARRAY_SIZE(spispeeds_hz);
+	if (BP_FWVERSION(fw_version_major, fw_version_minor) < BP_FWVERSION(6, 2)) {
 		if (spispeed > 0x4) {
 			msg_perr("Bus Pirate firmware 6.1 and older does not support SPI speeds above 2 MHz. "
 				 "Limiting speed to 2 MHz.\n");
 			msg_pinfo("It is recommended to upgrade to firmware 6.2 or newer.\n");
 			spispeed = 0x4;
 		}
+		bp_data->spispeed_count = 0x4 + 1;
+	}
 
 	/* This works because speeds numbering starts at 0 and is contiguous. */
 	msg_pdbg("SPI speed is %sHz\n", spispeeds[spispeed].name);
+	spi_master_buspirate.tune_speed = auto_speed;
+	spi_master_buspirate.clock_hz = spispeeds_hz[spispeed];
 
-	/* Set 2M baud serial speed by default on hardware 3.0 and newer if a custom speed was not set */
-	if (serialspeed_index == -1 && BP_HWVERSION(hw_version_major, hw_version_minor) >= BP_HWVERSION(3, 0)) {
-		serialspeed_index = ARRAY_SIZE(serialspeeds) - 2;
-		msg_pdbg("Bus Pirate v3 or newer detected. Set serial speed to 2M baud.\n");
+	/* Find the fastest stable serial speed by default on hardware 3.0 and newer if a custom speed was not set */
+	if (serialspeed_index == -1 && !serialspeed_auto &&
+	    BP_HWVERSION(hw_version_major, hw_version_minor) >= BP_HWVERSION(3, 0)) {
+		serialspeed_auto = true;
+		msg_pdbg("Bus Pirate v3 or newer detected. Probing for the fastest serial speed.\n");
 	}
 
 	/* Set custom serial speed if specified */
-	if (serialspeed_index != -1) {
+	if (serialspeed_index != -1 || serialspeed_auto) {
 		if (BP_FWVERSION(fw_version_major, fw_version_minor) < BP_FWVERSION(5, 5)) {
 			/* This feature requires firmware 5.5 or newer */
 			msg_perr("Bus Pirate firmware 5.4 and older does not support custom serial speeds."
 				 "Using default speed of 115200 baud.\n");
+		} else if (serialspeed_auto) {
+			if ((ret = buspirate_ramp_serialspeed(bp_commbuf)))
+				goto init_err_cleanup_exit;
 		} else if (serialspeeds[serialspeed_index].speed != BP_DEFAULTBAUD) {
 			/* Set the serial speed to match the user's choice if it doesn't already */
 
@@ -477,39 +661,7 @@ static int buspirate_spi_init(struct flashprog_programmer *const prog)
 				msg_pwarn("Increased serial speeds may not work on older (<3.0) Bus Pirates."
 					" Continue at your own risk.\n");
 
-			/* Enter baud rate configuration mode */
-			cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "b\n");
-			if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
-				goto init_err_cleanup_exit;
-			if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
-				goto init_err_cleanup_exit;
-
-			/* Enter manual clock divisor entry mode */
-			cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "10\n");
-			if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
-				goto init_err_cleanup_exit;
-			if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
-				goto init_err_cleanup_exit;
-
-			/* Set the clock divisor to the value calculated from the user's input */
-			cnt = snprintf((char *)bp_commbuf, DEFAULT_BUFSIZE, "%d\n",
-				BP_DIVISOR(serialspeeds[serialspeed_index].speed));
-
-			if ((ret = buspirate_sendrecv(bp_commbuf, cnt, 0)))
-				goto init_err_cleanup_exit;
-			sleep(1);
-
-			/* Reconfigure the host's serial baud rate to the new value */
-			if ((ret = serialport_config(sp_fd, serialspeeds[serialspeed_index].speed))) {
-				msg_perr("Unable to configure system baud rate to specified value.");
-				goto init_err_cleanup_exit;
-			}
-
-			/* Return to the main prompt */
-			bp_commbuf[0] = ' ';
-			if ((ret = buspirate_sendrecv(bp_commbuf, 1, 0)))
-				goto init_err_cleanup_exit;
-			if ((ret = buspirate_wait_for_string(bp_commbuf, "HiZ>")))
+			if ((ret = buspirate_set_serialspeed(bp_commbuf, serialspeeds[serialspeed_index].speed, false)))
 				goto init_err_cleanup_exit;
 
 			msg_pdbg("Serial speed is %d baud\n", serialspeeds[serialspeed_index].speed);
@@ -614,6 +766,33 @@ init_err_cleanup_exit:
 	return ret;
 }
 
+static size_t buspirate_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	const struct bp_spi_data *const bp_data = flash->mst.spi->data;
+	*speeds = spispeeds_hz;
+	return bp_data->spispeed_count;
+}
+
+static int buspirate_spi_set_speed(const struct flashctx *flash, unsigned long hz)
+{
+	struct bp_spi_data *const bp_data = flash->mst.spi->data;
+	unsigned int i;
+
+	for (i = 0; i < bp_data->spispeed_count && spispeeds_hz[i] != hz; ++i)
+		;
+	if (i == bp_data->spispeed_count)
+		return 1;
+
+	bp_data->commbuf[0] = 0x60 | spispeeds[i].speed;
+	if (buspirate_sendrecv(bp_data->commbuf, 1, 1))
+		return 1;
+	if (bp_data->commbuf[0] != 0x01) {
+		msg_perr("Protocol error while setting SPI speed!\n");
+		return 1;
+	}
+	return 0;
+}
+
 static int buspirate_spi_send_command_v1(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 					 const unsigned char *writearr, unsigned char *readarr)
 {
@@ -713,6 +892,84 @@ static int buspirate_spi_send_command_v2(const struct flashctx *flash, unsigned
 	return ret;
 }
 
+static int buspirate_send_read(struct flashctx *flash, unsigned int addr, unsigned int len)
+{
+	unsigned char cmd[5 + 1 + JEDEC_MAX_ADDR_LEN];
+
+	const int writecnt = spi_prepare_read_cmd(flash, cmd + 5, addr, len);
+	if (writecnt <= 0)
+		return 1;
+
+	/* Combined SPI write/read. */
+	cmd[0] = 0x04;
+	cmd[1] = (writecnt >> 8) & 0xff;
+	cmd[2] = writecnt & 0xff;
+	cmd[3] = (len >> 8) & 0xff;
+	cmd[4] = len & 0xff;
+
+	return buspirate_sendrecv(cmd, 5 + writecnt, 0);
+}
+
+/*
+ * Read with maximal write-then-read commands. If supported, the next
+ * command is sent before the answer to the previous one is received,
+ * keeping the serial link busy in both directions.
+ */
+static int buspirate_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct bp_spi_data *bp_data = flash->mst.spi->data;
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN];
+	const unsigned int chunk = BP_MAX_TRANSFER - 1 - JEDEC_MAX_ADDR_LEN;
+	unsigned int sent = 0, received = 0, in_flight = 0;
+
+	if (!bp_data->read_depth || !len)
+		return default_spi_read(flash, buf, start, len);
+
+	/* Checks the address mode and sets up the EAR for all chunks. */
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	if (buspirate_commbuf_grow(1 + chunk, &bp_data->commbuf, &bp_data->commbufsize))
+		return ERROR_OOM;
+
+	while (received < len) {
+		while (sent < len && in_flight < bp_data->read_depth) {
+			const unsigned int to_send = min(chunk, len - sent);
+			if (buspirate_send_read(flash, start + sent, to_send)) {
+				msg_perr("Bus Pirate communication error!\n");
+				return SPI_GENERIC_ERROR;
+			}
+			sent += to_send;
+			++in_flight;
+		}
+
+		const unsigned int to_read = min(chunk, len - received);
+		if (buspirate_sendrecv(bp_data->commbuf, 0, 1 + to_read)) {
+			msg_perr("Bus Pirate communication error!\n");
+			return SPI_GENERIC_ERROR;
+		}
+		if (bp_data->commbuf[0] != 0x01) {
+			msg_perr("Protocol error while sending SPI write/read!\n");
+			return SPI_GENERIC_ERROR;
+		}
+		memcpy(buf + received, bp_data->commbuf + 1, to_read);
+		received += to_read;
+		--in_flight;
+		flashprog_progress_add(flash, to_read);
+
+		if (flashprog_cancelled(flash) && received < len) {
+			/* Drain the outstanding answer to keep the protocol in sync. */
+			if (in_flight && buspirate_sendrecv(bp_data->commbuf, 0, 1 + min(chunk, len - received)))
+				return SPI_GENERIC_ERROR;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 const struct programmer_entry programmer_buspirate_spi = {
 	.name			= "buspirate_spi",
 	.type			= OTHER,
@@ -17,10 +17,14 @@
  * GNU General Public License for more details.
  */
 
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libusb.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
+#include "spi.h"
 
 /* LIBUSB_CALL ensures the right calling conventions on libusb callbacks.
  * However, the macro is not defined everywhere. m(
@@ -71,17 +75,26 @@
 
 /* Number of parallel IN transfers. 32 seems to produce the most stable throughput on Windows. */
 #define USB_IN_TRANSFERS 32
+/* Number of parallel OUT transfers, each sends a whole segment, cf. usb_transfer_segments(). */
+#define USB_OUT_TRANSFERS 4
 
-/* We need to use many queued IN transfers for any resemblance of performance (especially on Windows)
- * because USB spec says that transfers end on non-full packets and the device sends the 31 reply
- * data bytes to each 32-byte packet with command + 31 bytes of data... */
-static struct libusb_transfer *transfer_out = NULL;
-static struct libusb_transfer *transfer_ins[USB_IN_TRANSFERS] = {0};
+/* Native reads stream segments of up to CH341A_SEGMENT_PACKETS packets and report progress per block. */
+#define CH341A_SEGMENT_PACKETS	256
+#define CH341A_SEGMENT_DATA	(CH341A_SEGMENT_PACKETS * (CH341_PACKET_LENGTH - 1))
+#define CH341A_READ_BLOCK	(64 * KiB)
 
-/* Accumulate delays to be plucked between CS deassertion and CS assertions. */
-static unsigned int stored_delay_us = 0;
+struct ch341a_spi_data {
+	struct libusb_device_handle *handle;
 
-static struct libusb_device_handle *handle = NULL;
+	/* We need to use many queued IN transfers for any resemblance of performance (especially on
+	 * Windows) because USB spec says that transfers end on non-full packets and the device sends
+	 * the 31 reply data bytes to each 32-byte packet with command + 31 bytes of data... */
+	struct libusb_transfer *transfer_outs[USB_OUT_TRANSFERS];
+	struct libusb_transfer *transfer_ins[USB_IN_TRANSFERS];
+
+	/* Accumulate delays to be plucked between CS deassertion and CS assertions. */
+	unsigned int stored_delay_us;
+};
 
 static const struct dev_entry devs_ch341a_spi[] = {
 	{0x1A86, 0x5512, OK, "Winchiphead (WCH)", "CH341A"},
@@ -131,42 +144,70 @@ static void LIBUSB_CALL cb_in(struct libusb_transfer *transfer)
 	cb_common(__func__, transfer);
 }
 
-static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned int readcnt, const uint8_t *writearr, uint8_t *readarr)
+/*
+ * A segment is sent with a single OUT transfer, its `in_len` bytes of answer
+ * are received with IN transfers of up to 31 bytes, one for each packet. As
+ * transfers end on non-full packets, every packet but the last of a segment
+ * must be full.
+ */
+struct ch341a_segment {
+	const uint8_t *out;
+	unsigned int out_len;
+	uint8_t *in;
+	unsigned int in_len;
+};
+
+static int32_t usb_transfer_segments(struct ch341a_spi_data *ch341a_data, const char *func,
+				     const struct ch341a_segment *segs, unsigned int count)
 {
-	if (handle == NULL)
-		return -1;
+	struct libusb_transfer **const transfer_outs = ch341a_data->transfer_outs;
+	struct libusb_transfer **const transfer_ins = ch341a_data->transfer_ins;
 
-	int state_out = TRANS_IDLE;
-	transfer_out->buffer = (uint8_t*)writearr;
-	transfer_out->length = writecnt;
-	transfer_out->user_data = &state_out;
-
-	/* Schedule write first */
-	if (writecnt > 0) {
-		state_out = TRANS_ACTIVE;
-		int ret = libusb_submit_transfer(transfer_out);
-		if (ret) {
-			msg_perr("%s: failed to submit OUT transfer: %s\n", func, libusb_error_name(ret));
-			state_out = TRANS_ERR;
-			goto err;
-		}
-	}
+	/* OUT transfer `i % USB_OUT_TRANSFERS` is used for segment `i`. */
+	unsigned int out_next = 0; /* The segment to be sent next. */
+	unsigned int out_done = 0; /* The segment we expect to be completed next. */
+	int state_out[USB_OUT_TRANSFERS] = {0};
 
-	/* Handle all asynchronous packets as long as we have stuff to write or read. The write(s) simply need
-	 * to complete but we need to scheduling reads as long as we are not done. */
+	unsigned int in_seg = 0, in_seg_off = 0; /* The segment and offset to schedule IN transfers for. */
 	unsigned int free_idx = 0; /* The IN transfer we expect to be free next. */
 	unsigned int in_idx = 0; /* The IN transfer we expect to be completed next. */
 	unsigned int in_done = 0;
-	unsigned int in_active = 0;
-	unsigned int out_done = 0;
-	uint8_t *in_buf = readarr;
+	unsigned int in_total = 0;
 	int state_in[USB_IN_TRANSFERS] = {0};
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		in_total += segs[i].in_len;
+
+	/* Handle all asynchronous packets as long as we have stuff to write or read. Writes simply need to
+	 * complete, but we need to schedule reads as long as we are not done. */
 	do {
+		/* Schedule new writes as long as there are free transfers and unsent segments. */
+		while (out_next < count && state_out[out_next % USB_OUT_TRANSFERS] == TRANS_IDLE) {
+			const unsigned int out_idx = out_next % USB_OUT_TRANSFERS;
+			transfer_outs[out_idx]->buffer = (uint8_t *)segs[out_next].out;
+			transfer_outs[out_idx]->length = segs[out_next].out_len;
+			transfer_outs[out_idx]->user_data = &state_out[out_idx];
+			int ret = libusb_submit_transfer(transfer_outs[out_idx]);
+			if (ret) {
+				state_out[out_idx] = TRANS_ERR;
+				msg_perr("%s: failed to submit OUT transfer: %s\n", func, libusb_error_name(ret));
+				goto err;
+			}
+			state_out[out_idx] = TRANS_ACTIVE;
+			++out_next;
+		}
+
 		/* Schedule new reads as long as there are free transfers and unscheduled bytes to read. */
-		while ((in_done + in_active) < readcnt && state_in[free_idx] == TRANS_IDLE) {
-			unsigned int cur_todo = min(CH341_PACKET_LENGTH - 1, readcnt - in_done - in_active);
+		while (in_seg < count && state_in[free_idx] == TRANS_IDLE) {
+			if (in_seg_off == segs[in_seg].in_len) {
+				++in_seg;
+				in_seg_off = 0;
+				continue;
+			}
+			unsigned int cur_todo = min(CH341_PACKET_LENGTH - 1, segs[in_seg].in_len - in_seg_off);
 			transfer_ins[free_idx]->length = cur_todo;
-			transfer_ins[free_idx]->buffer = in_buf;
+			transfer_ins[free_idx]->buffer = segs[in_seg].in + in_seg_off;
 			transfer_ins[free_idx]->user_data = &state_in[free_idx];
 			int ret = libusb_submit_transfer(transfer_ins[free_idx]);
 			if (ret) {
@@ -175,8 +216,7 @@ static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned in
 					 func, libusb_error_name(ret));
 				goto err;
 			}
-			in_buf += cur_todo;
-			in_active += cur_todo;
+			in_seg_off += cur_todo;
 			state_in[free_idx] = TRANS_ACTIVE;
 			free_idx = (free_idx + 1) % USB_IN_TRANSFERS; /* Increment (and wrap around). */
 		}
@@ -184,68 +224,62 @@ static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned in
 		/* Actually get some work done. */
 		libusb_handle_events_timeout(NULL, &(struct timeval){1, 0});
 
-		/* Check for the write */
-		if (out_done < writecnt) {
-			if (state_out == TRANS_ERR) {
+		/* Check for completed writes. */
+		while (out_done < out_next && state_out[out_done % USB_OUT_TRANSFERS] != TRANS_ACTIVE) {
+			const unsigned int out_idx = out_done % USB_OUT_TRANSFERS;
+			if (state_out[out_idx] != (int)segs[out_done].out_len)
 				goto err;
-			} else if (state_out > 0) {
-				out_done += state_out;
-				state_out = TRANS_IDLE;
-			}
+			state_out[out_idx] = TRANS_IDLE;
+			++out_done;
 		}
-		/* Check for completed transfers. */
+		/* Check for completed reads. */
 		while (state_in[in_idx] != TRANS_IDLE && state_in[in_idx] != TRANS_ACTIVE) {
-			if (state_in[in_idx] == TRANS_ERR) {
+			/* Every packet is answered in full, anything shorter would shift the data. */
+			if (state_in[in_idx] != transfer_ins[in_idx]->length)
 				goto err;
-			}
 			/* If a transfer is done, record the number of bytes read and reuse it later. */
 			in_done += state_in[in_idx];
-			in_active -= state_in[in_idx];
 			state_in[in_idx] = TRANS_IDLE;
 			in_idx = (in_idx + 1) % USB_IN_TRANSFERS; /* Increment (and wrap around). */
 		}
-	} while ((out_done < writecnt) || (in_done < readcnt));
+	} while (out_done < count || in_done < in_total);
 
-	if (out_done > 0) {
-		msg_pspew("Wrote %d bytes:\n", out_done);
-		print_hex(writearr, out_done);
-		msg_pspew("\n\n");
-	}
-	if (in_done > 0) {
-		msg_pspew("Read %d bytes:\n", in_done);
-		print_hex(readarr, in_done);
+	for (i = 0; i < count; ++i) {
+		msg_pspew("Wrote %u bytes:\n", segs[i].out_len);
+		print_hex(segs[i].out, segs[i].out_len);
 		msg_pspew("\n\n");
+		if (segs[i].in_len) {
+			msg_pspew("Read %u bytes:\n", segs[i].in_len);
+			print_hex(segs[i].in, segs[i].in_len);
+			msg_pspew("\n\n");
+		}
 	}
 	return 0;
 err:
 	/* Clean up on errors. */
-	msg_perr("%s: Failed to %s %d bytes\n", func, (state_out == TRANS_ERR) ? "write" : "read",
-		 (state_out == TRANS_ERR) ? writecnt : readcnt);
+	msg_perr("%s: Failed to %s data\n", func, out_done < count ? "write" : "read");
 	/* First, we must cancel any ongoing requests and wait for them to be canceled. */
-	if ((writecnt > 0) && (state_out == TRANS_ACTIVE)) {
-		if (libusb_cancel_transfer(transfer_out) != 0)
-			state_out = TRANS_ERR;
+	for (i = 0; i < USB_OUT_TRANSFERS; i++) {
+		if (state_out[i] == TRANS_ACTIVE)
+			if (libusb_cancel_transfer(transfer_outs[i]) != 0)
+				state_out[i] = TRANS_ERR;
 	}
-	if (readcnt > 0) {
-		unsigned int i;
-		for (i = 0; i < USB_IN_TRANSFERS; i++) {
-			if (state_in[i] == TRANS_ACTIVE)
-				if (libusb_cancel_transfer(transfer_ins[i]) != 0)
-					state_in[i] = TRANS_ERR;
-		}
+	for (i = 0; i < USB_IN_TRANSFERS; i++) {
+		if (state_in[i] == TRANS_ACTIVE)
+			if (libusb_cancel_transfer(transfer_ins[i]) != 0)
+				state_in[i] = TRANS_ERR;
 	}
 
 	/* Wait for cancellations to complete. */
 	while (1) {
 		bool finished = true;
-		if ((writecnt > 0) && (state_out == TRANS_ACTIVE))
-			finished = false;
-		if (readcnt > 0) {
-			unsigned int i;
-			for (i = 0; i < USB_IN_TRANSFERS; i++) {
-				if (state_in[i] == TRANS_ACTIVE)
-					finished = false;
-			}
+		for (i = 0; i < USB_OUT_TRANSFERS; i++) {
+			if (state_out[i] == TRANS_ACTIVE)
+				finished = false;
+		}
+		for (i = 0; i < USB_IN_TRANSFERS; i++) {
+			if (state_in[i] == TRANS_ACTIVE)
+				finished = false;
 		}
 		if (finished)
 			break;
@@ -254,20 +288,25 @@ err:
 	return -1;
 }
 
+static int32_t usb_transfer(struct ch341a_spi_data *ch341a_data, const char *func,
+			    unsigned int writecnt, unsigned int readcnt, const uint8_t *writearr, uint8_t *readarr)
+{
+	const struct ch341a_segment seg = { writearr, writecnt, readarr, readcnt };
+
+	return usb_transfer_segments(ch341a_data, func, &seg, 1);
+}
+
 /*   Set the I2C bus speed (speed(b1b0): 0 = 20kHz; 1 = 100kHz, 2 = 400kHz, 3 = 750kHz).
  *   Set the SPI bus data width (speed(b2): 0 = Single, 1 = Double).  */
-static int32_t config_stream(uint32_t speed)
+static int32_t config_stream(struct ch341a_spi_data *ch341a_data, uint32_t speed)
 {
-	if (handle == NULL)
-		return -1;
-
 	uint8_t buf[] = {
 		CH341A_CMD_I2C_STREAM,
 		CH341A_CMD_I2C_STM_SET | (speed & 0x7),
 		CH341A_CMD_I2C_STM_END
 	};
 
-	int32_t ret = usb_transfer(__func__, sizeof(buf), 0, buf, NULL);
+	int32_t ret = usb_transfer(ch341a_data, __func__, sizeof(buf), 0, buf, NULL);
 	if (ret < 0) {
 		msg_perr("Could not configure stream interface.\n");
 	}
@@ -287,7 +326,7 @@ static int32_t config_stream(uint32_t speed)
  *	D6/21	unused	(DIN2)
  *	D7/22	SO/2	(DIN)
  */
-static int32_t enable_pins(bool enable)
+static int32_t enable_pins(struct ch341a_spi_data *ch341a_data, bool enable)
 {
 	uint8_t buf[] = {
 		CH341A_CMD_UIO_STREAM,
@@ -296,7 +335,7 @@ static int32_t enable_pins(bool enable)
 		CH341A_CMD_UIO_STM_END,
 	};
 
-	int32_t ret = usb_transfer(__func__, sizeof(buf), 0, buf, NULL);
+	int32_t ret = usb_transfer(ch341a_data, __func__, sizeof(buf), 0, buf, NULL);
 	if (ret < 0) {
 		msg_perr("Could not %sable output pins.\n", enable ? "en" : "dis");
 	}
@@ -304,14 +343,14 @@ static int32_t enable_pins(bool enable)
 }
 
 /* De-assert and assert CS in one operation. */
-static void pluck_cs(uint8_t *ptr)
+static void pluck_cs(struct ch341a_spi_data *ch341a_data, uint8_t *ptr)
 {
 	/* This was measured to give a minimum deassertion time of 2.25 us,
 	 * >20x more than needed for most SPI chips (100ns). */
 	int delay_cnt = 2;
-	if (stored_delay_us) {
-		delay_cnt = (stored_delay_us * 4) / 3;
-		stored_delay_us = 0;
+	if (ch341a_data->stored_delay_us) {
+		delay_cnt = (ch341a_data->stored_delay_us * 4) / 3;
+		ch341a_data->stored_delay_us = 0;
 	}
 	*ptr++ = CH341A_CMD_UIO_STREAM;
 	*ptr++ = CH341A_CMD_UIO_STM_OUT | 0x37; /* deasserted */
@@ -322,63 +361,195 @@ static void pluck_cs(uint8_t *ptr)
 	*ptr++ = CH341A_CMD_UIO_STM_END;
 }
 
-static void ch341a_spi_delay(unsigned int usecs)
+static void ch341a_spi_delay(struct flashprog_programmer *prog, unsigned int usecs)
 {
+	struct ch341a_spi_data *const ch341a_data = prog->data;
+
 	/* There is space for 28 bytes instructions of 750 ns each in the CS packet (32 - 4 for the actual CS
 	 * instructions), thus max 21 us, but we avoid getting too near to this boundary and use
 	 * internal_delay() for durations over 20 us. */
-	if ((usecs + stored_delay_us) > 20) {
-		unsigned int inc = 20 - stored_delay_us;
+	if ((usecs + ch341a_data->stored_delay_us) > 20) {
+		unsigned int inc = 20 - ch341a_data->stored_delay_us;
 		internal_delay(usecs - inc);
 		usecs = inc;
 	}
-	stored_delay_us += usecs;
+	ch341a_data->stored_delay_us += usecs;
 }
 
-static int ch341a_spi_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+/* Number of packets needed to stream `len` bytes via SPI. */
+static unsigned int stream_packets(unsigned int len)
 {
-	if (handle == NULL)
-		return -1;
+	return (len + CH341_PACKET_LENGTH - 2) / (CH341_PACKET_LENGTH - 1);
+}
 
-	/* How many packets ... */
-	const size_t packets = (writecnt + readcnt + CH341_PACKET_LENGTH - 2) / (CH341_PACKET_LENGTH - 1);
+/* Length of the OUT data of an SPI command, i.e. the CS packet and the stream packets. */
+static unsigned int command_length(unsigned int writecnt, unsigned int readcnt)
+{
+	return CH341_PACKET_LENGTH + stream_packets(writecnt + readcnt) + writecnt + readcnt;
+}
 
-	/* We pluck CS/timeout handling into the first packet thus we need to allocate one extra package. */
-	uint8_t wbuf[packets+1][CH341_PACKET_LENGTH];
-	uint8_t rbuf[writecnt + readcnt];
-	/* Initialize the write buffer to zero to prevent writing random stack contents to device. */
-	memset(wbuf[0], 0, CH341_PACKET_LENGTH);
+/* Fill `buf` with the packets of an SPI command, cf. command_length(). */
+static void fill_command(struct ch341a_spi_data *ch341a_data, uint8_t *buf,
+			 unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr)
+{
+	const unsigned int packets = stream_packets(writecnt + readcnt);
+
+	/* Initialize the CS packet to zero to prevent writing random stack contents to device. */
+	memset(buf, 0, CH341_PACKET_LENGTH);
 
-	uint8_t *ptr = wbuf[0];
 	/* CS usage is optimized by doing both transitions in one packet.
 	 * Final transition to deselected state is in the pin disable. */
-	pluck_cs(ptr);
+	pluck_cs(ch341a_data, buf);
 	unsigned int write_left = writecnt;
 	unsigned int read_left = readcnt;
 	unsigned int p;
 	for (p = 0; p < packets; p++) {
 		unsigned int write_now = min(CH341_PACKET_LENGTH - 1, write_left);
 		unsigned int read_now = min ((CH341_PACKET_LENGTH - 1) - write_now, read_left);
-		ptr = wbuf[p+1];
+		uint8_t *ptr = buf + (p + 1) * CH341_PACKET_LENGTH;
 		*ptr++ = CH341A_CMD_SPI_STREAM;
-		unsigned int i;
-		for (i = 0; i < write_now; ++i)
-			*ptr++ = reverse_byte(*writearr++);
+		reverse_bytes(ptr, writearr, write_now);
+		writearr += write_now;
+		ptr += write_now;
 		if (read_now) {
 			memset(ptr, 0xFF, read_now);
 			read_left -= read_now;
 		}
 		write_left -= write_now;
 	}
+}
+
+static int ch341a_spi_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	struct ch341a_spi_data *const ch341a_data = flash->mst.spi->data;
 
-	int32_t ret = usb_transfer(__func__, CH341_PACKET_LENGTH + packets + writecnt + readcnt,
+	/* We pluck CS/timeout handling into the first packet thus we need to allocate one extra package. */
+	uint8_t wbuf[stream_packets(writecnt + readcnt) + 1][CH341_PACKET_LENGTH];
+	uint8_t rbuf[writecnt + readcnt];
+
+	fill_command(ch341a_data, wbuf[0], writecnt, readcnt, writearr);
+
+	int32_t ret = usb_transfer(ch341a_data, __func__, command_length(writecnt, readcnt),
 				    writecnt + readcnt, wbuf[0], rbuf);
 	if (ret < 0)
 		return -1;
 
-	unsigned int i;
-	for (i = 0; i < readcnt; i++) {
-		*readarr++ = reverse_byte(rbuf[writecnt + i]);
+	reverse_bytes(readarr, rbuf + writecnt, readcnt);
+
+	return 0;
+}
+
+/*
+ * Send all commands at once, each with its own OUT transfer. This saves
+ * the round trips between them, e.g. between WREN and a page program.
+ */
+static int ch341a_spi_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	struct ch341a_spi_data *const ch341a_data = flash->mst.spi->data;
+	struct ch341a_segment *segs = NULL;
+	uint8_t *wbuf = NULL, *rbuf = NULL;
+	unsigned int count, i, out_len = 0, in_len = 0;
+	int ret = -1;
+
+	for (count = 0; cmds[count].writecnt || cmds[count].readcnt; ++count) {
+		/* We have no notion of multi-I/O. */
+		if (cmds[count].io_mode != SINGLE_IO_1_1_1) {
+			msg_perr("%s called with multi-I/O command.\n"
+				 "Please report a bug at flashprog@flashprog.org\n", __func__);
+			return SPI_FLASHPROG_BUG;
+		}
+		out_len += command_length(cmds[count].writecnt, cmds[count].readcnt);
+		in_len += cmds[count].writecnt + cmds[count].readcnt;
+	}
+	if (!count)
+		return 0;
+
+	segs = calloc(count, sizeof(*segs));
+	wbuf = malloc(out_len);
+	rbuf = malloc(in_len);
+	if (!segs || !wbuf || !rbuf) {
+		msg_perr("Out of memory!\n");
+		goto _free_ret;
+	}
+
+	out_len = 0;
+	in_len = 0;
+	for (i = 0; i < count; ++i) {
+		segs[i].out = wbuf + out_len;
+		segs[i].out_len = command_length(cmds[i].writecnt, cmds[i].readcnt);
+		segs[i].in = rbuf + in_len;
+		segs[i].in_len = cmds[i].writecnt + cmds[i].readcnt;
+		fill_command(ch341a_data, wbuf + out_len, cmds[i].writecnt, cmds[i].readcnt, cmds[i].writearr);
+		out_len += segs[i].out_len;
+		in_len += segs[i].in_len;
+	}
+
+	if (usb_transfer_segments(ch341a_data, __func__, segs, count) < 0)
+		goto _free_ret;
+
+	for (i = 0; i < count; ++i)
+		reverse_bytes(cmds[i].readarr, segs[i].in + cmds[i].writecnt, cmds[i].readcnt);
+	ret = 0;
+
+_free_ret:
+	free(rbuf);
+	free(wbuf);
+	free(segs);
+	return ret;
+}
+
+/*
+ * Read with a single read command. CS stays asserted until the next
+ * command, so the data can be streamed in further segments. These
+ * all share the same OUT data.
+ */
+static int ch341a_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct ch341a_spi_data *const ch341a_data = flash->mst.spi->data;
+	struct ch341a_segment segs[1 + (CH341A_READ_BLOCK + CH341A_SEGMENT_DATA - 1) / CH341A_SEGMENT_DATA];
+	uint8_t stream[CH341A_SEGMENT_PACKETS][CH341_PACKET_LENGTH];
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN], echo[1 + JEDEC_MAX_ADDR_LEN];
+	uint8_t cmd_buf[2][CH341_PACKET_LENGTH];
+	unsigned int done = 0, count, p;
+
+	if (!len)
+		return 0;
+
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	fill_command(ch341a_data, cmd_buf[0], cmdlen, 0, cmd);
+	segs[0] = (struct ch341a_segment){ cmd_buf[0], command_length(cmdlen, 0), echo, cmdlen };
+	count = 1;
+
+	for (p = 0; p < CH341A_SEGMENT_PACKETS; ++p) {
+		stream[p][0] = CH341A_CMD_SPI_STREAM;
+		memset(&stream[p][1], 0xFF, CH341_PACKET_LENGTH - 1);
+	}
+
+	while (done < len) {
+		const unsigned int block = min(CH341A_READ_BLOCK, len - done);
+		unsigned int off, seg_len;
+
+		if (flashprog_cancelled(flash))
+			return 1;
+
+		for (off = 0; off < block; off += seg_len) {
+			seg_len = min(CH341A_SEGMENT_DATA, block - off);
+			segs[count++] = (struct ch341a_segment){
+				stream[0], stream_packets(seg_len) + seg_len, buf + done + off, seg_len };
+		}
+
+		if (usb_transfer_segments(ch341a_data, __func__, segs, count) < 0)
+			return -1;
+
+		reverse_bytes(buf + done, buf + done, block);
+		flashprog_progress_add(flash, block);
+		done += block;
+		count = 0;
 	}
 
 	return 0;
@@ -394,8 +565,8 @@ static const struct spi_master spi_master_ch341a_spi = {
 	.max_data_read	= 4 * 1024,
 	.max_data_write	= 4 * 1024,
 	.command	= ch341a_spi_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.multicommand	= ch341a_spi_spi_send_multicommand,
+	.read		= ch341a_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= ch341a_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
@@ -403,33 +574,26 @@ static const struct spi_master spi_master_ch341a_spi = {
 
 static int ch341a_spi_shutdown(void *data)
 {
-	if (handle == NULL)
-		return -1;
+	struct ch341a_spi_data *const ch341a_data = data;
 
-	enable_pins(false);
-	libusb_free_transfer(transfer_out);
-	transfer_out = NULL;
+	enable_pins(ch341a_data, false);
 	int i;
-	for (i = 0; i < USB_IN_TRANSFERS; i++) {
-		libusb_free_transfer(transfer_ins[i]);
-		transfer_ins[i] = NULL;
-	}
-	libusb_release_interface(handle, 0);
-	libusb_close(handle);
-	libusb_exit(NULL);
-	handle = NULL;
+	for (i = 0; i < USB_OUT_TRANSFERS; i++)
+		libusb_free_transfer(ch341a_data->transfer_outs[i]);
+	for (i = 0; i < USB_IN_TRANSFERS; i++)
+		libusb_free_transfer(ch341a_data->transfer_ins[i]);
+	libusb_release_interface(ch341a_data->handle, 0);
+	libusb_close(ch341a_data->handle);
+	usb_dev_exit(NULL);
+	free(ch341a_data);
 	return 0;
 }
 
 static int ch341a_spi_init(struct flashprog_programmer *const prog)
 {
-	if (handle != NULL) {
-		msg_cerr("%s: handle already set! Please report a bug at flashprog@flashprog.org\n",
-			 __func__);
-		return -1;
-	}
+	struct libusb_device_handle *handle;
 
-	int32_t ret = libusb_init(NULL);
+	int32_t ret = usb_dev_init(NULL);
 	if (ret < 0) {
 		msg_perr("Couldn't initialize libusb!\n");
 		return -1;
@@ -486,13 +650,24 @@ static int ch341a_spi_init(struct flashprog_programmer *const prog)
 		(desc.bcdDevice >> 4) & 0x000F,
 		(desc.bcdDevice >> 0) & 0x000F);
 
-	/* Allocate and pre-fill transfer structures. */
-	transfer_out = libusb_alloc_transfer(0);
-	if (!transfer_out) {
-		msg_perr("Failed to alloc libusb OUT transfer\n");
+	struct ch341a_spi_data *const ch341a_data = calloc(1, sizeof(*ch341a_data));
+	if (!ch341a_data) {
+		msg_perr("Unable to allocate space for SPI master data\n");
 		goto release_interface;
 	}
+	ch341a_data->handle = handle;
+
+	/* Allocate and pre-fill transfer structures. */
+	struct libusb_transfer **const transfer_outs = ch341a_data->transfer_outs;
+	struct libusb_transfer **const transfer_ins = ch341a_data->transfer_ins;
 	int i;
+	for (i = 0; i < USB_OUT_TRANSFERS; i++) {
+		transfer_outs[i] = libusb_alloc_transfer(0);
+		if (transfer_outs[i] == NULL) {
+			msg_perr("Failed to alloc libusb OUT transfer %d\n", i);
+			goto dealloc_transfers;
+		}
+	}
 	for (i = 0; i < USB_IN_TRANSFERS; i++) {
 		transfer_ins[i] = libusb_alloc_transfer(0);
 		if (transfer_ins[i] == NULL) {
@@ -501,29 +676,28 @@ static int ch341a_spi_init(struct flashprog_programmer *const prog)
 		}
 	}
 	/* We use these helpers but dont fill the actual buffer yet. */
-	libusb_fill_bulk_transfer(transfer_out, handle, WRITE_EP, NULL, 0, cb_out, NULL, USB_TIMEOUT);
+	for (i = 0; i < USB_OUT_TRANSFERS; i++)
+		libusb_fill_bulk_transfer(transfer_outs[i], handle, WRITE_EP, NULL, 0, cb_out, NULL, USB_TIMEOUT);
 	for (i = 0; i < USB_IN_TRANSFERS; i++)
 		libusb_fill_bulk_transfer(transfer_ins[i], handle, READ_EP, NULL, 0, cb_in, NULL, USB_TIMEOUT);
 
-	if ((config_stream(CH341A_STM_I2C_100K) < 0) || (enable_pins(true) < 0))
+	if ((config_stream(ch341a_data, CH341A_STM_I2C_100K) < 0) || (enable_pins(ch341a_data, true) < 0))
 		goto dealloc_transfers;
 
-	return register_spi_master(&spi_master_ch341a_spi, 0, NULL);
+	/* For the delay hook. */
+	prog->data = ch341a_data;
+	return register_spi_master(&spi_master_ch341a_spi, 0, ch341a_data);
 
 dealloc_transfers:
-	for (i = 0; i < USB_IN_TRANSFERS; i++) {
-		if (transfer_ins[i] == NULL)
-			break;
+	for (i = 0; i < USB_IN_TRANSFERS; i++)
 		libusb_free_transfer(transfer_ins[i]);
-		transfer_ins[i] = NULL;
-	}
-	libusb_free_transfer(transfer_out);
-	transfer_out = NULL;
+	for (i = 0; i < USB_OUT_TRANSFERS; i++)
+		libusb_free_transfer(transfer_outs[i]);
+	free(ch341a_data);
 release_interface:
 	libusb_release_interface(handle, 0);
 close_handle:
 	libusb_close(handle);
-	handle = NULL;
 	return -1;
 }
 
@@ -14,12 +14,16 @@
  * GNU General Public License for more details.
  */
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include <libusb.h>
 #include "platform.h"
 #include "programmer.h"
 #include "flash.h"
+#include "chipdrivers.h"
+#include "spi.h"
 
 #define CH347_CMD_SPI_SET_CFG	0xC0
 #define CH347_CMD_SPI_CS_CTRL	0xC1
@@ -33,11 +37,7 @@
 #define CH347_CS_CHANGE		0x80
 #define CH347_CS_IGNORE		0x00
 
-#define WRITE_EP	0x06
-#define READ_EP 	0x86
-
-#define MODE_1_IFACE 2
-#define MODE_2_IFACE 1
+#define CH347_VID	0x1A86
 
 /* The USB descriptor says the max transfer size is 512 bytes, but the
  * vendor driver only seems to transfer a maximum of 510 bytes at once,
@@ -48,40 +48,116 @@
 
 struct ch347_spi_data {
 	struct libusb_device_handle *handle;
+	int interface;
+	uint8_t out_ep;
+	uint8_t in_ep;
+	unsigned int cs;	/* chip select in use, 0 for CS1, 1 for CS2 */
+
+	/* Statistics, reported at shutdown. */
+	unsigned long long bytes_transferred;
+	unsigned long long transfer_us;
 };
 
 /* TODO: Add support for HID mode */
 static const struct dev_entry devs_ch347_spi[] = {
-	{0x1A86, 0x55DB, OK, "QinHeng Electronics", "USB To UART+SPI+I2C"},
+	{CH347_VID, 0x55DB, OK, "QinHeng Electronics", "USB To UART+SPI+I2C"},
+	{CH347_VID, 0x55DE, NT, "QinHeng Electronics", "CH347F"},
 	{0}
 };
 
+/*
+ * The operating mode of the CH347T is selected by strapping pins and
+ * shows in the product id. Only the vendor-specific interfaces can be
+ * used, the HID protocol of mode 2 is undocumented.
+ */
+static const struct ch347_mode {
+	uint16_t pid;
+	const char *name;
+	int spi_interface; /* -1 if there is no vendor SPI interface */
+} ch347_modes[] = {
+	{ 0x55DA, "mode 0 (2x UART)",				-1 },
+	{ 0x55DB, "mode 1 (UART + vendor SPI/I2C)",		 2 },
+	{ 0x55DC, "mode 2 (HID UART + HID SPI/I2C)",		-1 },
+	{ 0x55DD, "mode 3 (UART + JTAG)",			-1 },
+	{ 0x55DE, "CH347F (UART + vendor SPI/I2C/JTAG)",	 4 },
+};
+
+static unsigned long long ch347_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ull + tv.tv_usec;
+}
+
+static void ch347_account(struct ch347_spi_data *ch347_data, unsigned int bytes, unsigned long long start)
+{
+	ch347_data->bytes_transferred += bytes;
+	ch347_data->transfer_us += ch347_time_us() - start;
+}
+
 static int ch347_spi_shutdown(void *data)
 {
 	struct ch347_spi_data *ch347_data = data;
 
-	/* TODO: Set this depending on the mode */
-	int spi_interface = MODE_1_IFACE;
-	libusb_release_interface(ch347_data->handle, spi_interface);
-	libusb_attach_kernel_driver(ch347_data->handle, spi_interface);
+	if (ch347_data->transfer_us) {
+		msg_pdbg("CH347: Transferred %llu bytes in %llu ms, %llu kB/s.\n",
+			 ch347_data->bytes_transferred, ch347_data->transfer_us / 1000,
+			 ch347_data->bytes_transferred * 1000 / ch347_data->transfer_us);
+	}
+
+	if (ch347_data->interface >= 0) {
+		libusb_release_interface(ch347_data->handle, ch347_data->interface);
+		libusb_attach_kernel_driver(ch347_data->handle, ch347_data->interface);
+	}
 	libusb_close(ch347_data->handle);
-	libusb_exit(NULL);
+	usb_dev_exit(NULL);
 
 	free(data);
 	return 0;
 }
 
-static int ch347_cs_control(struct ch347_spi_data *ch347_data, uint8_t cs1, uint8_t cs2)
+#define CH347_CS_CMD_LEN	13
+#define CH347_OUT_CMD_LEN	3
+#define CH347_IN_CMD_LEN	7
+
+/* Change chip select `cs` (0 for CS1, 1 for CS2) to `state`, the other one is ignored. */
+static size_t ch347_cs_cmd(uint8_t *const cmd, const unsigned int cs, const uint8_t state)
+{
+	memset(cmd, 0, CH347_CS_CMD_LEN);
+	cmd[0] = CH347_CMD_SPI_CS_CTRL;
+	/* payload length, uint16 LSB: 10 */
+	cmd[1] = CH347_CS_CMD_LEN - 3;
+	cmd[cs ? 8 : 3] = state | CH347_CS_CHANGE;
+	return CH347_CS_CMD_LEN;
+}
+
+static size_t ch347_out_cmd(uint8_t *const cmd, const uint8_t *const data, const unsigned int data_len)
 {
-	uint8_t cmd[13] = {
-		[0] = CH347_CMD_SPI_CS_CTRL,
-		/* payload length, uint16 LSB: 10 */
-		[1] = 10,
-		[3] = cs1,
-		[8] = cs2
-	};
+	cmd[0] = CH347_CMD_SPI_OUT;
+	cmd[1] = (data_len) & 0xFF;
+	cmd[2] = ((data_len) & 0xFF00) >> 8;
+	memcpy(cmd + CH347_OUT_CMD_LEN, data, data_len);
+	return CH347_OUT_CMD_LEN + data_len;
+}
+
+static size_t ch347_in_cmd(uint8_t *const cmd, const unsigned int readcnt)
+{
+	cmd[0] = CH347_CMD_SPI_IN;
+	cmd[1] = 4;
+	cmd[2] = 0;
+	cmd[3] = readcnt & 0xFF;
+	cmd[4] = (readcnt & 0xFF00) >> 8;
+	cmd[5] = (readcnt & 0xFF0000) >> 16;
+	cmd[6] = (readcnt & 0xFF000000) >> 24;
+	return CH347_IN_CMD_LEN;
+}
 
-	int32_t ret = libusb_bulk_transfer(ch347_data->handle, WRITE_EP, cmd, sizeof(cmd), NULL, 1000);
+static int ch347_cs_control(struct ch347_spi_data *ch347_data, uint8_t state)
+{
+	uint8_t cmd[CH347_CS_CMD_LEN];
+	const size_t len = ch347_cs_cmd(cmd, ch347_data->cs, state);
+
+	int32_t ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->out_ep, cmd, len, NULL, 1000);
 	if (ret < 0) {
 		msg_perr("Could not change CS!\n");
 		return -1;
@@ -89,120 +165,418 @@ static int ch347_cs_control(struct ch347_spi_data *ch347_data, uint8_t cs1, uint
 	return 0;
 }
 
+/* Number of packets in flight for reads and writes. */
+#define CH347_ASYNC_TRANSFERS 8
+/* Bytes read per SPI command by ch347_spi_read(). */
+#define CH347_READ_CHUNK (256 * KiB)
 
-static int ch347_write(struct ch347_spi_data *ch347_data, unsigned int writecnt, const uint8_t *writearr)
+struct ch347_async;
+
+struct ch347_slot {
+	struct ch347_async *async;
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	unsigned int busy; /* transfers of this slot that are not completed yet */
+	uint8_t out_buf[CH347_PACKET_SIZE];
+	uint8_t in_buf[CH347_PACKET_SIZE];
+};
+
+/*
+ * Ring of asynchronous transfers. Transfers on one endpoint complete in
+ * the order they were submitted, so packets can be processed in order
+ * in the callbacks. A slot is only reused after all its transfers are
+ * completed.
+ */
+struct ch347_async {
+	struct ch347_slot slots[CH347_ASYNC_TRANSFERS];
+	unsigned int pending; /* transfers submitted but not completed */
+	int error;
+
+	/* Destination of a read. */
+	uint8_t *dest;
+	unsigned int len;
+	unsigned int received;
+};
+
+static void ch347_async_free(struct ch347_async *a);
+
+static struct ch347_async *ch347_async_alloc(void)
 {
-	unsigned int data_len;
-	int packet_len;
-	int transferred;
-	int ret;
-	uint8_t resp_buf[4] = {0};
-	uint8_t buffer[CH347_PACKET_SIZE] = {0};
-	unsigned int bytes_written = 0;
-
-	while (bytes_written < writecnt) {
-		data_len = min(CH347_MAX_DATA_LEN, writecnt - bytes_written );
-		packet_len = data_len + 3;
-
-		buffer[0] = CH347_CMD_SPI_OUT;
-		buffer[1] = (data_len) & 0xFF;
-		buffer[2] = ((data_len) & 0xFF00) >> 8;
-		memcpy(buffer + 3, writearr + bytes_written, data_len);
-
-		ret = libusb_bulk_transfer(ch347_data->handle, WRITE_EP, buffer, packet_len, &transferred, 1000);
-		if (ret < 0 || transferred != packet_len) {
-			msg_perr("Could not send write command\n");
-			return -1;
+	unsigned int i;
+
+	struct ch347_async *const a = calloc(1, sizeof(*a));
+	if (!a) {
+		msg_perr("Out of memory!\n");
+		return NULL;
+	}
+	for (i = 0; i < CH347_ASYNC_TRANSFERS; ++i) {
+		a->slots[i].async = a;
+		a->slots[i].out = libusb_alloc_transfer(0);
+		a->slots[i].in = libusb_alloc_transfer(0);
+		if (!a->slots[i].out || !a->slots[i].in) {
+			msg_perr("Allocating libusb transfers failed!\n");
+			ch347_async_free(a);
+			return NULL;
 		}
+	}
+	return a;
+}
 
-		ret = libusb_bulk_transfer(ch347_data->handle, READ_EP, resp_buf, sizeof(resp_buf), NULL, 1000);
+static int ch347_async_poll(struct ch347_async *const a, const bool finish)
+{
+	if (!a->pending)
+		return 0;
+
+	do {
+		struct timeval timeout = { 10, 0 };
+		const int ret = libusb_handle_events_timeout(NULL, &timeout);
 		if (ret < 0) {
-			msg_perr("Could not receive write command response\n");
-			return -1;
+			msg_perr("Polling USB events failed: %i %s!\n", ret, libusb_error_name(ret));
+			return 1;
 		}
-		bytes_written += data_len;
+	} while (finish && a->pending);
+	return 0;
+}
+
+static void ch347_async_free(struct ch347_async *const a)
+{
+	unsigned int i;
+
+	/* Cancel anything left over after an error and wait for it. */
+	if (a->pending) {
+		for (i = 0; i < CH347_ASYNC_TRANSFERS; ++i) {
+			if (a->slots[i].busy) {
+				libusb_cancel_transfer(a->slots[i].out);
+				libusb_cancel_transfer(a->slots[i].in);
+			}
+		}
+		ch347_async_poll(a, true);
+	}
+	for (i = 0; i < CH347_ASYNC_TRANSFERS; ++i) {
+		libusb_free_transfer(a->slots[i].out);
+		libusb_free_transfer(a->slots[i].in);
+	}
+	free(a);
+}
+
+static int ch347_async_submit(struct ch347_slot *const slot, struct libusb_transfer *const transfer)
+{
+	const int ret = libusb_submit_transfer(transfer);
+	if (ret < 0) {
+		msg_perr("Submitting USB transfer failed: %s\n", libusb_error_name(ret));
+		slot->async->error = 1;
+		return 1;
 	}
+	++slot->busy;
+	++slot->async->pending;
 	return 0;
 }
 
-static int ch347_read(struct ch347_spi_data *ch347_data, unsigned int readcnt, uint8_t *readarr)
+/* Returns true if the transfer should be processed further. */
+static bool ch347_async_complete(struct libusb_transfer *const transfer, const char *const errmsg)
 {
-	uint8_t *read_ptr = readarr;
+	struct ch347_slot *const slot = transfer->user_data;
+
+	--slot->busy;
+	--slot->async->pending;
+	if (slot->async->error)
+		return false;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("%s\n", errmsg);
+		slot->async->error = 1;
+		return false;
+	}
+	return true;
+}
+
+static void LIBUSB_CALL ch347_write_out_cb(struct libusb_transfer *const transfer)
+{
+	struct ch347_slot *const slot = transfer->user_data;
+
+	if (!ch347_async_complete(transfer, "Could not send write command"))
+		return;
+	if (transfer->actual_length != transfer->length) {
+		msg_perr("Could not send write command\n");
+		slot->async->error = 1;
+	}
+}
+
+static void LIBUSB_CALL ch347_write_in_cb(struct libusb_transfer *const transfer)
+{
+	ch347_async_complete(transfer, "Could not receive write command response");
+}
+
+static int ch347_write(struct ch347_spi_data *ch347_data, unsigned int writecnt, const uint8_t *writearr)
+{
+	const unsigned long long start = ch347_time_us();
+	unsigned int bytes_written = 0, next = 0;
+	int ret = -1;
+
+	struct ch347_async *const a = ch347_async_alloc();
+	if (!a)
+		return -1;
+
+	/* Every packet is answered with a 4-byte response, keep several packets in flight. */
+	while (!a->error && bytes_written < writecnt) {
+		struct ch347_slot *slot;
+		while (!a->error && bytes_written < writecnt &&
+		       !(slot = &a->slots[next % CH347_ASYNC_TRANSFERS])->busy) {
+			const unsigned int data_len = min(CH347_MAX_DATA_LEN, writecnt - bytes_written);
+
+			const int packet_len = ch347_out_cmd(slot->out_buf, writearr + bytes_written, data_len);
+
+			libusb_fill_bulk_transfer(slot->out, ch347_data->handle, ch347_data->out_ep, slot->out_buf,
+						  packet_len, ch347_write_out_cb, slot, 1000);
+			libusb_fill_bulk_transfer(slot->in, ch347_data->handle, ch347_data->in_ep, slot->in_buf,
+						  4, ch347_write_in_cb, slot, 1000);
+			if (ch347_async_submit(slot, slot->out) || ch347_async_submit(slot, slot->in))
+				break;
+
+			bytes_written += data_len;
+			++next;
+		}
+		if (ch347_async_poll(a, false))
+			goto _free_ret;
+	}
+	if (ch347_async_poll(a, true) || a->error)
+		goto _free_ret;
+
+	ch347_account(ch347_data, writecnt, start);
+	ret = 0;
+_free_ret:
+	ch347_async_free(a);
+	return ret;
+}
+
+static void LIBUSB_CALL ch347_read_cb(struct libusb_transfer *const transfer)
+{
+	struct ch347_async *const a = ((struct ch347_slot *)transfer->user_data)->async;
+
+	if (!ch347_async_complete(transfer, "Could not read data"))
+		return;
+
+	/* Response: u8 command, u16 data length, then the data that was read */
+	if (transfer->actual_length < 3) {
+		msg_perr("CH347 returned an invalid response to read command\n");
+		a->error = 1;
+		return;
+	}
+	const unsigned int ch347_data_length = read_le16(transfer->buffer, 1);
+	if ((unsigned int)transfer->actual_length - 3 < ch347_data_length) {
+		msg_perr("CH347 returned less data than data length header indicates\n");
+		a->error = 1;
+		return;
+	}
+	if (a->received + ch347_data_length > a->len) {
+		msg_perr("CH347 returned more bytes than requested\n");
+		a->error = 1;
+		return;
+	}
+	memcpy(a->dest + a->received, transfer->buffer + 3, ch347_data_length);
+	a->received += ch347_data_length;
+}
+
+/* Receive the data of a CH347_CMD_SPI_IN command. */
+static int ch347_read_data(struct ch347_spi_data *ch347_data, unsigned int readcnt, uint8_t *readarr)
+{
+	const unsigned long long start = ch347_time_us();
+	unsigned int next = 0;
 	int ret;
+
+	struct ch347_async *const a = ch347_async_alloc();
+	if (!a)
+		return -1;
+	a->dest = readarr;
+	a->len = readcnt;
+
+	/*
+	 * Keep up to CH347_ASYNC_TRANSFERS packets queued, but not more
+	 * than the remaining data can fill. Normally, every packet but
+	 * the last carries CH347_MAX_DATA_LEN bytes.
+	 */
+	ret = -1;
+	while (!a->error && a->received < readcnt) {
+		struct ch347_slot *slot;
+		while (!a->error && a->received + a->pending * CH347_MAX_DATA_LEN < readcnt &&
+		       !(slot = &a->slots[next % CH347_ASYNC_TRANSFERS])->busy) {
+			libusb_fill_bulk_transfer(slot->in, ch347_data->handle, ch347_data->in_ep, slot->in_buf,
+						  CH347_PACKET_SIZE, ch347_read_cb, slot, 1000);
+			if (ch347_async_submit(slot, slot->in))
+				break;
+			++next;
+		}
+		if (ch347_async_poll(a, false))
+			goto _free_ret;
+	}
+	if (ch347_async_poll(a, true) || a->error || a->received != readcnt)
+		goto _free_ret;
+
+	ch347_account(ch347_data, readcnt, start);
+	ret = 0;
+_free_ret:
+	ch347_async_free(a);
+	return ret;
+}
+
+static int ch347_read(struct ch347_spi_data *ch347_data, unsigned int readcnt, uint8_t *readarr)
+{
+	uint8_t command_buf[CH347_IN_CMD_LEN];
 	int transferred;
-	unsigned int bytes_read = 0;
-	uint8_t buffer[CH347_PACKET_SIZE] = {0};
-	uint8_t command_buf[7] = {
-		[0] = CH347_CMD_SPI_IN,
-		[1] = 4,
-		[2] = 0,
-		[3] = readcnt & 0xFF,
-		[4] = (readcnt & 0xFF00) >> 8,
-		[5] = (readcnt & 0xFF0000) >> 16,
-		[6] = (readcnt & 0xFF000000) >> 24
-	};
 
-	ret = libusb_bulk_transfer(ch347_data->handle, WRITE_EP, command_buf, sizeof(command_buf), &transferred, 1000);
-	if (ret < 0 || transferred != sizeof(command_buf)) {
+	const int len = ch347_in_cmd(command_buf, readcnt);
+	const int ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->out_ep, command_buf, len, &transferred, 1000);
+	if (ret < 0 || transferred != len) {
 		msg_perr("Could not send read command\n");
 		return -1;
 	}
 
-	while (bytes_read < readcnt) {
-		ret = libusb_bulk_transfer(ch347_data->handle, READ_EP, buffer, CH347_PACKET_SIZE, &transferred, 1000);
+	return ch347_read_data(ch347_data, readcnt, readarr);
+}
+
+/* Transfer a command that doesn't fit into a single packet piece by piece. */
+static int ch347_send_unbatched(struct ch347_spi_data *ch347_data, const struct spi_command *cmd)
+{
+	int ret = 0;
+
+	ch347_cs_control(ch347_data, CH347_CS_ASSERT);
+	if (cmd->writecnt) {
+		ret = ch347_write(ch347_data, cmd->writecnt, cmd->writearr);
+		if (ret >= 0 && cmd->datacnt)
+			ret = ch347_write(ch347_data, cmd->datacnt, cmd->dataarr);
 		if (ret < 0) {
-			msg_perr("Could not read data\n");
+			msg_perr("CH347 write error\n");
 			return -1;
 		}
-		if (transferred > CH347_PACKET_SIZE) {
-			msg_perr("libusb bug: bytes received overflowed buffer\n");
+	}
+	if (cmd->readcnt) {
+		ret = ch347_read(ch347_data, cmd->readcnt, cmd->readarr);
+		if (ret < 0) {
+			msg_perr("CH347 read error\n");
 			return -1;
 		}
-		/* Response: u8 command, u16 data length, then the data that was read */
-		if (transferred < 3) {
-			msg_perr("CH347 returned an invalid response to read command\n");
-			return -1;
+	}
+	ch347_cs_control(ch347_data, CH347_CS_DEASSERT);
+
+	return 0;
+}
+
+/* Commands of a batch are sent in one packet, the responses are received in order. */
+struct ch347_batch {
+	uint8_t packet[CH347_PACKET_SIZE];
+	size_t len;
+	unsigned int cs;
+	const struct spi_command *first;
+	const struct spi_command *end;
+};
+
+static size_t ch347_batch_len(const struct spi_command *const cmd)
+{
+	return 2 * CH347_CS_CMD_LEN +
+		(cmd->writecnt ? CH347_OUT_CMD_LEN + cmd->writecnt + cmd->datacnt : 0) +
+		(cmd->readcnt ? CH347_IN_CMD_LEN : 0);
+}
+
+static void ch347_batch_add(struct ch347_batch *const batch, const struct spi_command *const cmd)
+{
+	uint8_t *const p = batch->packet;
+
+	if (!batch->len)
+		batch->first = cmd;
+	batch->end = cmd + 1;
+
+	batch->len += ch347_cs_cmd(p + batch->len, batch->cs, CH347_CS_ASSERT);
+	if (cmd->writecnt) {
+		uint8_t *const out = p + batch->len;
+		batch->len += ch347_out_cmd(out, cmd->writearr, cmd->writecnt);
+		if (cmd->datacnt) {
+			/* Extend the SPI_OUT command with the payload. */
+			const unsigned int out_len = cmd->writecnt + cmd->datacnt;
+			out[1] = out_len & 0xff;
+			out[2] = (out_len & 0xff00) >> 8;
+			memcpy(p + batch->len, cmd->dataarr, cmd->datacnt);
+			batch->len += cmd->datacnt;
 		}
-		int ch347_data_length = read_le16(buffer, 1);
-		if (transferred - 3 < ch347_data_length) {
-			msg_perr("CH347 returned less data than data length header indicates\n");
-			return -1;
+	}
+	if (cmd->readcnt)
+		batch->len += ch347_in_cmd(p + batch->len, cmd->readcnt);
+	batch->len += ch347_cs_cmd(p + batch->len, batch->cs, CH347_CS_DEASSERT);
+}
+
+static int ch347_batch_flush(struct ch347_spi_data *ch347_data, struct ch347_batch *const batch)
+{
+	const struct spi_command *cmd;
+	int transferred, ret;
+
+	if (!batch->len)
+		return 0;
+
+	const int len = batch->len;
+	batch->len = 0;
+	ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->out_ep, batch->packet, len, &transferred, 1000);
+	if (ret < 0 || transferred != len) {
+		msg_perr("Could not send command batch\n");
+		return -1;
+	}
+
+	for (cmd = batch->first; cmd < batch->end; ++cmd) {
+		if (cmd->writecnt) {
+			uint8_t resp_buf[4];
+			ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->in_ep, resp_buf, sizeof(resp_buf), NULL, 1000);
+			if (ret < 0) {
+				msg_perr("Could not receive write command response\n");
+				return -1;
+			}
 		}
-		bytes_read += ch347_data_length;
-		if (bytes_read > readcnt) {
-			msg_perr("CH347 returned more bytes than requested\n");
+		if (cmd->readcnt && ch347_read_data(ch347_data, cmd->readcnt, cmd->readarr)) {
+			msg_perr("CH347 read error\n");
 			return -1;
 		}
-		memcpy(read_ptr, buffer + 3, ch347_data_length);
-		read_ptr += ch347_data_length;
 	}
 	return 0;
 }
 
-static int ch347_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
-		unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+/*
+ * Pack CS control, write and read of as many commands as possible into
+ * a single bulk packet. This saves several USB round trips per command.
+ */
+static int ch347_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
 {
 	struct ch347_spi_data *ch347_data = flash->mst.spi->data;
-	int ret = 0;
+	struct ch347_batch batch = { .len = 0, .cs = flash->chip_select };
 
-	ch347_cs_control(ch347_data, CH347_CS_ASSERT | CH347_CS_CHANGE, CH347_CS_IGNORE);
-	if (writecnt) {
-		ret = ch347_write(ch347_data, writecnt, writearr);
-		if (ret < 0) {
-			msg_perr("CH347 write error\n");
-			return -1;
-		}
-	}
-	if (readcnt) {
-		ret = ch347_read(ch347_data, readcnt, readarr);
-		if (ret < 0) {
-			msg_perr("CH347 read error\n");
+	ch347_data->cs = flash->chip_select;
+
+	for (; cmds->writecnt || cmds->readcnt; ++cmds) {
+		const size_t len = ch347_batch_len(cmds);
+
+		if (batch.len + len > sizeof(batch.packet) && ch347_batch_flush(ch347_data, &batch))
 			return -1;
+
+		if (len > sizeof(batch.packet)) {
+			if (ch347_send_unbatched(ch347_data, cmds))
+				return -1;
+			continue;
 		}
+		ch347_batch_add(&batch, cmds);
 	}
-	ch347_cs_control(ch347_data, CH347_CS_DEASSERT | CH347_CS_CHANGE, CH347_CS_IGNORE);
+	return ch347_batch_flush(ch347_data, &batch);
+}
 
-	return 0;
+static int ch347_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
+		unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	struct spi_command cmds[] = {
+		{
+			.writecnt	= writecnt,
+			.readcnt	= readcnt,
+			.writearr	= writearr,
+			.readarr	= readarr,
+		},
+		NULL_SPI_CMD
+	};
+
+	return ch347_spi_send_multicommand(flash, cmds);
 }
 
 static int32_t ch347_spi_config(struct ch347_spi_data *ch347_data, uint8_t divisor)
@@ -233,7 +607,7 @@ static int32_t ch347_spi_config(struct ch347_spi_data *ch347_data, uint8_t divis
 		[24] = 0
 	};
 
-	ret = libusb_bulk_transfer(ch347_data->handle, WRITE_EP, buff, sizeof(buff), NULL, 1000);
+	ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->out_ep, buff, sizeof(buff), NULL, 1000);
 	if (ret < 0) {
 		msg_perr("Could not configure SPI interface\n");
 	}
@@ -241,24 +615,68 @@ static int32_t ch347_spi_config(struct ch347_spi_data *ch347_data, uint8_t divis
 	/* FIXME: Not sure if the CH347 sends error responses for
 	 * invalid config data, if so the code should check
 	 */
-	ret = libusb_bulk_transfer(ch347_data->handle, READ_EP, buff, sizeof(buff), NULL, 1000);
+	ret = usb_dev_bulk_transfer(ch347_data->handle, ch347_data->in_ep, buff, sizeof(buff), NULL, 1000);
 	if (ret < 0) {
 		msg_perr("Could not receive configure SPI command response\n");
 	}
 	return ret;
 }
 
+/*
+ * Send as many AAI words with their padding status reads as fit into one
+ * packet, see spi_write_aai_batched(). The reads take the same space in
+ * the packet regardless of their length.
+ */
+static int ch347_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const size_t word_len = 4 * CH347_CS_CMD_LEN + 2 * CH347_OUT_CMD_LEN + JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE +
+				1 + CH347_IN_CMD_LEN;
+
+	return spi_write_aai_batched(flash, buf, start, len, CH347_PACKET_SIZE / word_len);
+}
+
+/* Read in large chunks, so the transfer ring can keep the device streaming. */
+static int ch347_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return flashprog_read_chunked(flash, buf, start, len, CH347_READ_CHUNK, spi_nbyte_read);
+}
+
+/* The clocks of all divisors in Hz, in reverse order. */
+static const unsigned long ch347_speeds[] = {
+	468750, 937500, 1875000, 3750000, 7500000, 15000000, 30000000, 60000000,
+};
+
+static size_t ch347_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	*speeds = ch347_speeds;
+	return ARRAY_SIZE(ch347_speeds);
+}
+
+static int ch347_spi_set_speed(const struct flashctx *flash, unsigned long hz)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(ch347_speeds) && ch347_speeds[i] != hz; ++i)
+		;
+	if (i == ARRAY_SIZE(ch347_speeds))
+		return 1;
+	return ch347_spi_config(flash->mst.spi->data, ARRAY_SIZE(ch347_speeds) - 1 - i) < 0;
+}
+
 static const struct spi_master spi_master_ch347_spi = {
-	.features	= SPI_MASTER_4BA,
+	.features	= SPI_MASTER_4BA | SPI_MASTER_GATHER,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= ch347_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.multicommand	= ch347_spi_send_multicommand,
+	.read		= ch347_spi_read,
 	.write_256	= default_spi_write_256,
-	.write_aai	= default_spi_write_aai,
+	.write_aai	= ch347_spi_write_aai,
 	.shutdown	= ch347_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= ch347_spi_list_speeds,
+	.set_speed	= ch347_spi_set_speed,
+	.chip_selects	= 2,
 };
 
 static unsigned int ch347_div_to_khz(unsigned int div)
@@ -268,6 +686,85 @@ static unsigned int ch347_div_to_khz(unsigned int div)
 	return clk_khz / (1 << (div + 1));
 }
 
+static const struct ch347_mode *ch347_find_mode(const uint16_t pid)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(ch347_modes); ++i) {
+		if (ch347_modes[i].pid == pid)
+			return &ch347_modes[i];
+	}
+	return NULL;
+}
+
+/* Open the first supported CH347. If there is none, tell about CH347 in other modes. */
+static int ch347_open(struct ch347_spi_data *ch347_data)
+{
+	size_t i;
+
+	for (i = 0; devs_ch347_spi[i].vendor_id; ++i) {
+		ch347_data->handle = libusb_open_device_with_vid_pid(NULL,
+				devs_ch347_spi[i].vendor_id, devs_ch347_spi[i].device_id);
+		if (ch347_data->handle)
+			return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ch347_modes); ++i) {
+		if (ch347_modes[i].spi_interface >= 0)
+			continue;
+		struct libusb_device_handle *const handle =
+			libusb_open_device_with_vid_pid(NULL, CH347_VID, ch347_modes[i].pid);
+		if (handle) {
+			libusb_close(handle);
+			msg_perr("Found a CH347 in %s, which has no vendor SPI interface.\n"
+				 "Please strap it to mode 1 to use it with flashprog.\n", ch347_modes[i].name);
+			return 1;
+		}
+	}
+
+	msg_perr("Couldn't find a CH347 device.\n");
+	return 1;
+}
+
+/* Take the bulk endpoints from the interface descriptor instead of assuming their numbers. */
+static int ch347_find_endpoints(struct ch347_spi_data *ch347_data, struct libusb_device *dev, int iface)
+{
+	struct libusb_config_descriptor *config;
+	int i, ret = 1;
+
+	if (libusb_get_active_config_descriptor(dev, &config)) {
+		msg_perr("Failed to get config descriptor.\n");
+		return 1;
+	}
+	if (iface >= config->bNumInterfaces || !config->interface[iface].num_altsetting) {
+		msg_perr("CH347 has no interface %d.\n", iface);
+		goto _free_ret;
+	}
+
+	const struct libusb_interface_descriptor *const desc = &config->interface[iface].altsetting[0];
+	ch347_data->out_ep = ch347_data->in_ep = 0;
+	for (i = 0; i < desc->bNumEndpoints; ++i) {
+		const struct libusb_endpoint_descriptor *const ep = &desc->endpoint[i];
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+		if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			ch347_data->in_ep = ep->bEndpointAddress;
+		else
+			ch347_data->out_ep = ep->bEndpointAddress;
+	}
+	if (!ch347_data->out_ep || !ch347_data->in_ep) {
+		msg_perr("CH347 interface %d has no bulk endpoints.\n", iface);
+		goto _free_ret;
+	}
+	msg_pdbg("Using interface %d, endpoints 0x%02x/0x%02x.\n",
+		 iface, ch347_data->out_ep, ch347_data->in_ep);
+	ret = 0;
+
+_free_ret:
+	libusb_free_config_descriptor(config);
+	return ret;
+}
+
 /* Largely copied from ch341a_spi.c */
 static int ch347_spi_init(struct flashprog_programmer *const prog)
 {
@@ -277,9 +774,13 @@ static int ch347_spi_init(struct flashprog_programmer *const prog)
 		return 1;
 	}
 
+	struct spi_master mst = spi_master_ch347_spi;
 	unsigned int div = 3; /* Default to 7.5MHz */
 	char *const spispeed = extract_programmer_param("spispeed");
-	if (spispeed) {
+	if (spispeed && !strcmp(spispeed, "auto")) {
+		mst.tune_speed = true;
+		free(spispeed);
+	} else if (spispeed) {
 		char *endptr;
 		const unsigned long khz = strtoul(spispeed, &endptr, 10);
 		if (*endptr != '\0' || endptr == spispeed) {
@@ -299,7 +800,7 @@ static int ch347_spi_init(struct flashprog_programmer *const prog)
 		msg_pdbg("Using default spispeed of %ukHz.\n", ch347_div_to_khz(div));
 	}
 
-	int32_t ret = libusb_init(NULL);
+	int32_t ret = usb_dev_init(NULL);
 	if (ret < 0) {
 		msg_perr("Could not initialize libusb!\n");
 		free(ch347_data);
@@ -313,29 +814,9 @@ static int ch347_spi_init(struct flashprog_programmer *const prog)
 	libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
 #endif
 
-	uint16_t vid = devs_ch347_spi[0].vendor_id;
-	uint16_t pid = devs_ch347_spi[0].device_id;
-	ch347_data->handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
-	if (ch347_data->handle == NULL) {
-		msg_perr("Couldn't open device %04x:%04x.\n", vid, pid);
-		free(ch347_data);
-		return 1;
-	}
-
-	/* TODO: set based on mode */
-	/* Mode 1 uses interface 2 for the SPI interface */
-	int spi_interface = MODE_1_IFACE;
-
-	ret = libusb_detach_kernel_driver(ch347_data->handle, spi_interface);
-	if (ret != 0 && ret != LIBUSB_ERROR_NOT_FOUND)
-		msg_pwarn("Cannot detach the existing USB driver. Claiming the interface may fail. %s\n",
-			libusb_error_name(ret));
-
-	ret = libusb_claim_interface(ch347_data->handle, spi_interface);
-	if (ret != 0) {
-		msg_perr("Failed to claim interface 2: '%s'\n", libusb_error_name(ret));
+	ch347_data->interface = -1;
+	if (ch347_open(ch347_data))
 		goto error_exit;
-	}
 
 	struct libusb_device *dev;
 	if (!(dev = libusb_get_device(ch347_data->handle))) {
@@ -350,6 +831,30 @@ static int ch347_spi_init(struct flashprog_programmer *const prog)
 		goto error_exit;
 	}
 
+	const struct ch347_mode *const mode = ch347_find_mode(desc.idProduct);
+	if (!mode || mode->spi_interface < 0) {
+		msg_perr("CH347 is in %s, which has no vendor SPI interface.\n"
+			 "Please strap it to mode 1 to use it with flashprog.\n",
+			 mode ? mode->name : "an unknown mode");
+		goto error_exit;
+	}
+	msg_pdbg("CH347 is in %s.\n", mode->name);
+
+	if (ch347_find_endpoints(ch347_data, dev, mode->spi_interface))
+		goto error_exit;
+
+	ret = libusb_detach_kernel_driver(ch347_data->handle, mode->spi_interface);
+	if (ret != 0 && ret != LIBUSB_ERROR_NOT_FOUND)
+		msg_pwarn("Cannot detach the existing USB driver. Claiming the interface may fail. %s\n",
+			libusb_error_name(ret));
+
+	ret = libusb_claim_interface(ch347_data->handle, mode->spi_interface);
+	if (ret != 0) {
+		msg_perr("Failed to claim interface %d: '%s'\n", mode->spi_interface, libusb_error_name(ret));
+		goto error_exit;
+	}
+	ch347_data->interface = mode->spi_interface;
+
 	msg_pdbg("Device revision is %d.%01d.%01d\n",
 		(desc.bcdDevice >> 8) & 0x00FF,
 		(desc.bcdDevice >> 4) & 0x000F,
@@ -359,7 +864,8 @@ static int ch347_spi_init(struct flashprog_programmer *const prog)
 	if (ch347_spi_config(ch347_data, div) < 0)
 		goto error_exit;
 
-	return register_spi_master(&spi_master_ch347_spi, 0, ch347_data);
+	mst.clock_hz = ch347_speeds[ARRAY_SIZE(ch347_speeds) - 1 - div];
+	return register_spi_master(&mst, 0, ch347_data);
 
 error_exit:
 	ch347_spi_shutdown(ch347_data);
@@ -371,4 +877,5 @@ const struct programmer_entry programmer_ch347_spi = {
 	.type		= USB,
 	.devs.dev	= devs_ch347_spi,
 	.init		= ch347_spi_init,
+	.multi_instance	= true,
 };
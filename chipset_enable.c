@@ -378,6 +378,39 @@ static int enable_flash_ich_bios_cntl_memmapped(enum ich_chipset ich_generation,
 	return enable_flash_ich_bios_cntl_common(ich_generation, addr, NULL, 0);
 }
 
+/* Returns the size of the contiguous range below 4 GiB enabled in a FWH_DEC_EN1 style register. */
+static int ich_bios_decode_len(const char *const name, const uint16_t dec_en)
+{
+	bool contiguous = 1;
+	int i, max_decode = 0;
+
+	for (i = 7; i >= 0; i--) {
+		int tmp = (dec_en >> (i + 0x8)) & 0x1;
+		msg_pdbg("0x%08x/0x%08x %s decode %sabled\n",
+			 (0x1ff8 + i) * 0x80000,
+			 (0x1ff0 + i) * 0x80000,
+			 name, tmp ? "en" : "dis");
+		if ((tmp == 1) && contiguous) {
+			max_decode = (8 - i) * 0x80000;
+		} else {
+			contiguous = 0;
+		}
+	}
+	for (i = 3; i >= 0; i--) {
+		int tmp = (dec_en >> i) & 0x1;
+		msg_pdbg("0x%08x/0x%08x %s decode %sabled\n",
+			 (0xff4 + i) * 0x100000,
+			 (0xff0 + i) * 0x100000,
+			 name, tmp ? "en" : "dis");
+		if ((tmp == 1) && contiguous) {
+			max_decode = (8 - i) * 0x100000;
+		} else {
+			contiguous = 0;
+		}
+	}
+	return max_decode;
+}
+
 static int enable_flash_ich_fwh_decode(struct flashprog_programmer *prog,
 				       struct pci_dev *dev, enum ich_chipset ich_generation)
 {
@@ -520,36 +553,15 @@ idsel_garbage_out:
 			}
 		}
 	}
-	contiguous = 1;
 	/* FWH_DEC_EN1 */
 	fwh_conf = pci_read_byte(dev, fwh_dec_en_hi);
 	fwh_conf <<= 8;
 	fwh_conf |= pci_read_byte(dev, fwh_dec_en_lo);
-	for (i = 7; i >= 0; i--) {
-		int tmp = (fwh_conf >> (i + 0x8)) & 0x1;
-		msg_pdbg("0x%08x/0x%08x FWH decode %sabled\n",
-			 (0x1ff8 + i) * 0x80000,
-			 (0x1ff0 + i) * 0x80000,
-			 tmp ? "en" : "dis");
-		if ((tmp == 1) && contiguous) {
-			max_decode_fwh_decode = (8 - i) * 0x80000;
-		} else {
-			contiguous = 0;
-		}
-	}
-	for (i = 3; i >= 0; i--) {
-		int tmp = (fwh_conf >> i) & 0x1;
-		msg_pdbg("0x%08x/0x%08x FWH decode %sabled\n",
-			 (0xff4 + i) * 0x100000,
-			 (0xff0 + i) * 0x100000,
-			 tmp ? "en" : "dis");
-		if ((tmp == 1) && contiguous) {
-			max_decode_fwh_decode = (8 - i) * 0x100000;
-		} else {
-			contiguous = 0;
-		}
-	}
+	max_decode_fwh_decode = ich_bios_decode_len("FWH", fwh_conf);
 	internal->max_rom_decode = min(max_decode_fwh_idsel, max_decode_fwh_decode);
+	internal->bios_decode_len = max_decode_fwh_decode;
+	/* The ICH turns aligned dword reads into single multi-byte FWH/LPC cycles. */
+	internal->mmio_read_align = 4;
 	msg_pdbg("Maximum FWH chip size: 0x%zx bytes\n", internal->max_rom_decode);
 
 	return 0;
@@ -589,7 +601,8 @@ static int enable_flash_poulsbo(struct flashprog_programmer *prog, struct pci_de
 }
 
 static enum chipbustype enable_flash_ich_report_gcs(
-		struct pci_dev *const dev, const enum ich_chipset ich_generation, const uint8_t *const rcrb)
+		struct pci_dev *const dev, const enum ich_chipset ich_generation, const uint8_t *const rcrb,
+		bool *const top_swap_enabled)
 {
 	uint32_t gcs;
 	const char *reg_name;
@@ -756,12 +769,16 @@ static enum chipbustype enable_flash_ich_report_gcs(
 	if (ich_generation != CHIPSET_TUNNEL_CREEK && ich_generation != CHIPSET_CENTERTON)
 		msg_pdbg("Top Swap: %s\n", (top_swap) ? "enabled (A16(+) inverted)" : "not enabled");
 
+	*top_swap_enabled = top_swap;
 	return boot_straps[bbs].bus;
 }
 
 static int enable_flash_ich_spi(struct flashprog_programmer *prog, struct pci_dev *dev,
 				enum ich_chipset ich_generation, uint8_t bios_cntl)
 {
+	struct internal_data *const internal = prog->data;
+	bool top_swap;
+
 	/* Get physical address of Root Complex Register Block */
 	uint32_t rcra = pci_read_long(dev, 0xf0) & 0xffffc000;
 	msg_pdbg("Root Complex Register Block address = 0x%x\n", rcra);
@@ -771,7 +788,7 @@ static int enable_flash_ich_spi(struct flashprog_programmer *prog, struct pci_de
 	if (rcrb == ERROR_PTR)
 		return ERROR_FATAL;
 
-	const enum chipbustype boot_buses = enable_flash_ich_report_gcs(dev, ich_generation, rcrb);
+	const enum chipbustype boot_buses = enable_flash_ich_report_gcs(dev, ich_generation, rcrb, &top_swap);
 
 	/* Handle FWH-related parameters and initialization */
 	int ret_fwh = enable_flash_ich_fwh(prog, dev, ich_generation, bios_cntl);
@@ -806,8 +823,8 @@ static int enable_flash_ich_spi(struct flashprog_programmer *prog, struct pci_de
 	msg_pdbg("SPIBAR = 0x%0*" PRIxPTR " + 0x%04x\n", PRIxPTR_WIDTH, (uintptr_t)rcrb, spibar_offset);
 	void *spibar = rcrb + spibar_offset;
 
-	/* This adds BUS_SPI */
-	int ret_spi = ich_init_spi(spibar, ich_generation);
+	/* This adds BUS_SPI, the memory mapping is of no use if top swap is active */
+	int ret_spi = ich_init_spi(spibar, ich_generation, top_swap ? 0 : internal->bios_decode_len);
 	if (ret_spi == ERROR_FATAL)
 		return ret_spi;
 
@@ -938,7 +955,10 @@ static int enable_flash_pch100_or_c620(
 	/* Modify pacc so the rpci_write can register the undo callback with a
 	 * device using the correct pci_access */
 	pacc = pci_acc;
-	const enum chipbustype boot_buses = enable_flash_ich_report_gcs(spi_dev, pch_generation, NULL);
+	bool top_swap;
+	const enum chipbustype boot_buses =
+		enable_flash_ich_report_gcs(spi_dev, pch_generation, NULL, &top_swap);
+	const int bios_decode_len = ich_bios_decode_len("BIOS", pci_read_word(spi_dev, 0xd8));
 
 	const int ret_bc = enable_flash_ich_bios_cntl_config_space(spi_dev, pch_generation, 0xdc);
 	if (ret_bc == ERROR_FATAL)
@@ -950,8 +970,8 @@ static int enable_flash_pch100_or_c620(
 		goto _freepci_ret;
 	msg_pdbg("SPIBAR = 0x%0*" PRIxPTR " (phys = 0x%08x)\n", PRIxPTR_WIDTH, (uintptr_t)spibar, phys_spibar);
 
-	/* This adds BUS_SPI */
-	const int ret_spi = ich_init_spi(spibar, pch_generation);
+	/* This adds BUS_SPI, the memory mapping is of no use if top swap is active */
+	const int ret_spi = ich_init_spi(spibar, pch_generation, top_swap ? 0 : bios_decode_len);
 	if (ret_spi != ERROR_FATAL) {
 		if (ret_bc || ret_spi)
 			ret = ERROR_NONFATAL;
@@ -1023,7 +1043,9 @@ static int enable_flash_glk(struct flashprog_programmer *prog,
  */
 static int enable_flash_silvermont(struct flashprog_programmer *prog, struct pci_dev *dev, const char *name)
 {
+	struct internal_data *const internal = prog->data;
 	enum ich_chipset ich_generation = CHIPSET_BAYTRAIL;
+	bool top_swap;
 
 	/* Get physical address of Root Complex Register Block */
 	uint32_t rcba = pci_read_long(dev, 0xf0) & 0xfffffc00;
@@ -1033,7 +1055,7 @@ static int enable_flash_silvermont(struct flashprog_programmer *prog, struct pci
 	void *rcrb = physmap("BYT RCRB", rcba, 4);
 	if (rcrb == ERROR_PTR)
 		return ERROR_FATAL;
-	const enum chipbustype boot_buses = enable_flash_ich_report_gcs(dev, ich_generation, rcrb);
+	const enum chipbustype boot_buses = enable_flash_ich_report_gcs(dev, ich_generation, rcrb, &top_swap);
 	physunmap(rcrb, 4);
 
 	/* Handle fwh_idsel parameter */
@@ -1055,7 +1077,7 @@ static int enable_flash_silvermont(struct flashprog_programmer *prog, struct pci
 	 */
 	enable_flash_ich_bios_cntl_memmapped(ich_generation, spibar + 0xFC);
 
-	int ret_spi = ich_init_spi(spibar, ich_generation);
+	int ret_spi = ich_init_spi(spibar, ich_generation, top_swap ? 0 : internal->bios_decode_len);
 	if (ret_spi == ERROR_FATAL)
 		return ret_spi;
 
@@ -1389,7 +1411,7 @@ static int enable_flash_sb600(struct flashprog_programmer *prog, struct pci_dev
 
 	internal_buses_supported &= BUS_LPC | BUS_FWH;
 
-	ret = sb600_probe_spi(dev);
+	ret = sb600_probe_spi(prog, dev);
 
 	/* Read ROM strap override register. */
 	OUTB(0x8f, 0xcd6);
@@ -1569,7 +1591,7 @@ static int enable_flash_ck804(struct flashprog_programmer *prog, struct pci_dev
 
 	if (err > 0) {
 		msg_pinfo("%d locks could not be disabled, disabling writes (reads may also fail).\n", err);
-		programmer_may_write = false;
+		prog->may_write = false;
 	}
 
 	reg = 0x88;
@@ -1774,10 +1796,10 @@ static int get_flashbase_sc520(struct flashprog_programmer *prog, struct pci_dev
 	if (bootcs_found) {
 		if (parx & (1 << 25)) {
 			parx &= (1 << 14) - 1; /* Mask [13:0] */
-			flashbase = parx << 16;
+			prog->flashbase = parx << 16;
 		} else {
 			parx &= (1 << 18) - 1; /* Mask [17:0] */
-			flashbase = parx << 12;
+			prog->flashbase = parx << 12;
 		}
 	} else {
 		msg_pinfo("AMD Elan SC520 detected, but no BOOTCS. "
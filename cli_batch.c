@@ -0,0 +1,489 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A batch script runs several operations in one programmer session, so
+ * the programmer is initialized and the chip probed only once. Each line
+ * holds one command, `#` starts a comment:
+ *
+ *   read <file> [<region>...]
+ *   write <file> [<region>...]
+ *   verify <file> [<region>...]
+ *   erase [<region>...]
+ *   hash
+ *   wp status
+ *   wp disable
+ *   wp enable [<start> <length>]
+ *
+ * Regions refer to the layout given on the command line, without any
+ * regions the whole chip is used. Contents read, written or verified by
+ * one command are kept, so later writes don't have to read them again.
+ * The whole script is parsed before the first command runs, and it stops
+ * at the first command that fails.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if HAVE_PTHREAD == 1
+#include <poll.h>
+#endif
+#include "flash.h"
+#include "layout.h"
+#include "sha256.h"
+
+#define BATCH_MAX_ARGS	32
+#define BATCH_LINE_LEN	1024
+
+enum batch_op {
+	BATCH_READ,
+	BATCH_WRITE,
+	BATCH_VERIFY,
+	BATCH_ERASE,
+	BATCH_HASH,
+	BATCH_WP_STATUS,
+	BATCH_WP_DISABLE,
+	BATCH_WP_ENABLE,
+};
+
+static volatile sig_atomic_t cancel_requested;
+
+struct batch_cmd {
+	enum batch_op op;
+	unsigned int line;
+	const char *file;
+	unsigned int first_region;	/* index of the first region in `args` */
+	unsigned int region_count;
+	bool wp_range;
+	size_t wp_start, wp_len;
+	char *args[BATCH_MAX_ARGS];	/* strdup'd words of the line */
+	unsigned int argc;
+};
+
+struct batch {
+	struct flashctx *flash;
+	const struct flashprog_layout *layout;	/* regions from the command line */
+	uint8_t *contents;			/* known flash contents, or NULL */
+	size_t flash_size;
+	struct batch_cmd *cmds;
+	size_t count;
+};
+
+static bool batch_region_exists(const struct flashprog_layout *layout, const char *name)
+{
+	const struct romentry *entry = NULL;
+
+	while ((entry = layout_next(layout, entry))) {
+		if (!strcmp(entry->name, name))
+			return true;
+	}
+	return false;
+}
+
+static int batch_parse_size(const char *str, size_t *value)
+{
+	char *endptr;
+
+	errno = 0;
+	*value = strtoul(str, &endptr, 0);
+	return !*str || *endptr || errno;
+}
+
+static int batch_check_cmd(const struct batch *b, struct batch_cmd *cmd)
+{
+	const char *const name = cmd->args[0];
+	char *const *const args = cmd->args + 1;
+	const unsigned int argc = cmd->argc - 1;
+	unsigned int i;
+
+	if (!strcmp(name, "read") || !strcmp(name, "write") || !strcmp(name, "verify")) {
+		cmd->op = name[0] == 'r' ? BATCH_READ : name[0] == 'w' ? BATCH_WRITE : BATCH_VERIFY;
+		if (!argc)
+			goto _usage;
+		if (!strcmp(args[0], "-")) {
+			msg_gerr("Batch line %u: Standard input/output can't be used in batch scripts.\n",
+				 cmd->line);
+			return 1;
+		}
+		cmd->file = args[0];
+		cmd->first_region = 2;	/* after the command and the file */
+	} else if (!strcmp(name, "erase")) {
+		cmd->op = BATCH_ERASE;
+		cmd->first_region = 1;
+	} else if (!strcmp(name, "hash")) {
+		cmd->op = BATCH_HASH;
+		if (argc)
+			goto _usage;
+		return 0;
+	} else if (!strcmp(name, "wp")) {
+		if (argc == 1 && !strcmp(args[0], "status")) {
+			cmd->op = BATCH_WP_STATUS;
+		} else if (argc == 1 && !strcmp(args[0], "disable")) {
+			cmd->op = BATCH_WP_DISABLE;
+		} else if ((argc == 1 || argc == 3) && !strcmp(args[0], "enable")) {
+			cmd->op = BATCH_WP_ENABLE;
+			cmd->wp_range = argc == 3;
+			if (cmd->wp_range && (batch_parse_size(args[1], &cmd->wp_start) ||
+					      batch_parse_size(args[2], &cmd->wp_len)))
+				goto _usage;
+		} else {
+			goto _usage;
+		}
+		return 0;
+	} else {
+		msg_gerr("Batch line %u: Unknown command `%s'.\n", cmd->line, name);
+		return 1;
+	}
+
+	cmd->region_count = cmd->argc - cmd->first_region;
+	for (i = 0; i < cmd->region_count; ++i) {
+		const char *const region = cmd->args[cmd->first_region + i];
+		if (!b->layout || !batch_region_exists(b->layout, region)) {
+			msg_gerr("Batch line %u: Region `%s' not found in layout.\n", cmd->line, region);
+			return 1;
+		}
+	}
+	return 0;
+
+_usage:
+	msg_gerr("Batch line %u: Invalid arguments for `%s'.\n", cmd->line, name);
+	return 1;
+}
+
+static void batch_free(struct batch *b)
+{
+	size_t i;
+	unsigned int j;
+
+	for (i = 0; i < b->count; ++i) {
+		for (j = 0; j < b->cmds[i].argc; ++j)
+			free(b->cmds[i].args[j]);
+	}
+	free(b->cmds);
+	free(b->contents);
+}
+
+static int batch_load(struct batch *b, FILE *f, const char *name)
+{
+	char line[BATCH_LINE_LEN];
+	unsigned int lineno = 0;
+	size_t capacity = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		struct batch_cmd cmd = { .line = ++lineno };
+		char *word, *saveptr;
+
+		if (!strchr(line, '\n') && !feof(f)) {
+			msg_gerr("Batch line %u: Line too long.\n", lineno);
+			return 1;
+		}
+		line[strcspn(line, "#")] = '\0';
+
+		for (word = strtok_r(line, " \t\r\n", &saveptr); word; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			if (cmd.argc == BATCH_MAX_ARGS) {
+				msg_gerr("Batch line %u: Too many arguments.\n", lineno);
+				goto _free_cmd_ret;
+			}
+			cmd.args[cmd.argc] = strdup(word);
+			if (!cmd.args[cmd.argc]) {
+				msg_gerr("Out of memory!\n");
+				goto _free_cmd_ret;
+			}
+			++cmd.argc;
+		}
+		if (!cmd.argc)
+			continue;
+
+		if (b->count == capacity) {
+			const size_t new_capacity = capacity ? capacity * 2 : 8;
+			struct batch_cmd *const cmds = realloc(b->cmds, new_capacity * sizeof(*cmds));
+			if (!cmds) {
+				msg_gerr("Out of memory!\n");
+				goto _free_cmd_ret;
+			}
+			b->cmds = cmds;
+			capacity = new_capacity;
+		}
+		b->cmds[b->count++] = cmd;
+		if (batch_check_cmd(b, &b->cmds[b->count - 1]))
+			return 1;
+		continue;
+
+_free_cmd_ret:
+		while (cmd.argc)
+			free(cmd.args[--cmd.argc]);
+		return 1;
+	}
+	if (ferror(f)) {
+		msg_gerr("Error: Reading batch script %s failed: %s\n", name, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* A copy of the command line's layout with only the regions of `cmd` included. */
+static int batch_layout(const struct batch *b, const struct batch_cmd *cmd, struct flashprog_layout **layout)
+{
+	const struct romentry *entry = NULL;
+	unsigned int i;
+
+	*layout = NULL;
+	if (!cmd->region_count)
+		return 0;
+
+	if (flashprog_layout_new(layout))
+		return 1;
+	while ((entry = layout_next(b->layout, entry))) {
+		if (flashprog_layout_add_region(*layout, entry->start, entry->end, entry->name))
+			return 1;
+	}
+	for (i = 0; i < cmd->region_count; ++i) {
+		if (flashprog_layout_include_region(*layout, cmd->args[cmd->first_region + i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Remember the contents of `image` in the included regions, or all of them. */
+static void batch_remember(struct batch *b, const struct batch_cmd *cmd, const uint8_t *image)
+{
+	const struct romentry *entry = NULL;
+
+	if (!cmd->region_count) {
+		if (!b->contents)
+			b->contents = malloc(b->flash_size);
+		if (b->contents)
+			memcpy(b->contents, image, b->flash_size);
+		return;
+	}
+	if (!b->contents)
+		return;
+	while ((entry = layout_next_included(get_layout(b->flash), entry)))
+		memcpy(b->contents + entry->start, image + entry->start, entry->end - entry->start + 1);
+}
+
+static void batch_forget(struct batch *b)
+{
+	free(b->contents);
+	b->contents = NULL;
+}
+
+/* Cancel the running script. Can be called from signal handlers. */
+void batch_cancel(void)
+{
+	cancel_requested = 1;
+}
+
+/* Run a chip operation as a job, so it can be cancelled at the next block boundary. */
+static int batch_execute(struct batch *b, enum flashprog_job_type type, void *buffer, const uint8_t *refbuffer)
+{
+#if HAVE_PTHREAD == 1
+	struct flashprog_job *job;
+	bool cancelled = false;
+
+	if (flashprog_job_submit(&job, b->flash, type, buffer, b->flash_size, refbuffer, NULL, NULL))
+		return 1;
+
+	struct pollfd pfd = { .fd = flashprog_job_get_fd(job), .events = POLLIN };
+	while (flashprog_job_poll(job, NULL)) {
+		if (cancel_requested && !cancelled) {
+			flashprog_job_cancel(job);
+			cancelled = true;
+		}
+		poll(&pfd, 1, 100);
+	}
+	return flashprog_job_release(job);
+#else
+	switch (type) {
+	case FLASHPROG_JOB_READ:
+		return flashprog_image_read(b->flash, buffer, b->flash_size);
+	case FLASHPROG_JOB_WRITE:
+		return flashprog_image_write(b->flash, buffer, b->flash_size, refbuffer);
+	case FLASHPROG_JOB_VERIFY:
+		return flashprog_image_verify(b->flash, buffer, b->flash_size);
+	case FLASHPROG_JOB_ERASE:
+		return flashprog_flash_erase(b->flash);
+	default:
+		return 1;
+	}
+#endif
+}
+
+static int batch_wp(struct batch *b, const struct batch_cmd *cmd)
+{
+	static const char *const mode_names[] = { "disabled", "hardware", "power cycle", "permanent" };
+	struct flashprog_wp_cfg *cfg;
+	enum flashprog_wp_result wpret;
+	size_t start, len;
+
+	if (flashprog_wp_cfg_new(&cfg)) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	wpret = flashprog_wp_read_cfg(cfg, b->flash);
+	if (wpret == FLASHPROG_WP_OK && cmd->op != BATCH_WP_STATUS) {
+		flashprog_wp_set_mode(cfg, cmd->op == BATCH_WP_ENABLE ? FLASHPROG_WP_MODE_HARDWARE
+								      : FLASHPROG_WP_MODE_DISABLED);
+		if (cmd->wp_range)
+			flashprog_wp_set_range(cfg, cmd->wp_start, cmd->wp_len);
+		wpret = flashprog_wp_write_cfg(b->flash, cfg);
+	}
+	if (wpret == FLASHPROG_WP_OK) {
+		const enum flashprog_wp_mode mode = flashprog_wp_get_mode(cfg);
+		flashprog_wp_get_range(&start, &len, cfg);
+		msg_ginfo("Protection mode: %s, range: start=0x%08zx length=0x%08zx\n",
+			  mode < ARRAY_SIZE(mode_names) ? mode_names[mode] : "unknown", start, len);
+	} else if (wpret == FLASHPROG_WP_ERR_CHIP_UNSUPPORTED) {
+		msg_gerr("Error: Write protection is not supported for this chip.\n");
+	} else {
+		msg_gerr("Error: %s the write protection failed (error %d).\n",
+			 cmd->op == BATCH_WP_STATUS ? "Reading" : "Changing", wpret);
+	}
+
+	flashprog_wp_cfg_release(cfg);
+	return wpret != FLASHPROG_WP_OK;
+}
+
+static int batch_run_cmd(struct batch *b, const struct batch_cmd *cmd)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	struct image_buf image;
+	int ret;
+
+	switch (cmd->op) {
+	case BATCH_READ:
+		if (image_buf_create(&image, b->flash_size, cmd->file))
+			return 1;
+		ret = batch_execute(b, FLASHPROG_JOB_READ, image.buf, NULL);
+		if (!ret)
+			batch_remember(b, cmd, image.buf);
+		if (image_buf_close(&image, ret == 0))
+			ret = 1;
+		return ret;
+	case BATCH_WRITE:
+		if (image_buf_open(&image, b->flash_size, cmd->file))
+			return 1;
+		if (b->contents)
+			msg_ginfo("Using the flash contents known from earlier commands.\n");
+		ret = batch_execute(b, FLASHPROG_JOB_WRITE, image.buf, b->contents);
+		if (!ret)
+			batch_remember(b, cmd, image.buf);
+		else
+			batch_forget(b);
+		image_buf_close(&image, false);
+		return ret;
+	case BATCH_VERIFY:
+		if (image_buf_open(&image, b->flash_size, cmd->file))
+			return 1;
+		ret = batch_execute(b, FLASHPROG_JOB_VERIFY, image.buf, NULL);
+		if (!ret)
+			batch_remember(b, cmd, image.buf);
+		image_buf_close(&image, false);
+		return ret;
+	case BATCH_ERASE:
+		batch_forget(b);
+		ret = batch_execute(b, FLASHPROG_JOB_ERASE, NULL, NULL);
+		if (ret)
+			emergency_help_message(b->flash);
+		return ret;
+	case BATCH_HASH:
+		ret = flashprog_image_sha256(b->flash, digest);
+		if (!ret)
+			print_sha256(digest);
+		return ret;
+	default:
+		return batch_wp(b, cmd);
+	}
+}
+
+/*
+ * Run the batch script read from `f` on `flash`. `layout` holds the
+ * regions that commands can refer to, it may be NULL. `name` describes
+ * the script in messages.
+ *
+ * Returns 0 on success, or the result of the first command that failed.
+ */
+int batch_run_stream(struct flashctx *flash, const struct flashprog_layout *layout, FILE *f, const char *name)
+{
+	struct batch b = {
+		.flash		= flash,
+		.layout		= layout,
+		.flash_size	= flashprog_flash_getsize(flash),
+	};
+	struct flashprog_layout *cmd_layout;
+	size_t i;
+	int ret = 1;
+
+	if (batch_load(&b, f, name))
+		goto _free_ret;
+
+	for (i = 0; i < b.count; ++i) {
+		const struct batch_cmd *const cmd = &b.cmds[i];
+		unsigned int j;
+
+		if (cancel_requested) {
+			msg_gerr("Batch script cancelled.\n");
+			ret = 1;
+			break;
+		}
+
+		msg_ginfo("Batch line %u:", cmd->line);
+		for (j = 0; j < cmd->argc; ++j)
+			msg_ginfo(" %s", cmd->args[j]);
+		msg_ginfo("\n");
+
+		if (batch_layout(&b, cmd, &cmd_layout)) {
+			flashprog_layout_release(cmd_layout);
+			ret = 1;
+			break;
+		}
+		flashprog_layout_set(flash, cmd_layout);
+		/* Only contents that commands remember explicitly are carried over. */
+		read_cache_clear(flash);
+		ret = layout_sanity_checks(flash, cmd->op == BATCH_WRITE || cmd->op == BATCH_ERASE);
+		if (!ret)
+			ret = batch_run_cmd(&b, cmd);
+		flashprog_layout_set(flash, layout);
+		flashprog_layout_release(cmd_layout);
+		if (ret) {
+			msg_gerr("Batch line %u failed, stopping.\n", cmd->line);
+			break;
+		}
+	}
+
+_free_ret:
+	batch_free(&b);
+	return ret;
+}
+
+/* Run the batch script at `path`, cf. batch_run_stream(). */
+int batch_run(struct flashctx *flash, const struct flashprog_layout *layout, const char *path)
+{
+	char name[256];
+	int ret;
+
+	FILE *const f = fopen(path, "r");
+	if (!f) {
+		msg_gerr("Error: Can't open batch script `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	snprintf(name, sizeof(name), "`%s'", path);
+	ret = batch_run_stream(flash, layout, f, name);
+	fclose(f);
+	return ret;
+}
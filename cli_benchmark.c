@@ -0,0 +1,426 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The benchmark measures what a programmer achieves with the probed chip:
+ * the round-trip time of a single command (RDSR), sequential reads with
+ * different chunk sizes and what a multicommand saves over single com-
+ * mands. If the programmer can switch its SPI clock, this is repeated for
+ * every clock it lists. Page program and block erase times are measured
+ * only on request, in the last erase block of the chip, whose contents
+ * are restored afterwards.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+#include "programmer.h"
+#include "spi.h"
+
+#define BENCH_COMMANDS		100
+#define BENCH_READ_LEN		(256 * KiB)
+#define BENCH_PROGRAM_LEN	(4 * KiB)
+
+static const unsigned int read_chunks[] = { 256, 4 * KiB, 64 * KiB };
+static const unsigned int erase_sizes[] = { 4 * KiB, 64 * KiB };
+
+struct bench_result {
+	unsigned long khz;			/* 0 if unknown */
+	unsigned long long rdsr_ns;		/* per command, 0 if not measured */
+	unsigned long long single_ns;		/* two single commands */
+	unsigned long long multi_ns;		/* the same as one multicommand */
+	unsigned long long read_kibps[ARRAY_SIZE(read_chunks)];
+	unsigned long long program_us;		/* per page */
+	unsigned long long erase_us[ARRAY_SIZE(erase_sizes)];
+};
+
+struct bench_area {
+	unsigned int start, len;		/* what gets backed up and restored */
+	unsigned int page_size;
+	unsigned int erase_addr[ARRAY_SIZE(erase_sizes)];
+	erasefunc_t *erase_fn[ARRAY_SIZE(erase_sizes)];
+};
+
+static unsigned long long elapsed_us(const uint64_t start)
+{
+	const uint64_t us = monotonic_us() - start;
+	return us ? us : 1;
+}
+
+/* Find the last block of `size' bytes of an eraser. Returns false if it has none. */
+static bool last_block(const struct block_eraser *eraser, unsigned int size, unsigned int *addr)
+{
+	unsigned int i, offset = 0;
+	bool found = false;
+
+	for (i = 0; i < NUM_ERASEREGIONS && eraser->eraseblocks[i].count; ++i) {
+		const struct eraseblock *const eb = &eraser->eraseblocks[i];
+		if (eb->size == size) {
+			*addr = offset + (eb->count - 1) * eb->size;
+			found = true;
+		}
+		offset += eb->size * eb->count;
+	}
+	return found;
+}
+
+/* Check if an eraser has a block of `size' bytes at `addr'. */
+static bool has_block(const struct block_eraser *eraser, unsigned int size, unsigned int addr)
+{
+	unsigned int i, offset = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS && eraser->eraseblocks[i].count; ++i) {
+		const struct eraseblock *const eb = &eraser->eraseblocks[i];
+		const unsigned int end = offset + eb->size * eb->count;
+		if (eb->size == size && addr >= offset && addr < end && (addr - offset) % size == 0)
+			return true;
+		offset = end;
+	}
+	return false;
+}
+
+/*
+ * Pick the last 64 KiB block of the chip, or the last 4 KiB block if there
+ * is none. A 4 KiB erase is only measured inside of the 64 KiB block, so
+ * a single backup covers everything. Returns false if no erase fits.
+ */
+static bool bench_pick_area(const struct flashctx *flash, struct bench_area *area)
+{
+	const struct flashchip *const chip = flash->chip;
+	unsigned int i, k;
+
+	memset(area, 0, sizeof(*area));
+	for (i = ARRAY_SIZE(erase_sizes); i > 0; --i) {
+		for (k = 0; k < NUM_ERASEFUNCTIONS; ++k) {
+			const struct block_eraser *const eraser = &chip->block_erasers[k];
+			if (!eraser->block_erase)
+				continue;
+			if (area->len) {
+				if (!has_block(eraser, erase_sizes[i - 1], area->start))
+					continue;
+			} else {
+				if (!last_block(eraser, erase_sizes[i - 1], &area->start))
+					continue;
+				area->len = erase_sizes[i - 1];
+			}
+			area->erase_addr[i - 1] = area->start;
+			area->erase_fn[i - 1] = eraser->block_erase;
+			break;
+		}
+	}
+	area->page_size = chip->page_size ? chip->page_size : 256;
+	return area->len && chip->write;
+}
+
+static int bench_commands(struct flashctx *flash, struct bench_result *res)
+{
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	unsigned char status[2];
+	struct spi_command cmds[] = {
+		{ .writecnt = 1, .writearr = rdsr, .readcnt = 1, .readarr = &status[0] },
+		{ .writecnt = 1, .writearr = rdsr, .readcnt = 1, .readarr = &status[1] },
+		NULL_SPI_CMD,
+	};
+	uint64_t start;
+	unsigned int i;
+
+	start = monotonic_us();
+	for (i = 0; i < BENCH_COMMANDS; ++i) {
+		if (spi_send_command(flash, sizeof(rdsr), 1, rdsr, status))
+			return 1;
+	}
+	res->rdsr_ns = elapsed_us(start) * 1000 / BENCH_COMMANDS;
+
+	start = monotonic_us();
+	for (i = 0; i < BENCH_COMMANDS; ++i) {
+		if (spi_send_command(flash, sizeof(rdsr), 1, rdsr, &status[0]) ||
+		    spi_send_command(flash, sizeof(rdsr), 1, rdsr, &status[1]))
+			return 1;
+	}
+	res->single_ns = elapsed_us(start) * 1000 / BENCH_COMMANDS;
+
+	start = monotonic_us();
+	for (i = 0; i < BENCH_COMMANDS; ++i) {
+		if (spi_send_multicommand(flash, cmds))
+			return 1;
+	}
+	res->multi_ns = elapsed_us(start) * 1000 / BENCH_COMMANDS;
+	return 0;
+}
+
+/* Read sequentially from the start of the chip, bypassing the read cache. */
+static int bench_reads(struct flashctx *flash, uint8_t *buf, struct bench_result *res)
+{
+	const unsigned int len = min(BENCH_READ_LEN, flash->chip->total_size * KiB);
+	unsigned int i, offset;
+
+	for (i = 0; i < ARRAY_SIZE(read_chunks); ++i) {
+		const unsigned int chunk = min(read_chunks[i], len);
+		const uint64_t start = monotonic_us();
+		for (offset = 0; offset < len; offset += chunk) {
+			if (flash->chip->read(flash, buf + offset, offset, min(chunk, len - offset)))
+				return 1;
+		}
+		res->read_kibps[i] = (unsigned long long)len * 1000000 / KiB / elapsed_us(start);
+	}
+	return 0;
+}
+
+/* Erase the area, program pages at its start, then erase the first 4 KiB block again. */
+static int bench_destructive(struct flashctx *flash, const struct bench_area *area,
+			     const uint8_t *pattern, struct bench_result *res)
+{
+	const unsigned int pages = max(min(BENCH_PROGRAM_LEN, area->len) / area->page_size, 1);
+	const unsigned int large = ARRAY_SIZE(erase_sizes) - 1;
+	uint64_t start;
+	unsigned int i;
+
+	if (area->erase_fn[large]) {
+		start = monotonic_us();
+		if (area->erase_fn[large](flash, area->erase_addr[large], erase_sizes[large]))
+			return 1;
+		res->erase_us[large] = elapsed_us(start);
+	} else if (area->erase_fn[0](flash, area->erase_addr[0], erase_sizes[0])) {
+		return 1;
+	}
+
+	start = monotonic_us();
+	for (i = 0; i < pages; ++i) {
+		const unsigned int offset = i * area->page_size;
+		if (flash->chip->write(flash, pattern + offset, area->start + offset,
+				       min(area->page_size, area->len - offset)))
+			return 1;
+	}
+	res->program_us = elapsed_us(start) / pages;
+
+	if (area->erase_fn[0]) {
+		start = monotonic_us();
+		if (area->erase_fn[0](flash, area->erase_addr[0], erase_sizes[0]))
+			return 1;
+		res->erase_us[0] = elapsed_us(start);
+	}
+	return 0;
+}
+
+static bool page_is_erased(const struct flashctx *flash, const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; ++i) {
+		if (buf[i] != ERASED_VALUE(flash))
+			return false;
+	}
+	return true;
+}
+
+/* Erase the area and write the backup back, skipping erased pages. */
+static int bench_restore(struct flashctx *flash, const struct bench_area *area, const uint8_t *backup)
+{
+	const unsigned int large = ARRAY_SIZE(erase_sizes) - 1;
+	const unsigned int size = area->erase_fn[large] ? erase_sizes[large] : erase_sizes[0];
+	erasefunc_t *const erase = area->erase_fn[large] ? area->erase_fn[large] : area->erase_fn[0];
+	unsigned int offset;
+
+	if (erase(flash, area->start, size))
+		return 1;
+	for (offset = 0; offset < area->len; offset += area->page_size) {
+		const unsigned int len = min(area->page_size, area->len - offset);
+		if (page_is_erased(flash, backup + offset, len))
+			continue;
+		if (flash->chip->write(flash, backup + offset, area->start + offset, len))
+			return 1;
+	}
+	return 0;
+}
+
+static void print_value(unsigned long long value)
+{
+	if (value)
+		msg_ginfo(" %10llu", value);
+	else
+		msg_ginfo(" %10s", "-");
+}
+
+static void print_results(const struct flashctx *flash, const struct bench_result *res, size_t count,
+			  const struct bench_area *area)
+{
+	static const char *const columns[] = {
+		"RDSR", "2x single", "multicmd", "Read 256", "Read 4K", "Read 64K",
+		"Prog/page", "Erase 4K", "Erase 64K",
+	};
+	static const char *const units[] = {
+		"ns", "ns", "ns", "KiB/s", "KiB/s", "KiB/s", "us", "us", "us",
+	};
+	size_t i, j;
+
+	msg_ginfo("\n%8s", "Clock");
+	for (j = 0; j < ARRAY_SIZE(columns); ++j)
+		msg_ginfo(" %10s", columns[j]);
+	msg_ginfo("\n%8s", "kHz");
+	for (j = 0; j < ARRAY_SIZE(units); ++j)
+		msg_ginfo(" %10s", units[j]);
+	msg_ginfo("\n");
+
+	for (i = 0; i < count; ++i) {
+		if (res[i].khz)
+			msg_ginfo("%8lu", res[i].khz);
+		else
+			msg_ginfo("%8s", "-");
+		print_value(res[i].rdsr_ns);
+		print_value(res[i].single_ns);
+		print_value(res[i].multi_ns);
+		for (j = 0; j < ARRAY_SIZE(read_chunks); ++j)
+			print_value(res[i].read_kibps[j]);
+		print_value(res[i].program_us);
+		for (j = 0; j < ARRAY_SIZE(erase_sizes); ++j)
+			print_value(res[i].erase_us[j]);
+		msg_ginfo("\n");
+	}
+
+	printf("{\"chip\": \"%s %s\", \"page_size\": %u, \"results\": [",
+	       flash->chip->vendor, flash->chip->name, area->page_size);
+	for (i = 0; i < count; ++i) {
+		printf("%s{\"khz\": %lu, \"rdsr_ns\": %llu, \"single_ns\": %llu, \"multicommand_ns\": %llu, "
+		       "\"read_kibps\": {", i ? ", " : "", res[i].khz, res[i].rdsr_ns, res[i].single_ns,
+		       res[i].multi_ns);
+		for (j = 0; j < ARRAY_SIZE(read_chunks); ++j)
+			printf("%s\"%u\": %llu", j ? ", " : "", read_chunks[j], res[i].read_kibps[j]);
+		printf("}, \"program_page_us\": %llu, \"erase_us\": {", res[i].program_us);
+		for (j = 0; j < ARRAY_SIZE(erase_sizes); ++j)
+			printf("%s\"%u\": %llu", j ? ", " : "", erase_sizes[j], res[i].erase_us[j]);
+		printf("}}");
+	}
+	printf("]}\n");
+}
+
+/*
+ * Run the benchmark for every SPI clock the programmer lists, or once at
+ * its current clock. Only with `destructive', chip contents are touched.
+ * Values that weren't measured are reported as zero.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int benchmark_run(struct flashctx *flash, bool destructive)
+{
+	const unsigned int flash_size = flash->chip->total_size * KiB;
+	const bool spi = flash->chip->bustype == BUS_SPI;
+	struct spi_master *const mst = spi ? flash->mst.spi : NULL;
+	const unsigned long *speeds = NULL;
+	struct bench_result *res = NULL;
+	uint8_t *buf = NULL, *backup = NULL;
+	struct bench_area area;
+	size_t count = 0, i;
+	int ret = 1;
+
+	if (!flash->chip->read) {
+		msg_gerr("Error: The chip can't be read, nothing to measure.\n");
+		return 1;
+	}
+	const bool have_area = bench_pick_area(flash, &area);
+	if (destructive && !have_area) {
+		msg_gerr("Error: No 4 KiB or 64 KiB erase block to measure on this chip.\n");
+		return 1;
+	}
+
+	if (mst && mst->list_speeds && mst->set_speed)
+		count = mst->list_speeds(flash, &speeds);
+	const size_t runs = count ? count : 1;
+
+	res = calloc(runs, sizeof(*res));
+	buf = malloc(max(BENCH_READ_LEN, BENCH_PROGRAM_LEN));
+	backup = destructive ? malloc(area.len) : NULL;
+	if (!res || !buf || (destructive && !backup)) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+
+	if (prepare_flash_access(flash, true, destructive, destructive, false))
+		goto _free_ret;
+
+	if (destructive) {
+		msg_ginfo("Backing up 0x%06x..0x%06x... ", area.start, area.start + area.len - 1);
+		if (flashprog_read_range(flash, backup, area.start, area.len)) {
+			msg_ginfo("FAILED.\n");
+			goto _finalize_ret;
+		}
+		msg_ginfo("done.\n");
+	}
+
+	const unsigned long prev_hz = mst ? mst->clock_hz : 0;
+	for (i = 0; i < runs; ++i) {
+		if (count) {
+			res[i].khz = speeds[i] / 1000;
+			if (mst->set_speed(flash, speeds[i])) {
+				msg_gwarn("Can't switch to %lu kHz, skipping it.\n", res[i].khz);
+				continue;
+			}
+			mst->clock_hz = speeds[i];
+			msg_ginfo("Measuring at %lu kHz... ", res[i].khz);
+		} else {
+			res[i].khz = mst ? mst->clock_hz / 1000 : 0;
+			msg_ginfo("Measuring... ");
+		}
+
+		if ((spi && bench_commands(flash, &res[i])) || bench_reads(flash, buf, &res[i])) {
+			msg_ginfo("FAILED.\n");
+			break;
+		}
+		if (destructive) {
+			memset(buf, 0x5a, BENCH_PROGRAM_LEN);
+			if (bench_destructive(flash, &area, buf, &res[i])) {
+				msg_ginfo("FAILED.\n");
+				break;
+			}
+		}
+		msg_ginfo("done.\n");
+	}
+	const size_t done = i;
+
+	/* Without a known previous clock, fall back to the slowest one. */
+	if (count) {
+		const unsigned long hz = prev_hz ? prev_hz : speeds[0];
+		if (!mst->set_speed(flash, hz))
+			mst->clock_hz = hz;
+	}
+
+	if (destructive) {
+		msg_ginfo("Restoring 0x%06x..0x%06x... ", area.start, area.start + area.len - 1);
+		if (bench_restore(flash, &area, backup)) {
+			msg_ginfo("FAILED.\n");
+			emergency_help_message(flash);
+			read_cache_clear(flash);
+			goto _finalize_ret;
+		}
+		msg_ginfo("done.\n");
+		read_cache_clear(flash);
+	}
+
+	if (done) {
+		if (flash_size < BENCH_READ_LEN)
+			msg_ginfo("Reads cover the whole chip of %u bytes.\n", flash_size);
+		print_results(flash, res, done, &area);
+	}
+	ret = done < runs;
+
+_finalize_ret:
+	finalize_flash_access(flash);
+_free_ret:
+	free(backup);
+	free(buf);
+	free(res);
+	return ret;
+}
@@ -21,14 +21,22 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <getopt.h>
+#if !IS_WINDOWS
+#include <sys/resource.h>
+#endif
+#if HAVE_PTHREAD == 1
+#include <pthread.h>
+#endif
 #include "flash.h"
 #include "flashchips.h"
 #include "fmap.h"
 #include "programmer.h"
 #include "libflashprog.h"
+#include "sha256.h"
 
 static void cli_classic_usage(const char *name)
 {
@@ -38,24 +46,46 @@ static void cli_classic_usage(const char *name)
 #endif
 	       "\n\t-p <programmername>[:<parameters>] [-c <chipname>]\n"
 	       "\t\t(--flash-name|--flash-size|\n"
-	       "\t\t [-E|(-r|-w|-v) <file>]\n"
+	       "\t\t [-E|(-r|-w|-v|--patch|--batch|--spi-replay) <file>|\n"
+	       "\t\t  --benchmark [--allow-destructive]]\n"
 	       "\t\t [(-l <layoutfile>|--ifd| --fmap|--fmap-file <file>) [-i <imagename>]...]\n"
-	       "\t\t [-n] [-N] [-f])]\n"
-	       "\t[-V[V[V]]] [-o <logfile>]\n\n", name);
+	       "\t\t [-n] [-N] [--verify-inline] [--checked-read] [-f] [--erase-check <policy>]\n"
+	       "\t\t [--manifest <file>] [--journal <file> [--resume]] [--streaming]\n"
+	       "\t\t [--dry-run] [--chip-selects <n>] [--probe-cache <file>]\n"
+	       "\t\t [--sampled <n> [--sample-cursor <file>]]\n"
+	       "\t\t [--sfdp-overlay] [--hash sha256] [--stats[=json]] [--spi-trace <file>])]\n"
+	       "\t[-V[V[V]]] [-o <logfile>] [--log-json <file>] [--realtime]\n\n", name);
 
 	printf(" -h | --help                        print this help text\n"
 	       " -R | --version                     print version (release)\n"
-	       " -r | --read <file>                 read flash and save to <file>\n"
+	       " -r | --read (<file>|-)             read flash and save to <file>\n"
+	       "                                    or write it to the standard output\n"
 	       " -w | --write (<file>|-)            write <file> or the content provided\n"
 	       "                                    on the standard input to flash\n"
 	       " -v | --verify (<file>|-)           verify flash against <file>\n"
 	       "                                    or the content provided on the standard input\n"
 	       " -E | --erase                       erase flash memory\n"
+	       "      --patch <file>                write only the extents of patch <file>\n"
+	       "      --batch <file>                run the operations listed in <file>\n"
+#if HAVE_PTHREAD == 1
+	       "      --serve <socket>              run batch jobs sent to <socket>\n"
+#endif
+#if HAVE_USBDEV == 1
+	       "      --hotplug                     run --batch for every USB programmer plugged in\n"
+#endif
+	       "      --benchmark                   measure programmer performance with the chip\n"
+	       "      --allow-destructive           also measure program and erase times, this\n"
+	       "                                    temporarily modifies the last erase block\n"
 	       " -V | --verbose                     more verbose output\n"
 	       " -c | --chip <chipname>             probe only for specified flash chip\n"
 	       " -f | --force                       force specific operations (see man page)\n"
 	       " -n | --noverify                    don't auto-verify\n"
 	       " -N | --noverify-all                verify included regions only (cf. -i)\n"
+	       "      --verify-inline               verify every write right away\n"
+	       "      --checked-read                check every chunk read and read it again on mismatch\n"
+	       "      --dry-run                     only print what -w would erase and write\n"
+	       "      --erase-check <policy>        check erased blocks: `full' (default),\n"
+	       "                                    `sampled' or `none'\n"
 	       " -l | --layout <layoutfile>         read ROM layout from <layoutfile>\n"
 	       "      --flash-name                  read out the detected flash name\n"
 	       "      --flash-size                  read out the detected flash size\n"
@@ -65,20 +95,39 @@ static void cli_classic_usage(const char *name)
 	       " -i | --include <region>            only read/write image <region> from layout\n"
 	       "      --image <region>              deprecated, please use --include\n"
 	       " -o | --output <logfile>            log output to <logfile>\n"
+	       "      --log-json <file>             log messages and block operations as JSON lines\n"
 	       "      --flash-contents <ref-file>   assume flash contents to be <ref-file>\n"
+	       "      --manifest <file>             skip reading blocks recorded unchanged in <file>\n"
+	       "      --journal <file>              record completed erases and writes in <file>\n"
+	       "      --resume                      resume the interrupted write of the journal\n"
+	       "      --streaming                   write block by block, without reading first\n"
+	       "      --chip-selects <n>            write to the first <n> chips on the programmer\n"
+	       "      --probe-cache <file>          probe for the chip recorded in <file> first\n"
+	       "      --sfdp-overlay                complete chip parameters with its SFDP data\n"
+	       "      --sampled <n>                 only read back every <n>th erase block with -v\n"
+	       "      --sample-cursor <file>        rotate the sampled blocks across runs in <file>\n"
+	       "      --hash sha256                 print the SHA-256 of the flash contents,\n"
+	       "                                    alone or with -r or -v\n"
+	       "      --stats[=json]                print performance counters after the operation\n"
+	       "      --spi-trace <file>            record all SPI commands to <file>\n"
+	       "      --spi-replay <file>           send the SPI commands recorded in <file>\n"
+	       "                                    to the dummy programmer\n"
 	       " -L | --list-supported              print supported devices\n"
 #if CONFIG_PRINT_WIKI == 1
 	       " -z | --list-supported-wiki         print supported devices in wiki syntax\n"
 #endif
 	       "      --progress                    show progress percentage on the standard output\n"
+	       "      --realtime                    use real-time priority, pin to a CPU and lock memory\n"
 	       " -p | --programmer <name>[:<param>] specify the programmer device. One of\n");
 	list_programmers_linebreak(4, 80, 0);
 	printf(".\n\nYou can specify one of -h, -R, -L, "
 #if CONFIG_PRINT_WIKI == 1
 	         "-z, "
 #endif
-	         "-E, -r, -w, -v or no operation.\n"
-	       "If no operation is specified, flashprog will only probe for flash chips.\n");
+	         "-E, -r, -w, -v, --patch, --batch, --serve or no operation.\n"
+	       "If no operation is specified, flashprog will only probe for flash chips.\n"
+	       "With -w, -p can be given more than once to write the image to every programmer,\n"
+	       "concurrently if all drivers allow it, otherwise one after another.\n");
 }
 
 static void cli_classic_abort_usage(const char *msg)
@@ -118,78 +167,430 @@ static bool check_file(FILE *file)
 	return true;
 }
 
-static int do_read(struct flashctx *const flash, const char *const filename)
+struct stream_out {
+	struct image_stream *stream;
+	size_t offset;
+	uint8_t *buf;			/* if set, chunks are copied here instead of to `stream` */
+	struct sha256_ctx *hash;	/* if set, chunks are hashed too */
+};
+
+/* Fill unread parts of the image with zeros, like an unused part of a read buffer. */
+static int stream_out_pad(struct stream_out *const out, const size_t offset)
+{
+	static const uint8_t zeros[4096];
+
+	while (out->offset < offset) {
+		const size_t len = min(offset - out->offset, sizeof(zeros));
+		if (image_stream_write(out->stream, zeros, len))
+			return 1;
+		out->offset += len;
+	}
+	return 0;
+}
+
+static int stream_out_sink(const void *const data, const size_t offset, const size_t len, void *const user_data)
+{
+	struct stream_out *const out = user_data;
+
+	if (out->hash)
+		sha256_update(out->hash, data, len);
+	if (out->buf) {
+		memcpy(out->buf + offset, data, len);
+		return 0;
+	}
+	if (stream_out_pad(out, offset) || image_stream_write(out->stream, data, len))
+		return 1;
+	out->offset += len;
+	return 0;
+}
+
+/* Store the chunks as they arrive, for stdout and compressed images. */
+static int do_read_to_stream(struct flashctx *const flash, const char *const filename,
+			     struct sha256_ctx *const hash)
 {
+	struct stream_out out = { .offset = 0, .hash = hash };
 	int ret;
 
-	unsigned long size = flashprog_flash_getsize(flash);
-	unsigned char *buf = calloc(size, sizeof(unsigned char));
-	if (!buf) {
-		msg_gerr("Memory allocation failed!\n");
+	out.stream = image_stream_create(filename);
+	if (!out.stream)
 		return 1;
+
+	ret = flashprog_image_read_stream(flash, stream_out_sink, &out);
+	if (!ret && stream_out_pad(&out, flashprog_flash_getsize(flash)))
+		ret = 1;
+	if (image_stream_close(out.stream, ret == 0))
+		ret = 1;
+	return ret;
+}
+
+static int do_read(struct flashctx *const flash, const char *const filename, const bool hash)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	struct sha256_ctx hash_ctx;
+	struct image_buf image;
+	int ret;
+
+	sha256_init(&hash_ctx);
+
+	if (!strcmp(filename, "-") || image_name_compressed(filename)) {
+		ret = do_read_to_stream(flash, filename, hash ? &hash_ctx : NULL);
+		goto _hash_ret;
 	}
 
-	ret = flashprog_image_read(flash, buf, size);
-	if (ret > 0)
-		goto free_out;
+	if (image_buf_create(&image, flashprog_flash_getsize(flash), filename))
+		return 1;
 
-	ret = write_buf_to_file(buf, size, filename);
+	if (hash) {
+		/* Hash the chunks in the same pass, instead of the buffer afterwards. */
+		struct stream_out out = { .buf = image.buf, .hash = &hash_ctx };
+		ret = flashprog_image_read_stream(flash, stream_out_sink, &out);
+	} else {
+		ret = flashprog_image_read(flash, image.buf, image.size);
+	}
 
-free_out:
-	free(buf);
+	if (image_buf_close(&image, ret == 0))
+		ret = 1;
+_hash_ret:
+	if (hash && !ret) {
+		sha256_final(&hash_ctx, digest);
+		print_sha256(digest);
+	}
 	return ret;
 }
 
-static int do_write(struct flashctx *const flash, const char *const filename, const char *const referencefile)
+/* Print what a write of `newcontents` would do, without writing. */
+static int do_plan(struct flashctx *const flash, const uint8_t *const newcontents,
+		   const uint8_t *const refcontents)
+{
+	struct flashprog_plan *plan;
+	size_t i, erases = 0;
+
+	const int ret = flashprog_image_plan(flash, newcontents, flashprog_flash_getsize(flash),
+					     refcontents, &plan);
+	if (ret)
+		return ret;
+
+	msg_ginfo("Planned operations:\n");
+	for (i = 0; i < plan->count; ++i) {
+		const struct flashprog_event *const op = &plan->ops[i];
+		erases += op->id == FLASHPROG_EVENT_ERASE_BLOCK;
+		msg_ginfo("  %-11s 0x%06zx-0x%06zx\n", flashprog_event_name(op->id),
+			  op->start, op->start + op->len - 1);
+	}
+	if (!plan->count)
+		msg_ginfo("  none, chip content is identical to the requested image.\n");
+	msg_ginfo("%zu erases of %llu bytes and %zu writes of %llu bytes, estimated to take %llu.%03llus.\n",
+		  erases, plan->erase_bytes, plan->count - erases, plan->write_bytes,
+		  plan->estimated_us / 1000000, plan->estimated_us / 1000 % 1000);
+
+	flashprog_plan_release(plan);
+	return 0;
+}
+
+#if HAVE_PTHREAD == 1
+/*
+ * Loads (e.g. decompresses) the image in a thread, while the chip is
+ * already read, or with --streaming written block by block as soon as
+ * the image data for the block is there.
+ */
+struct image_loader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct image_buf *image;
+	unsigned long loaded;
+	bool done;
+	int ret;
+};
+
+static void image_loader_progress(const unsigned long loaded, void *const arg)
+{
+	struct image_loader *const loader = arg;
+
+	pthread_mutex_lock(&loader->lock);
+	loader->loaded = loaded;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+static void *image_loader_thread(void *const arg)
+{
+	struct image_loader *const loader = arg;
+	const int ret = read_buf_from_file_progress(loader->image->buf, loader->image->size,
+						    loader->image->filename, image_loader_progress, loader);
+
+	pthread_mutex_lock(&loader->lock);
+	loader->ret = ret;
+	loader->done = true;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+	return NULL;
+}
+
+/* The whole image is only there when the file was read successfully to its end. */
+static int image_loader_wait(const size_t len, void *const arg)
+{
+	struct image_loader *const loader = arg;
+	int ret;
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->done && (loader->loaded < len || len >= loader->image->size))
+		pthread_cond_wait(&loader->cond, &loader->lock);
+	ret = loader->done ? loader->ret : 0;
+	pthread_mutex_unlock(&loader->lock);
+	return ret;
+}
+
+static int write_loading(struct flashctx *const flash, struct image_buf *const image)
+{
+	struct image_loader loader = { .image = image };
+	int ret;
+
+	pthread_mutex_init(&loader.lock, NULL);
+	pthread_cond_init(&loader.cond, NULL);
+	if (pthread_create(&loader.thread, NULL, image_loader_thread, &loader)) {
+		ret = read_buf_from_file(image->buf, image->size, image->filename) ||
+		      flashprog_image_write(flash, image->buf, image->size, NULL) ? 1 : 0;
+		goto _destroy_ret;
+	}
+
+	ret = flashprog_image_write_loading(flash, image->buf, image->size, image_loader_wait, &loader);
+	pthread_join(loader.thread, NULL);
+	if (loader.ret)
+		ret = 1;
+
+_destroy_ret:
+	pthread_cond_destroy(&loader.cond);
+	pthread_mutex_destroy(&loader.lock);
+	return ret;
+}
+#endif
+
+static int do_write(struct flashctx *const flash, const char *const filename, const char *const referencefile,
+		    const char *const manifest, const char *const journal, const bool resume,
+		    const struct manifest_id *const id, const bool dry_run)
 {
 	const size_t flash_size = flashprog_flash_getsize(flash);
+	struct image_buf newimage, refimage = { 0 };
+	uint8_t *refcontents = NULL;
+	bool resumed = false;
 	int ret = 1;
 
-	uint8_t *const newcontents = malloc(flash_size);
-	uint8_t *const refcontents = referencefile ? malloc(flash_size) : NULL;
-
-	if (!newcontents || (referencefile && !refcontents)) {
-		msg_gerr("Out of memory!\n");
-		goto _free_ret;
+#if HAVE_PTHREAD == 1
+	/* Everything else needs the complete image before it starts. */
+	if (!referencefile && !manifest && !journal && !dry_run) {
+		if (image_buf_alloc(&newimage, flash_size, filename))
+			return 1;
+		ret = newimage.mapped ? flashprog_image_write(flash, newimage.buf, flash_size, NULL)
+				      : write_loading(flash, &newimage);
+		image_buf_close(&newimage, false);
+		return ret;
 	}
+#endif
 
-	if (read_buf_from_file(newcontents, flash_size, filename))
-		goto _free_ret;
+	if (image_buf_open(&newimage, flash_size, filename))
+		return 1;
+	uint8_t *const newcontents = newimage.buf;
 
 	if (referencefile) {
-		if (read_buf_from_file(refcontents, flash_size, referencefile))
+		if (image_buf_open(&refimage, flash_size, referencefile))
+			goto _free_ret;
+		refcontents = refimage.buf;
+	} else if (resume) {
+		refcontents = malloc(flash_size);
+		if (!refcontents) {
+			msg_gerr("Out of memory!\n");
 			goto _free_ret;
+		}
+		if (journal_prepare(flash, journal, id, newcontents, refcontents, &resumed))
+			goto _free_ret;
+	} else if (manifest) {
+		refcontents = malloc(flash_size);
+		if (!refcontents) {
+			msg_gerr("Out of memory!\n");
+			goto _free_ret;
+		}
+		if (manifest_prepare(flash, manifest, id, newcontents, refcontents))
+			goto _free_ret;
+	}
+
+	if (dry_run) {
+		ret = do_plan(flash, newcontents, refcontents);
+		goto _free_ret;
+	}
+
+	if (journal && journal_start(flash, journal, id, newcontents, resumed)) {
+		ret = 1;
+		goto _free_ret;
 	}
 
 	ret = flashprog_image_write(flash, newcontents, flash_size, refcontents);
 
+	if (journal)
+		journal_finish(flash, journal, ret == 0);
+
+	if (manifest) {
+		/* A failed write leaves us without knowledge of the flash contents. */
+		if (ret)
+			manifest_invalidate(manifest);
+		else
+			ret = manifest_store(flash, manifest, id, refcontents, newcontents);
+	}
+
 _free_ret:
-	free(refcontents);
-	free(newcontents);
+	if (referencefile)
+		image_buf_close(&refimage, false);
+	else
+		free(refcontents);
+	image_buf_close(&newimage, false);
 	return ret;
 }
 
-static int do_verify(struct flashctx *const flash, const char *const filename)
+/*
+ * Write the extents of a patch, if the chip holds its base image. If a
+ * manifest records the base image, the chip is checked against that,
+ * otherwise its contents are hashed. With --force, the check is skipped.
+ */
+static int do_patch(struct flashctx *const flash, const char *const patchfile, const char *const manifest,
+		    const struct manifest_id *const id, const bool force)
 {
-	const size_t flash_size = flashprog_flash_getsize(flash);
+	unsigned char digest[SHA256_DIGEST_LEN];
+	bool base_checked = true;
+	struct patch patch;
 	int ret = 1;
 
-	uint8_t *const newcontents = malloc(flash_size);
-	if (!newcontents) {
-		msg_gerr("Out of memory!\n");
+	if (patch_load(&patch, patchfile))
+		return 1;
+	if (patch.size != flashprog_flash_getsize(flash)) {
+		msg_gerr("Error: Patch image size (%zu B) doesn't match the flash chip's size (%zu B)!\n",
+			 patch.size, flashprog_flash_getsize(flash));
 		goto _free_ret;
 	}
 
-	if (read_buf_from_file(newcontents, flash_size, filename))
-		goto _free_ret;
+	if (manifest && !manifest_confirm_base(flash, manifest, id, patch.base)) {
+		msg_ginfo("Manifest confirms the base image of the patch.\n");
+	} else if (force) {
+		msg_gwarn("Not checking the base image of the patch because user forced us to.\n");
+		base_checked = false;
+	} else {
+		msg_ginfo("Hashing flash contents to check the base image of the patch.\n");
+		if (flashprog_image_sha256(flash, digest))
+			goto _free_ret;
+		if (memcmp(digest, patch.base, SHA256_DIGEST_LEN)) {
+			msg_gerr("Error: Flash contents are not the base image of the patch.\n"
+				 "Use --force/-f to apply it anyway.\n");
+			goto _free_ret;
+		}
+	}
+
+	msg_ginfo("Writing %zu extent%s of patch `%s'.\n", patch.count, patch.count == 1 ? "" : "s", patchfile);
+	ret = flashprog_image_write_extents(flash, patch.extents, patch.count);
 
-	ret = flashprog_image_verify(flash, newcontents, flash_size);
+	if (manifest) {
+		/* A failed write or an unknown base leaves us without knowledge of the flash contents. */
+		if (ret || !base_checked)
+			manifest_invalidate(manifest);
+		else
+			ret = manifest_store_patch(flash, manifest, id, patch.extents, patch.count, patch.result);
+	}
 
 _free_ret:
-	free(newcontents);
+	patch_free(&patch);
+	return ret;
+}
+
+/*
+ * The sample cursor records which of the sampled blocks to read back
+ * next, so consecutive runs with --sampled cover the whole chip.
+ */
+#define SAMPLE_CURSOR_MAGIC	"# flashprog sample cursor 1"
+
+static unsigned int sample_cursor_load(const char *const path)
+{
+	unsigned int cursor = 0;
+	char line[256];
+
+	FILE *const f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, SAMPLE_CURSOR_MAGIC "\n") ||
+	    !fgets(line, sizeof(line), f) || sscanf(line, "cursor: %u", &cursor) != 1)
+		cursor = 0;
+
+	fclose(f);
+	return cursor;
+}
+
+static void sample_cursor_store(const char *const path, const unsigned int cursor)
+{
+	FILE *const f = fopen(path, "w");
+	if (!f) {
+		msg_gwarn("Warning: Can't write sample cursor `%s': %s\n", path, strerror(errno));
+		return;
+	}
+	fprintf(f, SAMPLE_CURSOR_MAGIC "\ncursor: %u\n", cursor);
+	if (fclose(f))
+		msg_gwarn("Warning: Can't write sample cursor `%s': %s\n", path, strerror(errno));
+}
+
+static int do_verify_sampled(struct flashctx *const flash, const struct image_buf *const image,
+			     const unsigned int stride, const char *const cursorfile)
+{
+	struct flashprog_sampled_verify sample = {
+		.stride = stride,
+		.cursor = cursorfile ? sample_cursor_load(cursorfile) : 0,
+	};
+
+	const int ret = flashprog_image_verify_sampled(flash, image->buf, image->size, &sample);
+	if (ret == 1 || ret == 2)
+		return ret;
+
+	if (sample.escalated)
+		msg_ginfo("A sampled block mismatched, so all included regions were verified.\n");
+	else
+		msg_ginfo("Checked %zu of %zu blocks: %zu read back, %zu by checksum (coverage %u%%).\n",
+			  sample.read + sample.checksummed, sample.blocks, sample.read, sample.checksummed,
+			  sample.coverage);
+	if (cursorfile)
+		sample_cursor_store(cursorfile, sample.cursor);
+	return ret;
+}
+
+static int do_verify(struct flashctx *const flash, const char *const filename, const bool hash,
+		     const unsigned int sample_stride, const char *const samplecursorfile)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	struct image_buf image;
+	int ret;
+
+	if (image_buf_open(&image, flashprog_flash_getsize(flash), filename))
+		return 1;
+
+	if (sample_stride) {
+		ret = do_verify_sampled(flash, &image, sample_stride, samplecursorfile);
+	} else if (hash) {
+		ret = flashprog_image_verify_sha256(flash, image.buf, image.size, digest);
+		if (!ret || ret == 3)
+			print_sha256(digest);
+	} else {
+		ret = flashprog_image_verify(flash, image.buf, image.size);
+	}
+
+	image_buf_close(&image, false);
 	return ret;
 }
 
+static int do_hash(struct flashctx *const flash)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+
+	if (flashprog_image_sha256(flash, digest))
+		return 1;
+	print_sha256(digest);
+	return 0;
+}
+
 /* Returns true if the flash chip cannot be completely accessed due to size/address limits of the programmer. */
 static bool max_decode_exceeded(const struct registered_master *const mst, const struct flashctx *const flash)
 {
@@ -202,14 +603,266 @@ static bool max_decode_exceeded(const struct registered_master *const mst, const
 	return true;
 }
 
+/* Parse a programmer specification `name[:param]`. `*param` is NULL if no parameters are given. */
+static int parse_programmer(const char *const arg, const struct programmer_entry **const prog, char **const param)
+{
+	size_t p;
+
+	for (p = 0; p < programmer_table_size; p++) {
+		const char *const name = programmer_table[p]->name;
+		const size_t namelen = strlen(name);
+
+		if (strncmp(arg, name, namelen) != 0)
+			continue;
+		/* Differentiate between foo and foobar. */
+		if (arg[namelen] != ':' && arg[namelen] != '\0')
+			continue;
+
+		*prog = programmer_table[p];
+		*param = NULL;
+		if (arg[namelen] == ':' && arg[namelen + 1] != '\0') {
+			*param = strdup(arg + namelen + 1);
+			if (!*param) {
+				fprintf(stderr, "Out of memory!\n");
+				return 1;
+			}
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * The probe cache records the chip detected with a programmer, so
+ * the next run can probe for that chip alone. Generic matches are
+ * never recorded, as they would also match any specific chip.
+ */
+#define PROBE_CACHE_MAGIC	"# flashprog probe cache 1"
+
+static void probe_cache_id(char *const buf, const size_t len,
+			   const char *const prog_name, const char *const prog_param)
+{
+	const char *const param = prog_param ? prog_param : "";
+	snprintf(buf, len, "programmer: %s%s%s\n", prog_name, *param ? ":" : "", param);
+}
+
+/* Returns the chip name recorded for this programmer, or NULL. */
+static char *probe_cache_load(const char *const path, const char *const prog_name,
+			      const char *const prog_param)
+{
+	char expected[256], line[256];
+	char *chip_name = NULL;
+
+	FILE *const f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	probe_cache_id(expected, sizeof(expected), prog_name, prog_param);
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PROBE_CACHE_MAGIC "\n") ||
+	    !fgets(line, sizeof(line), f) || strcmp(line, expected) ||
+	    !fgets(line, sizeof(line), f) || strncmp(line, "chip: ", 6))
+		goto _close_ret;
+
+	line[strcspn(line, "\n")] = '\0';
+	chip_name = strdup(line + 6);
+
+_close_ret:
+	fclose(f);
+	return chip_name;
+}
+
+static void probe_cache_store(const char *const path, const char *const prog_name,
+			      const char *const prog_param, const struct flashchip *const chip)
+{
+	char id[256];
+
+	if (chip->model_id == GENERIC_DEVICE_ID || chip->model_id == SFDP_DEVICE_ID)
+		return;
+
+	FILE *const f = fopen(path, "w");
+	if (!f) {
+		msg_gwarn("Warning: Can't write probe cache `%s': %s\n", path, strerror(errno));
+		return;
+	}
+	probe_cache_id(id, sizeof(id), prog_name, prog_param);
+	fprintf(f, PROBE_CACHE_MAGIC "\n%schip: %s\n", id, chip->name);
+	if (fclose(f))
+		msg_gwarn("Warning: Can't write probe cache `%s': %s\n", path, strerror(errno));
+}
+
+/* Probe all registered masters, returns the number of chips found. */
+static int probe_masters(struct flashprog_programmer *const prog, struct flashctx *const flashes,
+			 const int max_chips, struct registered_master **const matched_master,
+			 const char *const chip_name)
+{
+	int chipcount = 0, startchip, j;
+
+	for (j = 0; j < prog->master_count; j++) {
+		startchip = 0;
+		while (chipcount < max_chips) {
+			startchip = probe_flash(&prog->masters[j], startchip, &flashes[chipcount], 0, chip_name);
+			if (startchip == -1)
+				break;
+			if (chipcount == 0)
+				*matched_master = &prog->masters[j];
+			chipcount++;
+			startchip++;
+		}
+	}
+	return chipcount;
+}
+
+/* CPU time and peak memory use of flashprog itself, where available. */
+static bool get_host_usage(unsigned long long *const cpu_us, unsigned long *const max_rss_kib)
+{
+#if !IS_WINDOWS
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return false;
+	*cpu_us = (unsigned long long)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+		  usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#if defined(__APPLE__)
+	*max_rss_kib = usage.ru_maxrss / 1024;
+#else
+	*max_rss_kib = usage.ru_maxrss;
+#endif
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void print_stats(const struct flashctx *const flash, const bool json)
+{
+	static const char *const stages[] = { "read", "write", "erase" };
+	struct flashprog_stats stats;
+	unsigned long long cpu_us;
+	unsigned long max_rss_kib;
+	size_t i;
+
+	flashprog_stats_get(flash, &stats);
+	const bool host = get_host_usage(&cpu_us, &max_rss_kib);
+
+	if (json) {
+		printf("{\"spi_transactions\": %lu, \"spi_commands\": %lu, "
+		       "\"bytes_out\": %llu, \"bytes_in\": %llu, \"wip_polls\": %lu, "
+		       "\"delay_us\": %llu, \"skipped_bytes\": %llu, \"skipped_erased_pages\": %lu, "
+		       "\"erased_blocks\": {",
+		       stats.spi_transactions, stats.spi_commands, stats.bytes_out, stats.bytes_in,
+		       stats.wip_polls, stats.delay_us, stats.skipped_bytes, stats.skipped_erased_pages);
+		for (i = 0; i < ARRAY_SIZE(stats.erased_blocks) && stats.erased_blocks[i].size; ++i)
+			printf("%s\"%u\": %lu", i ? ", " : "",
+			       stats.erased_blocks[i].size, stats.erased_blocks[i].count);
+		printf("}, \"stage_us\": {");
+		for (i = 0; i < ARRAY_SIZE(stages); ++i)
+			printf("%s\"%s\": %llu", i ? ", " : "", stages[i], stats.stage_us[i]);
+		printf("}, \"usb\": {\"transfers\": %lu, \"timeouts\": %lu, \"errors\": %lu, "
+		       "\"bytes\": %llu, \"time_us\": %llu, \"by_size\": [",
+		       stats.usb.transfers, stats.usb.timeouts, stats.usb.errors,
+		       stats.usb.bytes, stats.usb.time_us);
+		for (i = 0; i < ARRAY_SIZE(stats.usb.by_size); ++i)
+			printf("%s%lu", i ? ", " : "", stats.usb.by_size[i]);
+		printf("], \"by_latency\": [");
+		for (i = 0; i < ARRAY_SIZE(stats.usb.by_latency); ++i)
+			printf("%s%lu", i ? ", " : "", stats.usb.by_latency[i]);
+		printf("]}, \"delays\": {\"count\": %lu, \"by_lateness\": [", stats.delays.count);
+		for (i = 0; i < ARRAY_SIZE(stats.delays.by_lateness); ++i)
+			printf("%s%lu", i ? ", " : "", stats.delays.by_lateness[i]);
+		printf("]}");
+		if (host)
+			printf(", \"cpu_us\": %llu, \"max_rss_kib\": %lu", cpu_us, max_rss_kib);
+		printf("}\n");
+		return;
+	}
+
+	msg_ginfo("Statistics:\n");
+	msg_ginfo("  SPI: %lu transactions, %lu commands, %llu bytes out, %llu bytes in\n",
+		  stats.spi_transactions, stats.spi_commands, stats.bytes_out, stats.bytes_in);
+	msg_ginfo("  Waiting: %lu busy polls, %llu us of delays\n", stats.wip_polls, stats.delay_us);
+	msg_ginfo("  Skipped as up to date: %llu bytes (%lu whole pages that stay erased)\n",
+		  stats.skipped_bytes, stats.skipped_erased_pages);
+	for (i = 0; i < ARRAY_SIZE(stats.erased_blocks) && stats.erased_blocks[i].size; ++i)
+		msg_ginfo("  Erased: %lu x %u bytes\n",
+			  stats.erased_blocks[i].count, stats.erased_blocks[i].size);
+	for (i = 0; i < ARRAY_SIZE(stages); ++i) {
+		if (stats.stage_us[i])
+			msg_ginfo("  Time to %s: %llu.%03llu s\n", stages[i],
+				  stats.stage_us[i] / 1000000, stats.stage_us[i] / 1000 % 1000);
+	}
+	if (stats.usb.transfers) {
+		msg_ginfo("  USB: %lu transfers, %llu bytes, %llu us, %lu timeouts, %lu errors\n",
+			  stats.usb.transfers, stats.usb.bytes, stats.usb.time_us,
+			  stats.usb.timeouts, stats.usb.errors);
+		msg_ginfo("  USB transfer sizes:");
+		for (i = 0; i < ARRAY_SIZE(stats.usb.by_size); ++i) {
+			if (stats.usb.by_size[i])
+				msg_ginfo(" %s%u: %lu", i < ARRAY_SIZE(stats.usb.by_size) - 1 ? "<=" : ">",
+					  64 << MIN(i, ARRAY_SIZE(stats.usb.by_size) - 2), stats.usb.by_size[i]);
+		}
+		msg_ginfo(" bytes\n  USB latencies:");
+		for (i = 0; i < ARRAY_SIZE(stats.usb.by_latency); ++i) {
+			if (stats.usb.by_latency[i])
+				msg_ginfo(" %s%u: %lu", i < ARRAY_SIZE(stats.usb.by_latency) - 1 ? "<" : ">=",
+					  125 << MIN(i, ARRAY_SIZE(stats.usb.by_latency) - 2),
+					  stats.usb.by_latency[i]);
+		}
+		msg_ginfo(" us\n");
+	}
+	if (stats.delays.count) {
+		msg_ginfo("  Delays: %lu measured, ended late by:", stats.delays.count);
+		for (i = 0; i < ARRAY_SIZE(stats.delays.by_lateness); ++i) {
+			if (stats.delays.by_lateness[i])
+				msg_ginfo(" %s%u: %lu", i < ARRAY_SIZE(stats.delays.by_lateness) - 1 ? "<" : ">=",
+					  2 << MIN(i, ARRAY_SIZE(stats.delays.by_lateness) - 2),
+					  stats.delays.by_lateness[i]);
+		}
+		msg_ginfo(" us\n");
+	}
+	if (host)
+		msg_ginfo("  Host: %llu.%03llu s CPU time, %lu KiB peak memory\n",
+			  cpu_us / 1000000, cpu_us / 1000 % 1000, max_rss_kib);
+}
+
+static void release_flashes(struct flashctx *const flashes, int *const chipcount)
+{
+	int i;
+
+	for (i = 0; i < *chipcount; i++) {
+		read_cache_clear(&flashes[i]);
+		erase_layout_cache_clear(&flashes[i]);
+		spi_wp_release(&flashes[i]);
+		flashprog_layout_release(flashes[i].default_layout);
+		flashprog_free(flashes[i].chip);
+		memset(&flashes[i], 0, sizeof(flashes[i]));
+	}
+	*chipcount = 0;
+}
+
+/* Every -p is recorded for gang programming. Takes ownership of `param`. */
+static int append_gang_device(struct gang_device **const devs, size_t *const count,
+			      const struct programmer_entry *const prog, char *const param)
+{
+	struct gang_device *const new_devs = realloc(*devs, (*count + 1) * sizeof(**devs));
+	if (!new_devs) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+	new_devs[*count].prog_name = prog->name;
+	new_devs[*count].prog_param = param;
+	new_devs[*count].multi_instance = prog->multi_instance;
+	*devs = new_devs;
+	++*count;
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	const struct flashchip *chip = NULL;
 	/* Probe for up to eight flash chips. */
 	struct flashctx flashes[8] = {{0}};
 	struct flashctx *fill_flash;
-	const char *name;
-	int namelen, opt, i, j;
+	int opt, i, j;
 	int startchip = -1, chipcount = 0, option_index = 0;
 	int operation_specified = 0;
 	bool force = false, ifd = false, fmap = false;
@@ -221,8 +874,25 @@ int main(int argc, char *argv[])
 	bool dont_verify_it = false, dont_verify_all = false;
 	bool list_supported = false;
 	bool show_progress = false;
+	bool streaming = false;
+	bool verify_inline = false;
+	bool checked_read = false;
+	bool dry_run = false;
+	bool benchmark = false, allow_destructive = false;
+	bool hotplug = false;
+	bool realtime = false;
+	bool resume = false;
+	unsigned int chip_selects = 1;
+	bool sfdp_overlay = false;
+	bool hash = false;
+	unsigned int sample_stride = 0;
+	bool show_stats = false, stats_json = false;
+	enum flashprog_erase_check erase_check = FLASHPROG_ERASE_CHECK_FULL;
 	struct flashprog_layout *layout = NULL;
 	static const struct programmer_entry *prog = NULL;
+	const struct programmer_entry *gang_prog;
+	struct gang_device *gang_devs = NULL;
+	size_t gang_count = 0;
 	enum {
 		OPTION_IFD = 0x0100,
 		OPTION_FMAP,
@@ -231,6 +901,31 @@ int main(int argc, char *argv[])
 		OPTION_FLASH_NAME,
 		OPTION_FLASH_SIZE,
 		OPTION_PROGRESS,
+		OPTION_ERASE_CHECK,
+		OPTION_MANIFEST,
+		OPTION_STREAMING,
+		OPTION_VERIFY_INLINE,
+		OPTION_CHECKED_READ,
+		OPTION_DRY_RUN,
+		OPTION_JOURNAL,
+		OPTION_RESUME,
+		OPTION_CHIP_SELECTS,
+		OPTION_PROBE_CACHE,
+		OPTION_SFDP_OVERLAY,
+		OPTION_SAMPLED,
+		OPTION_SAMPLE_CURSOR,
+		OPTION_HASH,
+		OPTION_STATS,
+		OPTION_SPI_TRACE,
+		OPTION_SPI_REPLAY,
+		OPTION_LOG_JSON,
+		OPTION_PATCH,
+		OPTION_BATCH,
+		OPTION_SERVE,
+		OPTION_HOTPLUG,
+		OPTION_BENCHMARK,
+		OPTION_ALLOW_DESTRUCTIVE,
+		OPTION_REALTIME,
 	};
 	int ret = 0;
 
@@ -262,14 +957,54 @@ int main(int argc, char *argv[])
 		{"version",		0, NULL, 'R'},
 		{"output",		1, NULL, 'o'},
 		{"progress",		0, NULL, OPTION_PROGRESS},
+		{"erase-check",		1, NULL, OPTION_ERASE_CHECK},
+		{"manifest",		1, NULL, OPTION_MANIFEST},
+		{"streaming",		0, NULL, OPTION_STREAMING},
+		{"verify-inline",	0, NULL, OPTION_VERIFY_INLINE},
+		{"checked-read",	0, NULL, OPTION_CHECKED_READ},
+		{"dry-run",		0, NULL, OPTION_DRY_RUN},
+		{"journal",		1, NULL, OPTION_JOURNAL},
+		{"resume",		0, NULL, OPTION_RESUME},
+		{"chip-selects",	1, NULL, OPTION_CHIP_SELECTS},
+		{"probe-cache",		1, NULL, OPTION_PROBE_CACHE},
+		{"sfdp-overlay",	0, NULL, OPTION_SFDP_OVERLAY},
+		{"sampled",		1, NULL, OPTION_SAMPLED},
+		{"sample-cursor",	1, NULL, OPTION_SAMPLE_CURSOR},
+		{"hash",		1, NULL, OPTION_HASH},
+		{"stats",		2, NULL, OPTION_STATS},
+		{"spi-trace",		1, NULL, OPTION_SPI_TRACE},
+		{"spi-replay",		1, NULL, OPTION_SPI_REPLAY},
+		{"log-json",		1, NULL, OPTION_LOG_JSON},
+		{"patch",		1, NULL, OPTION_PATCH},
+		{"batch",		1, NULL, OPTION_BATCH},
+#if HAVE_PTHREAD == 1
+		{"serve",		1, NULL, OPTION_SERVE},
+#endif
+#if HAVE_USBDEV == 1
+		{"hotplug",		0, NULL, OPTION_HOTPLUG},
+#endif
+		{"benchmark",		0, NULL, OPTION_BENCHMARK},
+		{"allow-destructive",	0, NULL, OPTION_ALLOW_DESTRUCTIVE},
+		{"realtime",		0, NULL, OPTION_REALTIME},
 		{NULL,			0, NULL, 0},
 	};
 
 	char *filename = NULL;
+	char *chip_to_probe = NULL;
 	char *referencefile = NULL;
+	char *manifestfile = NULL;
+	char *journalfile = NULL;
+	char *patchfile = NULL;
+	char *batchfile = NULL;
+	char *servesocket = NULL;
+	char *probecachefile = NULL;
+	char *samplecursorfile = NULL;
+	char *spitracefile = NULL;
+	char *spireplayfile = NULL;
 	char *layoutfile = NULL;
 	char *fmapfile = NULL;
 	char *logfile = NULL;
+	char *jsonlogfile = NULL;
 	char *tempstr = NULL;
 	char *pparam = NULL;
 	struct layout_include_args *include_args = NULL;
@@ -285,13 +1020,6 @@ int main(int argc, char *argv[])
 			(flashprog_log_callback *)&flashprog_print_cb);
 	}
 
-	print_version();
-	print_banner();
-
-	/* FIXME: Delay calibration should happen in programmer code. */
-	if (flashprog_init(1))
-		exit(1);
-
 	setbuf(stdout, NULL);
 	/* FIXME: Delay all operation_specified checks until after command
 	 * line parsing to allow --help overriding everything else.
@@ -392,6 +1120,115 @@ int main(int argc, char *argv[])
 							"Aborting.\n");
 			referencefile = strdup(optarg);
 			break;
+		case OPTION_MANIFEST:
+			if (manifestfile)
+				cli_classic_abort_usage("Error: --manifest specified more than once."
+							"Aborting.\n");
+			manifestfile = strdup(optarg);
+			break;
+		case OPTION_STREAMING:
+			streaming = true;
+			break;
+		case OPTION_VERIFY_INLINE:
+			verify_inline = true;
+			break;
+		case OPTION_CHECKED_READ:
+			checked_read = true;
+			break;
+		case OPTION_DRY_RUN:
+			dry_run = true;
+			break;
+		case OPTION_JOURNAL:
+			if (journalfile)
+				cli_classic_abort_usage("Error: --journal specified more than once."
+							"Aborting.\n");
+			journalfile = strdup(optarg);
+			break;
+		case OPTION_RESUME:
+			resume = true;
+			break;
+		case OPTION_CHIP_SELECTS: {
+			char *endptr;
+			chip_selects = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || chip_selects < 1 || chip_selects > 256)
+				cli_classic_abort_usage("Error: Invalid number of chip selects.\n");
+			break;
+		}
+		case OPTION_PROBE_CACHE:
+			if (probecachefile)
+				cli_classic_abort_usage("Error: --probe-cache specified more than once."
+							"Aborting.\n");
+			probecachefile = strdup(optarg);
+			break;
+		case OPTION_SFDP_OVERLAY:
+			sfdp_overlay = true;
+			break;
+		case OPTION_SAMPLED: {
+			char *endptr;
+			sample_stride = strtoul(optarg, &endptr, 0);
+			if (*optarg == '\0' || *endptr != '\0' || sample_stride < 1)
+				cli_classic_abort_usage("Error: Invalid sampling interval.\n");
+			break;
+		}
+		case OPTION_SAMPLE_CURSOR:
+			if (samplecursorfile)
+				cli_classic_abort_usage("Error: --sample-cursor specified more than once."
+							"Aborting.\n");
+			samplecursorfile = strdup(optarg);
+			break;
+		case OPTION_HASH:
+			if (strcmp(optarg, "sha256"))
+				cli_classic_abort_usage("Error: Only `sha256' is supported for --hash.\n");
+			hash = true;
+			break;
+		case OPTION_STATS:
+			show_stats = true;
+			if (optarg && !strcmp(optarg, "json"))
+				stats_json = true;
+			else if (optarg)
+				cli_classic_abort_usage("Error: Unknown statistics format.\n");
+			break;
+		case OPTION_SPI_TRACE:
+			if (spitracefile)
+				cli_classic_abort_usage("Error: --spi-trace specified more than once."
+							"Aborting.\n");
+			spitracefile = strdup(optarg);
+			break;
+		case OPTION_SPI_REPLAY:
+			cli_classic_validate_singleop(&operation_specified);
+			spireplayfile = strdup(optarg);
+			break;
+		case OPTION_PATCH:
+			cli_classic_validate_singleop(&operation_specified);
+			patchfile = strdup(optarg);
+			break;
+		case OPTION_BATCH:
+			cli_classic_validate_singleop(&operation_specified);
+			batchfile = strdup(optarg);
+			break;
+		case OPTION_SERVE:
+			cli_classic_validate_singleop(&operation_specified);
+			servesocket = strdup(optarg);
+			break;
+		case OPTION_HOTPLUG:
+			hotplug = true;
+			break;
+		case OPTION_BENCHMARK:
+			cli_classic_validate_singleop(&operation_specified);
+			benchmark = true;
+			break;
+		case OPTION_ALLOW_DESTRUCTIVE:
+			allow_destructive = true;
+			break;
+		case OPTION_REALTIME:
+			realtime = true;
+			break;
+		case OPTION_LOG_JSON:
+			if (jsonlogfile)
+				cli_classic_abort_usage("Error: --log-json specified more than once."
+							"Aborting.\n");
+			jsonlogfile = strdup(optarg);
+			break;
 		case OPTION_FLASH_NAME:
 			cli_classic_validate_singleop(&operation_specified);
 			flash_name = true;
@@ -414,56 +1251,32 @@ int main(int argc, char *argv[])
 #endif
 			break;
 		case 'p':
-			if (prog != NULL) {
-				cli_classic_abort_usage("Error: --programmer specified "
-					"more than once. You can separate "
-					"multiple\nparameters for a programmer "
-					"with \",\". Please see the man page "
-					"for details.\n");
-			}
-			size_t p;
-			for (p = 0; p < programmer_table_size; p++) {
-				name = programmer_table[p]->name;
-				namelen = strlen(name);
-				if (strncmp(optarg, name, namelen) == 0) {
-					switch (optarg[namelen]) {
-					case ':':
-						pparam = strdup(optarg + namelen + 1);
-						if (!strlen(pparam)) {
-							free(pparam);
-							pparam = NULL;
-						}
-						prog = programmer_table[p];
-						break;
-					case '\0':
-						prog = programmer_table[p];
-						break;
-					default:
-						/* The continue refers to the
-						 * for loop. It is here to be
-						 * able to differentiate between
-						 * foo and foobar.
-						 */
-						continue;
-					}
-					break;
-				}
-			}
-			if (prog == NULL) {
+			if (parse_programmer(optarg, &gang_prog, &tempstr)) {
 				fprintf(stderr, "Error: Unknown programmer \"%s\". Valid choices are:\n",
 					optarg);
 				list_programmers_linebreak(0, 80, 0);
 				msg_ginfo(".\n");
 				cli_classic_abort_usage(NULL);
 			}
+			if (prog == NULL) {
+				prog = gang_prog;
+				pparam = tempstr ? strdup(tempstr) : NULL;
+			}
+			if (append_gang_device(&gang_devs, &gang_count, gang_prog, tempstr)) {
+				free(tempstr);
+				cli_classic_abort_usage(NULL);
+			}
+			tempstr = NULL;
 			break;
 		case 'R':
-			/* print_version() is always called during startup. */
 			cli_classic_validate_singleop(&operation_specified);
+			print_version();
 			exit(0);
 			break;
 		case 'h':
 			cli_classic_validate_singleop(&operation_specified);
+			print_version();
+			print_banner();
 			cli_classic_usage(argv[0]);
 			exit(0);
 			break;
@@ -481,12 +1294,33 @@ int main(int argc, char *argv[])
 		case OPTION_PROGRESS:
 			show_progress = true;
 			break;
+		case OPTION_ERASE_CHECK:
+			if (!strcmp(optarg, "full"))
+				erase_check = FLASHPROG_ERASE_CHECK_FULL;
+			else if (!strcmp(optarg, "sampled"))
+				erase_check = FLASHPROG_ERASE_CHECK_SAMPLED;
+			else if (!strcmp(optarg, "none"))
+				erase_check = FLASHPROG_ERASE_CHECK_NONE;
+			else
+				cli_classic_abort_usage("Error: Unknown erase-check policy.\n");
+			break;
 		default:
 			cli_classic_abort_usage(NULL);
 			break;
 		}
 	}
 
+	/* With `-r -`, the image goes to stdout and all messages to stderr. */
+	if (read_it && filename && !strcmp(filename, "-"))
+		stdout_is_data = true;
+
+	print_version();
+	print_banner();
+
+	/* FIXME: Delay calibration should happen in programmer code. */
+	if (flashprog_init(1))
+		exit(1);
+
 	if (optind < argc)
 		cli_classic_abort_usage("Error: Extra parameter found.\n");
 	if ((read_it | write_it | verify_it) && check_filename(filename, "image"))
@@ -497,10 +1331,76 @@ int main(int argc, char *argv[])
 		cli_classic_abort_usage(NULL);
 	if (referencefile && check_filename(referencefile, "reference"))
 		cli_classic_abort_usage(NULL);
+	if (manifestfile && check_filename(manifestfile, "manifest"))
+		cli_classic_abort_usage(NULL);
+	if (journalfile && check_filename(journalfile, "journal"))
+		cli_classic_abort_usage(NULL);
+	if ((journalfile || resume) && !write_it)
+		cli_classic_abort_usage("Error: --journal and --resume are only supported for writing.\n");
+	if (resume && (!journalfile || referencefile))
+		cli_classic_abort_usage("Error: --resume requires --journal and can't be used with "
+					"--flash-contents.\n");
+	if (probecachefile && check_filename(probecachefile, "probe cache"))
+		cli_classic_abort_usage(NULL);
+	if (samplecursorfile && check_filename(samplecursorfile, "sample cursor"))
+		cli_classic_abort_usage(NULL);
+	if ((sample_stride || samplecursorfile) && (!verify_it || hash))
+		cli_classic_abort_usage("Error: --sampled is only supported for verifying, without --hash.\n");
+	if (samplecursorfile && !sample_stride)
+		cli_classic_abort_usage("Error: --sample-cursor requires --sampled.\n");
+	if (spitracefile && check_filename(spitracefile, "SPI trace"))
+		cli_classic_abort_usage(NULL);
+	if (spireplayfile && check_filename(spireplayfile, "SPI trace"))
+		cli_classic_abort_usage(NULL);
+	if (patchfile && check_filename(patchfile, "patch"))
+		cli_classic_abort_usage(NULL);
+	/* A patch brings its own layout, and its base is checked against its hash. */
+	if (patchfile && (layoutfile || ifd || fmap || include_args || referencefile || streaming))
+		cli_classic_abort_usage("Error: --patch can't be used with -l, --ifd, --fmap, -i, "
+					"--flash-contents or --streaming.\n");
+	if (batchfile && check_filename(batchfile, "batch script"))
+		cli_classic_abort_usage(NULL);
+	if (servesocket && check_filename(servesocket, "socket"))
+		cli_classic_abort_usage(NULL);
+	/* Batch commands select their regions themselves, the manifest covers single writes only. */
+	if ((batchfile || servesocket) && (include_args || referencefile || manifestfile || streaming || hash))
+		cli_classic_abort_usage("Error: --batch and --serve can't be used with -i, --flash-contents, "
+					"--manifest, --streaming or --hash.\n");
+	/* Every board gets its own programmer session, the layout can't come from the chip. */
+	if (hotplug && (!batchfile || !prog || gang_count > 1 || ifd || fmap || fmapfile || probecachefile ||
+			spitracefile))
+		cli_classic_abort_usage("Error: --hotplug needs --batch and -p, and can't be used with multiple "
+					"programmers, --ifd, --fmap, --fmap-file, --probe-cache or --spi-trace.\n");
+	/* Replayed commands carry no data, they would corrupt a real chip. */
+	if (spireplayfile && prog && strcmp(prog->name, "dummy"))
+		cli_classic_abort_usage("Error: --spi-replay only works with the dummy programmer.\n");
+	if (allow_destructive && !benchmark)
+		cli_classic_abort_usage("Error: --allow-destructive is only supported with --benchmark.\n");
 	if (logfile && check_filename(logfile, "log"))
 		cli_classic_abort_usage(NULL);
+	if (hash && (write_it || erase_it))
+		cli_classic_abort_usage("Error: --hash is only supported for reading and verifying.\n");
+	if (hash && patchfile)
+		cli_classic_abort_usage("Error: --hash is only supported for reading and verifying.\n");
+	if (gang_count > 1 && !write_it)
+		cli_classic_abort_usage("Error: Multiple programmers are only supported for writing.\n");
+	if (chip_selects > 1 && (!write_it || !gang_count))
+		cli_classic_abort_usage("Error: --chip-selects is only supported for writing with -p.\n");
+	if (chip_selects > 1 && streaming)
+		cli_classic_abort_usage("Error: --chip-selects can't be used with --streaming.\n");
+	if (dry_run && (!write_it || gang_count > 1 || chip_selects > 1))
+		cli_classic_abort_usage("Error: --dry-run is only supported for writing with a single programmer.\n");
+	if ((gang_count > 1 || chip_selects > 1) && (ifd || fmap || referencefile || manifestfile || journalfile ||
+			       probecachefile || sfdp_overlay || show_stats || spitracefile || jsonlogfile))
+		cli_classic_abort_usage("Error: --ifd, --fmap, --flash-contents, --manifest, --journal, --probe-cache, "
+					"--sfdp-overlay, --stats, --spi-trace and --log-json can't be used with "
+					"multiple programmers or chip selects.\n");
 	if (logfile && open_logfile(logfile))
 		cli_classic_abort_usage(NULL);
+	if (jsonlogfile && open_json_log(jsonlogfile))
+		cli_classic_abort_usage(NULL);
+	/* Don't format messages that would be dropped anyway. */
+	flashprog_set_log_level(logfile ? MAX(verbose_screen, verbose_logfile) : verbose_screen);
 
 #if CONFIG_PRINT_WIKI == 1
 	if (list_supported_wiki) {
@@ -547,6 +1447,45 @@ int main(int argc, char *argv[])
 		/* Keep chip around for later usage in case a forced read is requested. */
 	}
 
+	if (realtime)
+		realtime_enter();
+
+#if HAVE_USBDEV == 1
+	if (hotplug) {
+		const struct hotplug_config cfg = {
+			.prog		= prog,
+			.prog_param	= pparam,
+			.chip_name	= chip_to_probe,
+			.script		= batchfile,
+			.layout		= layout,
+			.force		= force,
+			.verify		= !dont_verify_it,
+			.verify_all	= !dont_verify_all,
+			.erase_check	= erase_check,
+		};
+		ret = hotplug_run(&cfg);
+		flashprog_layout_release(layout);
+		goto out;
+	}
+#endif
+
+	if (gang_count > 1 || chip_selects > 1) {
+		const struct gang_config cfg = {
+			.chip_name	= chip_to_probe,
+			.chip_selects	= chip_selects,
+			.layout		= layout,
+			.force		= force,
+			.verify		= !dont_verify_it,
+			.verify_all	= !dont_verify_all,
+			.streaming	= streaming,
+			.show_progress	= show_progress,
+			.erase_check	= erase_check,
+		};
+		ret = gang_write(gang_devs, gang_count, filename, &cfg);
+		flashprog_layout_release(layout);
+		goto out;
+	}
+
 	if (prog == NULL) {
 		const struct programmer_entry *const default_programmer = CONFIG_DEFAULT_PROGRAMMER_NAME;
 
@@ -575,23 +1514,34 @@ int main(int argc, char *argv[])
 		ret = 1;
 		goto out;
 	}
-	tempstr = flashbuses_to_text(get_buses_supported());
+	tempstr = flashbuses_to_text(get_buses_supported(flashprog));
 	msg_pdbg("The following protocols are supported: %s.\n", tempstr);
 	free(tempstr);
 
+	if (spitracefile && spi_trace_start(spitracefile)) {
+		ret = 1;
+		goto out_shutdown;
+	}
+
 	struct registered_master *matched_master = NULL;
-	for (j = 0; j < registered_master_count; j++) {
-		startchip = 0;
-		while (chipcount < (int)ARRAY_SIZE(flashes)) {
-			startchip = probe_flash(&registered_masters[j], startchip, &flashes[chipcount], 0);
-			if (startchip == -1)
-				break;
-			if (chipcount == 0)
-				matched_master = &registered_masters[j];
-			chipcount++;
-			startchip++;
+	char *cached_chip = NULL;
+	if (probecachefile && !chip_to_probe)
+		cached_chip = probe_cache_load(probecachefile, prog->name, pparam);
+	if (cached_chip) {
+		msg_cdbg("Probing for cached chip \"%s\" first.\n", cached_chip);
+		chipcount = probe_masters(flashprog, flashes, ARRAY_SIZE(flashes), &matched_master, cached_chip);
+		if (chipcount != 1) {
+			msg_cinfo("Cached chip \"%s\" not found, probing for all chips.\n", cached_chip);
+			release_flashes(flashes, &chipcount);
+			matched_master = NULL;
 		}
 	}
+	if (!chipcount)
+		chipcount = probe_masters(flashprog, flashes, ARRAY_SIZE(flashes), &matched_master, chip_to_probe);
+	if (probecachefile && !chip_to_probe && chipcount == 1 &&
+	    (!cached_chip || strcmp(cached_chip, flashes[0].chip->name)))
+		probe_cache_store(probecachefile, prog->name, pparam, flashes[0].chip);
+	free(cached_chip);
 
 	if (chipcount > 1) {
 		msg_cinfo("Multiple flash chip definitions match the detected chip(s): \"%s\"",
@@ -612,8 +1562,8 @@ int main(int argc, char *argv[])
 			int compatible_masters = 0;
 			msg_cinfo("Force read (-f -r -c) requested, pretending the chip is there:\n");
 			/* This loop just counts compatible controllers. */
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
+			for (j = 0; j < flashprog->master_count; j++) {
+				mst = &flashprog->masters[j];
 				/* chip is still set from the chip_to_probe earlier in this function. */
 				if (mst->buses_supported & chip->bustype)
 					compatible_masters++;
@@ -626,9 +1576,9 @@ int main(int argc, char *argv[])
 			if (compatible_masters > 1)
 				msg_cinfo("More than one compatible controller found for the requested flash "
 					  "chip, using the first one.\n");
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
-				startchip = probe_flash(mst, 0, &flashes[0], 1);
+			for (j = 0; j < flashprog->master_count; j++) {
+				mst = &flashprog->masters[j];
+				startchip = probe_flash(mst, 0, &flashes[0], 1, chip_to_probe);
 				if (startchip != -1)
 					break;
 			}
@@ -640,8 +1590,8 @@ int main(int argc, char *argv[])
 			}
 			msg_cinfo("Please note that forced reads most likely contain garbage.\n");
 			flashprog_flag_set(&flashes[0], FLASHPROG_FLAG_FORCE, force);
-			ret = do_read(&flashes[0], filename);
-			free(flashes[0].chip);
+			ret = do_read(&flashes[0], filename, hash);
+			flashprog_free(flashes[0].chip);
 			goto out_shutdown;
 		}
 		ret = 1;
@@ -656,8 +1606,16 @@ int main(int argc, char *argv[])
 
 	fill_flash = &flashes[0];
 
-	if (show_progress)
-		flashprog_set_progress_callback(fill_flash, &flashprog_progress_cb, NULL);
+	if (sfdp_overlay)
+		flashprog_flash_sfdp_overlay(fill_flash);
+
+	if (jsonlogfile)
+		flashprog_set_event_callback(fill_flash, &flashprog_event_json_cb, NULL);
+
+	if (show_progress) {
+		flashprog_set_progress_callback(fill_flash, &flashprog_progress_cb, fill_flash);
+		flashprog_set_progress_interval(fill_flash, 100, 0);
+	}
 
 	print_chip_support_status(fill_flash->chip);
 
@@ -668,7 +1626,10 @@ int main(int argc, char *argv[])
 		goto out_shutdown;
 	}
 
-	if (!(read_it | write_it | verify_it | erase_it | flash_name | flash_size)) {
+	if (!(read_it | write_it | verify_it | erase_it | flash_name | flash_size | hash) &&
+	    !spireplayfile && !patchfile && !batchfile && !servesocket && !benchmark) {
+		/* Operations print it only if they need it, i.e. for erasing and writing. */
+		print_lock_status(fill_flash);
 		msg_ginfo("No operations were specified.\n");
 		goto out_shutdown;
 	}
@@ -734,14 +1695,18 @@ int main(int argc, char *argv[])
 #endif
 	flashprog_flag_set(fill_flash, FLASHPROG_FLAG_VERIFY_AFTER_WRITE, !dont_verify_it);
 	flashprog_flag_set(fill_flash, FLASHPROG_FLAG_VERIFY_WHOLE_CHIP, !dont_verify_all);
+	flashprog_flag_set(fill_flash, FLASHPROG_FLAG_STREAMING_WRITE, streaming);
+	flashprog_flag_set(fill_flash, FLASHPROG_FLAG_VERIFY_INLINE, verify_inline);
+	flashprog_flag_set(fill_flash, FLASHPROG_FLAG_CHECKED_READ, checked_read);
+	flashprog_erase_check_set(fill_flash, erase_check);
 
 	/* FIXME: We should issue an unconditional chip reset here. This can be
 	 * done once we have a .reset function in struct flashchip.
 	 * Give the chip time to settle.
 	 */
-	programmer_delay(100000);
+	programmer_delay(fill_flash, 100000);
 	if (read_it)
-		ret = do_read(fill_flash, filename);
+		ret = do_read(fill_flash, filename, hash);
 	else if (erase_it) {
 		ret = flashprog_flash_erase(fill_flash);
 		/*
@@ -752,33 +1717,66 @@ int main(int argc, char *argv[])
 		 * knows very well that booting won't work.
 		 */
 		if (ret)
-			emergency_help_message();
+			emergency_help_message(fill_flash);
+	}
+	else if (write_it) {
+		const struct manifest_id id = { prog->name, pparam };
+		ret = do_write(fill_flash, filename, referencefile, manifestfile, journalfile, resume,
+			       &id, dry_run);
 	}
-	else if (write_it)
-		ret = do_write(fill_flash, filename, referencefile);
 	else if (verify_it)
-		ret = do_verify(fill_flash, filename);
+		ret = do_verify(fill_flash, filename, hash, sample_stride, samplecursorfile);
+	else if (hash)
+		ret = do_hash(fill_flash);
+	else if (spireplayfile)
+		ret = spi_trace_replay(fill_flash, spireplayfile);
+	else if (patchfile) {
+		const struct manifest_id id = { prog->name, pparam };
+		ret = do_patch(fill_flash, patchfile, manifestfile, &id, force);
+	}
+	else if (batchfile)
+		ret = batch_run(fill_flash, layout, batchfile);
+#if HAVE_PTHREAD == 1
+	else if (servesocket)
+		ret = serve_run(fill_flash, layout, servesocket);
+#endif
+	else if (benchmark)
+		ret = benchmark_run(fill_flash, allow_destructive);
 
 	flashprog_layout_release(layout);
 
 out_shutdown:
+	/* Probing counts into the first context, so there are also statistics without an operation. */
+	if (show_stats && chipcount)
+		print_stats(&flashes[0], stats_json);
 	flashprog_programmer_shutdown(flashprog);
+	ret |= spi_trace_stop();
 out:
-	for (i = 0; i < chipcount; i++) {
-		flashprog_layout_release(flashes[i].default_layout);
-		free(flashes[i].chip);
-	}
+	release_flashes(flashes, &chipcount);
 
+	for (i = 0; i < (int)gang_count; i++)
+		free(gang_devs[i].prog_param);
+	free(gang_devs);
 	cleanup_include_args(&include_args);
 	free(filename);
 	free(fmapfile);
 	free(referencefile);
+	free(manifestfile);
+	free(journalfile);
+	free(patchfile);
+	free(batchfile);
+	free(servesocket);
+	free(probecachefile);
+	free(samplecursorfile);
+	free(spitracefile);
+	free(spireplayfile);
 	free(layoutfile);
 	free(pparam);
 	/* clean up global variables */
-	free((char *)chip_to_probe); /* Silence! Freeing is not modifying contents. */
-	chip_to_probe = NULL;
+	free(chip_to_probe);
 	free(logfile);
+	free(jsonlogfile);
 	ret |= close_logfile();
+	ret |= close_json_log();
 	return ret;
 }
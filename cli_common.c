@@ -18,7 +18,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "flash.h"
+#include "sha256.h"
 
 void print_chip_support_status(const struct flashchip *chip)
 {
@@ -76,3 +78,31 @@ void print_chip_support_status(const struct flashchip *chip)
 			  "Thanks for your help!\n");
 	}
 }
+
+void print_sha256(const unsigned char digest[SHA256_DIGEST_LEN])
+{
+	size_t i;
+
+	msg_ginfo("SHA-256 of the flash contents: ");
+	for (i = 0; i < SHA256_DIGEST_LEN; ++i)
+		msg_ginfo("%02x", digest[i]);
+	msg_ginfo("\n");
+}
+
+/* Parse a SHA-256 digest from 64 hex digits. Returns 0 on success, 1 if `hex` isn't one. */
+int parse_sha256(const char *hex, uint8_t digest[SHA256_DIGEST_LEN])
+{
+	unsigned int i;
+
+	for (i = 0; i < SHA256_DIGEST_LEN * 2; ++i) {
+		if (!isxdigit((unsigned char)hex[i]))
+			return 1;
+	}
+	if (hex[i] && !isspace((unsigned char)hex[i]))
+		return 1;
+	for (i = 0; i < SHA256_DIGEST_LEN; ++i) {
+		const char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+		digest[i] = strtoul(byte, NULL, 16);
+	}
+	return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Gang programming writes one image to a list of programmers. The image
+ * is read once and shared. If all drivers keep their state per programmer
+ * (see `multi_instance`), the devices are initialized and probed one after
+ * another and then written concurrently, one thread per device. Otherwise,
+ * they are handled one after another. Several chips on one programmer are
+ * always written at once.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if HAVE_PTHREAD == 1
+#include <pthread.h>
+#endif
+#include "flash.h"
+#include "libflashprog.h"
+
+struct gang_slot {
+	struct gang_device *dev;
+	size_t index;
+	struct flashprog_programmer *flashprog;
+	struct flashprog_flashctx *flashes[256];
+	const struct gang_config *cfg;
+	const struct image_buf *image;
+	struct gang_run *run;
+	/* Last reported progress, guarded by `run->lock`. */
+	enum flashprog_progress_stage stage;
+	unsigned int pc;
+};
+
+struct gang_run {
+	struct gang_slot *slots;
+	size_t count;
+#if HAVE_PTHREAD == 1
+	pthread_mutex_t lock;
+#endif
+};
+
+static const char *gang_result_str(const enum gang_result result)
+{
+	switch (result) {
+	case GANG_RESULT_OK:		return "OK";
+	case GANG_RESULT_SKIPPED:	return "skipped";
+	case GANG_RESULT_INIT:		return "programmer initialization failed";
+	case GANG_RESULT_PROBE:		return "no matching flash chip";
+	case GANG_RESULT_MULTIPLE:	return "multiple flash chips match, use -c";
+	case GANG_RESULT_IMAGE:		return "can't read image";
+	case GANG_RESULT_SIZE:		return "flash size doesn't match image";
+	case GANG_RESULT_WRITE:		return "write FAILED";
+	default:			return "FAILED";
+	}
+}
+
+#if HAVE_PTHREAD == 1
+static char gang_stage_char(const enum flashprog_progress_stage stage)
+{
+	switch (stage) {
+	case FLASHPROG_PROGRESS_READ:	return 'R';
+	case FLASHPROG_PROGRESS_WRITE:	return 'W';
+	case FLASHPROG_PROGRESS_ERASE:	return 'E';
+	default:			return '?';
+	}
+}
+
+/*
+ * The progress of concurrently written devices is shown on one line,
+ * e.g. ` 1:W 42%  2:E  7%`, as separate progress bars would overwrite
+ * each other.
+ */
+static void gang_progress_cb(const enum flashprog_progress_stage stage,
+			     const size_t current, const size_t total, void *const user_data)
+{
+	struct gang_slot *const slot = user_data;
+	struct gang_run *const run = slot->run;
+	const unsigned int pc = total ? (current * 100ull) / total : 100;
+	size_t i;
+
+	pthread_mutex_lock(&run->lock);
+	if (slot->stage != stage || slot->pc != pc) {
+		slot->stage = stage;
+		slot->pc = pc;
+		printf("\r");
+		for (i = 0; i < run->count; ++i) {
+			const struct gang_slot *const other = &run->slots[i];
+			if (other->pc > 100)
+				continue;
+			printf(" %zu:%c%3u%%", other->index + 1, gang_stage_char(other->stage), other->pc);
+		}
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&run->lock);
+}
+#endif
+
+/* Initializes the programmer and probes all its chips. Opens the image for the first device. */
+static enum gang_result gang_prepare_device(struct gang_slot *const slot, const char *const filename,
+					    struct image_buf *const image, const bool concurrent)
+{
+	const struct gang_config *const cfg = slot->cfg;
+	struct gang_device *const dev = slot->dev;
+	enum gang_result ret = GANG_RESULT_OK;
+	unsigned int cs;
+
+	if (flashprog_programmer_init(&slot->flashprog, dev->prog_name, dev->prog_param)) {
+		slot->flashprog = NULL;
+		return GANG_RESULT_INIT;
+	}
+
+	for (cs = 0; cs < cfg->chip_selects && ret == GANG_RESULT_OK; ++cs) {
+		const int probe_ret = flashprog_flash_probe_cs(&slot->flashes[cs], slot->flashprog,
+							       cfg->chip_name, cs);
+		if (probe_ret) {
+			ret = probe_ret == 3 ? GANG_RESULT_MULTIPLE : GANG_RESULT_PROBE;
+			break;
+		}
+		struct flashprog_flashctx *const flash = slot->flashes[cs];
+
+		const size_t flash_size = flashprog_flash_getsize(flash);
+		if (cfg->chip_selects > 1)
+			msg_ginfo("Found %s flash chip \"%s\" (%zu kB) on chip select %u.\n",
+				  flash->chip->vendor, flash->chip->name, flash_size / KiB, cs);
+		else
+			msg_ginfo("Found %s flash chip \"%s\" (%zu kB).\n",
+				  flash->chip->vendor, flash->chip->name, flash_size / KiB);
+
+		/* The first device found determines the image size. */
+		if (!image->buf) {
+			if (image_buf_open(image, flash_size, filename))
+				ret = GANG_RESULT_IMAGE;
+		} else if (flash_size != image->size) {
+			ret = GANG_RESULT_SIZE;
+		}
+
+		/* Progress lines of several chips would overwrite each other. */
+		if (cfg->show_progress && cs == 0) {
+#if HAVE_PTHREAD == 1
+			if (concurrent)
+				flashprog_set_progress_callback(flash, &gang_progress_cb, slot);
+			else
+#endif
+				flashprog_set_progress_callback(flash, &flashprog_progress_cb, flash);
+			flashprog_set_progress_interval(flash, 100, 0);
+		}
+		flashprog_layout_set(flash, cfg->layout);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_FORCE, cfg->force);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_VERIFY_AFTER_WRITE, cfg->verify);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_VERIFY_WHOLE_CHIP, cfg->verify_all);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_STREAMING_WRITE, cfg->streaming);
+		flashprog_erase_check_set(flash, cfg->erase_check);
+	}
+
+	return ret;
+}
+
+static enum gang_result gang_write_prepared(struct gang_slot *const slot)
+{
+	const struct image_buf *const image = slot->image;
+	int write_ret;
+
+	if (slot->cfg->chip_selects > 1)
+		write_ret = flashprog_image_write_multi(slot->flashes, slot->cfg->chip_selects,
+							image->buf, image->size);
+	else
+		write_ret = flashprog_image_write(slot->flashes[0], image->buf, image->size, NULL);
+
+	return write_ret ? GANG_RESULT_WRITE : GANG_RESULT_OK;
+}
+
+static void gang_release_device(struct gang_slot *const slot)
+{
+	unsigned int cs;
+
+	for (cs = 0; cs < slot->cfg->chip_selects; ++cs) {
+		flashprog_flash_release(slot->flashes[cs]);
+		slot->flashes[cs] = NULL;
+	}
+	if (slot->flashprog)
+		flashprog_programmer_shutdown(slot->flashprog);
+	slot->flashprog = NULL;
+}
+
+static void gang_print_header(const struct gang_slot *const slot, const size_t count)
+{
+	const char *const param = slot->dev->prog_param ? slot->dev->prog_param : "";
+
+	msg_ginfo("\n=== Device %zu/%zu: %s%s%s ===\n",
+		  slot->index + 1, count, slot->dev->prog_name, *param ? ":" : "", param);
+}
+
+static void gang_print_result(const struct gang_slot *const slot)
+{
+	if (slot->dev->result != GANG_RESULT_OK)
+		msg_gerr("Device %zu: %s.\n", slot->index + 1, gang_result_str(slot->dev->result));
+}
+
+static void gang_write_sequential(struct gang_run *const run, const char *const filename,
+				  struct image_buf *const image)
+{
+	size_t i;
+
+	for (i = 0; i < run->count; ++i) {
+		struct gang_slot *const slot = &run->slots[i];
+
+		gang_print_header(slot, run->count);
+		slot->dev->result = gang_prepare_device(slot, filename, image, false);
+		if (slot->dev->result == GANG_RESULT_OK)
+			slot->dev->result = gang_write_prepared(slot);
+		gang_release_device(slot);
+		gang_print_result(slot);
+		/* Without an image, there is nothing to write to the other devices. */
+		if (slot->dev->result == GANG_RESULT_IMAGE)
+			break;
+	}
+}
+
+#if HAVE_PTHREAD == 1
+static void *gang_write_thread(void *const arg)
+{
+	struct gang_slot *const slot = arg;
+	struct gang_run *const run = slot->run;
+
+	slot->dev->result = gang_write_prepared(slot);
+
+	pthread_mutex_lock(&run->lock);
+	slot->pc = (unsigned int)-1;	/* Drop it from the progress line. */
+	/* A progress line is left unterminated. */
+	msg_ginfo("%sDevice %zu: %s.\n", slot->cfg->show_progress ? "\n" : "",
+		  slot->index + 1, gang_result_str(slot->dev->result));
+	pthread_mutex_unlock(&run->lock);
+	return NULL;
+}
+
+static void gang_write_concurrent(struct gang_run *const run, const char *const filename,
+				  struct image_buf *const image)
+{
+	pthread_t *const threads = calloc(run->count, sizeof(*threads));
+	bool *const started = calloc(run->count, sizeof(*started));
+	size_t i, prepared = 0;
+
+	if (!threads || !started) {
+		free(threads);
+		free(started);
+		msg_gerr("Out of memory, writing the devices one after another.\n");
+		gang_write_sequential(run, filename, image);
+		return;
+	}
+
+	for (i = 0; i < run->count; ++i) {
+		struct gang_slot *const slot = &run->slots[i];
+
+		gang_print_header(slot, run->count);
+		slot->dev->result = gang_prepare_device(slot, filename, image, true);
+		gang_print_result(slot);
+		prepared += slot->dev->result == GANG_RESULT_OK;
+		/* Without an image, there is nothing to write to the other devices. */
+		if (slot->dev->result == GANG_RESULT_IMAGE)
+			break;
+	}
+
+	if (prepared)
+		msg_ginfo("\nWriting %zu devices concurrently...\n", prepared);
+	for (i = 0; i < run->count; ++i) {
+		struct gang_slot *const slot = &run->slots[i];
+
+		if (slot->dev->result != GANG_RESULT_OK) {
+			slot->pc = (unsigned int)-1;
+			continue;
+		}
+		if (pthread_create(&threads[i], NULL, gang_write_thread, slot)) {
+			msg_gerr("Device %zu: Couldn't start a thread, writing it directly.\n", i + 1);
+			gang_write_thread(slot);
+			continue;
+		}
+		started[i] = true;
+	}
+	for (i = 0; i < run->count; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < run->count; ++i)
+		gang_release_device(&run->slots[i]);
+
+	free(started);
+	free(threads);
+}
+#endif
+
+/*
+ * Write the image in `filename` to all `count` devices. The result for
+ * each device is stored in its `result` field and a summary is printed.
+ *
+ * Returns 0 if all devices were written successfully, 1 otherwise.
+ */
+int gang_write(struct gang_device *const devs, const size_t count,
+	       const char *const filename, const struct gang_config *const cfg)
+{
+	struct image_buf image = { 0 };
+	struct gang_run run = { .count = count };
+	bool concurrent = count > 1;
+	size_t i, succeeded = 0;
+
+	run.slots = calloc(count, sizeof(*run.slots));
+	if (!run.slots) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		devs[i].result = GANG_RESULT_SKIPPED;
+		run.slots[i].dev = &devs[i];
+		run.slots[i].index = i;
+		run.slots[i].cfg = cfg;
+		run.slots[i].image = &image;
+		run.slots[i].run = &run;
+		run.slots[i].pc = (unsigned int)-1;
+		concurrent &= devs[i].multi_instance;
+	}
+
+#if HAVE_PTHREAD == 1
+	if (concurrent && !pthread_mutex_init(&run.lock, NULL)) {
+		gang_write_concurrent(&run, filename, &image);
+		pthread_mutex_destroy(&run.lock);
+	} else
+#endif
+	{
+		gang_write_sequential(&run, filename, &image);
+	}
+	image_buf_close(&image, false);
+	free(run.slots);
+
+	msg_ginfo("\nGang programming summary:\n");
+	for (i = 0; i < count; ++i) {
+		const char *const param = devs[i].prog_param ? devs[i].prog_param : "";
+		msg_ginfo("  %2zu  %s%s%s: %s\n", i + 1, devs[i].prog_name, *param ? ":" : "", param,
+			  gang_result_str(devs[i].result));
+		succeeded += devs[i].result == GANG_RESULT_OK;
+	}
+	msg_ginfo("%zu of %zu devices written successfully.\n", succeeded, count);
+
+	return succeeded == count ? 0 : 1;
+}
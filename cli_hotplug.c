@@ -0,0 +1,139 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Hotplug mode runs a batch script on every board of a production run.
+ * It waits for a USB programmer of the selected type to be plugged in,
+ * runs the script and then waits for the programmer to be removed again.
+ * The libusb context stays initialized all along, the programmer driver
+ * shares it. SIGINT or SIGTERM cancel the running job and stop waiting.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "flash.h"
+#include "programmer.h"
+#include "libflashprog.h"
+
+/* Let the system settle (e.g. apply device permissions) after arrival. */
+#define HOTPLUG_SETTLE_US	(200 * 1000)
+#define HOTPLUG_POLL_MS		250
+
+static volatile sig_atomic_t hotplug_stop;
+
+static void hotplug_signal(int sig)
+{
+	(void)sig;
+	hotplug_stop = 1;
+	batch_cancel();
+}
+
+/* Returns 0 once the state is reached, 1 if stopped, -1 on errors. */
+static int hotplug_wait(const bool present)
+{
+	while (!hotplug_stop) {
+		const int ret = usb_dev_watch_wait(present, HOTPLUG_POLL_MS);
+		if (ret <= 0)
+			return ret;
+	}
+	return 1;
+}
+
+static int hotplug_job(const struct hotplug_config *const cfg)
+{
+	struct flashprog_programmer *flashprog;
+	struct flashprog_flashctx *flash;
+	int ret;
+
+	if (flashprog_programmer_init(&flashprog, cfg->prog->name, cfg->prog_param)) {
+		msg_gerr("Error: Programmer initialization failed.\n");
+		return 1;
+	}
+
+	ret = flashprog_flash_probe(&flash, flashprog, cfg->chip_name);
+	if (ret == 3) {
+		msg_gerr("Error: Multiple flash chips match, use -c.\n");
+	} else if (ret) {
+		msg_gerr("Error: No matching flash chip found.\n");
+	} else {
+		msg_ginfo("Found %s flash chip \"%s\" (%zu kB).\n", flash->chip->vendor, flash->chip->name,
+			  flashprog_flash_getsize(flash) / KiB);
+		flashprog_layout_set(flash, cfg->layout);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_FORCE, cfg->force);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_VERIFY_AFTER_WRITE, cfg->verify);
+		flashprog_flag_set(flash, FLASHPROG_FLAG_VERIFY_WHOLE_CHIP, cfg->verify_all);
+		flashprog_erase_check_set(flash, cfg->erase_check);
+
+		ret = batch_run(flash, cfg->layout, cfg->script);
+		flashprog_flash_release(flash);
+	}
+
+	flashprog_programmer_shutdown(flashprog);
+	return ret;
+}
+
+/*
+ * Run the batch script of `cfg` once for every arrival of a matching
+ * USB programmer, until interrupted.
+ *
+ * Returns 0 if all jobs succeeded, 1 otherwise.
+ */
+int hotplug_run(const struct hotplug_config *const cfg)
+{
+	struct sigaction sa = { .sa_handler = hotplug_signal };
+	struct sigaction old_int, old_term;
+	unsigned int jobs = 0, failed = 0;
+	int ret = 0;
+
+	if (cfg->prog->type != USB) {
+		msg_gerr("Error: Programmer `%s' is not a USB device.\n", cfg->prog->name);
+		return 1;
+	}
+
+	if (usb_dev_watch_start(cfg->prog->devs.dev))
+		return 1;
+
+	/* No SA_RESTART, waiting shall return when we are stopped. */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	while (!hotplug_stop) {
+		msg_ginfo("\nWaiting for a `%s' programmer to be plugged in...\n", cfg->prog->name);
+		ret = hotplug_wait(true);
+		if (ret)
+			break;
+
+		internal_delay(HOTPLUG_SETTLE_US);
+		msg_ginfo("=== Job %u ===\n", ++jobs);
+		if (hotplug_job(cfg)) {
+			msg_gerr("Job %u FAILED.\n", jobs);
+			++failed;
+		} else {
+			msg_ginfo("Job %u done.\n", jobs);
+		}
+
+		msg_ginfo("Remove the programmer to start the next job.\n");
+		ret = hotplug_wait(false);
+		if (ret)
+			break;
+	}
+	msg_ginfo("\n%u of %u jobs done successfully.\n", jobs - failed, jobs);
+
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGINT, &old_int, NULL);
+	usb_dev_watch_stop();
+	return ret < 0 || failed ? 1 : 0;
+}
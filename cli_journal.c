@@ -0,0 +1,346 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * An operation journal records every erase and write of a running write
+ * as soon as it completed. If the write is interrupted, a later run with
+ * the same chip, programmer, image and regions can resume it: the ranges
+ * that the journal records are taken from there instead of being read,
+ * and blocks that were already written don't need another erase.
+ *
+ *   # flashprog journal 1
+ *   chip: <vendor> <name> <manufacturer id>/<model id> <size> kB
+ *   programmer: <name>[:<parameters>]
+ *   image: <SHA-256 of the new image>
+ *   regions: <included spans>
+ *   erase 0x<offset> 0x<length>
+ *   write 0x<offset> 0x<length> <CRC-32 of the written data>
+ *   restore 0x<offset> 0x<length>
+ *   ...
+ *
+ * `restore` records writes of data outside the included regions, that
+ * was preserved around an erase block. Its contents are read again.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+#include "layout.h"
+#include "sha256.h"
+
+#define JOURNAL_MAGIC		"# flashprog journal 1"
+
+static struct {
+	FILE *file;
+	const uint8_t *newcontents;
+	const struct flashprog_layout *layout;
+	flashprog_event_callback *next_callback;	/* e.g. for --log-json */
+	void *next_user_data;
+} journal;
+
+/* The header identifies chip, programmer, image and regions. A journal is only used if it matches exactly. */
+static char *journal_header(const struct flashctx *flash, const struct manifest_id *id,
+			    const uint8_t *newcontents)
+{
+	const struct flashchip *const chip = flash->chip;
+	const char *const param = id->prog_param ? id->prog_param : "";
+	const struct flashprog_layout *const layout = get_layout(flash);
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char image[SHA256_DIGEST_LEN * 2 + 1];
+	struct sha256_ctx hash;
+	chipoff_t start = 0, end;
+	size_t len, regions_len = 0;
+	char *regions = NULL;
+	unsigned int i;
+
+	sha256_init(&hash);
+	sha256_update(&hash, newcontents, chip->total_size * KiB);
+	sha256_final(&hash, digest);
+	for (i = 0; i < SHA256_DIGEST_LEN; ++i)
+		snprintf(image + i * 2, 3, "%02x", digest[i]);
+
+	while (layout_next_included_span(layout, start, &start, &end)) {
+		char *const more = realloc(regions, regions_len + 2 * 11 + 2);
+		if (!more) {
+			msg_gerr("Out of memory!\n");
+			free(regions);
+			return NULL;
+		}
+		regions = more;
+		regions_len += sprintf(regions + regions_len, " 0x%08x-0x%08x", start, end);
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+
+	const char *const fmt = JOURNAL_MAGIC "\n"
+				"chip: %s %s 0x%02x/0x%04x %u kB\n"
+				"programmer: %s%s%s\n"
+				"image: %s\n"
+				"regions:%s\n";
+#define HEADER_ARGS chip->vendor, chip->name, chip->manufacture_id, chip->model_id, chip->total_size, \
+		    id->prog_name, *param ? ":" : "", param, image, regions ? regions : ""
+
+	len = snprintf(NULL, 0, fmt, HEADER_ARGS);
+	char *const header = malloc(len + 1);
+	if (!header) {
+		msg_gerr("Out of memory!\n");
+		free(regions);
+		return NULL;
+	}
+	snprintf(header, len + 1, fmt, HEADER_ARGS);
+#undef HEADER_ARGS
+	free(regions);
+	return header;
+}
+
+/* Check the header, returns the opened journal positioned at the first step, or NULL. */
+static FILE *journal_open(const struct flashctx *flash, const char *path, const struct manifest_id *id,
+			  const uint8_t *newcontents)
+{
+	char *expected = NULL, *header = NULL;
+	size_t expected_len;
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		if (errno != ENOENT)
+			msg_gwarn("Warning: Can't open journal `%s': %s\n", path, strerror(errno));
+		else
+			msg_ginfo("No journal `%s' to resume from.\n", path);
+		return NULL;
+	}
+
+	expected = journal_header(flash, id, newcontents);
+	if (!expected)
+		goto _close_ret;
+	expected_len = strlen(expected);
+
+	header = malloc(expected_len);
+	if (!header) {
+		msg_gerr("Out of memory!\n");
+		goto _close_ret;
+	}
+	if (fread(header, 1, expected_len, f) != expected_len ||
+	    memcmp(header, expected, expected_len)) {
+		msg_ginfo("Journal `%s' doesn't match chip, programmer, image or regions, ignoring it.\n", path);
+		goto _close_ret;
+	}
+	free(header);
+	free(expected);
+	return f;
+
+_close_ret:
+	free(header);
+	free(expected);
+	fclose(f);
+	return NULL;
+}
+
+/*
+ * Replay the steps of the journal `f` into `refcontents` and mark the
+ * bytes that they determine in `known`. Returns the range of the last
+ * write in `last_start` and `last_len` (zero if there was none).
+ */
+static void journal_replay(const struct flashctx *flash, FILE *f, const uint8_t *newcontents,
+			   uint8_t *refcontents, uint8_t *known, size_t *last_start, size_t *last_len)
+{
+	const size_t flash_size = flash->chip->total_size * KiB;
+	char line[80], op[8];
+	size_t start, len;
+	uint32_t crc;
+
+	*last_start = *last_len = 0;
+	while (fgets(line, sizeof(line), f)) {
+		/* An interrupted run may have left a partial line at the end. */
+		if (!strchr(line, '\n'))
+			break;
+		const int fields = sscanf(line, "%7s 0x%zx 0x%zx %8" SCNx32, op, &start, &len, &crc);
+		if (fields < 3 || !len || start >= flash_size || len > flash_size - start)
+			break;
+
+		if (!strcmp(op, "erase") && fields == 3) {
+			memset(refcontents + start, ERASED_VALUE(flash), len);
+			memset(known + start, 1, len);
+		} else if (!strcmp(op, "write") && fields == 4) {
+			if (crc != crc32_update(0, newcontents + start, len))
+				break;
+			memcpy(refcontents + start, newcontents + start, len);
+			memset(known + start, 1, len);
+			*last_start = start;
+			*last_len = len;
+		} else if (!strcmp(op, "restore") && fields == 3) {
+			memset(known + start, 0, len);
+		} else {
+			break;
+		}
+	}
+}
+
+/*
+ * Fill `refcontents` with the current flash contents to resume the write
+ * recorded in the journal at `path`. Ranges that the journal determines
+ * are taken from there, all others are read from the chip. The last write
+ * in the journal is read back to confirm it. If the journal can't be used,
+ * the whole chip is read and `resumed` is false.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int journal_prepare(struct flashctx *flash, const char *path, const struct manifest_id *id,
+		    const uint8_t *newcontents, uint8_t *refcontents, bool *resumed)
+{
+	const size_t flash_size = flash->chip->total_size * KiB;
+	size_t last_start = 0, last_len = 0, known_count = 0, i;
+	uint8_t *known = NULL;
+	int ret = 1;
+
+	*resumed = false;
+
+	known = calloc(flash_size, 1);
+	if (!known) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	if (prepare_flash_access(flash, true, false, false, false))
+		goto _free_ret;
+
+	FILE *const f = journal_open(flash, path, id, newcontents);
+	if (f) {
+		journal_replay(flash, f, newcontents, refcontents, known, &last_start, &last_len);
+		fclose(f);
+
+		uint8_t *const buf = last_len ? malloc(last_len) : NULL;
+		if (last_len && (!buf || flashprog_read_range(flash, buf, last_start, last_len) ||
+				 memcmp(buf, newcontents + last_start, last_len))) {
+			msg_ginfo("Flash contents don't match journal `%s' at 0x%06zx, ignoring it.\n",
+				  path, last_start);
+			memset(known, 0, flash_size);
+		} else {
+			*resumed = true;
+		}
+		free(buf);
+	}
+
+	for (i = 0; i < flash_size; ++i)
+		known_count += known[i];
+	if (*resumed)
+		msg_ginfo("Resuming from journal `%s', it covers %zu of %zu bytes.\n",
+			  path, known_count, flash_size);
+
+	msg_ginfo("Reading the remaining flash chip contents... ");
+	for (i = 0; i < flash_size; ) {
+		if (known[i]) {
+			++i;
+			continue;
+		}
+
+		/* Read consecutive unknown bytes at once. */
+		const size_t start = i;
+		for (; i < flash_size && !known[i]; ++i)
+			;
+		if (flashprog_read_range(flash, refcontents + start, start, i - start)) {
+			msg_ginfo("FAILED.\n");
+			goto _finalize_ret;
+		}
+	}
+	msg_ginfo("done.\n");
+	ret = 0;
+
+_finalize_ret:
+	finalize_flash_access(flash);
+_free_ret:
+	free(known);
+	return ret;
+}
+
+/* Record completed erases and writes, and pass all events on. */
+static void journal_event_cb(const struct flashprog_event *const event, void *const user_data)
+{
+	if (journal.file && !event->result) {
+		chipoff_t start, end;
+		if (event->id == FLASHPROG_EVENT_ERASE_BLOCK) {
+			fprintf(journal.file, "erase 0x%zx 0x%zx\n", event->start, event->len);
+		} else if (event->id == FLASHPROG_EVENT_WRITE) {
+			if (layout_next_included_span(journal.layout, event->start, &start, &end) &&
+			    start == event->start && end >= event->start + event->len - 1)
+				fprintf(journal.file, "write 0x%zx 0x%zx %08" PRIx32 "\n", event->start,
+					event->len, crc32_update(0, journal.newcontents + event->start,
+								 event->len));
+			else
+				fprintf(journal.file, "restore 0x%zx 0x%zx\n", event->start, event->len);
+		}
+		/* Every step has to survive an interruption right after it. */
+		if (fflush(journal.file)) {
+			msg_gwarn("Warning: Can't write journal: %s\n", strerror(errno));
+			fclose(journal.file);
+			journal.file = NULL;
+		}
+	}
+
+	if (journal.next_callback)
+		journal.next_callback(event, journal.next_user_data);
+}
+
+/*
+ * Start recording the write of `newcontents` to the journal at `path`.
+ * If `append`, the journal was resumed and the new steps are added to it.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int journal_start(struct flashctx *flash, const char *path, const struct manifest_id *id,
+		  const uint8_t *newcontents, bool append)
+{
+	journal.file = fopen(path, append ? "ab" : "wb");
+	if (!journal.file) {
+		msg_gerr("Error: Can't write journal `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (!append) {
+		char *const header = journal_header(flash, id, newcontents);
+		if (!header || fputs(header, journal.file) == EOF || fflush(journal.file)) {
+			if (header)
+				msg_gerr("Error: Can't write journal `%s': %s\n", path, strerror(errno));
+			free(header);
+			fclose(journal.file);
+			journal.file = NULL;
+			return 1;
+		}
+		free(header);
+	}
+
+	journal.newcontents = newcontents;
+	journal.layout = get_layout(flash);
+	journal.next_callback = flash->event.callback;
+	journal.next_user_data = flash->event.user_data;
+	flashprog_set_event_callback(flash, journal_event_cb, NULL);
+	return 0;
+}
+
+/* Stop recording. The journal is removed after a successful write, otherwise it's kept to resume. */
+void journal_finish(struct flashctx *flash, const char *path, bool success)
+{
+	flashprog_set_event_callback(flash, journal.next_callback, journal.next_user_data);
+	if (journal.file && fclose(journal.file))
+		msg_gwarn("Warning: Can't write journal `%s': %s\n", path, strerror(errno));
+	journal.file = NULL;
+
+	if (success && remove(path) && errno != ENOENT)
+		msg_gwarn("Warning: Can't remove journal `%s': %s\n", path, strerror(errno));
+}
@@ -0,0 +1,473 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A content manifest records a CRC-32 for every block of the flash chip
+ * after a successful write. On the next write, blocks whose recorded CRC
+ * matches the new image are assumed to be up to date and are not read.
+ * The SHA-256 of the whole contents is recorded too, it identifies the
+ * base image of a patch (cf. cli_patch.c).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+#include "layout.h"
+#include "sha256.h"
+
+#define MANIFEST_MAGIC		"# flashprog manifest 1"
+/* Number of blocks read back to confirm a manifest, if the programmer can't calculate checksums. */
+#define MANIFEST_SAMPLES	4
+
+struct manifest {
+	unsigned int block_size;
+	unsigned int block_count;
+	uint32_t *crcs;
+	bool has_sha256;	/* older manifests don't record it */
+	uint8_t sha256[SHA256_DIGEST_LEN];
+};
+
+/* Use the smallest erase block size, so a manifest block never spans two erase blocks. */
+static unsigned int manifest_block_size(const struct flashctx *flash)
+{
+	const struct flashchip *const chip = flash->chip;
+	unsigned int i, j, size = chip->total_size * KiB;
+
+	for (i = 0; i < NUM_ERASEFUNCTIONS; ++i) {
+		for (j = 0; j < NUM_ERASEREGIONS; ++j) {
+			const struct eraseblock *const eb = &chip->block_erasers[i].eraseblocks[j];
+			if (eb->size && eb->count && eb->size < size)
+				size = eb->size;
+		}
+	}
+	return size;
+}
+
+static int manifest_init(struct manifest *m, const struct flashctx *flash)
+{
+	const unsigned int flash_size = flash->chip->total_size * KiB;
+
+	m->block_size = manifest_block_size(flash);
+	m->block_count = (flash_size + m->block_size - 1) / m->block_size;
+	m->has_sha256 = false;
+	m->crcs = calloc(m->block_count, sizeof(*m->crcs));
+	if (!m->crcs) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned int block_len(const struct manifest *m, const struct flashctx *flash, unsigned int i)
+{
+	const unsigned int flash_size = flash->chip->total_size * KiB;
+	return min(m->block_size, flash_size - i * m->block_size);
+}
+
+static void manifest_calculate(struct manifest *m, const struct flashctx *flash, const uint8_t *contents)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->block_count; ++i) {
+		const unsigned int off = i * m->block_size;
+		m->crcs[i] = crc32_update(0, contents + off, block_len(m, flash, i));
+	}
+}
+
+/* The header identifies chip and programmer. A manifest is only used if it matches exactly. */
+static char *manifest_header(const struct manifest *m, const struct flashctx *flash,
+			     const struct manifest_id *id)
+{
+	const struct flashchip *const chip = flash->chip;
+	const char *const param = id->prog_param ? id->prog_param : "";
+	const char *const fmt = MANIFEST_MAGIC "\n"
+				"chip: %s %s 0x%02x/0x%04x %u kB\n"
+				"programmer: %s%s%s\n"
+				"blocksize: %u\n";
+#define HEADER_ARGS chip->vendor, chip->name, chip->manufacture_id, chip->model_id, chip->total_size, \
+		    id->prog_name, *param ? ":" : "", param, m->block_size
+
+	const int len = snprintf(NULL, 0, fmt, HEADER_ARGS);
+	char *const header = len < 0 ? NULL : malloc(len + 1);
+	if (!header) {
+		msg_gerr("Out of memory!\n");
+		return NULL;
+	}
+	snprintf(header, len + 1, fmt, HEADER_ARGS);
+#undef HEADER_ARGS
+	return header;
+}
+
+static int manifest_load(struct manifest *m, const struct flashctx *flash,
+			 const char *path, const struct manifest_id *id)
+{
+	char *expected = NULL, *header = NULL;
+	size_t expected_len;
+	unsigned int i;
+	int ret = 1;
+
+	FILE *const f = fopen(path, "rb");
+	if (!f) {
+		if (errno != ENOENT)
+			msg_gwarn("Warning: Can't open manifest `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	expected = manifest_header(m, flash, id);
+	if (!expected)
+		goto _close_ret;
+	expected_len = strlen(expected);
+
+	header = malloc(expected_len);
+	if (!header) {
+		msg_gerr("Out of memory!\n");
+		goto _close_ret;
+	}
+	if (fread(header, 1, expected_len, f) != expected_len ||
+	    memcmp(header, expected, expected_len)) {
+		msg_ginfo("Manifest `%s' doesn't match chip or programmer, ignoring it.\n", path);
+		goto _close_ret;
+	}
+
+	for (i = 0; i < m->block_count; ++i) {
+		if (fscanf(f, "%8" SCNx32 "\n", &m->crcs[i]) != 1) {
+			msg_gwarn("Warning: Manifest `%s' is truncated, ignoring it.\n", path);
+			goto _close_ret;
+		}
+	}
+	char line[80];
+	if (fgets(line, sizeof(line), f) && !strncmp(line, "sha256: ", 8))
+		m->has_sha256 = !parse_sha256(line + 8, m->sha256);
+	ret = 0;
+
+_close_ret:
+	free(header);
+	free(expected);
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Confirm that blocks marked as `known` still have the recorded contents.
+ * If the programmer can calculate checksums, all of them are checked.
+ * Otherwise, a few blocks spread over the chip are read back.
+ */
+static bool manifest_confirm(struct flashctx *flash, const struct manifest *m,
+			     const bool *known, unsigned int known_count)
+{
+	const unsigned int step = max(known_count / MANIFEST_SAMPLES, 1);
+	unsigned int i, k = 0;
+	bool sampling = false;
+	uint8_t *buf = NULL;
+	bool ret = false;
+
+	for (i = 0; i < m->block_count; ++i) {
+		const unsigned int start = i * m->block_size;
+		const unsigned int len = block_len(m, flash, i);
+		uint32_t crc;
+
+		if (!known[i])
+			continue;
+
+		if (!sampling && programmer_checksum(flash, start, len, &crc))
+			sampling = true;
+		if (sampling) {
+			if (k++ % step)
+				continue;
+			if (!buf) {
+				buf = malloc(m->block_size);
+				if (!buf) {
+					msg_gerr("Out of memory!\n");
+					goto _free_ret;
+				}
+			}
+			if (flash->chip->read(flash, buf, start, len))
+				goto _free_ret;
+			crc = crc32_update(0, buf, len);
+		}
+		if (crc != m->crcs[i]) {
+			msg_cdbg("Manifest mismatch at 0x%08x.\n", start);
+			goto _free_ret;
+		}
+	}
+	ret = true;
+
+_free_ret:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Fill `refcontents` with the current flash contents. Blocks that the
+ * manifest at `path` records with the same contents as `newcontents`
+ * are taken from there, all others are read from the chip.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int manifest_prepare(struct flashctx *flash, const char *path, const struct manifest_id *id,
+		     const uint8_t *newcontents, uint8_t *refcontents)
+{
+	struct manifest m;
+	unsigned int i, known_count = 0;
+	bool *known = NULL;
+	int ret = 1;
+
+	if (manifest_init(&m, flash))
+		return 1;
+
+	known = calloc(m.block_count, sizeof(*known));
+	if (!known) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+
+	if (prepare_flash_access(flash, true, false, false, false))
+		goto _free_ret;
+
+	if (!manifest_load(&m, flash, path, id)) {
+		for (i = 0; i < m.block_count; ++i) {
+			const unsigned int off = i * m.block_size;
+			known[i] = m.crcs[i] == crc32_update(0, newcontents + off, block_len(&m, flash, i));
+			known_count += known[i];
+		}
+		if (known_count && !manifest_confirm(flash, &m, known, known_count)) {
+			msg_ginfo("Flash contents don't match manifest `%s', ignoring it.\n", path);
+			memset(known, 0, m.block_count * sizeof(*known));
+			known_count = 0;
+		}
+	}
+
+	msg_ginfo("Manifest covers %u of %u blocks, reading the rest... ", known_count, m.block_count);
+	for (i = 0; i < m.block_count; ) {
+		const unsigned int start = i * m.block_size;
+
+		if (known[i]) {
+			memcpy(refcontents + start, newcontents + start, block_len(&m, flash, i));
+			++i;
+			continue;
+		}
+
+		/* Read consecutive unknown blocks at once. */
+		unsigned int len = 0;
+		for (; i < m.block_count && !known[i]; ++i)
+			len += block_len(&m, flash, i);
+		if (flashprog_read_range(flash, refcontents + start, start, len)) {
+			msg_ginfo("FAILED.\n");
+			goto _finalize_ret;
+		}
+	}
+	msg_ginfo("done.\n");
+	ret = 0;
+
+_finalize_ret:
+	finalize_flash_access(flash);
+_free_ret:
+	free(known);
+	free(m.crcs);
+	return ret;
+}
+
+static int manifest_write(const struct manifest *m, const struct flashctx *flash,
+			  const char *path, const struct manifest_id *id)
+{
+	unsigned int i;
+
+	char *const header = manifest_header(m, flash, id);
+	if (!header)
+		return 1;
+
+	FILE *const f = fopen(path, "wb");
+	if (!f) {
+		msg_gerr("Error: Can't write manifest `%s': %s\n", path, strerror(errno));
+		free(header);
+		return 1;
+	}
+	fputs(header, f);
+	free(header);
+	for (i = 0; i < m->block_count; ++i)
+		fprintf(f, "%08" PRIx32 "\n", m->crcs[i]);
+	if (m->has_sha256) {
+		fputs("sha256: ", f);
+		for (i = 0; i < SHA256_DIGEST_LEN; ++i)
+			fprintf(f, "%02x", m->sha256[i]);
+		fputs("\n", f);
+	}
+	if (fclose(f)) {
+		msg_gerr("Error: Can't write manifest `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Record the flash contents after a successful write: `newcontents`
+ * in the included layout regions, `refcontents` everywhere else.
+ */
+int manifest_store(struct flashctx *flash, const char *path, const struct manifest_id *id,
+		   const uint8_t *refcontents, const uint8_t *newcontents)
+{
+	const unsigned int flash_size = flash->chip->total_size * KiB;
+	const struct romentry *entry = NULL;
+	struct manifest m = { 0 };
+	int ret = 1;
+
+	uint8_t *const contents = malloc(flash_size);
+	if (!contents) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	memcpy(contents, refcontents, flash_size);
+	while ((entry = layout_next_included(get_layout(flash), entry)))
+		memcpy(contents + entry->start, newcontents + entry->start, entry->end - entry->start + 1);
+
+	if (manifest_init(&m, flash))
+		goto _free_ret;
+	manifest_calculate(&m, flash, contents);
+
+	struct sha256_ctx hash;
+	sha256_init(&hash);
+	sha256_update(&hash, contents, flash_size);
+	sha256_final(&hash, m.sha256);
+	m.has_sha256 = true;
+
+	ret = manifest_write(&m, flash, path, id);
+
+_free_ret:
+	free(m.crcs);
+	free(contents);
+	return ret;
+}
+
+/*
+ * Check that the flash chip holds the image with the SHA-256 `base`: the
+ * manifest at `path` must record it and the chip must still match the
+ * manifest (cf. manifest_confirm()).
+ *
+ * Returns 0 if confirmed, 1 otherwise.
+ */
+int manifest_confirm_base(struct flashctx *flash, const char *path, const struct manifest_id *id,
+			  const uint8_t base[32])
+{
+	struct manifest m;
+	bool *known = NULL;
+	unsigned int i;
+	int ret = 1;
+
+	if (manifest_init(&m, flash))
+		return 1;
+	if (manifest_load(&m, flash, path, id))
+		goto _free_ret;
+	if (!m.has_sha256 || memcmp(m.sha256, base, SHA256_DIGEST_LEN)) {
+		msg_ginfo("Manifest `%s' doesn't record the base image of the patch.\n", path);
+		goto _free_ret;
+	}
+
+	known = malloc(m.block_count * sizeof(*known));
+	if (!known) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+	for (i = 0; i < m.block_count; ++i)
+		known[i] = true;
+
+	if (prepare_flash_access(flash, true, false, false, false))
+		goto _free_ret;
+	if (manifest_confirm(flash, &m, known, m.block_count))
+		ret = 0;
+	else
+		msg_ginfo("Flash contents don't match manifest `%s'.\n", path);
+	finalize_flash_access(flash);
+
+_free_ret:
+	free(known);
+	free(m.crcs);
+	return ret;
+}
+
+/*
+ * Update the manifest at `path` after the extents of a patch were
+ * written on top of the image it records. The blocks touched are
+ * recalculated, from the extent if it covers the block completely,
+ * otherwise from the chip. `result` is the SHA-256 of the new contents.
+ *
+ * Returns 0 on success, 1 on error. The manifest is removed on errors.
+ */
+int manifest_store_patch(struct flashctx *flash, const char *path, const struct manifest_id *id,
+			 const struct flashprog_extent *extents, size_t count, const uint8_t result[32])
+{
+	struct manifest m;
+	uint8_t *buf = NULL;
+	unsigned int i;
+	size_t e = 0;
+	int ret = 1;
+
+	if (manifest_init(&m, flash))
+		return 1;
+	if (manifest_load(&m, flash, path, id))
+		goto _free_ret;
+
+	buf = malloc(m.block_size);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+
+	if (prepare_flash_access(flash, true, false, false, false))
+		goto _free_ret;
+	for (i = 0; i < m.block_count; ++i) {
+		const size_t start = (size_t)i * m.block_size;
+		const size_t len = block_len(&m, flash, i);
+
+		/* Skip extents that end before this block. */
+		while (e < count && extents[e].offset + extents[e].len <= start)
+			++e;
+		if (e == count)
+			break;
+		if (extents[e].offset >= start + len)
+			continue;
+
+		if (extents[e].offset <= start && extents[e].offset + extents[e].len >= start + len) {
+			const uint8_t *const data = extents[e].data;
+			m.crcs[i] = crc32_update(0, data + (start - extents[e].offset), len);
+		} else {
+			if (flashprog_read_range(flash, buf, start, len))
+				goto _finalize_ret;
+			m.crcs[i] = crc32_update(0, buf, len);
+		}
+	}
+	memcpy(m.sha256, result, SHA256_DIGEST_LEN);
+	m.has_sha256 = true;
+	ret = manifest_write(&m, flash, path, id);
+
+_finalize_ret:
+	finalize_flash_access(flash);
+_free_ret:
+	if (ret)
+		manifest_invalidate(path);
+	free(buf);
+	free(m.crcs);
+	return ret;
+}
+
+/* Remove a manifest that may no longer describe the flash contents. */
+void manifest_invalidate(const char *path)
+{
+	if (remove(path) && errno != ENOENT)
+		msg_gwarn("Warning: Can't remove stale manifest `%s': %s\n", path, strerror(errno));
+}
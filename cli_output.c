@@ -17,19 +17,205 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#if HAVE_PTHREAD == 1
+#include <pthread.h>
+#include <time.h>
+#endif
 #include "flash.h"
 
 enum flashprog_log_level verbose_screen = FLASHPROG_MSG_INFO;
 enum flashprog_log_level verbose_logfile = FLASHPROG_MSG_DEBUG2;
+/* Set when stdout carries image data, all messages go to stderr then. */
+bool stdout_is_data = false;
+/* Messages for the screen are also copied here, e.g. to a --serve client. */
+FILE *client_output = NULL;
 
 static FILE *logfile = NULL;
 
+#if HAVE_PTHREAD == 1
+/*
+ * Messages for the log file are collected in a ring buffer that a
+ * background thread writes out every LOG_FLUSH_MS, or earlier if the
+ * ring fills up. So a debug message in a hot loop doesn't cost a
+ * write(). If the ring is full, the printing thread waits. Errors are
+ * written out and flushed before their print call returns, so they
+ * (and everything before them) are on disk if we crash right after.
+ */
+#define LOG_RING_SIZE	(64 * KiB)
+#define LOG_FLUSH_MS	200
+
+static struct {
+	bool running;
+	bool stop;
+	bool kicked;		/* writer was woken up, because the ring is filling up */
+	bool write_failed;
+	size_t head, tail;	/* free running, taken modulo LOG_RING_SIZE */
+	unsigned long flush_req, flush_done;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/* wakes the writer */
+	pthread_cond_t done;	/* signals space in the ring or a finished flush */
+	pthread_t thread;
+	char ring[LOG_RING_SIZE];
+} log_writer = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.wake	= PTHREAD_COND_INITIALIZER,
+	.done	= PTHREAD_COND_INITIALIZER,
+};
+
+static void *log_writer_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&log_writer.lock);
+	while (!log_writer.stop || log_writer.head != log_writer.tail) {
+		if (!log_writer.stop && !log_writer.kicked && log_writer.flush_req == log_writer.flush_done) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&log_writer.wake, &log_writer.lock, &deadline);
+		}
+		log_writer.kicked = false;
+
+		const unsigned long req = log_writer.flush_req;
+		const bool dirty = log_writer.head != log_writer.tail;
+		while (log_writer.head != log_writer.tail) {
+			const size_t pos = log_writer.tail % LOG_RING_SIZE;
+			const size_t len = MIN(log_writer.head - log_writer.tail, LOG_RING_SIZE - pos);
+
+			pthread_mutex_unlock(&log_writer.lock);
+			const bool failed = fwrite(log_writer.ring + pos, 1, len, logfile) != len;
+			pthread_mutex_lock(&log_writer.lock);
+
+			log_writer.write_failed |= failed;
+			log_writer.tail += len;
+			pthread_cond_broadcast(&log_writer.done);
+		}
+		if (dirty) {
+			pthread_mutex_unlock(&log_writer.lock);
+			const bool failed = fflush(logfile) != 0;
+			pthread_mutex_lock(&log_writer.lock);
+			log_writer.write_failed |= failed;
+		}
+		log_writer.flush_done = req;
+		pthread_cond_broadcast(&log_writer.done);
+	}
+	pthread_mutex_unlock(&log_writer.lock);
+	return NULL;
+}
+
+static void log_writer_put(const char *text, size_t len)
+{
+	pthread_mutex_lock(&log_writer.lock);
+	while (len) {
+		const size_t used = log_writer.head - log_writer.tail;
+		if (used == LOG_RING_SIZE) {
+			log_writer.kicked = true;
+			pthread_cond_signal(&log_writer.wake);
+			pthread_cond_wait(&log_writer.done, &log_writer.lock);
+			continue;
+		}
+		const size_t pos = log_writer.head % LOG_RING_SIZE;
+		const size_t n = MIN(len, MIN(LOG_RING_SIZE - used, LOG_RING_SIZE - pos));
+		memcpy(log_writer.ring + pos, text, n);
+		log_writer.head += n;
+		text += n;
+		len -= n;
+	}
+	if (!log_writer.kicked && log_writer.head - log_writer.tail >= LOG_RING_SIZE / 2) {
+		log_writer.kicked = true;
+		pthread_cond_signal(&log_writer.wake);
+	}
+	pthread_mutex_unlock(&log_writer.lock);
+}
+
+/* Wait until everything queued so far is written and flushed. */
+static void log_writer_flush(void)
+{
+	pthread_mutex_lock(&log_writer.lock);
+	const unsigned long req = ++log_writer.flush_req;
+	pthread_cond_signal(&log_writer.wake);
+	while ((long)(log_writer.flush_done - req) < 0)
+		pthread_cond_wait(&log_writer.done, &log_writer.lock);
+	pthread_mutex_unlock(&log_writer.lock);
+}
+
+static void log_writer_start(void)
+{
+	log_writer.stop = false;
+	log_writer.write_failed = false;
+	log_writer.head = log_writer.tail = 0;
+	log_writer.flush_req = log_writer.flush_done = 0;
+	/* Without the thread, we write synchronously. */
+	log_writer.running = !pthread_create(&log_writer.thread, NULL, log_writer_thread, NULL);
+}
+
+/* Returns true if writing failed. */
+static bool log_writer_stop(void)
+{
+	if (!log_writer.running)
+		return false;
+
+	pthread_mutex_lock(&log_writer.lock);
+	log_writer.stop = true;
+	pthread_cond_signal(&log_writer.wake);
+	pthread_mutex_unlock(&log_writer.lock);
+	pthread_join(log_writer.thread, NULL);
+	log_writer.running = false;
+	return log_writer.write_failed;
+}
+
+static void log_writer_message(const enum flashprog_log_level level, const char *fmt, va_list ap)
+{
+	char buf[1024];
+	va_list ap2;
+	int len;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (len >= (int)sizeof(buf)) {
+		char *const text = malloc(len + 1);
+		if (text) {
+			vsnprintf(text, len + 1, fmt, ap2);
+			log_writer_put(text, len);
+			free(text);
+		} else {
+			log_writer_put(buf, sizeof(buf) - 1);
+		}
+	} else if (len > 0) {
+		log_writer_put(buf, len);
+	}
+	va_end(ap2);
+
+	if (level == FLASHPROG_MSG_ERROR)
+		log_writer_flush();
+}
+#endif
+
+/* JSON lines, see open_json_log(). Messages are collected until a newline. */
+static FILE *json_log = NULL;
+static struct {
+	enum flashprog_log_level level;
+	size_t len;
+	char text[1024];
+} json_line;
+
 int close_logfile(void)
 {
 	if (!logfile)
 		return 0;
+#if HAVE_PTHREAD == 1
+	if (log_writer_stop()) {
+		fclose(logfile);
+		logfile = NULL;
+		msg_gerr("Writing the log file failed.\n");
+		return 1;
+	}
+#endif
 	/* No need to call fflush() explicitly, fclose() already does that. */
 	if (fclose(logfile)) {
 		/* fclose returned an error. Stop writing to be safe. */
@@ -51,6 +237,107 @@ int open_logfile(const char * const filename)
 		msg_gerr("Error: opening log file \"%s\" failed: %s\n", filename, strerror(errno));
 		return 1;
 	}
+#if HAVE_PTHREAD == 1
+	log_writer_start();
+#endif
+	return 0;
+}
+
+int open_json_log(const char *const filename)
+{
+	if ((json_log = fopen(filename, "w")) == NULL) {
+		msg_gerr("Error: opening JSON log file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void json_log_string(const char *str, size_t len)
+{
+	for (; len; ++str, --len) {
+		const unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(json_log, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(json_log, "\\u%04x", c);
+		else
+			fputc(c, json_log);
+	}
+}
+
+static const char *json_log_level_name(const enum flashprog_log_level level)
+{
+	switch (level) {
+	case FLASHPROG_MSG_ERROR:	return "error";
+	case FLASHPROG_MSG_WARN:	return "warn";
+	case FLASHPROG_MSG_INFO:	return "info";
+	case FLASHPROG_MSG_DEBUG:	return "debug";
+	case FLASHPROG_MSG_DEBUG2:	return "debug2";
+	case FLASHPROG_MSG_SPEW:	return "spew";
+	}
+	return "unknown";
+}
+
+static void json_log_flush_line(void)
+{
+	if (!json_line.len)
+		return;
+	fprintf(json_log, "{\"type\":\"log\",\"level\":\"%s\",\"msg\":\"",
+		json_log_level_name(json_line.level));
+	json_log_string(json_line.text, json_line.len);
+	fprintf(json_log, "\"}\n");
+	json_line.len = 0;
+}
+
+static void json_log_message(const enum flashprog_log_level level, const char *fmt, va_list ap)
+{
+	char buf[1024];
+	int len, i;
+
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (len < 0)
+		return;
+	len = min(len, (int)sizeof(buf) - 1);
+
+	for (i = 0; i < len; ++i) {
+		if (!json_line.len)
+			json_line.level = level;
+		if (buf[i] == '\n') {
+			json_log_flush_line();
+			continue;
+		}
+		/* Progress bars rewrite the line, that's meaningless here. */
+		if (buf[i] == '\r')
+			continue;
+		json_line.text[json_line.len++] = buf[i];
+		if (json_line.len == sizeof(json_line.text))
+			json_log_flush_line();
+	}
+}
+
+/* Writes one JSON object per event. The IDs and names are stable. */
+void flashprog_event_json_cb(const struct flashprog_event *const event, void *const user_data)
+{
+	if (!json_log)
+		return;
+	/* Keep the order with a partial message line. */
+	json_log_flush_line();
+	fprintf(json_log, "{\"type\":\"event\",\"event\":\"%s\",\"id\":%d,"
+			  "\"start\":%zu,\"len\":%zu,\"result\":%d}\n",
+		flashprog_event_name(event->id), event->id, event->start, event->len, event->result);
+}
+
+int close_json_log(void)
+{
+	if (!json_log)
+		return 0;
+	json_log_flush_line();
+	const int ret = fclose(json_log);
+	json_log = NULL;
+	if (ret) {
+		msg_gerr("Closing the JSON log file returned error %s\n", strerror(errno));
+		return 1;
+	}
 	return 0;
 }
 
@@ -75,24 +362,41 @@ static const char *flashprog_progress_stage_to_string(enum flashprog_progress_st
 	return "Progress";
 }
 
-static void print_progress_bar(enum flashprog_progress_stage stage, unsigned int pc)
+static void print_progress_bar(enum flashprog_progress_stage stage, unsigned int pc,
+			       const struct flashprog_flashctx *flash)
 {
-	char progress_line[73], *bar;
+	char progress_line[80], *bar;
+	unsigned long long rate;
+	unsigned long eta;
 	unsigned int i;
 
 	const int bar_start = snprintf(progress_line, sizeof(progress_line), "%s... [",
 				       flashprog_progress_stage_to_string(stage));
 
-	for (bar = progress_line + bar_start, i = 0; i < pc; i += 2)
+	for (bar = progress_line + bar_start, i = 0; i < pc; i += 4)
 		*bar++ = '=';
 	if (i < 100)
-		*bar++ = '>', i += 2;
-	for (; i < 100; i += 2)
+		*bar++ = '>', i += 4;
+	for (; i < 100; i += 4)
 		*bar++ = ' ';
 
-	snprintf(bar, sizeof(progress_line) - (bar - progress_line), "] %3u%% ", pc);
+	bar += snprintf(bar, sizeof(progress_line) - (bar - progress_line), "] %3u%% ", pc);
 
-	printf("\r%s", progress_line);
+	if (flash && !flashprog_progress_get_rate(flash, &rate, &eta)) {
+		const size_t left = sizeof(progress_line) - (bar - progress_line);
+		const int len = rate >= MiB
+			? snprintf(bar, left, "%6.1f MiB/s", (double)rate / MiB)
+			: snprintf(bar, left, "%6.1f KiB/s", (double)rate / KiB);
+		bar += len;
+		if (pc < 100 && eta >= 3600)
+			snprintf(bar, left - len, ", %lu:%02lu:%02lu left ", eta / 3600, eta / 60 % 60, eta % 60);
+		else if (pc < 100)
+			snprintf(bar, left - len, ", %lu:%02lu left    ", eta / 60, eta % 60);
+		else
+			snprintf(bar, left - len, "%16s", "");
+	}
+
+	fprintf(stdout_is_data ? stderr : stdout, "\r%s", progress_line);
 }
 
 void flashprog_progress_cb(enum flashprog_progress_stage stage, size_t current, size_t total, void *user_data)
@@ -106,9 +410,10 @@ void flashprog_progress_cb(enum flashprog_progress_stage stage, size_t current,
 		return;
 
 	if (last_stage != stage || pc == 0)
-		printf("\n");
+		fprintf(stdout_is_data ? stderr : stdout, "\n");
 
-	print_progress_bar(stage, pc);
+	/* The CLI passes the flash context as `user_data`. */
+	print_progress_bar(stage, pc, user_data);
 	last_stage = stage;
 	last_pc = pc;
 }
@@ -119,10 +424,12 @@ int flashprog_print_cb(enum flashprog_log_level level, const char *fmt, va_list
 	int ret = 0;
 	FILE *output_type = stdout;
 
-	va_list logfile_args;
+	va_list logfile_args, json_args, client_args;
 	va_copy(logfile_args, ap);
+	va_copy(json_args, ap);
+	va_copy(client_args, ap);
 
-	if (level < FLASHPROG_MSG_INFO)
+	if (level < FLASHPROG_MSG_INFO || stdout_is_data)
 		output_type = stderr;
 
 	if (level <= verbose_screen) {
@@ -134,11 +441,29 @@ int flashprog_print_cb(enum flashprog_log_level level, const char *fmt, va_list
 	}
 
 	if ((level <= verbose_logfile) && logfile) {
-		ret = vfprintf(logfile, fmt, logfile_args);
+#if HAVE_PTHREAD == 1
+		if (log_writer.running) {
+			log_writer_message(level, fmt, logfile_args);
+		} else
+#endif
+		{
+			ret = vfprintf(logfile, fmt, logfile_args);
+			if (level != FLASHPROG_MSG_SPEW)
+				fflush(logfile);
+		}
+	}
+
+	if (level <= verbose_screen && json_log)
+		json_log_message(level, fmt, json_args);
+
+	if (level <= verbose_screen && client_output) {
+		vfprintf(client_output, fmt, client_args);
 		if (level != FLASHPROG_MSG_SPEW)
-			fflush(logfile);
+			fflush(client_output);
 	}
 
+	va_end(client_args);
+	va_end(json_args);
 	va_end(logfile_args);
 	return ret;
 }
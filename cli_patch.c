@@ -0,0 +1,148 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A patch describes the changes from a base image to a result image
+ * as a list of extents. It starts with a text header, followed by the
+ * extents, each a line with its offset and length and then the data:
+ *
+ *   # flashprog patch 1
+ *   size: <size of the images in bytes>
+ *   base: <SHA-256 of the base image>
+ *   result: <SHA-256 of the result image>
+ *   extent: 0x<offset> 0x<length>
+ *   <length bytes of data>
+ *   ...
+ *
+ * Extents are sorted by offset and must not overlap.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+
+#define PATCH_MAGIC	"# flashprog patch 1"
+
+static int patch_add_extent(struct patch *patch, FILE *f, const char *path,
+			    const size_t offset, const size_t len, size_t *const capacity)
+{
+	const size_t end = patch->count ? patch->extents[patch->count - 1].offset +
+					  patch->extents[patch->count - 1].len : 0;
+
+	if (!len || offset < end || offset >= patch->size || len > patch->size - offset) {
+		msg_gerr("Error: Extent 0x%zx+0x%zx in patch `%s' overlaps or exceeds the image.\n",
+			 offset, len, path);
+		return 1;
+	}
+
+	if (patch->count == *capacity) {
+		const size_t new_capacity = *capacity ? *capacity * 2 : 16;
+		struct flashprog_extent *const extents =
+			realloc(patch->extents, new_capacity * sizeof(*extents));
+		if (!extents) {
+			msg_gerr("Out of memory!\n");
+			return 1;
+		}
+		patch->extents = extents;
+		*capacity = new_capacity;
+	}
+
+	uint8_t *const data = malloc(len);
+	if (!data) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	if (fread(data, 1, len, f) != len) {
+		msg_gerr("Error: Patch `%s' is truncated.\n", path);
+		free(data);
+		return 1;
+	}
+
+	patch->extents[patch->count].offset = offset;
+	patch->extents[patch->count].len = len;
+	patch->extents[patch->count].data = data;
+	++patch->count;
+	return 0;
+}
+
+int patch_load(struct patch *patch, const char *path)
+{
+	bool have_size = false, have_base = false, have_result = false;
+	size_t capacity = 0, offset, len;
+	char line[128];
+	int ret = 1;
+
+	memset(patch, 0, sizeof(*patch));
+
+	FILE *const f = fopen(path, "rb");
+	if (!f) {
+		msg_gerr("Error: Can't open patch `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PATCH_MAGIC "\n")) {
+		msg_gerr("Error: `%s' is not a flashprog patch.\n", path);
+		goto _close_ret;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "size: %zu", &patch->size) == 1) {
+			have_size = true;
+		} else if (!strncmp(line, "base: ", 6)) {
+			have_base = !parse_sha256(line + 6, patch->base);
+			if (!have_base)
+				break;
+		} else if (!strncmp(line, "result: ", 8)) {
+			have_result = !parse_sha256(line + 8, patch->result);
+			if (!have_result)
+				break;
+		} else if (sscanf(line, "extent: %zx %zx", &offset, &len) == 2) {
+			if (!have_size || !have_base || !have_result)
+				break;
+			if (patch_add_extent(patch, f, path, offset, len, &capacity))
+				goto _close_ret;
+		} else {
+			break;
+		}
+	}
+	if (ferror(f)) {
+		msg_gerr("Error: Reading patch `%s' failed: %s\n", path, strerror(errno));
+		goto _close_ret;
+	}
+	if (!feof(f) || !have_size || !have_base || !have_result) {
+		msg_gerr("Error: Patch `%s' is malformed.\n", path);
+		goto _close_ret;
+	}
+	ret = 0;
+
+_close_ret:
+	fclose(f);
+	if (ret)
+		patch_free(patch);
+	return ret;
+}
+
+void patch_free(struct patch *patch)
+{
+	size_t i;
+
+	for (i = 0; i < patch->count; ++i)
+		free((void *)patch->extents[i].data);
+	free(patch->extents);
+	patch->extents = NULL;
+	patch->count = 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Real-time mode keeps timing-sensitive programmers, e.g. bitbanging
+ * ones, from being preempted in the middle of a transfer. The thread
+ * that talks to the programmer gets the lowest real-time priority and
+ * is pinned to the CPU it currently runs on, and the process memory is
+ * locked, so we don't wait for page faults either. Threads started
+ * later, e.g. the image loader, inherit the priority and the CPU. They
+ * still run whenever the main thread sleeps or waits for them.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "flash.h"
+
+#if defined(__linux__) || (!IS_WINDOWS && defined(_POSIX_PRIORITY_SCHEDULING))
+#include <sched.h>
+#endif
+#if !IS_WINDOWS && defined(_POSIX_MEMLOCK)
+#include <sys/mman.h>
+#endif
+
+static int lock_memory(void)
+{
+#if !IS_WINDOWS && defined(_POSIX_MEMLOCK)
+	/*
+	 * Without privileges, future allocations would count against the
+	 * usually small RLIMIT_MEMLOCK and fail, e.g. for the image buffer.
+	 */
+	const int flags = geteuid() == 0 ? MCL_CURRENT | MCL_FUTURE : MCL_CURRENT;
+
+	if (mlockall(flags)) {
+		msg_gwarn("Warning: Can't lock memory: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+#else
+	msg_gwarn("Warning: Locking memory is not supported on this platform.\n");
+	return 1;
+#endif
+}
+
+static int raise_priority(void)
+{
+#if IS_WINDOWS
+	/* Without administrator rights, this silently gives us HIGH_PRIORITY_CLASS. */
+	if (!SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS) ||
+	    !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+		msg_gwarn("Warning: Can't raise the priority: error %lu\n", GetLastError());
+		return 1;
+	}
+	return 0;
+#elif defined(_POSIX_PRIORITY_SCHEDULING) && defined(SCHED_FIFO)
+	const struct sched_param param = { .sched_priority = sched_get_priority_min(SCHED_FIFO) };
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		msg_gwarn("Warning: Can't switch to real-time scheduling: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+#else
+	msg_gwarn("Warning: Real-time scheduling is not supported on this platform.\n");
+	return 1;
+#endif
+}
+
+static int pin_cpu(void)
+{
+#if defined(__linux__)
+	const int cpu = sched_getcpu();
+	cpu_set_t set;
+
+	if (cpu < 0) {
+		msg_gwarn("Warning: Can't pin to a CPU: %s\n", strerror(errno));
+		return 1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		msg_gwarn("Warning: Can't pin to CPU %d: %s\n", cpu, strerror(errno));
+		return 1;
+	}
+	msg_gdbg("Pinned to CPU %d.\n", cpu);
+	return 0;
+#elif IS_WINDOWS
+	const DWORD cpu = GetCurrentProcessorNumber();
+
+	if (cpu >= 8 * sizeof(DWORD_PTR) || !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) {
+		msg_gwarn("Warning: Can't pin to CPU %lu.\n", cpu);
+		return 1;
+	}
+	msg_gdbg("Pinned to CPU %lu.\n", cpu);
+	return 0;
+#else
+	msg_gwarn("Warning: Pinning to a CPU is not supported on this platform.\n");
+	return 1;
+#endif
+}
+
+/*
+ * Switch the calling thread to real-time mode. Every step is tried,
+ * the ones that fail only result in a warning.
+ *
+ * Returns 0 if all steps succeeded, 1 otherwise.
+ */
+int realtime_enter(void)
+{
+	int ret = 0;
+
+	ret |= lock_memory();
+	ret |= raise_priority();
+	ret |= pin_cpu();
+	if (!ret)
+		msg_ginfo("Running in real-time mode.\n");
+	return ret;
+}
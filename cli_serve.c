@@ -0,0 +1,173 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Server mode keeps the programmer initialized and the chip probed, and
+ * runs jobs sent over a local (Unix domain) socket. A job is a batch
+ * script (see cli_batch.c), sent by the client before it shuts down its
+ * sending side of the connection, e.g. with
+ *
+ *   socat - UNIX-CONNECT:<socket> <script
+ *
+ * While the job runs, all messages are copied to the client, the last
+ * line is either `OK' or `ERROR <result>'. Jobs run one after another,
+ * as they all share the programmer. SIGINT or SIGTERM cancel the running
+ * job and stop the server.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "flash.h"
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+	(void)sig;
+	serve_stop = 1;
+	batch_cancel();
+}
+
+static int serve_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		msg_gerr("Error: Socket path `%s' is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Remove a stale socket of an earlier server, but nothing else. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msg_gerr("Error: Can't create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Only the user running the server may connect. */
+	const mode_t old_umask = umask(0077);
+	const int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if (ret || listen(fd, 4)) {
+		msg_gerr("Error: Can't listen on `%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void serve_client(struct flashctx *flash, const struct flashprog_layout *layout, const int fd)
+{
+	FILE *const in = fdopen(fd, "r");
+	const int out_fd = dup(fd);
+	FILE *const out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+	int ret;
+
+	if (!in || !out) {
+		msg_gerr("Error: Can't set up client connection: %s\n", strerror(errno));
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		if (out)
+			fclose(out);
+		else if (out_fd >= 0)
+			close(out_fd);
+		return;
+	}
+
+	msg_ginfo("Running job of new client.\n");
+	/* The chip may have been changed by others while we were waiting. */
+	read_cache_clear(flash);
+	client_output = out;
+	ret = batch_run_stream(flash, layout, in, "from client");
+	client_output = NULL;
+
+	if (ret)
+		fprintf(out, "ERROR %d\n", ret);
+	else
+		fprintf(out, "OK\n");
+	msg_ginfo("Job %s.\n", ret ? "failed" : "done");
+
+	fclose(out);
+	fclose(in);
+}
+
+/*
+ * Serve jobs on the socket at `path` until interrupted. `layout` holds
+ * the regions that jobs can refer to, it may be NULL.
+ *
+ * Returns 0 if the server was stopped by a signal, 1 on errors.
+ */
+int serve_run(struct flashctx *flash, const struct flashprog_layout *layout, const char *path)
+{
+	struct sigaction sa = { .sa_handler = serve_signal };
+	struct sigaction old_int, old_term, old_pipe;
+	int ret = 0;
+
+	const int fd = serve_listen(path);
+	if (fd < 0)
+		return 1;
+
+	/* No SA_RESTART, blocking calls shall return when we are stopped. */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	/* A client that went away must not kill the server. */
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &old_pipe);
+
+	msg_ginfo("Listening for jobs on `%s'.\n", path);
+	while (!serve_stop) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			msg_gerr("Error: Waiting for clients failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+
+		const int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			msg_gerr("Error: Accepting client failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		serve_client(flash, layout, client);
+	}
+	msg_ginfo("Stopping server.\n");
+
+	sigaction(SIGPIPE, &old_pipe, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGINT, &old_int, NULL);
+	close(fd);
+	unlink(path);
+	return ret;
+}
@@ -37,7 +37,8 @@
 #define FIRMWARE_VERSION(x,y,z) ((x << 16) | (y << 8) | z)
 #define DEFAULT_TIMEOUT 3000
 #define MAX_BLOCK_COUNT 65535
-#define DEDIPROG_ASYNC_TRANSFERS 8 /* at most 8 asynchronous transfers */
+#define DEDIPROG_ASYNC_TRANSFERS 8 /* default number of asynchronous transfers in flight */
+#define DEDIPROG_MAX_ASYNC_TRANSFERS 64
 #define REQTYPE_OTHER_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_OTHER)	/* 0x43 */
 #define REQTYPE_OTHER_IN (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_OTHER)	/* 0xC3 */
 #define REQTYPE_EP_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_ENDPOINT)	/* 0x42 */
@@ -163,6 +164,9 @@ struct dediprog_data {
 	int firmwareversion;
 	char devicestring[32+1];
 	enum dediprog_devtype devicetype;
+	unsigned int async_transfers;
+	enum dediprog_readmode read_mode; /* 0 selects a mode per chip */
+	bool read_mode_checked;
 };
 
 #if defined(LIBUSB_MAJOR) && defined(LIBUSB_MINOR) && defined(LIBUSB_MICRO) && \
@@ -211,6 +215,7 @@ struct dediprog_transfer_status {
 	int error; /* OK if 0, ERROR else */
 	unsigned int queued_idx;
 	unsigned int finished_idx;
+	unsigned int chunksize; /* flash data per transfer */
 };
 
 static void LIBUSB_CALL dediprog_bulk_read_cb(struct libusb_transfer *const transfer)
@@ -224,9 +229,22 @@ static void LIBUSB_CALL dediprog_bulk_read_cb(struct libusb_transfer *const tran
 	++status->finished_idx;
 }
 
-static int dediprog_bulk_read_poll(struct libusb_context *usb_ctx,
-				   const struct dediprog_transfer_status *const status,
-				   const int finish)
+static void LIBUSB_CALL dediprog_bulk_write_cb(struct libusb_transfer *const transfer)
+{
+	struct dediprog_transfer_status *const status = (struct dediprog_transfer_status *)transfer->user_data;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+		status->error = 1;
+		msg_perr("SPI bulk write failed, expected %i, got %i!\n",
+			 transfer->length, transfer->actual_length);
+	} else {
+		flashprog_progress_add(status->flash, status->chunksize);
+	}
+	++status->finished_idx;
+}
+
+static int dediprog_bulk_poll(struct libusb_context *usb_ctx,
+			      const struct dediprog_transfer_status *const status,
+			      const int finish)
 {
 	if (status->finished_idx >= status->queued_idx)
 		return 0;
@@ -235,7 +253,7 @@ static int dediprog_bulk_read_poll(struct libusb_context *usb_ctx,
 		struct timeval timeout = { 10, 0 };
 		const int ret = libusb_handle_events_timeout(usb_ctx, &timeout);
 		if (ret < 0) {
-			msg_perr("Polling read events failed: %i %s!\n", ret, libusb_error_name(ret));
+			msg_perr("Polling USB events failed: %i %s!\n", ret, libusb_error_name(ret));
 			return 1;
 		}
 	} while (finish && (status->finished_idx < status->queued_idx));
@@ -246,16 +264,16 @@ static int dediprog_read(libusb_device_handle *dediprog_handle,
 			 enum dediprog_cmds cmd, unsigned int value, unsigned int idx,
 			 uint8_t *bytes, size_t size)
 {
-	return libusb_control_transfer(dediprog_handle, REQTYPE_EP_IN, cmd, value, idx,
-				      (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
+	return usb_dev_control_transfer(dediprog_handle, REQTYPE_EP_IN, cmd, value, idx,
+				       (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
 }
 
 static int dediprog_write(libusb_device_handle *dediprog_handle,
 			  enum dediprog_cmds cmd, unsigned int value, unsigned int idx,
 			  const uint8_t *bytes, size_t size)
 {
-	return libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, cmd, value, idx,
-				      (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
+	return usb_dev_control_transfer(dediprog_handle, REQTYPE_EP_OUT, cmd, value, idx,
+				       (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
 }
 
 
@@ -325,7 +343,7 @@ static int dediprog_set_spi_voltage(libusb_device_handle *dediprog_handle, int m
 
 	if (voltage_selector == 0) {
 		/* Wait some time as the original driver does. */
-		programmer_delay(200 * 1000);
+		programmer_delay(NULL, 200 * 1000);
 	}
 	ret = dediprog_write(dediprog_handle, CMD_SET_VCC, voltage_selector, 0, NULL, 0);
 	if (ret != 0x0) {
@@ -335,7 +353,7 @@ static int dediprog_set_spi_voltage(libusb_device_handle *dediprog_handle, int m
 	}
 	if (voltage_selector != 0) {
 		/* Wait some time as the original driver does. */
-		programmer_delay(200 * 1000);
+		programmer_delay(NULL, 200 * 1000);
 	}
 	return 0;
 }
@@ -375,6 +393,33 @@ static int dediprog_set_spi_speed(unsigned int spispeed_idx, const struct dedipr
 	return 0;
 }
 
+/* The clocks of spispeeds[] in Hz, in reverse order. */
+static const unsigned long spispeeds_hz[] = {
+	375000, 750000, 1500000, 2180000, 3000000, 8000000, 12000000, 24000000,
+};
+
+static size_t dediprog_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	const struct dediprog_data *const dp_data = flash->mst.spi->data;
+
+	/* Older firmware ignores the speed setting. */
+	if (dp_data->devicetype < DEV_SF600PG2 && dp_data->firmwareversion < FIRMWARE_VERSION(5, 0, 0))
+		return 0;
+	*speeds = spispeeds_hz;
+	return ARRAY_SIZE(spispeeds_hz);
+}
+
+static int dediprog_set_master_speed(const struct flashctx *flash, unsigned long hz)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(spispeeds_hz) && spispeeds_hz[i] != hz; ++i)
+		;
+	if (i == ARRAY_SIZE(spispeeds_hz))
+		return 1;
+	return dediprog_set_spi_speed(ARRAY_SIZE(spispeeds_hz) - 1 - i, flash->mst.spi->data);
+}
+
 static int prepare_rw_cmd(
 		struct flashctx *const flash, uint8_t *data_packet, unsigned int count,
 		uint8_t dedi_spi_cmd, unsigned int *value, unsigned int *idx, unsigned int start, int is_read)
@@ -392,7 +437,7 @@ static int prepare_rw_cmd(
 	data_packet[0] = count & 0xff;
 	data_packet[1] = (count >> 8) & 0xff;
 	data_packet[2] = 0; /* RFU */
-	data_packet[3] = dedi_spi_cmd; /* Read/Write Mode (currently READ_MODE_STD, WRITE_MODE_PAGE_PGM or WRITE_MODE_2B_AAI) */
+	data_packet[3] = dedi_spi_cmd; /* Read/Write Mode (currently READ_MODE_STD, READ_MODE_FAST, WRITE_MODE_PAGE_PGM or WRITE_MODE_2B_AAI) */
 	data_packet[4] = 0; /* "Opcode". Specs imply necessity only for READ_MODE_4B_ADDR_FAST and WRITE_MODE_4B_ADDR_256B_PAGE_PGM */
 
 	if (protocol(dp_data) >= PROTOCOL_V2) {
@@ -450,9 +495,11 @@ static int prepare_rw_cmd(
 /* Bulk read interface, will read multiple 512 byte chunks aligned to 512 bytes.
  * @start	start address
  * @len		length
- * @return	0 on success, 1 on failure
+ * @read_mode	dediprog specific read mode
+ * @return	0 on success, 2 if the read command was rejected, 1 on other failures
  */
-static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+static int dediprog_spi_bulk_read_mode(struct flashctx *flash, uint8_t *buf, unsigned int start,
+				       unsigned int len, enum dediprog_readmode read_mode)
 {
 	int err = 1;
 	const struct dediprog_data *dp_data = flash->mst.spi->data;
@@ -461,8 +508,9 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 	const unsigned int chunksize = 512;
 	const unsigned int count = len / chunksize;
 
-	struct dediprog_transfer_status status = { flash, 0, 0, 0 };
-	struct libusb_transfer *transfers[DEDIPROG_ASYNC_TRANSFERS] = { NULL, };
+	struct dediprog_transfer_status status = { flash, 0, 0, 0, chunksize };
+	struct libusb_transfer *transfers[DEDIPROG_MAX_ASYNC_TRANSFERS] = { NULL, };
+	const unsigned int depth = dp_data->async_transfers;
 	struct libusb_transfer *transfer;
 
 	if (len == 0)
@@ -492,13 +540,13 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 
 	uint8_t data_packet[command_packet_size];
 	unsigned int value, idx;
-	if (prepare_rw_cmd(flash, data_packet, count, READ_MODE_STD, &value, &idx, start, 1))
+	if (prepare_rw_cmd(flash, data_packet, count, read_mode, &value, &idx, start, 1))
 		return 1;
 
 	int ret = dediprog_write(dp_data->handle, CMD_READ, value, idx, data_packet, sizeof(data_packet));
 	if (ret != (int)sizeof(data_packet)) {
 		msg_perr("Command Read SPI Bulk failed, %i %s!\n", ret, libusb_error_name(ret));
-		return 1;
+		return 2;
 	}
 
 	/*
@@ -509,7 +557,7 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 
 	/* Allocate bulk transfers. */
 	unsigned int i;
-	for (i = 0; i < MIN(DEDIPROG_ASYNC_TRANSFERS, count); ++i) {
+	for (i = 0; i < MIN(depth, count); ++i) {
 		transfers[i] = libusb_alloc_transfer(0);
 		if (!transfers[i]) {
 			msg_perr("Allocating libusb transfer %i failed: %s!\n", i, libusb_error_name(ret));
@@ -520,9 +568,9 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 	/* Now transfer requested chunks using libusb's asynchronous interface. */
 	while (!status.error && (status.queued_idx < count)) {
 		while ((status.queued_idx < count) &&
-		       (status.queued_idx - status.finished_idx) < DEDIPROG_ASYNC_TRANSFERS)
+		       (status.queued_idx - status.finished_idx) < depth)
 		{
-			transfer = transfers[status.queued_idx % DEDIPROG_ASYNC_TRANSFERS];
+			transfer = transfers[status.queued_idx % depth];
 			libusb_fill_bulk_transfer(transfer, dp_data->handle, dp_data->in_endpoint,
 					(unsigned char *)buf + status.queued_idx * chunksize, chunksize,
 					dediprog_bulk_read_cb, &status, DEFAULT_TIMEOUT);
@@ -535,11 +583,11 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 			}
 			++status.queued_idx;
 		}
-		if (dediprog_bulk_read_poll(dp_data->usb_ctx, &status, 0))
+		if (dediprog_bulk_poll(dp_data->usb_ctx, &status, 0))
 			goto err_free;
 	}
 	/* Wait for transfers to finish. */
-	if (dediprog_bulk_read_poll(dp_data->usb_ctx, &status, 1))
+	if (dediprog_bulk_poll(dp_data->usb_ctx, &status, 1))
 		goto err_free;
 	/* Check if everything has been transmitted. */
 	if ((status.finished_idx < count) || status.error)
@@ -548,12 +596,57 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 	err = 0;
 
 err_free:
-	dediprog_bulk_read_poll(dp_data->usb_ctx, &status, 1);
-	for (i = 0; i < DEDIPROG_ASYNC_TRANSFERS; ++i)
+	dediprog_bulk_poll(dp_data->usb_ctx, &status, 1);
+	for (i = 0; i < depth; ++i)
 		if (transfers[i]) libusb_free_transfer(transfers[i]);
 	return err;
 }
 
+/* Any chip with a multi-I/O read supports the single-I/O fast read (0x0b). */
+static enum dediprog_readmode dediprog_read_mode(const struct flashctx *flash,
+						 const struct dediprog_data *dp_data)
+{
+	if (dp_data->read_mode)
+		return dp_data->read_mode;
+	if (flash->chip->feature_bits & (FEATURE_FAST_READ_DUAL | FEATURE_FAST_READ_QUAD | FEATURE_4BA_FAST_READ))
+		return READ_MODE_FAST;
+	return READ_MODE_STD;
+}
+
+/*
+ * Bulk read in the selected mode. If the firmware rejects the mode or
+ * the first data read with it doesn't match a slow read, fall back to
+ * standard reads for the rest of the session.
+ */
+static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct dediprog_data *dp_data = flash->mst.spi->data;
+	const enum dediprog_readmode read_mode = dediprog_read_mode(flash, dp_data);
+	const size_t progress = flash->progress.current;
+	uint8_t check[16];
+
+	int ret = dediprog_spi_bulk_read_mode(flash, buf, start, len, read_mode);
+	if (read_mode == READ_MODE_STD || !len)
+		return ret ? 1 : 0;
+
+	if (ret == 2) {
+		msg_pwarn("Read mode %d rejected, falling back to standard reads.\n", read_mode);
+	} else if (!ret && !dp_data->read_mode_checked) {
+		dp_data->read_mode_checked = true;
+		if (spi_nbyte_read(flash, check, start, sizeof(check)))
+			return 1;
+		if (!memcmp(check, buf, sizeof(check)))
+			return 0;
+		msg_pwarn("Read mode %d returned wrong data, falling back to standard reads.\n", read_mode);
+	} else {
+		return ret ? 1 : 0;
+	}
+
+	dp_data->read_mode = READ_MODE_STD;
+	flash->progress.current = progress;
+	return dediprog_spi_bulk_read_mode(flash, buf, start, len, READ_MODE_STD) ? 1 : 0;
+}
+
 static int dediprog_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
 	int ret;
@@ -661,22 +754,63 @@ static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, u
 		return 1;
 	}
 
+	/* Ring buffer of bulk transfers, like in dediprog_spi_bulk_read(). */
+	struct dediprog_transfer_status status = { flash, 0, 0, 0, chunksize };
+	struct libusb_transfer *transfers[DEDIPROG_MAX_ASYNC_TRANSFERS] = { NULL, };
+	const unsigned int depth = MIN(dp_data->async_transfers, count);
+	int err = 1;
+
+	unsigned char *const usbbufs = malloc(depth * 512);
+	if (!usbbufs) {
+		msg_perr("Out of memory!\n");
+		return 1;
+	}
+
 	unsigned int i;
-	for (i = 0; i < count; i++) {
-		unsigned char usbbuf[512];
-		memcpy(usbbuf, buf + i * chunksize, chunksize);
-		memset(usbbuf + chunksize, 0xff, sizeof(usbbuf) - chunksize); // fill up with 0xFF
-		int transferred;
-		ret = libusb_bulk_transfer(dp_data->handle, dp_data->out_endpoint, usbbuf, 512, &transferred,
-					   DEFAULT_TIMEOUT);
-		if ((ret < 0) || (transferred != 512)) {
-			msg_perr("SPI bulk write failed, expected %i, got %s!\n", 512, libusb_error_name(ret));
-			return 1;
+	for (i = 0; i < depth; ++i) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			msg_perr("Allocating libusb transfer %i failed!\n", i);
+			goto err_free;
 		}
-		flashprog_progress_add(flash, chunksize);
 	}
 
-	return 0;
+	while (!status.error && (status.queued_idx < count)) {
+		while ((status.queued_idx < count) &&
+		       (status.queued_idx - status.finished_idx) < depth)
+		{
+			const unsigned int slot = status.queued_idx % depth;
+			unsigned char *const usbbuf = usbbufs + slot * 512;
+			memcpy(usbbuf, buf + status.queued_idx * chunksize, chunksize);
+			memset(usbbuf + chunksize, 0xff, 512 - chunksize); // fill up with 0xFF
+			libusb_fill_bulk_transfer(transfers[slot], dp_data->handle, dp_data->out_endpoint,
+					usbbuf, 512, dediprog_bulk_write_cb, &status, DEFAULT_TIMEOUT);
+			ret = libusb_submit_transfer(transfers[slot]);
+			if (ret < 0) {
+				msg_perr("Submitting SPI bulk write %i failed: %s!\n",
+					 status.queued_idx, libusb_error_name(ret));
+				goto err_free;
+			}
+			++status.queued_idx;
+		}
+		if (dediprog_bulk_poll(dp_data->usb_ctx, &status, 0))
+			goto err_free;
+	}
+	/* Wait for transfers to finish. */
+	if (dediprog_bulk_poll(dp_data->usb_ctx, &status, 1))
+		goto err_free;
+	/* Check if everything has been transmitted. */
+	if ((status.finished_idx < count) || status.error)
+		goto err_free;
+
+	err = 0;
+
+err_free:
+	dediprog_bulk_poll(dp_data->usb_ctx, &status, 1);
+	for (i = 0; i < depth; ++i)
+		if (transfers[i]) libusb_free_transfer(transfers[i]);
+	free(usbbufs);
+	return err;
 }
 
 static int dediprog_spi_write(struct flashctx *flash, const uint8_t *buf,
@@ -908,7 +1042,7 @@ static int dediprog_read_id(struct dediprog_data *const dp)
 			if (ret != (int)sizeof(out))
 				goto failed_ret;
 
-			ret = libusb_bulk_transfer(dp->handle, dp->in_endpoint,
+			ret = usb_dev_bulk_transfer(dp->handle, dp->in_endpoint,
 					buf, sizeof(buf), &transferred, DEFAULT_TIMEOUT);
 		}
 
@@ -920,11 +1054,11 @@ static int dediprog_read_id(struct dediprog_data *const dp)
 		if (dp->devicetype >= DEV_SF600) {
 			ret = dediprog_read(dp->handle, CMD_READ_EEPROM, 0, 0, buf, sizeof(buf));
 		} else {
-			ret = libusb_control_transfer(dp->handle, REQTYPE_OTHER_IN,
-						      0x7,    /* request */
-						      0,      /* value */
-						      0xEF00, /* index */
-						      buf, min_len, DEFAULT_TIMEOUT);
+			ret = usb_dev_control_transfer(dp->handle, REQTYPE_OTHER_IN,
+						       0x7,    /* request */
+						       0,      /* value */
+						       0xEF00, /* index */
+						       buf, min_len, DEFAULT_TIMEOUT);
 		}
 
 		if (ret >= min_len)
@@ -952,7 +1086,7 @@ failed_ret:
 static int dediprog_set_voltage(libusb_device_handle *dediprog_handle)
 {
 	unsigned char buf[1] = {0};
-	int ret = libusb_control_transfer(dediprog_handle, REQTYPE_OTHER_IN, CMD_SET_VOLTAGE, 0x0, 0x0,
+	int ret = usb_dev_control_transfer(dediprog_handle, REQTYPE_OTHER_IN, CMD_SET_VOLTAGE, 0x0, 0x0,
 			      buf, 0x1, DEFAULT_TIMEOUT);
 	if (ret < 0) {
 		msg_perr("Command Set Voltage failed (%s)!\n", libusb_error_name(ret));
@@ -1095,6 +1229,8 @@ static struct spi_master spi_master_dediprog = {
 	.write_aai	= dediprog_spi_write_aai,
 	.shutdown	= dediprog_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= dediprog_list_speeds,
+	.set_speed	= dediprog_set_master_speed,
 };
 
 /*
@@ -1111,7 +1247,7 @@ static int dediprog_open(int index, struct dediprog_data *dp_data)
 	dp_data->handle = usb_dev_get_by_vid_pid_number(dp_data->usb_ctx, vid, pid, (unsigned int) index);
 	if (!dp_data->handle) {
 		msg_perr("Could not find a Dediprog programmer on USB.\n");
-		libusb_exit(dp_data->usb_ctx);
+		usb_dev_exit(dp_data->usb_ctx);
 		return -1;
 	}
 	ret = libusb_set_configuration(dp_data->handle, 1);
@@ -1171,7 +1307,7 @@ static int dediprog_shutdown(void *data)
 		goto out;
 	}
 	libusb_close(dp_data->handle);
-	libusb_exit(dp_data->usb_ctx);
+	usb_dev_exit(dp_data->usb_ctx);
 out:
 	free(data);
 	return ret;
@@ -1179,8 +1315,11 @@ out:
 
 static int dediprog_init(struct flashprog_programmer *const prog)
 {
-	char *voltage, *id_str, *device, *spispeed, *target_str;
+	char *voltage, *id_str, *device, *spispeed, *target_str, *transfers_str, *readmode_str;
+	unsigned int async_transfers = DEDIPROG_ASYNC_TRANSFERS;
+	enum dediprog_readmode read_mode = 0;
 	int spispeed_idx = 1;
+	bool auto_speed = false;
 	int millivolt = 3500;
 	long id = -1; /* -1 defaults to enumeration order */
 	int found_id;
@@ -1189,7 +1328,10 @@ static int dediprog_init(struct flashprog_programmer *const prog)
 	int i, ret;
 
 	spispeed = extract_programmer_param("spispeed");
-	if (spispeed) {
+	if (spispeed && !strcasecmp(spispeed, "auto")) {
+		auto_speed = true;
+		free(spispeed);
+	} else if (spispeed) {
 		for (i = 0; spispeeds[i].name; ++i) {
 			if (!strcasecmp(spispeeds[i].name, spispeed)) {
 				spispeed_idx = i;
@@ -1308,6 +1450,41 @@ static int dediprog_init(struct flashprog_programmer *const prog)
 	}
 	free(target_str);
 
+	transfers_str = extract_programmer_param("transfers");
+	if (transfers_str) {
+		char *transfers_suffix;
+		errno = 0;
+		const long transfers = strtol(transfers_str, &transfers_suffix, 10);
+		if (errno != 0 || transfers_str == transfers_suffix || strlen(transfers_suffix) > 0) {
+			msg_perr("Error: Could not convert 'transfers'.\n");
+			free(transfers_str);
+			return 1;
+		}
+		if (transfers < 1 || transfers > DEDIPROG_MAX_ASYNC_TRANSFERS) {
+			msg_perr("Error: Value for 'transfers' is out of range (1..%d).\n",
+				 DEDIPROG_MAX_ASYNC_TRANSFERS);
+			free(transfers_str);
+			return 1;
+		}
+		async_transfers = transfers;
+		msg_pinfo("Using %u USB transfers in flight.\n", async_transfers);
+	}
+	free(transfers_str);
+
+	readmode_str = extract_programmer_param("readmode");
+	if (readmode_str) {
+		if (!strcasecmp(readmode_str, "std")) {
+			read_mode = READ_MODE_STD;
+		} else if (!strcasecmp(readmode_str, "fast")) {
+			read_mode = READ_MODE_FAST;
+		} else if (strcasecmp(readmode_str, "auto")) {
+			msg_perr("Error: Invalid readmode value: '%s'.\n", readmode_str);
+			free(readmode_str);
+			return 1;
+		}
+	}
+	free(readmode_str);
+
 	struct dediprog_data *dp_data = calloc(1, sizeof(*dp_data));
 	if (!dp_data) {
 		msg_perr("Unable to allocate space for SPI master data\n");
@@ -1315,9 +1492,11 @@ static int dediprog_init(struct flashprog_programmer *const prog)
 	}
 	dp_data->firmwareversion = FIRMWARE_VERSION(0, 0, 0);
 	dp_data->devicetype = DEV_UNKNOWN;
+	dp_data->async_transfers = async_transfers;
+	dp_data->read_mode = read_mode;
 
 	/* Here comes the USB stuff. */
-	ret = libusb_init(&dp_data->usb_ctx);
+	ret = usb_dev_init(&dp_data->usb_ctx);
 	if (ret) {
 		msg_perr("Could not initialize libusb!\n");
 		goto init_err_exit;
@@ -1390,6 +1569,8 @@ static int dediprog_init(struct flashprog_programmer *const prog)
 	if (dediprog_set_leds(LED_NONE, dp_data))
 		goto init_err_cleanup_exit;
 
+	spi_master_dediprog.tune_speed = auto_speed;
+	spi_master_dediprog.clock_hz = spispeeds_hz[ARRAY_SIZE(spispeeds_hz) - 1 - spispeed_idx];
 	return register_spi_master(&spi_master_dediprog, 0, dp_data);
 
 init_err_cleanup_exit:
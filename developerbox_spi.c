@@ -31,6 +31,7 @@
  * should be turned on).
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <libusb.h>
 #include "programmer.h"
@@ -58,15 +59,105 @@ static const struct dev_entry devs_developerbox_spi[] = {
 	{0},
 };
 
+/* Latch writes that may be in flight at once. */
+#define CP210X_QUEUE_DEPTH	32
+
 static struct libusb_context *usb_ctx;
 static libusb_device_handle *cp210x_handle;
 
+/*
+ * Latch writes are queued asynchronously, so SCK and MOSI changes don't
+ * wait for a round trip each. Control transfers complete in order, so
+ * only reads and CS# changes have to wait for the queue.
+ */
+struct cp210x_latch_write {
+	struct libusb_transfer *transfer;
+	uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+	bool busy;
+};
+
+static struct {
+	struct cp210x_latch_write slots[CP210X_QUEUE_DEPTH];
+	unsigned int next, pending;
+	bool error;
+} cp210x_queue;
+
+static void LIBUSB_CALL cp210x_latch_write_cb(struct libusb_transfer *const transfer)
+{
+	struct cp210x_latch_write *const slot = transfer->user_data;
+
+	slot->busy = false;
+	--cp210x_queue.pending;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("Failed to write GPIO pins (status %d)\n", transfer->status);
+		cp210x_queue.error = true;
+	}
+}
+
+/* Wait until `slot` is free, or for everything if it's NULL. */
+static void cp210x_queue_wait(const struct cp210x_latch_write *const slot)
+{
+	while (cp210x_queue.pending && (!slot || slot->busy)) {
+		struct timeval timeout = { 10, 0 };
+		const int ret = libusb_handle_events_timeout(usb_ctx, &timeout);
+		if (ret < 0) {
+			msg_perr("Polling USB events failed (%s)\n", libusb_error_name(ret));
+			cp210x_queue.error = true;
+			return;
+		}
+	}
+}
+
+/* Returns 0 if all queued writes succeeded. */
+static int cp210x_queue_flush(void)
+{
+	cp210x_queue_wait(NULL);
+	if (!cp210x_queue.error)
+		return 0;
+	cp210x_queue.error = false;
+	return -1;
+}
+
+static void cp210x_queue_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < CP210X_QUEUE_DEPTH; ++i) {
+		if (cp210x_queue.slots[i].busy)
+			libusb_cancel_transfer(cp210x_queue.slots[i].transfer);
+	}
+	cp210x_queue_flush();
+	for (i = 0; i < CP210X_QUEUE_DEPTH; ++i) {
+		libusb_free_transfer(cp210x_queue.slots[i].transfer);
+		cp210x_queue.slots[i].transfer = NULL;
+	}
+}
+
+static int cp210x_queue_alloc(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < CP210X_QUEUE_DEPTH; ++i) {
+		cp210x_queue.slots[i].transfer = libusb_alloc_transfer(0);
+		if (!cp210x_queue.slots[i].transfer) {
+			msg_perr("Allocating libusb transfers failed!\n");
+			cp210x_queue_free();
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int cp210x_gpio_get(void)
 {
 	int res;
 	uint8_t gpio;
 
-	res = libusb_control_transfer(cp210x_handle, REQTYPE_DEVICE_TO_HOST,
+	if (cp210x_queue_flush())
+		return 0;
+
+	res = usb_dev_control_transfer(cp210x_handle, REQTYPE_DEVICE_TO_HOST,
 			CP210X_VENDOR_SPECIFIC, CP210X_READ_LATCH,
 			0, &gpio, 1, 0);
 	if (res < 0) {
@@ -77,24 +168,37 @@ static int cp210x_gpio_get(void)
 	return gpio;
 }
 
+/* Queue a latch write, see cp210x_queue_flush() to wait for it. */
 static void cp210x_gpio_set(uint8_t val, uint8_t mask)
 {
+	struct cp210x_latch_write *const slot = &cp210x_queue.slots[cp210x_queue.next];
 	int res;
 	uint16_t gpio;
 
 	gpio = ((val & 0xf) << 8) | (mask & 0xf);
 
+	cp210x_queue_wait(slot);
+	libusb_fill_control_setup(slot->setup, REQTYPE_HOST_TO_DEVICE,
+			CP210X_VENDOR_SPECIFIC, CP210X_WRITE_LATCH, gpio, 0);
+	libusb_fill_control_transfer(slot->transfer, cp210x_handle, slot->setup,
+			cp210x_latch_write_cb, slot, 0);
+
 	/* Set relay state on the card */
-	res = libusb_control_transfer(cp210x_handle, REQTYPE_HOST_TO_DEVICE,
-			CP210X_VENDOR_SPECIFIC, CP210X_WRITE_LATCH,
-			gpio, NULL, 0, 0);
-	if (res < 0)
-		msg_perr("Failed to read GPIO pins (%s)\n", libusb_error_name(res));
+	res = libusb_submit_transfer(slot->transfer);
+	if (res < 0) {
+		msg_perr("Failed to write GPIO pins (%s)\n", libusb_error_name(res));
+		cp210x_queue.error = true;
+		return;
+	}
+	slot->busy = true;
+	++cp210x_queue.pending;
+	cp210x_queue.next = (cp210x_queue.next + 1) % CP210X_QUEUE_DEPTH;
 }
 
 static void cp210x_bitbang_set_cs(int val, void *spi_data)
 {
 	cp210x_gpio_set(val << DEVELOPERBOX_SPI_CS, 1 << DEVELOPERBOX_SPI_CS);
+	cp210x_queue_flush();
 }
 
 static void cp210x_bitbang_set_sck(int val, void *spi_data)
@@ -118,25 +222,55 @@ static void cp210x_bitbang_set_sck_set_mosi(int sck, int mosi, void *spi_data)
 			  1 << DEVELOPERBOX_SPI_SCK |    1 << DEVELOPERBOX_SPI_MOSI);
 }
 
+/*
+ * Each bit takes two latch writes that update SCK and MOSI together. They
+ * are queued without waiting, only reads wait to sample MISO. MISO changes
+ * on the falling edge, so it's sampled while SCK is low.
+ */
+static void cp210x_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	const uint8_t mask = 1 << DEVELOPERBOX_SPI_SCK | 1 << DEVELOPERBOX_SPI_MOSI;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; ++i) {
+		const uint8_t byte = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; --bit) {
+			const uint8_t mosi = ((byte >> bit) & 1) << DEVELOPERBOX_SPI_MOSI;
+
+			cp210x_gpio_set(mosi, mask);
+			if (in)
+				miso = miso << 1 | !!(cp210x_gpio_get() & (1 << DEVELOPERBOX_SPI_MISO));
+			cp210x_gpio_set(1 << DEVELOPERBOX_SPI_SCK | mosi, mask);
+		}
+		if (in)
+			in[i] = miso;
+	}
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_cp210x = {
 	.set_cs			= cp210x_bitbang_set_cs,
 	.set_sck		= cp210x_bitbang_set_sck,
 	.set_mosi		= cp210x_bitbang_set_mosi,
 	.get_miso		= cp210x_bitbang_get_miso,
 	.set_sck_set_mosi	= cp210x_bitbang_set_sck_set_mosi,
+	.shift_bytes		= cp210x_bitbang_shift_bytes,
 };
 
 static int developerbox_spi_shutdown(void *data)
 {
+	cp210x_queue_free();
 	libusb_close(cp210x_handle);
-	libusb_exit(usb_ctx);
+	usb_dev_exit(usb_ctx);
 
 	return 0;
 }
 
 static int developerbox_spi_init(struct flashprog_programmer *const prog)
 {
-	if (libusb_init(&usb_ctx)) {
+	if (usb_dev_init(&usb_ctx)) {
 		msg_perr("Could not initialize libusb!\n");
 		return 1;
 	}
@@ -152,6 +286,11 @@ static int developerbox_spi_init(struct flashprog_programmer *const prog)
 		goto err_exit;
 	}
 
+	if (cp210x_queue_alloc()) {
+		libusb_close(cp210x_handle);
+		goto err_exit;
+	}
+
 	if (register_shutdown(developerbox_spi_shutdown, NULL))
 		goto err_exit;
 
@@ -161,7 +300,7 @@ static int developerbox_spi_init(struct flashprog_programmer *const prog)
 	return 0;
 
 err_exit:
-	libusb_exit(usb_ctx);
+	usb_dev_exit(usb_ctx);
 	return 1;
 }
 
@@ -31,10 +31,20 @@
  * David Carne <davidcarne@gmail.com>.
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libusb.h>
+#include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
+#include "spi.h"
+
+/* LIBUSB_CALL ensures the right calling conventions on libusb callbacks.
+ * However, the macro is not defined everywhere. */
+#ifndef LIBUSB_CALL
+#define LIBUSB_CALL
+#endif
 
 /* This is pretty much arbitrarily chosen. After one second without a
  * response we can be pretty sure we're not going to succeed. */
@@ -45,8 +55,16 @@
 #define	DATA_WRITE_EP		0x03
 #define	DATA_READ_EP		0x84
 
-static struct libusb_device_handle *handle = NULL;
-static bool reset_board;
+/* Streamed reads use this many bulk transfers of DIGILENT_TRANSFER_SIZE in flight per direction. */
+#define DIGILENT_ASYNC_TRANSFERS	4
+#define DIGILENT_TRANSFER_SIZE		(16 * KiB)
+/* Maximum length of a single streamed IO transaction. */
+#define DIGILENT_READ_BLOCK		(256 * KiB)
+
+struct digilent_spi_data {
+	struct libusb_device_handle *handle;
+	bool reset_board;
+};
 
 #define DIGILENT_VID		0x1443
 #define DIGILENT_JTAG_PID	0x0007
@@ -97,13 +115,13 @@ enum {
 	CMD_SPI_TX_END		= 0x87,
 };
 
-static int do_command(uint8_t *req, int req_len, uint8_t *res, int res_len)
+static int do_command(struct libusb_device_handle *handle, uint8_t *req, int req_len, uint8_t *res, int res_len)
 {
 	int tx_len = 0;
 	int ret;
 
 	req[0] = req_len - 1;
-	ret = libusb_bulk_transfer(handle, CMD_WRITE_EP, req, req_len, &tx_len, USB_TIMEOUT);
+	ret = usb_dev_bulk_transfer(handle, CMD_WRITE_EP, req, req_len, &tx_len, USB_TIMEOUT);
 	if (ret) {
 		msg_perr("Failed to issue a command: '%s'\n", libusb_error_name(ret));
 		return -1;
@@ -114,7 +132,7 @@ static int do_command(uint8_t *req, int req_len, uint8_t *res, int res_len)
 		return -1;
 	}
 
-	ret = libusb_bulk_transfer(handle, CMD_READ_EP, res, res_len, &tx_len, USB_TIMEOUT);
+	ret = usb_dev_bulk_transfer(handle, CMD_READ_EP, res, res_len, &tx_len, USB_TIMEOUT);
 	if (ret) {
 		msg_perr("Failed to get a response: '%s'\n", libusb_error_name(ret));
 		return -1;
@@ -133,41 +151,41 @@ static int do_command(uint8_t *req, int req_len, uint8_t *res, int res_len)
 	return 0;
 }
 
-static int gpio_open(void)
+static int gpio_open(struct libusb_device_handle *handle)
 {
 	uint8_t req[] = { 0x00, CMD_GPIO, CMD_GPIO_OPEN, 0x00 };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int gpio_set_dir(uint8_t direction)
+static int gpio_set_dir(struct libusb_device_handle *handle, uint8_t direction)
 {
 	uint8_t req[] = { 0x00, CMD_GPIO, CMD_GPIO_SET_DIR, 0x00,
 			  direction, 0x00, 0x00, 0x00 };
 	uint8_t res[6];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int gpio_set_value(uint8_t value)
+static int gpio_set_value(struct libusb_device_handle *handle, uint8_t value)
 {
 	uint8_t req[] = { 0x00, CMD_GPIO, CMD_GPIO_SET_VAL, 0x00,
 			  value, 0x00, 0x00, 0x00 };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int spi_open(void)
+static int spi_open(struct libusb_device_handle *handle)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_OPEN, 0x00 };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int spi_set_speed(uint32_t speed)
+static int spi_set_speed(struct libusb_device_handle *handle, uint32_t speed)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_SET_SPEED, 0x00,
 			  (speed) & 0xff,
@@ -178,7 +196,7 @@ static int spi_set_speed(uint32_t speed)
 	uint32_t real_speed;
 	int ret;
 
-	ret = do_command(req, sizeof(req), res, sizeof(res));
+	ret = do_command(handle, req, sizeof(req), res, sizeof(res));
 	if (ret)
 		return ret;
 
@@ -189,23 +207,23 @@ static int spi_set_speed(uint32_t speed)
 	return 0;
 }
 
-static int spi_set_mode(uint8_t mode)
+static int spi_set_mode(struct libusb_device_handle *handle, uint8_t mode)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_SET_MODE, 0x00, mode };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int spi_set_cs(uint8_t cs)
+static int spi_set_cs(struct libusb_device_handle *handle, uint8_t cs)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_SET_CS, 0x00, cs };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int spi_start_io(uint8_t read_follows, uint32_t write_len)
+static int spi_start_io(struct libusb_device_handle *handle, uint8_t read_follows, uint32_t write_len)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_START_IO, 0x00,
 			  0x00, 0x00, /* meaning unknown */
@@ -216,17 +234,17 @@ static int spi_start_io(uint8_t read_follows, uint32_t write_len)
 			  (write_len >> 24) & 0xff };
 	uint8_t res[2];
 
-	return do_command(req, sizeof(req), res, sizeof(res));
+	return do_command(handle, req, sizeof(req), res, sizeof(res));
 }
 
-static int spi_tx_end(uint8_t read_follows, uint32_t tx_len)
+static int spi_tx_end(struct libusb_device_handle *handle, uint8_t read_follows, uint32_t tx_len)
 {
 	uint8_t req[] = { 0x00, CMD_SPI, CMD_SPI_TX_END, 0x00 };
 	uint8_t res[read_follows ? 10 : 6];
 	int ret;
 	uint32_t count;
 
-	ret = do_command(req, sizeof(req), res, sizeof(res));
+	ret = do_command(handle, req, sizeof(req), res, sizeof(res));
 	if (ret != 0)
 		return ret;
 
@@ -260,6 +278,8 @@ static int spi_tx_end(uint8_t read_follows, uint32_t tx_len)
 static int digilent_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				     const unsigned char *writearr, unsigned char *readarr)
 {
+	struct libusb_device_handle *const handle =
+		((struct digilent_spi_data *)flash->mst.spi->data)->handle;
 	int ret;
 	int len = writecnt + readcnt;
 	int tx_len = 0;
@@ -269,15 +289,15 @@ static int digilent_spi_send_command(const struct flashctx *flash, unsigned int
 	memcpy(buf, writearr, writecnt);
 	memset(buf + writecnt, 0xff, readcnt);
 
-	ret = spi_set_cs(0);
+	ret = spi_set_cs(handle, 0);
 	if (ret != 0)
 		return ret;
 
-	ret = spi_start_io(read_follows, writecnt);
+	ret = spi_start_io(handle, read_follows, writecnt);
 	if (ret != 0)
 		return ret;
 
-	ret = libusb_bulk_transfer(handle, DATA_WRITE_EP, buf, len, &tx_len, USB_TIMEOUT);
+	ret = usb_dev_bulk_transfer(handle, DATA_WRITE_EP, buf, len, &tx_len, USB_TIMEOUT);
 	if (ret != 0) {
 		msg_perr("%s: failed to write data: '%s'\n", __func__, libusb_error_name(ret));
 		return -1;
@@ -288,7 +308,7 @@ static int digilent_spi_send_command(const struct flashctx *flash, unsigned int
 	}
 
 	if (read_follows) {
-		ret = libusb_bulk_transfer(handle, DATA_READ_EP, buf, len, &tx_len, USB_TIMEOUT);
+		ret = usb_dev_bulk_transfer(handle, DATA_READ_EP, buf, len, &tx_len, USB_TIMEOUT);
 		if (ret != 0) {
 			msg_perr("%s: failed to read data: '%s'\n", __func__, libusb_error_name(ret));
 			return -1;
@@ -299,11 +319,11 @@ static int digilent_spi_send_command(const struct flashctx *flash, unsigned int
 		}
 	}
 
-	ret = spi_tx_end(read_follows, len);
+	ret = spi_tx_end(handle, read_follows, len);
 	if (ret != 0)
 		return ret;
 
-	ret = spi_set_cs(1);
+	ret = spi_set_cs(handle, 1);
 	if (ret != 0)
 		return ret;
 
@@ -312,6 +332,265 @@ static int digilent_spi_send_command(const struct flashctx *flash, unsigned int
 	return 0;
 }
 
+/*
+ * State of a streamed transfer on the data endpoints. Data is sent and
+ * received with several bulk transfers in flight per direction. Received
+ * data is copied to `dest`, after skipping the first `skip` bytes.
+ */
+struct digilent_stream {
+	struct libusb_device_handle *handle;
+	struct libusb_transfer *out[DIGILENT_ASYNC_TRANSFERS];
+	struct libusb_transfer *in[DIGILENT_ASYNC_TRANSFERS];
+	bool out_busy[DIGILENT_ASYNC_TRANSFERS];
+	bool in_busy[DIGILENT_ASYNC_TRANSFERS];
+	uint8_t in_buf[DIGILENT_ASYNC_TRANSFERS][DIGILENT_TRANSFER_SIZE];
+	unsigned int pending; /* transfers submitted but not completed */
+	unsigned int in_requested; /* bytes requested by pending IN transfers */
+	int error;
+
+	uint8_t *dest;
+	unsigned int skip;
+	unsigned int received;
+};
+
+static void stream_complete(struct digilent_stream *const s, struct libusb_transfer *const transfer,
+			    bool *const busy, const char *const errmsg)
+{
+	*busy = false;
+	--s->pending;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (!s->error && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("%s\n", errmsg);
+		s->error = 1;
+	}
+}
+
+static void LIBUSB_CALL stream_out_cb(struct libusb_transfer *const transfer)
+{
+	struct digilent_stream *const s = transfer->user_data;
+	unsigned int i;
+
+	for (i = 0; s->out[i] != transfer; ++i)
+		;
+	stream_complete(s, transfer, &s->out_busy[i], "Failed to write streamed data");
+	if (!s->error && transfer->actual_length != transfer->length) {
+		msg_perr("Short write of streamed data\n");
+		s->error = 1;
+	}
+}
+
+static void LIBUSB_CALL stream_in_cb(struct libusb_transfer *const transfer)
+{
+	struct digilent_stream *const s = transfer->user_data;
+	const uint8_t *data = transfer->buffer;
+	unsigned int len = transfer->actual_length;
+	unsigned int i;
+
+	for (i = 0; s->in[i] != transfer; ++i)
+		;
+	s->in_requested -= transfer->length;
+	stream_complete(s, transfer, &s->in_busy[i], "Failed to read streamed data");
+	if (s->error)
+		return;
+
+	/* IN transfers complete in order, a short one only means we need more of them. */
+	const unsigned int skip = min(s->skip, len);
+	s->skip -= skip;
+	data += skip;
+	len -= skip;
+	memcpy(s->dest + s->received, data, len);
+	s->received += len;
+}
+
+static int stream_poll(struct digilent_stream *const s)
+{
+	struct timeval timeout = { 1, 0 };
+	const int ret = libusb_handle_events_timeout(NULL, &timeout);
+	if (ret < 0) {
+		msg_perr("Polling USB events failed: %s\n", libusb_error_name(ret));
+		s->error = 1;
+	}
+	return s->error;
+}
+
+static void stream_free(struct digilent_stream *const s)
+{
+	unsigned int i;
+
+	/* Cancel anything left over after an error and wait for it. */
+	for (i = 0; i < DIGILENT_ASYNC_TRANSFERS; ++i) {
+		if (s->out_busy[i])
+			libusb_cancel_transfer(s->out[i]);
+		if (s->in_busy[i])
+			libusb_cancel_transfer(s->in[i]);
+	}
+	while (s->pending) {
+		struct timeval timeout = { 1, 0 };
+		if (libusb_handle_events_timeout(NULL, &timeout) < 0)
+			break;
+	}
+	for (i = 0; i < DIGILENT_ASYNC_TRANSFERS; ++i) {
+		libusb_free_transfer(s->out[i]);
+		libusb_free_transfer(s->in[i]);
+	}
+	free(s);
+}
+
+static struct digilent_stream *stream_alloc(struct libusb_device_handle *const handle)
+{
+	unsigned int i;
+
+	struct digilent_stream *const s = calloc(1, sizeof(*s));
+	if (!s) {
+		msg_perr("Out of memory!\n");
+		return NULL;
+	}
+	s->handle = handle;
+	for (i = 0; i < DIGILENT_ASYNC_TRANSFERS; ++i) {
+		s->out[i] = libusb_alloc_transfer(0);
+		s->in[i] = libusb_alloc_transfer(0);
+		if (!s->out[i] || !s->in[i]) {
+			msg_perr("Allocating libusb transfers failed!\n");
+			stream_free(s);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+/*
+ * Stream `len` bytes in one IO transaction: the `first` data chunk,
+ * followed by `fill` as often as needed. Both must hold at least
+ * DIGILENT_TRANSFER_SIZE bytes. Everything read after `skip` bytes
+ * is stored in `dest`.
+ */
+static int stream_io(struct flashctx *flash, struct digilent_stream *const s, const unsigned int write_len,
+		     const uint8_t *first, const uint8_t *fill, const unsigned int len,
+		     uint8_t *dest, const unsigned int skip)
+{
+	unsigned int sent = 0, next_out = 0, next_in = 0, reported = 0;
+
+	s->dest = dest;
+	s->skip = skip;
+	s->received = 0;
+
+	if (spi_start_io(s->handle, 1, write_len))
+		return 1;
+
+	/* Bytes received or requested so far, including skipped ones. */
+#define RAW_IN (skip - s->skip + s->received)
+	while (!s->error && (sent < len || RAW_IN < len || s->pending)) {
+		while (sent < len && !s->out_busy[next_out]) {
+			const unsigned int chunk = min(DIGILENT_TRANSFER_SIZE, len - sent);
+			libusb_fill_bulk_transfer(s->out[next_out], s->handle, DATA_WRITE_EP,
+						  (uint8_t *)(sent ? fill : first), chunk,
+						  stream_out_cb, s, USB_TIMEOUT);
+			if (libusb_submit_transfer(s->out[next_out])) {
+				msg_perr("Submitting USB transfer failed\n");
+				return 1;
+			}
+			s->out_busy[next_out] = true;
+			++s->pending;
+			sent += chunk;
+			next_out = (next_out + 1) % DIGILENT_ASYNC_TRANSFERS;
+		}
+
+		while (RAW_IN + s->in_requested < len && !s->in_busy[next_in]) {
+			const unsigned int chunk = min(DIGILENT_TRANSFER_SIZE, len - RAW_IN - s->in_requested);
+			libusb_fill_bulk_transfer(s->in[next_in], s->handle, DATA_READ_EP,
+						  s->in_buf[next_in], chunk, stream_in_cb, s, USB_TIMEOUT);
+			if (libusb_submit_transfer(s->in[next_in])) {
+				msg_perr("Submitting USB transfer failed\n");
+				return 1;
+			}
+			s->in_busy[next_in] = true;
+			++s->pending;
+			s->in_requested += chunk;
+			next_in = (next_in + 1) % DIGILENT_ASYNC_TRANSFERS;
+		}
+
+		if (stream_poll(s))
+			return 1;
+
+		flashprog_progress_add(flash, s->received - reported);
+		reported = s->received;
+	}
+#undef RAW_IN
+	if (s->error)
+		return 1;
+
+	return spi_tx_end(s->handle, 1, len);
+}
+
+/*
+ * Read with a single read command. CS stays asserted for the whole
+ * range, which is streamed in IO transactions of DIGILENT_READ_BLOCK.
+ */
+static int digilent_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct libusb_device_handle *const handle =
+		((struct digilent_spi_data *)flash->mst.spi->data)->handle;
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+	int ret = 1;
+
+	if (!len)
+		return 0;
+
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	uint8_t *const first = malloc(2 * DIGILENT_TRANSFER_SIZE);
+	if (!first) {
+		msg_perr("Out of memory!\n");
+		return 1;
+	}
+	uint8_t *const fill = first + DIGILENT_TRANSFER_SIZE;
+	memset(first, 0xff, 2 * DIGILENT_TRANSFER_SIZE);
+	memcpy(first, cmd, cmdlen);
+
+	struct digilent_stream *const s = stream_alloc(handle);
+	if (!s)
+		goto _free_ret;
+
+	if (spi_set_cs(handle, 0))
+		goto _stream_ret;
+
+	while (done < len) {
+		const unsigned int block = min(DIGILENT_READ_BLOCK, len - done);
+
+		if (flashprog_cancelled(flash))
+			break;
+
+		/* Only the first transaction carries the command. */
+		if (done == 0) {
+			if (stream_io(flash, s, cmdlen, first, fill, cmdlen + block, buf, cmdlen))
+				break;
+		} else {
+			if (stream_io(flash, s, 0, fill, fill, block, buf + done, 0))
+				break;
+		}
+		done += block;
+	}
+	ret = done < len;
+
+	/* Cancel anything left over before CS is released. */
+	stream_free(s);
+	if (spi_set_cs(handle, 1))
+		ret = 1;
+	free(first);
+	return ret;
+
+_stream_ret:
+	stream_free(s);
+_free_ret:
+	free(first);
+	return ret;
+}
+
 static int digilent_spi_shutdown(void *data);
 
 static const struct spi_master spi_master_digilent_spi = {
@@ -320,7 +599,7 @@ static const struct spi_master spi_master_digilent_spi = {
 	.max_data_write	= 252,
 	.command	= digilent_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= digilent_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= digilent_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
@@ -329,22 +608,24 @@ static const struct spi_master spi_master_digilent_spi = {
 
 static int digilent_spi_shutdown(void *data)
 {
-	if (reset_board)
-		gpio_set_dir(0);
+	struct digilent_spi_data *const digilent_data = data;
 
-	libusb_close(handle);
-	handle = NULL;
+	if (digilent_data->reset_board)
+		gpio_set_dir(digilent_data->handle, 0);
+
+	libusb_close(digilent_data->handle);
+	free(digilent_data);
 
 	return 0;
 }
 
-static bool default_reset(void)
+static bool default_reset(struct libusb_device_handle *handle)
 {
 	char board[17];
 
-	libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-	                        GET_BOARD_TYPE, 0, 0,
-	                        (unsigned char *)board, sizeof(board) - 1, USB_TIMEOUT);
+	usb_dev_control_transfer(handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+	                         GET_BOARD_TYPE, 0, 0,
+	                         (unsigned char *)board, sizeof(board) - 1, USB_TIMEOUT);
 	board[sizeof(board) -1] = '\0';
 
 	if (strcmp(board, "iCE40") == 0)
@@ -373,18 +654,14 @@ static const struct digilent_spispeeds spispeeds[] = {
 
 static int digilent_spi_init(struct flashprog_programmer *const prog)
 {
+	struct libusb_device_handle *handle;
+	struct digilent_spi_data *digilent_data;
+	bool reset_board;
 	char *p;
 	uint32_t speed_hz = spispeeds[0].speed;
 	int i;
 
-	if (handle != NULL) {
-		msg_cerr("%s: handle already set!\n"
-			 "Please report a bug at flashprog@flashprog.org\n",
-			 __func__);
-		return -1;
-	}
-
-	int32_t ret = libusb_init(NULL);
+	int32_t ret = usb_dev_init(NULL);
 	if (ret < 0) {
 		msg_perr("%s: couldn't initialize libusb!\n", __func__);
 		return -1;
@@ -398,11 +675,17 @@ static int digilent_spi_init(struct flashprog_programmer *const prog)
 
 	uint16_t vid = devs_digilent_spi[0].vendor_id;
 	uint16_t pid = devs_digilent_spi[0].device_id;
-	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	p = extract_programmer_param("serial");
+	handle = usb_dev_get_by_vid_pid_serial(NULL, vid, pid, p);
 	if (handle == NULL) {
-		msg_perr("%s: couldn't open device %04x:%04x.\n", __func__, vid, pid);
+		if (p)
+			msg_perr("%s: couldn't open device %04x:%04x with serial %s.\n", __func__, vid, pid, p);
+		else
+			msg_perr("%s: couldn't open device %04x:%04x.\n", __func__, vid, pid);
+		free(p);
 		return -1;
 	}
+	free(p);
 
 	ret = libusb_claim_interface(handle, 0);
 	if (ret != 0) {
@@ -430,30 +713,37 @@ static int digilent_spi_init(struct flashprog_programmer *const prog)
 	if (p && strlen(p))
 		reset_board = (p[0] == '1');
 	else
-		reset_board = default_reset();
+		reset_board = default_reset(handle);
 	free(p);
 
 	if (reset_board) {
-		if (gpio_open() != 0)
+		if (gpio_open(handle) != 0)
 			goto close_handle;
-		if (gpio_set_dir(1) != 0)
+		if (gpio_set_dir(handle, 1) != 0)
 			goto close_handle;
-		if (gpio_set_value(0) != 0)
+		if (gpio_set_value(handle, 0) != 0)
 			goto close_handle;
 	}
 
-	if (spi_open() != 0)
+	if (spi_open(handle) != 0)
+		goto close_handle;
+	if (spi_set_speed(handle, speed_hz) != 0)
 		goto close_handle;
-	if (spi_set_speed(speed_hz) != 0)
+	if (spi_set_mode(handle, 0x00) != 0)
 		goto close_handle;
-	if (spi_set_mode(0x00) != 0)
+
+	digilent_data = calloc(1, sizeof(*digilent_data));
+	if (!digilent_data) {
+		msg_perr("Out of memory!\n");
 		goto close_handle;
+	}
+	digilent_data->handle = handle;
+	digilent_data->reset_board = reset_board;
 
-	return register_spi_master(&spi_master_digilent_spi, 0, NULL);
+	return register_spi_master(&spi_master_digilent_spi, 0, digilent_data);
 
 close_handle:
 	libusb_close(handle);
-	handle = NULL;
 	return -1;
 }
 
@@ -462,4 +752,5 @@ const struct programmer_entry programmer_digilent_spi = {
 	.type			= USB,
 	.devs.dev		= devs_digilent_spi,
 	.init			= digilent_spi_init,
+	.multi_instance		= true,
 };
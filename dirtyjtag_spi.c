@@ -32,15 +32,50 @@
  */
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <libusb.h>
+#include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
+#include "spi.h"
+
+/* LIBUSB_CALL ensures the right calling conventions on libusb callbacks.
+ * However, not all libusb.h variants provide it. */
+#ifndef LIBUSB_CALL
+#define LIBUSB_CALL
+#endif
+
+#define DJTAG_PACKET_SIZE	64
+#define DJTAG2_MAX_XFER		62	/* max transfer size in DJTAG2 */
+#define DJTAG_ASYNC_TRANSFERS	32	/* transfers in flight per direction */
+#define DJTAG_READ_BLOCK	(64 * KiB)
+
+struct dirtyjtag_batch;
+
+struct dirtyjtag_slot {
+	struct dirtyjtag_batch *batch;
+	struct libusb_transfer *transfer;
+	bool busy;
+	uint8_t buf[DJTAG_PACKET_SIZE];
+};
+
+struct dirtyjtag_batch {
+	uint8_t packet[DJTAG_PACKET_SIZE];	/* packet being filled */
+	size_t packet_len;
+	struct dirtyjtag_slot out[DJTAG_ASYNC_TRANSFERS];
+	struct dirtyjtag_slot in[DJTAG_ASYNC_TRANSFERS];
+	unsigned int out_next, in_next;
+	unsigned int pending; /* transfers submitted but not completed */
+	int error;
+};
 
 struct dirtyjtag_spi_data {
 	struct libusb_context *libusb_ctx;
 	struct libusb_device_handle *libusb_handle;
+	struct dirtyjtag_batch batch; /* DJTAG2 only */
 };
 
 static const struct dev_entry devs_dirtyjtag_spi[] = {
@@ -82,7 +117,7 @@ enum dirtyjtag_signal_identifier {
 static int dirtyjtag_send(struct dirtyjtag_spi_data *djtag_data, uint8_t *data, size_t len)
 {
 	int transferred;
-	int ret = libusb_bulk_transfer(djtag_data->libusb_handle,
+	int ret = usb_dev_bulk_transfer(djtag_data->libusb_handle,
 		dirtyjtag_write_endpoint,
 		data,
 		len,
@@ -103,7 +138,7 @@ static int dirtyjtag_send(struct dirtyjtag_spi_data *djtag_data, uint8_t *data,
 static int dirtyjtag_receive(struct dirtyjtag_spi_data *djtag_data, uint8_t *data, size_t buffer_len, int expected)
 {
 	int transferred;
-	int ret = libusb_bulk_transfer(djtag_data->libusb_handle,
+	int ret = usb_dev_bulk_transfer(djtag_data->libusb_handle,
 		dirtyjtag_read_endpoint,
 		data,
 		buffer_len,
@@ -147,17 +182,6 @@ static unsigned int dirtyjtag_version(const char *info)
 	return 0;
 }
 
-static int dirtyjtag_spi_shutdown(void *data)
-{
-	struct dirtyjtag_spi_data *djtag_data = (struct dirtyjtag_spi_data*)data;
-	libusb_release_interface(djtag_data->libusb_handle, 0);
-	libusb_attach_kernel_driver(djtag_data->libusb_handle, 0);
-	libusb_close(djtag_data->libusb_handle);
-	libusb_exit(djtag_data->libusb_ctx);
-	free(data);
-	return 0;
-}
-
 static int dirtyjtag_reset_tms(struct dirtyjtag_spi_data *context)
 {
 	uint8_t tms_reset_buffer[] = {
@@ -220,51 +244,304 @@ cleanup_fail:
 	return -1;
 }
 
+/*
+ * DJTAG2 batch mode: Commands are packed into USB packets of up to
+ * DJTAG_PACKET_SIZE bytes. The probe answers every CMD_XFER without
+ * NO_READ with a packet of its own, so the IN transfer for it is
+ * queued before the command is sent. Transfers on one endpoint
+ * complete in the order they were submitted. The data of an answer
+ * goes right into the caller's buffer.
+ */
+static void LIBUSB_CALL dirtyjtag_batch_cb(struct libusb_transfer *const transfer)
+{
+	struct dirtyjtag_slot *const slot = transfer->user_data;
+
+	slot->busy = false;
+	--slot->batch->pending;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+		if (!slot->batch->error && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("DirtyJTAG USB transfer failed (status %d)\n", transfer->status);
+		slot->batch->error = 1;
+	}
+}
+
+/* Wait for `slot` to be available, or for all transfers if `slot` is NULL. */
+static int dirtyjtag_batch_poll(struct dirtyjtag_spi_data *const context, const struct dirtyjtag_slot *const slot)
+{
+	struct dirtyjtag_batch *const batch = &context->batch;
+
+	while (slot ? slot->busy : batch->pending) {
+		struct timeval timeout = { 10, 0 };
+		const int ret = libusb_handle_events_timeout(context->libusb_ctx, &timeout);
+		if (ret < 0) {
+			msg_perr("Polling USB events failed: %i %s!\n", ret, libusb_error_name(ret));
+			batch->error = 1;
+			return 1;
+		}
+	}
+	return batch->error;
+}
+
+static int dirtyjtag_batch_submit(struct dirtyjtag_spi_data *const context, struct dirtyjtag_slot *const slot,
+				  const unsigned char endpoint, uint8_t *const buf, const size_t len)
+{
+	struct dirtyjtag_batch *const batch = &context->batch;
+
+	libusb_fill_bulk_transfer(slot->transfer, context->libusb_handle, endpoint, buf, len,
+				  dirtyjtag_batch_cb, slot, dirtyjtag_timeout);
+	const int ret = libusb_submit_transfer(slot->transfer);
+	if (ret < 0) {
+		msg_perr("Submitting USB transfer failed: %s\n", libusb_error_name(ret));
+		batch->error = 1;
+		return 1;
+	}
+	slot->busy = true;
+	++batch->pending;
+	return 0;
+}
+
+static int dirtyjtag_batch_flush(struct dirtyjtag_spi_data *const context)
+{
+	struct dirtyjtag_batch *const batch = &context->batch;
+	struct dirtyjtag_slot *const slot = &batch->out[batch->out_next];
+
+	if (!batch->packet_len)
+		return 0;
+
+	if (dirtyjtag_batch_poll(context, slot))
+		return 1;
+
+	memcpy(slot->buf, batch->packet, batch->packet_len);
+	if (dirtyjtag_batch_submit(context, slot, dirtyjtag_write_endpoint, slot->buf, batch->packet_len))
+		return 1;
+
+	batch->out_next = (batch->out_next + 1) % DJTAG_ASYNC_TRANSFERS;
+	batch->packet_len = 0;
+	return 0;
+}
+
+/* Queue a command and, if `answer_len` is non-zero, receive its answer into `answer`. */
+static int dirtyjtag_batch_queue(struct dirtyjtag_spi_data *const context, const uint8_t *const cmd,
+				 const size_t cmd_len, uint8_t *const answer, const size_t answer_len)
+{
+	struct dirtyjtag_batch *const batch = &context->batch;
+
+	if (batch->packet_len + cmd_len > DJTAG_PACKET_SIZE && dirtyjtag_batch_flush(context))
+		return 1;
+
+	if (answer_len) {
+		struct dirtyjtag_slot *const slot = &batch->in[batch->in_next];
+
+		/* The command of the answer we wait for may still be in the packet. */
+		if (slot->busy && dirtyjtag_batch_flush(context))
+			return 1;
+		if (dirtyjtag_batch_poll(context, slot))
+			return 1;
+		if (dirtyjtag_batch_submit(context, slot, dirtyjtag_read_endpoint, answer, answer_len))
+			return 1;
+		batch->in_next = (batch->in_next + 1) % DJTAG_ASYNC_TRANSFERS;
+	}
+
+	memcpy(batch->packet + batch->packet_len, cmd, cmd_len);
+	batch->packet_len += cmd_len;
+	return 0;
+}
+
+/* Send everything queued and wait for all answers. */
+static int dirtyjtag_batch_sync(struct dirtyjtag_spi_data *const context)
+{
+	return dirtyjtag_batch_flush(context) || dirtyjtag_batch_poll(context, NULL);
+}
+
+/* Like dirtyjtag_batch_sync(), but also clean up after an error. */
+static int dirtyjtag_batch_finish(struct dirtyjtag_spi_data *const context)
+{
+	struct dirtyjtag_batch *const batch = &context->batch;
+	unsigned int i;
+
+	if (!dirtyjtag_batch_sync(context))
+		return 0;
+
+	/* Cancel anything left over after an error and wait for it. */
+	for (i = 0; i < DJTAG_ASYNC_TRANSFERS; ++i) {
+		if (batch->out[i].busy)
+			libusb_cancel_transfer(batch->out[i].transfer);
+		if (batch->in[i].busy)
+			libusb_cancel_transfer(batch->in[i].transfer);
+	}
+	dirtyjtag_batch_poll(context, NULL);
+
+	batch->packet_len = 0;
+	batch->error = 0;
+	return 1;
+}
+
+static void dirtyjtag_batch_free(struct dirtyjtag_batch *const batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < DJTAG_ASYNC_TRANSFERS; ++i) {
+		libusb_free_transfer(batch->out[i].transfer);
+		libusb_free_transfer(batch->in[i].transfer);
+		batch->out[i].transfer = NULL;
+		batch->in[i].transfer = NULL;
+	}
+}
+
+static int dirtyjtag_batch_init(struct dirtyjtag_batch *const batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < DJTAG_ASYNC_TRANSFERS; ++i) {
+		batch->out[i].batch = batch;
+		batch->in[i].batch = batch;
+		batch->out[i].transfer = libusb_alloc_transfer(0);
+		batch->in[i].transfer = libusb_alloc_transfer(0);
+		if (!batch->out[i].transfer || !batch->in[i].transfer) {
+			msg_perr("Allocating libusb transfers failed!\n");
+			dirtyjtag_batch_free(batch);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Queue CMD_XFERs for `len` bytes; `tdi` may be NULL to shift zeros, `tdo` NULL to skip reading. */
+static int dirtyjtag_djtag2_queue_xfer(struct dirtyjtag_spi_data *const context,
+				       const uint8_t *const tdi, uint8_t *const tdo, const size_t len)
+{
+	uint8_t command[2 + DJTAG2_MAX_XFER]; /* 1B command + 1B len + payload */
+	size_t i = 0;
+
+	while (i < len) {
+		const size_t txn_size = MIN(DJTAG2_MAX_XFER, len - i);
+
+		command[0] = CMD_XFER;
+		if (!tdo)
+			command[0] |= NO_READ;
+		if (txn_size * 8 >= 256)
+			command[0] |= EXTEND_LENGTH;
+		command[1] = (txn_size * 8) % 256;
+		if (tdi)
+			memcpy(command + 2, tdi + i, txn_size);
+		else
+			memset(command + 2, 0, txn_size);
+
+		if (dirtyjtag_batch_queue(context, command, 2 + txn_size, tdo ? tdo + i : NULL, tdo ? txn_size : 0))
+			return 1;
+
+		i += txn_size;
+	}
+	return 0;
+}
+
+static int dirtyjtag_djtag2_queue_reset_tms(struct dirtyjtag_spi_data *const context)
+{
+	static const uint8_t tms_reset[] = {
+		CMD_SETSIG,
+		SIG_TMS,
+		SIG_TMS,
+	};
+	return dirtyjtag_batch_queue(context, tms_reset, sizeof(tms_reset), NULL, 0);
+}
+
 static int dirtyjtag_djtag2_spi_send_command(const struct flashctx *flash,
 					     unsigned int writecnt, unsigned int readcnt,
 					     const unsigned char *writearr, unsigned char *readarr)
 {
 	struct dirtyjtag_spi_data *const context = flash->mst.spi->data;
-	const size_t max_xfer_size = 62; /* max transfer size in DJTAG2 */
-	uint8_t transfer_buffer[2 + max_xfer_size]; /* 1B command + 1B len + payload */
-	size_t i;
 
-	i = 0;
-	while (i < writecnt) {
-		const size_t txn_size = MIN(max_xfer_size, writecnt - i);
+	if (dirtyjtag_djtag2_queue_xfer(context, writearr, NULL, writecnt) ||
+	    dirtyjtag_djtag2_queue_xfer(context, NULL, readarr, readcnt) ||
+	    dirtyjtag_djtag2_queue_reset_tms(context)) {
+		dirtyjtag_batch_finish(context);
+		return -1;
+	}
 
-		transfer_buffer[0] = CMD_XFER | NO_READ;
-		if (txn_size * 8 >= 256)
-			transfer_buffer[0] |= EXTEND_LENGTH;
-		transfer_buffer[1] = (txn_size * 8) % 256;
-		memcpy(transfer_buffer + 2, writearr + i, txn_size);
+	return dirtyjtag_batch_finish(context) ? -1 : 0;
+}
 
-		if (dirtyjtag_send(context, transfer_buffer, 2 + txn_size))
-			return -1;
+/* Pack all commands into as few USB packets as possible. */
+static int dirtyjtag_djtag2_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	struct dirtyjtag_spi_data *const context = flash->mst.spi->data;
 
-		i += txn_size;
+	for (; cmds->writecnt || cmds->readcnt; cmds++) {
+		if (cmds->io_mode != SINGLE_IO_1_1_1) {
+			msg_perr("%s called with multi-I/O command.\n"
+				 "Please report a bug at flashprog@flashprog.org\n", __func__);
+			dirtyjtag_batch_finish(context);
+			return SPI_FLASHPROG_BUG;
+		}
+		if (dirtyjtag_djtag2_queue_xfer(context, cmds->writearr, NULL, cmds->writecnt) ||
+		    dirtyjtag_djtag2_queue_xfer(context, NULL, cmds->readarr, cmds->readcnt) ||
+		    dirtyjtag_djtag2_queue_reset_tms(context)) {
+			dirtyjtag_batch_finish(context);
+			return -1;
+		}
 	}
 
-	i = 0;
-	while (i < readcnt) {
-		const size_t rxn_size = MIN(max_xfer_size, readcnt - i);
+	return dirtyjtag_batch_finish(context) ? -1 : 0;
+}
 
-		transfer_buffer[0] = CMD_XFER;
-		if (rxn_size * 8 >= 256)
-			transfer_buffer[0] |= EXTEND_LENGTH;
-		transfer_buffer[1] = (rxn_size * 8) % 256;
+/*
+ * Read with a single read command, keeping up to DJTAG_ASYNC_TRANSFERS
+ * answers in flight. Progress is reported every DJTAG_READ_BLOCK bytes.
+ */
+static int dirtyjtag_djtag2_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct dirtyjtag_spi_data *const context = flash->mst.spi->data;
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+	int ret = 0;
 
-		if (dirtyjtag_send(context, transfer_buffer, 2 + rxn_size))
-			return -1;
+	if (!len)
+		return 0;
 
-		if (dirtyjtag_receive(context, readarr + i, rxn_size, rxn_size) < 0)
-			return -1;
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	if (dirtyjtag_djtag2_queue_xfer(context, cmd, NULL, cmdlen))
+		goto read_err;
 
-		i += rxn_size;
+	while (done < len) {
+		const unsigned int block = min(DJTAG_READ_BLOCK, len - done);
+
+		if (flashprog_cancelled(flash)) {
+			ret = 1;
+			break;
+		}
+
+		if (dirtyjtag_djtag2_queue_xfer(context, NULL, buf + done, block) ||
+		    dirtyjtag_batch_sync(context))
+			goto read_err;
+
+		flashprog_progress_add(flash, block);
+		done += block;
 	}
 
-	dirtyjtag_reset_tms(context);
+	if (dirtyjtag_djtag2_queue_reset_tms(context))
+		goto read_err;
+
+	return dirtyjtag_batch_finish(context) ? -1 : ret;
 
+read_err:
+	dirtyjtag_batch_finish(context);
+	return -1;
+}
+
+static int dirtyjtag_spi_shutdown(void *data)
+{
+	struct dirtyjtag_spi_data *djtag_data = (struct dirtyjtag_spi_data*)data;
+	dirtyjtag_batch_free(&djtag_data->batch);
+	libusb_release_interface(djtag_data->libusb_handle, 0);
+	libusb_attach_kernel_driver(djtag_data->libusb_handle, 0);
+	libusb_close(djtag_data->libusb_handle);
+	usb_dev_exit(djtag_data->libusb_ctx);
+	free(data);
 	return 0;
 }
 
@@ -291,7 +568,7 @@ static int dirtyjtag_spi_init(struct flashprog_programmer *const prog)
 		return -1;
 	}
 
-	int ret = libusb_init(&djtag_data->libusb_ctx);
+	int ret = usb_dev_init(&djtag_data->libusb_ctx);
 	if (ret < 0) {
 		msg_perr("%s: couldn't initialize libusb!\n", __func__);
 		goto cleanup_djtag_struct;
@@ -375,6 +652,12 @@ static int dirtyjtag_spi_init(struct flashprog_programmer *const prog)
 		/* fall-through */
 	case 2:
 		dirtyjtag_spi.command = dirtyjtag_djtag2_spi_send_command;
+		dirtyjtag_spi.multicommand = dirtyjtag_djtag2_spi_send_multicommand;
+		dirtyjtag_spi.read = dirtyjtag_djtag2_spi_read;
+		if (dirtyjtag_batch_init(&djtag_data->batch)) {
+			free(info);
+			goto cleanup_libusb_handle;
+		}
 		break;
 	case 1:
 		dirtyjtag_spi.command = dirtyjtag_djtag1_spi_send_command;
@@ -402,11 +685,12 @@ static int dirtyjtag_spi_init(struct flashprog_programmer *const prog)
 	return register_spi_master(&dirtyjtag_spi, 0, djtag_data);
 
 cleanup_libusb_handle:
+	dirtyjtag_batch_free(&djtag_data->batch);
 	libusb_attach_kernel_driver(handle, 0);
 	libusb_close(handle);
 
 cleanup_libusb_ctx:
-	libusb_exit(djtag_data->libusb_ctx);
+	usb_dev_exit(djtag_data->libusb_ctx);
 
 cleanup_djtag_struct:
 	free(djtag_data);
@@ -418,4 +702,5 @@ const struct programmer_entry programmer_dirtyjtag_spi = {
 	.type			= USB,
 	.devs.dev		= devs_dirtyjtag_spi,
 	.init			= dirtyjtag_spi_init,
+	.multi_instance		= true,
 };
@@ -20,13 +20,23 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if !defined(__LIBPAYLOAD__) && !IS_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+#endif
 #include "flash.h"
 #include "chipdrivers.h"
 #include "programmer.h"
 
 #include "spi.h"
+#include "sfdp.h"
 #include "writeprotect.h"
 
 enum emu_chip {
@@ -37,10 +47,39 @@ enum emu_chip {
 	EMULATE_MACRONIX_MX25L6436,
 	EMULATE_WINBOND_W25Q128FV,
 	EMULATE_SPANSION_S25FL128L,
+	EMULATE_SFDP_GENERIC,
+	EMULATE_WINBOND_W25M512JV,
+	EMULATE_MICRON_MT29F1G01ABAFD,
+};
+
+/* The emulated SPI NAND has 2KiB pages with 128B spare areas, 64 pages per block. */
+#define EMU_NAND_PAGE_SIZE	2048
+#define EMU_NAND_SPARE_SIZE	128
+#define EMU_NAND_BLOCK_PAGES	64
+
+/* Parameter tables of the generic SFDP chip: BFPT (JESD216B) and 4BAIT. */
+#define SFDP_GENERIC_BFPT_DWORDS	16
+#define SFDP_GENERIC_4BAIT_DWORDS	2
+#define SFDP_GENERIC_BFPT_PTP		(3 * SFDP_HEADER_LEN)
+#define SFDP_GENERIC_4BAIT_PTP		(SFDP_GENERIC_BFPT_PTP + 4 * SFDP_GENERIC_BFPT_DWORDS)
+#define SFDP_GENERIC_LEN		(SFDP_GENERIC_4BAIT_PTP + 4 * SFDP_GENERIC_4BAIT_DWORDS)
+
+/* Number of chips one emulated SPI master can address, see chip_selects=. */
+#define DUMMY_MAX_CHIP_SELECTS	4
+
+/*
+ * With virtual_time=yes, the timing model advances a simulated clock
+ * instead of waiting. All chip selects of a programmer share the clock.
+ */
+struct dummy_clock {
+	bool virtual_time;
+	uint64_t virtual_time_us;
 };
 
 struct emu_data {
+	struct dummy_clock *clock;
 	enum emu_chip emu_chip;
+	unsigned int emu_chip_selects;	/* emulated chips, this is one of them */
 	char *emu_persistent_image;
 	unsigned int emu_chip_size;
 	/* Note: W25Q128FV doesn't change value of SR2 if it's not provided, but
@@ -49,15 +88,29 @@ struct emu_data {
 	bool emu_wrsr_ext2;
 	bool emu_wrsr_ext3;
 	bool emu_modified;	/* is the image modified since reading it? */
+	bool emu_image_mapped;	/* flashchip_contents is a shared mapping of the persistent image */
 	uint8_t emu_status[3];
 	uint8_t emu_status_len;	/* number of emulated status registers */
 	unsigned int emu_max_byteprogram_size;
 	unsigned int emu_max_aai_size;
+	unsigned int emu_aai_offs;	/* where the next AAI word goes */
 	unsigned int emu_jedec_se_size;
 	unsigned int emu_jedec_be_52_size;
 	unsigned int emu_jedec_be_d8_size;
 	unsigned int emu_jedec_ce_60_size;
 	unsigned int emu_jedec_ce_c7_size;
+	bool emu_4ba_mode;	/* 3-byte address opcodes take 4 bytes (generic chip only) */
+	bool emu_qpi_support;	/* generic chip with QPI mode, QE is bit 6 of SR1 */
+	bool emu_qpi;		/* in QPI mode, all commands come in 4-4-4 */
+	unsigned int emu_dies;	/* stacked dies, 0 for single-die chips */
+	unsigned int emu_die;	/* selected die, the state below belongs to it */
+	struct {		/* state of the other dies */
+		uint8_t status[3];
+		uint64_t busy_until;
+	} emu_die_state[MAX_DIES];
+	const uint8_t *emu_sfdp;	/* SFDP table, if the chip has one */
+	size_t emu_sfdp_len;
+	uint8_t emu_sfdp_generic[SFDP_GENERIC_LEN];
 	unsigned char spi_blacklist[256];
 	unsigned char spi_ignorelist[256];
 	unsigned int spi_blacklist_size;
@@ -70,8 +123,52 @@ struct emu_data {
 
 	unsigned int spi_write_256_chunksize;
 	uint8_t *flashchip_contents;
+
+	/* Timing model, all zero unless requested. */
+	unsigned int latency_us;	/* overhead of every transaction */
+	unsigned int bandwidth_kbps;	/* bus speed in kbit/s */
+	unsigned int max_transfer;	/* max. data bytes per transaction */
+	unsigned int page_program_us;
+	unsigned int sector_erase_us;	/* 4KiB erase (0x20) */
+	unsigned int block_erase_us;	/* 32/64KiB erase (0x52, 0xd8), chip erase takes one per 64KiB */
+	unsigned int page_read_us;	/* SPI NAND array to cache (0x13, 0x31) */
+	uint64_t busy_until;		/* monotonic_us() when WIP clears */
+
+	/* SPI NAND state, cf. emulate_spi_nand_response(). */
+	struct {
+		uint8_t prot;
+		uint8_t status;		/* without OIP, that follows `busy_until` */
+		int data_page;		/* page in the data register for 0x31/0x3f, -1 if none */
+		uint64_t array_until;	/* when reading `data_page` from the array is done */
+		int bad_block;		/* block with a bad-block marker, -1 if none */
+		uint8_t cache[EMU_NAND_PAGE_SIZE + EMU_NAND_SPARE_SIZE];
+	} emu_nand;
+
+	/* SPI clock, set for `spispeed=auto'. From `flaky_khz' on, responses get bit errors. */
+	unsigned int spi_khz;
+	unsigned int flaky_khz;
+	unsigned int flaky_count;
 };
 
+static uint64_t dummy_now(const struct emu_data *const data)
+{
+	return data->clock->virtual_time ? data->clock->virtual_time_us : monotonic_us();
+}
+
+static void dummy_clock_delay(struct dummy_clock *const clock, unsigned int usecs)
+{
+	if (clock->virtual_time)
+		clock->virtual_time_us += usecs;
+	else
+		internal_delay(usecs);
+}
+
+static void dummy_delay(struct flashprog_programmer *const prog, unsigned int usecs)
+{
+	const struct emu_data *const data = prog->data;
+	dummy_clock_delay(data->clock, usecs);
+}
+
 /* A legit complete SFDP table based on the MX25L6436E (rev. 1.8) datasheet. */
 static const uint8_t sfdp_table[] = {
 	0x53, 0x46, 0x44, 0x50, // @0x00: SFDP signature
@@ -98,10 +195,161 @@ static const uint8_t sfdp_table[] = {
 	0xFF, 0xFF, 0xFF, 0xFF, // @0x54: Macronix parameter table end
 };
 
+/* Multi-I/O reads of the generic SFDP chip, as advertised in its table. */
+static const struct fast_read_params sfdp_generic_fast_read[NUM_IO_MODES] = {
+	[SINGLE_IO_1_1_1]	= { JEDEC_READ_FAST,	 0, 8 },
+	[DUAL_OUT_1_1_2]	= { JEDEC_READ_DUAL_OUT, 0, 8 },
+	[DUAL_IO_1_2_2]		= { JEDEC_READ_DUAL_IO,	 4, 0 },
+	[QUAD_OUT_1_1_4]	= { JEDEC_READ_QUAD_OUT, 0, 8 },
+	[QUAD_IO_1_4_4]		= { JEDEC_READ_QUAD_IO,	 2, 4 },
+	[QPI_4_4_4]		= { JEDEC_READ_QUAD_IO,	 2, 4 },
+};
+
+static void sfdp_put_dword(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val;
+	buf[1] = val >> 8;
+	buf[2] = val >> 16;
+	buf[3] = val >> 24;
+}
+
+static void sfdp_put_header(uint8_t *buf, const struct sfdp_tbl_hdr *hdr)
+{
+	buf[0] = hdr->id;
+	buf[1] = hdr->v_minor;
+	buf[2] = hdr->v_major;
+	buf[3] = hdr->len;
+	buf[4] = hdr->ptp;
+	buf[5] = hdr->ptp >> 8;
+	buf[6] = hdr->ptp >> 16;
+	buf[7] = hdr->id_msb;
+}
+
+/*
+ * Encode a duration as a count (of `count_bits`) and the smallest of
+ * the `num_units` units that fits. Zero results in the shortest encoding.
+ */
+static uint32_t sfdp_encode_time(unsigned int us, const unsigned int units[], unsigned int num_units,
+				 unsigned int count_bits)
+{
+	const unsigned int max_count = 1 << count_bits;
+	unsigned int unit, count;
+
+	for (unit = 0; unit < num_units - 1; ++unit) {
+		if ((us + units[unit] - 1) / units[unit] <= max_count)
+			break;
+	}
+	count = (us + units[unit] - 1) / units[unit];
+	count = count < 1 ? 1 : count > max_count ? max_count : count;
+	return (count - 1) | unit << count_bits;
+}
+
+static unsigned int sfdp_log2(unsigned int val)
+{
+	unsigned int i;
+
+	for (i = 0; val > 1; ++i)
+		val >>= 1;
+	return i;
+}
+
+/*
+ * Build the SFDP table of the generic chip from its emulated features:
+ * 4KiB, 32KiB and 64KiB erase, all multi-I/O reads without a Quad
+ * Enable bit, B7/E9 to switch to 4-byte addresses and native 4-byte
+ * instructions. The advertised times are those of the timing model.
+ * With QPI mode, the Quad Enable bit is bit 6 of SR1, quad reads need
+ * it then, too.
+ */
+static void sfdp_generic_build(struct emu_data *data)
+{
+	static const unsigned int erase_units[] = { 1000, 16 * 1000, 128 * 1000, 1000 * 1000 };
+	static const unsigned int program_units[] = { 8, 64 };
+	static const unsigned int chip_erase_units[] = {
+		16 * 1000, 256 * 1000, 4 * 1000 * 1000, 64 * 1000 * 1000 };
+	const struct sfdp_tbl_hdr hdrs[] = {
+		{ SFDP_BFPT_ID, 6, 1, SFDP_GENERIC_BFPT_DWORDS, SFDP_GENERIC_BFPT_PTP, SFDP_JEDEC_ID_MSB },
+		{ SFDP_4BAIT_ID, 0, 1, SFDP_GENERIC_4BAIT_DWORDS, SFDP_GENERIC_4BAIT_PTP, SFDP_JEDEC_ID_MSB },
+	};
+	const struct fast_read_params *const fr = sfdp_generic_fast_read;
+	uint8_t *const sfdp = data->emu_sfdp_generic;
+	uint8_t *const bfpt = sfdp + SFDP_GENERIC_BFPT_PTP;
+	uint8_t *const bait = sfdp + SFDP_GENERIC_4BAIT_PTP;
+	const unsigned long long chip_erase_us =
+		(unsigned long long)data->block_erase_us * (data->emu_chip_size / (64 * KiB));
+	size_t i;
+
+	memset(sfdp, 0xff, SFDP_GENERIC_LEN);
+	sfdp_put_dword(sfdp, SFDP_SIGNATURE);
+	sfdp[4] = 6;			/* revision 1.6 */
+	sfdp[5] = 1;
+	sfdp[6] = ARRAY_SIZE(hdrs) - 1;	/* NPH */
+	for (i = 0; i < ARRAY_SIZE(hdrs); ++i)
+		sfdp_put_header(sfdp + SFDP_HEADER_LEN * (1 + i), &hdrs[i]);
+
+	sfdp_put_dword(bfpt + 4 * 0, 0xff800000 |
+		       SFDP_BFPT_DW1_FAST_READ_112 | SFDP_BFPT_DW1_FAST_READ_122 |
+		       SFDP_BFPT_DW1_FAST_READ_144 | SFDP_BFPT_DW1_FAST_READ_114 |
+		       SFDP_BFPT_ADDR_3_OR_4 << SFDP_BFPT_DW1_ADDR_SHIFT |
+		       JEDEC_SE << SFDP_BFPT_DW1_ERASE_4K_OP_SHIFT |
+		       SFDP_BFPT_DW1_WRITE_64 | SFDP_BFPT_DW1_ERASE_4K);
+	sfdp_put_dword(bfpt + 4 * 1, data->emu_chip_size * 8 - 1);
+	sfdp_put_dword(bfpt + 4 * 2,
+		SFDP_FAST_READ_PARAMS(fr[QUAD_OUT_1_1_4].opcode, fr[QUAD_OUT_1_1_4].mode_clocks,
+				      fr[QUAD_OUT_1_1_4].dummy_clocks) << 16 |
+		SFDP_FAST_READ_PARAMS(fr[QUAD_IO_1_4_4].opcode, fr[QUAD_IO_1_4_4].mode_clocks,
+				      fr[QUAD_IO_1_4_4].dummy_clocks));
+	sfdp_put_dword(bfpt + 4 * 3,
+		SFDP_FAST_READ_PARAMS(fr[DUAL_IO_1_2_2].opcode, fr[DUAL_IO_1_2_2].mode_clocks,
+				      fr[DUAL_IO_1_2_2].dummy_clocks) << 16 |
+		SFDP_FAST_READ_PARAMS(fr[DUAL_OUT_1_1_2].opcode, fr[DUAL_OUT_1_1_2].mode_clocks,
+				      fr[DUAL_OUT_1_1_2].dummy_clocks));
+	if (data->emu_qpi_support) {
+		sfdp_put_dword(bfpt + 4 * 4, 0xffffffee | SFDP_BFPT_DW5_FAST_READ_444);
+		sfdp_put_dword(bfpt + 4 * 6, 0x0000ffff |
+			SFDP_FAST_READ_PARAMS(fr[QPI_4_4_4].opcode, fr[QPI_4_4_4].mode_clocks,
+					      fr[QPI_4_4_4].dummy_clocks) << 16);
+	} else {
+		sfdp_put_dword(bfpt + 4 * 4, 0xffffffee);	/* no 2-2-2 and 4-4-4 */
+		sfdp_put_dword(bfpt + 4 * 6, 0x0000ffff);
+	}
+	sfdp_put_dword(bfpt + 4 * 5, 0x0000ffff);
+	/* Erase types 1 to 3: 4KiB, 32KiB, 64KiB */
+	sfdp_put_dword(bfpt + 4 * 7, JEDEC_BE_52 << 24 | 15 << 16 | JEDEC_SE << 8 | 12);
+	sfdp_put_dword(bfpt + 4 * 8, JEDEC_BE_D8 << 8 | 16);
+	sfdp_put_dword(bfpt + 4 * 9,
+		       sfdp_encode_time(data->block_erase_us, erase_units, 4, 5) << 18 |
+		       sfdp_encode_time(data->block_erase_us, erase_units, 4, 5) << 11 |
+		       sfdp_encode_time(data->sector_erase_us, erase_units, 4, 5) << 4);
+	sfdp_put_dword(bfpt + 4 * 10, 1u << 31 |
+		       sfdp_encode_time(MIN(chip_erase_us, UINT_MAX), chip_erase_units, 4, 5) << 24 |
+		       sfdp_encode_time(data->page_program_us, program_units, 2, 5) << 8 |
+		       sfdp_log2(data->emu_max_byteprogram_size) << 4);
+	/* DW12..14: no suspend/resume, no deep power-down */
+	if (data->emu_qpi_support)
+		sfdp_put_dword(bfpt + 4 * 14, 2 << SFDP_BFPT_DW15_QER_SHIFT |
+			       SFDP_QPI_ENTER_QE_38 << SFDP_BFPT_DW15_QPI_ENTER_SHIFT |
+			       SFDP_QPI_EXIT_FF << SFDP_BFPT_DW15_QPI_EXIT_SHIFT);
+	else
+		sfdp_put_dword(bfpt + 4 * 14, 0);	/* no Quad Enable bit */
+	sfdp_put_dword(bfpt + 4 * 15, 1 << 7 |
+		       SFDP_4BA_ENTER_B7 << SFDP_BFPT_DW16_4BA_ENTER_SHIFT |
+		       SFDP_4BA_EXIT_E9 << SFDP_BFPT_DW16_4BA_EXIT_SHIFT);
+
+	sfdp_put_dword(bait + 4 * 0, 0xffff0000 |
+		       0x7 << SFDP_4BAIT_DW1_ERASE_TYPE_SHIFT |
+		       SFDP_4BAIT_DW1_PROGRAM_12 | SFDP_4BAIT_DW1_FAST_READ_0C | SFDP_4BAIT_DW1_READ_13);
+	sfdp_put_dword(bait + 4 * 1, 0xff000000 | 0xdc << 16 | 0x5c << 8 | 0x21);
+
+	data->emu_sfdp = sfdp;
+	data->emu_sfdp_len = SFDP_GENERIC_LEN;
+}
+
 
 
 static int dummy_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				  const unsigned char *writearr, unsigned char *readarr);
+static int dummy_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds);
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
 static void dummy_chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr);
@@ -113,6 +361,12 @@ static uint16_t dummy_chip_readw(const struct flashctx *flash, const chipaddr ad
 static uint32_t dummy_chip_readl(const struct flashctx *flash, const chipaddr addr);
 static void dummy_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
 static bool dummy_spi_probe_opcode(const struct flashctx *flash, uint8_t opcode);
+static int dummy_spi_blank_check(struct flashctx *flash, unsigned int start, unsigned int len,
+				 uint8_t erased_value);
+static int dummy_spi_checksum(struct flashctx *flash, unsigned int start, unsigned int len,
+			      uint32_t *crc);
+static size_t dummy_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds);
+static int dummy_spi_set_speed(const struct flashctx *flash, unsigned long hz);
 static void *dummy_map(const char *descr, uintptr_t phys_addr, size_t len);
 static void dummy_unmap(void *virt_addr, size_t len);
 
@@ -121,10 +375,14 @@ static const struct spi_master spi_master_dummyflasher = {
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
 	.command	= dummy_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= dummy_spi_send_multicommand,
 	.read		= default_spi_read,
 	.write_256	= dummy_spi_write_256,
 	.probe_opcode	= dummy_spi_probe_opcode,
+	.blank_check	= dummy_spi_blank_check,
+	.checksum	= dummy_spi_checksum,
+	.list_speeds	= dummy_spi_list_speeds,
+	.set_speed	= dummy_spi_set_speed,
 };
 
 static const struct par_master par_master_dummyflasher = {
@@ -140,21 +398,117 @@ static const struct par_master par_master_dummyflasher = {
 	.unmap_flash	= dummy_unmap,
 };
 
-static int dummy_shutdown(void *data)
+#ifdef HAVE_MMAP
+/* Map the persistent image, so only touched pages are read and written back. */
+static bool map_persistent_image(struct emu_data *data)
 {
-	msg_pspew("%s\n", __func__);
-	struct emu_data *emu_data = (struct emu_data *)data;
-	if (emu_data->emu_chip != EMULATE_NONE) {
-		if (emu_data->emu_persistent_image && emu_data->emu_modified) {
+	struct stat st;
+	void *map = MAP_FAILED;
+
+	const int fd = open(data->emu_persistent_image, O_RDWR);
+	if (fd < 0)
+		return false;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (uintmax_t)st.st_size == data->emu_chip_size)
+		map = mmap(NULL, data->emu_chip_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	free(data->flashchip_contents);
+	data->flashchip_contents = map;
+	data->emu_image_mapped = true;
+	return true;
+}
+#endif
+
+static void free_flashchip_contents(struct emu_data *data)
+{
+#ifdef HAVE_MMAP
+	if (data->emu_image_mapped) {
+		munmap(data->flashchip_contents, data->emu_chip_size);
+		return;
+	}
+#endif
+	free(data->flashchip_contents);
+}
+
+/* Free the emulated chips behind `data`, writing their images back. */
+static void free_emu_chips(struct emu_data *const data)
+{
+	unsigned int i;
+
+	for (i = 0; i < data->emu_chip_selects; ++i) {
+		struct emu_data *const emu_data = &data[i];
+
+		if (emu_data->emu_chip == EMULATE_NONE || !emu_data->flashchip_contents)
+			continue;
+		if (emu_data->emu_qpi)
+			msg_perr("Emulated chip was left in QPI mode!\n");
+		/* A mapped image is already up to date. */
+		if (emu_data->emu_persistent_image && emu_data->emu_modified && !emu_data->emu_image_mapped) {
 			msg_pdbg("Writing %s\n", emu_data->emu_persistent_image);
 			write_buf_to_file(emu_data->flashchip_contents,
 					  emu_data->emu_chip_size,
 					  emu_data->emu_persistent_image);
 		}
 		free(emu_data->emu_persistent_image);
-		free(emu_data->flashchip_contents);
+		free_flashchip_contents(emu_data);
 	}
-	free(data);
+}
+
+static int dummy_shutdown(void *data)
+{
+	msg_pspew("%s\n", __func__);
+	struct emu_data *const emu_data = data;
+
+	free_emu_chips(emu_data);
+	if (emu_data->clock->virtual_time)
+		msg_pinfo("Simulated time: %llu us\n", (unsigned long long)emu_data->clock->virtual_time_us);
+	free(emu_data->clock);
+	free(emu_data);
+	return 0;
+}
+
+static int get_timing_param(const char *name, unsigned int *value)
+{
+	char *endptr;
+	char *const tmp = extract_programmer_param(name);
+	if (!tmp)
+		return 0;
+
+	errno = 0;
+	*value = strtoul(tmp, &endptr, 0);
+	if (errno || tmp == endptr || *endptr != '\0') {
+		msg_perr("invalid %s\n", name);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* Parse a power-of-two size parameter of the generic chip. */
+static int get_generic_size(const char *name, unsigned int *value, unsigned int def,
+			    unsigned int min, unsigned int max)
+{
+	char *endptr;
+	char *const tmp = extract_programmer_param(name);
+	if (!tmp) {
+		*value = def;
+		return 0;
+	}
+
+	errno = 0;
+	const unsigned long val = strtoul(tmp, &endptr, 0);
+	if (errno || endptr == tmp || *endptr != '\0' ||
+	    val < min || val > max || (val & (val - 1))) {
+		msg_perr("Invalid %s `%s', must be a power of two between %u and %u.\n",
+			 name, tmp, min, max);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	*value = val;
 	return 0;
 }
 
@@ -205,6 +559,30 @@ static int init_data(struct emu_data *data, enum chipbustype *dummy_buses_suppor
 		free(tmp);
 	}
 
+	if (get_timing_param("latency_us", &data->latency_us) ||
+	    get_timing_param("bandwidth_kbps", &data->bandwidth_kbps) ||
+	    get_timing_param("max_transfer", &data->max_transfer) ||
+	    get_timing_param("page_program_us", &data->page_program_us) ||
+	    get_timing_param("sector_erase_us", &data->sector_erase_us) ||
+	    get_timing_param("block_erase_us", &data->block_erase_us) ||
+	    get_timing_param("page_read_us", &data->page_read_us))
+		return 1;
+
+	if (get_timing_param("flaky_spispeed", &data->flaky_khz))
+		return 1;
+
+	tmp = extract_programmer_param("virtual_time");
+	if (tmp) {
+		if (!strcmp(tmp, "yes")) {
+			data->clock->virtual_time = true;
+		} else if (strcmp(tmp, "no")) {
+			msg_perr("virtual_time can be \"yes\" or \"no\"\n");
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+
 	tmp = extract_programmer_param("spi_blacklist");
 	if (tmp) {
 		i = strlen(tmp);
@@ -352,6 +730,8 @@ static int init_data(struct emu_data *data, enum chipbustype *dummy_buses_suppor
 		data->emu_jedec_be_d8_size = 64 * 1024;
 		data->emu_jedec_ce_60_size = data->emu_chip_size;
 		data->emu_jedec_ce_c7_size = data->emu_chip_size;
+		data->emu_sfdp = sfdp_table;
+		data->emu_sfdp_len = sizeof(sfdp_table);
 		msg_pdbg("Emulating Macronix MX25L6436 SPI flash chip (RDID, "
 			 "SFDP)\n");
 	}
@@ -384,6 +764,75 @@ static int init_data(struct emu_data *data, enum chipbustype *dummy_buses_suppor
 		data->emu_jedec_ce_c7_size = data->emu_chip_size;
 		msg_pdbg("Emulating Spansion S25FL128L SPI flash chip (RES, RDID, WP)\n");
 	}
+	if (!strcmp(tmp, "W25M512JV")) {
+		data->emu_chip = EMULATE_WINBOND_W25M512JV;
+		data->emu_chip_size = 64 * 1024 * 1024;
+		data->emu_dies = 2;
+		data->emu_max_byteprogram_size = 256;
+		data->emu_max_aai_size = 0;
+		data->emu_status_len = 1;
+		data->emu_jedec_se_size = 4 * 1024;
+		data->emu_jedec_be_52_size = 32 * 1024;
+		data->emu_jedec_be_d8_size = 64 * 1024;
+		/* Chip erase erases the selected die. */
+		data->emu_jedec_ce_60_size = data->emu_chip_size / data->emu_dies;
+		data->emu_jedec_ce_c7_size = data->emu_chip_size / data->emu_dies;
+		msg_pdbg("Emulating Winbond W25M512JV SPI flash chip (RDID, 2 dies, 4BA)\n");
+	}
+	if (!strcmp(tmp, "MT29F1G01ABAFD")) {
+		char *const bad_block = extract_programmer_param("nand_bad_block");
+
+		data->emu_chip = EMULATE_MICRON_MT29F1G01ABAFD;
+		data->emu_chip_size = 128 * MiB;
+		/* Blocks are locked after power-up. */
+		data->emu_nand.prot = 0x38;
+		data->emu_nand.data_page = -1;
+		data->emu_nand.bad_block = -1;
+		if (bad_block) {
+			const unsigned long block = strtoul(bad_block, &endptr, 0);
+			if (*endptr != '\0' || endptr == bad_block ||
+			    block >= data->emu_chip_size / EMU_NAND_PAGE_SIZE / EMU_NAND_BLOCK_PAGES) {
+				msg_perr("invalid nand_bad_block\n");
+				free(bad_block);
+				free(tmp);
+				return 1;
+			}
+			data->emu_nand.bad_block = block;
+			free(bad_block);
+		}
+		msg_pdbg("Emulating Micron MT29F1G01ABAFD SPI NAND chip (cache read sequential)\n");
+	}
+	if (!strcmp(tmp, "sfdp_generic")) {
+		data->emu_chip = EMULATE_SFDP_GENERIC;
+		if (get_generic_size("size", &data->emu_chip_size, 16 * MiB, 64 * KiB, 256 * MiB) ||
+		    get_generic_size("page_size", &data->emu_max_byteprogram_size, 256, 64, 4 * KiB)) {
+			free(tmp);
+			return 1;
+		}
+		data->emu_max_aai_size = 0;
+		data->emu_status_len = 1;
+		data->emu_jedec_se_size = 4 * 1024;
+		data->emu_jedec_be_52_size = 32 * 1024;
+		data->emu_jedec_be_d8_size = 64 * 1024;
+		data->emu_jedec_ce_60_size = data->emu_chip_size;
+		data->emu_jedec_ce_c7_size = data->emu_chip_size;
+		char *const qpi = extract_programmer_param("qpi");
+		if (qpi) {
+			if (!strcmp(qpi, "yes")) {
+				data->emu_qpi_support = true;
+			} else if (strcmp(qpi, "no")) {
+				msg_perr("qpi can be \"yes\" or \"no\"\n");
+				free(qpi);
+				free(tmp);
+				return 1;
+			}
+			free(qpi);
+		}
+		sfdp_generic_build(data);
+		msg_pdbg("Emulating generic SPI flash chip (%u kB, %u B pages, SFDP, multi-I/O, %s4BA)\n",
+			 data->emu_chip_size / KiB, data->emu_max_byteprogram_size,
+			 data->emu_qpi_support ? "QPI, " : "");
+	}
 	if (data->emu_chip == EMULATE_NONE) {
 		msg_perr("Invalid chip specified for emulation: %s\n", tmp);
 		free(tmp);
@@ -436,26 +885,103 @@ static int init_data(struct emu_data *data, enum chipbustype *dummy_buses_suppor
 	return 0;
 }
 
+/* Load the persistent image of chip select `cs` if there is one, or fill the chip with 0xff. */
+static int load_persistent_image(struct emu_data *const data, const unsigned int cs)
+{
+	struct stat image_stat;
+	char param[16];
+
+	if (cs)
+		snprintf(param, sizeof(param), "image%u", cs);
+	else
+		snprintf(param, sizeof(param), "image");
+
+	/* Will be freed by shutdown function if necessary. */
+	data->emu_persistent_image = extract_programmer_param(param);
+	/* We will silently (in default verbosity) ignore the file if it does not exist (yet) or the size does
+	 * not match the emulated chip. */
+	if (data->emu_persistent_image && !stat(data->emu_persistent_image, &image_stat)) {
+		msg_pdbg("Found persistent image %s, %jd B ",
+			 data->emu_persistent_image, (intmax_t)image_stat.st_size);
+		if ((uintmax_t)image_stat.st_size == data->emu_chip_size) {
+			msg_pdbg("matches.\n");
+#ifdef HAVE_MMAP
+			if (map_persistent_image(data)) {
+				msg_pdbg("Mapped %s\n", data->emu_persistent_image);
+				return 0;
+			}
+#endif
+			msg_pdbg("Reading %s\n", data->emu_persistent_image);
+			if (read_buf_from_file(data->flashchip_contents, data->emu_chip_size,
+					   data->emu_persistent_image)) {
+				msg_perr("Unable to read %s\n", data->emu_persistent_image);
+				return 1;
+			}
+			return 0;
+		}
+		msg_pdbg("doesn't match.\n");
+	}
+
+	msg_pdbg("Filling fake flash chip with 0xff, size %i\n", data->emu_chip_size);
+	memset(data->flashchip_contents, 0xff, data->emu_chip_size);
+	return 0;
+}
+
 static int dummy_init(struct flashprog_programmer *const prog)
 {
+	unsigned int chip_selects = 1, i;
 	int ret = 0;
-	struct stat image_stat;
 
-	struct emu_data *data = calloc(1, sizeof(*data));
+	msg_pspew("%s\n", __func__);
+
+	char *const tmp = extract_programmer_param("chip_selects");
+	if (tmp) {
+		char *endptr;
+		errno = 0;
+		chip_selects = strtoul(tmp, &endptr, 0);
+		if (errno || endptr == tmp || *endptr != '\0' ||
+		    chip_selects < 1 || chip_selects > DUMMY_MAX_CHIP_SELECTS) {
+			msg_perr("Invalid chip_selects `%s', must be between 1 and %u.\n",
+				 tmp, DUMMY_MAX_CHIP_SELECTS);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+
+	bool tune_speed = false;
+	char *const spispeed = extract_programmer_param("spispeed");
+	if (spispeed) {
+		tune_speed = !strcmp(spispeed, "auto");
+		if (!tune_speed) {
+			msg_perr("spispeed can only be \"auto\"\n");
+			free(spispeed);
+			return 1;
+		}
+		free(spispeed);
+	}
+
+	struct emu_data *data = calloc(chip_selects, sizeof(*data));
 	if (!data) {
 		msg_perr("Out of memory!\n");
 		return 1;
 	}
+	data->clock = calloc(1, sizeof(*data->clock));
+	if (!data->clock) {
+		msg_perr("Out of memory!\n");
+		free(data);
+		return 1;
+	}
 	data->emu_chip = EMULATE_NONE;
 	data->spi_write_256_chunksize = 256;
 
-	msg_pspew("%s\n", __func__);
-
 	enum chipbustype dummy_buses_supported;
 	if (init_data(data, &dummy_buses_supported)) {
+		free(data->clock);
 		free(data);
 		return 1;
 	}
+	data->emu_chip_selects = chip_selects;
 
 	if (data->emu_chip == EMULATE_NONE) {
 		msg_pdbg("Not emulating any flash chip.\n");
@@ -463,51 +989,54 @@ static int dummy_init(struct flashprog_programmer *const prog)
 		goto dummy_init_out;
 	}
 
-	msg_pdbg("Filling fake flash chip with 0xff, size %i\n", data->emu_chip_size);
-	memset(data->flashchip_contents, 0xff, data->emu_chip_size);
-
-	/* Will be freed by shutdown function if necessary. */
-	data->emu_persistent_image = extract_programmer_param("image");
-	if (!data->emu_persistent_image) {
-		/* Nothing else to do. */
-		goto dummy_init_out;
-	}
-	/* We will silently (in default verbosity) ignore the file if it does not exist (yet) or the size does
-	 * not match the emulated chip. */
-	if (!stat(data->emu_persistent_image, &image_stat)) {
-		msg_pdbg("Found persistent image %s, %jd B ",
-			 data->emu_persistent_image, (intmax_t)image_stat.st_size);
-		if ((uintmax_t)image_stat.st_size == data->emu_chip_size) {
-			msg_pdbg("matches.\n");
-			msg_pdbg("Reading %s\n", data->emu_persistent_image);
-			if (read_buf_from_file(data->flashchip_contents, data->emu_chip_size,
-					   data->emu_persistent_image)) {
-				msg_perr("Unable to read %s\n", data->emu_persistent_image);
-				free(data->emu_persistent_image);
-				free(data->flashchip_contents);
-				free(data);
-				return 1;
-			}
-		} else {
-			msg_pdbg("doesn't match.\n");
+	/* All chip selects emulate the same chip, each with its own contents. */
+	for (i = 1; i < chip_selects; ++i) {
+		data[i] = data[0];
+		if (data[0].emu_sfdp == data[0].emu_sfdp_generic)
+			data[i].emu_sfdp = data[i].emu_sfdp_generic;
+		data[i].flashchip_contents = malloc(data->emu_chip_size);
+		if (!data[i].flashchip_contents) {
+			msg_perr("Out of memory!\n");
+			goto dummy_init_fail;
 		}
 	}
+	for (i = 0; i < chip_selects; ++i) {
+		if (load_persistent_image(&data[i], i))
+			goto dummy_init_fail;
+	}
 
 dummy_init_out:
-	if (register_shutdown(dummy_shutdown, data)) {
-		free(data->emu_persistent_image);
-		free(data->flashchip_contents);
-		free(data);
-		return 1;
-	}
+	if (register_shutdown(dummy_shutdown, data))
+		goto dummy_init_fail;
+	prog->data = data;
 	if (dummy_buses_supported & BUS_NONSPI)
 		ret |= register_par_master(&par_master_dummyflasher,
 					   dummy_buses_supported & BUS_NONSPI,
 					   0, data);
-	if (dummy_buses_supported & BUS_SPI)
-		ret |= register_spi_master(&spi_master_dummyflasher, 0, data);
+	if (dummy_buses_supported & BUS_SPI) {
+		struct spi_master mst = spi_master_dummyflasher;
+		/* Only the generic chip knows multi-I/O reads, don't let others use them. */
+		if (data->emu_chip == EMULATE_SFDP_GENERIC)
+			mst.features |= SPI_MASTER_DUAL | SPI_MASTER_QUAD;
+		if (data->emu_qpi_support)
+			mst.features |= SPI_MASTER_QPI;
+		if (data->max_transfer) {
+			mst.max_data_read = data->max_transfer;
+			mst.max_data_write = data->max_transfer;
+		}
+		if (chip_selects > 1)
+			mst.chip_selects = chip_selects;
+		mst.tune_speed = tune_speed;
+		ret |= register_spi_master(&mst, 0, data);
+	}
 
 	return ret;
+
+dummy_init_fail:
+	free_emu_chips(data);
+	free(data->clock);
+	free(data);
+	return 1;
 }
 
 static void *dummy_map(const char *descr, uintptr_t phys_addr, size_t len)
@@ -702,16 +1231,275 @@ static int erase_flash_data(struct emu_data *data, uint32_t start, uint32_t len)
 	return 0;
 }
 
-static int emulate_spi_chip_response(unsigned int writecnt,
+/* Set WIP for `us` microseconds, as if a program or erase operation was running. */
+static void set_busy(struct emu_data *data, unsigned int us)
+{
+	if (!us)
+		return;
+	data->busy_until = dummy_now(data) + us;
+	data->emu_status[0] |= SPI_SR_WIP;
+}
+
+/*
+ * The generic chip and the W25M512JV also take native 4-byte address instructions.
+ * Returns the 3-byte address opcode they correspond to and the address length.
+ */
+static uint8_t emu_decode_opcode(const struct emu_data *data, uint8_t opcode, unsigned int *addr_len)
+{
+	static const uint8_t native_4ba[][2] = {
+		{ JEDEC_READ_4BA,		JEDEC_READ },
+		{ JEDEC_READ_4BA_FAST,		JEDEC_READ_FAST },
+		{ JEDEC_BYTE_PROGRAM_4BA,	JEDEC_BYTE_PROGRAM },
+		{ 0x21,				JEDEC_SE },
+		{ 0x5c,				JEDEC_BE_52 },
+		{ 0xdc,				JEDEC_BE_D8 },
+	};
+	size_t i;
+
+	*addr_len = 3;
+	if (data->emu_chip != EMULATE_SFDP_GENERIC && data->emu_chip != EMULATE_WINBOND_W25M512JV)
+		return opcode;
+
+	if (data->emu_4ba_mode)
+		*addr_len = 4;
+	for (i = 0; i < ARRAY_SIZE(native_4ba); ++i) {
+		if (native_4ba[i][0] == opcode) {
+			*addr_len = 4;
+			return native_4ba[i][1];
+		}
+	}
+	return opcode;
+}
+
+/*
+ * Returns the number of mode and dummy bytes of a fast read of the
+ * generic chip and its I/O mode, -1 if `opcode` is no fast read.
+ */
+static int emu_fast_read_dummy_len(const struct emu_data *data, uint8_t opcode, enum io_mode *io_mode)
+{
+	int mode;
+
+	if (data->emu_chip != EMULATE_SFDP_GENERIC)
+		return -1;
+
+	for (mode = 0; mode < NUM_IO_MODES; ++mode) {
+		const struct fast_read_params *const params = &sfdp_generic_fast_read[mode];
+		/* Only the 4-4-4 read works in QPI mode, and only there. */
+		if ((mode == QPI_4_4_4) != data->emu_qpi)
+			continue;
+		if (params->opcode == opcode) {
+			*io_mode = mode;
+			return (params->mode_clocks + params->dummy_clocks) * spi_addr_lines(mode) / 8;
+		}
+	}
+	return -1;
+}
+
+static unsigned int emu_die_size(const struct emu_data *data)
+{
+	return data->emu_dies ? data->emu_chip_size / data->emu_dies : data->emu_chip_size;
+}
+
+/* Address of a command within the selected die, truncated to its size. */
+static unsigned int emu_address(const struct emu_data *data, const unsigned char *writearr,
+				unsigned int addr_len)
+{
+	unsigned int offs = 0, i;
+
+	for (i = 1; i <= addr_len; ++i)
+		offs = offs << 8 | writearr[i];
+	return data->emu_die * emu_die_size(data) + offs % emu_die_size(data);
+}
+
+/* Software die select is accepted while the current die is busy. */
+static int emu_select_die(struct emu_data *data, unsigned int writecnt, const unsigned char *writearr)
+{
+	if (writecnt != JEDEC_SELECT_DIE_OUTSIZE || writearr[1] >= data->emu_dies) {
+		msg_perr("Invalid DIE SELECT!\n");
+		return 1;
+	}
+	memcpy(data->emu_die_state[data->emu_die].status, data->emu_status, sizeof(data->emu_status));
+	data->emu_die_state[data->emu_die].busy_until = data->busy_until;
+	data->emu_die = writearr[1];
+	memcpy(data->emu_status, data->emu_die_state[data->emu_die].status, sizeof(data->emu_status));
+	data->busy_until = data->emu_die_state[data->emu_die].busy_until;
+	return 0;
+}
+
+static unsigned int emu_nand_row(const unsigned char *writearr)
+{
+	return writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+}
+
+/* Read a page into the cache, only the spare area of a bad block's first page has a marker. */
+static void emu_nand_load(struct emu_data *data, unsigned int page)
+{
+	memcpy(data->emu_nand.cache, data->flashchip_contents + page * EMU_NAND_PAGE_SIZE, EMU_NAND_PAGE_SIZE);
+	memset(data->emu_nand.cache + EMU_NAND_PAGE_SIZE, 0xff, EMU_NAND_SPARE_SIZE);
+	if ((int)(page / EMU_NAND_BLOCK_PAGES) == data->emu_nand.bad_block && page % EMU_NAND_BLOCK_PAGES == 0)
+		data->emu_nand.cache[EMU_NAND_PAGE_SIZE] = 0x00;
+}
+
+/*
+ * Blocks are unlocked all at once, the bad block and locked blocks fail to
+ * program and erase. Programming can only clear bits, like the real thing.
+ */
+static int emulate_spi_nand_response(unsigned int writecnt, unsigned int readcnt,
+				     const unsigned char *writearr, unsigned char *readarr,
+				     struct emu_data *data)
+{
+	const unsigned int pages = data->emu_chip_size / EMU_NAND_PAGE_SIZE;
+	const unsigned int cache_size = sizeof(data->emu_nand.cache);
+	unsigned int page, col, i;
+
+	if (data->busy_until && dummy_now(data) >= data->busy_until)
+		data->busy_until = 0;
+	if (data->busy_until && writearr[0] != SPI_NAND_GET_FEATURE) {
+		msg_perr("Command 0x%02x sent while the chip is busy!\n", writearr[0]);
+		return 1;
+	}
+
+	switch (writearr[0]) {
+	case JEDEC_RDID:
+		if (writecnt != SPI_NAND_RDID_OUTSIZE)
+			return 1;
+		if (readcnt > 0)
+			readarr[0] = 0x2c;
+		if (readcnt > 1)
+			readarr[1] = 0x14;
+		break;
+	case 0xff: /* reset */
+		data->emu_nand.data_page = -1;
+		data->emu_nand.status = 0;
+		break;
+	case SPI_NAND_GET_FEATURE:
+		if (writecnt != 2 || !readcnt)
+			return 1;
+		if (writearr[1] == SPI_NAND_FEATURE_PROT)
+			readarr[0] = data->emu_nand.prot;
+		else if (writearr[1] == SPI_NAND_FEATURE_CONFIG)
+			readarr[0] = 0x10; /* ECC enabled */
+		else if (writearr[1] == SPI_NAND_FEATURE_STATUS)
+			readarr[0] = data->emu_nand.status | (data->busy_until ? SPI_NAND_SR_OIP : 0);
+		else
+			return 1;
+		break;
+	case SPI_NAND_SET_FEATURE:
+		if (writecnt != 3)
+			return 1;
+		if (writearr[1] == SPI_NAND_FEATURE_PROT)
+			data->emu_nand.prot = writearr[2];
+		else if (writearr[1] != SPI_NAND_FEATURE_CONFIG)
+			return 1;
+		break;
+	case JEDEC_WREN:
+		data->emu_nand.status |= SPI_NAND_SR_WEL;
+		break;
+	case JEDEC_WRDI:
+		data->emu_nand.status &= ~SPI_NAND_SR_WEL;
+		break;
+	case SPI_NAND_PAGE_READ:
+		if (writecnt != SPI_NAND_ROW_OUTSIZE || emu_nand_row(writearr) >= pages)
+			return 1;
+		page = emu_nand_row(writearr);
+		emu_nand_load(data, page);
+		data->emu_nand.data_page = page;
+		data->emu_nand.array_until = dummy_now(data) + data->page_read_us;
+		set_busy(data, data->page_read_us);
+		break;
+	case SPI_NAND_READ_CACHE_SEQ:
+	case SPI_NAND_READ_CACHE_END:
+		if (writecnt != 1 || data->emu_nand.data_page < 0)
+			return 1;
+		/* Busy until the data register is ready, the next page is read in the background. */
+		const uint64_t now = dummy_now(data);
+		const uint64_t ready = MAX(now, data->emu_nand.array_until);
+		set_busy(data, ready - now);
+		emu_nand_load(data, data->emu_nand.data_page);
+		if (writearr[0] == SPI_NAND_READ_CACHE_SEQ && (unsigned int)data->emu_nand.data_page + 1 < pages) {
+			++data->emu_nand.data_page;
+			data->emu_nand.array_until = ready + data->page_read_us;
+		} else {
+			data->emu_nand.data_page = -1;
+		}
+		break;
+	case SPI_NAND_READ_CACHE:
+	case JEDEC_READ_FAST:
+		if (writecnt != SPI_NAND_READ_CACHE_OUTSIZE)
+			return 1;
+		col = (writearr[1] << 8 | writearr[2]) % cache_size;
+		for (i = 0; i < readcnt; ++i)
+			readarr[i] = data->emu_nand.cache[(col + i) % cache_size];
+		break;
+	case SPI_NAND_PROGRAM_LOAD:
+	case SPI_NAND_PROGRAM_LOAD_RANDOM:
+		if (writecnt < SPI_NAND_PROGRAM_LOAD_OUTSIZE)
+			return 1;
+		if (writearr[0] == SPI_NAND_PROGRAM_LOAD)
+			memset(data->emu_nand.cache, 0xff, cache_size);
+		col = (writearr[1] << 8 | writearr[2]) % cache_size;
+		for (i = SPI_NAND_PROGRAM_LOAD_OUTSIZE; i < writecnt; ++i)
+			data->emu_nand.cache[(col + i - SPI_NAND_PROGRAM_LOAD_OUTSIZE) % cache_size] = writearr[i];
+		break;
+	case SPI_NAND_PROGRAM_EXECUTE:
+	case SPI_NAND_BLOCK_ERASE:
+		if (writecnt != SPI_NAND_ROW_OUTSIZE || emu_nand_row(writearr) >= pages)
+			return 1;
+		page = emu_nand_row(writearr);
+		if (!(data->emu_nand.status & SPI_NAND_SR_WEL))
+			break;
+		data->emu_nand.status &= ~(SPI_NAND_SR_WEL | SPI_NAND_SR_P_FAIL | SPI_NAND_SR_E_FAIL);
+		if ((data->emu_nand.prot & SPI_NAND_PROT_BP_TB) ||
+		    (int)(page / EMU_NAND_BLOCK_PAGES) == data->emu_nand.bad_block) {
+			data->emu_nand.status |= writearr[0] == SPI_NAND_BLOCK_ERASE ? SPI_NAND_SR_E_FAIL
+										     : SPI_NAND_SR_P_FAIL;
+			break;
+		}
+		if (writearr[0] == SPI_NAND_BLOCK_ERASE) {
+			page -= page % EMU_NAND_BLOCK_PAGES;
+			memset(data->flashchip_contents + page * EMU_NAND_PAGE_SIZE, 0xff,
+			       EMU_NAND_BLOCK_PAGES * EMU_NAND_PAGE_SIZE);
+			set_busy(data, data->block_erase_us);
+		} else {
+			uint8_t *const dst = data->flashchip_contents + page * EMU_NAND_PAGE_SIZE;
+			for (i = 0; i < EMU_NAND_PAGE_SIZE; ++i)
+				dst[i] &= data->emu_nand.cache[i];
+			set_busy(data, data->page_program_us);
+		}
+		data->emu_modified = true;
+		break;
+	default:
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads wrap around at the end of the chip. */
+static void emu_read(const struct emu_data *data, unsigned int offs, unsigned char *readarr,
+		     unsigned int readcnt)
+{
+	while (readcnt > 0) {
+		const unsigned int chunk = min(readcnt, data->emu_chip_size - offs);
+		memcpy(readarr, data->flashchip_contents + offs, chunk);
+		readarr += chunk;
+		readcnt -= chunk;
+		offs = 0;
+	}
+}
+
+static int emulate_spi_chip_response(enum io_mode io_mode,
+				     unsigned int writecnt,
 				     unsigned int readcnt,
 				     const unsigned char *writearr,
 				     unsigned char *readarr,
 				     struct emu_data *data)
 {
-	unsigned int offs, i, toread;
+	unsigned int offs, i, toread, addr_len;
+	enum io_mode fast_read_mode = SINGLE_IO_1_1_1;
+	int fast_read_dummy;
+	uint8_t opcode;
 	uint8_t ro_bits;
 	bool wrsr_ext2, wrsr_ext3;
-	static int unsigned aai_offs;
 	const unsigned char sst25vf040_rems_response[2] = {0xbf, 0x44};
 	const unsigned char sst25vf032b_rems_response[2] = {0xbf, 0x4a};
 	const unsigned char mx25l6436_rems_response[2] = {0xc2, 0x16};
@@ -740,6 +1528,28 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		}
 	}
 
+	if (data->emu_dies && writearr[0] == JEDEC_SELECT_DIE)
+		return emu_select_die(data, writecnt, writearr);
+
+	if (data->busy_until) {
+		if (dummy_now(data) >= data->busy_until) {
+			data->busy_until = 0;
+			data->emu_status[0] &= ~SPI_SR_WIP;
+		} else if (writearr[0] != JEDEC_RDSR) {
+			msg_perr("Command 0x%02x sent while the chip is busy!\n", writearr[0]);
+			return 1;
+		}
+	}
+
+	opcode = emu_decode_opcode(data, writearr[0], &addr_len);
+	fast_read_dummy = emu_fast_read_dummy_len(data, opcode, &fast_read_mode);
+	if (data->emu_qpi)
+		fast_read_mode = QPI_4_4_4;
+	if (io_mode != fast_read_mode) {
+		msg_perr("Opcode 0x%02x sent in the wrong I/O mode (%d)!\n", writearr[0], io_mode);
+		return 1;
+	}
+
 	if (data->emu_max_aai_size && (data->emu_status[0] & SPI_SR_AAI)) {
 		if (writearr[0] != JEDEC_AAI_WORD_PROGRAM &&
 		    writearr[0] != JEDEC_WRDI &&
@@ -750,7 +1560,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		}
 	}
 
-	switch (writearr[0]) {
+	switch (opcode) {
 	case JEDEC_RES:
 		if (writecnt < JEDEC_RES_OUTSIZE)
 			break;
@@ -849,6 +1659,14 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			if (readcnt > 2)
 				readarr[2] = 0x18;
 			break;
+		case EMULATE_WINBOND_W25M512JV:
+			if (readcnt > 0)
+				readarr[0] = 0xef;
+			if (readcnt > 1)
+				readarr[1] = 0x71;
+			if (readcnt > 2)
+				readarr[2] = 0x19;
+			break;
 		default: /* ignore */
 			break;
 		}
@@ -933,29 +1751,61 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 
 		msg_pdbg2("WRSR3 wrote 0x%02x.\n", data->emu_status[2]);
 		break;
+	case JEDEC_ENTER_QPI:
+		if (!data->emu_qpi_support)
+			break;
+		if (!(data->emu_status[0] & 1 << 6)) {
+			msg_perr("QPI mode entered without the Quad Enable bit!\n");
+			return 1;
+		}
+		data->emu_qpi = true;
+		break;
+	case JEDEC_EXIT_QPI:
+		data->emu_qpi = false;
+		break;
 	case JEDEC_READ:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
-		/* Truncate to emu_chip_size. */
-		offs %= data->emu_chip_size;
-		if (readcnt > 0)
-			memcpy(readarr, data->flashchip_contents + offs, readcnt);
+		if (data->emu_qpi) {
+			msg_perr("READ (0x03) is not supported in QPI mode!\n");
+			return 1;
+		}
+		if (writecnt < 1 + addr_len)
+			break;
+		offs = emu_address(data, writearr, addr_len);
+		emu_read(data, offs, readarr, readcnt);
+		break;
+	case JEDEC_READ_FAST:
+	case JEDEC_READ_DUAL_OUT:
+	case JEDEC_READ_DUAL_IO:
+	case JEDEC_READ_QUAD_OUT:
+	case JEDEC_READ_QUAD_IO:
+		if (fast_read_dummy < 0)
+			break;
+		if (writecnt != 1 + addr_len + fast_read_dummy) {
+			msg_perr("FAST READ 0x%02x outsize invalid!\n", writearr[0]);
+			return 1;
+		}
+		offs = emu_address(data, writearr, addr_len);
+		emu_read(data, offs, readarr, readcnt);
 		break;
 	case JEDEC_BYTE_PROGRAM:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
-		/* Truncate to emu_chip_size. */
-		offs %= data->emu_chip_size;
-		if (writecnt < 5) {
+		if (writecnt < 2 + addr_len) {
 			msg_perr("BYTE PROGRAM size too short!\n");
 			return 1;
 		}
-		if (writecnt - 4 > data->emu_max_byteprogram_size) {
+		if (writecnt - 1 - addr_len > data->emu_max_byteprogram_size) {
 			msg_perr("Max BYTE PROGRAM size exceeded!\n");
 			return 1;
 		}
-		if (write_flash_data(data, offs, writecnt - 4, writearr + 4)) {
+		offs = emu_address(data, writearr, addr_len);
+		if (offs + (writecnt - 1 - addr_len) > data->emu_chip_size) {
+			msg_perr("BYTE PROGRAM crosses the end of the chip!\n");
+			return 1;
+		}
+		if (write_flash_data(data, offs, writecnt - 1 - addr_len, writearr + 1 + addr_len)) {
 			msg_perr("Failed to program flash!\n");
 			return 1;
 		}
+		set_busy(data, data->page_program_us);
 		break;
 	case JEDEC_AAI_WORD_PROGRAM:
 		if (!data->emu_max_aai_size)
@@ -972,15 +1822,14 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 				return 1;
 			}
 			data->emu_status[0] |= SPI_SR_AAI;
-			aai_offs = writearr[1] << 16 | writearr[2] << 8 |
-				   writearr[3];
+			data->emu_aai_offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
 			/* Truncate to emu_chip_size. */
-			aai_offs %= data->emu_chip_size;
-			if (write_flash_data(data, aai_offs, 2, writearr + 4)) {
+			data->emu_aai_offs %= data->emu_chip_size;
+			if (write_flash_data(data, data->emu_aai_offs, 2, writearr + 4)) {
 				msg_perr("Failed to program flash!\n");
 				return 1;
 			}
-			aai_offs += 2;
+			data->emu_aai_offs += 2;
 		} else {
 			if (writecnt < JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE) {
 				msg_perr("Continuation AAI WORD PROGRAM size "
@@ -992,11 +1841,11 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 					 "too long!\n");
 				return 1;
 			}
-			if (write_flash_data(data, aai_offs, 2, writearr + 1)) {
+			if (write_flash_data(data, data->emu_aai_offs, 2, writearr + 1)) {
 				msg_perr("Failed to program flash!\n");
 				return 1;
 			}
-			aai_offs += 2;
+			data->emu_aai_offs += 2;
 		}
 		break;
 	case JEDEC_WRDI:
@@ -1006,7 +1855,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 	case JEDEC_SE:
 		if (!data->emu_jedec_se_size)
 			break;
-		if (writecnt != JEDEC_SE_OUTSIZE) {
+		if (writecnt != 1 + addr_len) {
 			msg_perr("SECTOR ERASE 0x20 outsize invalid!\n");
 			return 1;
 		}
@@ -1014,7 +1863,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("SECTOR ERASE 0x20 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(data, writearr, addr_len);
 		if (offs & (data->emu_jedec_se_size - 1))
 			msg_pdbg("Unaligned SECTOR ERASE 0x20: 0x%x\n", offs);
 		offs &= ~(data->emu_jedec_se_size - 1);
@@ -1022,11 +1871,12 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("Failed to erase flash!\n");
 			return 1;
 		}
+		set_busy(data, data->sector_erase_us);
 		break;
 	case JEDEC_BE_52:
 		if (!data->emu_jedec_be_52_size)
 			break;
-		if (writecnt != JEDEC_BE_52_OUTSIZE) {
+		if (writecnt != 1 + addr_len) {
 			msg_perr("BLOCK ERASE 0x52 outsize invalid!\n");
 			return 1;
 		}
@@ -1034,7 +1884,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("BLOCK ERASE 0x52 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(data, writearr, addr_len);
 		if (offs & (data->emu_jedec_be_52_size - 1))
 			msg_pdbg("Unaligned BLOCK ERASE 0x52: 0x%x\n", offs);
 		offs &= ~(data->emu_jedec_be_52_size - 1);
@@ -1042,11 +1892,12 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("Failed to erase flash!\n");
 			return 1;
 		}
+		set_busy(data, data->block_erase_us);
 		break;
 	case JEDEC_BE_D8:
 		if (!data->emu_jedec_be_d8_size)
 			break;
-		if (writecnt != JEDEC_BE_D8_OUTSIZE) {
+		if (writecnt != 1 + addr_len) {
 			msg_perr("BLOCK ERASE 0xd8 outsize invalid!\n");
 			return 1;
 		}
@@ -1054,7 +1905,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("BLOCK ERASE 0xd8 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(data, writearr, addr_len);
 		if (offs & (data->emu_jedec_be_d8_size - 1))
 			msg_pdbg("Unaligned BLOCK ERASE 0xd8: 0x%x\n", offs);
 		offs &= ~(data->emu_jedec_be_d8_size - 1);
@@ -1062,6 +1913,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("Failed to erase flash!\n");
 			return 1;
 		}
+		set_busy(data, data->block_erase_us);
 		break;
 	case JEDEC_CE_60:
 		if (!data->emu_jedec_ce_60_size)
@@ -1075,11 +1927,12 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			return 1;
 		}
 		/* JEDEC_CE_60_OUTSIZE is 1 (no address) -> no offset. */
-		/* emu_jedec_ce_60_size is emu_chip_size. */
-		if (erase_flash_data(data, 0, data->emu_jedec_ce_60_size)) {
+		/* emu_jedec_ce_60_size is emu_chip_size or the size of a die. */
+		if (erase_flash_data(data, data->emu_die * emu_die_size(data), data->emu_jedec_ce_60_size)) {
 			msg_perr("Failed to erase flash!\n");
 			return 1;
 		}
+		set_busy(data, data->block_erase_us * (data->emu_jedec_ce_60_size / (64 * KiB)));
 		break;
 	case JEDEC_CE_C7:
 		if (!data->emu_jedec_ce_c7_size)
@@ -1093,14 +1946,20 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			return 1;
 		}
 		/* JEDEC_CE_C7_OUTSIZE is 1 (no address) -> no offset. */
-		/* emu_jedec_ce_c7_size is emu_chip_size. */
-		if (erase_flash_data(data, 0, data->emu_jedec_ce_c7_size)) {
+		/* emu_jedec_ce_c7_size is emu_chip_size or the size of a die. */
+		if (erase_flash_data(data, data->emu_die * emu_die_size(data), data->emu_jedec_ce_c7_size)) {
 			msg_perr("Failed to erase flash!\n");
 			return 1;
 		}
+		set_busy(data, data->block_erase_us * (data->emu_jedec_ce_c7_size / (64 * KiB)));
+		break;
+	case JEDEC_ENTER_4_BYTE_ADDR_MODE:
+	case JEDEC_EXIT_4_BYTE_ADDR_MODE:
+		if (data->emu_chip == EMULATE_SFDP_GENERIC)
+			data->emu_4ba_mode = opcode == JEDEC_ENTER_4_BYTE_ADDR_MODE;
 		break;
 	case JEDEC_SFDP:
-		if (data->emu_chip != EMULATE_MACRONIX_MX25L6436)
+		if (!data->emu_sfdp)
 			break;
 		if (writecnt < 4)
 			break;
@@ -1122,13 +1981,13 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* The SFDP spec implies that the start address of an SFDP read may be truncated to fit in the
 		 * SFDP table address space, i.e. the start address may be wrapped around at SFDP table size.
 		 * This is a reasonable implementation choice in hardware because it saves a few gates. */
-		if (offs >= sizeof(sfdp_table)) {
+		if (offs >= data->emu_sfdp_len) {
 			msg_pdbg("Wrapping the start address around the SFDP table boundary (using 0x%x "
-				 "instead of 0x%x).\n", (unsigned int)(offs % sizeof(sfdp_table)), offs);
-			offs %= sizeof(sfdp_table);
+				 "instead of 0x%x).\n", (unsigned int)(offs % data->emu_sfdp_len), offs);
+			offs %= data->emu_sfdp_len;
 		}
-		toread = min(sizeof(sfdp_table) - offs, readcnt);
-		memcpy(readarr, sfdp_table + offs, toread);
+		toread = min(data->emu_sfdp_len - offs, readcnt);
+		memcpy(readarr, data->emu_sfdp + offs, toread);
 		if (toread < readcnt)
 			msg_pdbg("Crossing the SFDP table boundary in a single "
 				 "continuous chunk produces undefined results "
@@ -1143,13 +2002,39 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 	return 0;
 }
 
-static int dummy_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
-				  unsigned int readcnt,
-				  const unsigned char *writearr,
-				  unsigned char *readarr)
+/*
+ * Simulate the time a real programmer would take for a transaction. The
+ * opcode is sent on one line, except in QPI mode, the rest according to
+ * `io_mode`.
+ */
+static void dummy_transfer_delay(const struct emu_data *data, enum io_mode io_mode,
+				 unsigned int writecnt, unsigned int readcnt)
+{
+	unsigned long long us = data->latency_us;
+
+	if (data->bandwidth_kbps) {
+		const unsigned long long clocks = 8ULL * min(writecnt, 1) / spi_opcode_lines(io_mode) +
+			8ULL * (writecnt - min(writecnt, 1)) / spi_addr_lines(io_mode) +
+			8ULL * readcnt / spi_data_lines(io_mode);
+		us += clocks * 1000 / data->bandwidth_kbps;
+	}
+	if (us)
+		dummy_clock_delay(data->clock, us > UINT_MAX ? UINT_MAX : us);
+}
+
+/* The emulated chip that `flash` talks to. */
+static struct emu_data *dummy_emu_data(const struct flashctx *const flash)
+{
+	struct emu_data *const data = flash->mst.spi->data;
+	return data ? &data[flash->chip_select] : NULL;
+}
+
+static int dummy_spi_send_io(const struct flashctx *flash, enum io_mode io_mode,
+			     unsigned int writecnt, unsigned int readcnt,
+			     const unsigned char *writearr, unsigned char *readarr)
 {
 	unsigned int i;
-	struct emu_data *emu_data = flash->mst.spi->data;
+	struct emu_data *emu_data = dummy_emu_data(flash);
 	if (!emu_data) {
 		msg_perr("No data in flash context!\n");
 		return 1;
@@ -1161,6 +2046,14 @@ static int dummy_spi_send_command(const struct flashctx *flash, unsigned int wri
 	for (i = 0; i < writecnt; i++)
 		msg_pspew(" 0x%02x", writearr[i]);
 
+	/* Leave room for opcode, 4-byte address and up to three mode and dummy bytes. */
+	if (emu_data->max_transfer && (readcnt > emu_data->max_transfer ||
+				       writecnt > emu_data->max_transfer + 8)) {
+		msg_pspew(" exceeds max_transfer\n");
+		return SPI_INVALID_LENGTH;
+	}
+	dummy_transfer_delay(emu_data, io_mode, writecnt, readcnt);
+
 	/* Response for unknown commands and missing chip is 0xff. */
 	memset(readarr, 0xff, readcnt);
 	switch (emu_data->emu_chip) {
@@ -1170,15 +2063,28 @@ static int dummy_spi_send_command(const struct flashctx *flash, unsigned int wri
 	case EMULATE_MACRONIX_MX25L6436:
 	case EMULATE_WINBOND_W25Q128FV:
 	case EMULATE_SPANSION_S25FL128L:
-		if (emulate_spi_chip_response(writecnt, readcnt, writearr,
+	case EMULATE_SFDP_GENERIC:
+	case EMULATE_WINBOND_W25M512JV:
+		if (emulate_spi_chip_response(io_mode, writecnt, readcnt, writearr,
 					      readarr, emu_data)) {
 			msg_pdbg("Invalid command sent to flash chip!\n");
 			return 1;
 		}
 		break;
+	case EMULATE_MICRON_MT29F1G01ABAFD:
+		if (emulate_spi_nand_response(writecnt, readcnt, writearr, readarr, emu_data)) {
+			msg_pdbg("Invalid command sent to flash chip!\n");
+			return 1;
+		}
+		break;
 	default:
 		break;
 	}
+	/* Every 16th response above the flaky clock gets a bit flipped. */
+	if (readcnt && emu_data->flaky_khz && emu_data->spi_khz >= emu_data->flaky_khz &&
+	    ++emu_data->flaky_count % 16 == 0)
+		readarr[emu_data->flaky_count / 16 % readcnt] ^= 1 << (emu_data->flaky_count % 8);
+
 	msg_pspew(" reading %u bytes:", readcnt);
 	for (i = 0; i < readcnt; i++)
 		msg_pspew(" 0x%02x", readarr[i]);
@@ -1186,16 +2092,61 @@ static int dummy_spi_send_command(const struct flashctx *flash, unsigned int wri
 	return 0;
 }
 
+static int dummy_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
+				  unsigned int readcnt,
+				  const unsigned char *writearr,
+				  unsigned char *readarr)
+{
+	return dummy_spi_send_io(flash, SINGLE_IO_1_1_1, writecnt, readcnt, writearr, readarr);
+}
+
+/* Like default_spi_send_multicommand(), but multi-I/O commands are emulated too. */
+static int dummy_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	int result = 0;
+	for (; (cmds->writecnt || cmds->readcnt) && !result; cmds++)
+		result = dummy_spi_send_io(flash, cmds->io_mode, cmds->writecnt, cmds->readcnt,
+					   cmds->writearr, cmds->readarr);
+	return result;
+}
+
+/* Clock steps of `spispeed=auto', in Hz. */
+static const unsigned long dummy_speeds[] = {
+	1000000, 2000000, 4000000, 8000000, 16000000, 33000000, 50000000, 66000000, 100000000,
+};
+
+static size_t dummy_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	*speeds = dummy_speeds;
+	return ARRAY_SIZE(dummy_speeds);
+}
+
+static int dummy_spi_set_speed(const struct flashctx *flash, unsigned long hz)
+{
+	struct emu_data *const data = flash->mst.spi->data;
+	unsigned int i;
+
+	/* All chip selects share the clock. */
+	for (i = 0; i < data->emu_chip_selects; ++i)
+		data[i].spi_khz = hz / 1000;
+	msg_pdbg("%s: %lu kHz\n", __func__, hz / 1000);
+	return 0;
+}
+
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
-	const struct emu_data *const data = flash->mst.spi->data;
-	return spi_write_chunked(flash, buf, start, len, data->spi_write_256_chunksize);
+	const struct emu_data *const data = dummy_emu_data(flash);
+	unsigned int chunksize = data->spi_write_256_chunksize;
+
+	if (data->max_transfer && data->max_transfer < chunksize)
+		chunksize = data->max_transfer;
+	return spi_write_chunked(flash, buf, start, len, chunksize);
 }
 
 static bool dummy_spi_probe_opcode(const struct flashctx *flash, uint8_t opcode)
 {
 	size_t i;
-	const struct emu_data *emu_data = flash->mst.spi->data;
+	const struct emu_data *emu_data = dummy_emu_data(flash);
 	for (i = 0; i < emu_data->spi_blacklist_size; i++) {
 		if (emu_data->spi_blacklist[i] == opcode)
 			return false;
@@ -1203,10 +2154,40 @@ static bool dummy_spi_probe_opcode(const struct flashctx *flash, uint8_t opcode)
 	return true;
 }
 
+static int dummy_spi_blank_check(struct flashctx *flash, unsigned int start, unsigned int len,
+				 uint8_t erased_value)
+{
+	const struct emu_data *const data = dummy_emu_data(flash);
+	unsigned int i;
+
+	if (data->emu_chip == EMULATE_NONE || start + len > data->emu_chip_size)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		if (data->flashchip_contents[start + i] != erased_value)
+			return 1;
+	}
+	return 0;
+}
+
+static int dummy_spi_checksum(struct flashctx *flash, unsigned int start, unsigned int len,
+			      uint32_t *crc)
+{
+	const struct emu_data *const data = dummy_emu_data(flash);
+
+	if (data->emu_chip == EMULATE_NONE || start + len > data->emu_chip_size)
+		return 1;
+
+	*crc = crc32_update(0, data->flashchip_contents + start, len);
+	return 0;
+}
+
 const struct programmer_entry programmer_dummy = {
 	.name			= "dummy",
 	.type			= OTHER,
 				/* FIXME */
 	.devs.note		= "Dummy device, does nothing and logs all accesses\n",
 	.init			= dummy_init,
+	.delay			= dummy_delay,
+	.multi_instance		= true,
 };
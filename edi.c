@@ -20,8 +20,24 @@
 #include "ene.h"
 #include "edi.h"
 
+/* Number of EDI commands that are queued and sent to the programmer at once. */
+#define EDI_BATCH_MAX		64
+/* Number of bytes fetched per batch in edi_chip_read(). */
+#define EDI_BURST_READS		8
+
 static unsigned int edi_read_buffer_length = EDI_READ_BUFFER_LENGTH_DEFAULT;
 
+/*
+ * EDI commands that don't depend on the result of each other can be sent
+ * with a single spi_send_multicommand(), which saves a round trip per
+ * command on most USB programmers.
+ */
+struct edi_batch {
+	unsigned int count;
+	unsigned char cmds[EDI_BATCH_MAX][5];
+	struct spi_command spi[EDI_BATCH_MAX + 1];
+};
+
 static const struct ene_chip ene_kb9012 = {
 	.hwversion = ENE_KB9012_HWVERSION,
 	.ediid = ENE_KB9012_EDIID,
@@ -44,64 +60,123 @@ static void edi_read_cmd(unsigned char *cmd, unsigned short address)
 	cmd[3] = (address >> 0) & 0xff; /* Address lower byte. */
 }
 
-static int edi_write(struct flashctx *flash, unsigned short address, unsigned char data)
+static int edi_batch_flush(struct flashctx *flash, struct edi_batch *batch)
 {
-	unsigned char cmd[5];
 	int rc;
 
-	edi_write_cmd(cmd, address, data);
+	if (!batch->count)
+		return 0;
 
-	rc = spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
+	memset(&batch->spi[batch->count], 0, sizeof(batch->spi[batch->count]));
+	rc = spi_send_multicommand(flash, batch->spi);
+	batch->count = 0;
 	if (rc)
 		return -1;
 
 	return 0;
 }
 
-static int edi_read_byte(struct flashctx *flash, unsigned short address, unsigned char *data)
+static struct spi_command *edi_batch_next(struct flashctx *flash, struct edi_batch *batch)
 {
-	unsigned char cmd[4];
-	unsigned char buffer[edi_read_buffer_length];
-	unsigned int index;
-	unsigned int i;
+	struct spi_command *cmd;
+
+	if (batch->count == EDI_BATCH_MAX && edi_batch_flush(flash, batch) < 0)
+		return NULL;
+
+	cmd = &batch->spi[batch->count];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->writearr = batch->cmds[batch->count];
+	batch->count++;
+
+	return cmd;
+}
+
+static int edi_batch_write(struct flashctx *flash, struct edi_batch *batch,
+			   unsigned short address, unsigned char data)
+{
+	struct spi_command *cmd = edi_batch_next(flash, batch);
+
+	if (!cmd)
+		return -1;
+
+	edi_write_cmd(batch->cmds[batch->count - 1], address, data);
+	cmd->writecnt = 5;
+
+	return 0;
+}
+
+/* `buffer` has to hold `edi_read_buffer_length` bytes until the batch is flushed. */
+static int edi_batch_read(struct flashctx *flash, struct edi_batch *batch,
+			  unsigned short address, unsigned char *buffer)
+{
+	struct spi_command *cmd = edi_batch_next(flash, batch);
+
+	if (!cmd)
+		return -1;
+
+	edi_read_cmd(batch->cmds[batch->count - 1], address);
+	cmd->writecnt = 4;
+	cmd->readcnt = edi_read_buffer_length;
+	cmd->readarr = buffer;
+
+	return 0;
+}
+
+static int edi_write(struct flashctx *flash, unsigned short address, unsigned char data)
+{
+	unsigned char cmd[5];
 	int rc;
 
-	edi_read_cmd(cmd, address);
+	edi_write_cmd(cmd, address, data);
 
-	rc = spi_send_command(flash, sizeof(cmd), sizeof(buffer), cmd, buffer);
+	rc = spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
 	if (rc)
 		return -1;
 
-	index = 0;
+	return 0;
+}
 
-	for (i = 0; i < sizeof(buffer); i++) {
-		index = i;
+static int edi_read_parse(const unsigned char *buffer, unsigned int length, unsigned char *data)
+{
+	unsigned int i;
 
-		if (buffer[i] == EDI_NOT_READY)
+	for (i = 0; i < length; i++) {
+		if (buffer[i] != EDI_READY)
 			continue;
 
-		if (buffer[i] == EDI_READY) {
-			if (i == (sizeof(buffer) - 1)) {
-				/*
-				 * Buffer size was too small for receiving the value.
-				 * This is as good as getting only EDI_NOT_READY.
-				 */
-
-				buffer[i] = EDI_NOT_READY;
-				break;
-			}
-
-			*data = buffer[i + 1];
-			return 0;
+		if (i == (length - 1)) {
+			/*
+			 * Buffer size was too small for receiving the value.
+			 * This is as good as getting only EDI_NOT_READY.
+			 */
+			return -EDI_NOT_READY;
 		}
+
+		*data = buffer[i + 1];
+		return 0;
 	}
 
-	if (buffer[index] == EDI_NOT_READY)
+	if (buffer[length - 1] == EDI_NOT_READY)
 		return -EDI_NOT_READY;
 
 	return -1;
 }
 
+static int edi_read_byte(struct flashctx *flash, unsigned short address, unsigned char *data)
+{
+	unsigned char cmd[4];
+	unsigned char buffer[edi_read_buffer_length];
+	int rc;
+
+	edi_read_cmd(cmd, address);
+
+	rc = spi_send_command(flash, sizeof(cmd), sizeof(buffer), cmd, buffer);
+	if (rc)
+		return -1;
+
+	return edi_read_parse(buffer, sizeof(buffer), data);
+}
+
 static int edi_read(struct flashctx *flash, unsigned short address, unsigned char *data)
 {
 	int rc;
@@ -218,24 +293,25 @@ static int edi_spi_busy(struct flashctx *flash)
 	return !!(buffer & ENE_XBI_EFCFG_BUSY);
 }
 
-static int edi_spi_address(struct flashctx *flash, unsigned int start, unsigned int address)
+static int edi_batch_spi_address(struct flashctx *flash, struct edi_batch *batch,
+				 unsigned int start, unsigned int address)
 {
 	int rc;
 
 	if ((address == start) || (((address - 1) & 0xff) != (address & 0xff))) {
-		rc = edi_write(flash, ENE_XBI_EFA0, ((address & 0xff) >> 0));
+		rc = edi_batch_write(flash, batch, ENE_XBI_EFA0, ((address & 0xff) >> 0));
 		if (rc < 0)
 			return -1;
 	}
 
 	if ((address == start) || (((address - 1) & 0xff00) != (address & 0xff00))) {
-		rc = edi_write(flash, ENE_XBI_EFA1, ((address & 0xff00) >> 8));
+		rc = edi_batch_write(flash, batch, ENE_XBI_EFA1, ((address & 0xff00) >> 8));
 		if (rc < 0)
 			return -1;
 	}
 
 	if ((address == start) || (((address - 1) & 0xff0000) != (address & 0xff0000))) {
-		rc = edi_write(flash, ENE_XBI_EFA2, ((address & 0xff0000) >> 16));
+		rc = edi_batch_write(flash, batch, ENE_XBI_EFA2, ((address & 0xff0000) >> 16));
 		if (rc < 0)
 			return -1;
 	}
@@ -243,6 +319,18 @@ static int edi_spi_address(struct flashctx *flash, unsigned int start, unsigned
 	return 0;
 }
 
+static int edi_spi_address(struct flashctx *flash, unsigned int start, unsigned int address)
+{
+	struct edi_batch batch = { 0 };
+	int rc;
+
+	rc = edi_batch_spi_address(flash, &batch, start, address);
+	if (rc < 0)
+		return -1;
+
+	return edi_batch_flush(flash, &batch);
+}
+
 static int edi_8051_reset(struct flashctx *flash)
 {
 	unsigned char buffer;
@@ -304,7 +392,7 @@ int edi_chip_block_erase(struct flashctx *flash, unsigned int page, unsigned int
 		return -1;
 
 	while (edi_spi_busy(flash) == 1 && timeout) {
-		programmer_delay(10);
+		programmer_delay(flash, 10);
 		timeout--;
 	}
 
@@ -324,6 +412,7 @@ int edi_chip_block_erase(struct flashctx *flash, unsigned int page, unsigned int
 
 int edi_chip_write(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
+	struct edi_batch batch;
 	unsigned int address = start;
 	unsigned int pages;
 	unsigned int timeout;
@@ -351,21 +440,24 @@ int edi_chip_write(struct flashctx *flash, const uint8_t *buf, unsigned int star
 	for (i = 0; i < pages; i++) {
 		timeout = 64;
 
+		/* Queue the whole page, none of the commands has a result to wait for. */
+		batch.count = 0;
+
 		/* Clear page buffer. */
-		rc = edi_write(flash, ENE_XBI_EFCMD, ENE_XBI_EFCMD_HVPL_CLEAR);
+		rc = edi_batch_write(flash, &batch, ENE_XBI_EFCMD, ENE_XBI_EFCMD_HVPL_CLEAR);
 		if (rc < 0)
 			return -1;
 
 		for (j = 0; j < flash->chip->page_size; j++) {
-			rc = edi_spi_address(flash, start, address);
+			rc = edi_batch_spi_address(flash, &batch, start, address);
 			if (rc < 0)
 				return -1;
 
-			rc = edi_write(flash, ENE_XBI_EFDAT, *buf);
+			rc = edi_batch_write(flash, &batch, ENE_XBI_EFDAT, *buf);
 			if (rc < 0)
 				return -1;
 
-			rc = edi_write(flash, ENE_XBI_EFCMD, ENE_XBI_EFCMD_HVPL_LATCH);
+			rc = edi_batch_write(flash, &batch, ENE_XBI_EFCMD, ENE_XBI_EFCMD_HVPL_LATCH);
 			if (rc < 0)
 				return -1;
 
@@ -374,12 +466,16 @@ int edi_chip_write(struct flashctx *flash, const uint8_t *buf, unsigned int star
 		}
 
 		/* Program page buffer to flash. */
-		rc = edi_write(flash, ENE_XBI_EFCMD, ENE_XBI_EFCMD_PROGRAM);
+		rc = edi_batch_write(flash, &batch, ENE_XBI_EFCMD, ENE_XBI_EFCMD_PROGRAM);
+		if (rc < 0)
+			return -1;
+
+		rc = edi_batch_flush(flash, &batch);
 		if (rc < 0)
 			return -1;
 
 		while (edi_spi_busy(flash) == 1 && timeout) {
-			programmer_delay(10);
+			programmer_delay(flash, 10);
 			timeout--;
 		}
 
@@ -400,11 +496,46 @@ int edi_chip_write(struct flashctx *flash, const uint8_t *buf, unsigned int star
 	return 0;
 }
 
+static int edi_chip_read_byte(struct flashctx *flash, uint8_t *buf, unsigned int address)
+{
+	unsigned int timeout = 64;
+	int rc;
+
+	rc = edi_spi_address(flash, address, address);
+	if (rc < 0)
+		return -1;
+
+	rc = edi_write(flash, ENE_XBI_EFCMD, ENE_XBI_EFCMD_READ);
+	if (rc < 0)
+		return -1;
+
+	do {
+		rc = edi_read(flash, ENE_XBI_EFDAT, buf);
+		if (rc == 0)
+			break;
+
+		/* Just in case. */
+		while (edi_spi_busy(flash) == 1 && timeout) {
+			programmer_delay(flash, 10);
+			timeout--;
+		}
+
+		if (!timeout) {
+			msg_perr("%s: Timed out waiting for SPI not busy!\n", __func__);
+			return -1;
+		}
+	} while (1);
+
+	return 0;
+}
+
 int edi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
+	unsigned char buffers[EDI_BURST_READS][EDI_READ_BUFFER_LENGTH_MAX];
+	struct edi_batch batch;
 	unsigned int address = start;
+	unsigned int burst;
 	unsigned int i;
-	unsigned int timeout;
 	int rc;
 
 	rc = edi_spi_enable(flash);
@@ -417,39 +548,51 @@ int edi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsi
 	 * EDI brings such a drastic overhead that there is about no need to
 	 * have any delay in between calls. The EDI protocol will handle wait
 	 * I/O times on its own anyway.
+	 *
+	 * Hence, several bytes are requested in one batch. If one of them
+	 * isn't ready, it is read again on its own together with all that
+	 * follow in the batch.
 	 */
 
-	for (i = 0; i < len; i++) {
-		timeout = 64;
+	while (len > 0) {
+		burst = min(EDI_BURST_READS, len);
+		batch.count = 0;
 
-		rc = edi_spi_address(flash, start, address);
-		if (rc < 0)
-			return -1;
+		for (i = 0; i < burst; i++) {
+			rc = edi_batch_spi_address(flash, &batch, start, address + i);
+			if (rc < 0)
+				return -1;
+
+			rc = edi_batch_write(flash, &batch, ENE_XBI_EFCMD, ENE_XBI_EFCMD_READ);
+			if (rc < 0)
+				return -1;
 
-		rc = edi_write(flash, ENE_XBI_EFCMD, ENE_XBI_EFCMD_READ);
+			rc = edi_batch_read(flash, &batch, ENE_XBI_EFDAT, buffers[i]);
+			if (rc < 0)
+				return -1;
+		}
+
+		rc = edi_batch_flush(flash, &batch);
 		if (rc < 0)
 			return -1;
 
-		do {
-			rc = edi_read(flash, ENE_XBI_EFDAT, buf);
-			if (rc == 0)
+		for (i = 0; i < burst; i++) {
+			if (edi_read_parse(buffers[i], edi_read_buffer_length, &buf[i]) < 0)
 				break;
+		}
 
-			/* Just in case. */
-			while (edi_spi_busy(flash) == 1 && timeout) {
-				programmer_delay(10);
-				timeout--;
-			}
-
-			if (!timeout) {
-				msg_perr("%s: Timed out waiting for SPI not busy!\n", __func__);
+		if (i < burst) {
+			/* The address registers point past this byte now. */
+			rc = edi_chip_read_byte(flash, &buf[i], address + i);
+			if (rc < 0)
 				return -1;
-			}
-		} while (1);
+			i++;
+		}
 
-		buf++;
-		address++;
-		flashprog_progress_add(flash, 1);
+		buf += i;
+		address += i;
+		len -= i;
+		flashprog_progress_add(flash, i);
 	}
 
 	rc = edi_spi_disable(flash);
@@ -23,6 +23,73 @@
 #include "chipdrivers.h"
 #include "writeprotect.h"
 
+/*
+ * Write protection bits, shared by all chips with the same register layout.
+ * The names list the bits that are used: a status register lock (SRL), the
+ * number of block protection bits (BP) and TB, SEC, CMP and WPS.
+ */
+static const struct reg_bit_map wp_bits_srl_bp3_tb_sec_cmp = {
+	.srp    = {STATUS1, 7, RW},
+	.srl    = {STATUS2, 0, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
+	.tb     = {STATUS1, 5, RW},
+	.sec    = {STATUS1, 6, RW},
+	.cmp    = {STATUS2, 6, RW},
+};
+
+static const struct reg_bit_map wp_bits_bp3_tb = {
+	.srp    = {STATUS1, 7, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
+	.tb     = {STATUS1, 5, RW},
+};
+
+static const struct reg_bit_map wp_bits_srl6_bp4_tb = {
+	.srp    = {STATUS1, 7, RW},
+	.srl    = {STATUS2, 6, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
+	.tb     = {STATUS1, 6, RW},
+};
+
+static const struct reg_bit_map wp_bits_bp4_tb5 = {
+	.srp    = {STATUS1, 7, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 6, RW}},
+	.tb     = {STATUS1, 5, RW},
+};
+
+static const struct reg_bit_map wp_bits_srl_bp3_tb_sec_cmp_wps = {
+	.srp	= {STATUS1, 7, RW},
+	.srl	= {STATUS2, 0, RW},
+	.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
+	.tb	= {STATUS1, 5, RW},
+	.sec	= {STATUS1, 6, RW},
+	.cmp	= {STATUS2, 6, RW},
+	.wps	= {STATUS3, 2, RW},
+};
+
+static const struct reg_bit_map wp_bits_srl_bp4_tb_cmp_wps = {
+	.srp	= {STATUS1, 7, RW},
+	.srl	= {STATUS2, 0, RW},
+	.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
+	.tb	= {STATUS1, 6, RW},
+	.cmp	= {STATUS2, 6, RW},
+	.wps	= {STATUS3, 2, RW},
+};
+
+static const struct reg_bit_map wp_bits_srl_bp4_tb_cmp = {
+	.srp    = {STATUS1, 7, RW},
+	.srl    = {STATUS2, 0, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
+	.tb     = {STATUS1, 6, RW},
+	.cmp    = {STATUS2, 6, RW},
+};
+
+static const struct reg_bit_map wp_bits_srl_bp4_tb = {
+	.srp    = {STATUS1, 7, RW},
+	.srl    = {STATUS2, 0, RW},
+	.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
+	.tb     = {STATUS1, 6, RW},
+};
+
 /**
  * List of supported flash chips.
  *
@@ -2451,15 +2518,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 2000},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -5222,12 +5281,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-		},
+		/* TB is called BP3 in the datasheet. */
+		.reg_bits	= &wp_bits_bp3_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -5308,12 +5363,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-		},
+		/* TB is called BP3 in the datasheet. */
+		.reg_bits	= &wp_bits_bp3_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -5397,12 +5448,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-		},
+		/* TB is called BP3 in the datasheet. */
+		.reg_bits	= &wp_bits_bp3_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -5831,7 +5878,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -5863,7 +5910,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -5892,7 +5939,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -5921,7 +5968,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -6542,15 +6589,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {1695, 1950},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-			.sec    = {STATUS1, 6, RW}, /* Called BP4 in datasheet, acts like SEC */
-			.cmp    = {STATUS2, 6, RW},
-		},
+		/* TB and SEC are called BP3 and BP4 in the datasheet. */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -6711,15 +6751,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {1695, 1950},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-			.sec    = {STATUS1, 6, RW}, /* Called BP4 in datasheet, acts like SEC */
-			.cmp    = {STATUS2, 6, RW},
-		},
+		/* TB and SEC are called BP3 and BP4 in the datasheet. */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -6842,15 +6875,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-			.sec    = {STATUS1, 6, RW}, /* Called BP4 in datasheet, acts like SEC */
-			.cmp    = {STATUS2, 6, RW},
-		},
+		/* TB and SEC are called BP3 and BP4 in the datasheet. */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -6980,13 +7006,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 6, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb     = {STATUS1, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl6_bp4_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -7031,15 +7051,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-			.sec    = {STATUS1, 6, RW}, /* Called BP4 in datasheet, acts like SEC */
-			.cmp    = {STATUS2, 6, RW},
-		},
+		/* TB and SEC are called BP3 and BP4 in the datasheet. */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -7156,15 +7169,8 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW}, /* Called BP3 in datasheet, acts like TB */
-			.sec    = {STATUS1, 6, RW}, /* Called BP4 in datasheet, acts like SEC */
-			.cmp    = {STATUS2, 6, RW},
-		},
+		/* TB and SEC are called BP3 and BP4 in the datasheet. */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -7917,7 +7923,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -7946,7 +7952,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -7978,7 +7984,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -8007,7 +8013,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10145,7 +10151,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10177,7 +10183,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10206,7 +10212,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10238,7 +10244,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10270,7 +10276,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10299,7 +10305,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -10331,7 +10337,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -11432,16 +11438,11 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256, /* Multi I/O supported */
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {1700, 2000},
-		.reg_bits	=
-		{
-			/*
-			 * There is also a volatile lock register per 64KiB sector, which is not
-			 * mutually exclusive with BP-based protection.
-			 */
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-		},
+		/*
+		 * There is also a volatile lock register per 64KiB sector, which is not
+		 * mutually exclusive with BP-based protection.
+		 */
+		.reg_bits	= &wp_bits_bp3_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -11480,16 +11481,11 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256, /* Multi I/O supported */
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			/*
-			 * There is also a volatile lock register per 64KiB sector, which is not
-			 * mutually exclusive with BP-based protection.
-			 */
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-		},
+		/*
+		 * There is also a volatile lock register per 64KiB sector, which is not
+		 * mutually exclusive with BP-based protection.
+		 */
+		.reg_bits	= &wp_bits_bp3_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -11528,16 +11524,11 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256, /* Multi I/O supported */
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {1700, 2000},
-		.reg_bits	=
-		{
-			/*
-			 * There is also a volatile lock register per 64KiB sector, which is not
-			 * mutually exclusive with BP-based protection.
-			 */
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 6, RW}},
-			.tb     = {STATUS1, 5, RW},
-		},
+		/*
+		 * There is also a volatile lock register per 64KiB sector, which is not
+		 * mutually exclusive with BP-based protection.
+		 */
+		.reg_bits	= &wp_bits_bp4_tb5,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -11576,16 +11567,11 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256, /* Multi I/O supported */
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			/*
-			 * There is also a volatile lock register per 64KiB sector, which is not
-			 * mutually exclusive with BP-based protection.
-			 */
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 6, RW}},
-			.tb     = {STATUS1, 5, RW},
-		},
+		/*
+		 * There is also a volatile lock register per 64KiB sector, which is not
+		 * mutually exclusive with BP-based protection.
+		 */
+		.reg_bits	= &wp_bits_bp4_tb5,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -12239,12 +12225,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256, /* Multi I/O supported */
 		.read		= spi_chip_read, /* Fast read (0x0B) and multi I/O supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 6, RW}},
-			.tb     = {STATUS1, 5, RW},
-		},
+		.reg_bits	= &wp_bits_bp4_tb5,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -12302,6 +12283,40 @@ const struct flashchip flashchips[] = {
 		.prepare_access	= spi_prepare_4ba,
 	},
 
+	{
+		.vendor		= "Micron",
+		.name		= "MT29F1G01ABAFD",
+		.bustype	= BUS_SPI,
+		.manufacture_id	= MICRON_ID,
+		.model_id	= MICRON_MT29F1G01ABAFD,
+		.total_size	= 128 * 1024,	/* main areas only, pages have 128B spare */
+		.page_size	= 2048,
+		.feature_bits	= FEATURE_NAND_CACHE_SEQ,
+		.tested		= TEST_UNTESTED,
+		.spi_cmd_set	= SPI_NAND,
+		.probe		= probe_spi_nand,
+		.probe_timing	= TIMING_ZERO,
+		.block_erasers	=
+		{
+			{
+				.eraseblocks = { {128 * 1024, 1024} },
+				.block_erase = spi_nand_block_erase,
+			}
+		},
+		.printlock	= spi_nand_printlock,
+		.unlock		= spi_nand_unlock,
+		.write		= spi_nand_write,
+		.read		= spi_nand_read,
+		.voltage	= {2700, 3600},
+		.gran		= write_gran_2048bytes,
+		.prepare_access	= spi_nand_prepare_access,
+		.finish_access	= spi_nand_finish_access,
+		.spi_timing	= {
+			.page_program	= {200, 600},
+			.erase		= { {128 * 1024, {2000, 10000}} },
+		},
+	},
+
 	{
 		.vendor		= "MoselVitelic",
 		.name		= "V29C51000B",
@@ -16754,23 +16769,14 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			/*
-			 * Note: This chip has a read-only Status Register 2 that is not
-			 *	 counted here. Registers are mapped as follows:
-			 *	 STATUS1 ... Status Register 1
-			 *	 STATUS2 ... Configuration Register 1
-			 *	 STATUS3 ... Configuration Register 2
-			 */
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb	= {STATUS1, 5, RW},
-			.sec	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		/*
+		 * Note: This chip has a read-only Status Register 2 that is not
+		 *	 counted here. Registers are mapped as follows:
+		 *	 STATUS1 ... Status Register 1
+		 *	 STATUS2 ... Configuration Register 1
+		 *	 STATUS3 ... Configuration Register 2
+		 */
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -17189,22 +17195,14 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read, /* Fast read (0x0B) supported */
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			/*
-			 * Note: This chip has a read-only Status Register 2 that is not
-			 *	 counted here. Registers are mapped as follows:
-			 *	 STATUS1 ... Status Register 1
-			 *	 STATUS2 ... Configuration Register 1
-			 *	 STATUS3 ... Configuration Register 2
-			 */
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		/*
+		 * Note: This chip has a read-only Status Register 2 that is not
+		 *	 counted here. Registers are mapped as follows:
+		 *	 STATUS1 ... Status Register 1
+		 *	 STATUS2 ... Configuration Register 1
+		 *	 STATUS3 ... Configuration Register 2
+		 */
+		.reg_bits	= &wp_bits_srl_bp4_tb_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -17595,6 +17593,80 @@ const struct flashchip flashchips[] = {
 		.finish_access	= finish_memory_access,
 	},
 
+	{
+		.vendor		= "Winbond",
+		.name		= "W25M512JV",
+		.bustype	= BUS_SPI,
+		.manufacture_id	= WINBOND_NEX_ID,
+		.model_id	= WINBOND_NEX_W25M512JV,
+		.total_size	= 64 * 1024,
+		.page_size	= 256,
+		/* Two W25Q256JV dies, switched with die select (0xc2). The 3-byte
+		   address instructions reach only 16MiB of a die, leave them out. */
+		.dies		= 2,
+		.feature_bits	= FEATURE_WRSR_WREN | FEATURE_4BA_NATIVE,
+		.tested		= TEST_UNTESTED,
+		.probe		= probe_spi_rdid,
+		.probe_timing	= TIMING_ZERO,
+		.block_erasers	=
+		{
+			{
+				.eraseblocks = { {4 * 1024, 16384} },
+				.block_erase = spi_block_erase_21,
+			}, {
+				.eraseblocks = { {64 * 1024, 1024} },
+				.block_erase = spi_block_erase_dc,
+			}, {
+				.eraseblocks = { {32 * 1024 * 1024, 2} },
+				.block_erase = spi_block_erase_60,
+			}, {
+				.eraseblocks = { {32 * 1024 * 1024, 2} },
+				.block_erase = spi_block_erase_c7,
+			}
+		},
+		.printlock	= spi_prettyprint_status_register_plain, /* TODO: improve */
+		.unlock		= spi_disable_blockprotect_dies,
+		.write		= spi_chip_write_256,
+		.read		= spi_chip_read,
+		.voltage	= {2700, 3600},
+		.prepare_access	= spi_prepare_4ba,
+	},
+
+	{
+		.vendor		= "Winbond",
+		.name		= "W25N01GV",
+		.bustype	= BUS_SPI,
+		.manufacture_id	= WINBOND_NEX_ID,
+		.model_id	= WINBOND_NEX_W25N01GV,
+		.total_size	= 128 * 1024,	/* main areas only, pages have 64B spare */
+		.page_size	= 2048,
+		/* No Page Read Cache Sequential, its continuous read (BUF=0) isn't used. */
+		.feature_bits	= 0,
+		.tested		= TEST_UNTESTED,
+		.spi_cmd_set	= SPI_NAND,
+		.probe		= probe_spi_nand,
+		.probe_timing	= TIMING_ZERO,
+		.block_erasers	=
+		{
+			{
+				.eraseblocks = { {128 * 1024, 1024} },
+				.block_erase = spi_nand_block_erase,
+			}
+		},
+		.printlock	= spi_nand_printlock,
+		.unlock		= spi_nand_unlock,
+		.write		= spi_nand_write,
+		.read		= spi_nand_read,
+		.voltage	= {2700, 3600},
+		.gran		= write_gran_2048bytes,
+		.prepare_access	= spi_nand_prepare_access,
+		.finish_access	= spi_nand_finish_access,
+		.spi_timing	= {
+			.page_program	= {250, 700},
+			.erase		= { {128 * 1024, {2000, 10000}} },
+		},
+	},
+
 	{
 		.vendor		= "Winbond",
 		.name		= "W25P16",
@@ -17722,16 +17794,7 @@ const struct flashchip flashchips[] = {
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
 		/* FIXME: Older versions (e.g. 25Q128BV) use WRSR_EXT and have no WPS. */
-		.reg_bits	=
-		{
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb	= {STATUS1, 5, RW},
-			.sec	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -17774,15 +17837,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -17827,15 +17882,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1650, 1950},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -17878,15 +17925,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1650, 1950},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18052,14 +18091,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb     = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp4_tb_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18111,14 +18143,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb     = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp4_tb_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18170,14 +18195,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb     = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp4_tb_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18277,15 +18295,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950},
-		.reg_bits	=
-		{
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp4_tb_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18331,15 +18341,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18385,16 +18387,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps    = {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18440,16 +18433,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps    = {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18494,15 +18478,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950}, /* Fast read (0x0B) and multi I/O supported */
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18548,16 +18524,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950}, /* Fast read (0x0B) and multi I/O supported */
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps    = {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18603,16 +18570,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950}, /* Fast read (0x0B) and multi I/O supported */
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps    = {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18658,16 +18616,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps    = {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18879,15 +18828,7 @@ const struct flashchip flashchips[] = {
 		.write          = spi_chip_write_256,
 		.read           = spi_chip_read,
 		.voltage        = {1650, 1950},
-		.reg_bits       =
-		{
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		.reg_bits       = &wp_bits_srl_bp4_tb_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18933,15 +18874,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb	= {STATUS1, 5, RW},
-			.sec	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -18987,16 +18920,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp	= {STATUS1, 7, RW},
-			.srl	= {STATUS2, 0, RW},
-			.bp	= {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb	= {STATUS1, 5, RW},
-			.sec	= {STATUS1, 6, RW},
-			.cmp	= {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -19081,15 +19005,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950}, /* Fast read (0x0B) and multi I/O supported */
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -19134,16 +19050,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {1700, 1950}, /* Fast read (0x0B) and multi I/O supported */
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-			.wps	= {STATUS3, 2, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp_wps,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -19696,7 +19603,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19725,7 +19632,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19757,7 +19664,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19789,7 +19696,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19818,7 +19725,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19850,7 +19757,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -19879,7 +19786,7 @@ const struct flashchip flashchips[] = {
 				.block_erase = erase_chip_block_jedec,
 			},
 		},
-		.write		= write_jedec_1,
+		.write		= write_jedec_29gl,
 		.read		= read_memmapped,
 		.voltage	= {2700, 3600},
 		.prepare_access	= prepare_memory_access,
@@ -20452,15 +20359,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}},
-			.tb     = {STATUS1, 5, RW},
-			.sec    = {STATUS1, 6, RW},
-			.cmp    = {STATUS2, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp3_tb_sec_cmp,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
@@ -20510,13 +20409,7 @@ const struct flashchip flashchips[] = {
 		.write		= spi_chip_write_256,
 		.read		= spi_chip_read,
 		.voltage	= {2700, 3600},
-		.reg_bits	=
-		{
-			.srp    = {STATUS1, 7, RW},
-			.srl    = {STATUS2, 0, RW},
-			.bp     = {{STATUS1, 2, RW}, {STATUS1, 3, RW}, {STATUS1, 4, RW}, {STATUS1, 5, RW}},
-			.tb     = {STATUS1, 6, RW},
-		},
+		.reg_bits	= &wp_bits_srl_bp4_tb,
 		.wp_write_cfg	= spi_wp_write_cfg,
 		.wp_read_cfg	= spi_wp_read_cfg,
 		.wp_get_ranges	= spi_wp_get_available_ranges,
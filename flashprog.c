@@ -33,33 +33,27 @@
 #include "programmer.h"
 #include "hwaccess_physmap.h"
 #include "chipdrivers.h"
+#include "sha256.h"
 
 const char flashprog_version[] = FLASHPROG_VERSION;
-const char *chip_to_probe = NULL;
 
-static const struct programmer_entry *programmer = NULL;
-static char *programmer_param = NULL;
-
-/* If nonzero, used as the start address of bottom-aligned flash. */
-unsigned long flashbase;
-
-/* Is writing allowed with this programmer? */
-bool programmer_may_write;
-
-#define SHUTDOWN_MAXFN 32
-static int shutdown_fn_count = 0;
-/** @private */
-static struct shutdown_func_data {
-	int (*func) (void *data);
-	void *data;
-} shutdown_fn[SHUTDOWN_MAXFN];
-/* Initialize to 0 to make sure nobody registers a shutdown function before
- * programmer init.
+/* The programmer that this thread initializes or probes, masters and
+ * shutdown functions are registered with it. Programmers may be set up
+ * on several threads at once, hence it's thread-local.
  */
-static bool may_register_shutdown = false;
+#if HAVE_PTHREAD == 1
+static __thread struct flashprog_programmer *active_programmer = NULL;
+#else
+static struct flashprog_programmer *active_programmer = NULL;
+#endif
 
-/* Did we change something or was every erase/write skipped (if any)? */
-static bool all_skipped = true;
+/*
+ * Set while a programmer is initialized whose driver isn't multi_instance.
+ * Such drivers keep state in statics, some of them shared (e.g. serial.c
+ * or the chipset code of the internal programmer), so only one of them
+ * may be used at a time.
+ */
+static bool exclusive_programmer = false;
 
 static int check_block_eraser(const struct flashctx *flash, int k, int log);
 
@@ -79,19 +73,42 @@ int shutdown_free(void *data)
  */
 int register_shutdown(int (*function) (void *data), void *data)
 {
-	if (shutdown_fn_count >= SHUTDOWN_MAXFN) {
+	struct flashprog_programmer *const prog = active_programmer;
+
+	if (!prog) {
+		msg_perr("Tried to register a shutdown function outside of "
+			 "programmer init or probing.\n");
+		return 1;
+	}
+	if (prog->shutdown_fn_count >= SHUTDOWN_MAXFN) {
 		msg_perr("Tried to register more than %i shutdown functions.\n",
 			 SHUTDOWN_MAXFN);
 		return 1;
 	}
-	if (!may_register_shutdown) {
-		msg_perr("Tried to register a shutdown function before "
-			 "programmer init.\n");
-		return 1;
+	prog->shutdown_fn[prog->shutdown_fn_count].func = function;
+	prog->shutdown_fn[prog->shutdown_fn_count].data = data;
+	prog->shutdown_fn_count++;
+
+	return 0;
+}
+
+/* This function copies the struct registered_master parameter. */
+int register_master(const struct registered_master *mst)
+{
+	struct flashprog_programmer *const prog = active_programmer;
+
+	if (!prog) {
+		msg_perr("Tried to register a master outside of programmer init.\n");
+		return ERROR_FLASHPROG_BUG;
+	}
+	if (prog->master_count >= MASTERS_MAX) {
+		msg_perr("Tried to register more than %i master "
+			 "interfaces.\n", MASTERS_MAX);
+		return ERROR_FLASHPROG_LIMIT;
 	}
-	shutdown_fn[shutdown_fn_count].func = function;
-	shutdown_fn[shutdown_fn_count].data = data;
-	shutdown_fn_count++;
+	prog->masters[prog->master_count] = *mst;
+	prog->masters[prog->master_count].prog = prog;
+	prog->master_count++;
 
 	return 0;
 }
@@ -132,35 +149,46 @@ int programmer_init(struct flashprog_programmer *const prog)
 		msg_perr("Invalid programmer specified!\n");
 		return -1;
 	}
-	programmer = prog->driver;
-	programmer_param = prog->param;
 	/* Initialize all programmer specific data. */
 	/* Default to top aligned flash at 4 GB. */
-	flashbase = 0;
-	/* Registering shutdown functions is now allowed. */
-	may_register_shutdown = true;
-	/* Default to allowing writes. Broken programmers set this to 0. */
-	programmer_may_write = true;
-
-	msg_pdbg("Initializing %s programmer\n", programmer->name);
-	ret = programmer->init(prog);
-	if (programmer_param && strlen(programmer_param)) {
+	prog->flashbase = 0;
+	/* Default to allowing writes. Broken programmers clear this. */
+	prog->may_write = true;
+	prog->master_count = 0;
+	prog->delay_total_us = 0;
+	prog->spi_id_cache_count = 0;
+	prog->job_running = false;
+	/* Registering masters and shutdown functions is now allowed. */
+	prog->shutdown_fn_count = 0;
+
+	prog->exclusive = !prog->driver->multi_instance;
+	if (prog->exclusive && __atomic_exchange_n(&exclusive_programmer, true, __ATOMIC_ACQUIRE)) {
+		msg_perr("The %s programmer can't be used along with another single-instance programmer.\n",
+			 prog->driver->name);
+		prog->exclusive = false;
+		return 1;
+	}
+	active_programmer = prog;
+
+	msg_pdbg("Initializing %s programmer\n", prog->driver->name);
+	ret = prog->driver->init(prog);
+	if (prog->param && strlen(prog->param)) {
 		if (ret != 0) {
 			/* It is quite possible that any unhandled programmer parameter would have been valid,
 			 * but an error in actual programmer init happened before the parameter was evaluated.
 			 */
 			msg_pwarn("Unhandled programmer parameters (possibly due to another failure): %s\n",
-				  programmer_param);
+				  prog->param);
 		} else {
 			/* Actual programmer init was successful, but the user specified an invalid or unusable
 			 * (for the current programmer configuration) parameter.
 			 */
-			msg_perr("Unhandled programmer parameters: %s\n", programmer_param);
+			msg_perr("Unhandled programmer parameters: %s\n", prog->param);
 			msg_perr("Aborting.\n");
 			ret = ERROR_FATAL;
 		}
 	}
-	programmer_param = NULL;
+	active_programmer = NULL;
 	return ret;
 }
 
@@ -173,22 +201,50 @@ int programmer_shutdown(struct flashprog_programmer *const prog)
 {
 	int ret = 0;
 
-	/* Registering shutdown functions is no longer allowed. */
-	may_register_shutdown = false;
-	while (shutdown_fn_count > 0) {
-		int i = --shutdown_fn_count;
-		ret |= shutdown_fn[i].func(shutdown_fn[i].data);
+	if (!prog)
+		return 0;
+
+	while (prog->shutdown_fn_count > 0) {
+		int i = --prog->shutdown_fn_count;
+		ret |= prog->shutdown_fn[i].func(prog->shutdown_fn[i].data);
+	}
+	prog->master_count = 0;
+
+	if (prog->exclusive) {
+		prog->exclusive = false;
+		__atomic_store_n(&exclusive_programmer, false, __ATOMIC_RELEASE);
 	}
-	registered_master_count = 0;
 
 	return ret;
 }
 
-void programmer_delay(unsigned int usecs)
+/* Time spent in programmer_delay() for `flash`'s programmer so far, for the statistics. */
+unsigned long long programmer_delay_total(const struct flashctx *const flash)
+{
+	return flash->prog ? flash->prog->delay_total_us : 0;
+}
+
+static struct flashprog_usb_stats usb_stats_total;
+
+/* USB transfers of all programmers so far, accounted atomically by the usbdev.c wrappers. */
+struct flashprog_usb_stats *programmer_usb_stats(void)
+{
+	return &usb_stats_total;
+}
+
+/*
+ * Delay for `usecs` microseconds on the programmer of `flash`. Drivers
+ * without a flash context at hand pass NULL, and get a host delay.
+ */
+void programmer_delay(const struct flashctx *const flash, unsigned int usecs)
 {
+	struct flashprog_programmer *const prog = flash ? flash->prog : NULL;
+
+	if (prog)
+		prog->delay_total_us += usecs;
 	if (usecs > 0) {
-		if (programmer->delay)
-			programmer->delay(usecs);
+		if (prog && prog->driver->delay)
+			prog->driver->delay(prog, usecs);
 		else
 			internal_delay(usecs);
 	}
@@ -265,12 +321,19 @@ static char *extract_param(char *const *haystack, const char *needle, const char
 	return opt;
 }
 
+/* Only valid during programmer init, the parameters belong to the active programmer. */
 char *extract_programmer_param(const char *param_name)
 {
-	return extract_param(&programmer_param, param_name, ",");
+	if (!active_programmer)
+		return NULL;
+	return extract_param(&active_programmer->param, param_name, ",");
 }
 
-static void flashprog_progress_report(struct flashprog_progress *const p)
+/*
+ * Call the progress callback, unless it was called too recently. The
+ * start and the end of a stage are always reported.
+ */
+static void flashprog_progress_report(struct flashprog_progress *const p, const bool force)
 {
 	if (p->current > p->total) {
 		msg_gdbg2("Sanitizing progress report: %zu bytes off.", p->current - p->total);
@@ -280,51 +343,107 @@ static void flashprog_progress_report(struct flashprog_progress *const p)
 	if (!p->callback)
 		return;
 
+	const uint64_t now = p->interval_ms ? monotonic_us() : 0;
+	if (!force && p->current != p->total && p->current >= p->reported) {
+		if (p->current - p->reported < p->granularity)
+			return;
+		if (now - p->reported_us < p->interval_ms * 1000ULL)
+			return;
+	}
+	p->reported = p->current;
+	p->reported_us = now;
+
 	p->callback(p->stage, p->current, p->total, p->user_data);
 }
 
+/* Account the time since the current stage started. */
+static void flashprog_stats_stage_end(struct flashprog_flashctx *const flashctx)
+{
+	if (!flashctx->stats_state.stage_running)
+		return;
+
+	flashctx->stats.stage_us[flashctx->progress.stage] +=
+		monotonic_us() - flashctx->stats_state.stage_start;
+	flashctx->stats_state.stage_running = false;
+}
+
 static void flashprog_progress_start(struct flashprog_flashctx *const flashctx,
 				    const enum flashprog_progress_stage stage, const size_t total)
 {
+	flashprog_stats_stage_end(flashctx);
+	flashctx->stats_state.stage_start	= monotonic_us();
+	flashctx->stats_state.stage_running	= true;
+
 	flashctx->progress.stage	= stage;
 	flashctx->progress.current	= 0;
 	flashctx->progress.total	= total;
-	flashprog_progress_report(&flashctx->progress);
+	flashctx->progress.start_us	= flashctx->stats_state.stage_start;
+	flashprog_progress_report(&flashctx->progress, true);
 }
 
-static void flashprog_progress_start_by_layout(struct flashprog_flashctx *const flashctx,
-					      const enum flashprog_progress_stage stage,
-					      const struct flashprog_layout *const layout)
+/* Return the total size of the included regions of `layout`. */
+static size_t included_size(const struct flashprog_layout *const layout)
 {
-	const struct romentry *entry = NULL;
+	chipoff_t start = 0, end;
 	size_t total = 0;
 
-	while ((entry = layout_next_included(layout, entry)))
-		total += entry->end - entry->start + 1;
+	while (layout_next_included_span(layout, start, &start, &end)) {
+		total += end - start + 1;
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+	return total;
+}
 
-	flashprog_progress_start(flashctx, stage, total);
+static void flashprog_progress_start_by_layout(struct flashprog_flashctx *const flashctx,
+					      const enum flashprog_progress_stage stage,
+					      const struct flashprog_layout *const layout)
+{
+	flashprog_progress_start(flashctx, stage, included_size(layout));
 }
 
 static void flashprog_progress_set(struct flashprog_flashctx *const flashctx, const size_t current)
 {
 	flashctx->progress.current = current;
-	flashprog_progress_report(&flashctx->progress);
+	flashprog_progress_report(&flashctx->progress, false);
 }
 
 /** @private */
 void flashprog_progress_add(struct flashprog_flashctx *const flashctx, const size_t progress)
 {
 	flashctx->progress.current += progress;
-	flashprog_progress_report(&flashctx->progress);
+	flashprog_progress_report(&flashctx->progress, false);
+}
+
+static void flashprog_event(struct flashprog_flashctx *const flashctx, const enum flashprog_event_id id,
+			    const size_t start, const size_t len, const int result)
+{
+	if (!flashctx->event.callback)
+		return;
+
+	const struct flashprog_event event = { .id = id, .start = start, .len = len, .result = result };
+	flashctx->event.callback(&event, flashctx->event.user_data);
+}
+
+/** @private */
+bool flashprog_cancelled(const struct flashprog_flashctx *const flashctx)
+{
+	if (!__atomic_load_n(&flashctx->cancel_requested, __ATOMIC_RELAXED))
+		return false;
+	msg_gerr("Operation cancelled.\n");
+	return true;
 }
 
 static void flashprog_progress_finish(struct flashprog_flashctx *const flashctx)
 {
+	flashprog_stats_stage_end(flashctx);
+
 	if (flashctx->progress.current == flashctx->progress.total)
 		return;
 
 	flashctx->progress.current = flashctx->progress.total;
-	flashprog_progress_report(&flashctx->progress);
+	flashprog_progress_report(&flashctx->progress, true);
 }
 
 /* Returns the number of well-defined erasers for a chip. */
@@ -365,7 +484,7 @@ static int check_erased_range(struct flashctx *flash, unsigned int start, unsign
 	int ret;
 	const uint8_t erased_value = ERASED_VALUE(flash);
 
-	uint8_t *cmpbuf = malloc(len);
+	uint8_t *cmpbuf = flashprog_malloc(len);
 	if (!cmpbuf) {
 		msg_gerr("Out of memory!\n");
 		return -1;
@@ -373,19 +492,429 @@ static int check_erased_range(struct flashctx *flash, unsigned int start, unsign
 	memset(cmpbuf, erased_value, len);
 	ret = verify_range(flash, cmpbuf, start, len);
 
-	free(cmpbuf);
+	flashprog_free(cmpbuf);
+	return ret;
+}
+
+/* Let the programmer check if a range is erased, returns <0 if it can't. */
+static int programmer_blank_check(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	/* Programmer-side checks know only the plain SPI25 read commands of single-die chips. */
+	if (flash->chip->bustype == BUS_SPI && flash->chip->read == spi_chip_read &&
+	    spi_die_count(flash) == 1 && flash->mst.spi->blank_check)
+		return flash->mst.spi->blank_check(flash, start, len, ERASED_VALUE(flash));
+	if (flash->chip->bustype == BUS_PROG && flash->mst.opaque->blank_check)
+		return flash->mst.opaque->blank_check(flash, start, len, ERASED_VALUE(flash));
+	return -1;
+}
+
+#define ERASE_CHECK_SAMPLES	4
+#define ERASE_CHECK_SAMPLE_LEN	256
+
+/*
+ * Check an erased block according to the erase-check policy. Progress
+ * is accounted for `len` bytes, however much we actually read.
+ */
+static int check_erased_block(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	unsigned int i, checked = 0;
+	int ret;
+
+	if (flash->flags.erase_check == FLASHPROG_ERASE_CHECK_NONE) {
+		ret = 0;
+		goto done;
+	}
+
+	ret = programmer_blank_check(flash, start, len);
+	if (ret > 0)
+		msg_cerr("Blank check failed in range 0x%x..0x%x.\n", start, start + len - 1);
+	if (ret >= 0)
+		goto done;
+	ret = 0;
+
+	if (flash->flags.erase_check == FLASHPROG_ERASE_CHECK_SAMPLED &&
+	    len > ERASE_CHECK_SAMPLES * ERASE_CHECK_SAMPLE_LEN) {
+		/* Check the start, the end and evenly spaced samples in between. */
+		const unsigned int step = (len - ERASE_CHECK_SAMPLE_LEN) / (ERASE_CHECK_SAMPLES - 1);
+		for (i = 0; i < ERASE_CHECK_SAMPLES && !ret; ++i)
+			ret = check_erased_range(flash, start + i * step, ERASE_CHECK_SAMPLE_LEN);
+		checked = ERASE_CHECK_SAMPLES * ERASE_CHECK_SAMPLE_LEN;
+		goto done;
+	}
+
+	return check_erased_range(flash, start, len);
+
+done:
+	flashprog_progress_add(flash, len - checked);
+	return ret;
+}
+
+/*
+ * Flash contents read with flashprog_read_range() and read_by_layout()
+ * are kept up to READ_CACHE_SIZE bytes. So an FMAP or IFD that was read
+ * to set up the layout doesn't have to be read again for the image.
+ * Erasing and writing drops all cached data of the affected range.
+ */
+#define READ_CACHE_SIZE		(1 * MiB)
+
+struct read_cache_entry {
+	chipoff_t start;
+	chipsize_t len;
+	uint8_t *data;
+};
+
+void read_cache_clear(struct flashctx *const flash)
+{
+	struct read_cache *const cache = &flash->read_cache;
+	size_t i;
+
+	for (i = 0; i < cache->count; ++i)
+		flashprog_free(cache->entries[i].data);
+	flashprog_free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void read_cache_invalidate(struct flashctx *const flash, const chipoff_t start, const chipsize_t len)
+{
+	struct read_cache *const cache = &flash->read_cache;
+	size_t i, kept = 0;
+
+	for (i = 0; i < cache->count; ++i) {
+		struct read_cache_entry *const entry = &cache->entries[i];
+		if (entry->start < start + len && start < entry->start + entry->len) {
+			cache->bytes -= entry->len;
+			flashprog_free(entry->data);
+		} else {
+			cache->entries[kept++] = *entry;
+		}
+	}
+	cache->count = kept;
+}
+
+/* `start` to `start + len` must not be cached yet. */
+static void read_cache_store(struct flashctx *const flash, const uint8_t *const buf,
+			     const chipoff_t start, const chipsize_t len)
+{
+	struct read_cache *const cache = &flash->read_cache;
+	size_t pos;
+
+	if (len > READ_CACHE_SIZE - cache->bytes)
+		return;
+
+	uint8_t *const data = flashprog_malloc(len);
+	struct read_cache_entry *const entries =
+		flashprog_realloc(cache->entries, (cache->count + 1) * sizeof(*entries));
+	if (entries)
+		cache->entries = entries;
+	if (!data || !entries) {
+		flashprog_free(data);
+		return;
+	}
+	memcpy(data, buf, len);
+
+	for (pos = cache->count; pos > 0 && entries[pos - 1].start > start; --pos)
+		entries[pos] = entries[pos - 1];
+	entries[pos].start = start;
+	entries[pos].len = len;
+	entries[pos].data = data;
+	++cache->count;
+	cache->bytes += len;
+}
+
+/* Chunks of checked reads, a mismatch costs a re-read of this size. */
+#define CHECKED_READ_CHUNK	(64 * KiB)
+#define CHECKED_READ_RETRIES	4
+
+/*
+ * Read from the chip. With FLASHPROG_FLAG_CHECKED_READ, every chunk is
+ * checked against a CRC-32 calculated by the programmer, or against a
+ * second read if it can't calculate one. Chunks that don't match are read
+ * again, at a lower SPI clock if the master can switch it.
+ */
+static int read_checked(struct flashctx *const flash, uint8_t *const buf,
+			const chipoff_t start, const chipsize_t len)
+{
+	uint8_t *second = NULL;
+	chipsize_t pos, chunk;
+	int ret = 1;
+
+	if (!flash->flags.checked_read)
+		return flash->chip->read(flash, buf, start, len);
+
+	for (pos = 0; pos < len; pos += chunk) {
+		const size_t progress = flash->progress.current;
+		unsigned int tries;
+		uint32_t crc;
+
+		chunk = min(CHECKED_READ_CHUNK, len - pos);
+		for (tries = 0;; ++tries) {
+			bool match;
+
+			if (flash->chip->read(flash, buf + pos, start + pos, chunk))
+				goto _free_ret;
+			if (!programmer_checksum(flash, start + pos, chunk, &crc)) {
+				match = crc32_update(0, buf + pos, chunk) == crc;
+			} else {
+				if (!second && !(second = flashprog_malloc(CHECKED_READ_CHUNK))) {
+					msg_gerr("Out of memory!\n");
+					goto _free_ret;
+				}
+				if (flash->chip->read(flash, second, start + pos, chunk))
+					goto _free_ret;
+				match = !memcmp(buf + pos, second, chunk);
+			}
+			/* Count every byte once, however often it was read. */
+			flashprog_progress_set(flash, progress + chunk);
+			if (match)
+				break;
+
+			if (tries == CHECKED_READ_RETRIES) {
+				msg_gerr("Reads at 0x%06x..0x%06x keep disagreeing, giving up.\n",
+					 start + pos, start + pos + chunk - 1);
+				goto _free_ret;
+			}
+			msg_gwarn("Reads at 0x%06x..0x%06x disagree, reading again.\n",
+				  start + pos, start + pos + chunk - 1);
+			if (flash->chip->bustype == BUS_SPI)
+				spi_slow_down(flash);
+		}
+	}
+	ret = 0;
+
+_free_ret:
+	flashprog_free(second);
 	return ret;
 }
 
+/* Read from the cache where possible, and from the chip otherwise. */
+static int read_cached(struct flashctx *const flash, uint8_t *const buf,
+		       const chipoff_t start, const chipsize_t len)
+{
+	const struct read_cache *const cache = &flash->read_cache;
+	const chipoff_t end = start + len;
+	chipoff_t addr = start;
+
+	while (addr < end) {
+		const struct read_cache_entry *entry = NULL;
+		chipoff_t next = end;
+		size_t i;
+
+		for (i = 0; i < cache->count; ++i) {
+			if (cache->entries[i].start + cache->entries[i].len > addr) {
+				entry = &cache->entries[i];
+				break;
+			}
+		}
+
+		if (entry && entry->start <= addr) {
+			const chipsize_t copy_len = MIN(entry->start + entry->len, end) - addr;
+			memcpy(buf + (addr - start), entry->data + (addr - entry->start), copy_len);
+			flashprog_progress_add(flash, copy_len);
+			addr += copy_len;
+			continue;
+		}
+
+		if (entry && entry->start < end)
+			next = entry->start;
+		if (read_checked(flash, buf + (addr - start), addr, next - addr))
+			return 1;
+		read_cache_store(flash, buf + (addr - start), addr, next - addr);
+		addr = next;
+	}
+
+	return 0;
+}
+
 int flashprog_read_range(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
 	flashprog_progress_start(flash, FLASHPROG_PROGRESS_READ, len);
-	const int ret = flash->chip->read(flash, buf, start, len);
+	const int ret = read_cached(flash, buf, start, len);
 	flashprog_progress_finish(flash);
 	return ret;
 }
 
+static int verify_range_by_reading(struct flashctx *flash, const uint8_t *cmpbuf,
+				   unsigned int start, unsigned int len)
+{
+	uint8_t *readbuf = flashprog_malloc(len);
+	if (!readbuf) {
+		msg_gerr("Out of memory!\n");
+		return -1;
+	}
+
+	int ret = read_checked(flash, readbuf, start, len);
+	if (ret) {
+		msg_gerr("Verification impossible because read failed "
+			 "at 0x%x (len 0x%x)\n", start, len);
+		ret = -1;
+		goto out_free;
+	}
+
+	ret = compare_range(cmpbuf, readbuf, start, len);
+out_free:
+	flashprog_free(readbuf);
+	return ret;
+}
+
+/* Let the programmer calculate a CRC-32 of a range, returns non-zero if it can't. */
+int programmer_checksum(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc)
+{
+	if (flash->chip->bustype == BUS_SPI && flash->chip->read == spi_chip_read &&
+	    spi_die_count(flash) == 1 && flash->mst.spi->checksum)
+		return flash->mst.spi->checksum(flash, start, len, crc);
+	if (flash->chip->bustype == BUS_PROG && flash->mst.opaque->checksum)
+		return flash->mst.opaque->checksum(flash, start, len, crc);
+	return 1;
+}
+
+/*
+ * Get the access restrictions of the programmer at `addr`. The region
+ * reaches as far as they stay the same. Without known restrictions, the
+ * whole chip is accessible.
+ */
+void get_flash_region(const struct flashctx *flash, chipoff_t addr, struct flash_region *region)
+{
+	*region = (struct flash_region){ .start = 0, .end = flash->chip->total_size * 1024 - 1 };
+	if (flash->chip->bustype == BUS_SPI && flash->mst.spi->get_region)
+		flash->mst.spi->get_region(flash, addr, region);
+	else if (flash->chip->bustype == BUS_PROG && flash->mst.opaque->get_region)
+		flash->mst.opaque->get_region(flash, addr, region);
+}
+
+static bool region_skipped(const struct flash_region *region, const bool skip_write_protected)
+{
+	return region->read_prot || (skip_write_protected && region->write_prot);
+}
+
+/* Returns true if the programmer allows to read all of the range. */
+bool flash_range_readable(const struct flashctx *flash, chipoff_t start, const chipsize_t len)
+{
+	const chipoff_t last = start + len - 1;
+	struct flash_region region;
+
+	for (;;) {
+		get_flash_region(flash, start, &region);
+		if (region.read_prot)
+			return false;
+		if (region.end >= last)
+			return true;
+		start = region.end + 1;
+	}
+}
+
+static bool unprotected_next_included_span(const struct flashctx *flash, const struct flashprog_layout *layout,
+					   const bool skip_write_protected,
+					   chipoff_t where, chipoff_t *start, chipoff_t *end)
+{
+	struct flash_region region;
+
+	while (layout_next_included_span(layout, where, start, end)) {
+		get_flash_region(flash, *start, &region);
+		*end = MIN(*end, region.end);
+		if (!region_skipped(&region, skip_write_protected))
+			return true;
+
+		msg_cdbg2("Skipping protected range 0x%08x-0x%08x.\n", *start, *end);
+		if (*end + 1 == 0)
+			break;
+		where = *end + 1;
+	}
+	return false;
+}
+
+/*
+ * Like layout_next_included_span(), but leaves out the ranges that the
+ * programmer can't read, and while erasing or writing those it can't
+ * write either. Spans are split where the access restrictions change.
+ */
+bool accessible_next_included_span(const struct flashctx *flash, const struct flashprog_layout *layout,
+				   chipoff_t where, chipoff_t *start, chipoff_t *end)
+{
+	return unprotected_next_included_span(flash, layout, flash->skip_write_protected, where, start, end);
+}
+
+/*
+ * Like accessible_next_included_span(), but only leaves out the ranges
+ * that can't be read. Write-protected ranges are verified too, so that
+ * an image that differs there doesn't pass.
+ */
+static bool readable_next_included_span(const struct flashctx *flash, const struct flashprog_layout *layout,
+					chipoff_t where, chipoff_t *start, chipoff_t *end)
+{
+	return unprotected_next_included_span(flash, layout, false, where, start, end);
+}
+
+static void warn_write_protected(const chipoff_t start, const chipoff_t end)
+{
+	msg_cwarn("Range 0x%08x-0x%08x is write protected and differs from the image, "
+		  "it won't be written.\n", start, end);
+}
+
+/*
+ * Warns about included ranges that can't be written but differ
+ * from the image. Returns true if there are any.
+ */
+static bool write_protected_differs(const struct flashctx *flash, const struct flashprog_layout *layout,
+				    const uint8_t *curcontents, const uint8_t *newcontents)
+{
+	struct flash_region region;
+	chipoff_t start = 0, end;
+	bool differs = false;
+
+	while (layout_next_included_span(layout, start, &start, &end)) {
+		get_flash_region(flash, start, &region);
+		end = MIN(end, region.end);
+		if (region.write_prot && !region.read_prot &&
+		    memcmp(curcontents + start, newcontents + start, end - start + 1)) {
+			warn_write_protected(start, end);
+			differs = true;
+		}
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+	return differs;
+}
+
+/* Ranges with mismatching checksums are bisected down to this size. */
+#define VERIFY_BISECT_MIN	(4 * KiB)
+
+/* Returns 0 for success, -1 for failure, 1 if the programmer can't calculate the checksum. */
+static int verify_range_by_checksum(struct flashctx *flash, const uint8_t *cmpbuf,
+				    unsigned int start, unsigned int len)
+{
+	uint32_t crc;
+	int ret;
+
+	if (programmer_checksum(flash, start, len, &crc))
+		return 1;
+
+	if (crc == crc32_update(0, cmpbuf, len)) {
+		flashprog_progress_add(flash, len);
+		return 0;
+	}
+
+	msg_cdbg2("Checksum mismatch at 0x%08x-0x%08x.\n", start, start + len - 1);
+	if (len <= VERIFY_BISECT_MIN)
+		return verify_range_by_reading(flash, cmpbuf, start, len);
+
+	const unsigned int half = len / 2;
+	ret = verify_range_by_checksum(flash, cmpbuf, start, half);
+	if (ret > 0)
+		ret = verify_range_by_reading(flash, cmpbuf, start, half);
+	if (ret)
+		return ret;
+
+	ret = verify_range_by_checksum(flash, cmpbuf + half, start + half, len - half);
+	if (ret > 0)
+		ret = verify_range_by_reading(flash, cmpbuf + half, start + half, len - half);
+	return ret;
+}
+
 /*
+ * If the programmer can calculate checksums, only ranges with mismatching
+ * checksums are read back.
+ *
  * @cmpbuf	buffer to compare against, cmpbuf[0] is expected to match the
  *		flash content at location start
  * @start	offset to the base address of the flash chip
@@ -404,23 +933,11 @@ int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int sta
 		return -1;
 	}
 
-	uint8_t *readbuf = malloc(len);
-	if (!readbuf) {
-		msg_gerr("Out of memory!\n");
-		return -1;
-	}
-
-	int ret = flash->chip->read(flash, readbuf, start, len);
-	if (ret) {
-		msg_gerr("Verification impossible because read failed "
-			 "at 0x%x (len 0x%x)\n", start, len);
-		ret = -1;
-		goto out_free;
-	}
+	int ret = verify_range_by_checksum(flash, cmpbuf, start, len);
+	if (ret > 0)
+		ret = verify_range_by_reading(flash, cmpbuf, start, len);
 
-	ret = compare_range(cmpbuf, readbuf, start, len);
-out_free:
-	free(readbuf);
+	flashprog_event(flash, FLASHPROG_EVENT_VERIFY, start, len, ret);
 	return ret;
 }
 
@@ -437,28 +954,126 @@ size_t gran_to_bytes(const enum write_granularity gran)
 		case write_gran_528bytes:		return 528;
 		case write_gran_1024bytes:		return 1024;
 		case write_gran_1056bytes:		return 1056;
+		case write_gran_2048bytes:		return 2048;
 		default:				return 0;
 	}
 }
 
-/* Helper function for need_erase() that focuses on granularities of gran bytes. */
-static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsigned int len,
-                                 unsigned int gran, const uint8_t erased_value)
+/*
+ * Word-wise helpers for the loops below. Images are mostly identical when
+ * re-flashing, so we want to skip equal parts quickly. Loads go through
+ * memcpy() to avoid alignment issues; compilers turn them into plain loads.
+ */
+#define WORD_ONES	0x0101010101010101ULL
+#define WORD_HIGHS	0x8080808080808080ULL
+
+static inline uint64_t load_word(const uint8_t *p)
 {
-	unsigned int i, j, limit;
-	for (j = 0; j < len / gran; j++) {
-		limit = min (gran, len - j * gran);
-		/* Are 'have' and 'want' identical? */
-		if (!memcmp(have + j * gran, want + j * gran, limit))
-			continue;
-		/* have needs to be in erased state. */
-		for (i = 0; i < limit; i++)
-			if (have[j * gran + i] != erased_value)
-				return 1;
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/* Whether any byte of `w` is zero. */
+static inline bool word_has_zero_byte(const uint64_t w)
+{
+	return (w - WORD_ONES) & ~w & WORD_HIGHS;
+}
+
+/* Return the offset of the first byte that differs, `len` if there is none. */
+static size_t find_first_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		if (load_word(a + i) != load_word(b + i))
+			break;
+	}
+	for (; i < len && a[i] == b[i]; ++i)
+		;
+	return i;
+}
+
+/* Return the offset of the first byte that is equal, `len` if there is none. */
+static size_t find_first_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		if (word_has_zero_byte(load_word(a + i) ^ load_word(b + i)))
+			break;
+	}
+	for (; i < len && a[i] != b[i]; ++i)
+		;
+	return i;
+}
+
+static bool is_erased(const uint8_t *buf, size_t len, const uint8_t erased_value)
+{
+	const uint64_t erased_word = erased_value * WORD_ONES;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		if (load_word(buf + i) != erased_word)
+			return false;
+	}
+	for (; i < len; ++i) {
+		if (buf[i] != erased_value)
+			return false;
+	}
+	return true;
+}
+
+/* Helper function for need_erase() that focuses on granularities of gran bytes. */
+static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsigned int len,
+                                 unsigned int gran, const uint8_t erased_value)
+{
+	unsigned int j, limit;
+	for (j = 0; j < len / gran; j++) {
+		limit = min (gran, len - j * gran);
+		/* Are 'have' and 'want' identical? */
+		if (!memcmp(have + j * gran, want + j * gran, limit))
+			continue;
+		/* have needs to be in erased state. */
+		if (!is_erased(have + j * gran, limit, erased_value))
+			return 1;
+	}
+	return 0;
+}
+
+/* Check if all bits that are set in `want` are also set in `have`. */
+static int need_erase_1bit(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		const uint64_t w = load_word(want + i);
+		if ((load_word(have + i) & w) != w)
+			return 1;
+	}
+	for (; i < len; i++) {
+		if ((have[i] & want[i]) != want[i])
+			return 1;
 	}
 	return 0;
 }
 
+/* Check if all bytes that differ are erased in `have`. */
+static int need_erase_1byte(const uint8_t *have, const uint8_t *want, unsigned int len,
+			    const uint8_t erased_value)
+{
+	unsigned int i = 0;
+
+	while (true) {
+		i += find_first_diff(have + i, want + i, len - i);
+		if (i >= len)
+			return 0;
+		if (have[i] != erased_value)
+			return 1;
+		++i;
+	}
+}
+
 /*
  * Check if the buffer @have can be programmed to the content of @want without
  * erasing. This is only possible if all chunks of size @gran are either kept
@@ -476,22 +1091,13 @@ static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsig
 static int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len,
 		      enum write_granularity gran, const uint8_t erased_value)
 {
-	unsigned int i;
 	size_t stride;
 
 	switch (gran) {
 	case write_gran_1bit:
-		for (i = 0; i < len; i++) {
-			if ((have[i] & want[i]) != want[i])
-				return 1;
-		}
-		return 0;
+		return need_erase_1bit(have, want, len);
 	case write_gran_1byte:
-		for (i = 0; i < len; i++) {
-			if ((have[i] != want[i]) && (have[i] != erased_value))
-				return 1;
-		}
-		return 0;
+		return need_erase_1byte(have, want, len, erased_value);
 	case write_gran_1byte_implicit_erase:
 		/* Do not erase, handle content changes from anything->0xff by writing 0xff. */
 		return 0;
@@ -525,9 +1131,7 @@ static int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len
  * @return	length of the first contiguous area which needs to be written
  *		0 if no write is needed
  *
- * FIXME: This function needs a parameter which tells it about coalescing
- * in relation to the max write length of the programmer and the max write
- * length of the chip.
+ * Coalescing of writes is done by the caller, see write_range().
  */
 static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, chipsize_t len,
 				   chipoff_t *first_start, enum write_granularity gran)
@@ -545,20 +1149,26 @@ static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, chi
 		 */
 		return 0;
 	}
-	for (i = 0; i < len / stride; i++) {
-		limit = min(stride, len - i * stride);
-		/* Are 'have' and 'want' identical? */
-		if (memcmp(have + i * stride, want + i * stride, limit)) {
-			if (!need_write) {
-				/* First location where have and want differ. */
-				need_write = true;
-				rel_start = i * stride;
-			}
-		} else {
-			if (need_write) {
-				/* First location where have and want
-				 * do not differ anymore.
-				 */
+	/* Skip identical units quickly. */
+	i = find_first_diff(have, want, len / stride * stride) / stride;
+	if (stride == 1) {
+		if (i < len) {
+			need_write = true;
+			rel_start = i;
+			i += find_first_equal(have + i, want + i, len - i);
+		}
+	} else {
+		for (; i < len / stride; i++) {
+			limit = min(stride, len - i * stride);
+			/* Are 'have' and 'want' identical? */
+			if (memcmp(have + i * stride, want + i * stride, limit)) {
+				if (!need_write) {
+					/* First location where have and want differ. */
+					need_write = true;
+					rel_start = i * stride;
+				}
+			} else {
+				/* First location where have and want do not differ anymore. */
 				break;
 			}
 		}
@@ -613,12 +1223,26 @@ static int init_default_layout(struct flashctx *flash)
 	return 0;
 }
 
-int probe_flash(struct registered_master *mst, int startchip, struct flashctx *flash, int force)
+static int probe_flash_on(struct registered_master *mst, int startchip, struct flashctx *flash, int force,
+			  const char *chip_to_probe)
 {
 	const struct flashchip *chip;
+	struct flashchip candidate;
 	enum chipbustype buses_common;
 	char *tmp;
 
+	/*
+	 * ID responses cached by the SPI probe functions stay valid while
+	 * we continue on the same master, i.e. for startchip != 0.
+	 */
+	if (startchip == 0)
+		spi_id_cache_clear(mst->prog);
+
+	flash->prog = mst->prog;
+	flash->stats_state.delay_base = programmer_delay_total(flash);
+	flash->stats_state.usb_base = *programmer_usb_stats();
+	flash->stats_state.delays_base = *internal_delay_stats();
+
 	for (chip = flashchips + startchip; chip && chip->name; chip++) {
 		if (chip_to_probe && strcmp(chip->name, chip_to_probe) != 0)
 			continue;
@@ -634,14 +1258,19 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 			continue;
 		}
 
-		/* Start filling in the dynamic data. */
-		flash->chip = calloc(1, sizeof(*flash->chip));
-		if (!flash->chip) {
-			msg_gerr("Out of memory!\n");
-			return -1;
-		}
-		*flash->chip = *chip;
+		/*
+		 * Start filling in the dynamic data. Probe functions may adapt
+		 * the chip, so they work on a scratch copy. Only the detected
+		 * chip gets its own copy below.
+		 */
+		candidate = *chip;
+		flash->chip = &candidate;
 		flash->mst.par = &mst->par; /* both `mst` are unions, so we need only one pointer */
+		memset(&flash->status_shadow, 0, sizeof(flash->status_shadow));
+		flash->address_mode_known = false;
+		memset(&flash->die, 0, sizeof(flash->die));
+		flash->die.active = -1;
+		flash->chip_requested = chip_to_probe != NULL;
 
 		if (flash->chip->prepare_access && flash->chip->prepare_access(flash, PREPARE_PROBE))
 			goto free_chip;
@@ -696,13 +1325,24 @@ notfound:
 		if (flash->chip->finish_access)
 			flash->chip->finish_access(flash);
 free_chip:
-		free(flash->chip);
 		flash->chip = NULL;
 	}
 
 	if (!flash->chip)
 		return -1;
 
+	flash->chip = flashprog_malloc(sizeof(*flash->chip));
+	if (!flash->chip) {
+		msg_gerr("Out of memory!\n");
+		if (candidate.finish_access) {
+			flash->chip = &candidate;
+			candidate.finish_access(flash);
+			flash->chip = NULL;
+		}
+		return -1;
+	}
+	*flash->chip = candidate;
+
 	if (init_default_layout(flash) < 0)
 		return -1;
 
@@ -716,13 +1356,11 @@ free_chip:
 			  PRIxPTR_WIDTH, flash->physical_memory);
 	else
 #endif
-		msg_cinfo("on %s.\n", programmer->name);
+		msg_cinfo("on %s.\n", mst->prog->driver->name);
 
-	/* Flash registers may more likely not be mapped if the chip was forced.
-	 * Lock info may be stored in registers, so avoid lock info printing. */
-	if (!force)
-		if (flash->chip->printlock)
-			flash->chip->printlock(flash);
+	/* With `spispeed=auto', the master picks its clock with the first chip found. */
+	if (flash->chip->bustype == BUS_SPI && flash->mst.spi->tune_speed && !force)
+		spi_tune_speed(flash);
 
 	/* Get out of the way for later runs. */
 	if (flash->chip->finish_access)
@@ -732,6 +1370,17 @@ free_chip:
 	return chip - flashchips;
 }
 
+int probe_flash(struct registered_master *mst, int startchip, struct flashctx *flash, int force,
+		const char *chip_to_probe)
+{
+	/* Probe functions may register shutdown functions, e.g. to undo mappings. */
+	struct flashprog_programmer *const prev = active_programmer;
+	active_programmer = mst->prog;
+	const int ret = probe_flash_on(mst, startchip, flash, force, chip_to_probe);
+	active_programmer = prev;
+	return ret;
+}
+
 /* Even if an error is found, the function will keep going and check the rest. */
 static int selfcheck_eraseblocks(const struct flashchip *chip)
 {
@@ -861,16 +1510,28 @@ static int check_block_eraser(const struct flashctx *flash, int k, int log)
 static int read_by_layout(struct flashctx *const flashctx, uint8_t *const buffer)
 {
 	const struct flashprog_layout *const layout = get_layout(flashctx);
-	const struct romentry *entry = NULL;
+	chipoff_t region_start = 0, region_end;
 
 	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_READ, layout);
 
-	while ((entry = layout_next_included(layout, entry))) {
-		const chipoff_t region_start	= entry->start;
-		const chipsize_t region_len	= entry->end - entry->start + 1;
+	while (layout_next_included_span(layout, region_start, &region_start, &region_end)) {
+		struct flash_region region;
 
-		if (flashctx->chip->read(flashctx, buffer + region_start, region_start, region_len))
+		get_flash_region(flashctx, region_start, &region);
+		region_end = MIN(region_end, region.end);
+		const chipsize_t region_len = region_end - region_start + 1;
+
+		if (region.read_prot) {
+			msg_cinfo("Skipping protected range 0x%08x-0x%08x, filling it with 0x%02x.\n",
+				  region_start, region_end, ERASED_VALUE(flashctx));
+			memset(buffer + region_start, ERASED_VALUE(flashctx), region_len);
+		} else if (read_cached(flashctx, buffer + region_start, region_start, region_len)) {
 			return 1;
+		}
+
+		region_start = region_end + 1;
+		if (region_start == 0)
+			break;
 	}
 
 	flashprog_progress_finish(flashctx);
@@ -885,33 +1546,63 @@ static int read_by_layout(struct flashctx *const flashctx, uint8_t *const buffer
  * to buffers of the chip's size. Both are supposed to be prefilled
  * with at least the included layout regions of the current flash
  * contents (`curcontents`) and the data to be written to the flash
- * (`newcontents`).
+ * (`newcontents`). When streaming, `curcontents` holds only the
+ * current region, starting at flash offset `cur_offset`, and
+ * `newcontents` may hold only the current region, too, starting
+ * at `new_offset`. If the whole
+ * chip was read, `cur_complete` is set and `curcontents` tracks the
+ * chip contents outside the included regions too, so erase blocks can
+ * be backed up from it.
  *
  * For erase, `curcontents` and `newcontents` shall be NULL-pointers.
  *
+ * `scratch` holds buffers that are reused for all erase blocks of a walk.
+ *
  * The `chipoff_t` values are used internally by `walk_by_layout()`.
  */
+struct walk_scratch {
+	uint8_t *buf;
+	size_t len;
+};
+
 struct walk_info {
 	uint8_t *curcontents;
+	chipoff_t cur_offset;
+	bool cur_complete;
 	const uint8_t *newcontents;
+	chipoff_t new_offset;
+	struct walk_scratch *scratch;
 	chipoff_t region_start;
 	chipoff_t region_end;
 	chipoff_t erase_start;
 	chipoff_t erase_end;
 };
 
+/* An erase block, as computed from an `erase_layout`. */
 struct eraseblock_data {
 	chipoff_t start_addr;
 	chipoff_t end_addr;
-	bool selected;
 	size_t block_num;
-	size_t first_sub_block_index;
-	size_t last_sub_block_index;
 };
 
+/* A run of uniformly sized erase blocks. */
+struct erase_region {
+	chipoff_t start_addr;
+	chipsize_t block_size;
+	size_t first_block;
+	size_t block_count;
+};
+
+/*
+ * Erase blocks are not stored individually, their addresses are computed
+ * from the regions of the eraser. Only the selection is kept per block,
+ * in the bitmap `selected`.
+ */
 struct erase_layout {
-	struct eraseblock_data* layout_list;
+	struct erase_region regions[NUM_ERASEREGIONS];
+	size_t region_count;
 	size_t block_count;
+	uint8_t *selected;
 	const struct block_eraser *eraser;
 };
 
@@ -921,35 +1612,83 @@ static bool explicit_erase(const struct walk_info *const info)
 	return !info->newcontents;
 }
 
-static size_t calculate_block_count(const struct block_eraser *const eraser)
+static uint8_t *curcontents_at(const struct walk_info *const info, const chipoff_t addr)
+{
+	return info->curcontents + (addr - info->cur_offset);
+}
+
+static const uint8_t *newcontents_at(const struct walk_info *const info, const chipoff_t addr)
+{
+	return info->newcontents + (addr - info->new_offset);
+}
+
+static struct eraseblock_data get_eraseblock(const struct erase_layout *const layout, const size_t block_num)
 {
-	size_t block_count = 0, i;
+	const struct erase_region *region = &layout->regions[0];
 
-	for (i = 0; i < ARRAY_SIZE(eraser->eraseblocks); ++i)
-		block_count += eraser->eraseblocks[i].count;
+	while (block_num >= region->first_block + region->block_count &&
+	       region < &layout->regions[layout->region_count - 1])
+		++region;
 
-	return block_count;
+	const chipoff_t start_addr =
+		region->start_addr + (block_num - region->first_block) * region->block_size;
+	return (struct eraseblock_data){ start_addr, start_addr + region->block_size - 1, block_num };
 }
 
-static void init_eraseblock(struct erase_layout *layout, size_t idx, size_t block_num,
-		chipoff_t start_addr, chipoff_t end_addr, size_t *sub_block_index)
+/* Return the index of the block containing `addr`, `block_count` if there is none. */
+static size_t eraseblock_index(const struct erase_layout *const layout, const chipoff_t addr)
 {
-	struct eraseblock_data *edata = &layout[idx].layout_list[block_num];
-	edata->start_addr = start_addr;
-	edata->end_addr = end_addr;
-	edata->selected = false;
-	edata->block_num = block_num;
+	size_t i;
 
-	if (!idx)
-		return;
-	const struct erase_layout *const sub_layout = &layout[idx - 1];
+	for (i = 0; i < layout->region_count; ++i) {
+		const struct erase_region *const region = &layout->regions[i];
+		if ((uint64_t)addr < region->start_addr + (uint64_t)region->block_size * region->block_count)
+			return region->first_block + (addr - region->start_addr) / region->block_size;
+	}
+	return layout->block_count;
+}
+
+static bool eraseblock_selected(const struct erase_layout *const layout, const size_t block_num)
+{
+	return layout->selected[block_num / 8] & (1 << (block_num % 8));
+}
+
+static void select_eraseblock(const struct erase_layout *const layout, const size_t block_num,
+			      const bool selected)
+{
+	if (selected)
+		layout->selected[block_num / 8] |= 1 << (block_num % 8);
+	else
+		layout->selected[block_num / 8] &= ~(1 << (block_num % 8));
+}
 
-	edata->first_sub_block_index = *sub_block_index;
-	for (; *sub_block_index < sub_layout->block_count; ++*sub_block_index) {
-		if (sub_layout->layout_list[*sub_block_index].end_addr > end_addr)
+/*
+ * Find the next selected block of `layout`, starting at `*block_num`,
+ * that overlaps the region of `info`. Returns false if there is none.
+ */
+static bool next_selected_eraseblock(const struct erase_layout *const layout,
+				     const struct walk_info *const info,
+				     size_t *const block_num, struct eraseblock_data *const eb)
+{
+	const size_t end = MIN(layout->block_count, eraseblock_index(layout, info->region_end) + 1);
+	size_t i = *block_num;
+
+	while (i < end) {
+		/* Skip unselected blocks eight at a time. */
+		if (!layout->selected[i / 8]) {
+			i = i - i % 8 + 8;
+			continue;
+		}
+		if (eraseblock_selected(layout, i))
 			break;
+		++i;
 	}
-	edata->last_sub_block_index = *sub_block_index - 1;
+	if (i >= end)
+		return false;
+
+	*eb = get_eraseblock(layout, i);
+	*block_num = i;
+	return true;
 }
 
 /*
@@ -966,9 +1705,9 @@ static void free_erase_layout(struct erase_layout *layout, unsigned int erasefn_
 	if (!layout)
 		return;
 	for (i = 0; i < erasefn_count; i++) {
-		free(layout[i].layout_list);
+		flashprog_free(layout[i].selected);
 	}
-	free(layout);
+	flashprog_free(layout);
 }
 
 /*
@@ -993,7 +1732,7 @@ static int create_erase_layout(struct flashctx *const flashctx, struct erase_lay
 		return 0;
 	}
 
-	struct erase_layout *layout = calloc(erasefn_count, sizeof(struct erase_layout));
+	struct erase_layout *layout = flashprog_calloc(erasefn_count, sizeof(struct erase_layout));
 	if (!layout) {
 		msg_gerr("Out of memory!\n");
 		return -1;
@@ -1004,34 +1743,32 @@ static int create_erase_layout(struct flashctx *const flashctx, struct erase_lay
 		if (check_block_eraser(flashctx, eraser_idx, 0))
 			continue;
 
-		layout[layout_idx].eraser = &chip->block_erasers[eraser_idx];
-		const size_t block_count = calculate_block_count(&chip->block_erasers[eraser_idx]);
-		size_t sub_block_index = 0;
+		const struct block_eraser *const eraser = &chip->block_erasers[eraser_idx];
+		struct erase_layout *const entry = &layout[layout_idx];
+		chipoff_t start_addr = 0;
+		size_t i;
 
-		layout[layout_idx].block_count = block_count;
-		layout[layout_idx].layout_list = (struct eraseblock_data *)calloc(block_count,
-									sizeof(struct eraseblock_data));
+		entry->eraser = eraser;
+		for (i = 0; i < NUM_ERASEREGIONS; i++) {
+			const struct eraseblock *const block = &eraser->eraseblocks[i];
 
-		if (!layout[layout_idx].layout_list) {
-			free_erase_layout(layout, layout_idx);
-			return -1;
+			if (!block->count)
+				continue;
+			entry->regions[entry->region_count++] = (struct erase_region){
+				.start_addr	= start_addr,
+				.block_size	= block->size,
+				.first_block	= entry->block_count,
+				.block_count	= block->count,
+			};
+			entry->block_count += block->count;
+			start_addr += block->size * block->count;
 		}
 
-		size_t block_num = 0;
-		chipoff_t start_addr = 0;
-
-		int i;
-		for (i = 0; block_num < block_count;  i++) {
-			const struct eraseblock *block = &chip->block_erasers[eraser_idx].eraseblocks[i];
-
-			size_t num;
-			for (num = 0; num < block->count; num++) {
-				chipoff_t end_addr = start_addr + block->size - 1;
-				init_eraseblock(layout, layout_idx, block_num,
-						start_addr, end_addr, &sub_block_index);
-				block_num += 1;
-				start_addr = end_addr + 1;
-			}
+		entry->selected = flashprog_calloc((entry->block_count + 7) / 8, 1);
+		if (!entry->selected) {
+			msg_gerr("Out of memory!\n");
+			free_erase_layout(layout, layout_idx);
+			return -1;
 		}
 		layout_idx++;
 	}
@@ -1040,6 +1777,121 @@ static int create_erase_layout(struct flashctx *const flashctx, struct erase_lay
 	return layout_idx;
 }
 
+/* Returns a bit for each well-defined eraser of a chip. */
+static unsigned int usable_erasers(const struct flashctx *const flash)
+{
+	unsigned int usable = 0;
+	int k;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (!check_block_eraser(flash, k, 0))
+			usable |= 1 << k;
+	}
+	return usable;
+}
+
+void erase_layout_cache_clear(struct flashctx *const flashctx)
+{
+	struct erase_layout_cache *const cache = &flashctx->erase_layout_cache;
+
+	free_erase_layout(cache->layouts, cache->count);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ * Like create_erase_layout(), but the layout is kept in the flash context
+ * and only created again if the chip or its usable erasers changed. The
+ * layout is returned with nothing selected and must not be freed.
+ */
+static int get_erase_layout(struct flashctx *const flashctx, struct erase_layout **const e_layout)
+{
+	struct erase_layout_cache *const cache = &flashctx->erase_layout_cache;
+	const unsigned int usable = usable_erasers(flashctx);
+	int i;
+
+	if (cache->layouts && cache->chip == flashctx->chip && cache->usable == usable &&
+	    !memcmp(cache->erasers, flashctx->chip->block_erasers, sizeof(cache->erasers))) {
+		for (i = 0; i < cache->count; ++i)
+			memset(cache->layouts[i].selected, 0, (cache->layouts[i].block_count + 7) / 8);
+		*e_layout = cache->layouts;
+		return cache->count;
+	}
+
+	erase_layout_cache_clear(flashctx);
+	const int count = create_erase_layout(flashctx, e_layout);
+	if (count <= 0)
+		return count;
+
+	cache->layouts = *e_layout;
+	cache->count = count;
+	cache->chip = flashctx->chip;
+	cache->usable = usable;
+	memcpy(cache->erasers, flashctx->chip->block_erasers, sizeof(cache->erasers));
+	return count;
+}
+
+/*
+ * Rough time estimates in microseconds, used to select erase block sizes.
+ * Chip timings are used if known (e.g. from SFDP), the defaults below
+ * resemble common SPI NOR flash at moderate bus speeds otherwise.
+ */
+#define EST_READ_US_PER_KIB	1000	/* read-back for the erase check, ~8Mbit/s */
+#define EST_PROGRAM_US		700	/* per page program of `EST_PROGRAM_BYTES` */
+#define EST_PROGRAM_BYTES	256
+
+/* The SPI chip erase commands, they erase a single die on stacked-die chips. */
+static bool is_spi_chip_eraser(const struct block_eraser *eraser)
+{
+	return eraser->block_erase == spi_block_erase_60 ||
+	       eraser->block_erase == spi_block_erase_62 ||
+	       eraser->block_erase == spi_block_erase_c7;
+}
+
+static uint64_t estimate_erase_us(const struct flashctx *flashctx,
+				  const struct block_eraser *eraser, const size_t size)
+{
+	const struct spi_timings *const timings = &flashctx->chip->spi_timing;
+	uint64_t erase_us = 30 * 1000 + (uint64_t)size * 2;
+	size_t i;
+
+	if (is_spi_chip_eraser(eraser) && timings->chip_erase.typ_us) {
+		erase_us = timings->chip_erase.typ_us;
+	} else {
+		for (i = 0; i < ARRAY_SIZE(timings->erase); ++i) {
+			if (timings->erase[i].block_size == size && timings->erase[i].timing.typ_us)
+				erase_us = timings->erase[i].timing.typ_us;
+		}
+	}
+
+	return erase_us + (uint64_t)size * EST_READ_US_PER_KIB / 1024;
+}
+
+/* Estimate for programming `size` bytes, without the transfer to the chip. */
+static uint64_t estimate_program_us(const struct flashctx *flashctx, const size_t size)
+{
+	const struct flashchip *const chip = flashctx->chip;
+	unsigned int program_us = EST_PROGRAM_US, program_bytes = EST_PROGRAM_BYTES;
+
+	if (chip->spi_timing.page_program.typ_us && chip->page_size) {
+		program_us = chip->spi_timing.page_program.typ_us;
+		program_bytes = chip->page_size;
+	}
+	return (uint64_t)(size + program_bytes - 1) / program_bytes * program_us;
+}
+
+/* Estimate for re-writing data that was erased along with a bigger block. */
+static uint64_t estimate_rewrite_us(const struct flashctx *flashctx, const struct walk_info *info,
+				    const struct eraseblock_data *block)
+{
+	const size_t size = block->end_addr - block->start_addr + 1;
+
+	if (explicit_erase(info) ||
+	    is_erased(newcontents_at(info, block->start_addr), size, ERASED_VALUE(flashctx)))
+		return 0;
+
+	return estimate_program_us(flashctx, size);
+}
+
 /*
  * @brief	Function to select the list of sectors that need erasing
  *
@@ -1048,47 +1900,71 @@ static int create_erase_layout(struct flashctx *const flashctx, struct erase_lay
  * @param	findex		index of the erase function
  * @param	block_num	index of the block to erase according to the erase function index
  * @param	info		current info from walking the regions
+ * @param	cost		estimated time of the selected erase operations is added here
  * @return number of bytes selected for erase
+ *
+ * For each block, we compare the estimated time to erase the selected
+ * sub-blocks against the time to erase the whole block plus the time
+ * to re-write the contents of sub-blocks that didn't need erasing.
  */
 static size_t select_erase_functions_rec(const struct flashctx *flashctx, const struct erase_layout *layout,
-					 size_t findex, size_t block_num, const struct walk_info *info)
+					 size_t findex, size_t block_num, const struct walk_info *info,
+					 uint64_t *cost)
 {
-	struct eraseblock_data *ll = &layout[findex].layout_list[block_num];
-	const size_t eraseblock_size = ll->end_addr - ll->start_addr + 1;
+	const struct eraseblock_data ll = get_eraseblock(&layout[findex], block_num);
+	const size_t eraseblock_size = ll.end_addr - ll.start_addr + 1;
+	if (ll.start_addr > info->region_end || ll.end_addr < info->region_start)
+		return 0;
 	if (!findex) {
-		if (ll->start_addr <= info->region_end && ll->end_addr >= info->region_start) {
-			if (explicit_erase(info)) {
-				ll->selected = true;
-				return eraseblock_size;
-			}
-			const chipoff_t write_start = MAX(info->region_start, ll->start_addr);
-			const chipoff_t write_end   = MIN(info->region_end, ll->end_addr);
-			const chipsize_t write_len  = write_end - write_start + 1;
-			const uint8_t erased_value  = ERASED_VALUE(flashctx);
-			ll->selected = need_erase(
-				info->curcontents + write_start, info->newcontents + write_start,
-				write_len, flashctx->chip->gran, erased_value);
-			if (ll->selected)
-				return eraseblock_size;
+		if (explicit_erase(info)) {
+			select_eraseblock(&layout[findex], block_num, true);
+			*cost += estimate_erase_us(flashctx, layout[findex].eraser, eraseblock_size);
+			return eraseblock_size;
+		}
+		const chipoff_t write_start = MAX(info->region_start, ll.start_addr);
+		const chipoff_t write_end   = MIN(info->region_end, ll.end_addr);
+		const chipsize_t write_len  = write_end - write_start + 1;
+		const uint8_t erased_value  = ERASED_VALUE(flashctx);
+		if (need_erase(curcontents_at(info, write_start), newcontents_at(info, write_start),
+			       write_len, flashctx->chip->gran, erased_value)) {
+			select_eraseblock(&layout[findex], block_num, true);
+			*cost += estimate_erase_us(flashctx, layout[findex].eraser, eraseblock_size);
+			return eraseblock_size;
 		}
 		return 0;
 	} else {
-		const int sub_block_start = ll->first_sub_block_index;
-		const int sub_block_end = ll->last_sub_block_index;
+		/* Only sub-blocks that overlap the region are of interest. */
+		const struct erase_layout *const sub_layout = &layout[findex - 1];
+		const size_t sub_block_start =
+			eraseblock_index(sub_layout, MAX(ll.start_addr, info->region_start));
+		const size_t sub_block_end =
+			eraseblock_index(sub_layout, MIN(ll.end_addr, info->region_end));
+		uint64_t sub_cost = 0;
 		size_t bytes = 0;
 
-		int j;
+		size_t j;
 		for (j = sub_block_start; j <= sub_block_end; j++)
-			bytes += select_erase_functions_rec(flashctx, layout, findex - 1, j, info);
+			bytes += select_erase_functions_rec(flashctx, layout, findex - 1, j, info, &sub_cost);
+
+		if (bytes && ll.start_addr >= info->region_start && ll.end_addr <= info->region_end) {
+			uint64_t block_cost =
+				estimate_erase_us(flashctx, layout[findex].eraser, eraseblock_size);
+			for (j = sub_block_start; j <= sub_block_end; j++) {
+				if (!eraseblock_selected(sub_layout, j)) {
+					const struct eraseblock_data sub_block = get_eraseblock(sub_layout, j);
+					block_cost += estimate_rewrite_us(flashctx, info, &sub_block);
+				}
+			}
 
-		if (bytes > eraseblock_size / 2) {
-			if (ll->start_addr >= info->region_start && ll->end_addr <= info->region_end) {
+			if (block_cost < sub_cost) {
 				for (j = sub_block_start; j <= sub_block_end; j++)
-					layout[findex - 1].layout_list[j].selected = false;
-				ll->selected = true;
+					select_eraseblock(sub_layout, j, false);
+				select_eraseblock(&layout[findex], block_num, true);
 				bytes = eraseblock_size;
+				sub_cost = block_cost;
 			}
 		}
+		*cost += sub_cost;
 		return bytes;
 	}
 }
@@ -1096,34 +1972,166 @@ static size_t select_erase_functions_rec(const struct flashctx *flashctx, const
 static size_t select_erase_functions(const struct flashctx *flashctx, const struct erase_layout *layout,
 				     size_t erasefn_count, const struct walk_info *info)
 {
+	const struct erase_layout *const top = &layout[erasefn_count - 1];
+	uint64_t cost = 0;
 	size_t bytes = 0;
 	size_t block_num;
-	for (block_num = 0; block_num < layout[erasefn_count - 1].block_count; ++block_num)
-		bytes += select_erase_functions_rec(flashctx, layout, erasefn_count - 1, block_num, info);
+	for (block_num = eraseblock_index(top, info->region_start);
+	     block_num <= eraseblock_index(top, info->region_end); ++block_num)
+		bytes += select_erase_functions_rec(flashctx, layout, erasefn_count - 1, block_num, info, &cost);
+	msg_cdbg2("Selected %zu bytes for erase, estimated to take %"PRIu64" ms.\n", bytes, cost / 1000);
+
+	/* Chip erasers are always the biggest, report if one won. */
+	size_t findex;
+	for (findex = erasefn_count; findex > 0 && is_spi_chip_eraser(layout[findex - 1].eraser); --findex) {
+		const struct erase_layout *const chip_layout = &layout[findex - 1];
+		struct eraseblock_data ll;
+		block_num = eraseblock_index(chip_layout, info->region_start);
+		for (; next_selected_eraseblock(chip_layout, info, &block_num, &ll); ++block_num)
+			msg_cdbg("Chip erase of 0x%06x-0x%06x estimated to be faster than block erases.\n",
+				 ll.start_addr, ll.end_addr);
+	}
 	return bytes;
 }
 
+/*
+ * Return the maximum length of a write that takes a single program
+ * cycle, or 0 if the write function doesn't work in such cycles.
+ * Writing unchanged bytes in between is cheap compared to another
+ * cycle, so write_range() merges everything that fits.
+ */
+static unsigned int max_coalesced_write(const struct flashctx *const flash)
+{
+	const struct flashchip *const chip = flash->chip;
+
+	/* Only then is `flash->mst` the SPI member of the union, cf. get_flash_region(). */
+	if (chip->bustype != BUS_SPI || chip->write != spi_chip_write_256 || !chip->page_size)
+		return 0;
+
+	/* default_spi_write_256() splits pages into chunks of `max_data_write`. */
+	if (flash->mst.spi->write_256 == default_spi_write_256 &&
+	    flash->mst.spi->max_data_write != MAX_DATA_UNSPECIFIED)
+		return min(chip->page_size, flash->mst.spi->max_data_write);
+
+	return chip->page_size;
+}
+
+/* Extend the write at `start` by further writes that fit into the same program cycle. */
+static chipsize_t coalesce_writes(const struct flashctx *const flash, const chipoff_t flash_offset,
+				  const uint8_t *const curcontents, const uint8_t *const newcontents,
+				  const chipsize_t len, const chipoff_t start, chipsize_t write_len,
+				  const unsigned int max_len)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	const chipoff_t page_start = flash_offset + start - (flash_offset + start) % page_size;
+	const chipsize_t limit = min(len, page_start + page_size - flash_offset);
+	chipoff_t next = start + write_len;
+	chipsize_t next_len;
+
+	while (next < limit &&
+	       (next_len = get_next_write(curcontents + next, newcontents + next,
+					  limit - next, &next, flash->chip->gran))) {
+		if (next + next_len - start > max_len)
+			break;
+		write_len = next + next_len - start;
+		next += next_len;
+	}
+
+	return write_len;
+}
+
+/* Count the whole pages between `start` and `end` of a range that stay erased. */
+static unsigned long count_erased_pages(const struct flashctx *const flash, const chipoff_t flash_offset,
+					const uint8_t *const newcontents, const chipoff_t start,
+					const chipoff_t end)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	unsigned long count = 0;
+	chipoff_t page;
+
+	if (!page_size || end - start < page_size)
+		return 0;
+
+	page = (flash_offset + start + page_size - 1) / page_size * page_size - flash_offset;
+	for (; page + page_size <= end; page += page_size) {
+		if (is_erased(newcontents + page, page_size, ERASED_VALUE(flash)))
+			++count;
+	}
+	return count;
+}
+
+/* Writes that don't read back correctly right away are retried this often. */
+#define INLINE_VERIFY_RETRIES	1
+
+/*
+ * Read back what was just written. Reading doesn't count for the progress,
+ * which is accounted for the write.
+ */
+static int verify_written(struct flashctx *const flashctx, const uint8_t *const newcontents,
+			  const chipoff_t start, const chipsize_t len)
+{
+	const struct flashprog_progress progress = flashctx->progress;
+
+	flashctx->progress.callback = NULL;
+	const int ret = verify_range(flashctx, newcontents, start, len);
+	flashctx->progress = progress;
+	return ret;
+}
+
 static int write_range(struct flashctx *const flashctx, const chipoff_t flash_offset,
 		       const uint8_t *const curcontents, const uint8_t *const newcontents,
 		       const chipsize_t len, bool *const skipped)
 {
+	const unsigned int max_coalesced = max_coalesced_write(flashctx);
 	unsigned int writecount = 0;
-	chipoff_t starthere = 0;
+	const size_t progress_base = flashctx->progress.current;
+	chipsize_t written = 0;
+	chipoff_t starthere = 0, gap_start = 0;
 	chipsize_t lenhere = 0;
 
 	while ((lenhere = get_next_write(curcontents + starthere, newcontents + starthere,
 					 len - starthere, &starthere, flashctx->chip->gran))) {
+		if (skipped)
+			flashctx->stats.skipped_erased_pages +=
+				count_erased_pages(flashctx, flash_offset, newcontents, gap_start, starthere);
+		if (max_coalesced)
+			lenhere = coalesce_writes(flashctx, flash_offset, curcontents, newcontents,
+						  len, starthere, lenhere, max_coalesced);
+		if (flashprog_cancelled(flashctx))
+			return 1;
 		if (!writecount++)
 			msg_cdbg("W");
-		if (flashctx->chip->write(flashctx, newcontents + starthere,
-					  flash_offset + starthere, lenhere))
+		read_cache_invalidate(flashctx, flash_offset + starthere, lenhere);
+		unsigned int tries = 0;
+		int ret;
+		do {
+			if (tries)
+				msg_cinfo("Retrying write of 0x%06x-0x%06x.\n", flash_offset + starthere,
+					  flash_offset + starthere + lenhere - 1);
+			ret = flashctx->chip->write(flashctx, newcontents + starthere,
+						    flash_offset + starthere, lenhere);
+			flashprog_event(flashctx, FLASHPROG_EVENT_WRITE, flash_offset + starthere, lenhere, ret);
+			if (!ret && flashctx->verifying_inline)
+				ret = verify_written(flashctx, newcontents + starthere,
+						     flash_offset + starthere, lenhere);
+		} while (ret && flashctx->verifying_inline && tries++ < INLINE_VERIFY_RETRIES);
+		if (ret)
 			return 1;
 		starthere += lenhere;
+		gap_start = starthere;
+		written += lenhere;
 		if (skipped) {
-			flashprog_progress_set(flashctx, starthere);
+			/* The write functions report progress too, override it. */
+			flashprog_progress_set(flashctx, progress_base + starthere);
 			*skipped = false;
 		}
 	}
+	if (skipped) {
+		flashprog_progress_set(flashctx, progress_base + len);
+		flashctx->stats.skipped_bytes += len - written;
+		flashctx->stats.skipped_erased_pages +=
+			count_erased_pages(flashctx, flash_offset, newcontents, gap_start, len);
+	}
 	return 0;
 }
 
@@ -1131,119 +2139,116 @@ typedef int (*erasefn_t)(struct flashctx *, unsigned int addr, unsigned int len)
 /* returns 0 on success, 1 to retry with another erase function, 2 for immediate abort */
 typedef int (*per_blockfn_t)(struct flashctx *, const struct walk_info *, erasefn_t);
 
-static int walk_eraseblocks(struct flashctx *const flashctx,
-			    struct erase_layout *const layouts,
-			    const size_t layout_count,
-			    struct walk_info *const info,
-			    const per_blockfn_t per_blockfn)
+static void flashprog_stats_erased_block(struct flashctx *const flashctx, const unsigned int size)
 {
-	int ret;
-	size_t i, j;
-	bool first = true;
-
-	for (i = 0; i < layout_count; ++i) {
-		const struct erase_layout *const layout = &layouts[i];
-
-		for (j = 0; j < layout->block_count; ++j) {
-			struct eraseblock_data *const eb = &layout->layout_list[j];
+	struct flashprog_stats *const stats = &flashctx->stats;
+	size_t i;
 
-			if (eb->start_addr > info->region_end)
-				break;
-			if (eb->end_addr < info->region_start)
-				continue;
-			if (!eb->selected)
-				continue;
+	for (i = 0; i < ARRAY_SIZE(stats->erased_blocks); ++i) {
+		if (!stats->erased_blocks[i].size)
+			stats->erased_blocks[i].size = size;
+		if (stats->erased_blocks[i].size == size) {
+			++stats->erased_blocks[i].count;
+			return;
+		}
+	}
+}
 
-			/* Print this for every block except the first one. */
-			if (first)
-				first = false;
-			else
-				msg_cdbg(", ");
-			msg_cdbg("0x%06x-0x%06x:", eb->start_addr, eb->end_addr);
+/* Send the erase command for the block given by `info`. */
+static int erase_block_start(struct flashctx *const flashctx,
+			     const struct walk_info *const info, const erasefn_t erasefn)
+{
+	const unsigned int erase_len = info->erase_end + 1 - info->erase_start;
 
-			info->erase_start = eb->start_addr;
-			info->erase_end = eb->end_addr;
-			ret = per_blockfn(flashctx, info, layout->eraser->block_erase);
-			if (ret)
-				return ret;
+	flashctx->all_skipped = false;
 
-			/* Clean the erase layout up for future use on other
-			   regions. `.selected` is the only field we alter. */
-			eb->selected = false;
-		}
+	msg_cdbg("E");
+	read_cache_invalidate(flashctx, info->erase_start, erase_len);
+	if (erasefn(flashctx, info->erase_start, erase_len)) {
+		flashprog_event(flashctx, FLASHPROG_EVENT_ERASE_BLOCK, info->erase_start, erase_len, -1);
+		return 1;
 	}
-	msg_cdbg("\n");
 	return 0;
 }
 
-static int walk_by_layout(struct flashctx *const flashctx, struct walk_info *const info,
-			  const per_blockfn_t per_blockfn)
+/* Check the erased block given by `info` and track its new contents. */
+static int erase_block_finish(struct flashctx *const flashctx, const struct walk_info *const info)
 {
-	const bool do_erase = explicit_erase(info) || !(flashctx->chip->feature_bits & FEATURE_NO_ERASE);
-	const struct flashprog_layout *const layout = get_layout(flashctx);
-	struct erase_layout *erase_layouts = NULL;
-	const struct romentry *entry = NULL;
-	int ret = 0, layout_count = 0;
-
-	all_skipped = true;
-	msg_cinfo("Erasing and writing flash chip... ");
+	const unsigned int erase_len = info->erase_end + 1 - info->erase_start;
 
-	if (do_erase) {
-		layout_count = create_erase_layout(flashctx, &erase_layouts);
-		if (layout_count <= 0)
-			return 1;
+	flashprog_stats_erased_block(flashctx, erase_len);
+	flashprog_progress_add(flashctx, erase_len);
+	if (check_erased_block(flashctx, info->erase_start, erase_len)) {
+		flashprog_event(flashctx, FLASHPROG_EVENT_ERASE_BLOCK, info->erase_start, erase_len, -1);
+		msg_cerr("ERASE FAILED!\n");
+		return 1;
 	}
+	flashprog_event(flashctx, FLASHPROG_EVENT_ERASE_BLOCK, info->erase_start, erase_len, 0);
+	/* Only the part within the current region is tracked in `curcontents`. */
+	const chipoff_t cur_start = MAX(info->erase_start, info->region_start);
+	const chipsize_t cur_len = MIN(info->erase_end, info->region_end) + 1 - cur_start;
+	if (info->curcontents)
+		memset(curcontents_at(info, cur_start), ERASED_VALUE(flashctx), cur_len);
+	return 0;
+}
 
-	while ((entry = layout_next_included(layout, entry))) {
-		info->region_start = entry->start;
-		info->region_end   = entry->end;
+/*
+ * Return `len` bytes of scratch space, growing the buffer if necessary.
+ * The old contents are dropped, so both buffers never exist at once.
+ */
+static uint8_t *get_scratch(struct walk_scratch *const scratch, const size_t len)
+{
+	if (scratch->len < len) {
+		flashprog_free(scratch->buf);
+		scratch->len = 0;
+		scratch->buf = flashprog_malloc(len);
+		if (!scratch->buf) {
+			msg_cerr("Out of memory!\n");
+			return NULL;
+		}
+		scratch->len = len;
+	}
+	return scratch->buf;
+}
 
-		if (do_erase) {
-			const size_t total = select_erase_functions(flashctx, erase_layouts, layout_count, info);
+static void free_scratch(struct walk_scratch *const scratch)
+{
+	flashprog_free(scratch->buf);
+	scratch->buf = NULL;
+	scratch->len = 0;
+}
 
-			/* We verify every erased block manually. Technically that's
-			   reading, but accounting for it as part of the erase helps
-			   to provide a smooth, overall progress. Hence `total * 2`. */
-			flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_ERASE, total * 2);
+/*
+ * Fill `backup_contents` with the current contents of the erase block
+ * given by `info` that lies outside the region. The part within the
+ * region is left erased. If `curcontents` doesn't cover it, the data
+ * on both sides of the region is fetched with a single read.
+ */
+static int backup_eraseblock(struct flashctx *const flashctx, const struct walk_info *const info,
+			     uint8_t *const backup_contents)
+{
+	const unsigned int erase_len = info->erase_end + 1 - info->erase_start;
+	const chipoff_t region_start = MAX(info->region_start, info->erase_start);
+	const chipoff_t region_end = MIN(info->region_end, info->erase_end);
 
-			ret = walk_eraseblocks(flashctx, erase_layouts, layout_count, info, per_blockfn);
-			if (ret) {
-				msg_cerr("FAILED!\n");
-				goto free_ret;
-			}
+	if (info->cur_complete) {
+		memcpy(backup_contents, curcontents_at(info, info->erase_start), erase_len);
+	} else {
+		const chipoff_t start = info->region_start > info->erase_start
+					? info->erase_start : info->region_end + 1;
+		const chipoff_t end = info->erase_end > info->region_end
+				      ? info->erase_end : info->region_start - 1;
 
-			flashprog_progress_finish(flashctx);
-		}
-
-		if (info->newcontents) {
-			bool skipped = true;
-			msg_cdbg("0x%06x-0x%06x:", info->region_start, info->region_end);
-			flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_WRITE,
-						info->region_end - info->region_start + 1);
-			ret = write_range(flashctx, info->region_start,
-					  info->curcontents + info->region_start,
-					  info->newcontents + info->region_start,
-					  info->region_end + 1 - info->region_start, &skipped);
-			if (ret) {
-				msg_cerr("FAILED!\n");
-				goto free_ret;
-			}
-			flashprog_progress_finish(flashctx);
-			if (skipped) {
-				msg_cdbg("S\n");
-			} else {
-				msg_cdbg("\n");
-				all_skipped = false;
-			}
+		msg_cdbg("R");
+		if (read_checked(flashctx, backup_contents + (start - info->erase_start),
+				 start, end + 1 - start)) {
+			msg_cerr("Can't read! Aborting.\n");
+			return 1;
 		}
 	}
-	if (all_skipped)
-		msg_cinfo("\nWarning: Chip content is identical to the requested image.\n");
-	msg_cinfo("Erase/write done.\n");
-
-free_ret:
-	free_erase_layout(erase_layouts, layout_count);
-	return ret;
+	memset(backup_contents + (region_start - info->erase_start),
+	       ERASED_VALUE(flashctx), region_end + 1 - region_start);
+	return 0;
 }
 
 static int erase_block(struct flashctx *const flashctx,
@@ -1253,69 +2258,401 @@ static int erase_block(struct flashctx *const flashctx,
 	const bool region_unaligned = info->region_start > info->erase_start ||
 				      info->erase_end > info->region_end;
 	uint8_t *backup_contents = NULL, *erased_contents = NULL;
-	int ret = 1;
 
 	/*
 	 * If the region is not erase-block aligned, merge current flash con-
-	 * tents into a new buffer `backup_contents`.
+	 * tents into the scratch buffer `backup_contents`.
 	 */
 	if (region_unaligned) {
-		backup_contents = malloc(erase_len);
-		erased_contents = malloc(erase_len);
-		if (!backup_contents || !erased_contents) {
-			msg_cerr("Out of memory!\n");
-			goto _free_ret;
-		}
-		memset(backup_contents, ERASED_VALUE(flashctx), erase_len);
+		backup_contents = get_scratch(info->scratch, 2 * (size_t)erase_len);
+		if (!backup_contents)
+			return 1;
+		erased_contents = backup_contents + erase_len;
 		memset(erased_contents, ERASED_VALUE(flashctx), erase_len);
 
-		msg_cdbg("R");
-		/* Merge data preceding the current region. */
-		if (info->region_start > info->erase_start) {
-			const chipoff_t start	= info->erase_start;
-			const chipsize_t len	= info->region_start - info->erase_start;
-			if (flashctx->chip->read(flashctx, backup_contents, start, len)) {
-				msg_cerr("Can't read! Aborting.\n");
+		if (backup_eraseblock(flashctx, info, backup_contents))
+			return 1;
+	}
+
+	if (erase_block_start(flashctx, info, erasefn) || erase_block_finish(flashctx, info))
+		return 1;
+
+	/* Restore data outside the region, the region itself stays erased. */
+	if (region_unaligned) {
+		if (write_range(flashctx, info->erase_start, erased_contents, backup_contents, erase_len, NULL))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int walk_eraseblocks(struct flashctx *const flashctx,
+			    struct erase_layout *const layouts,
+			    const size_t layout_count,
+			    struct walk_info *const info,
+			    const per_blockfn_t per_blockfn)
+{
+	int ret;
+	size_t i, j;
+	bool first = true;
+
+	for (i = 0; i < layout_count; ++i) {
+		const struct erase_layout *const layout = &layouts[i];
+		struct eraseblock_data eb;
+
+		j = eraseblock_index(layout, info->region_start);
+		for (; next_selected_eraseblock(layout, info, &j, &eb); ++j) {
+			/* Print this for every block except the first one. */
+			if (first)
+				first = false;
+			else
+				msg_cdbg(", ");
+			msg_cdbg("0x%06x-0x%06x:", eb.start_addr, eb.end_addr);
+
+			if (flashprog_cancelled(flashctx))
+				return 2;
+
+			info->erase_start = eb.start_addr;
+			info->erase_end = eb.end_addr;
+			ret = per_blockfn(flashctx, info, layout->eraser->block_erase);
+			if (ret)
+				return ret;
+
+			/* Clean the erase layout up for future use on other
+			   regions. The selection is the only thing we alter. */
+			select_eraseblock(layout, j, false);
+		}
+	}
+	msg_cdbg("\n");
+	return 0;
+}
+
+/* A selected erase block, queued to be erased out of layout order. */
+struct queued_block {
+	struct eraseblock_data eb;
+	const struct erase_layout *layout;
+	erasefn_t erasefn;
+};
+
+/*
+ * Stacked-die chips erase on all dies at once. So we visit their selected
+ * blocks round robin: an erase is posted on every die before the first of
+ * them is waited for and checked. Blocks that stick out of the region are
+ * left to `per_blockfn`, as it has to restore their surroundings.
+ */
+static int walk_eraseblocks_dies(struct flashctx *const flashctx,
+				 struct erase_layout *const layouts,
+				 const size_t layout_count,
+				 struct walk_info *const info,
+				 const per_blockfn_t per_blockfn)
+{
+	const unsigned int dies = spi_die_count(flashctx);
+	const chipsize_t die_size = spi_die_size(flashctx);
+	struct queued_block *queue[MAX_DIES] = { NULL };
+	size_t count[MAX_DIES] = { 0 }, queued[MAX_DIES] = { 0 }, next[MAX_DIES] = { 0 };
+	bool first = true;
+	unsigned int die, pass;
+	size_t i, j;
+	int ret = 0;
+
+	/* Count the selected blocks per die first, then queue them. */
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < layout_count; ++i) {
+			const struct erase_layout *const layout = &layouts[i];
+			struct eraseblock_data eb;
+
+			j = eraseblock_index(layout, info->region_start);
+			for (; next_selected_eraseblock(layout, info, &j, &eb); ++j) {
+				die = eb.start_addr / die_size;
+				if (pass)
+					queue[die][queued[die]++] =
+						(struct queued_block){ eb, layout, layout->eraser->block_erase };
+				else
+					++count[die];
+			}
+		}
+		for (die = 0; !pass && die < dies; ++die) {
+			if (count[die] && !(queue[die] = flashprog_malloc(count[die] * sizeof(*queue[die])))) {
+				msg_gerr("Out of memory!\n");
+				ret = 1;
+				goto _free_ret;
+			}
+		}
+	}
+
+	while (true) {
+		bool posted[MAX_DIES] = { false };
+		bool any = false;
+
+		for (die = 0; die < dies; ++die) {
+			if (next[die] == queued[die])
+				continue;
+			const struct queued_block *const block = &queue[die][next[die]++];
+			any = true;
+
+			/* Print this for every block except the first one. */
+			if (first)
+				first = false;
+			else
+				msg_cdbg(", ");
+			msg_cdbg("0x%06x-0x%06x:", block->eb.start_addr, block->eb.end_addr);
+
+			if (flashprog_cancelled(flashctx)) {
+				ret = 2;
 				goto _free_ret;
 			}
+
+			info->erase_start = block->eb.start_addr;
+			info->erase_end = block->eb.end_addr;
+			if (info->erase_start < info->region_start || info->erase_end > info->region_end ||
+			    info->erase_end / die_size != die) {
+				ret = per_blockfn(flashctx, info, block->erasefn);
+				select_eraseblock(block->layout, block->eb.block_num, false);
+			} else {
+				flashctx->die.post = true;
+				ret = erase_block_start(flashctx, info, block->erasefn);
+				flashctx->die.post = false;
+				posted[die] = true;
+			}
+			if (ret)
+				goto _free_ret;
 		}
-		/* Merge data following the current region. */
-		if (info->erase_end > info->region_end) {
-			const chipoff_t start     = info->region_end + 1;
-			const chipoff_t rel_start = start - info->erase_start; /* within this erase block */
-			const chipsize_t len      = info->erase_end - info->region_end;
-			if (flashctx->chip->read(flashctx, backup_contents + rel_start, start, len)) {
-				msg_cerr("Can't read! Aborting.\n");
+		if (!any)
+			break;
+
+		for (die = 0; die < dies; ++die) {
+			if (!posted[die])
+				continue;
+			const struct queued_block *const block = &queue[die][next[die] - 1];
+
+			info->erase_start = block->eb.start_addr;
+			info->erase_end = block->eb.end_addr;
+			if (spi_select_die(flashctx, die)) {
+				flashprog_event(flashctx, FLASHPROG_EVENT_ERASE_BLOCK, info->erase_start,
+						info->erase_end + 1 - info->erase_start, -1);
+				msg_cerr("ERASE FAILED!\n");
+				ret = 1;
 				goto _free_ret;
 			}
+			ret = erase_block_finish(flashctx, info);
+			if (ret)
+				goto _free_ret;
+			select_eraseblock(block->layout, block->eb.block_num, false);
 		}
 	}
+	msg_cdbg("\n");
+
+_free_ret:
+	if (spi_wait_dies(flashctx) && !ret)
+		ret = 1;
+	for (die = 0; die < dies; ++die)
+		flashprog_free(queue[die]);
+	return ret;
+}
 
-	all_skipped = false;
+/* Erases queued with an opaque master before we wait for them. */
+#define ERASE_QUEUE_LEN		16
 
-	msg_cdbg("E");
-	if (erasefn(flashctx, info->erase_start, erase_len))
-		goto _free_ret;
-	flashprog_progress_add(flashctx, erase_len);
-	if (check_erased_range(flashctx, info->erase_start, erase_len)) {
+/* Wait for the queued erases and check the erased blocks. */
+static int flush_erase_queue(struct flashctx *const flashctx, struct walk_info *const info,
+			     const struct queued_block queue[], size_t *const queued)
+{
+	const int flush_ret = erase_flush_opaque(flashctx);
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < *queued; ++i) {
+		info->erase_start = queue[i].eb.start_addr;
+		info->erase_end = queue[i].eb.end_addr;
+		if (flush_ret || ret) {
+			flashprog_event(flashctx, FLASHPROG_EVENT_ERASE_BLOCK, info->erase_start,
+					info->erase_end + 1 - info->erase_start, -1);
+			continue;
+		}
+		if (erase_block_finish(flashctx, info)) {
+			ret = 1;
+			continue;
+		}
+		select_eraseblock(queue[i].layout, queue[i].eb.block_num, false);
+	}
+	if (flush_ret) {
 		msg_cerr("ERASE FAILED!\n");
-		goto _free_ret;
+		ret = 1;
 	}
-	if (info->curcontents)
-		memset(info->curcontents + info->erase_start, ERASED_VALUE(flashctx), erase_len);
+	*queued = 0;
+	return ret;
+}
 
-	if (region_unaligned) {
-		if (write_range(flashctx, info->erase_start, erased_contents, backup_contents, erase_len, NULL))
-			goto _free_ret;
-		if (info->curcontents)
-			memcpy(info->curcontents + info->erase_start, backup_contents, erase_len);
+/*
+ * Opaque masters may run erases in the background or in bulk. So we
+ * queue the selected blocks and check them only when the master has
+ * finished them all. Blocks that stick out of the region are left to
+ * `per_blockfn`, as it has to restore their surroundings.
+ */
+static int walk_eraseblocks_queued(struct flashctx *const flashctx,
+				   struct erase_layout *const layouts,
+				   const size_t layout_count,
+				   struct walk_info *const info,
+				   const per_blockfn_t per_blockfn)
+{
+	struct queued_block queue[ERASE_QUEUE_LEN];
+	size_t queued = 0;
+	bool first = true;
+	size_t i, j;
+	int ret = 0;
+
+	for (i = 0; i < layout_count && !ret; ++i) {
+		const struct erase_layout *const layout = &layouts[i];
+		struct eraseblock_data eb;
+
+		j = eraseblock_index(layout, info->region_start);
+		for (; !ret && next_selected_eraseblock(layout, info, &j, &eb); ++j) {
+			/* Print this for every block except the first one. */
+			if (first)
+				first = false;
+			else
+				msg_cdbg(", ");
+			msg_cdbg("0x%06x-0x%06x:", eb.start_addr, eb.end_addr);
+
+			if (flashprog_cancelled(flashctx)) {
+				ret = 2;
+				break;
+			}
+
+			info->erase_start = eb.start_addr;
+			info->erase_end = eb.end_addr;
+			if (info->erase_start < info->region_start || info->erase_end > info->region_end ||
+			    layout->eraser->block_erase != erase_opaque) {
+				if (queued)
+					ret = flush_erase_queue(flashctx, info, queue, &queued);
+				if (!ret) {
+					info->erase_start = eb.start_addr;
+					info->erase_end = eb.end_addr;
+					ret = per_blockfn(flashctx, info, layout->eraser->block_erase);
+				}
+				if (!ret)
+					select_eraseblock(layout, j, false);
+				continue;
+			}
+
+			ret = erase_block_start(flashctx, info, erase_queue_opaque);
+			if (ret)
+				break;
+			queue[queued++] = (struct queued_block){ eb, layout, erase_queue_opaque };
+			if (queued == ERASE_QUEUE_LEN)
+				ret = flush_erase_queue(flashctx, info, queue, &queued);
+		}
 	}
 
-	ret = 0;
+	/* Never leave erases running, even if we failed. */
+	if (queued) {
+		const int flush_ret = flush_erase_queue(flashctx, info, queue, &queued);
+		if (!ret)
+			ret = flush_ret;
+	}
+	if (!ret)
+		msg_cdbg("\n");
+	return ret;
+}
 
-_free_ret:
-	free(erased_contents);
-	free(backup_contents);
+/* Erase and write the region described by `info`. */
+static int walk_region(struct flashctx *const flashctx, struct walk_info *const info,
+		       struct erase_layout *const erase_layouts, const int layout_count,
+		       const per_blockfn_t per_blockfn)
+{
+	int ret;
+
+	if (layout_count) {
+		const size_t total = select_erase_functions(flashctx, erase_layouts, layout_count, info);
+
+		/* We verify every erased block manually. Technically that's
+		   reading, but accounting for it as part of the erase helps
+		   to provide a smooth, overall progress. Hence `total * 2`. */
+		flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_ERASE, total * 2);
+
+		if (spi_die_count(flashctx) > 1)
+			ret = walk_eraseblocks_dies(flashctx, erase_layouts, layout_count, info, per_blockfn);
+		else if (opaque_can_queue_erase(flashctx))
+			ret = walk_eraseblocks_queued(flashctx, erase_layouts, layout_count, info, per_blockfn);
+		else
+			ret = walk_eraseblocks(flashctx, erase_layouts, layout_count, info, per_blockfn);
+		if (ret) {
+			msg_cerr("FAILED!\n");
+			return ret;
+		}
+
+		flashprog_progress_finish(flashctx);
+	}
+
+	if (info->newcontents) {
+		bool skipped = true;
+		msg_cdbg("0x%06x-0x%06x:", info->region_start, info->region_end);
+		flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_WRITE,
+					info->region_end - info->region_start + 1);
+		ret = write_range(flashctx, info->region_start,
+				  curcontents_at(info, info->region_start),
+				  newcontents_at(info, info->region_start),
+				  info->region_end + 1 - info->region_start, &skipped);
+		if (ret) {
+			msg_cerr("FAILED!\n");
+			return ret;
+		}
+		/* Keep `curcontents` in sync for erase blocks shared with later regions. */
+		memcpy(curcontents_at(info, info->region_start), newcontents_at(info, info->region_start),
+		       info->region_end + 1 - info->region_start);
+		flashprog_progress_finish(flashctx);
+		if (skipped) {
+			msg_cdbg("S\n");
+			flashprog_event(flashctx, FLASHPROG_EVENT_SKIP, info->region_start,
+					info->region_end + 1 - info->region_start, 0);
+		} else {
+			msg_cdbg("\n");
+			flashctx->all_skipped = false;
+		}
+	}
+	return 0;
+}
+
+static int walk_by_layout(struct flashctx *const flashctx, struct walk_info *const info,
+			  const per_blockfn_t per_blockfn)
+{
+	const bool do_erase = explicit_erase(info) || !(flashctx->chip->feature_bits & FEATURE_NO_ERASE);
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	struct erase_layout *erase_layouts = NULL;
+	struct walk_scratch scratch = { 0 };
+	chipoff_t start = 0, end;
+	int ret = 0, layout_count = 0;
+
+	flashctx->all_skipped = true;
+	info->scratch = &scratch;
+	msg_cinfo("Erasing and writing flash chip... ");
+
+	if (do_erase) {
+		layout_count = get_erase_layout(flashctx, &erase_layouts);
+		if (layout_count <= 0)
+			return 1;
+	}
+
+	/* Adjacent regions are handled together, so erase blocks
+	   that they share are only backed up and erased once. */
+	while (accessible_next_included_span(flashctx, layout, start, &start, &end)) {
+		info->region_start = start;
+		info->region_end   = end;
+
+		ret = walk_region(flashctx, info, erase_layouts, layout_count, per_blockfn);
+		if (ret)
+			goto free_ret;
+
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+	if (flashctx->all_skipped)
+		msg_cinfo("\nWarning: Chip content is identical to the requested image.\n");
+	msg_cinfo("Erase/write done.\n");
+
+free_ret:
+	free_scratch(&scratch);
 	return ret;
 }
 
@@ -1343,375 +2680,2263 @@ static int erase_by_layout(struct flashctx *const flashctx)
  *
  * @param flashctx    Flash context to be used.
  * @param curcontents A buffer of full chip size with current chip contents of included regions.
+ * @param cur_complete Whether `curcontents` holds the current contents of the whole chip.
  * @param newcontents The new image to be written.
  * @return 0 on success,
  *	   1 if anything has gone wrong.
  */
-static int write_by_layout(struct flashctx *const flashctx,
-			   void *const curcontents, const void *const newcontents)
+static int write_by_layout(struct flashctx *const flashctx, void *const curcontents,
+			   const bool cur_complete, const void *const newcontents)
 {
-	struct walk_info info;
+	struct walk_info info = { 0 };
 	info.curcontents = curcontents;
+	info.cur_offset = 0;
+	info.cur_complete = cur_complete;
 	info.newcontents = newcontents;
 	return walk_by_layout(flashctx, &info, erase_block);
 }
 
-/**
- * @brief Compares the included layout regions with content from a buffer.
- *
- * If there is no layout set in the given flash context, the whole chip's
- * contents will be compared.
- *
- * @param flashctx    Flash context to be used.
- * @param layout      Flash layout information.
- * @param curcontents A buffer of full chip size to read current chip contents into.
- * @param newcontents The new image to compare to.
- * @return 0 on success,
- *	   1 if reading failed,
- *	   3 if the contents don't match.
+/*
+ * To verify the whole chip, we keep SHA-256 hashes, per KEPT_BLOCK_SIZE
+ * block, of the old contents that are not included in the layout, and
+ * of the whole old chip, instead of a copy of the old contents. The
+ * latter tells us after a failed write if anything has changed.
  */
-static int verify_by_layout(
-		struct flashctx *const flashctx,
-		const struct flashprog_layout *const layout,
-		void *const curcontents, const uint8_t *const newcontents)
-{
-	const struct romentry *entry = NULL;
+#define KEPT_BLOCK_SIZE	(4 * KiB)
 
-	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_READ, layout);
+struct kept_hashes {
+	uint8_t chip[SHA256_DIGEST_LEN];
+	uint8_t (*blocks)[SHA256_DIGEST_LEN];
+};
+
+/* State of one chip written by write_by_layout_multi(). */
+struct write_lane {
+	struct flashctx *flashctx;
+	struct walk_info info;
+	struct walk_scratch scratch;
+	struct kept_hashes kept;	/* only to verify the whole chip */
+	struct erase_layout *erase_layouts;
+	int layout_count;
+	bool protected_differs;		/* verify even if nothing was written */
+	bool in_region;			/* `info` describes the current region */
+	bool finished;
+	chipoff_t written;		/* the region is written below this offset */
+	struct queued_block *blocks;	/* selected erase blocks of the region, by address */
+	size_t block_count, next_block;
+	const struct queued_block *posted;	/* erase that is still running */
+	unsigned int posted_die;
+	unsigned long posted_seq;
+};
 
-	while ((entry = layout_next_included(layout, entry))) {
-		const chipoff_t region_start	= entry->start;
-		const chipsize_t region_len	= entry->end - entry->start + 1;
+static int compare_queued_blocks(const void *const a, const void *const b)
+{
+	const struct queued_block *const qa = a, *const qb = b;
+	if (qa->eb.start_addr == qb->eb.start_addr)
+		return 0;
+	return qa->eb.start_addr < qb->eb.start_addr ? -1 : 1;
+}
 
-		if (flashctx->chip->read(flashctx, curcontents + region_start, region_start, region_len))
+/* Queue the erase blocks selected for the region of `lane` in address order. */
+static int lane_queue_blocks(struct write_lane *const lane)
+{
+	const struct walk_info *const info = &lane->info;
+	size_t i, j, count = 0;
+	int pass;
+
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < (size_t)lane->layout_count; ++i) {
+			const struct erase_layout *const layout = &lane->erase_layouts[i];
+			struct eraseblock_data eb;
+
+			j = eraseblock_index(layout, info->region_start);
+			for (; next_selected_eraseblock(layout, info, &j, &eb); ++j) {
+				if (pass)
+					lane->blocks[lane->block_count++] =
+						(struct queued_block){ eb, layout, layout->eraser->block_erase };
+				else
+					++count;
+			}
+		}
+		if (!pass && count && !(lane->blocks = flashprog_malloc(count * sizeof(*lane->blocks)))) {
+			msg_gerr("Out of memory!\n");
 			return 1;
-		if (compare_range(newcontents + region_start, curcontents + region_start,
-				  region_start, region_len))
-			return 3;
+		}
 	}
-
-	flashprog_progress_finish(flashctx);
-
+	if (lane->block_count)
+		qsort(lane->blocks, lane->block_count, sizeof(*lane->blocks), compare_queued_blocks);
 	return 0;
 }
 
-static void nonfatal_help_message(void)
+/* Write the part of the current region of `lane` below `end`. */
+static int lane_write_until(struct write_lane *const lane, const chipoff_t end)
 {
-	msg_gerr("Good, writing to the flash chip apparently didn't do anything.\n");
-#if CONFIG_INTERNAL == 1
-	if (programmer == &programmer_internal)
-		msg_gerr("This means we have to add special support for your board, programmer or flash\n"
-			 "chip. Please report this to the mailing list at flashprog@flashprog.org or\n"
-			 "on IRC (see https://www.flashprog.org/Contact for details), thanks!\n"
-			 "-------------------------------------------------------------------------------\n"
-			 "You may now reboot or simply leave the machine running.\n");
-	else
-#endif
-		msg_gerr("Please check the connections (especially those to write protection pins) between\n"
-			 "the programmer and the flash chip. If you think the error is caused by flashprog\n"
-			 "please report this to the mailing list at flashprog@flashprog.org or on IRC\n"
-			 "(see https://www.flashprog.org/Contact for details), thanks!\n");
+	const struct walk_info *const info = &lane->info;
+	bool skipped = true;
+
+	if (end <= lane->written)
+		return 0;
+	if (write_range(lane->flashctx, lane->written, curcontents_at(info, lane->written),
+			newcontents_at(info, lane->written), end - lane->written, &skipped))
+		return 1;
+	memcpy(curcontents_at(info, lane->written), newcontents_at(info, lane->written), end - lane->written);
+	if (!skipped)
+		lane->flashctx->all_skipped = false;
+	lane->written = end;
+	return 0;
 }
 
-void emergency_help_message(void)
+/* Start the next region of `lane`, or finish it if there is none. */
+static int lane_next_region(struct write_lane *const lane)
 {
-	msg_gerr("Your flash chip is in an unknown state.\n");
-#if CONFIG_INTERNAL == 1
-	if (programmer == &programmer_internal)
-		msg_gerr("Get help on IRC (see https://www.flashprog.org/Contact) or mail\n"
-			"flashprog@flashprog.org with the subject \"FAILED: <your board name>\"!\n"
-			"-------------------------------------------------------------------------------\n"
-			"DO NOT REBOOT OR POWEROFF!\n");
-	else
-#endif
-		msg_gerr("Please report this to the mailing list at flashprog@flashprog.org\n"
-			 "or on IRC (see https://www.flashprog.org/Contact for details), thanks!\n");
+	struct flashctx *const flashctx = lane->flashctx;
+	struct walk_info *const info = &lane->info;
+	chipoff_t start = 0, end;
+
+	if (lane->in_region) {
+		flashprog_progress_finish(flashctx);
+		flashprog_free(lane->blocks);
+		lane->blocks = NULL;
+		lane->block_count = lane->next_block = 0;
+		lane->in_region = false;
+		start = info->region_end + 1;
+		if (start == 0) {
+			lane->finished = true;
+			return 0;
+		}
+	}
+	if (!accessible_next_included_span(flashctx, get_layout(flashctx), start, &start, &end)) {
+		lane->finished = true;
+		return 0;
+	}
+
+	info->region_start = start;
+	info->region_end = end;
+	lane->written = start;
+	lane->in_region = true;
+	size_t erase_total = 0;
+	if (lane->layout_count) {
+		erase_total = select_erase_functions(flashctx, lane->erase_layouts, lane->layout_count, info);
+		if (lane_queue_blocks(lane))
+			return 1;
+	}
+	/* Erases are accounted for twice, as in walk_region(), for the erase check. */
+	flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_WRITE, end + 1 - start + erase_total * 2);
+	return 0;
 }
 
-void list_programmers_linebreak(int startcol, int cols, int paren)
+/*
+ * Let `lane` work until it posted an erase, or is done with all its
+ * regions. Erase blocks are written right after they were erased, and
+ * the parts of a region that need no erase before the next erase block.
+ * Blocks that stick out of the region are handled synchronously by
+ * erase_block(), as it has to restore their surroundings.
+ */
+static int lane_run(struct write_lane *const lane)
 {
-	const char *pname;
-	int pnamelen;
-	int remaining = 0, firstline = 1;
-	size_t p;
-	int i;
+	struct flashctx *const flashctx = lane->flashctx;
+	struct walk_info *const info = &lane->info;
 
-	for (p = 0; p < programmer_table_size; p++) {
-		pname = programmer_table[p]->name;
-		pnamelen = strlen(pname);
-		if (remaining - pnamelen - 2 < 0) {
-			if (firstline)
-				firstline = 0;
-			else
-				msg_ginfo("\n");
-			for (i = 0; i < startcol; i++)
-				msg_ginfo(" ");
-			remaining = cols - startcol;
-		} else {
-			msg_ginfo(" ");
-			remaining--;
-		}
-		if (paren && (p == 0)) {
-			msg_ginfo("(");
-			remaining--;
+	if (lane->posted) {
+		const struct queued_block *const block = lane->posted;
+		const struct eraseblock_data *const eb = &block->eb;
+
+		lane->posted = NULL;
+		info->erase_start = eb->start_addr;
+		info->erase_end = eb->end_addr;
+		if (erase_block_finish(flashctx, info))
+			return 1;
+		select_eraseblock(block->layout, eb->block_num, false);
+		if (lane_write_until(lane, eb->end_addr + 1))
+			return 1;
+	}
+
+	while (!lane->finished) {
+		if (!lane->in_region || lane->next_block == lane->block_count) {
+			if (lane->in_region && lane_write_until(lane, info->region_end + 1))
+				return 1;
+			if (lane_next_region(lane))
+				return 1;
+			continue;
 		}
-		msg_ginfo("%s", pname);
-		remaining -= pnamelen;
-		if (p < programmer_table_size - 1) {
-			msg_ginfo(",");
-			remaining--;
-		} else {
-			if (paren)
-				msg_ginfo(")");
+
+		const struct queued_block *const block = &lane->blocks[lane->next_block++];
+		const struct eraseblock_data *const eb = &block->eb;
+
+		if (flashprog_cancelled(flashctx))
+			return 2;
+		msg_cdbg("%u:0x%06x-0x%06x:", flashctx->chip_select, eb->start_addr, eb->end_addr);
+
+		info->erase_start = eb->start_addr;
+		info->erase_end = eb->end_addr;
+		if (eb->start_addr < info->region_start || eb->end_addr > info->region_end) {
+			if (lane_write_until(lane, eb->start_addr) || erase_block(flashctx, info, block->erasefn))
+				return 1;
+			select_eraseblock(block->layout, eb->block_num, false);
+			if (lane_write_until(lane, MIN(eb->end_addr, info->region_end) + 1))
+				return 1;
+			continue;
 		}
+
+		const unsigned int dies = spi_die_count(flashctx);
+		if (lane_write_until(lane, eb->start_addr))
+			return 1;
+		flashctx->die.post = true;
+		const int ret = erase_block_start(flashctx, info, block->erasefn);
+		flashctx->die.post = false;
+		if (ret)
+			return 1;
+		lane->posted = block;
+		lane->posted_die = dies > 1 ? eb->start_addr / spi_die_size(flashctx) : 0;
+		return 0;
 	}
+	return 0;
 }
 
-int selfcheck(void)
+/*
+ * Erase and write several chips at once. Whenever a chip is busy with an
+ * erase, the others get their turn, so one is erased while another is
+ * programmed. Only when all chips wait for an erase, we wait for the one
+ * that started first.
+ */
+static int write_by_layout_multi(struct write_lane *const lanes, const size_t count)
 {
-	unsigned int i;
+	unsigned long seq = 0;
+	size_t i, finished = 0;
 	int ret = 0;
 
-	for (i = 0; i < programmer_table_size; i++) {
-		const struct programmer_entry *const p = programmer_table[i];
-		if (p == NULL) {
-			msg_gerr("Programmer with index %d is NULL instead of a valid pointer!\n", i);
-			ret = 1;
-			continue;
-		}
-		if (p->name == NULL) {
-			msg_gerr("All programmers need a valid name, but the one with index %d does not!\n", i);
-			ret = 1;
-			/* This might hide other problems with this programmer, but allows for better error
-			 * messages below without jumping through hoops. */
-			continue;
-		}
-		switch (p->type) {
-		case USB:
-		case PCI:
-		case OTHER:
-			if (p->devs.note == NULL) {
-				if (strcmp("internal", p->name) == 0)
-					break; /* This one has its device list stored separately. */
-				msg_gerr("Programmer %s has neither a device list nor a textual description!\n",
-					 p->name);
+	msg_cinfo("Erasing and writing %zu flash chips... ", count);
+	for (i = 0; i < count; ++i) {
+		struct flashctx *const flashctx = lanes[i].flashctx;
+
+		flashctx->all_skipped = true;
+		if (!(flashctx->chip->feature_bits & FEATURE_NO_ERASE)) {
+			lanes[i].layout_count = get_erase_layout(flashctx, &lanes[i].erase_layouts);
+			if (lanes[i].layout_count <= 0) {
+				lanes[i].layout_count = 0;
 				ret = 1;
+				goto _free_ret;
 			}
-			break;
-		default:
-			msg_gerr("Programmer %s does not have a valid type set!\n", p->name);
-			ret = 1;
-			break;
-		}
-		if (p->init == NULL) {
-			msg_gerr("Programmer %s does not have a valid init function!\n", p->name);
-			ret = 1;
+			/* A chip erase would leave nothing to interleave with the other chips. */
+			while (lanes[i].layout_count > 1 &&
+			       lanes[i].erase_layouts[lanes[i].layout_count - 1].block_count == 1)
+				--lanes[i].layout_count;
 		}
 	}
 
-	/* It would be favorable if we could check for the correct layout (especially termination) of various
-	 * constant arrays: flashchips, chipset_enables, board_matches, boards_known, laptops_known.
-	 * They are all defined as externs in this compilation unit so we don't know their sizes which vary
-	 * depending on compiler flags, e.g. the target architecture, and can sometimes be 0.
-	 * For 'flashchips' we export the size explicitly to work around this and to be able to implement the
-	 * checks below. */
-	if (flashchips_size <= 1 || flashchips[flashchips_size - 1].name != NULL) {
-		msg_gerr("Flashchips table miscompilation!\n");
-		ret = 1;
-	} else {
-		for (i = 0; i < flashchips_size - 1; i++) {
-			const struct flashchip *chip = &flashchips[i];
-			if (chip->vendor == NULL || chip->name == NULL || chip->bustype == BUS_NONE) {
-				ret = 1;
-				msg_gerr("ERROR: Some field of flash chip #%d (%s) is misconfigured.\n"
-					 "Please report a bug at flashprog@flashprog.org\n", i,
-					 chip->name == NULL ? "unnamed" : chip->name);
-			}
-			if (selfcheck_eraseblocks(chip)) {
-				ret = 1;
+	while (finished < count) {
+		struct write_lane *oldest = NULL;
+
+		for (i = 0; i < count; ++i) {
+			struct write_lane *const lane = &lanes[i];
+
+			if (lane->finished)
+				continue;
+			if (lane->posted) {
+				const int busy = spi_die_busy(lane->flashctx, lane->posted_die);
+				if (busy > 0) {
+					if (!oldest || lane->posted_seq < oldest->posted_seq)
+						oldest = lane;
+					continue;
+				}
+				if (busy < 0)
+					goto _erase_failed;
 			}
+			ret = lane_run(lane);
+			if (ret)
+				goto _failed;
+			lane->posted_seq = seq++;
+			finished += lane->finished;
 		}
+
+		/* Every chip that isn't done waits for an erase now. */
+		if (oldest && spi_select_die(oldest->flashctx, oldest->posted_die)) {
+			i = oldest - lanes;
+			goto _erase_failed;
+		}
+	}
+	msg_cinfo("Erase/write done.\n");
+	goto _free_ret;
+
+_erase_failed:
+	flashprog_event(lanes[i].flashctx, FLASHPROG_EVENT_ERASE_BLOCK, lanes[i].posted->eb.start_addr,
+			lanes[i].posted->eb.end_addr + 1 - lanes[i].posted->eb.start_addr, -1);
+	msg_cerr("ERASE FAILED!\n");
+	ret = 1;
+_failed:
+	msg_cerr("FAILED on chip select %u!\n", lanes[i].flashctx->chip_select);
+_free_ret:
+	for (i = 0; i < count; ++i) {
+		if (spi_wait_dies(lanes[i].flashctx) && !ret)
+			ret = 1;
+		flashprog_free(lanes[i].blocks);
+		lanes[i].blocks = NULL;
+		free_scratch(&lanes[i].scratch);
 	}
+	return ret;
+}
 
-#if CONFIG_INTERNAL == 1
-	ret |= selfcheck_board_enables();
-#endif
+/* Granularity of streamed writes if there are no erase blocks to follow. */
+#define STREAM_CHUNK_SIZE	(64 * KiB)
 
-	/* TODO: implement similar sanity checks for other arrays where deemed necessary. */
-	return ret;
+static chipsize_t max_eraseblock_size(const struct erase_layout *const layout)
+{
+	chipsize_t size = 0;
+	size_t i;
+
+	for (i = 0; i < layout->region_count; ++i)
+		size = MAX(size, layout->regions[i].block_size);
+	return size;
 }
 
-/* FIXME: This function signature needs to be improved once prepare_flash_access()
- * has a better function signature.
+/*
+ * Streamed writes work on blocks of the biggest eraser that doesn't
+ * erase the whole chip. Drop the layouts above it, a chip erase would
+ * require the whole chip contents at once.
  */
-static int chip_safety_check(const struct flashctx *flash, int force,
-			     int read_it, int write_it, int erase_it, int verify_it)
+static int stream_layout_count(const struct flashctx *const flashctx,
+			       const struct erase_layout *const layouts, int layout_count)
 {
-	const struct flashchip *chip = flash->chip;
+	const chipsize_t flash_size = flashctx->chip->total_size * 1024;
 
-	if (!programmer_may_write && (write_it || erase_it)) {
-		msg_perr("Write/erase is not working yet on your programmer in "
-			 "its current configuration.\n");
-		/* --force is the wrong approach, but it's the best we can do
-		 * until the generic programmer parameter parser is merged.
-		 */
-		if (!force)
-			return 1;
-		msg_cerr("Continuing anyway.\n");
-	}
+	while (layout_count > 1 && max_eraseblock_size(&layouts[layout_count - 1]) >= flash_size)
+		--layout_count;
+	return layout_count;
+}
 
-	if (read_it || erase_it || write_it || verify_it) {
-		/* Everything needs read. */
-		if (chip->tested.read == BAD) {
-			msg_cerr("Read is not working on this chip. ");
-			if (!force)
-				return 1;
-			msg_cerr("Continuing anyway.\n");
-		}
-		if (!chip->read) {
-			msg_cerr("flashprog has no read function for this "
-				 "flash chip.\n");
-			return 1;
-		}
+/* Point `info` to the new contents of its region, gathered into `gather` if they span several vectors. */
+static int stream_new_contents(struct walk_info *const info, const struct flashprog_iovec *iov,
+			       uint8_t **const gather, const chipsize_t gather_size)
+{
+	const chipsize_t len = info->region_end + 1 - info->region_start;
+	size_t skip = info->region_start, done;
+
+	for (; skip >= iov->len; ++iov)
+		skip -= iov->len;
+
+	info->new_offset = info->region_start;
+	if (iov->len - skip >= len) {
+		info->newcontents = (const uint8_t *)iov->base + skip;
+		return 0;
 	}
-	if (erase_it || write_it) {
-		/* Write needs erase. */
-		if (chip->tested.erase == NA) {
-			msg_cerr("Erase is not possible on this chip.\n");
-			return 1;
-		}
-		if (chip->tested.erase == BAD) {
-			msg_cerr("Erase is not working on this chip. ");
-			if (!force)
-				return 1;
-			msg_cerr("Continuing anyway.\n");
-		}
-		if(count_usable_erasers(flash) == 0) {
-			msg_cerr("flashprog has no erase function for this "
-				 "flash chip.\n");
+
+	if (!*gather) {
+		*gather = flashprog_malloc(gather_size);
+		if (!*gather) {
+			msg_gerr("Out of memory!\n");
 			return 1;
 		}
 	}
-	if (write_it) {
-		if (chip->tested.write == NA) {
-			msg_cerr("Write is not possible on this chip.\n");
-			return 1;
-		}
-		if (chip->tested.write == BAD) {
-			msg_cerr("Write is not working on this chip. ");
-			if (!force)
-				return 1;
-			msg_cerr("Continuing anyway.\n");
-		}
-		if (!chip->write) {
-			msg_cerr("flashprog has no write function for this "
-				 "flash chip.\n");
-			return 1;
-		}
+	for (done = 0; done < len; ++iov, skip = 0) {
+		const size_t n = MIN(iov->len - skip, len - done);
+		memcpy(*gather + done, (const uint8_t *)iov->base + skip, n);
+		done += n;
 	}
+	info->newcontents = *gather;
 	return 0;
 }
 
-int prepare_flash_access(struct flashctx *const flash,
-			 const bool read_it, const bool write_it,
-			 const bool erase_it, const bool verify_it)
+/* Read, erase, write and optionally verify the part of a region given by `info`. */
+static int write_chunk_streamed(struct flashctx *const flashctx, struct walk_info *const info,
+				struct erase_layout *const erase_layouts, const int layout_count,
+				const bool verify)
 {
-	if (chip_safety_check(flash, flash->flags.force, read_it, write_it, erase_it, verify_it)) {
-		msg_cerr("Aborting.\n");
-		return 1;
+	const chipsize_t len = info->region_end + 1 - info->region_start;
+	const struct flashprog_progress progress = flashctx->progress;
+	const bool skipped_before = flashctx->all_skipped;
+	int ret;
+
+	/* Progress is reported for the whole layout, not for each step. */
+	flashctx->progress.callback = NULL;
+
+	if (read_checked(flashctx, info->curcontents, info->region_start, len)) {
+		msg_cerr("Can't read! Aborting.\n");
+		ret = 1;
+		goto _restore_progress;
+	}
+
+	flashctx->all_skipped = true;
+	ret = walk_region(flashctx, info, erase_layouts, layout_count, erase_block);
+	if (!ret && verify && !flashctx->all_skipped) {
+		if (verify_range(flashctx, newcontents_at(info, info->region_start), info->region_start, len))
+			ret = 3;
+	}
+	flashctx->all_skipped = flashctx->all_skipped && skipped_before;
+
+_restore_progress:
+	flashctx->progress = progress;
+	flashprog_progress_add(flashctx, len);
+	return ret;
+}
+
+/* The image of flashprog_image_write_loading() that is still being loaded. */
+struct image_source {
+	flashprog_image_wait *wait;
+	void *user_data;
+};
+
+/* Wait until the first `len` bytes of the image are available. */
+static int image_wait(const struct image_source *const src, const size_t len)
+{
+	if (!src || !src->wait(len, src->user_data))
+		return 0;
+	msg_cerr("Loading the image failed, aborting.\n");
+	return 1;
+}
+
+/*
+ * Compares the write-protected ranges that write_by_layout_streamed()
+ * left out, chunk by chunk. Returns 0 if they match the image, 3 if
+ * they don't and 1 on failure.
+ */
+static int verify_write_protected_streamed(struct flashctx *const flashctx, struct walk_info *const info,
+					   const struct flashprog_iovec *const iov, uint8_t **const gather,
+					   const chipsize_t chunk_size, const struct image_source *const src)
+{
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	struct flash_region region;
+	chipoff_t start = 0, end;
+	int ret = 0;
+
+	while (readable_next_included_span(flashctx, layout, start, &start, &end)) {
+		get_flash_region(flashctx, start, &region);
+		for (info->region_start = start; region.write_prot; info->region_start = info->region_end + 1) {
+			info->region_end = end - info->region_start < chunk_size
+					   ? end : info->region_start + chunk_size - 1;
+			const chipsize_t len = info->region_end + 1 - info->region_start;
+
+			if (image_wait(src, info->region_end + 1) || stream_new_contents(info, iov, gather, chunk_size))
+				return 1;
+			if (read_checked(flashctx, info->curcontents, info->region_start, len))
+				return 1;
+			if (memcmp(info->curcontents, info->newcontents, len)) {
+				warn_write_protected(start, end);
+				ret = 3;
+				break;
+			}
+			if (info->region_end == end)
+				break;
+		}
+
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+	return ret;
+}
+
+/**
+ * @brief Writes the included layout regions block by block.
+ *
+ * Unlike write_by_layout(), this doesn't need the current contents of the
+ * whole chip. Each erase block is read, erased and written if necessary,
+ * and verified right away if requested. Only included layout regions are
+ * verified.
+ *
+ * The new image is given as vectors that are concatenated, so it never
+ * has to exist as a whole. Only blocks that span several vectors are
+ * gathered into a buffer of the block size.
+ *
+ * @param flashctx    Flash context to be used.
+ * @param iov         The new image to be written, at least the chip's size.
+ * @param verify      Whether to verify each written block.
+ * @param src         If not NULL, wait for the image to be loaded up to each block.
+ * @return 0 on success,
+ *	   1 if reading, erasing or writing failed,
+ *	   3 if verification failed,
+ *	   -1 if loading the image failed before anything was changed.
+ */
+static int write_by_layout_streamed(struct flashctx *const flashctx, const struct flashprog_iovec *const iov,
+				    const bool verify, const struct image_source *const src)
+{
+	const bool do_erase = !(flashctx->chip->feature_bits & FEATURE_NO_ERASE);
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	struct erase_layout *erase_layouts = NULL;
+	chipoff_t span_start = 0, span_end;
+	chipsize_t chunk_size = STREAM_CHUNK_SIZE;
+	int ret = 1, created = 0, layout_count = 0;
+	struct walk_scratch scratch = { 0 };
+	struct walk_info info = { 0 };
+	uint8_t *gather = NULL;
+
+	if (do_erase) {
+		created = get_erase_layout(flashctx, &erase_layouts);
+		if (created <= 0)
+			return 1;
+		layout_count = stream_layout_count(flashctx, erase_layouts, created);
+		chunk_size = max_eraseblock_size(&erase_layouts[layout_count - 1]);
+	}
+
+	info.scratch = &scratch;
+	info.curcontents = flashprog_malloc(chunk_size);
+	if (!info.curcontents) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+
+	flashctx->all_skipped = true;
+	msg_cinfo("Erasing and writing flash chip... ");
+	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_WRITE, layout);
+
+	while (accessible_next_included_span(flashctx, layout, span_start, &span_start, &span_end)) {
+		chipoff_t start;
+
+		for (start = span_start; start <= span_end; start = info.region_end + 1) {
+			info.region_start = start;
+			if (layout_count) {
+				const struct erase_layout *const top = &erase_layouts[layout_count - 1];
+				const struct eraseblock_data eb = get_eraseblock(top, eraseblock_index(top, start));
+				info.region_end = MIN(span_end, eb.end_addr);
+			} else {
+				info.region_end = MIN(span_end, start - start % chunk_size + chunk_size - 1);
+			}
+			info.cur_offset = start;
+
+			if (image_wait(src, info.region_end + 1)) {
+				ret = flashctx->all_skipped ? -1 : 1;
+				goto _free_ret;
+			}
+			ret = stream_new_contents(&info, iov, &gather, chunk_size);
+			if (ret)
+				goto _free_ret;
+			ret = write_chunk_streamed(flashctx, &info, erase_layouts, layout_count, verify);
+			if (ret)
+				goto _free_ret;
+			if (info.region_end + 1 == 0)
+				break;
+		}
+
+		span_start = span_end + 1;
+		if (span_start == 0)
+			break;
+	}
+	flashprog_progress_finish(flashctx);
+
+	ret = 0;
+	if (verify) {
+		ret = verify_write_protected_streamed(flashctx, &info, iov, &gather, chunk_size, src);
+		if (ret)
+			goto _free_ret;
+	}
+
+	if (flashctx->all_skipped)
+		msg_cinfo("\nWarning: Chip content is identical to the requested image.\n");
+	msg_cinfo("Erase/write done.\n");
+	if (verify && !flashctx->all_skipped)
+		msg_cinfo("Written blocks VERIFIED.\n");
+
+_free_ret:
+	free_scratch(&scratch);
+	flashprog_free(gather);
+	flashprog_free(info.curcontents);
+	return ret;
+}
+
+/*
+ * Regions are read back in chunks of this size, each compared (and hashed)
+ * while it's still in the CPU cache. Mismatches are reported per chunk.
+ */
+#define VERIFY_CHUNK_SIZE	(256 * KiB)
+
+/* Read a region in chunks and compare it, returns 0 on success, 1 if reading failed, -1 on mismatch. */
+/* If `chunked`, `curcontents` only holds one chunk and is reused for each. */
+static int verify_region_by_reading(struct flashctx *const flashctx, uint8_t *const curcontents,
+				    const bool chunked, const uint8_t *const newcontents, const chipoff_t start,
+				    const chipsize_t len, struct sha256_ctx *const hash)
+{
+	chipsize_t pos, chunk;
+	int ret = 0;
+
+	for (pos = 0; pos < len; pos += chunk) {
+		uint8_t *const cur = chunked ? curcontents : curcontents + pos;
+
+		chunk = MIN(VERIFY_CHUNK_SIZE, len - pos);
+		if (read_checked(flashctx, cur, start + pos, chunk))
+			return 1;
+		if (compare_range(newcontents + pos, cur, start + pos, chunk))
+			ret = -1;
+		if (hash)
+			sha256_update(hash, cur, chunk);
+	}
+	return ret;
+}
+
+/**
+ * @brief Compares the included layout regions with content from a buffer.
+ *
+ * If there is no layout set in the given flash context, the whole chip's
+ * contents will be compared.
+ *
+ * @param flashctx    Flash context to be used.
+ * @param layout      Flash layout information.
+ * @param curcontents A buffer of full chip size to read current chip contents into.
+ * @param chunked     If set, `curcontents` is only VERIFY_CHUNK_SIZE large
+ *                    and holds nothing useful afterwards.
+ * @param newcontents The new image to compare to.
+ * @param hash        If not NULL, all included regions are read back (even
+ *                    if the programmer could calculate checksums) and
+ *                    hashed in address order, also after a mismatch.
+ * @return 0 on success,
+ *	   1 if reading failed,
+ *	   3 if the contents don't match.
+ */
+static int verify_by_layout(
+		struct flashctx *const flashctx,
+		const struct flashprog_layout *const layout,
+		uint8_t *const curcontents, const bool chunked, const uint8_t *const newcontents,
+		struct sha256_ctx *const hash)
+{
+	chipoff_t region_start = 0, region_end;
+	bool mismatch = false;
+
+	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_READ, layout);
+
+	for (; readable_next_included_span(flashctx, layout, region_start, &region_start, &region_end);
+	     region_start = region_end + 1) {
+		const chipsize_t region_len = region_end - region_start + 1;
+
+		int ret = hash ? 1 : verify_range_by_checksum(flashctx, newcontents + region_start,
+							      region_start, region_len);
+		if (ret > 0) {
+			ret = verify_region_by_reading(flashctx,
+						       chunked ? curcontents : curcontents + region_start, chunked,
+						       newcontents + region_start, region_start,
+						       region_len, hash);
+			if (ret > 0) {
+				flashprog_event(flashctx, FLASHPROG_EVENT_VERIFY, region_start, region_len, -1);
+				return 1;
+			}
+		}
+		flashprog_event(flashctx, FLASHPROG_EVENT_VERIFY, region_start, region_len, ret);
+		if (ret && !hash)
+			return 3;
+		if (ret)
+			mismatch = true;
+
+		if (region_end + 1 == 0)
+			break;
+	}
+
+	flashprog_progress_finish(flashctx);
+
+	return mismatch ? 3 : 0;
+}
+
+/* Find the next span in [where, last] that is not included in the layout. */
+static bool next_kept_span(const struct flashprog_layout *const layout, chipoff_t where, const chipoff_t last,
+			   chipoff_t *const start, chipoff_t *const end)
+{
+	chipoff_t inc_start, inc_end;
+
+	while (where <= last) {
+		if (!layout_next_included_span(layout, where, &inc_start, &inc_end) || inc_start > last) {
+			*start = where;
+			*end = last;
+			return true;
+		}
+		if (inc_start > where) {
+			*start = where;
+			*end = inc_start - 1;
+			return true;
+		}
+		if (inc_end >= last)
+			break;
+		where = inc_end + 1;
+	}
+	return false;
+}
+
+/* Hash the bytes of a block that aren't included, returns false if there are none. */
+static bool hash_kept_block(const struct flashprog_layout *const layout, const uint8_t *const contents,
+			    const chipoff_t block_start, const chipoff_t block_end, uint8_t digest[SHA256_DIGEST_LEN])
+{
+	struct sha256_ctx ctx;
+	chipoff_t start, end, pos;
+	bool kept = false;
+
+	sha256_init(&ctx);
+	for (pos = block_start; next_kept_span(layout, pos, block_end, &start, &end); pos = end + 1) {
+		sha256_update(&ctx, contents + start, end - start + 1);
+		kept = true;
+		if (end == block_end)
+			break;
+	}
+	sha256_final(&ctx, digest);
+	return kept;
+}
+
+static int kept_hashes_init(const struct flashctx *const flashctx, struct kept_hashes *const kept,
+			    const uint8_t *const oldcontents)
+{
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	const chipsize_t flash_size = flashctx->chip->total_size * 1024;
+	const size_t count = (flash_size + KEPT_BLOCK_SIZE - 1) / KEPT_BLOCK_SIZE;
+	struct sha256_ctx ctx;
+	size_t i;
+
+	kept->blocks = flashprog_malloc(count * sizeof(*kept->blocks));
+	if (!kept->blocks) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, oldcontents, flash_size);
+	sha256_final(&ctx, kept->chip);
+
+	for (i = 0; i < count; ++i) {
+		const chipoff_t start = i * KEPT_BLOCK_SIZE;
+		const chipoff_t end = MIN(start + KEPT_BLOCK_SIZE, flash_size) - 1;
+		hash_kept_block(layout, oldcontents, start, end, kept->blocks[i]);
+	}
+	return 0;
+}
+
+/* Check if `curcontents` of the whole chip match the old contents. */
+static bool kept_chip_unchanged(const struct flashctx *const flashctx, const struct kept_hashes *const kept,
+				const uint8_t *const curcontents)
+{
+	uint8_t digest[SHA256_DIGEST_LEN];
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, curcontents, flashctx->chip->total_size * 1024);
+	sha256_final(&ctx, digest);
+	return !memcmp(digest, kept->chip, sizeof(digest));
+}
+
+/*
+ * Read the areas that are not included in the layout back into
+ * `curcontents` and compare their hashes.
+ *
+ * @return 0 on success,
+ *	   1 if reading failed,
+ *	   3 if the contents don't match.
+ */
+static int verify_kept_areas(struct flashctx *const flashctx, const struct kept_hashes *const kept,
+			     uint8_t *const curcontents)
+{
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	const chipoff_t last = flashctx->chip->total_size * 1024 - 1;
+	uint8_t digest[SHA256_DIGEST_LEN];
+	chipoff_t start, end, pos;
+	chipsize_t kept_size = 0;
+	unsigned int mismatches = 0;
+	size_t i;
+
+	for (pos = 0; next_kept_span(layout, pos, last, &start, &end); pos = end + 1) {
+		kept_size += end - start + 1;
+		if (end == last)
+			break;
+	}
+	if (!kept_size)
+		return 0;
+
+	flashprog_progress_start(flashctx, FLASHPROG_PROGRESS_READ, kept_size);
+	for (pos = 0; next_kept_span(layout, pos, last, &start, &end); pos = end + 1) {
+		if (read_checked(flashctx, curcontents + start, start, end - start + 1)) {
+			msg_gerr("Verification impossible because read failed "
+				 "at 0x%x (len 0x%x)\n", start, end - start + 1);
+			flashprog_event(flashctx, FLASHPROG_EVENT_VERIFY, start, end - start + 1, -1);
+			return 1;
+		}
+		if (end == last)
+			break;
+	}
+	flashprog_progress_finish(flashctx);
+
+	for (i = 0, pos = 0; pos <= last; ++i, pos += KEPT_BLOCK_SIZE) {
+		end = MIN(pos + KEPT_BLOCK_SIZE - 1, last);
+		if (!hash_kept_block(layout, curcontents, pos, end, digest))
+			continue;
+
+		const bool match = !memcmp(digest, kept->blocks[i], sizeof(digest));
+		if (!match && !mismatches++)
+			msg_cerr("FAILED, data outside the written regions changed at 0x%08x-0x%08x!",
+				 pos, end);
+		flashprog_event(flashctx, FLASHPROG_EVENT_VERIFY, pos, end - pos + 1, match ? 0 : -1);
+	}
+	if (mismatches) {
+		msg_cerr(" changed blocks: %u\n", mismatches);
+		return 3;
+	}
+	return 0;
+}
+
+static void nonfatal_help_message(const struct flashctx *const flash)
+{
+	msg_gerr("Good, writing to the flash chip apparently didn't do anything.\n");
+#if CONFIG_INTERNAL == 1
+	if (flash->prog->driver == &programmer_internal)
+		msg_gerr("This means we have to add special support for your board, programmer or flash\n"
+			 "chip. Please report this to the mailing list at flashprog@flashprog.org or\n"
+			 "on IRC (see https://www.flashprog.org/Contact for details), thanks!\n"
+			 "-------------------------------------------------------------------------------\n"
+			 "You may now reboot or simply leave the machine running.\n");
+	else
+#endif
+		msg_gerr("Please check the connections (especially those to write protection pins) between\n"
+			 "the programmer and the flash chip. If you think the error is caused by flashprog\n"
+			 "please report this to the mailing list at flashprog@flashprog.org or on IRC\n"
+			 "(see https://www.flashprog.org/Contact for details), thanks!\n");
+}
+
+void emergency_help_message(const struct flashctx *const flash)
+{
+	msg_gerr("Your flash chip is in an unknown state.\n");
+#if CONFIG_INTERNAL == 1
+	if (flash->prog->driver == &programmer_internal)
+		msg_gerr("Get help on IRC (see https://www.flashprog.org/Contact) or mail\n"
+			"flashprog@flashprog.org with the subject \"FAILED: <your board name>\"!\n"
+			"-------------------------------------------------------------------------------\n"
+			"DO NOT REBOOT OR POWEROFF!\n");
+	else
+#endif
+		msg_gerr("Please report this to the mailing list at flashprog@flashprog.org\n"
+			 "or on IRC (see https://www.flashprog.org/Contact for details), thanks!\n");
+}
+
+void list_programmers_linebreak(int startcol, int cols, int paren)
+{
+	const char *pname;
+	int pnamelen;
+	int remaining = 0, firstline = 1;
+	size_t p;
+	int i;
+
+	for (p = 0; p < programmer_table_size; p++) {
+		pname = programmer_table[p]->name;
+		pnamelen = strlen(pname);
+		if (remaining - pnamelen - 2 < 0) {
+			if (firstline)
+				firstline = 0;
+			else
+				msg_ginfo("\n");
+			for (i = 0; i < startcol; i++)
+				msg_ginfo(" ");
+			remaining = cols - startcol;
+		} else {
+			msg_ginfo(" ");
+			remaining--;
+		}
+		if (paren && (p == 0)) {
+			msg_ginfo("(");
+			remaining--;
+		}
+		msg_ginfo("%s", pname);
+		remaining -= pnamelen;
+		if (p < programmer_table_size - 1) {
+			msg_ginfo(",");
+			remaining--;
+		} else {
+			if (paren)
+				msg_ginfo(")");
+		}
+	}
+}
+
+int selfcheck(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < programmer_table_size; i++) {
+		const struct programmer_entry *const p = programmer_table[i];
+		if (p == NULL) {
+			msg_gerr("Programmer with index %d is NULL instead of a valid pointer!\n", i);
+			ret = 1;
+			continue;
+		}
+		if (p->name == NULL) {
+			msg_gerr("All programmers need a valid name, but the one with index %d does not!\n", i);
+			ret = 1;
+			/* This might hide other problems with this programmer, but allows for better error
+			 * messages below without jumping through hoops. */
+			continue;
+		}
+		switch (p->type) {
+		case USB:
+		case PCI:
+		case OTHER:
+			if (p->devs.note == NULL) {
+				if (strcmp("internal", p->name) == 0)
+					break; /* This one has its device list stored separately. */
+				msg_gerr("Programmer %s has neither a device list nor a textual description!\n",
+					 p->name);
+				ret = 1;
+			}
+			break;
+		default:
+			msg_gerr("Programmer %s does not have a valid type set!\n", p->name);
+			ret = 1;
+			break;
+		}
+		if (p->init == NULL) {
+			msg_gerr("Programmer %s does not have a valid init function!\n", p->name);
+			ret = 1;
+		}
+	}
+
+	/* It would be favorable if we could check for the correct layout (especially termination) of various
+	 * constant arrays: flashchips, chipset_enables, board_matches, boards_known, laptops_known.
+	 * They are all defined as externs in this compilation unit so we don't know their sizes which vary
+	 * depending on compiler flags, e.g. the target architecture, and can sometimes be 0.
+	 * For 'flashchips' we export the size explicitly to work around this and to be able to implement the
+	 * checks below. */
+	if (flashchips_size <= 1 || flashchips[flashchips_size - 1].name != NULL) {
+		msg_gerr("Flashchips table miscompilation!\n");
+		ret = 1;
+	} else {
+		for (i = 0; i < flashchips_size - 1; i++) {
+			const struct flashchip *chip = &flashchips[i];
+			if (chip->vendor == NULL || chip->name == NULL || chip->bustype == BUS_NONE) {
+				ret = 1;
+				msg_gerr("ERROR: Some field of flash chip #%d (%s) is misconfigured.\n"
+					 "Please report a bug at flashprog@flashprog.org\n", i,
+					 chip->name == NULL ? "unnamed" : chip->name);
+			}
+			if (selfcheck_eraseblocks(chip)) {
+				ret = 1;
+			}
+		}
+	}
+
+#if CONFIG_INTERNAL == 1
+	ret |= selfcheck_board_enables();
+#endif
+
+	/* TODO: implement similar sanity checks for other arrays where deemed necessary. */
+	return ret;
+}
+
+/* FIXME: This function signature needs to be improved once prepare_flash_access()
+ * has a better function signature.
+ */
+static int chip_safety_check(const struct flashctx *flash, int force,
+			     int read_it, int write_it, int erase_it, int verify_it)
+{
+	const struct flashchip *chip = flash->chip;
+
+	if (!flash->prog->may_write && (write_it || erase_it)) {
+		msg_perr("Write/erase is not working yet on your programmer in "
+			 "its current configuration.\n");
+		/* --force is the wrong approach, but it's the best we can do
+		 * until the generic programmer parameter parser is merged.
+		 */
+		if (!force)
+			return 1;
+		msg_cerr("Continuing anyway.\n");
+	}
+
+	if (read_it || erase_it || write_it || verify_it) {
+		/* Everything needs read. */
+		if (chip->tested.read == BAD) {
+			msg_cerr("Read is not working on this chip. ");
+			if (!force)
+				return 1;
+			msg_cerr("Continuing anyway.\n");
+		}
+		if (!chip->read) {
+			msg_cerr("flashprog has no read function for this "
+				 "flash chip.\n");
+			return 1;
+		}
+	}
+	if (erase_it || write_it) {
+		/* Write needs erase. */
+		if (chip->tested.erase == NA) {
+			msg_cerr("Erase is not possible on this chip.\n");
+			return 1;
+		}
+		if (chip->tested.erase == BAD) {
+			msg_cerr("Erase is not working on this chip. ");
+			if (!force)
+				return 1;
+			msg_cerr("Continuing anyway.\n");
+		}
+		if(count_usable_erasers(flash) == 0) {
+			msg_cerr("flashprog has no erase function for this "
+				 "flash chip.\n");
+			return 1;
+		}
+	}
+	if (write_it) {
+		if (chip->tested.write == NA) {
+			msg_cerr("Write is not possible on this chip.\n");
+			return 1;
+		}
+		if (chip->tested.write == BAD) {
+			msg_cerr("Write is not working on this chip. ");
+			if (!force)
+				return 1;
+			msg_cerr("Continuing anyway.\n");
+		}
+		if (!chip->write) {
+			msg_cerr("flashprog has no write function for this "
+				 "flash chip.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int prepare_flash_access(struct flashctx *const flash,
+			 const bool read_it, const bool write_it,
+			 const bool erase_it, const bool verify_it)
+{
+	if (chip_safety_check(flash, flash->flags.force, read_it, write_it, erase_it, verify_it)) {
+		msg_cerr("Aborting.\n");
+		return 1;
+	}
+
+	if (layout_sanity_checks(flash, write_it)) {
+		msg_cerr("Requested regions can not be handled. Aborting.\n");
+		return 1;
+	}
+
+	if (flash->chip->prepare_access && flash->chip->prepare_access(flash, PREPARE_FULL))
+		return 1;
+
+	flash->skip_write_protected = write_it || erase_it;
+
+	/* The address mode is settled now, so SPI commands can be set up once. */
+	if (flash->chip->bustype == BUS_SPI)
+		spi_prepare_ops(flash);
+
+	/* Initialize chip_restore_fn_count before chip unlock calls. */
+	flash->chip_restore_fn_count = 0;
+
+	/* The lock status matters only for erasing and writing, keep reads lean. */
+	if ((write_it || erase_it) && flash->chip->printlock)
+		flash->chip->printlock(flash);
+
+	/* Given the existence of read locks, we want to unlock for read,
+	   erase and write. SPI flash knows no read locks, though, and
+	   unlocking it would change its write protection. */
+	if (flash->chip->unlock && (write_it || erase_it || flash->chip->bustype != BUS_SPI))
+		flash->chip->unlock(flash);
+
+	/* Bulk transfers are faster in QPI mode, if the chip and master support it. */
+	if (flash->chip->bustype == BUS_SPI)
+		spi_prepare_qpi(flash);
+
+	return 0;
+}
+
+/* Print the lock status of a probed chip, as far as the chip driver knows it. */
+void print_lock_status(struct flashctx *const flash)
+{
+	if (!flash->chip->printlock)
+		return;
+	if (flash->chip->prepare_access && flash->chip->prepare_access(flash, PREPARE_PROBE))
+		return;
+	flash->chip->printlock(flash);
+	if (flash->chip->finish_access)
+		flash->chip->finish_access(flash);
+}
+
+void finalize_flash_access(struct flashctx *const flash)
+{
+	/* Always return to single I/O, the restore functions rely on it. */
+	if (flash->chip->bustype == BUS_SPI)
+		spi_exit_qpi(flash);
+	deregister_chip_restore(flash);
+	if (flash->chip->finish_access)
+		flash->chip->finish_access(flash);
+	flash->spi_ops.program_valid = flash->spi_ops.read_valid = false;
+}
+
+/**
+ * @addtogroup flashprog-flash
+ * @{
+ */
+
+/**
+ * @brief Erase the specified ROM chip.
+ *
+ * If a layout is set in the given flash context, only included regions
+ * will be erased.
+ *
+ * @param flashctx The context of the flash chip to erase.
+ * @return 0 on success.
+ */
+int flashprog_flash_erase(struct flashctx *const flashctx)
+{
+	if (prepare_flash_access(flashctx, false, false, true, false))
+		return 1;
+
+	const int ret = erase_by_layout(flashctx);
+
+	finalize_flash_access(flashctx);
+
+	return ret;
+}
+
+/** @} */ /* end flashprog-flash */
+
+/**
+ * @defgroup flashprog-ops Operations
+ * @{
+ */
+
+/**
+ * @brief Read the current image from the specified ROM chip.
+ *
+ * If a layout is set in the specified flash context, only included regions
+ * will be read.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param buffer Target buffer to write image to.
+ * @param buffer_len Size of target buffer in bytes.
+ * @return 0 on success,
+ *         2 if buffer_len is too short for the flash chip's contents,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_read(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+
+	if (flash_size > buffer_len)
+		return 2;
+
+	if (prepare_flash_access(flashctx, true, false, false, false))
+		return 1;
+
+	msg_cinfo("Reading flash... ");
+
+	int ret = 1;
+	if (read_by_layout(flashctx, buffer)) {
+		msg_cerr("Read operation failed!\n");
+		msg_cinfo("FAILED.\n");
+		goto _finalize_ret;
+	}
+	msg_cinfo("done.\n");
+	ret = 0;
+
+_finalize_ret:
+	finalize_flash_access(flashctx);
+	return ret;
+}
+
+/**
+ * @brief Read the current image from the specified ROM chip in chunks.
+ *
+ * Like flashprog_image_read(), but without a buffer of the chip's size.
+ * The included regions are read in chunks of at most 64KiB that are
+ * passed to `sink` in ascending address order, so the data can be
+ * processed while the rest is still being read. Overlapping regions
+ * are only read once, gaps between included regions are not reported.
+ *
+ * @param flashctx  The context of the flash chip.
+ * @param sink      Called for every chunk with its data, its offset in
+ *                  the flash chip and its length. Returning non-zero
+ *                  aborts the read.
+ * @param user_data Passed to `sink`.
+ * @return 0 on success,
+ *         2 if `sink` failed,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_read_stream(struct flashctx *const flashctx, flashprog_read_sink *const sink,
+				void *const user_data)
+{
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	const struct romentry *included;
+	chipoff_t start = 0;
+	int ret = 1;
+
+	uint8_t *const buf = flashprog_malloc(STREAM_CHUNK_SIZE);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	if (prepare_flash_access(flashctx, true, false, false, false))
+		goto _free_ret;
+
+	msg_cinfo("Reading flash... ");
+	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_READ, layout);
+
+	while ((included = layout_next_included_region(layout, start))) {
+		chipoff_t addr = max(start, included->start);
+		while (addr <= included->end) {
+			const chipsize_t len = min(STREAM_CHUNK_SIZE, included->end - addr + 1);
+
+			if (read_checked(flashctx, buf, addr, len)) {
+				msg_cerr("Read operation failed!\n");
+				msg_cinfo("FAILED.\n");
+				goto _finalize_ret;
+			}
+			if (sink(buf, addr, len, user_data)) {
+				msg_cinfo("FAILED.\n");
+				ret = 2;
+				goto _finalize_ret;
+			}
+			addr += len;
+			if (addr == 0)
+				break;
+		}
+		start = included->end + 1;
+		if (start == 0)
+			break;
+	}
+
+	flashprog_progress_finish(flashctx);
+	msg_cinfo("done.\n");
+	ret = 0;
+
+_finalize_ret:
+	finalize_flash_access(flashctx);
+_free_ret:
+	flashprog_free(buf);
+	return ret;
+}
+
+static int sha256_sink(const void *const data, const size_t offset, const size_t len, void *const user_data)
+{
+	sha256_update(user_data, data, len);
+	return 0;
+}
+
+/**
+ * @brief Calculate the SHA-256 of the ROM chip's contents.
+ *
+ * The contents are read with flashprog_image_read_stream(), so no buffer
+ * of the chip's size is needed. If a layout is set, only the included
+ * regions are hashed, in ascending address order.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param[out] digest The SHA-256, set on success.
+ * @return 0 on success,
+ *         or 1 on failure.
+ */
+int flashprog_image_sha256(struct flashctx *const flashctx, unsigned char digest[32])
+{
+	struct sha256_ctx hash;
+
+	sha256_init(&hash);
+	if (flashprog_image_read_stream(flashctx, sha256_sink, &hash))
+		return 1;
+	sha256_final(&hash, digest);
+	return 0;
+}
+
+/* Only images for the internal programmer are checked against the board. */
+static bool board_image_check(const struct flashctx *const flash)
+{
+#if CONFIG_INTERNAL == 1
+	return flash->prog->driver == &programmer_internal;
+#else
+	return false;
+#endif
+}
+
+/* Check that an image for the internal programmer fits the board. */
+static int check_board_image(const struct flashctx *const flashctx, const uint8_t *const newcontents)
+{
+#if CONFIG_INTERNAL == 1
+	if (board_image_check(flashctx) &&
+	    cb_check_image(newcontents, flashctx->chip->total_size * 1024) < 0) {
+		if (flashctx->flags.force_boardmismatch) {
+			msg_pinfo("Proceeding anyway because user forced us to.\n");
+		} else {
+			msg_perr("Aborting. You can override this with "
+				 "-p internal:boardmismatch=force.\n");
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Read the whole chip to be able to check whether regions need to be
+ * erased and to give better diagnostics in case write fails.
+ * The alternative is to read only the regions which are to be
+ * preserved, but in that case we might perform unneeded erase which
+ * takes time as well.
+ *
+ * If `whole_chip` is set, the whole chip is read regardless of the layout.
+ */
+static int read_old_contents(struct flashctx *const flashctx, uint8_t *const curcontents, const bool whole_chip)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+
+	msg_cinfo("Reading old flash chip contents... ");
+	if (whole_chip) {
+		if (flashprog_read_range(flashctx, curcontents, 0, flash_size)) {
+			msg_cinfo("FAILED.\n");
+			return 1;
+		}
+	} else {
+		if (read_by_layout(flashctx, curcontents)) {
+			msg_cinfo("FAILED.\n");
+			return 1;
+		}
+	}
+	msg_cinfo("done.\n");
+	return 0;
+}
+
+/*
+ * Work around chips which need some time to calm down. Parallel, LPC
+ * and FWH chips always get the pause, SPI chips only if flagged.
+ */
+#define SETTLE_DELAY_US	(1000 * 1000)
+
+static bool needs_settle_delay(const struct flashctx *const flashctx)
+{
+	return flashctx->chip->feature_bits & FEATURE_SETTLE_DELAY || flashctx->chip->bustype & BUS_NONSPI;
+}
+
+static void settle_before_verify(const struct flashctx *const flashctx)
+{
+	if (needs_settle_delay(flashctx))
+		programmer_delay(flashctx, SETTLE_DELAY_US);
+}
+
+static int image_write_streamed(struct flashctx *const flashctx, const struct flashprog_iovec *const iov,
+				const bool verify, const struct image_source *const src)
+{
+	int ret;
+
+	if (prepare_flash_access(flashctx, false, true, false, verify))
+		return 1;
+
+	ret = write_by_layout_streamed(flashctx, iov, verify, src);
+	if (ret == 1) {
+		msg_cerr("Uh oh. Erase/write failed.\n");
+		ret = 2;
+	}
+	if (ret > 0)
+		emergency_help_message(flashctx);
+	else if (ret < 0)
+		ret = 1;
+
+	finalize_flash_access(flashctx);
+	return ret;
+}
+
+/* Whether to write one erase block at a time, instead of using a copy of the whole chip. */
+static bool write_streamed(const struct flashctx *const flashctx)
+{
+	if (flashctx->flags.streaming_write)
+		return true;
+	if (flashprog_memory_fits(flashctx->chip->total_size * 1024))
+		return false;
+	msg_cdbg("No room for a copy of the chip within the memory limit, writing block by block.\n");
+	return true;
+}
+
+static int image_write(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len,
+		       const void *const refbuffer, const struct image_source *const src)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+	const bool streaming = !refbuffer && write_streamed(flashctx);
+	const bool verify_all = flashctx->flags.verify_whole_chip && !streaming;
+	const bool verify = flashctx->flags.verify_after_write;
+	const bool verify_inline = verify && flashctx->flags.verify_inline && !streaming;
+	const enum flashprog_erase_check erase_check = flashctx->flags.erase_check;
+
+	if (buffer_len != flash_size)
+		return 4;
+
+	int ret = 1;
+
+	uint8_t *const newcontents = buffer;
+	const uint8_t *const refcontents = refbuffer;
+	uint8_t *curcontents = NULL;
+	struct kept_hashes kept = { .blocks = NULL };
+	if (!streaming) {
+		curcontents = flashprog_malloc(flash_size);
+		if (!curcontents) {
+			msg_gerr("Out of memory!\n");
+			goto _free_ret;
+		}
+	}
+
+	/* The board check needs the whole image. */
+	if (board_image_check(flashctx) && image_wait(src, flash_size))
+		goto _free_ret;
+	if (check_board_image(flashctx, newcontents))
+		goto _free_ret;
+
+	if (streaming) {
+		const struct flashprog_iovec whole = { newcontents, flash_size };
+		ret = image_write_streamed(flashctx, &whole, verify, src);
+		goto _free_ret;
+	}
+
+	if (prepare_flash_access(flashctx, false, true, false, verify))
+		goto _free_ret;
+
+	/* If given, assume flash chip contains same data as `refcontents`. */
+	if (refcontents) {
+		msg_cinfo("Assuming old flash chip contents as ref-file...\n");
+		memcpy(curcontents, refcontents, flash_size);
+	} else {
+		if (read_old_contents(flashctx, curcontents, verify_all))
+			goto _finalize_ret;
+	}
+	if (image_wait(src, flash_size))
+		goto _finalize_ret;
+	if (verify_all && kept_hashes_init(flashctx, &kept, curcontents))
+		goto _finalize_ret;
+	/* Those are neither written nor verified inline, but have to fail the verification. */
+	const bool protected_differs =
+		write_protected_differs(flashctx, get_layout(flashctx), curcontents, newcontents);
+
+	/* Every erased block is fully checked instead of the final verify. */
+	if (verify_inline)
+		flashctx->flags.erase_check = FLASHPROG_ERASE_CHECK_FULL;
+	flashctx->verifying_inline = verify_inline;
+	/* Only contents read from the chip are trusted to back erase blocks up. */
+	const bool cur_complete = verify_all && !refcontents;
+	const int write_ret = write_by_layout(flashctx, curcontents, cur_complete, newcontents);
+	flashctx->verifying_inline = false;
+	flashctx->flags.erase_check = erase_check;
+	if (write_ret) {
+		msg_cerr("Uh oh. Erase/write failed. ");
+		ret = 2;
+		if (verify_all) {
+			msg_cerr("Checking if anything has changed.\n");
+			msg_cinfo("Reading current flash chip contents... ");
+			if (!flashprog_read_range(flashctx, curcontents, 0, flash_size)) {
+				msg_cinfo("done.\n");
+				if (kept_chip_unchanged(flashctx, &kept, curcontents)) {
+					nonfatal_help_message(flashctx);
+					goto _finalize_ret;
+				}
+				msg_cerr("Apparently at least some data has changed.\n");
+			} else
+				msg_cerr("Can't even read anymore!\n");
+			emergency_help_message(flashctx);
+			goto _finalize_ret;
+		} else {
+			msg_cerr("\n");
+		}
+		emergency_help_message(flashctx);
+		goto _finalize_ret;
+	}
+
+	/* Verify only if we actually changed something. */
+	if (verify && verify_inline && !protected_differs) {
+		if (!flashctx->all_skipped)
+			msg_cinfo("Verified while writing.\n");
+		ret = 0;
+	} else if (verify && (!flashctx->all_skipped || protected_differs)) {
+		msg_cinfo("Verifying flash... ");
+
+		settle_before_verify(flashctx);
+
+		ret = verify_by_layout(flashctx, get_layout(flashctx), curcontents, false, newcontents, NULL);
+		if (!ret && verify_all)
+			ret = verify_kept_areas(flashctx, &kept, curcontents);
+		/* If we tried to write, and verification now fails, we
+		   might have an emergency situation. */
+		if (ret)
+			emergency_help_message(flashctx);
+		else
+			msg_cinfo("VERIFIED.\n");
+	} else {
+		/* We didn't change anything. */
+		ret = 0;
+	}
+
+_finalize_ret:
+	finalize_flash_access(flashctx);
+_free_ret:
+	flashprog_free(kept.blocks);
+	flashprog_free(curcontents);
+	return ret;
+}
+
+/**
+ * @brief Write the specified image to the ROM chip.
+ *
+ * If a layout is set in the specified flash context, only erase blocks
+ * containing included regions will be touched.
+ *
+ * If FLASHPROG_FLAG_STREAMING_WRITE is set and no `refbuffer` is given,
+ * the chip is read, erased, written and verified one erase block at a
+ * time. This needs no buffers of the chip's size, but only the included
+ * regions are verified. This is also done if a memory limit is set (see
+ * flashprog_set_memory_limit()) and a copy of the chip wouldn't fit.
+ *
+ * If FLASHPROG_FLAG_VERIFY_INLINE is set, every write is read back right
+ * away and retried once if it doesn't match, instead of verifying all
+ * regions at the end.
+ *
+ * If FLASHPROG_FLAG_VERIFY_WHOLE_CHIP is set, the areas outside the layout
+ * are verified against hashes of their old contents.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param buffer Source buffer to read image from.
+ * @param buffer_len Size of source buffer in bytes.
+ * @param refbuffer If given, assume flash chip contains same data as `refbuffer`.
+ * @return 0 on success,
+ *         4 if buffer_len doesn't match the size of the flash chip,
+ *         3 if write was tried but nothing has changed,
+ *         2 if write failed and flash contents changed,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_write(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len,
+                         const void *const refbuffer)
+{
+	return image_write(flashctx, buffer, buffer_len, refbuffer, NULL);
+}
+
+/**
+ * @brief Write an image to the ROM chip while it's still being loaded.
+ *
+ * Works like flashprog_image_write() without a reference, but `buffer`
+ * may still be filled in address order, e.g. by a thread that reads or
+ * decompresses the image. Before the first `len` bytes of the image are
+ * used, `wait` is called with `len` and shall return once these bytes
+ * are available, or non-zero if loading failed.
+ *
+ * Meanwhile, the old flash contents are read. With
+ * FLASHPROG_FLAG_STREAMING_WRITE set, each erase block is written as soon
+ * as its part of the image is available. Otherwise, nothing is changed
+ * before the whole image is available.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param buffer Buffer that receives the image.
+ * @param buffer_len Size of the buffer in bytes.
+ * @param wait Called to wait for the image data.
+ * @param user_data Passed to `wait`.
+ * @return Like flashprog_image_write().
+ */
+int flashprog_image_write_loading(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len,
+				  flashprog_image_wait *const wait, void *const user_data)
+{
+	const struct image_source src = { wait, user_data };
+
+	return image_write(flashctx, buffer, buffer_len, NULL, &src);
+}
+
+/* State of flashprog_image_plan() while it collects the planned operations. */
+struct plan_builder {
+	struct flashprog_plan *plan;
+	size_t capacity;
+	bool verify_inline;
+	uint64_t read_us;	/* measured time of reading `read_bytes` */
+	size_t read_bytes;
+};
+
+/* Estimate for transferring `len` bytes, at the rate measured while reading. */
+static uint64_t plan_transfer_us(const struct plan_builder *const pb, const uint64_t len)
+{
+	if (pb->read_us && pb->read_bytes)
+		return len * pb->read_us / pb->read_bytes;
+	return len * EST_READ_US_PER_KIB / 1024;
+}
+
+static int plan_add(struct plan_builder *const pb, const enum flashprog_event_id id,
+		    const chipoff_t start, const chipsize_t len)
+{
+	struct flashprog_plan *const plan = pb->plan;
+
+	if (plan->count == pb->capacity) {
+		const size_t capacity = pb->capacity ? pb->capacity * 2 : 64;
+		struct flashprog_event *const ops = flashprog_realloc(plan->ops, capacity * sizeof(*ops));
+		if (!ops) {
+			msg_gerr("Out of memory!\n");
+			return 1;
+		}
+		plan->ops = ops;
+		pb->capacity = capacity;
 	}
+	plan->ops[plan->count++] = (struct flashprog_event){ id, start, len, 0 };
+	return 0;
+}
 
-	if (layout_sanity_checks(flash, write_it)) {
-		msg_cerr("Requested regions can not be handled. Aborting.\n");
+/* Plan the writes that write_range() would do. */
+static int plan_writes(const struct flashctx *const flashctx, struct plan_builder *const pb,
+		       const chipoff_t flash_offset, const uint8_t *const curcontents,
+		       const uint8_t *const newcontents, const chipsize_t len)
+{
+	const unsigned int max_coalesced = max_coalesced_write(flashctx);
+	struct flashprog_plan *const plan = pb->plan;
+	chipoff_t starthere = 0;
+	chipsize_t lenhere;
+
+	while ((lenhere = get_next_write(curcontents + starthere, newcontents + starthere,
+					 len - starthere, &starthere, flashctx->chip->gran))) {
+		if (max_coalesced)
+			lenhere = coalesce_writes(flashctx, flash_offset, curcontents, newcontents,
+						  len, starthere, lenhere, max_coalesced);
+		if (plan_add(pb, FLASHPROG_EVENT_WRITE, flash_offset + starthere, lenhere))
+			return 1;
+		plan->write_bytes += lenhere;
+		plan->estimated_us += estimate_program_us(flashctx, lenhere) + plan_transfer_us(pb, lenhere);
+		if (pb->verify_inline)
+			plan->estimated_us += plan_transfer_us(pb, lenhere);
+		starthere += lenhere;
+	}
+	return 0;
+}
+
+/* Plan the erases and writes of the region given by `info`, like walk_region(). */
+static int plan_region(struct flashctx *const flashctx, struct walk_info *const info,
+		       struct erase_layout *const erase_layouts, const int layout_count,
+		       struct plan_builder *const pb)
+{
+	struct flashprog_plan *const plan = pb->plan;
+	int i;
+
+	if (layout_count)
+		select_erase_functions(flashctx, erase_layouts, layout_count, info);
+
+	for (i = 0; i < layout_count; ++i) {
+		const struct erase_layout *const layout = &erase_layouts[i];
+		struct eraseblock_data eb;
+		size_t j = eraseblock_index(layout, info->region_start);
+
+		for (; next_selected_eraseblock(layout, info, &j, &eb); ++j) {
+			const chipsize_t erase_len = eb.end_addr + 1 - eb.start_addr;
+
+			select_eraseblock(layout, j, false);
+			if (plan_add(pb, FLASHPROG_EVENT_ERASE_BLOCK, eb.start_addr, erase_len))
+				return 1;
+			plan->erase_bytes += erase_len;
+			plan->estimated_us += estimate_erase_us(flashctx, layout->eraser, erase_len);
+
+			info->erase_start = eb.start_addr;
+			info->erase_end = eb.end_addr;
+			if (eb.start_addr < info->region_start || eb.end_addr > info->region_end) {
+				uint8_t *const backup_contents = get_scratch(info->scratch, 2 * (size_t)erase_len);
+				if (!backup_contents || backup_eraseblock(flashctx, info, backup_contents))
+					return 1;
+				uint8_t *const erased_contents = backup_contents + erase_len;
+				memset(erased_contents, ERASED_VALUE(flashctx), erase_len);
+				if (plan_writes(flashctx, pb, eb.start_addr, erased_contents, backup_contents, erase_len))
+					return 1;
+			}
+
+			const chipoff_t cur_start = MAX(eb.start_addr, info->region_start);
+			const chipsize_t cur_len = MIN(eb.end_addr, info->region_end) + 1 - cur_start;
+			memset(curcontents_at(info, cur_start), ERASED_VALUE(flashctx), cur_len);
+		}
+	}
+
+	const chipsize_t len = info->region_end + 1 - info->region_start;
+	if (plan_writes(flashctx, pb, info->region_start, curcontents_at(info, info->region_start),
+			newcontents_at(info, info->region_start), len))
 		return 1;
+	memcpy(curcontents_at(info, info->region_start), newcontents_at(info, info->region_start), len);
+	return 0;
+}
+
+/**
+ * @brief Plan a write of the specified image, without writing.
+ *
+ * Like flashprog_image_write(), the current flash contents are read (unless
+ * `refbuffer` is given) and the erase blocks are selected for the included
+ * regions. But instead of erasing and writing, the operations are returned
+ * as a list of FLASHPROG_EVENT_ERASE_BLOCK and FLASHPROG_EVENT_WRITE events,
+ * in the order they would happen. The chip is only read.
+ *
+ * The estimated time is based on the chip's timings if known, and on the
+ * throughput of the programmer measured while reading. Streaming writes
+ * are planned like buffered ones.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param buffer Source buffer with the image to plan for.
+ * @param buffer_len Size of source buffer in bytes.
+ * @param refbuffer If given, assume flash chip contains same data as `refbuffer`.
+ * @param[out] plan Points to the plan on success, release it with flashprog_plan_release().
+ * @return 0 on success,
+ *         4 if buffer_len doesn't match the size of the flash chip,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_plan(struct flashctx *const flashctx, const void *const buffer, const size_t buffer_len,
+			 const void *const refbuffer, struct flashprog_plan **const plan)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+	const bool verify_all = flashctx->flags.verify_whole_chip;
+	const bool verify = flashctx->flags.verify_after_write;
+	const bool do_erase = !(flashctx->chip->feature_bits & FEATURE_NO_ERASE);
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	struct plan_builder pb = { .verify_inline = verify && flashctx->flags.verify_inline };
+	struct erase_layout *erase_layouts = NULL;
+	struct walk_scratch scratch = { 0 };
+	struct walk_info info = { 0 };
+	chipoff_t start = 0, end;
+	int ret = 1, layout_count = 0;
+
+	*plan = NULL;
+	if (buffer_len != flash_size)
+		return 4;
+
+	pb.plan = flashprog_calloc(1, sizeof(*pb.plan));
+	info.curcontents = flashprog_malloc(flash_size);
+	if (!pb.plan || !info.curcontents) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
 	}
+	info.cur_complete = verify_all && !refbuffer;
+	info.newcontents = buffer;
+	info.scratch = &scratch;
 
-	if (flash->chip->prepare_access && flash->chip->prepare_access(flash, PREPARE_FULL))
+	if (prepare_flash_access(flashctx, true, false, false, false))
+		goto _free_ret;
+	/* Nothing is written, but plan as if. */
+	flashctx->skip_write_protected = true;
+
+	if (refbuffer) {
+		msg_cinfo("Assuming old flash chip contents as ref-file...\n");
+		memcpy(info.curcontents, refbuffer, flash_size);
+	} else {
+		/* The write would read the same, so this counts for the estimate too. */
+		const uint64_t read_start = monotonic_us();
+		msg_cinfo("Reading old flash chip contents... ");
+		if (verify_all ? flashprog_read_range(flashctx, info.curcontents, 0, flash_size)
+			       : read_by_layout(flashctx, info.curcontents)) {
+			msg_cinfo("FAILED.\n");
+			goto _finalize_ret;
+		}
+		msg_cinfo("done.\n");
+		write_protected_differs(flashctx, layout, info.curcontents, buffer);
+		pb.read_us = monotonic_us() - read_start;
+		pb.read_bytes = verify_all ? flash_size : included_size(layout);
+		pb.plan->estimated_us += pb.read_us;
+	}
+
+	if (do_erase) {
+		layout_count = get_erase_layout(flashctx, &erase_layouts);
+		if (layout_count <= 0) {
+			layout_count = 0;
+			goto _finalize_ret;
+		}
+	}
+
+	while (accessible_next_included_span(flashctx, layout, start, &start, &end)) {
+		info.region_start = start;
+		info.region_end = end;
+		if (plan_region(flashctx, &info, erase_layouts, layout_count, &pb))
+			goto _finalize_ret;
+		start = end + 1;
+		if (start == 0)
+			break;
+	}
+
+	if (verify && !pb.verify_inline && pb.plan->count) {
+		pb.plan->estimated_us += plan_transfer_us(&pb, verify_all ? flash_size : included_size(layout));
+		if (needs_settle_delay(flashctx))
+			pb.plan->estimated_us += SETTLE_DELAY_US;
+	}
+
+	*plan = pb.plan;
+	pb.plan = NULL;
+	ret = 0;
+
+_finalize_ret:
+	finalize_flash_access(flashctx);
+_free_ret:
+	free_scratch(&scratch);
+	flashprog_free(info.curcontents);
+	flashprog_plan_release(pb.plan);
+	return ret;
+}
+
+/**
+ * @brief Release a plan returned by flashprog_image_plan().
+ *
+ * @param plan The plan to release, may be NULL.
+ */
+void flashprog_plan_release(struct flashprog_plan *const plan)
+{
+	if (!plan)
+		return;
+	flashprog_free(plan->ops);
+	flashprog_free(plan);
+}
+
+/**
+ * @brief Write only the given extents of an image to the ROM chip.
+ *
+ * Works like flashprog_image_write() with a layout that includes exactly
+ * the extents, but the caller doesn't need an image of the chip's size.
+ * Only erase blocks containing extents are read and touched, and only the
+ * extents are verified. The layout set in the flash context is ignored.
+ *
+ * If the write is streamed (see flashprog_image_write()), the extents are
+ * used in place and no buffer of the chip's size is allocated either.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param extents The extents to write, sorted by offset and not overlapping.
+ *                Like layout regions, they must be aligned to the write
+ *                granularity of the chip.
+ * @param count Number of extents.
+ * @return 0 on success,
+ *         4 if the extents aren't sorted or don't fit the flash chip,
+ *         3, 2 or 1 like flashprog_image_write().
+ */
+int flashprog_image_write_extents(struct flashctx *const flashctx,
+				  const struct flashprog_extent *const extents, const size_t count)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+	const struct flashprog_layout *const saved_layout = flashctx->layout;
+	const bool saved_verify_all = flashctx->flags.verify_whole_chip;
+	struct flashprog_layout *layout = NULL;
+	struct flashprog_iovec *iov = NULL;
+	uint8_t *image = NULL;
+	size_t i, end = 0, iovcnt = 0;
+	bool streamed;
+	int ret = 1;
+
+	for (i = 0; i < count; ++i) {
+		if (!extents[i].len || extents[i].offset < end || extents[i].offset >= flash_size ||
+		    extents[i].len > flash_size - extents[i].offset)
+			return 4;
+		end = extents[i].offset + extents[i].len;
+	}
+	if (!count)
+		return 0;
+
+	streamed = !board_image_check(flashctx) && write_streamed(flashctx);
+	if (streamed)
+		iov = flashprog_calloc(2 * count + 1, sizeof(*iov));
+	else
+		/* Untouched pages of a large calloc() usually aren't even allocated. */
+		image = flashprog_calloc(1, flash_size);
+	if (!(streamed ? (void *)iov : (void *)image) || flashprog_layout_new(&layout)) {
+		msg_gerr("Out of memory!\n");
+		goto _free_ret;
+	}
+	for (i = 0, end = 0; i < count; ++i) {
+		const struct flashprog_extent *const extent = &extents[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "extent%zu", i);
+		if (flashprog_layout_add_region(layout, extent->offset, extent->offset + extent->len - 1, name) ||
+		    flashprog_layout_include_region(layout, name))
+			goto _free_ret;
+		if (streamed) {
+			/* Gaps are outside the layout, their contents are never used. */
+			iov[iovcnt++] = (struct flashprog_iovec){ NULL, extent->offset - end };
+			iov[iovcnt++] = (struct flashprog_iovec){ extent->data, extent->len };
+			end = extent->offset + extent->len;
+		} else {
+			memcpy(image + extent->offset, extent->data, extent->len);
+		}
+	}
+	if (streamed)
+		iov[iovcnt++] = (struct flashprog_iovec){ NULL, flash_size - end };
+
+	/* The image is only valid inside the extents. */
+	flashctx->layout = layout;
+	flashctx->flags.verify_whole_chip = false;
+	if (streamed)
+		ret = image_write_streamed(flashctx, iov, flashctx->flags.verify_after_write, NULL);
+	else
+		ret = flashprog_image_write(flashctx, image, flash_size, NULL);
+	flashctx->flags.verify_whole_chip = saved_verify_all;
+	flashctx->layout = saved_layout;
+
+_free_ret:
+	flashprog_layout_release(layout);
+	flashprog_free(iov);
+	flashprog_free(image);
+	return ret;
+}
+
+/**
+ * @brief Write an image given as several buffers to the ROM chip.
+ *
+ * Works like flashprog_image_write() with the concatenation of the
+ * vectors as image, i.e. the first vector starts at flash offset 0 and
+ * each following one right after the previous. Vectors may be empty.
+ *
+ * If FLASHPROG_FLAG_STREAMING_WRITE is set, the image is never assembled:
+ * the vectors are used in place, and only erase blocks that span several
+ * vectors are gathered into a buffer of the block size. Otherwise, and
+ * if the image has to be checked against the board for the internal
+ * programmer, the vectors are copied into a buffer of the chip's size.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param iov Vectors that form the image.
+ * @param iovcnt Number of vectors.
+ * @return 0 on success,
+ *         4 if the vectors don't add up to the size of the flash chip,
+ *         3, 2 or 1 like flashprog_image_write().
+ */
+int flashprog_image_writev(struct flashctx *const flashctx,
+			   const struct flashprog_iovec *const iov, const size_t iovcnt)
+{
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+	const bool verify = flashctx->flags.verify_after_write;
+	size_t i, total = 0;
+	uint8_t *image;
+	int ret;
+
+	for (i = 0; i < iovcnt; ++i) {
+		if (iov[i].len > flash_size - total)
+			return 4;
+		total += iov[i].len;
+	}
+	if (total != flash_size)
+		return 4;
+
+	if (!board_image_check(flashctx) && write_streamed(flashctx))
+		return image_write_streamed(flashctx, iov, verify, NULL);
+
+	image = flashprog_malloc(flash_size);
+	if (!image) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	for (i = 0, total = 0; i < iovcnt; total += iov[i++].len)
+		memcpy(image + total, iov[i].base, iov[i].len);
+	ret = flashprog_image_write(flashctx, image, flash_size, NULL);
+	flashprog_free(image);
+	return ret;
+}
+
+/**
+ * @brief Write the specified image to several ROM chips at once.
+ *
+ * Works like flashprog_image_write() on each of the chips, e.g. on the
+ * chip selects of one programmer (cf. flashprog_flash_probe_cs()). The
+ * chips are erased and written interleaved: while one chip is busy with
+ * an erase, another one is programmed. Each chip uses its own layout
+ * and flags, FLASHPROG_FLAG_STREAMING_WRITE is ignored.
+ *
+ * @param flashctxs The contexts of the flash chips.
+ * @param count Number of flash chips.
+ * @param buffer Source buffer to read image from.
+ * @param buffer_len Size of source buffer in bytes.
+ * @return 0 on success,
+ *         4 if buffer_len doesn't match the size of a flash chip,
+ *         3 if verification failed,
+ *         2 if write failed and flash contents changed,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_write_multi(struct flashprog_flashctx *const flashctxs[], const size_t count,
+				const void *const buffer, const size_t buffer_len)
+{
+	const uint8_t *const newcontents = buffer;
+	struct write_lane *lanes;
+	size_t i, prepared = 0;
+	bool changed = false;
+	int ret = 1;
+
+	for (i = 0; i < count; ++i) {
+		if (buffer_len != flashctxs[i]->chip->total_size * 1024)
+			return 4;
+	}
+
+	lanes = flashprog_calloc(count, sizeof(*lanes));
+	if (!lanes) {
+		msg_gerr("Out of memory!\n");
 		return 1;
+	}
+	for (i = 0; i < count; ++i) {
+		struct flashctx *const flashctx = flashctxs[i];
+
+		lanes[i].flashctx = flashctx;
+		lanes[i].info.newcontents = newcontents;
+		lanes[i].info.scratch = &lanes[i].scratch;
+		lanes[i].info.curcontents = flashprog_malloc(buffer_len);
+		if (!lanes[i].info.curcontents) {
+			msg_gerr("Out of memory!\n");
+			goto _free_ret;
+		}
+		if (check_board_image(flashctx, newcontents))
+			goto _free_ret;
+	}
 
-	/* Initialize chip_restore_fn_count before chip unlock calls. */
-	flash->chip_restore_fn_count = 0;
+	for (; prepared < count; ++prepared) {
+		struct flashctx *const flashctx = flashctxs[prepared];
 
-	/* Given the existence of read locks, we want to unlock for read,
-	   erase and write. */
-	if (flash->chip->unlock)
-		flash->chip->unlock(flash);
+		if (prepare_flash_access(flashctx, false, true, false, flashctx->flags.verify_after_write))
+			goto _finalize_ret;
+	}
 
-	return 0;
+	for (i = 0; i < count; ++i) {
+		const bool verify_all = flashctxs[i]->flags.verify_whole_chip;
+
+		if (read_old_contents(flashctxs[i], lanes[i].info.curcontents, verify_all))
+			goto _finalize_ret;
+		if (verify_all && kept_hashes_init(flashctxs[i], &lanes[i].kept, lanes[i].info.curcontents))
+			goto _finalize_ret;
+		lanes[i].info.cur_complete = verify_all;
+		lanes[i].protected_differs = write_protected_differs(flashctxs[i], get_layout(flashctxs[i]),
+								     lanes[i].info.curcontents, newcontents);
+	}
+
+	if (write_by_layout_multi(lanes, count)) {
+		msg_cerr("Uh oh. Erase/write failed.\n");
+		emergency_help_message(flashctxs[0]);
+		ret = 2;
+		goto _finalize_ret;
+	}
+
+	ret = 0;
+	for (i = 0; i < count; ++i) {
+		const struct flashctx *const flashctx = flashctxs[i];
+		changed |= (!flashctx->all_skipped || lanes[i].protected_differs) &&
+			   flashctx->flags.verify_after_write;
+	}
+	if (!changed)
+		goto _finalize_ret;
+
+	settle_before_verify(flashctxs[0]);
+
+	for (i = 0; i < count; ++i) {
+		struct flashctx *const flashctx = flashctxs[i];
+
+		/* Verify only if we actually changed something. */
+		if ((flashctx->all_skipped && !lanes[i].protected_differs) ||
+		    !flashctx->flags.verify_after_write)
+			continue;
+
+		msg_cinfo("Verifying flash on chip select %u... ", flashctx->chip_select);
+		ret = verify_by_layout(flashctx, get_layout(flashctx), lanes[i].info.curcontents, false,
+				       newcontents, NULL);
+		if (!ret && lanes[i].kept.blocks)
+			ret = verify_kept_areas(flashctx, &lanes[i].kept, lanes[i].info.curcontents);
+		if (ret) {
+			emergency_help_message(flashctx);
+			goto _finalize_ret;
+		}
+		msg_cinfo("VERIFIED.\n");
+	}
+
+_finalize_ret:
+	for (i = 0; i < prepared; ++i)
+		finalize_flash_access(flashctxs[i]);
+_free_ret:
+	for (i = 0; i < count; ++i) {
+		flashprog_free(lanes[i].kept.blocks);
+		flashprog_free(lanes[i].info.curcontents);
+	}
+	flashprog_free(lanes);
+	return ret;
 }
 
-void finalize_flash_access(struct flashctx *const flash)
+static int image_verify(struct flashctx *const flashctx, const void *const buffer, const size_t buffer_len,
+			unsigned char *const digest)
+{
+	const struct flashprog_layout *const layout = get_layout(flashctx);
+	const size_t flash_size = flashctx->chip->total_size * 1024;
+
+	if (buffer_len != flash_size)
+		return 2;
+
+	/* Without room for a copy of the chip, read it chunk by chunk. */
+	const bool chunked = !flashprog_memory_fits(flash_size);
+	const uint8_t *const newcontents = buffer;
+	uint8_t *const curcontents = flashprog_malloc(chunked ? MIN(VERIFY_CHUNK_SIZE, flash_size) : flash_size);
+	if (!curcontents) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	int ret = 1;
+
+	if (prepare_flash_access(flashctx, false, false, false, true))
+		goto _free_ret;
+
+	struct sha256_ctx hash;
+	sha256_init(&hash);
+
+	msg_cinfo("Verifying flash... ");
+	ret = verify_by_layout(flashctx, layout, curcontents, chunked, newcontents, digest ? &hash : NULL);
+	if (!ret)
+		msg_cinfo("VERIFIED.\n");
+	if (digest && (!ret || ret == 3))
+		sha256_final(&hash, digest);
+
+	finalize_flash_access(flashctx);
+_free_ret:
+	flashprog_free(curcontents);
+	return ret;
+}
+
+/**
+ * @brief Verify the ROM chip's contents with the specified image.
+ *
+ * If a layout is set in the specified flash context, only included regions
+ * will be verified.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param buffer Source buffer to verify with.
+ * @param buffer_len Size of source buffer in bytes.
+ * @return 0 on success,
+ *         3 if the chip's contents don't match,
+ *         2 if buffer_len doesn't match the size of the flash chip,
+ *         or 1 on any other failure.
+ */
+int flashprog_image_verify(struct flashctx *const flashctx, const void *const buffer, const size_t buffer_len)
 {
-	deregister_chip_restore(flash);
-	if (flash->chip->finish_access)
-		flash->chip->finish_access(flash);
+	return image_verify(flashctx, buffer, buffer_len, NULL);
 }
 
 /**
- * @addtogroup flashprog-flash
- * @{
- */
-
-/**
- * @brief Erase the specified ROM chip.
+ * @brief Verify the ROM chip's contents and calculate their SHA-256.
  *
- * If a layout is set in the given flash context, only included regions
- * will be erased.
+ * Works like flashprog_image_verify(), but always reads the included
+ * regions back, and hashes them in the same pass. So the digest is of
+ * what the chip returned, not of the image. If a layout is set, only
+ * the included regions are hashed, in address order.
  *
- * @param flashctx The context of the flash chip to erase.
- * @return 0 on success.
+ * @param flashctx The context of the flash chip.
+ * @param buffer Source buffer to verify with.
+ * @param buffer_len Size of source buffer in bytes.
+ * @param[out] digest The SHA-256 of the chip's contents, set if the
+ *                    contents were read completely, i.e. on success
+ *                    and if they don't match.
+ * @return 0 on success,
+ *         3 if the chip's contents don't match,
+ *         2 if buffer_len doesn't match the size of the flash chip,
+ *         or 1 on any other failure.
  */
-int flashprog_flash_erase(struct flashctx *const flashctx)
+int flashprog_image_verify_sha256(struct flashctx *const flashctx, const void *const buffer,
+				  const size_t buffer_len, unsigned char digest[32])
 {
-	if (prepare_flash_access(flashctx, false, false, true, false))
-		return 1;
+	return image_verify(flashctx, buffer, buffer_len, digest);
+}
 
-	const int ret = erase_by_layout(flashctx);
+/* Chips without usable erasers are sampled in blocks of this size. */
+#define SAMPLE_BLOCK_SIZE	(4 * KiB)
 
-	finalize_flash_access(flashctx);
+/*
+ * Verifies the included parts of a block, returns 0 for success, -1 for
+ * failure, 1 if it wasn't checked and 2 if nothing of it is included.
+ */
+static int verify_sample_block(struct flashctx *const flashctx, const uint8_t *const newcontents,
+			       const chipoff_t block_start, const chipoff_t block_end,
+			       const bool read_back, bool *const checksums)
+{
+	chipoff_t start, end;
+	int ret = 2;
+
+	for (start = block_start;
+	     readable_next_included_span(flashctx, get_layout(flashctx), start, &start, &end) &&
+	     start <= block_end; start = end + 1) {
+		end = MIN(end, block_end);
+		const chipsize_t len = end - start + 1;
+
+		int range_ret = 1;
+		if (!read_back && *checksums) {
+			range_ret = verify_range_by_checksum(flashctx, newcontents + start, start, len);
+			if (range_ret > 0)
+				*checksums = false;
+		}
+		if (read_back)
+			range_ret = verify_range_by_reading(flashctx, newcontents + start, start, len);
+		if (range_ret > 0)
+			return 1;
+		flashprog_event(flashctx, FLASHPROG_EVENT_VERIFY, start, len, range_ret);
+		if (range_ret)
+			return -1;
+		ret = 0;
 
+		if (end == block_end)
+			break;
+	}
 	return ret;
 }
 
-/** @} */ /* end flashprog-flash */
-
-/**
- * @defgroup flashprog-ops Operations
- * @{
- */
-
 /**
- * @brief Read the current image from the specified ROM chip.
+ * @brief Verify a rotating sample of the ROM chip's erase blocks.
  *
- * If a layout is set in the specified flash context, only included regions
- * will be read.
+ * Only every `sample->stride`-th erase block (of the smallest erase block
+ * size) is read back, starting with block `sample->cursor`. The cursor is
+ * advanced, so that `stride` runs with the same context read everything
+ * once. If the programmer can calculate checksums, all other blocks are
+ * compared by checksum. On any mismatch, all included regions are read
+ * back and verified like with flashprog_image_verify().
  *
  * @param flashctx The context of the flash chip.
- * @param buffer Target buffer to write image to.
- * @param buffer_len Size of target buffer in bytes.
+ * @param buffer Source buffer to verify with.
+ * @param buffer_len Size of source buffer in bytes.
+ * @param sample Sampling parameters and results.
  * @return 0 on success,
- *         2 if buffer_len is too short for the flash chip's contents,
+ *         3 if the chip's contents don't match,
+ *         2 if buffer_len doesn't match the size of the flash chip,
  *         or 1 on any other failure.
  */
-int flashprog_image_read(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len)
+int flashprog_image_verify_sampled(struct flashctx *const flashctx, const void *const buffer,
+				   const size_t buffer_len, struct flashprog_sampled_verify *const sample)
 {
 	const size_t flash_size = flashctx->chip->total_size * 1024;
+	const unsigned int stride = MAX(sample->stride, 1);
+	const unsigned int cursor = sample->cursor % stride;
+	const uint8_t *const newcontents = buffer;
+	struct erase_layout *erase_layout = NULL;
+	bool checksums = true;
+	size_t block_count, i;
+	int ret = 1;
 
-	if (flash_size > buffer_len)
+	sample->blocks = sample->read = sample->checksummed = 0;
+	sample->coverage = 0;
+	sample->escalated = false;
+
+	if (buffer_len != flash_size)
 		return 2;
 
-	if (prepare_flash_access(flashctx, true, false, false, false))
+	if (prepare_flash_access(flashctx, false, false, false, true))
 		return 1;
 
-	msg_cinfo("Reading flash... ");
+	if (count_usable_erasers(flashctx)) {
+		const int count = get_erase_layout(flashctx, &erase_layout);
+		if (count <= 0)
+			goto _finalize_ret;
+		/* Use the eraser with the smallest blocks. */
+		for (i = 1; i < (size_t)count; ++i) {
+			if (erase_layout[i].block_count > erase_layout[0].block_count)
+				erase_layout = &erase_layout[i];
+		}
+		block_count = erase_layout->block_count;
+	} else {
+		block_count = (flash_size + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+	}
 
-	int ret = 1;
-	if (read_by_layout(flashctx, buffer)) {
-		msg_cerr("Read operation failed!\n");
-		msg_cinfo("FAILED.\n");
-		goto _finalize_ret;
+	msg_cinfo("Verifying 1 in %u blocks of flash... ", stride);
+	flashprog_progress_start_by_layout(flashctx, FLASHPROG_PROGRESS_READ, get_layout(flashctx));
+	for (i = 0; i < block_count; ++i) {
+		chipoff_t block_start, block_end;
+		if (erase_layout) {
+			const struct eraseblock_data block = get_eraseblock(erase_layout, i);
+			block_start = block.start_addr;
+			block_end = block.end_addr;
+		} else {
+			block_start = i * SAMPLE_BLOCK_SIZE;
+			block_end = MIN(block_start + SAMPLE_BLOCK_SIZE, flash_size) - 1;
+		}
+
+		const bool read_back = i % stride == cursor;
+		const int block_ret = verify_sample_block(flashctx, newcontents, block_start, block_end,
+							  read_back, &checksums);
+		if (block_ret < 0)
+			break;
+		if (block_ret == 2)
+			continue;
+
+		++sample->blocks;
+		if (block_ret)
+			continue;
+		if (read_back)
+			++sample->read;
+		else
+			++sample->checksummed;
 	}
-	msg_cinfo("done.\n");
+	flashprog_progress_finish(flashctx);
+
+	if (i < block_count) {
+		msg_cinfo("\nMismatch in sampled block %zu, verifying everything.\n", i);
+		sample->escalated = true;
+		finalize_flash_access(flashctx);
+		ret = image_verify(flashctx, buffer, buffer_len, NULL);
+		sample->coverage = 100;
+		sample->cursor = cursor;
+		return ret;
+	}
+
+	sample->coverage = sample->blocks ? (sample->read + sample->checksummed) * 100 / sample->blocks : 100;
+	sample->cursor = (cursor + 1) % stride;
+	msg_cinfo("VERIFIED.\n");
 	ret = 0;
 
 _finalize_ret:
@@ -1719,211 +4944,181 @@ _finalize_ret:
 	return ret;
 }
 
-static void combine_image_by_layout(const struct flashctx *const flashctx,
-				    uint8_t *const newcontents, const uint8_t *const oldcontents)
+/* Looks up region `name` in the current layout and returns a layout with only this region included. */
+static int region_layout(const struct flashctx *const flashctx, const char *const name,
+			 const struct romentry **const region, struct flashprog_layout **const single)
 {
 	const struct flashprog_layout *const layout = get_layout(flashctx);
-	const struct romentry *included;
-	chipoff_t start = 0;
+	const struct romentry *entry = NULL;
 
-	while ((included = layout_next_included_region(layout, start))) {
-		if (included->start > start) {
-			/* copy everything up to the start of this included region */
-			memcpy(newcontents + start, oldcontents + start, included->start - start);
-		}
-		/* skip this included region */
-		start = included->end + 1;
-		if (start == 0)
-			return;
+	while ((entry = layout_next(layout, entry))) {
+		if (entry->name && !strcmp(entry->name, name))
+			break;
+	}
+	if (!entry) {
+		msg_gerr("No region named `%s' in the layout.\n", name);
+		return 1;
 	}
 
-	/* copy the rest of the chip */
-	const chipsize_t copy_len = flashctx->chip->total_size * 1024 - start;
-	memcpy(newcontents + start, oldcontents + start, copy_len);
+	if (flashprog_layout_new(single) ||
+	    flashprog_layout_add_region(*single, entry->start, entry->end, entry->name) ||
+	    flashprog_layout_include_region(*single, entry->name)) {
+		flashprog_layout_release(*single);
+		*single = NULL;
+		return 1;
+	}
+	*region = entry;
+	return 0;
 }
 
-/**
- * @brief Write the specified image to the ROM chip.
- *
- * If a layout is set in the specified flash context, only erase blocks
- * containing included regions will be touched.
- *
- * @param flashctx The context of the flash chip.
- * @param buffer Source buffer to read image from (may be altered for full verification).
- * @param buffer_len Size of source buffer in bytes.
- * @param refbuffer If given, assume flash chip contains same data as `refbuffer`.
- * @return 0 on success,
- *         4 if buffer_len doesn't match the size of the flash chip,
- *         3 if write was tried but nothing has changed,
- *         2 if write failed and flash contents changed,
- *         or 1 on any other failure.
- */
-int flashprog_image_write(struct flashctx *const flashctx, void *const buffer, const size_t buffer_len,
-                         const void *const refbuffer)
-{
-	const size_t flash_size = flashctx->chip->total_size * 1024;
-	const bool verify_all = flashctx->flags.verify_whole_chip;
-	const bool verify = flashctx->flags.verify_after_write;
-	const struct flashprog_layout *const verify_layout =
-		verify_all ? get_default_layout(flashctx) : get_layout(flashctx);
+struct region_sink_state {
+	chipoff_t start;
+	uint8_t *buf;
+	const uint8_t *refbuf;
+	bool mismatch;
+};
 
-	if (buffer_len != flash_size)
-		return 4;
+static int region_read_sink(const void *const data, const size_t offset, const size_t len,
+			    void *const user_data)
+{
+	struct region_sink_state *const state = user_data;
 
-	int ret = 1;
+	memcpy(state->buf + offset - state->start, data, len);
+	return 0;
+}
 
-	uint8_t *const newcontents = buffer;
-	const uint8_t *const refcontents = refbuffer;
-	uint8_t *const curcontents = malloc(flash_size);
-	uint8_t *oldcontents = NULL;
-	if (verify_all)
-		oldcontents = malloc(flash_size);
-	if (!curcontents || (verify_all && !oldcontents)) {
-		msg_gerr("Out of memory!\n");
-		goto _free_ret;
-	}
+static int region_verify_sink(const void *const data, const size_t offset, const size_t len,
+			      void *const user_data)
+{
+	struct region_sink_state *const state = user_data;
+	const uint8_t *const ref = state->refbuf + offset - state->start;
+	size_t i;
 
-#if CONFIG_INTERNAL == 1
-	if (programmer == &programmer_internal && cb_check_image(newcontents, flash_size) < 0) {
-		if (flashctx->flags.force_boardmismatch) {
-			msg_pinfo("Proceeding anyway because user forced us to.\n");
-		} else {
-			msg_perr("Aborting. You can override this with "
-				 "-p internal:boardmismatch=force.\n");
-			goto _free_ret;
+	for (i = 0; i < len; ++i) {
+		if (((const uint8_t *)data)[i] != ref[i]) {
+			msg_gerr("Verifying region failed at 0x%08zx: expected 0x%02x, got 0x%02x.\n",
+				 offset + i, ref[i], ((const uint8_t *)data)[i]);
+			state->mismatch = true;
+			return 1;
 		}
 	}
-#endif
-
-	if (prepare_flash_access(flashctx, false, true, false, verify))
-		goto _free_ret;
+	return 0;
+}
 
-	/* If given, assume flash chip contains same data as `refcontents`. */
-	if (refcontents) {
-		msg_cinfo("Assuming old flash chip contents as ref-file...\n");
-		memcpy(curcontents, refcontents, flash_size);
-		if (oldcontents)
-			memcpy(oldcontents, refcontents, flash_size);
-	} else {
-		/*
-		 * Read the whole chip to be able to check whether regions need to be
-		 * erased and to give better diagnostics in case write fails.
-		 * The alternative is to read only the regions which are to be
-		 * preserved, but in that case we might perform unneeded erase which
-		 * takes time as well.
-		 */
-		msg_cinfo("Reading old flash chip contents... ");
-		if (verify_all) {
-			if (flashprog_read_range(flashctx, oldcontents, 0, flash_size)) {
-				msg_cinfo("FAILED.\n");
-				goto _finalize_ret;
-			}
-			memcpy(curcontents, oldcontents, flash_size);
-		} else {
-			if (read_by_layout(flashctx, curcontents)) {
-				msg_cinfo("FAILED.\n");
-				goto _finalize_ret;
-			}
-		}
-		msg_cinfo("done.\n");
-	}
+/* Streams region `name` through `sink`, with the flash context's layout set to just this region. */
+static int region_stream(struct flashctx *const flashctx, const char *const name, const size_t len,
+			 flashprog_read_sink *const sink, struct region_sink_state *const state)
+{
+	const struct flashprog_layout *const saved_layout = flashctx->layout;
+	struct flashprog_layout *single;
+	const struct romentry *region;
+	int ret;
 
-	if (write_by_layout(flashctx, curcontents, newcontents)) {
-		msg_cerr("Uh oh. Erase/write failed. ");
-		ret = 2;
-		if (verify_all) {
-			msg_cerr("Checking if anything has changed.\n");
-			msg_cinfo("Reading current flash chip contents... ");
-			if (!flashprog_read_range(flashctx, curcontents, 0, flash_size)) {
-				msg_cinfo("done.\n");
-				if (!memcmp(oldcontents, curcontents, flash_size)) {
-					nonfatal_help_message();
-					goto _finalize_ret;
-				}
-				msg_cerr("Apparently at least some data has changed.\n");
-			} else
-				msg_cerr("Can't even read anymore!\n");
-			emergency_help_message();
-			goto _finalize_ret;
-		} else {
-			msg_cerr("\n");
-		}
-		emergency_help_message();
-		goto _finalize_ret;
+	if (region_layout(flashctx, name, &region, &single))
+		return 1;
+	if (len != region->end - region->start + 1) {
+		flashprog_layout_release(single);
+		return 2;
 	}
 
-	/* Verify only if we actually changed something. */
-	if (verify && !all_skipped) {
-		msg_cinfo("Verifying flash... ");
+	state->start = region->start;
+	flashctx->layout = single;
+	ret = flashprog_image_read_stream(flashctx, sink, state);
+	flashctx->layout = saved_layout;
 
-		/* Work around chips which need some time to calm down. */
-		programmer_delay(1000*1000);
+	flashprog_layout_release(single);
+	return ret;
+}
 
-		if (verify_all)
-			combine_image_by_layout(flashctx, newcontents, oldcontents);
-		ret = verify_by_layout(flashctx, verify_layout, curcontents, newcontents);
-		/* If we tried to write, and verification now fails, we
-		   might have an emergency situation. */
-		if (ret)
-			emergency_help_message();
-		else
-			msg_cinfo("VERIFIED.\n");
-	} else {
-		/* We didn't change anything. */
-		ret = 0;
-	}
+/**
+ * @brief Read a single region of the ROM chip into a buffer of its size.
+ *
+ * Like flashprog_image_read() with only this region included, but the
+ * buffer holds only the region, starting at its first byte. The region
+ * is looked up by name in the layout set in the flash context, included
+ * or not.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param name Name of the region.
+ * @param buffer Target buffer to write the region's contents to.
+ * @param buffer_len Size of target buffer in bytes.
+ * @return 0 on success,
+ *         2 if buffer_len doesn't match the size of the region,
+ *         or 1 on any other failure, e.g. if there is no such region.
+ */
+int flashprog_region_read(struct flashctx *const flashctx, const char *const name,
+			  void *const buffer, const size_t buffer_len)
+{
+	struct region_sink_state state = { .buf = buffer };
+	const int ret = region_stream(flashctx, name, buffer_len, region_read_sink, &state);
 
-_finalize_ret:
-	finalize_flash_access(flashctx);
-_free_ret:
-	free(oldcontents);
-	free(curcontents);
-	return ret;
+	return ret == 2 ? 2 : !!ret;
 }
 
 /**
- * @brief Verify the ROM chip's contents with the specified image.
+ * @brief Write a single region of the ROM chip from a buffer of its size.
  *
- * If a layout is set in the specified flash context, only included regions
- * will be verified.
+ * Works like flashprog_image_write_extents() with a single extent that
+ * covers the region. So only erase blocks overlapping the region are read
+ * and touched, and the rest of these blocks is preserved. The region is
+ * looked up by name in the layout set in the flash context, included or
+ * not.
  *
  * @param flashctx The context of the flash chip.
- * @param buffer Source buffer to verify with.
+ * @param name Name of the region.
+ * @param buffer Source buffer with the region's new contents.
  * @param buffer_len Size of source buffer in bytes.
  * @return 0 on success,
- *         3 if the chip's contents don't match,
- *         2 if buffer_len doesn't match the size of the flash chip,
- *         or 1 on any other failure.
+ *         4 if there is no such region or buffer_len doesn't match its size,
+ *         3, 2 or 1 like flashprog_image_write().
  */
-int flashprog_image_verify(struct flashctx *const flashctx, const void *const buffer, const size_t buffer_len)
+int flashprog_region_write(struct flashctx *const flashctx, const char *const name,
+			   const void *const buffer, const size_t buffer_len)
 {
-	const struct flashprog_layout *const layout = get_layout(flashctx);
-	const size_t flash_size = flashctx->chip->total_size * 1024;
-
-	if (buffer_len != flash_size)
-		return 2;
+	struct flashprog_layout *single;
+	const struct romentry *region;
 
-	const uint8_t *const newcontents = buffer;
-	uint8_t *const curcontents = malloc(flash_size);
-	if (!curcontents) {
-		msg_gerr("Out of memory!\n");
-		return 1;
-	}
+	if (region_layout(flashctx, name, &region, &single))
+		return 4;
 
-	int ret = 1;
+	const struct flashprog_extent extent = {
+		.offset	= region->start,
+		.len	= region->end - region->start + 1,
+		.data	= buffer,
+	};
+	flashprog_layout_release(single);
+	if (buffer_len != extent.len)
+		return 4;
 
-	if (prepare_flash_access(flashctx, false, false, false, true))
-		goto _free_ret;
+	return flashprog_image_write_extents(flashctx, &extent, 1);
+}
 
-	msg_cinfo("Verifying flash... ");
-	ret = verify_by_layout(flashctx, layout, curcontents, newcontents);
-	if (!ret)
-		msg_cinfo("VERIFIED.\n");
+/**
+ * @brief Verify a single region of the ROM chip with a buffer of its size.
+ *
+ * Like flashprog_image_verify() with only this region included, but the
+ * buffer holds only the region, starting at its first byte. The region
+ * is looked up by name in the layout set in the flash context, included
+ * or not. Verification stops at the first mismatch.
+ *
+ * @param flashctx The context of the flash chip.
+ * @param name Name of the region.
+ * @param buffer Source buffer to verify with.
+ * @param buffer_len Size of source buffer in bytes.
+ * @return 0 on success,
+ *         3 if the region's contents don't match,
+ *         2 if buffer_len doesn't match the size of the region,
+ *         or 1 on any other failure, e.g. if there is no such region.
+ */
+int flashprog_region_verify(struct flashctx *const flashctx, const char *const name,
+			    const void *const buffer, const size_t buffer_len)
+{
+	struct region_sink_state state = { .refbuf = buffer };
+	const int ret = region_stream(flashctx, name, buffer_len, region_verify_sink, &state);
 
-	finalize_flash_access(flashctx);
-_free_ret:
-	free(curcontents);
-	return ret;
+	if (state.mismatch)
+		return 3;
+	return ret == 2 ? 2 : !!ret;
 }
 
 /** @} */ /* end flashprog-ops */
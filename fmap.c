@@ -167,10 +167,21 @@ static int fmap_lsearch_rom(struct fmap **fmap_out,
 		goto _finalize_ret;
 	}
 
-	ret = flashprog_read_range(flashctx, buf + rom_offset, rom_offset, len);
-	if (ret) {
-		msg_pdbg("Cannot read ROM contents.\n");
-		goto _free_ret;
+	/* Leave read-protected ranges blank, an fmap can't be found there anyway. */
+	size_t offset;
+	for (offset = rom_offset; offset < rom_offset + len; ) {
+		struct flash_region region;
+		get_flash_region(flashctx, offset, &region);
+		const size_t chunk = MIN((size_t)region.end + 1, rom_offset + len) - offset;
+
+		if (region.read_prot) {
+			memset(buf + offset, 0xff, chunk);
+		} else if (flashprog_read_range(flashctx, buf + offset, offset, chunk)) {
+			msg_pdbg("Cannot read ROM contents.\n");
+			ret = -1;
+			goto _free_ret;
+		}
+		offset += chunk;
 	}
 
 	ret = fmap_read_from_buffer(fmap_out, buf + rom_offset, len);
@@ -181,6 +192,131 @@ _finalize_ret:
 	return ret;
 }
 
+/* Returns 0 if `fmap` is a valid header, 2 if only the signature matches. */
+static int fmap_check_header(const struct fmap *fmap, size_t offset)
+{
+	if (is_valid_fmap(fmap)) {
+		msg_gdbg("fmap found at offset 0x%06zx\n", offset);
+		return 0;
+	}
+	msg_gerr("fmap signature found at %zu but header is invalid.\n", offset);
+	return 2;
+}
+
+/* Read and check the fmap header at `offset`. Returns 1 if there is none. */
+static int fmap_probe_offset(struct flashctx *const flashctx, struct fmap *fmap, size_t offset)
+{
+	const int sig_len = strlen(FMAP_SIGNATURE);
+
+	/* Known locked regions are skipped without trying. */
+	if (!flash_range_readable(flashctx, offset, sizeof(*fmap)))
+		return 1;
+
+	/* Read errors are considered non-fatal since we may
+	 * encounter locked regions and want to continue. */
+	if (flashprog_read_range(flashctx, (uint8_t *)fmap, offset, sig_len)) {
+		/*
+		 * Print in verbose mode only to avoid excessive
+		 * messages for benign errors. Subsequent error
+		 * prints should be done as usual.
+		 */
+		msg_cdbg("Cannot read %d bytes at offset %zu\n", sig_len, offset);
+		return 1;
+	}
+
+	if (memcmp(fmap, FMAP_SIGNATURE, sig_len) != 0)
+		return 1;
+
+	if (flashprog_read_range(flashctx, (uint8_t *)fmap + sig_len,
+				offset + sig_len, sizeof(*fmap) - sig_len)) {
+		msg_cerr("Cannot read %zu bytes at offset %06zx\n",
+				sizeof(*fmap) - sig_len, offset + sig_len);
+		return 1;
+	}
+
+	return fmap_check_header(fmap, offset);
+}
+
+/* The largest stride of the binary search that hits `rel_offset`. */
+static size_t fmap_stride_level(size_t rel_offset, size_t stride, size_t min_stride)
+{
+	while (stride > min_stride && rel_offset % stride)
+		stride /= 2;
+	return stride;
+}
+
+/*
+ * Once the stride of the binary search drops below the window size,
+ * reading single offsets would mean many tiny transactions. Instead,
+ * we read whole windows and check all remaining candidates in them.
+ * To find the same fmap as checking stride by stride would, we prefer
+ * candidates at larger strides over those at lower offsets.
+ */
+#define FMAP_SEARCH_WINDOW	(64 * KiB)
+
+static int fmap_wsearch_rom(struct flashctx *const flashctx, struct fmap *fmap, size_t *found_offset,
+		size_t rom_offset, size_t len, size_t stride, size_t min_stride, bool check_offset_0)
+{
+	const size_t buf_size = FMAP_SEARCH_WINDOW + sizeof(*fmap) - 1;
+	const size_t last = rom_offset + len - sizeof(*fmap);
+	const int sig_len = strlen(FMAP_SIGNATURE);
+	size_t window, best_level = 0;
+	int ret = 1;
+
+	uint8_t *const buf = malloc(buf_size);
+	if (!buf) {
+		msg_gerr("Out of memory.\n");
+		return 1;
+	}
+
+	for (window = rom_offset; window <= last && best_level < stride; window += FMAP_SEARCH_WINDOW) {
+		const size_t window_len = min(buf_size, rom_offset + len - window);
+		const bool readable = flash_range_readable(flashctx, window, window_len) &&
+				      !flashprog_read_range(flashctx, buf, window, window_len);
+		size_t offset;
+
+		if (!readable)
+			msg_cdbg("Cannot read %zu bytes at offset %zu\n", window_len, window);
+
+		for (offset = window; offset < window + FMAP_SEARCH_WINDOW && offset <= last;
+		     offset += min_stride) {
+			const size_t level = fmap_stride_level(offset - rom_offset, stride, min_stride);
+			struct fmap header;
+			int found;
+
+			/* At the same stride, the earlier offset wins. */
+			if (level <= best_level)
+				continue;
+			if ((offset % (stride * 2) == 0) && (offset != 0))
+				continue;
+			if (offset == 0 && !check_offset_0)
+				continue;
+
+			if (readable) {
+				if (memcmp(buf + offset - window, FMAP_SIGNATURE, sig_len) != 0)
+					continue;
+				memcpy(&header, buf + offset - window, sizeof(header));
+				found = fmap_check_header(&header, offset);
+			} else {
+				/* Maybe only parts of the window are locked. */
+				found = fmap_probe_offset(flashctx, &header, offset);
+			}
+
+			if (found == 0) {
+				memcpy(fmap, &header, sizeof(header));
+				*found_offset = offset;
+				best_level = level;
+				ret = 0;
+			} else if (found == 2 && ret) {
+				ret = 2;
+			}
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
 static int fmap_bsearch_rom(struct fmap **fmap_out, struct flashctx *const flashctx,
 		size_t rom_offset, size_t len, size_t min_stride)
 {
@@ -190,7 +326,6 @@ static int fmap_bsearch_rom(struct fmap **fmap_out, struct flashctx *const flash
 	bool check_offset_0 = true;
 	struct fmap *fmap;
 	const unsigned int chip_size = flashctx->chip->total_size * 1024;
-	const int sig_len = strlen(FMAP_SIGNATURE);
 
 	if (rom_offset + len > flashctx->chip->total_size * 1024)
 		return 1;
@@ -221,6 +356,15 @@ static int fmap_bsearch_rom(struct fmap **fmap_out, struct flashctx *const flash
 		if (stride > len)
 			continue;
 
+		if (stride < FMAP_SEARCH_WINDOW) {
+			const int found = fmap_wsearch_rom(flashctx, fmap, &offset, rom_offset, len,
+							   stride, min_stride, check_offset_0);
+			fmap_found = found == 0;
+			if (found == 2)
+				ret = 2;
+			break;
+		}
+
 		for (offset = rom_offset;
 		     offset <= rom_offset + len - sizeof(struct fmap);
 		     offset += stride) {
@@ -230,35 +374,13 @@ static int fmap_bsearch_rom(struct fmap **fmap_out, struct flashctx *const flash
 				continue;
 			check_offset_0 = false;
 
-			/* Read errors are considered non-fatal since we may
-			 * encounter locked regions and want to continue. */
-			if (flashprog_read_range(flashctx, (uint8_t *)fmap, offset, sig_len)) {
-				/*
-				 * Print in verbose mode only to avoid excessive
-				 * messages for benign errors. Subsequent error
-				 * prints should be done as usual.
-				 */
-				msg_cdbg("Cannot read %d bytes at offset %zu\n", sig_len, offset);
-				continue;
-			}
-
-			if (memcmp(fmap, FMAP_SIGNATURE, sig_len) != 0)
-				continue;
-
-			if (flashprog_read_range(flashctx, (uint8_t *)fmap + sig_len,
-						offset + sig_len, sizeof(*fmap) - sig_len)) {
-				msg_cerr("Cannot read %zu bytes at offset %06zx\n",
-						sizeof(*fmap) - sig_len, offset + sig_len);
-				continue;
-			}
-
-			if (is_valid_fmap(fmap)) {
-				msg_gdbg("fmap found at offset 0x%06zx\n", offset);
+			const int found = fmap_probe_offset(flashctx, fmap, offset);
+			if (found == 0) {
 				fmap_found = true;
 				break;
 			}
-			msg_gerr("fmap signature found at %zu but header is invalid.\n", offset);
-			ret = 2;
+			if (found == 2)
+				ret = 2;
 		}
 
 		if (fmap_found)
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 #include <ftdi.h>
@@ -84,6 +85,43 @@ static const struct dev_entry devs_ft2232spi[] = {
 
 #define FTDI_HW_BUFFER_SIZE 4096 /* in bytes */
 
+/* Maximum length of a single MPSSE data command. */
+#define MPSSE_MAX_LEN		(64 * KiB)
+
+/* Bytes read per SPI command by ft2232_spi_read(). */
+#define FT2232_READ_CHUNK	(256 * KiB)
+/* Size of libftdi's USB read transfers. */
+#define FT2232_USB_CHUNK	(16 * KiB)
+/* Reads of at least this size are submitted before their commands are sent. */
+#define FT2232_ASYNC_MIN	(4 * KiB)
+
+/* Page programs queued per USB transfer by ft2232_spi_write_256(). */
+#define FT2232_WRITE_PAGES	8
+/* Upper bound of the commands for one page: delay, WREN, RDSR and program. */
+#define FT2232_PAGE_CMD_LEN	(3 + 10 + 13 + 9 + 1 + JEDEC_MAX_ADDR_LEN + 256)
+/* Fallback for chips without known page-program timing. */
+#define FT2232_PAGE_TYP_US	700
+#define FT2232_PAGE_MAX_US	(10 * 1000)
+
+/* AAI words queued per USB transfer by ft2232_spi_write_aai(). */
+#define FT2232_AAI_WORDS	64
+/* Upper bound of the commands for one AAI word: delay, word and RDSR. */
+#define FT2232_AAI_CMD_LEN	(3 + 9 + JEDEC_AAI_WORD_PROGRAM_OUTSIZE + 13)
+/* The WREN before the first word. */
+#define FT2232_WREN_CMD_LEN	10
+
+/* Status reads per USB round trip in ft2232_spi_poll_busy(). */
+#define FT2232_POLL_BATCH	16
+/* Longest interval between two status reads queued on the MPSSE. */
+#define FT2232_POLL_MAX_US	1000
+
+#if !defined(SEND_IMMEDIATE)
+#define SEND_IMMEDIATE		0x87
+#endif
+#if !defined(CLK_BYTES)
+#define CLK_BYTES		0x8f /* clock n x 8 bits without data transfer, 'H' chips only */
+#endif
+
 #define DEFAULT_DIVISOR 2
 
 #define BITMODE_BITBANG_NORMAL	1
@@ -120,6 +158,9 @@ struct ft2232_data {
 	uint8_t cs_bits;
 	uint8_t aux_bits;
 	uint8_t pindir;
+	bool clk_bytes;			/* supports CLK_BYTES */
+	unsigned int spi_khz;
+	unsigned int page_delay_us;	/* time to wait between pipelined page programs */
 	struct ftdi_context ftdi_context;
 };
 
@@ -199,19 +240,130 @@ static int ft2232_shutdown(void *data)
 	return ret;
 }
 
+static size_t ft2232_read_cmd_count(size_t readcnt)
+{
+	return (readcnt + MPSSE_MAX_LEN - 1) / MPSSE_MAX_LEN;
+}
+
 static bool ft2232_spi_command_fits(const struct spi_command *cmd, size_t buffer_size)
 {
 	const size_t cmd_len = 3; /* same length for any ft2232 command */
 	return
 		/* commands for CS# assertion and de-assertion: */
 		cmd_len + cmd_len
-		/* commands for either a write, a read or both: */
-		+ (cmd->writecnt && cmd->readcnt ? cmd_len + cmd_len : cmd_len)
+		/* an optional write and one read command per 64 KiB: */
+		+ (cmd->writecnt ? cmd_len : 0) + cmd_len * ft2232_read_cmd_count(cmd->readcnt)
 		/* payload (only writecnt; readcnt concerns another buffer): */
-		+ cmd->writecnt
+		+ cmd->writecnt + cmd->datacnt
 		<= buffer_size;
 }
 
+static size_t ft2232_set_cs(const struct ft2232_data *spi_data, unsigned char *buf, bool assert)
+{
+	buf[0] = SET_BITS_LOW;
+	/* CS# pins are active low, keep aux_bits, all other output pins stay low */
+	buf[1] = assert ? spi_data->aux_bits : spi_data->cs_bits | spi_data->aux_bits;
+	buf[2] = spi_data->pindir;
+	return 3;
+}
+
+/* Write `hdr` followed by `data`, e.g. opcode and address, then the page to program. */
+static size_t ft2232_write_cmd_data(unsigned char *buf, const unsigned char *hdr, size_t hdr_len,
+				    const unsigned char *data, size_t data_len)
+{
+	const size_t len = hdr_len + data_len;
+
+	buf[0] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
+	buf[1] = (len - 1) & 0xff;
+	buf[2] = ((len - 1) >> 8) & 0xff;
+	memcpy(buf + 3, hdr, hdr_len);
+	if (data_len)
+		memcpy(buf + 3 + hdr_len, data, data_len);
+	return 3 + len;
+}
+
+static size_t ft2232_write_cmd(unsigned char *buf, const unsigned char *data, size_t len)
+{
+	return ft2232_write_cmd_data(buf, data, len, NULL, 0);
+}
+
+/* MPSSE commands transfer 64 KiB at most, longer reads are queued back to back. */
+static size_t ft2232_read_cmds(unsigned char *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (len) {
+		const size_t chunk = min(len, MPSSE_MAX_LEN);
+		buf[i++] = MPSSE_DO_READ;
+		buf[i++] = (chunk - 1) & 0xff;
+		buf[i++] = ((chunk - 1) >> 8) & 0xff;
+		len -= chunk;
+	}
+	return i;
+}
+
+/* Keep the MPSSE busy for about `usecs` by clocking with CS# de-asserted. */
+static size_t ft2232_delay_cmd(const struct ft2232_data *spi_data, unsigned char *buf, unsigned int usecs)
+{
+	const unsigned long long clocks = (unsigned long long)usecs * spi_data->spi_khz / 1000;
+	size_t len = (clocks + 7) / 8;
+
+	if (len < 1)
+		len = 1;
+	if (len > MPSSE_MAX_LEN)
+		len = MPSSE_MAX_LEN;
+
+	buf[0] = CLK_BYTES;
+	buf[1] = (len - 1) & 0xff;
+	buf[2] = ((len - 1) >> 8) & 0xff;
+	return 3;
+}
+
+/*
+ * Send `size` bytes of commands and read `readcnt` bytes of response.
+ * Long reads are submitted before the commands are sent, so the host
+ * fetches data as soon as the FTDI chip provides it.
+ */
+static int ft2232_transfer(struct ftdi_context *ftdic, const unsigned char *buf, int size,
+			   unsigned char *readarr, int readcnt)
+{
+	int ret;
+
+	if (readcnt < FT2232_ASYNC_MIN) {
+		ret = send_buf(ftdic, buf, size);
+		if (ret) {
+			msg_perr("send_buf failed: %i\n", ret);
+			return ret;
+		}
+		if (readcnt) {
+			ret = get_buf(ftdic, readarr, readcnt);
+			if (ret)
+				msg_perr("get_buf failed: %i\n", ret);
+		}
+		return ret;
+	}
+
+	struct ftdi_transfer_control *const tc = ftdi_read_data_submit(ftdic, readarr, readcnt);
+	if (!tc) {
+		msg_perr("ftdi_read_data_submit failed: %s\n", ftdi_get_error_string(ftdic));
+		return 1;
+	}
+	ret = send_buf(ftdic, buf, size);
+	if (ret)
+		msg_perr("send_buf failed: %i\n", ret);
+	/* Always reap the transfer, it times out if the commands didn't make it. */
+	const int r = ftdi_transfer_data_done(tc);
+	if (r < 0) {
+		msg_perr("ftdi_transfer_data_done: %d, %s\n", r, ftdi_get_error_string(ftdic));
+		return 1;
+	}
+	if (!ret && r != readcnt) {
+		msg_perr("Short read: %d of %d bytes\n", r, readcnt);
+		return 1;
+	}
+	return ret;
+}
+
 /* Returns 0 upon success, a negative number upon errors. */
 static int ft2232_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
 {
@@ -226,7 +378,7 @@ static int ft2232_spi_send_multicommand(const struct flashctx *flash, struct spi
 	 */
 	for (; cmds->writecnt || cmds->readcnt; cmds++) {
 
-		if (cmds->writecnt > 65536 || cmds->readcnt > 65536)
+		if (cmds->writecnt + cmds->datacnt > MPSSE_MAX_LEN || cmds->readcnt > FT2232_READ_CHUNK)
 			return SPI_INVALID_LENGTH;
 
 		if (!ft2232_spi_command_fits(cmds, FTDI_HW_BUFFER_SIZE - i)) {
@@ -235,32 +387,19 @@ static int ft2232_spi_send_multicommand(const struct flashctx *flash, struct spi
 		}
 
 		msg_pspew("Assert CS#\n");
-		buf[i++] = SET_BITS_LOW;
-		/* assert CS# pins, keep aux_bits, all other output pins stay low */
-		buf[i++] = spi_data->aux_bits;
-		buf[i++] = spi_data->pindir;
+		i += ft2232_set_cs(spi_data, buf + i, true);
 
 		/* WREN, OP(PROGRAM, ERASE), ADDR, DATA */
-		if (cmds->writecnt) {
-			buf[i++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-			buf[i++] = (cmds->writecnt - 1) & 0xff;
-			buf[i++] = ((cmds->writecnt - 1) >> 8) & 0xff;
-			memcpy(buf + i, cmds->writearr, cmds->writecnt);
-			i += cmds->writecnt;
-		}
+		if (cmds->writecnt)
+			i += ft2232_write_cmd_data(buf + i, cmds->writearr, cmds->writecnt,
+						   cmds->dataarr, cmds->datacnt);
 
 		/* An optional read command */
-		if (cmds->readcnt) {
-			buf[i++] = MPSSE_DO_READ;
-			buf[i++] = (cmds->readcnt - 1) & 0xff;
-			buf[i++] = ((cmds->readcnt - 1) >> 8) & 0xff;
-		}
+		i += ft2232_read_cmds(buf + i, cmds->readcnt);
 
 		/* Add final de-assert CS# */
 		msg_pspew("De-assert CS#\n");
-		buf[i++] = SET_BITS_LOW;
-		buf[i++] = spi_data->cs_bits | spi_data->aux_bits;
-		buf[i++] = spi_data->pindir;
+		i += ft2232_set_cs(spi_data, buf + i, false);
 
 		/* continue if there is no read-cmd and further cmds exist */
 		if (!cmds->readcnt &&
@@ -269,34 +408,310 @@ static int ft2232_spi_send_multicommand(const struct flashctx *flash, struct spi
 			continue;
 		}
 
-		ret = send_buf(ftdic, buf, i);
+		ret = ft2232_transfer(ftdic, buf, i, cmds->readarr, cmds->readcnt);
 		i = 0;
-		if (ret) {
-			msg_perr("send_buf failed: %i\n", ret);
+		if (ret)
 			break;
+	}
+	return ret ? -1 : 0;
+}
+
+static int ft2232_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return flashprog_read_chunked(flash, buf, start, len, FT2232_READ_CHUNK, spi_nbyte_read);
+}
+
+struct ft2232_page {
+	unsigned int addr;
+	const uint8_t *data;
+	unsigned int len;
+};
+
+/*
+ * A chip ignores WREN while it is busy, and a page program without
+ * WEL. Hence a page program is executed iff the status read between
+ * its WREN and itself shows WEL set and WIP cleared.
+ */
+static bool ft2232_page_accepted(uint8_t status)
+{
+	return (status & (SPI_SR_WIP | SPI_SR_WEL)) == SPI_SR_WEL;
+}
+
+/*
+ * Send WREN, RDSR and a page program for each of `count` pages in one
+ * USB transfer. Between the pages, the MPSSE idles for the expected
+ * page-program time. The RDSR results are stored in `status`.
+ */
+static int ft2232_program_pages(struct flashctx *flash, const struct ft2232_page *pages, size_t count,
+				bool delay_first, const uint8_t op, const int addr_len, uint8_t *status)
+{
+	struct ft2232_data *spi_data = flash->mst.spi->data;
+	static unsigned char buf[FT2232_WRITE_PAGES * FT2232_PAGE_CMD_LEN];
+	unsigned char cmd[1 + JEDEC_MAX_ADDR_LEN];
+	size_t i = 0, p;
+	int j;
+
+	for (p = 0; p < count; ++p) {
+		if (p > 0 || delay_first)
+			i += ft2232_delay_cmd(spi_data, buf + i, spi_data->page_delay_us);
+
+		i += ft2232_set_cs(spi_data, buf + i, true);
+		i += ft2232_write_cmd(buf + i, (const unsigned char[]){ JEDEC_WREN }, 1);
+		i += ft2232_set_cs(spi_data, buf + i, false);
+
+		i += ft2232_set_cs(spi_data, buf + i, true);
+		i += ft2232_write_cmd(buf + i, (const unsigned char[]){ JEDEC_RDSR }, 1);
+		i += ft2232_read_cmds(buf + i, 1);
+		i += ft2232_set_cs(spi_data, buf + i, false);
+
+		cmd[0] = op;
+		for (j = 0; j < addr_len; ++j)
+			cmd[1 + j] = pages[p].addr >> (8 * (addr_len - 1 - j)) & 0xff;
+		i += ft2232_set_cs(spi_data, buf + i, true);
+		i += ft2232_write_cmd_data(buf + i, cmd, 1 + addr_len, pages[p].data, pages[p].len);
+		i += ft2232_set_cs(spi_data, buf + i, false);
+	}
+
+	return ft2232_transfer(&spi_data->ftdi_context, buf, i, status, count);
+}
+
+/*
+ * Wait for WIP to clear, reading the status FT2232_POLL_BATCH times
+ * per USB round trip. On 'H' chips, the reads are spread over a window
+ * that starts at half the typical time and doubles with every round
+ * trip, up to FT2232_POLL_MAX_US between reads. Other chips can't
+ * idle the MPSSE, so the host sleeps through the window and the reads
+ * follow back to back.
+ */
+static int ft2232_spi_poll_busy(struct flashctx *flash, const struct wip_timing *timing)
+{
+	struct ft2232_data *spi_data = flash->mst.spi->data;
+	static unsigned char buf[FT2232_POLL_BATCH * (3 + 13) + 1];
+	uint8_t status[FT2232_POLL_BATCH];
+	unsigned int window = max(timing->typ_us / 2, FT2232_POLL_BATCH);
+	const uint64_t start = monotonic_us();
+	unsigned int waited = 0;
+
+	if (!timing->generic && timing->typ_us >= 4) {
+		waited = timing->typ_us / 4 * 3;
+		programmer_delay(flash, waited);
+	}
+
+	while (true) {
+		const unsigned int interval = min(window / FT2232_POLL_BATCH, FT2232_POLL_MAX_US);
+		size_t i = 0, k;
+
+		if (!spi_data->clk_bytes)
+			programmer_delay(flash, interval * FT2232_POLL_BATCH);
+
+		for (k = 0; k < FT2232_POLL_BATCH; ++k) {
+			if (k > 0 && spi_data->clk_bytes)
+				i += ft2232_delay_cmd(spi_data, buf + i, interval);
+			i += ft2232_set_cs(spi_data, buf + i, true);
+			i += ft2232_write_cmd(buf + i, (const unsigned char[]){ JEDEC_RDSR }, 1);
+			i += ft2232_read_cmds(buf + i, 1);
+			i += ft2232_set_cs(spi_data, buf + i, false);
 		}
+		/* Don't wait for the latency timer to return the results. */
+		buf[i++] = SEND_IMMEDIATE;
 
-		if (cmds->readcnt) {
-			ret = get_buf(ftdic, cmds->readarr, cmds->readcnt);
-			if (ret) {
-				msg_perr("get_buf failed: %i\n", ret);
+		if (ft2232_transfer(&spi_data->ftdi_context, buf, i, status, FT2232_POLL_BATCH))
+			return 1;
+		for (k = 0; k < FT2232_POLL_BATCH; ++k) {
+			if (!(status[k] & SPI_SR_WIP))
+				return 0;
+		}
+
+		waited += interval * FT2232_POLL_BATCH;
+		/* Delays of virtual clocks (cf. dummy) don't show in the wall time. */
+		const uint64_t wall_us = monotonic_us() - start;
+		const unsigned long long elapsed = wall_us > waited ? wall_us : waited;
+		if (elapsed >= timing->max_us) {
+			msg_cerr("Timeout: WIP still set after %llu us, maximum time is %u us.\n",
+				 elapsed, timing->max_us);
+			return TIMEOUT_ERROR;
+		}
+		window = min(window * 2, FT2232_POLL_BATCH * FT2232_POLL_MAX_US);
+	}
+}
+
+/*
+ * Program up to FT2232_WRITE_PAGES pages per USB transfer. Pages that
+ * the chip didn't accept, because the previous program took longer
+ * than expected, are retried one by one and the delay is increased.
+ */
+static int ft2232_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct ft2232_data *spi_data = flash->mst.spi->data;
+	const struct wip_timing *const chip_timing = &flash->chip->spi_timing.page_program;
+	const struct wip_timing timing = chip_timing->typ_us && chip_timing->max_us ? *chip_timing :
+					 (struct wip_timing){ FT2232_PAGE_TYP_US, FT2232_PAGE_MAX_US, true };
+	const unsigned int page_size = min(flash->chip->page_size, 256);
+	const bool native_4ba = flash->chip->feature_bits & FEATURE_4BA_WRITE && spi_master_4ba(flash);
+	const uint8_t op = native_4ba ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
+	const int addr_len = native_4ba || flash->in_4ba_mode ? 4 : 3;
+	bool busy = false;
+
+	if (!spi_data->clk_bytes || !page_size || !len)
+		return default_spi_write_256(flash, buf, start, len);
+
+	if (addr_len == 3) {
+		/* spi_chip_write_256() doesn't cross 16 MiB boundaries. */
+		if (flash->chip->feature_bits & FEATURE_4BA_EAR_ANY) {
+			if (spi_set_extended_address(flash, start >> 24))
+				return 1;
+		} else if ((start + len - 1) >> 24) {
+			return default_spi_write_256(flash, buf, start, len);
+		}
+	}
+
+	if (!spi_data->page_delay_us)
+		spi_data->page_delay_us = timing.typ_us;
+
+	while (len) {
+		struct ft2232_page pages[FT2232_WRITE_PAGES];
+		uint8_t status[FT2232_WRITE_PAGES];
+		bool delayed = false;
+		size_t count, p;
+
+		if (flashprog_cancelled(flash))
+			return 1;
+
+		for (count = 0; count < ARRAY_SIZE(pages) && len; ++count) {
+			pages[count].addr = start;
+			pages[count].data = buf;
+			pages[count].len = min(page_size - start % page_size, len);
+			start += pages[count].len;
+			buf += pages[count].len;
+			len -= pages[count].len;
+		}
+
+		if (ft2232_program_pages(flash, pages, count, busy, op, addr_len, status))
+			return 1;
+		busy = true;
+
+		for (p = 0; p < count; ++p) {
+			if (!ft2232_page_accepted(status[p])) {
+				if (!(status[p] & SPI_SR_WIP)) {
+					msg_cerr("Write enable failed at 0x%06x (status 0x%02x).\n",
+						 pages[p].addr, status[p]);
+					return 1;
+				}
+				/* Later pages of this batch were sent with the same delay. */
+				if (!delayed) {
+					spi_data->page_delay_us = min(spi_data->page_delay_us * 2, timing.max_us);
+					msg_pdbg2("Page program at 0x%06x delayed, waiting %u us now.\n",
+						  pages[p].addr, spi_data->page_delay_us);
+					delayed = true;
+				}
+				if (ft2232_spi_poll_busy(flash, &timing) ||
+				    ft2232_program_pages(flash, &pages[p], 1, false, op, addr_len, &status[p]))
+					return 1;
+				if (!ft2232_page_accepted(status[p])) {
+					msg_cerr("Page program at 0x%06x failed (status 0x%02x).\n",
+						 pages[p].addr, status[p]);
+					return 1;
+				}
+			}
+			flashprog_progress_add(flash, pages[p].len);
+		}
+	}
+
+	return ft2232_spi_poll_busy(flash, &timing);
+}
+
+/*
+ * Program AAI words, up to FT2232_AAI_WORDS per USB transfer. After each
+ * word, the MPSSE idles for the word-program time and reads the status.
+ * A chip ignores words while it is busy, so if a status shows WIP, the
+ * following words may have been lost and the write fails.
+ */
+static int ft2232_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	static const struct wip_timing timing = { JEDEC_AAI_WORD_PROGRAM_DELAY_US, 1000, true };
+	struct ft2232_data *spi_data = flash->mst.spi->data;
+	static unsigned char cmdbuf[FT2232_WREN_CMD_LEN + FT2232_AAI_WORDS * FT2232_AAI_CMD_LEN];
+	uint8_t status[FT2232_AAI_WORDS];
+	unsigned int pos = start;
+	int ret = 0;
+
+	/* AAI takes 3-byte addresses, odd starts and lengths are left to the generic code. */
+	if (!spi_data->clk_bytes || start % 2 || len % 2 || !len || (start + len - 1) >> 24)
+		return default_spi_write_aai(flash, buf, start, len);
+
+	while (pos < start + len && !ret) {
+		const size_t words = min((start + len - pos) / 2, FT2232_AAI_WORDS);
+		size_t i = 0, w;
+
+		if (flashprog_cancelled(flash)) {
+			ret = 1;
+			break;
+		}
+
+		for (w = 0; w < words; ++w) {
+			const unsigned int addr = pos + 2 * w;
+			const uint8_t *const data = buf + addr - start;
+
+			i += ft2232_set_cs(spi_data, cmdbuf + i, true);
+			if (addr == start) {
+				i += ft2232_write_cmd(cmdbuf + i, (const unsigned char[]){ JEDEC_WREN }, 1);
+				i += ft2232_set_cs(spi_data, cmdbuf + i, false);
+				i += ft2232_set_cs(spi_data, cmdbuf + i, true);
+				i += ft2232_write_cmd(cmdbuf + i, (const unsigned char[]){ JEDEC_AAI_WORD_PROGRAM,
+					(addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, data[0], data[1] },
+					JEDEC_AAI_WORD_PROGRAM_OUTSIZE);
+			} else {
+				i += ft2232_write_cmd(cmdbuf + i, (const unsigned char[]){ JEDEC_AAI_WORD_PROGRAM,
+					data[0], data[1] }, JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE);
+			}
+			i += ft2232_set_cs(spi_data, cmdbuf + i, false);
+
+			i += ft2232_delay_cmd(spi_data, cmdbuf + i, JEDEC_AAI_WORD_PROGRAM_DELAY_US);
+			i += ft2232_set_cs(spi_data, cmdbuf + i, true);
+			i += ft2232_write_cmd(cmdbuf + i, (const unsigned char[]){ JEDEC_RDSR }, 1);
+			i += ft2232_read_cmds(cmdbuf + i, 1);
+			i += ft2232_set_cs(spi_data, cmdbuf + i, false);
+		}
+
+		if (ft2232_transfer(&spi_data->ftdi_context, cmdbuf, i, status, words)) {
+			ret = 1;
+			break;
+		}
+		for (w = 0; w < words; ++w) {
+			if ((status[w] & (SPI_SR_WIP | SPI_SR_AAI)) != SPI_SR_AAI) {
+				msg_cerr("AAI word at 0x%06zx not done after %u us (status 0x%02x).\n",
+					 pos + 2 * w, JEDEC_AAI_WORD_PROGRAM_DELAY_US, status[w]);
+				ret = 1;
 				break;
 			}
 		}
+		pos += 2 * words;
+		if (!ret)
+			flashprog_progress_add(flash, 2 * words);
 	}
-	return ret ? -1 : 0;
+
+	/* WRDI exits AAI mode, but not while the last word is still being programmed. */
+	if (ret)
+		ft2232_spi_poll_busy(flash, &timing);
+	if (spi_write_disable(flash)) {
+		msg_cerr("%s failed to disable AAI mode.\n", __func__);
+		ret = 1;
+	}
+	return ret;
 }
 
 static const struct spi_master spi_master_ft2232 = {
-	.features	= SPI_MASTER_4BA,
+	.features	= SPI_MASTER_4BA | SPI_MASTER_BATCH_POLL | SPI_MASTER_GATHER,
 	.max_data_read	= 64 * 1024,
 	.max_data_write	= 256,
 	.command	= default_spi_send_command,
 	.multicommand	= ft2232_spi_send_multicommand,
-	.read		= default_spi_read,
-	.write_256	= default_spi_write_256,
+	.read		= ft2232_spi_read,
+	.write_256	= ft2232_spi_write_256,
+	.write_aai	= ft2232_spi_write_aai,
 	.shutdown	= ft2232_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.poll_busy	= ft2232_spi_poll_busy,
 };
 
 /* Returns 0 upon success, a negative number upon errors. */
@@ -631,6 +1046,10 @@ format_error:
 		msg_perr("Unable to set latency timer (%s).\n", ftdi_get_error_string(ftdic));
 	}
 
+	if (ftdi_read_data_set_chunksize(ftdic, FT2232_USB_CHUNK) < 0) {
+		msg_perr("Unable to set read chunk size (%s).\n", ftdi_get_error_string(ftdic));
+	}
+
 	if (ftdi_set_bitmode(ftdic, 0x00, BITMODE_BITBANG_SPI) < 0) {
 		msg_perr("Unable to set bitmode to SPI (%s).\n", ftdi_get_error_string(ftdic));
 	}
@@ -690,6 +1109,8 @@ format_error:
 	spi_data->cs_bits = cs_bits;
 	spi_data->aux_bits = aux_bits;
 	spi_data->pindir = pindir;
+	spi_data->clk_bytes = clock_5x;
+	spi_data->spi_khz = mpsse_clk * 1000 / divisor;
 
 	return register_spi_master(&spi_master_ft2232, 0, spi_data);
 
@@ -64,15 +64,19 @@ static void gfxnvidia_chip_writeb(const struct flashctx *flash, uint8_t val,
 				  chipaddr addr);
 static uint8_t gfxnvidia_chip_readb(const struct flashctx *flash,
 				    const chipaddr addr);
+static void gfxnvidia_chip_writen(const struct flashctx *flash, const uint8_t *buf,
+				  chipaddr addr, size_t len);
+static void gfxnvidia_chip_readn(const struct flashctx *flash, uint8_t *buf,
+				 const chipaddr addr, size_t len);
 static const struct par_master par_master_gfxnvidia = {
 	.chip_readb	= gfxnvidia_chip_readb,
 	.chip_readw	= fallback_chip_readw,
 	.chip_readl	= fallback_chip_readl,
-	.chip_readn	= fallback_chip_readn,
+	.chip_readn	= gfxnvidia_chip_readn,
 	.chip_writeb	= gfxnvidia_chip_writeb,
 	.chip_writew	= fallback_chip_writew,
 	.chip_writel	= fallback_chip_writel,
-	.chip_writen	= fallback_chip_writen,
+	.chip_writen	= gfxnvidia_chip_writen,
 };
 
 static int gfxnvidia_init(struct flashprog_programmer *const prog)
@@ -101,7 +105,7 @@ static int gfxnvidia_init(struct flashprog_programmer *const prog)
 	rpci_write_long(dev, 0x50, reg32);
 
 	/* Write/erase doesn't work. */
-	programmer_may_write = false;
+	prog->may_write = false;
 	return register_par_master(&par_master_gfxnvidia, BUS_PARALLEL, 0, NULL);
 }
 
@@ -117,6 +121,35 @@ static uint8_t gfxnvidia_chip_readb(const struct flashctx *flash,
 	return pci_mmio_readb(nvidia_bar + (addr & GFXNVIDIA_MEMMAP_MASK));
 }
 
+/* Length of the access at `addr`, up to `len` but not beyond the end of the 128kB window. */
+static size_t gfxnvidia_window_len(const chipaddr addr, const size_t len)
+{
+	return min(len, GFXNVIDIA_MEMMAP_MASK + 1 - (addr & GFXNVIDIA_MEMMAP_MASK));
+}
+
+/* Flash writes have to be single byte cycles. */
+static void gfxnvidia_chip_writen(const struct flashctx *flash, const uint8_t *buf,
+				  chipaddr addr, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		pci_mmio_writeb(buf[i], nvidia_bar + ((addr + i) & GFXNVIDIA_MEMMAP_MASK));
+}
+
+/* The PROM window answers 32-bit reads, which take a single PCI transaction. */
+static void gfxnvidia_chip_readn(const struct flashctx *flash, uint8_t *buf,
+				 const chipaddr addr, size_t len)
+{
+	size_t done, chunk;
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = gfxnvidia_window_len(addr + done, len - done);
+		mmio_readn_aligned(nvidia_bar + ((addr + done) & GFXNVIDIA_MEMMAP_MASK),
+				   buf + done, chunk, 4);
+	}
+}
+
 const struct programmer_entry programmer_gfxnvidia = {
 	.name			= "gfxnvidia",
 	.type			= PCI,
@@ -22,13 +22,279 @@
 
 #ifndef __LIBPAYLOAD__
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+#endif
+
+#if IS_WINDOWS
+#include <windows.h>
+#undef min
+#undef max
+#endif
+
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
 #endif
 
 #include "flash.h"
 
-int read_buf_from_file(unsigned char *buf, unsigned long size,
-		       const char *filename)
+/*
+ * Image files may be compressed with xz or zstd. Input is recognized by
+ * its magic bytes and decoded straight into the image buffer, output is
+ * compressed if the file name ends in `.xz` or `.zst`. Either format is
+ * only available if flashprog was built with the respective library.
+ */
+
+enum image_compression {
+	IMAGE_RAW,
+	IMAGE_XZ,
+	IMAGE_ZSTD,
+};
+
+#define IMAGE_MAGIC_LEN		6
+#define IMAGE_CHUNK_SIZE	(64*KiB)
+
+static enum image_compression compression_by_name(const char *const filename)
+{
+	const size_t len = strlen(filename);
+
+	if (len > 3 && !strcmp(filename + len - 3, ".xz"))
+		return IMAGE_XZ;
+	if (len > 4 && !strcmp(filename + len - 4, ".zst"))
+		return IMAGE_ZSTD;
+	return IMAGE_RAW;
+}
+
+/* Tell whether writing to `filename` compresses the image. */
+bool image_name_compressed(const char *const filename)
+{
+	return compression_by_name(filename) != IMAGE_RAW;
+}
+
+#ifndef __LIBPAYLOAD__
+static const char *compression_name(const enum image_compression compression)
+{
+	switch (compression) {
+	case IMAGE_XZ:		return "xz";
+	case IMAGE_ZSTD:	return "zstd";
+	default:		return "raw";
+	}
+}
+
+static enum image_compression compression_by_magic(const unsigned char *const head, const size_t len)
+{
+	static const unsigned char xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+	static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	if (len >= sizeof(xz_magic) && !memcmp(head, xz_magic, sizeof(xz_magic)))
+		return IMAGE_XZ;
+	if (len >= sizeof(zstd_magic) && !memcmp(head, zstd_magic, sizeof(zstd_magic)))
+		return IMAGE_ZSTD;
+	return IMAGE_RAW;
+}
+
+static bool compression_supported(const enum image_compression compression, const char *const filename)
+{
+	const bool supported =
+#ifdef HAVE_LIBLZMA
+		compression == IMAGE_XZ ||
+#endif
+#ifdef HAVE_LIBZSTD
+		compression == IMAGE_ZSTD ||
+#endif
+		compression == IMAGE_RAW;
+
+	if (!supported) {
+		const char *const name = compression_name(compression);
+		msg_gerr("Error: Image \"%s\" calls for %s compression, but this flashprog "
+			 "was built without %s support.\n", filename, name, name);
+	}
+	return supported;
+}
+#endif
+
+#if !defined(__LIBPAYLOAD__) && (defined(HAVE_LIBLZMA) || defined(HAVE_LIBZSTD))
+static int decompress_size_check(const unsigned long got, const unsigned long size,
+				 const bool more, const char *const filename)
+{
+	if (more) {
+		msg_gerr("Error: Decompressed image \"%s\" is larger than the flash chip (%lu B)!\n",
+			 filename, size);
+		return 1;
+	}
+	if (got != size) {
+		msg_gerr("Error: Decompressed image size (%lu B) doesn't match the flash chip's size (%lu B)!\n",
+			 got, size);
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+#if !defined(__LIBPAYLOAD__) && defined(HAVE_LIBLZMA)
+static int decompress_xz(FILE *const file, unsigned char *const in, const size_t head_len,
+			 unsigned char *const buf, const unsigned long size, const char *const filename,
+			 image_load_progress *const progress, void *const arg)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret lret;
+	int ret = 1;
+
+	if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		msg_gerr("Error: Initializing the xz decoder failed.\n");
+		return 1;
+	}
+
+	strm.next_in = in;
+	strm.avail_in = head_len;
+	strm.next_out = buf;
+	strm.avail_out = size;
+	while (1) {
+		if (!strm.avail_in && action == LZMA_RUN) {
+			strm.next_in = in;
+			strm.avail_in = fread(in, 1, IMAGE_CHUNK_SIZE, file);
+			if (ferror(file)) {
+				msg_gerr("Error: Reading file \"%s\" failed: %s\n", filename, strerror(errno));
+				goto _end_ret;
+			}
+			if (feof(file))
+				action = LZMA_FINISH;
+		}
+		lret = lzma_code(&strm, action);
+		if (progress && (lret == LZMA_OK || lret == LZMA_STREAM_END))
+			progress(size - strm.avail_out, arg);
+		if (lret == LZMA_STREAM_END)
+			break;
+		if (lret == LZMA_BUF_ERROR && !strm.avail_out) {
+			ret = decompress_size_check(size, size, true, filename);
+			goto _end_ret;
+		}
+		if (lret != LZMA_OK) {
+			msg_gerr("Error: Decompressing file \"%s\" failed (xz error %d).\n", filename, lret);
+			goto _end_ret;
+		}
+	}
+	ret = decompress_size_check(size - strm.avail_out, size, false, filename);
+
+_end_ret:
+	lzma_end(&strm);
+	return ret;
+}
+#endif
+
+#if !defined(__LIBPAYLOAD__) && defined(HAVE_LIBZSTD)
+static int decompress_zstd(FILE *const file, unsigned char *const in, const size_t head_len,
+			   unsigned char *const buf, const unsigned long size, const char *const filename,
+			   image_load_progress *const progress, void *const arg)
+{
+	ZSTD_inBuffer input = { in, head_len, 0 };
+	ZSTD_outBuffer output = { buf, size, 0 };
+	size_t zret = 0;
+	int ret = 1;
+
+	ZSTD_DCtx *const dctx = ZSTD_createDCtx();
+	if (!dctx) {
+		msg_gerr("Error: Initializing the zstd decoder failed.\n");
+		return 1;
+	}
+
+	while (1) {
+		if (input.pos == input.size) {
+			if (feof(file))
+				break;
+			input.size = fread(in, 1, IMAGE_CHUNK_SIZE, file);
+			input.pos = 0;
+			if (ferror(file)) {
+				msg_gerr("Error: Reading file \"%s\" failed: %s\n", filename, strerror(errno));
+				goto _free_ret;
+			}
+			if (!input.size)
+				continue;
+		}
+		const size_t in_pos = input.pos, out_pos = output.pos;
+		zret = ZSTD_decompressStream(dctx, &output, &input);
+		if (ZSTD_isError(zret)) {
+			msg_gerr("Error: Decompressing file \"%s\" failed: %s\n",
+				 filename, ZSTD_getErrorName(zret));
+			goto _free_ret;
+		}
+		/* No progress with input left means the output is full. */
+		if (input.pos == in_pos && output.pos == out_pos) {
+			ret = decompress_size_check(size, size, true, filename);
+			goto _free_ret;
+		}
+		if (progress)
+			progress(output.pos, arg);
+	}
+	if (zret) {
+		msg_gerr("Error: Compressed file \"%s\" is truncated.\n", filename);
+		goto _free_ret;
+	}
+	ret = decompress_size_check(output.pos, size, false, filename);
+
+_free_ret:
+	ZSTD_freeDCtx(dctx);
+	return ret;
+}
+#endif
+
+#ifndef __LIBPAYLOAD__
+/* Decode the rest of `file`, whose first `head_len` bytes were already read into `head`. */
+static int decompress_file(FILE *const file, const enum image_compression compression,
+			   const unsigned char *const head, const size_t head_len,
+			   unsigned char *const buf, const unsigned long size, const char *const filename,
+			   image_load_progress *const progress, void *const arg)
+{
+	unsigned char *in;
+	int ret = 1;
+
+	if (!compression_supported(compression, filename))
+		return 1;
+
+	in = malloc(IMAGE_CHUNK_SIZE);
+	if (!in) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	memcpy(in, head, head_len);
+
+	msg_gdbg("Decompressing %s image \"%s\".\n", compression_name(compression), filename);
+	switch (compression) {
+#ifdef HAVE_LIBLZMA
+	case IMAGE_XZ:
+		ret = decompress_xz(file, in, head_len, buf, size, filename, progress, arg);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case IMAGE_ZSTD:
+		ret = decompress_zstd(file, in, head_len, buf, size, filename, progress, arg);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	free(in);
+	return ret;
+}
+#endif
+
+/*
+ * Like read_buf_from_file(), but `progress` is called whenever more of the
+ * image is available in `buf`, with the number of bytes from the start.
+ * The last call doesn't mean success, the file may still turn out to be
+ * too long or broken.
+ */
+int read_buf_from_file_progress(unsigned char *buf, unsigned long size, const char *filename,
+				image_load_progress *progress, void *arg)
 {
 #ifdef __LIBPAYLOAD__
 	msg_gerr("Error: No file I/O support in libpayload\n");
@@ -52,14 +318,38 @@ int read_buf_from_file(unsigned char *buf, unsigned long size,
 		ret = 1;
 		goto out;
 	}
-	if ((image_stat.st_size != (intmax_t)size) && strcmp(filename, "-")) {
+
+	/* A file of the right size is taken as is, whatever it starts with. */
+	const bool size_matches = image_stat.st_size == (intmax_t)size;
+	unsigned char head[IMAGE_MAGIC_LEN];
+	const size_t head_len = fread(head, 1, min(sizeof(head), size), image);
+	if (!size_matches || !strcmp(filename, "-")) {
+		const enum image_compression compression = compression_by_magic(head, head_len);
+		if (compression != IMAGE_RAW) {
+			ret = decompress_file(image, compression, head, head_len, buf, size, filename,
+					      progress, arg);
+			goto out;
+		}
+	}
+	if (!size_matches && strcmp(filename, "-")) {
 		msg_gerr("Error: Image size (%jd B) doesn't match the flash chip's size (%lu B)!\n",
 			 (intmax_t)image_stat.st_size, size);
 		ret = 1;
 		goto out;
 	}
 
-	unsigned long numbytes = fread(buf, 1, size, image);
+	memcpy(buf, head, head_len);
+	unsigned long numbytes = head_len;
+	if (!progress) {
+		numbytes += fread(buf + head_len, 1, size - head_len, image);
+	} else {
+		size_t got;
+		do {
+			got = fread(buf + numbytes, 1, min(IMAGE_CHUNK_SIZE, size - numbytes), image);
+			numbytes += got;
+			progress(numbytes, arg);
+		} while (got && numbytes < size);
+	}
 	if (numbytes != size) {
 		msg_gerr("Error: Failed to read complete file. Got %ld bytes, "
 			 "wanted %ld!\n", numbytes, size);
@@ -71,54 +361,484 @@ out:
 #endif
 }
 
-int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
+int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename)
+{
+	return read_buf_from_file_progress(buf, size, filename, NULL, NULL);
+}
+
+#ifndef __LIBPAYLOAD__
+/*
+ * Output files are written under a temporary name in the same directory
+ * and only renamed once complete, so a failed read doesn't destroy an
+ * older image. Anything that isn't a regular file (e.g. devices, pipes
+ * or symlinks) is written in place.
+ *
+ * Returns the temporary name, or NULL to write `filename` in place.
+ */
+static char *output_tmpname(const char *const filename)
+{
+	struct stat st;
+
+#if IS_WINDOWS
+	if (!stat(filename, &st) && !S_ISREG(st.st_mode))
+#else
+	if (!lstat(filename, &st) && !S_ISREG(st.st_mode))
+#endif
+		return NULL;
+
+	const size_t len = strlen(filename) + 32;
+	char *const tmpname = malloc(len);
+	if (tmpname)
+		snprintf(tmpname, len, "%s.%ld.tmp", filename, (long)getpid());
+	return tmpname;
+}
+
+/*
+ * Returns 0 on success, 1 if `tmpname` couldn't replace `filename`. The
+ * complete image is then kept under `tmpname`, so it isn't lost.
+ */
+static int output_replace(const char *const tmpname, const char *const filename)
+{
+#if IS_WINDOWS
+	/* rename() doesn't replace existing files here, MoveFileEx() does. */
+	if (MoveFileEx(tmpname, filename, MOVEFILE_REPLACE_EXISTING))
+		return 0;
+	msg_gerr("Error: renaming \"%s\" to \"%s\" failed: error %lu\n", tmpname, filename, GetLastError());
+#else
+	if (!rename(tmpname, filename))
+		return 0;
+	msg_gerr("Error: renaming \"%s\" to \"%s\" failed: %s\n", tmpname, filename, strerror(errno));
+#endif
+	msg_gerr("The image was kept as \"%s\".\n", tmpname);
+	return 1;
+}
+#endif
+
+/*
+ * An image stream writes an image to a file, or stdout for `-`, in pieces,
+ * compressing it on the fly if the file name asks for it. This way, reads
+ * can be stored while the rest of the chip is still being transferred.
+ */
+struct image_stream {
+	FILE *file;
+	const char *filename;
+	char *tmpname;		/* written instead of `filename` until committed */
+	enum image_compression compression;
+	bool is_stdout;
+#ifdef HAVE_LIBLZMA
+	lzma_stream xz;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_CCtx *zstd;
+#endif
+	unsigned char *out;
+};
+
+#ifndef __LIBPAYLOAD__
+static int image_stream_fwrite(struct image_stream *const stream, const void *const data, const size_t len)
+{
+	if (fwrite(data, 1, len, stream->file) != len) {
+		if (stream->is_stdout)
+			msg_gerr("Error: Writing image to stdout failed: %s\n", strerror(errno));
+		else
+			msg_gerr("Error: file %s could not be written completely.\n", stream->filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* Feed `len` bytes into the encoder, or flush it with `finish`. */
+static int image_stream_encode(struct image_stream *const stream,
+			       const void *const data, const size_t len, const bool finish)
+{
+	switch (stream->compression) {
+#ifdef HAVE_LIBLZMA
+	case IMAGE_XZ: {
+		lzma_stream *const strm = &stream->xz;
+		strm->next_in = data;
+		strm->avail_in = len;
+		while (strm->avail_in || finish) {
+			strm->next_out = stream->out;
+			strm->avail_out = IMAGE_CHUNK_SIZE;
+			const lzma_ret lret = lzma_code(strm, finish ? LZMA_FINISH : LZMA_RUN);
+			if (lret != LZMA_OK && lret != LZMA_STREAM_END) {
+				msg_gerr("Error: Compressing file \"%s\" failed (xz error %d).\n",
+					 stream->filename, lret);
+				return 1;
+			}
+			if (image_stream_fwrite(stream, stream->out, IMAGE_CHUNK_SIZE - strm->avail_out))
+				return 1;
+			if (lret == LZMA_STREAM_END)
+				break;
+		}
+		return 0;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case IMAGE_ZSTD: {
+		ZSTD_inBuffer input = { data, len, 0 };
+		size_t remaining;
+		do {
+			ZSTD_outBuffer output = { stream->out, IMAGE_CHUNK_SIZE, 0 };
+			remaining = ZSTD_compressStream2(stream->zstd, &output, &input,
+							 finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining)) {
+				msg_gerr("Error: Compressing file \"%s\" failed: %s\n",
+					 stream->filename, ZSTD_getErrorName(remaining));
+				return 1;
+			}
+			if (image_stream_fwrite(stream, stream->out, output.pos))
+				return 1;
+		} while (input.pos < input.size || (finish && remaining));
+		return 0;
+	}
+#endif
+	default:
+		return image_stream_fwrite(stream, data, len);
+	}
+}
+
+static int image_stream_init_encoder(struct image_stream *const stream)
+{
+	switch (stream->compression) {
+#ifdef HAVE_LIBLZMA
+	case IMAGE_XZ:
+		stream->xz = (lzma_stream)LZMA_STREAM_INIT;
+		if (lzma_easy_encoder(&stream->xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64) != LZMA_OK) {
+			msg_gerr("Error: Initializing the xz encoder failed.\n");
+			return 1;
+		}
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case IMAGE_ZSTD:
+		stream->zstd = ZSTD_createCCtx();
+		if (!stream->zstd ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(stream->zstd, ZSTD_c_checksumFlag, 1))) {
+			msg_gerr("Error: Initializing the zstd encoder failed.\n");
+			ZSTD_freeCCtx(stream->zstd);
+			return 1;
+		}
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	stream->out = malloc(IMAGE_CHUNK_SIZE);
+	if (!stream->out) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static void image_stream_end_encoder(struct image_stream *const stream)
+{
+	switch (stream->compression) {
+#ifdef HAVE_LIBLZMA
+	case IMAGE_XZ:
+		lzma_end(&stream->xz);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case IMAGE_ZSTD:
+		ZSTD_freeCCtx(stream->zstd);
+		break;
+#endif
+	default:
+		break;
+	}
+	free(stream->out);
+}
+#endif
+
+struct image_stream *image_stream_create(const char *const filename)
 {
 #ifdef __LIBPAYLOAD__
 	msg_gerr("Error: No file I/O support in libpayload\n");
-	return 1;
+	return NULL;
 #else
-	FILE *image;
-	int ret = 0;
-
 	if (!filename) {
 		msg_gerr("No filename specified.\n");
-		return 1;
+		return NULL;
 	}
-	if ((image = fopen(filename, "wb")) == NULL) {
-		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
-		return 1;
+
+	struct image_stream *const stream = calloc(1, sizeof(*stream));
+	if (!stream) {
+		msg_gerr("Out of memory!\n");
+		return NULL;
 	}
+	stream->filename = filename;
+	stream->is_stdout = !strcmp(filename, "-");
+	stream->compression = stream->is_stdout ? IMAGE_RAW : compression_by_name(filename);
 
-	unsigned long numbytes = fwrite(buf, 1, size, image);
-	if (numbytes != size) {
-		msg_gerr("Error: file %s could not be written completely.\n", filename);
-		ret = 1;
-		goto out;
+	if (!compression_supported(stream->compression, filename))
+		goto _free_ret;
+	if (stream->compression != IMAGE_RAW)
+		msg_gdbg("Compressing image \"%s\" with %s.\n",
+			 filename, compression_name(stream->compression));
+
+	if (stream->is_stdout) {
+		stream->file = fdopen(fileno(stdout), "wb");
+	} else {
+		stream->tmpname = output_tmpname(filename);
+		stream->file = fopen(stream->tmpname ? stream->tmpname : filename, "wb");
+	}
+	if (!stream->file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n",
+			 stream->tmpname ? stream->tmpname : filename, strerror(errno));
+		goto _free_ret;
 	}
-	if (fflush(image)) {
-		msg_gerr("Error: flushing file \"%s\" failed: %s\n", filename, strerror(errno));
+
+	if (image_stream_init_encoder(stream)) {
+		(void)fclose(stream->file);
+		if (!stream->is_stdout)
+			(void)remove(stream->tmpname ? stream->tmpname : filename);
+		goto _free_ret;
+	}
+	return stream;
+
+_free_ret:
+	free(stream->tmpname);
+	free(stream);
+	return NULL;
+#endif
+}
+
+int image_stream_write(struct image_stream *const stream, const void *const data, const size_t len)
+{
+#ifdef __LIBPAYLOAD__
+	return 1;
+#else
+	return image_stream_encode(stream, data, len, false);
+#endif
+}
+
+/*
+ * Finish and close an image stream. If `commit` is false, the partial
+ * output file is removed again.
+ *
+ * Returns 0 on success, 1 if storing the contents failed.
+ */
+int image_stream_close(struct image_stream *const stream, const bool commit)
+{
+#ifdef __LIBPAYLOAD__
+	return 1;
+#else
+	int ret = 0;
+
+	if (commit && stream->compression != IMAGE_RAW)
+		ret = image_stream_encode(stream, NULL, 0, true);
+	image_stream_end_encoder(stream);
+
+	if (commit && !ret && fflush(stream->file)) {
+		msg_gerr("Error: flushing file \"%s\" failed: %s\n", stream->filename, strerror(errno));
 		ret = 1;
 	}
 	// Try to fsync() only regular files and if that function is available at all (e.g. not on MinGW).
 #if defined(_POSIX_FSYNC) && (_POSIX_FSYNC != -1)
 	struct stat image_stat;
-	if (fstat(fileno(image), &image_stat) != 0) {
-		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
-		ret = 1;
-		goto out;
-	}
-	if (S_ISREG(image_stat.st_mode)) {
-		if (fsync(fileno(image))) {
-			msg_gerr("Error: fsyncing file \"%s\" failed: %s\n", filename, strerror(errno));
+	if (commit && !ret) {
+		if (fstat(fileno(stream->file), &image_stat) != 0) {
+			msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n",
+				 stream->filename, strerror(errno));
+			ret = 1;
+		} else if (S_ISREG(image_stat.st_mode) && fsync(fileno(stream->file))) {
+			msg_gerr("Error: fsyncing file \"%s\" failed: %s\n", stream->filename, strerror(errno));
 			ret = 1;
 		}
 	}
 #endif
-out:
-	if (fclose(image)) {
-		msg_gerr("Error: closing file \"%s\" failed: %s\n", filename, strerror(errno));
+	if (fclose(stream->file) && commit && !ret) {
+		msg_gerr("Error: closing file \"%s\" failed: %s\n", stream->filename, strerror(errno));
 		ret = 1;
 	}
+	if (stream->tmpname) {
+		if (commit && !ret)
+			ret = output_replace(stream->tmpname, stream->filename);
+		else
+			(void)remove(stream->tmpname);
+	} else if (!commit && !stream->is_stdout) {
+		(void)remove(stream->filename);
+	}
+
+	free(stream->tmpname);
+	free(stream);
 	return ret;
 #endif
 }
+
+int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
+{
+	struct image_stream *const stream = image_stream_create(filename);
+	if (!stream)
+		return 1;
+
+	const int ret = image_stream_write(stream, buf, size);
+	return image_stream_close(stream, true) || ret;
+}
+
+/*
+ * Image buffers are backed by a mapping of the image file where possible,
+ * so large images are neither copied into a separate buffer nor held in
+ * memory twice. Input files are mapped privately: changes to the buffer
+ * stay local and are never written back. Output files are created under
+ * a temporary name with their final size and mapped shared, so the data
+ * lands directly in the page cache. If a file can't be mapped (e.g. stdin,
+ * a pipe, or a system without mmap()), a malloc'd buffer and stdio are
+ * used instead.
+ */
+
+#ifdef HAVE_MMAP
+/* Returns 0 on success, 1 if the file can't be mapped, -1 on a fatal error. */
+static int image_map(struct image_buf *const image, const char *const filename, const bool output)
+{
+	struct stat st;
+
+	/* Compressed images go through stdio. */
+	if (output && image_name_compressed(filename))
+		return 1;
+	/* Anything that isn't replaced by a regular file goes through stdio too. */
+	if (output && !(image->tmpname = output_tmpname(filename)))
+		return 1;
+
+	const int fd = output ? open(image->tmpname, O_RDWR | O_CREAT | O_EXCL, 0666) : open(filename, O_RDONLY);
+	if (fd < 0)
+		goto _free_ret;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		goto _close_ret;
+	if (output && ftruncate(fd, image->size))
+		goto _close_ret;
+	if (!output && st.st_size != (intmax_t)image->size) {
+		unsigned char head[IMAGE_MAGIC_LEN];
+		const ssize_t head_len = read(fd, head, sizeof(head));
+		if (head_len > 0 && compression_by_magic(head, head_len) != IMAGE_RAW)
+			goto _close_ret;
+		msg_gerr("Error: Image size (%jd B) doesn't match the flash chip's size (%lu B)!\n",
+			 (intmax_t)st.st_size, image->size);
+		close(fd);
+		return -1;
+	}
+
+	void *const map = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+			       output ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto _close_ret;
+
+	close(fd);
+	image->buf = map;
+	image->mapped = true;
+	return 0;
+
+_close_ret:
+	close(fd);
+	if (output)
+		(void)remove(image->tmpname);
+_free_ret:
+	free(image->tmpname);
+	image->tmpname = NULL;
+	return 1;
+}
+#endif
+
+static int image_alloc(struct image_buf *const image, const unsigned long size,
+		       const char *const filename, const bool output)
+{
+	image->buf = NULL;
+	image->size = size;
+	image->filename = filename;
+	image->tmpname = NULL;
+	image->output = output;
+	image->mapped = false;
+
+	if (!size) {
+		msg_gerr("Error: Empty image!\n");
+		return 1;
+	}
+
+#ifdef HAVE_MMAP
+	if (strcmp(filename, "-")) {
+		const int ret = image_map(image, filename, output);
+		if (ret == 0)
+			return 0;
+		if (ret < 0)
+			return 1;
+	}
+#endif
+
+	image->buf = malloc(size);
+	if (!image->buf) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Provide the contents of `filename`, which must be `size` bytes long, in `image->buf`. */
+/*
+ * Provide a buffer for the contents of `filename` without reading them
+ * yet. If the file could be mapped, the buffer is already complete,
+ * otherwise the caller has to fill it with read_buf_from_file().
+ */
+int image_buf_alloc(struct image_buf *const image, const unsigned long size, const char *const filename)
+{
+	return image_alloc(image, size, filename, false);
+}
+
+int image_buf_open(struct image_buf *const image, const unsigned long size, const char *const filename)
+{
+	if (image_buf_alloc(image, size, filename))
+		return 1;
+	if (!image->mapped && read_buf_from_file(image->buf, size, filename)) {
+		image_buf_close(image, false);
+		return 1;
+	}
+	return 0;
+}
+
+/* Provide a buffer of `size` bytes that will be written to `filename` by image_buf_close(). */
+int image_buf_create(struct image_buf *const image, const unsigned long size, const char *const filename)
+{
+	return image_alloc(image, size, filename, true);
+}
+
+/*
+ * Release an image buffer. For output buffers, `commit` tells whether the
+ * contents should be stored. The temporary file that was already created
+ * for the mapping then replaces `filename`, or is removed again if not.
+ *
+ * Returns 0 on success, 1 if storing the contents failed.
+ */
+int image_buf_close(struct image_buf *const image, const bool commit)
+{
+	int ret = 0;
+
+	if (!image->buf)
+		return 0;
+
+	if (!image->mapped) {
+		if (image->output && commit)
+			ret = write_buf_to_file(image->buf, image->size, image->filename);
+		free(image->buf);
+		image->buf = NULL;
+		return ret;
+	}
+
+#ifdef HAVE_MMAP
+	if (image->output && commit && msync(image->buf, image->size, MS_SYNC)) {
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", image->filename, strerror(errno));
+		ret = 1;
+	}
+	munmap(image->buf, image->size);
+	if (image->output && commit && !ret)
+		ret = output_replace(image->tmpname, image->filename);
+	else if (image->output)
+		(void)remove(image->tmpname);
+	free(image->tmpname);
+	image->tmpname = NULL;
+#endif
+	image->buf = NULL;
+	return ret;
+}
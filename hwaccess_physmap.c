@@ -216,6 +216,8 @@ static void sys_physunmap_unaligned(void *virt_addr, size_t len)
 #define PHYSM_CLEANUP	1
 #define PHYSM_EXACT	0
 #define PHYSM_ROUND	1
+#define PHYSM_VERBOSE	0
+#define PHYSM_QUIET	1
 
 /* Round start to nearest page boundary below and set len so that the resulting address range ends at the lowest
  * possible page boundary where the original address range is still entirely contained. It returns the
@@ -237,6 +239,54 @@ static uintptr_t round_to_page_boundaries(uintptr_t *start, size_t *len)
 	return old_start - *start;
 }
 
+/*
+ * Mappings are shared: a request that lies within an existing mapping of
+ * the same type gets a view into it. Each entry counts its users and is
+ * unmapped when the last one is gone.
+ */
+struct physmap_entry {
+	struct physmap_entry *next;
+	uintptr_t phys_addr;
+	size_t len;
+	void *virt_addr;
+	bool readonly;
+	unsigned int refcount;
+};
+static struct physmap_entry *physmap_entries;
+
+static void *physmap_cache_get(uintptr_t phys_addr, size_t len, bool readonly)
+{
+	struct physmap_entry *entry;
+
+	for (entry = physmap_entries; entry; entry = entry->next) {
+		if (entry->readonly != readonly || phys_addr < entry->phys_addr ||
+		    phys_addr - entry->phys_addr > entry->len ||
+		    len > entry->len - (phys_addr - entry->phys_addr))
+			continue;
+		++entry->refcount;
+		msg_gspew("Reusing mapping of 0x%zx bytes at 0x%0*" PRIxPTR ".\n",
+			  entry->len, PRIxPTR_WIDTH, entry->phys_addr);
+		return (uint8_t *)entry->virt_addr + (phys_addr - entry->phys_addr);
+	}
+	return NULL;
+}
+
+static int physmap_cache_add(uintptr_t phys_addr, size_t len, void *virt_addr, bool readonly)
+{
+	struct physmap_entry *const entry = malloc(sizeof(*entry));
+	if (!entry)
+		return 1;
+
+	entry->phys_addr	= phys_addr;
+	entry->len		= len;
+	entry->virt_addr	= virt_addr;
+	entry->readonly		= readonly;
+	entry->refcount		= 1;
+	entry->next		= physmap_entries;
+	physmap_entries		= entry;
+	return 0;
+}
+
 struct undo_physmap_data {
 	void *virt_addr;
 	size_t len;
@@ -255,7 +305,7 @@ static int undo_physmap(void *data)
 }
 
 static void *physmap_common(const char *descr, uintptr_t phys_addr, size_t len, bool readonly, bool autocleanup,
-			    bool round)
+			    bool round, bool quiet)
 {
 	void *virt_addr;
 	uintptr_t offset = 0;
@@ -268,6 +318,10 @@ static void *physmap_common(const char *descr, uintptr_t phys_addr, size_t len,
 	if (round)
 		offset = round_to_page_boundaries(&phys_addr, &len);
 
+	virt_addr = physmap_cache_get(phys_addr, len, readonly);
+	if (virt_addr)
+		goto _mapped;
+
 	if (readonly)
 		virt_addr = sys_physmap_ro_cached(phys_addr, len);
 	else
@@ -276,6 +330,11 @@ static void *physmap_common(const char *descr, uintptr_t phys_addr, size_t len,
 	if (ERROR_PTR == virt_addr) {
 		if (NULL == descr)
 			descr = "memory";
+		if (quiet) {
+			msg_pdbg("Not mapping %s, 0x%zx bytes at 0x%0*" PRIxPTR ": %s\n",
+				 descr, len, PRIxPTR_WIDTH, phys_addr, strerror(errno));
+			return ERROR_PTR;
+		}
 		msg_perr("Error accessing %s, 0x%zx bytes at 0x%0*" PRIxPTR "\n",
 			 descr, len, PRIxPTR_WIDTH, phys_addr);
 		msg_perr(MEM_DEV " mmap failed: %s\n", strerror(errno));
@@ -295,6 +354,13 @@ static void *physmap_common(const char *descr, uintptr_t phys_addr, size_t len,
 		return ERROR_PTR;
 	}
 
+	if (physmap_cache_add(phys_addr, len, virt_addr, readonly)) {
+		msg_perr("%s: Out of memory!\n", __func__);
+		sys_physunmap_unaligned(virt_addr, len);
+		return ERROR_PTR;
+	}
+
+_mapped:
 	if (autocleanup) {
 		struct undo_physmap_data *d = malloc(sizeof(*d));
 		if (d == NULL) {
@@ -317,6 +383,8 @@ static void *physmap_common(const char *descr, uintptr_t phys_addr, size_t len,
 
 void physunmap_unaligned(void *virt_addr, size_t len)
 {
+	struct physmap_entry **entry;
+
 	/* No need to check for zero size, such mappings would have yielded ERROR_PTR. */
 	if (virt_addr == ERROR_PTR) {
 		msg_perr("Trying to unmap a nonexisting mapping!\n"
@@ -324,7 +392,23 @@ void physunmap_unaligned(void *virt_addr, size_t len)
 		return;
 	}
 
-	sys_physunmap_unaligned(virt_addr, len);
+	for (entry = &physmap_entries; *entry; entry = &(*entry)->next) {
+		const uintptr_t start = (uintptr_t)(*entry)->virt_addr;
+		const uintptr_t addr = (uintptr_t)virt_addr;
+		if (addr < start || addr - start > (*entry)->len || len > (*entry)->len - (addr - start))
+			continue;
+
+		struct physmap_entry *const found = *entry;
+		if (--found->refcount)
+			return;
+		*entry = found->next;
+		sys_physunmap_unaligned(found->virt_addr, found->len);
+		free(found);
+		return;
+	}
+
+	msg_perr("Trying to unmap an unknown mapping!\n"
+		 "Please report a bug at flashprog@flashprog.org\n");
 }
 
 void physunmap(void *virt_addr, size_t len)
@@ -349,22 +433,28 @@ void physunmap(void *virt_addr, size_t len)
 
 void *physmap(const char *descr, uintptr_t phys_addr, size_t len)
 {
-	return physmap_common(descr, phys_addr, len, PHYSM_RW, PHYSM_NOCLEANUP, PHYSM_ROUND);
+	return physmap_common(descr, phys_addr, len, PHYSM_RW, PHYSM_NOCLEANUP, PHYSM_ROUND, PHYSM_VERBOSE);
 }
 
 void *rphysmap(const char *descr, uintptr_t phys_addr, size_t len)
 {
-	return physmap_common(descr, phys_addr, len, PHYSM_RW, PHYSM_CLEANUP, PHYSM_ROUND);
+	return physmap_common(descr, phys_addr, len, PHYSM_RW, PHYSM_CLEANUP, PHYSM_ROUND, PHYSM_VERBOSE);
+}
+
+/* Like rphysmap(), for mappings that are only an optimization. Failure is no error. */
+void *rphysmap_optional(const char *descr, uintptr_t phys_addr, size_t len)
+{
+	return physmap_common(descr, phys_addr, len, PHYSM_RW, PHYSM_CLEANUP, PHYSM_ROUND, PHYSM_QUIET);
 }
 
 void *physmap_ro(const char *descr, uintptr_t phys_addr, size_t len)
 {
-	return physmap_common(descr, phys_addr, len, PHYSM_RO, PHYSM_NOCLEANUP, PHYSM_ROUND);
+	return physmap_common(descr, phys_addr, len, PHYSM_RO, PHYSM_NOCLEANUP, PHYSM_ROUND, PHYSM_VERBOSE);
 }
 
 void *physmap_ro_unaligned(const char *descr, uintptr_t phys_addr, size_t len)
 {
-	return physmap_common(descr, phys_addr, len, PHYSM_RO, PHYSM_NOCLEANUP, PHYSM_EXACT);
+	return physmap_common(descr, phys_addr, len, PHYSM_RO, PHYSM_NOCLEANUP, PHYSM_EXACT, PHYSM_VERBOSE);
 }
 
 /* Prevent reordering and/or merging of reads/writes to hardware.
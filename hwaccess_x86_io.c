@@ -419,3 +419,27 @@ uint32_t INL(uint16_t port)
 	return value;
 }
 #endif
+
+/*
+ * String I/O
+ * Transfers `len' bytes between `buf' and a single port. This saves the
+ * per-byte call and loop overhead when a port is written with a whole
+ * sequence of values, e.g. when bit-banging. All supported platforms
+ * grant user-space access to the ports, so the string instructions can
+ * be used directly.
+ */
+void OUTSB(const uint8_t *buf, size_t len, uint16_t port)
+{
+	__asm__ volatile ("rep outsb"
+			  : "+S" (buf), "+c" (len)
+			  : "d" (port)
+			  : "memory");
+}
+
+void INSB(uint8_t *buf, size_t len, uint16_t port)
+{
+	__asm__ volatile ("rep insb"
+			  : "+D" (buf), "+c" (len)
+			  : "d" (port)
+			  : "memory");
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #define print(t, ...) printf(__VA_ARGS__)
+enum flashprog_log_level print_level = FLASHPROG_MSG_SPEW;
 #endif
 
 #define DESCRIPTOR_MODE_SIGNATURE 0x0ff0a55a
@@ -352,6 +352,18 @@ static OPCODE POSSIBLE_OPCODES[] = {
 
 static OPCODES O_EXISTING = {};
 
+/* The opcode menu as initially set up, all other opcodes are reported as unsupported. */
+static OPCODES opcodes_initial;
+
+/*
+ * When the opcode menu isn't locked, opcodes missing from it are swapped in
+ * on the fly. The least recently used slot is replaced, so all opcodes of an
+ * operation settle in the menu after one reprogramming each.
+ */
+static unsigned int opcode_last_use[8];
+static unsigned int opcode_use_clock;
+static unsigned int opcode_reprograms;
+
 /* pretty printing functions */
 static void prettyprint_opcodes(OPCODES *ops)
 {
@@ -526,11 +538,16 @@ static int reprogram_opcode_on_the_fly(uint8_t opcode, unsigned int writecnt, un
 		else // we have an invalid case
 			return SPI_INVALID_LENGTH;
 	}
-	int oppos = 2;	// use original JEDEC_BE_D8 offset
+	int oppos = 0, i;
+	for (i = 1; i < 8; i++) {
+		if (opcode_last_use[i] < opcode_last_use[oppos])
+			oppos = i;
+	}
 	curopcodes->opcode[oppos].opcode = opcode;
 	curopcodes->opcode[oppos].spi_type = spi_type;
 	program_opcodes(curopcodes, 0);
-	oppos = find_opcode(curopcodes, opcode);
+	opcode_last_use[oppos] = ++opcode_use_clock;
+	++opcode_reprograms;
 	msg_pdbg2("on-the-fly OPCODE (0x%02X) re-programmed, op-pos=%d\n", opcode, oppos);
 	return oppos;
 }
@@ -801,6 +818,13 @@ static void ich_fill_data(const uint8_t *data, int len, int reg0_off)
 		REGWRITE32(reg0_off + (i - (i % 4)), temp32);
 }
 
+static int ich_opcodes_shutdown(void *data)
+{
+	msg_pdbg("Reprogrammed the opcode menu %u times.\n", opcode_reprograms);
+	opcode_reprograms = 0;
+	return 0;
+}
+
 /* This function generates OPCODES from or programs OPCODES to ICH according to
  * the chipset's SPI configuration lock.
  *
@@ -830,8 +854,11 @@ static int ich_init_opcodes(void)
 		return 1;
 	} else {
 		curopcodes = curopcodes_done;
+		opcodes_initial = *curopcodes;
 		msg_pdbg("done\n");
 		prettyprint_opcodes(curopcodes);
+		if (!ichspi_lock)
+			register_shutdown(ich_opcodes_shutdown, NULL);
 		return 0;
 	}
 }
@@ -854,7 +881,7 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 
 	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
 	while ((REGREAD16(ICH7_REG_SPIS) & SPIS_SCIP) && --timeout) {
-		programmer_delay(10);
+		programmer_delay(NULL, 10);
 	}
 	if (!timeout) {
 		msg_perr("Error: SCIP never cleared!\n");
@@ -930,7 +957,7 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 	/* Wait for Cycle Done Status or Flash Cycle Error. */
 	while (((REGREAD16(ICH7_REG_SPIS) & (SPIS_CDS | SPIS_FCERR)) == 0) &&
 	       --timeout) {
-		programmer_delay(10);
+		programmer_delay(NULL, 10);
 	}
 	if (!timeout) {
 		msg_perr("timeout, ICH7_REG_SPIS=0x%04x\n",
@@ -971,7 +998,7 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 
 	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
 	while ((REGREAD8(swseq_data.reg_ssfsc) & SSFS_SCIP) && --timeout) {
-		programmer_delay(10);
+		programmer_delay(NULL, 10);
 	}
 	if (!timeout) {
 		msg_perr("Error: SCIP never cleared!\n");
@@ -1052,7 +1079,7 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 	/* Wait for Cycle Done Status or Flash Cycle Error. */
 	while (((REGREAD32(swseq_data.reg_ssfsc) & (SSFS_FDONE | SSFS_FCERR)) == 0) &&
 	       --timeout) {
-		programmer_delay(10);
+		programmer_delay(NULL, 10);
 	}
 	if (!timeout) {
 		msg_perr("timeout, REG_SSFS=0x%08x\n",
@@ -1135,6 +1162,7 @@ static int ich_spi_send_command(const struct flashctx *flash, unsigned int write
 			return SPI_INVALID_OPCODE;
 		}
 	}
+	opcode_last_use[opcode_index] = ++opcode_use_clock;
 
 	opcode = &(curopcodes->opcode[opcode_index]);
 
@@ -1248,6 +1276,12 @@ static struct hwseq_data {
 	uint32_t addr_mask;
 	bool only_4k;
 	uint32_t hsfc_fcycle;
+	/* Part of the BIOS region that is memory mapped below 4 GiB, see ich_hwseq_map_bios(). */
+	void *bios_mmap;
+	uint32_t bios_mmap_start;
+	uint32_t bios_mmap_len;
+	/* Length of the erase cycle left running by ich_hwseq_erase_queue(), 0 if none. */
+	unsigned int posted_erase_len;
 } hwseq_data;
 
 /* Sets FLA in FADDR to (addr & hwseq_data.addr_mask) without touching other bits. */
@@ -1283,7 +1317,12 @@ static uint32_t ich_hwseq_get_erase_block_size(unsigned int addr)
 	return dec_berase[enc_berase];
 }
 
-/* Polls for Cycle Done Status, Flash Cycle Error or timeout in 8 us intervals.
+/* Number of status polls without delay before falling back to 8 us intervals. */
+#define HWSEQ_SPIN_POLLS	64
+
+/* Polls for Cycle Done Status, Flash Cycle Error or timeout. Short cycles
+   like 64-byte reads are usually done within a few register reads, so poll
+   tightly at first and then in 8 us intervals.
    Resets all error flags in HSFS.
    Returns 0 if the cycle completes successfully without errors within
    timeout us, 1 on errors. */
@@ -1294,6 +1333,7 @@ static int ich_hwseq_wait_for_cycle_complete(unsigned int len)
 	 * introduce the long timeout of 30s to cover the worst case scenarios as well.
 	 */
 	unsigned int timeout_us = 30 * 1000 * 1000;
+	unsigned int spins = HWSEQ_SPIN_POLLS;
 	uint16_t hsfs;
 	uint32_t addr;
 
@@ -1301,9 +1341,13 @@ static int ich_hwseq_wait_for_cycle_complete(unsigned int len)
 	while ((((hsfs = REGREAD16(ICH9_REG_HSFS)) &
 		 (HSFS_FDONE | HSFS_FCERR)) == 0) &&
 	       --timeout_us) {
-		programmer_delay(8);
+		if (spins) {
+			--spins;
+			continue;
+		}
+		programmer_delay(NULL, 8);
 	}
-	REGWRITE16(ICH9_REG_HSFS, REGREAD16(ICH9_REG_HSFS));
+	REGWRITE16(ICH9_REG_HSFS, hsfs);
 	if (!timeout_us) {
 		addr = REGREAD32(ICH9_REG_FADDR) & hwseq_data.addr_mask;
 		msg_perr("Timeout error between offset 0x%08x and "
@@ -1326,6 +1370,19 @@ static int ich_hwseq_wait_for_cycle_complete(unsigned int len)
 	return 0;
 }
 
+/*
+ * Starts a read or write cycle of `len` bytes at `addr`. `faddr` holds the
+ * bits of FADDR outside of FLA, and `hsfc` the HSFC template with the cycle
+ * type set, both read once per request to save register round trips.
+ */
+static void ich_hwseq_start_cycle(uint32_t faddr, uint16_t hsfc, unsigned int addr, unsigned int len)
+{
+	REGWRITE32(ICH9_REG_FADDR, (addr & hwseq_data.addr_mask) | faddr);
+	hsfc |= (((len - 1) << HSFC_FDBC_OFF) & HSFC_FDBC); /* set byte count */
+	hsfc |= HSFC_FGO; /* start */
+	REGWRITE16(ICH9_REG_HSFC, hsfc);
+}
+
 static int ich_hwseq_probe(struct flashctx *flash)
 {
 	uint32_t total_size, boundary;
@@ -1382,7 +1439,8 @@ static int ich_hwseq_probe(struct flashctx *flash)
 	return 1;
 }
 
-static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
+/* Starts the erase cycle of the block at `addr`, returns 0 on success. */
+static int ich_hwseq_erase_start(struct flashctx *flash, unsigned int addr,
 				 unsigned int len)
 {
 	uint32_t erase_block;
@@ -1425,43 +1483,61 @@ static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
 	msg_pdbg("HSFC used for block erasing: ");
 	prettyprint_ich9_reg_hsfc(hsfc);
 	REGWRITE16(ICH9_REG_HSFC, hsfc);
+	return 0;
+}
 
-	if (ich_hwseq_wait_for_cycle_complete(len))
+static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
+				 unsigned int len)
+{
+	if (ich_hwseq_erase_start(flash, addr, len) ||
+	    ich_hwseq_wait_for_cycle_complete(len))
 		return -1;
 	return 0;
 }
 
-static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf,
-			  unsigned int addr, unsigned int len)
+static int ich_hwseq_erase_flush(struct flashctx *flash)
 {
-	uint16_t hsfc;
-	uint8_t block_len;
+	const unsigned int len = hwseq_data.posted_erase_len;
 
-	if (addr + len > flash->chip->total_size * 1024) {
-		msg_perr("Request to read from an inaccessible memory address "
-			 "(addr=0x%x, len=%d).\n", addr, len);
+	if (!len)
+		return 0;
+	hwseq_data.posted_erase_len = 0;
+	return ich_hwseq_wait_for_cycle_complete(len) ? -1 : 0;
+}
+
+/* Leave the erase cycle running, the controller takes one cycle at a time. */
+static int ich_hwseq_erase_queue(struct flashctx *flash, unsigned int addr,
+				 unsigned int len)
+{
+	if (ich_hwseq_erase_flush(flash) || ich_hwseq_erase_start(flash, addr, len))
 		return -1;
-	}
+	hwseq_data.posted_erase_len = len;
+	return 0;
+}
+
+static int ich_hwseq_read_fdata(struct flashctx *flash, uint8_t *buf,
+				unsigned int addr, unsigned int len)
+{
+	uint32_t faddr;
+	uint16_t hsfc;
+	uint8_t block_len;
 
 	msg_pdbg("Reading %d bytes starting at 0x%06x.\n", len, addr);
 	/* clear FDONE, FCERR, AEL by writing 1 to them (if they are set) */
 	REGWRITE16(ICH9_REG_HSFS, REGREAD16(ICH9_REG_HSFS));
 
+	faddr = REGREAD32(ICH9_REG_FADDR) & ~hwseq_data.addr_mask;
+	hsfc = REGREAD16(ICH9_REG_HSFC);
+	hsfc &= ~hwseq_data.hsfc_fcycle; /* set read operation */
+	hsfc &= ~(HSFC_FDBC | HSFC_FGO); /* clear byte count */
+
 	while (len > 0) {
 		/* Obey programmer limit... */
 		block_len = min(len, flash->mst.opaque->max_data_read);
 		/* as well as flash chip page borders as demanded in the Intel datasheets. */
 		block_len = min(block_len, 256 - (addr & 0xFF));
 
-		ich_hwseq_set_addr(addr);
-		hsfc = REGREAD16(ICH9_REG_HSFC);
-		hsfc &= ~hwseq_data.hsfc_fcycle; /* set read operation */
-		hsfc &= ~HSFC_FDBC; /* clear byte count */
-		/* set byte count */
-		hsfc |= (((block_len - 1) << HSFC_FDBC_OFF) & HSFC_FDBC);
-		hsfc |= HSFC_FGO; /* start */
-		REGWRITE16(ICH9_REG_HSFC, hsfc);
-
+		ich_hwseq_start_cycle(faddr, hsfc, addr, block_len);
 		if (ich_hwseq_wait_for_cycle_complete(block_len))
 			return 1;
 		ich_read_data(buf, block_len, ICH9_REG_FDATA0);
@@ -1473,8 +1549,54 @@ static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf,
 	return 0;
 }
 
+static int ich_hwseq_read_mmap(struct flashctx *flash, uint8_t *buf,
+			       unsigned int addr, unsigned int len)
+{
+	mmio_readn_aligned((const uint8_t *)hwseq_data.bios_mmap + (addr - hwseq_data.bios_mmap_start), buf, len, 8);
+	return 0;
+}
+
+static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf,
+			  unsigned int addr, unsigned int len)
+{
+	const unsigned int mmap_start = hwseq_data.bios_mmap_start;
+	const unsigned int mmap_end = mmap_start + hwseq_data.bios_mmap_len;
+
+	if (addr + len > flash->chip->total_size * 1024) {
+		msg_perr("Request to read from an inaccessible memory address "
+			 "(addr=0x%x, len=%d).\n", addr, len);
+		return -1;
+	}
+
+	/* Read the memory-mapped part of the BIOS region directly, the rest through FDATA. */
+	if (addr < mmap_end && addr + len > mmap_start) {
+		if (addr < mmap_start) {
+			const unsigned int unmapped_len = mmap_start - addr;
+			if (ich_hwseq_read_fdata(flash, buf, addr, unmapped_len))
+				return 1;
+			addr += unmapped_len;
+			buf += unmapped_len;
+			len -= unmapped_len;
+		}
+
+		const unsigned int mapped_len = min(len, mmap_end - addr);
+		msg_pdbg("Reading %d bytes starting at 0x%06x memory mapped.\n", mapped_len, addr);
+		if (flashprog_read_chunked(flash, buf, addr, mapped_len,
+					   MAX_DATA_READ_UNLIMITED, ich_hwseq_read_mmap))
+			return 1;
+		addr += mapped_len;
+		buf += mapped_len;
+		len -= mapped_len;
+	}
+
+	if (len)
+		return ich_hwseq_read_fdata(flash, buf, addr, len);
+	return 0;
+}
+
 static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned int addr, unsigned int len)
 {
+	uint32_t faddr;
 	uint16_t hsfc;
 	uint8_t block_len;
 
@@ -1488,21 +1610,19 @@ static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned
 	/* clear FDONE, FCERR, AEL by writing 1 to them (if they are set) */
 	REGWRITE16(ICH9_REG_HSFS, REGREAD16(ICH9_REG_HSFS));
 
+	faddr = REGREAD32(ICH9_REG_FADDR) & ~hwseq_data.addr_mask;
+	hsfc = REGREAD16(ICH9_REG_HSFC);
+	hsfc &= ~hwseq_data.hsfc_fcycle; /* clear operation */
+	hsfc |= (0x2 << HSFC_FCYCLE_OFF); /* set write operation */
+	hsfc &= ~(HSFC_FDBC | HSFC_FGO); /* clear byte count */
+
 	while (len > 0) {
-		ich_hwseq_set_addr(addr);
 		/* Obey programmer limit... */
 		block_len = min(len, flash->mst.opaque->max_data_write);
 		/* as well as flash chip page borders as demanded in the Intel datasheets. */
 		block_len = min(block_len, 256 - (addr & 0xFF));
 		ich_fill_data(buf, block_len, ICH9_REG_FDATA0);
-		hsfc = REGREAD16(ICH9_REG_HSFC);
-		hsfc &= ~hwseq_data.hsfc_fcycle; /* clear operation */
-		hsfc |= (0x2 << HSFC_FCYCLE_OFF); /* set write operation */
-		hsfc &= ~HSFC_FDBC; /* clear byte count */
-		/* set byte count */
-		hsfc |= (((block_len - 1) << HSFC_FDBC_OFF) & HSFC_FDBC);
-		hsfc |= HSFC_FGO; /* start */
-		REGWRITE16(ICH9_REG_HSFC, hsfc);
+		ich_hwseq_start_cycle(faddr, hsfc, addr, block_len);
 
 		if (ich_hwseq_wait_for_cycle_complete(block_len))
 			return -1;
@@ -1576,7 +1696,8 @@ static int ich_spi_send_multicommand(const struct flashctx *flash,
 
 static bool ich_spi_probe_opcode(const struct flashctx *flash, uint8_t opcode)
 {
-	return find_opcode(curopcodes, opcode) >= 0;
+	/* Keep the answer stable while opcodes are swapped in and out. */
+	return find_opcode(curopcodes, opcode) >= 0 || find_opcode(&opcodes_initial, opcode) >= 0;
 }
 
 #define ICH_BMWAG(x) ((x >> 24) & 0xff)
@@ -1591,6 +1712,50 @@ static const char *const access_names[] = {
 	"locked", "read-only", "write-only", "read-write"
 };
 
+/* Restricted ranges found in the FREG/FRAP and PR registers, cf. ich_get_region(). */
+#define ICH_MAX_PROT_RANGES	32
+static struct {
+	uint32_t base;
+	uint32_t limit;
+	enum ich_access_protection prot;
+} ich_prot_ranges[ICH_MAX_PROT_RANGES];
+static size_t ich_prot_count;
+
+static enum ich_access_protection ich_record_prot(const uint32_t base, const uint32_t limit,
+						  const enum ich_access_protection prot)
+{
+	if (prot != NO_PROT && ich_prot_count < ICH_MAX_PROT_RANGES) {
+		ich_prot_ranges[ich_prot_count].base = base;
+		ich_prot_ranges[ich_prot_count].limit = limit;
+		ich_prot_ranges[ich_prot_count].prot = prot;
+		++ich_prot_count;
+	}
+	return prot;
+}
+
+static void ich_get_region(const struct flashctx *flash, const chipoff_t addr, struct flash_region *region)
+{
+	enum ich_access_protection prot = NO_PROT;
+	size_t i;
+
+	for (i = 0; i < ich_prot_count; ++i) {
+		const uint32_t base = ich_prot_ranges[i].base;
+		const uint32_t limit = ich_prot_ranges[i].limit;
+
+		if (addr < base) {
+			region->end = MIN(region->end, base - 1);
+		} else if (addr > limit) {
+			region->start = MAX(region->start, limit + 1);
+		} else {
+			region->start = MAX(region->start, base);
+			region->end = MIN(region->end, limit);
+			prot |= ich_prot_ranges[i].prot;
+		}
+	}
+	region->read_prot = prot & READ_PROT;
+	region->write_prot = prot & WRITE_PROT;
+}
+
 static enum ich_access_protection ich9_handle_frap(uint32_t frap, unsigned int i)
 {
 	const int rwperms_unknown = ARRAY_SIZE(access_names);
@@ -1641,7 +1806,7 @@ static enum ich_access_protection ich9_handle_frap(uint32_t frap, unsigned int i
 
 	msg_pinfo("FREG%u: %s region (0x%08x-0x%08x) is %s.\n", i,
 		  region_name, base, limit, access_names[rwperms]);
-	return access_perms_to_protection[rwperms];
+	return ich_record_prot(base, limit, access_perms_to_protection[rwperms]);
 }
 
 	/* In contrast to FRAP and the master section of the descriptor the bits
@@ -1672,7 +1837,7 @@ static enum ich_access_protection ich9_handle_pr(const size_t reg_pr0, unsigned
 	msg_pdbg("0x%02X: 0x%08x ", off, pr);
 	msg_pwarn("%sPR%u: Warning: 0x%08x-0x%08x is %s.\n", prefix, i, ICH_FREG_BASE(pr),
 		  ICH_FREG_LIMIT(pr), access_names[rwperms]);
-	return access_perms_to_protection[rwperms];
+	return ich_record_prot(ICH_FREG_BASE(pr), ICH_FREG_LIMIT(pr), access_perms_to_protection[rwperms]);
 }
 
 /* Set/Clear the read and write protection enable bits of PR register @i
@@ -1716,8 +1881,43 @@ static const struct spi_master spi_master_ich9 = {
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.probe_opcode	= ich_spi_probe_opcode,
+	.get_region	= ich_get_region,
 };
 
+/*
+ * The top of the BIOS region is mapped right below 4 GiB. Map as much of
+ * it as the chipset decodes, `decode_len`, for fast reads.
+ */
+static void ich_hwseq_map_bios(size_t decode_len)
+{
+	const uint32_t freg = mmio_readl(ich_spibar + ICH9_REG_FREG0 + 1 * 4);
+	const uint32_t base = ICH_FREG_BASE(freg);
+	const uint32_t limit = ICH_FREG_LIMIT(freg);
+
+	if (!decode_len || base > limit)
+		return;
+
+	const uint32_t len = min(limit - base + 1, decode_len);
+	void *const mmap = physmap_ro("ICH BIOS region", (uintptr_t)(0x100000000ULL - len), len);
+	if (mmap == ERROR_PTR) {
+		msg_pdbg("Couldn't map BIOS region, reading through FDATA only.\n");
+		return;
+	}
+
+	hwseq_data.bios_mmap = mmap;
+	hwseq_data.bios_mmap_start = limit + 1 - len;
+	hwseq_data.bios_mmap_len = len;
+	msg_pdbg("Reading 0x%08x-0x%08x memory mapped.\n", hwseq_data.bios_mmap_start, limit);
+}
+
+static int ich_hwseq_shutdown(void *data)
+{
+	if (hwseq_data.bios_mmap_len)
+		physunmap(hwseq_data.bios_mmap, hwseq_data.bios_mmap_len);
+	hwseq_data.bios_mmap_len = 0;
+	return 0;
+}
+
 static const struct opaque_master opaque_master_ich_hwseq = {
 	.max_data_read	= 64,
 	.max_data_write	= 64,
@@ -1725,9 +1925,13 @@ static const struct opaque_master opaque_master_ich_hwseq = {
 	.read		= ich_hwseq_read,
 	.write		= ich_hwseq_write,
 	.erase		= ich_hwseq_block_erase,
+	.erase_queue	= ich_hwseq_erase_queue,
+	.erase_flush	= ich_hwseq_erase_flush,
+	.get_region	= ich_get_region,
+	.shutdown	= ich_hwseq_shutdown,
 };
 
-int ich_init_spi(void *spibar, enum ich_chipset ich_gen)
+int ich_init_spi(void *spibar, enum ich_chipset ich_gen, size_t bios_decode_len)
 {
 	unsigned int i;
 	uint16_t tmp2;
@@ -1745,6 +1949,7 @@ int ich_init_spi(void *spibar, enum ich_chipset ich_gen)
 
 	ich_generation = ich_gen;
 	ich_spibar = spibar;
+	ich_prot_count = 0;
 
 	/* Moving registers / bits */
 	switch (ich_generation) {
@@ -1922,16 +2127,14 @@ int ich_init_spi(void *spibar, enum ich_chipset ich_gen)
 
 		switch (ich_spi_rw_restricted) {
 		case WRITE_PROT:
-			msg_pwarn("At least some flash regions are write protected. For write operations,\n"
-				  "you should use a flash layout and include only writable regions. See\n"
-				  "manpage for more details.\n");
+			msg_pwarn("At least some flash regions are write protected. They will be left out\n"
+				  "of erase and write operations. See manpage for more details.\n");
 			break;
 		case READ_PROT:
 		case LOCKED:
-			msg_pwarn("At least some flash regions are read protected. You have to use a flash\n"
-				  "layout and include only accessible regions. For write operations, you'll\n"
-				  "additionally need the --noverify-all switch. See manpage for more details.\n"
-				  );
+			msg_pwarn("At least some flash regions are read protected. They will be left out\n"
+				  "of all operations, and read as erased. For write operations, you'll need\n"
+				  "the --noverify-all switch. See manpage for more details.\n");
 			break;
 		}
 
@@ -2065,6 +2268,7 @@ int ich_init_spi(void *spibar, enum ich_chipset ich_gen)
 			}
 			hwseq_data.size_comp1 = tmpi;
 
+			ich_hwseq_map_bios(bios_decode_len);
 			register_opaque_master(&opaque_master_ich_hwseq, NULL);
 		} else {
 			register_spi_master(&spi_master_ich9, 0, NULL);
@@ -28,6 +28,8 @@ int spi_chip_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int
 int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start, int unsigned len);
 
 /* spi25.c */
+int spi_poll_wip(struct flashctx *, const struct wip_timing *);
+void spi_id_cache_clear(struct flashprog_programmer *);
 int probe_spi_rdid(struct flashctx *flash);
 int probe_spi_rdid4(struct flashctx *flash);
 int probe_spi_rems(struct flashctx *flash);
@@ -56,16 +58,28 @@ erasefunc_t *spi25_get_erasefn_from_opcode(uint8_t opcode);
 const uint8_t *spi_get_opcode_from_erasefn(erasefunc_t *func, bool *native_4ba);
 int spi_chip_write_1(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int spi_nbyte_read(struct flashctx *flash, uint8_t *dst, unsigned int addr, unsigned int len);
+int spi_prepare_read_cmd(struct flashctx *, uint8_t cmd[], unsigned int addr, unsigned int len);
 int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len, unsigned int chunksize);
 int spi_enter_4ba(struct flashctx *flash);
 int spi_exit_4ba(struct flashctx *flash);
 int spi_set_extended_address(struct flashctx *, uint8_t addr_high);
 int spi_prepare_4ba(struct flashctx *, enum preparation_steps);
+void spi_prepare_ops(struct flashctx *);
+void spi_prepare_qpi(struct flashctx *);
+enum io_mode spi_read_io_mode(const struct flashctx *);
+int spi_exit_qpi(struct flashctx *);
+unsigned int spi_die_count(const struct flashctx *);
+unsigned int spi_die_size(const struct flashctx *);
+int spi_select_die(struct flashctx *, unsigned int die);
+int spi_die_busy(struct flashctx *, unsigned int die);
+int spi_wait_dies(struct flashctx *);
 
 
 /* spi25_statusreg.c */
-int spi_read_register(const struct flashctx *flash, enum flash_reg reg, uint8_t *value);
-int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t value);
+int spi_read_register(struct flashctx *flash, enum flash_reg reg, uint8_t *value);
+int spi_read_register_cached(struct flashctx *flash, enum flash_reg reg, uint8_t *value);
+int spi_write_register(struct flashctx *flash, enum flash_reg reg, uint8_t value);
+int spi_set_quad_enable(struct flashctx *flash);
 void spi_prettyprint_status_register_bit(uint8_t status, int bit);
 int spi_prettyprint_status_register_plain(struct flashctx *flash);
 int spi_prettyprint_status_register_default_welwip(struct flashctx *flash);
@@ -76,6 +90,7 @@ int spi_prettyprint_status_register_bp4_srwd(struct flashctx *flash);
 int spi_prettyprint_status_register_bp2_bpl(struct flashctx *flash);
 int spi_prettyprint_status_register_bp2_tb_bpl(struct flashctx *flash);
 int spi_disable_blockprotect(struct flashctx *flash);
+int spi_disable_blockprotect_dies(struct flashctx *flash);
 int spi_disable_blockprotect_bp1_srwd(struct flashctx *flash);
 int spi_disable_blockprotect_bp2_srwd(struct flashctx *flash);
 int spi_disable_blockprotect_bp3_srwd(struct flashctx *flash);
@@ -109,12 +124,16 @@ int spi_disable_blockprotect_sst26_global_unprotect(struct flashctx *flash);
 
 /* sfdp.c */
 int probe_spi_sfdp(struct flashctx *flash);
+int sfdp_overlay(struct flashctx *flash);
 
 /* opaque.c */
 int probe_opaque(struct flashctx *flash);
 int read_opaque(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int write_opaque(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int erase_opaque(struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+bool opaque_can_queue_erase(const struct flashctx *flash);
+int erase_queue_opaque(struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+int erase_flush_opaque(struct flashctx *flash);
 
 /* at45db.c */
 int probe_spi_at45db(struct flashctx *flash);
@@ -130,7 +149,7 @@ int spi_erase_at45db_chip(struct flashctx *flash, unsigned int addr, unsigned in
 int spi_erase_at45cs_sector(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
 
 /* 82802ab.c */
-uint8_t wait_82802ab(struct flashctx *flash);
+uint8_t wait_82802ab(struct flashctx *flash, enum wait_82802ab_op);
 int probe_82802ab(struct flashctx *flash);
 int erase_block_82802ab(struct flashctx *flash, unsigned int page, unsigned int pagesize);
 int write_82802ab(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
@@ -146,6 +165,7 @@ int probe_jedec(struct flashctx *flash);
 int probe_jedec_29gl(struct flashctx *flash);
 int write_jedec(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int write_jedec_1(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
+int write_jedec_29gl(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int erase_sector_jedec(struct flashctx *flash, unsigned int page, unsigned int pagesize);
 int erase_block_jedec(struct flashctx *flash, unsigned int page, unsigned int blocksize);
 int erase_chip_block_jedec(struct flashctx *flash, unsigned int page, unsigned int blocksize);
@@ -208,6 +228,16 @@ int edi_probe_kb9012(struct flashctx *flash);
 int probe_spi_st95(struct flashctx *flash);
 int spi_block_erase_emulation(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
 
+/* spi_nand.c */
+int probe_spi_nand(struct flashctx *flash);
+int spi_nand_prepare_access(struct flashctx *flash, enum preparation_steps);
+void spi_nand_finish_access(struct flashctx *flash);
+int spi_nand_printlock(struct flashctx *flash);
+int spi_nand_unlock(struct flashctx *flash);
+int spi_nand_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
+int spi_nand_write(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
+int spi_nand_block_erase(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
+
 /* writeprotect_ranges.c */
 void decode_range_spi25(size_t *start, size_t *len, const struct wp_bits *, size_t chip_len);
 void decode_range_spi25_64k_block(size_t *start, size_t *len, const struct wp_bits *, size_t chip_len);
@@ -56,7 +56,7 @@ typedef uintptr_t chipaddr;
 
 int register_shutdown(int (*function) (void *data), void *data);
 int shutdown_free(void *data);
-void programmer_delay(unsigned int usecs);
+void programmer_delay(const struct flashprog_flashctx *, unsigned int usecs);
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -88,6 +88,7 @@ enum write_granularity {
 	write_gran_528bytes,	/* If less than 528 bytes are written, the unwritten bytes are undefined. */
 	write_gran_1024bytes,	/* If less than 1024 bytes are written, the unwritten bytes are undefined. */
 	write_gran_1056bytes,	/* If less than 1056 bytes are written, the unwritten bytes are undefined. */
+	write_gran_2048bytes,	/* If less than 2048 bytes are written, the unwritten bytes are undefined. */
 	write_gran_1byte_implicit_erase, /* EEPROMs and other chips with implicit erase and 1-byte writes. */
 };
 
@@ -106,6 +107,7 @@ size_t gran_to_bytes(enum write_granularity);
 #define NUM_ERASEFUNCTIONS 8
 
 #define MAX_CHIP_RESTORE_FUNCTIONS 4
+#define MAX_DIES 4
 
 /* Feature bits used for non-SPI only */
 #define FEATURE_LONG_RESET	(0 << 4)
@@ -151,8 +153,48 @@ size_t gran_to_bytes(enum write_granularity);
 #define FEATURE_WRSR_EXT3	((1 << 22) | FEATURE_WRSR_EXT2)
 #define FEATURE_WRSR3		(1 << 23)
 
+/* Multi-I/O read instructions, see `enum io_mode` */
+#define FEATURE_FAST_READ_DOUT	(1 << 24) /**< Dual-output fast read (1-1-2, 0x3b) is supported. */
+#define FEATURE_FAST_READ_DIO	(1 << 25) /**< Dual-I/O fast read (1-2-2, 0xbb) is supported. */
+#define FEATURE_FAST_READ_QOUT	(1 << 26) /**< Quad-output fast read (1-1-4, 0x6b) is supported. */
+#define FEATURE_FAST_READ_QIO	(1 << 27) /**< Quad-I/O fast read (1-4-4, 0xeb) is supported. */
+#define FEATURE_SETTLE_DELAY	(1 << 28) /**< Needs a pause after writing before it reads back reliably. */
+#define FEATURE_NAND_CACHE_SEQ	(1 << 29) /**< SPI NAND with Page Read Cache Sequential (0x31, 0x3f). */
+
+#define FEATURE_FAST_READ_DUAL	(FEATURE_FAST_READ_DOUT | FEATURE_FAST_READ_DIO)
+#define FEATURE_FAST_READ_QUAD	(FEATURE_FAST_READ_QOUT | FEATURE_FAST_READ_QIO)
+
 #define ERASED_VALUE(flash)	(((flash)->chip->feature_bits & FEATURE_ERASED_ZERO) ? 0x00 : 0xff)
 
+/*
+ * I/O modes of SPI commands, named after the number of lines used
+ * for the opcode, the address (plus mode and dummy bits) and data.
+ */
+enum io_mode {
+	SINGLE_IO_1_1_1 = 0,
+	DUAL_OUT_1_1_2,
+	DUAL_IO_1_2_2,
+	QUAD_OUT_1_1_4,
+	QUAD_IO_1_4_4,
+	QPI_4_4_4,	/* all of the command, only while the chip is in QPI mode */
+	NUM_IO_MODES
+};
+
+/* Typical and maximum duration of an operation that sets WIP, in microseconds. */
+struct wip_timing {
+	unsigned int typ_us;
+	unsigned int max_us;
+	bool generic;	/* only a default, not known for the chip: poll without sleeping first */
+};
+
+/* Kinds of operations of 82802ab-style chips, cf. wait_82802ab(). */
+enum wait_82802ab_op {
+	WAIT_82802AB_PROGRAM,
+	WAIT_82802AB_ERASE,		/* also (un)locking of all blocks at once */
+	WAIT_82802AB_ERASE_SECTOR,	/* small sectors, if they erase faster than blocks */
+	NUM_WAIT_82802AB_OPS
+};
+
 enum test_state {
 	OK = 0,
 	NT = 1,	/* Not tested */
@@ -213,6 +255,41 @@ enum preparation_steps {
 	PREPARE_FULL,
 };
 
+struct reg_bit_map {
+	/* Status register protection bit (SRP) */
+	struct reg_bit_info srp;
+
+	/* Status register lock bit (SRP) */
+	struct reg_bit_info srl;
+
+	/*
+	 * Note: some datasheets refer to configuration bits that
+	 * function like TB/SEC/CMP bits as BP bits (e.g. BP3 for a bit
+	 * that functions like TB).
+	 *
+	 * As a convention, any config bit that functions like a
+	 * TB/SEC/CMP bit should be assigned to the respective
+	 * tb/sec/cmp field in this structure, even if the datasheet
+	 * uses a different name.
+	 */
+
+	/* Block protection bits (BP) */
+	/* Extra element for terminator */
+	struct reg_bit_info bp[MAX_BP_BITS + 1];
+
+	/* Top/bottom protection bit (TB) */
+	struct reg_bit_info tb;
+
+	/* Sector/block protection bit (SEC) */
+	struct reg_bit_info sec;
+
+	/* Complement bit (CMP) */
+	struct reg_bit_info cmp;
+
+	/* Write Protect Selection (per sector protection when set) */
+	struct reg_bit_info wps;
+};
+
 struct flashchip {
 	const char *vendor;
 	const char *name;
@@ -231,6 +308,13 @@ struct flashchip {
 	unsigned int total_size;
 	/* Chip page size in bytes */
 	unsigned int page_size;
+	/*
+	 * Number of stacked dies (e.g. Winbond W25M), 0 for single-die chips.
+	 * The dies share the bus and are switched with Software Die Select
+	 * (0xc2). Each die takes addresses relative to its own start and has
+	 * its own status registers, but they can program and erase at once.
+	 */
+	unsigned int dies;
 	int feature_bits;
 
 	/* Indicate how well flashprog supports different operations of this flash chip. */
@@ -253,6 +337,7 @@ struct flashchip {
 		SPI25 = 0,
 		SPI95,
 		SPI_EDI,
+		SPI_NAND,
 	} spi_cmd_set;
 
 	int (*probe) (struct flashctx *flash);
@@ -289,40 +374,8 @@ struct flashchip {
 	} voltage;
 	enum write_granularity gran;
 
-	struct reg_bit_map {
-		/* Status register protection bit (SRP) */
-		struct reg_bit_info srp;
-
-		/* Status register lock bit (SRP) */
-		struct reg_bit_info srl;
-
-		/*
-		 * Note: some datasheets refer to configuration bits that
-		 * function like TB/SEC/CMP bits as BP bits (e.g. BP3 for a bit
-		 * that functions like TB).
-		 *
-		 * As a convention, any config bit that functions like a
-		 * TB/SEC/CMP bit should be assigned to the respective
-		 * tb/sec/cmp field in this structure, even if the datasheet
-		 * uses a different name.
-		 */
-
-		/* Block protection bits (BP) */
-		/* Extra element for terminator */
-		struct reg_bit_info bp[MAX_BP_BITS + 1];
-
-		/* Top/bottom protection bit (TB) */
-		struct reg_bit_info tb;
-
-		/* Sector/block protection bit (SEC) */
-		struct reg_bit_info sec;
-
-		/* Complement bit (CMP) */
-		struct reg_bit_info cmp;
-
-		/* Write Protect Selection (per sector protection when set) */
-		struct reg_bit_info wps;
-	} reg_bits;
+	/* Write protection bits, NULL if the chip has none */
+	const struct reg_bit_map *reg_bits;
 
 	/* Write WP configuration to the chip */
 	enum flashprog_wp_result (*wp_write_cfg)(struct flashctx *, const struct flashprog_wp_cfg *);
@@ -336,6 +389,41 @@ struct flashchip {
 
 	int (*prepare_access)(struct flashctx *, enum preparation_steps);
 	void (*finish_access)(struct flashctx *);
+
+	/*
+	 * Parameters of the multi-I/O fast-read instructions, indexed by
+	 * `enum io_mode`. A zero opcode selects the JEDEC defaults. Only
+	 * used when the respective FEATURE_FAST_READ_* bit is set.
+	 */
+	struct fast_read_params {
+		uint8_t opcode;
+		uint8_t mode_clocks;	/* clock cycles for mode bits */
+		uint8_t dummy_clocks;	/* clock cycles for wait states */
+	} fast_read[NUM_IO_MODES];
+
+	/*
+	 * How to switch the chip into QPI mode, where it takes whole commands
+	 * on four lines. Only used with FEATURE_QPI and a non-zero `enter_op`,
+	 * cf. spi_prepare_qpi(). The fast read is in `fast_read[QPI_4_4_4]`.
+	 */
+	struct {
+		uint8_t qer;		/* Quad Enable requirement, JESD216 BFPT DW15 encoding */
+		uint8_t enter_op;	/* sent after setting the Quad Enable bit */
+		uint8_t exit_op;
+	} qpi;
+
+	/*
+	 * Durations of SPI program and erase operations. Zero entries
+	 * are unknown and conservative defaults are used instead.
+	 */
+	struct spi_timings {
+		struct wip_timing page_program;
+		struct wip_timing chip_erase;
+		struct spi_erase_timing {
+			unsigned int block_size;
+			struct wip_timing timing;
+		} erase[4];
+	} spi_timing;
 };
 
 typedef int (*chip_restore_fn_cb_t)(struct flashctx *flash, uint8_t status);
@@ -346,6 +434,14 @@ struct flashprog_progress {
 	size_t current;
 	size_t total;
 	void *user_data;
+
+	/* Rate limit of the callback, zero values don't limit. */
+	unsigned int interval_ms;
+	size_t granularity;
+
+	uint64_t start_us;	/* when the current stage started */
+	uint64_t reported_us;	/* when the callback was last called */
+	size_t reported;	/* `current` at the last callback */
 };
 
 struct flashprog_flashctx {
@@ -364,6 +460,10 @@ struct flashprog_flashctx {
 		struct spi_master *spi;
 		struct opaque_master *opaque;
 	} mst;
+	/* The programmer that `mst` belongs to. */
+	struct flashprog_programmer *prog;
+	/* Which of the chips on an SPI master this is, cf. spi_master.chip_selects. */
+	unsigned int chip_select;
 	const struct flashprog_layout *layout;
 	struct flashprog_layout *default_layout;
 	struct {
@@ -371,6 +471,10 @@ struct flashprog_flashctx {
 		bool force_boardmismatch;
 		bool verify_after_write;
 		bool verify_whole_chip;
+		bool streaming_write;
+		bool verify_inline;
+		bool checked_read;
+		enum flashprog_erase_check erase_check;
 	} flags;
 	/* We cache the state of the extended address register (highest byte
            of a 4BA for 3BA instructions) and the state of the 4BA mode here.
@@ -378,6 +482,60 @@ struct flashprog_flashctx {
            of the extended address register. */
 	int address_high_byte;
 	bool in_4ba_mode;
+	/* Are the two above known to match the chip? Cf. spi_prepare_4ba(). */
+	bool address_mode_known;
+	/* All SPI commands are sent in 4-4-4 mode, cf. spi_prepare_qpi(). */
+	bool in_qpi_mode;
+	/*
+	 * Opcodes and address lengths of SPI25 page program and read for the
+	 * current address mode, precomputed by spi_prepare_ops(). Without
+	 * `valid`, they are derived again for every command.
+	 */
+	struct {
+		bool program_valid;
+		uint8_t program_op;
+		uint8_t program_addr_len;
+		const struct wip_timing *program_timing;
+		bool read_valid;
+		uint8_t read_op;
+		uint8_t read_addr_len;
+		uint8_t read_dummy_len;
+		enum io_mode read_io_mode;
+		bool ear;	/* 3-byte addresses use the extended address register */
+	} spi_ops;
+
+	/* State of stacked-die chips, cf. spi_select_die(). Single-die
+	   chips use `busy[0]` for posted operations. */
+	struct {
+		int active;	/* selected die, -1 if unknown */
+		bool post;	/* return from erase commands without waiting for WIP */
+		struct {	/* operation posted on each die, if any */
+			const struct wip_timing *timing;
+			uint64_t start_us;
+			unsigned long long start_delay_us;	/* programmer_delay_total() */
+		} busy[MAX_DIES];
+	} die;
+
+	/* Protection ranges of the chip, cf. get_range_table(). */
+	struct wp_range_table *wp_ranges;
+
+	/* Bad blocks of SPI NAND chips, cf. spi_nand_prepare_access(). */
+	struct {
+		bool *bad;		/* one entry per erase block, NULL outside of accesses */
+		unsigned int block_size;
+	} nand;
+
+	/* Duration of the last operations of 82802ab-style chips, cf. wait_82802ab(). */
+	unsigned int wait_82802ab_us[NUM_WAIT_82802AB_OPS];
+
+	/* Status registers as last read from the chip, cf. spi_read_register_cached(). */
+	struct {
+		uint8_t value[MAX_REGISTERS];
+		bool valid[MAX_REGISTERS];
+	} status_shadow;
+
+	/* Was this chip explicitly requested for probing (e.g. with -c)? */
+	bool chip_requested;
 
 	int chip_restore_fn_count;
 	struct chip_restore_func_data {
@@ -386,6 +544,48 @@ struct flashprog_flashctx {
 	} chip_restore_fn[MAX_CHIP_RESTORE_FUNCTIONS];
 
 	struct flashprog_progress progress;
+
+	struct {
+		flashprog_event_callback *callback;
+		void *user_data;
+	} event;
+
+	/* Did we change something or was every erase/write skipped (if any)? */
+	bool all_skipped;
+	/* Read back every write right away, cf. write_range(). */
+	bool verifying_inline;
+	/* Leave out write-protected ranges too, cf. accessible_next_included_span(). */
+	bool skip_write_protected;
+
+	/* Set from another thread to abort the current operation, see libflashprog_job.c. */
+	bool cancel_requested;
+
+	/* Performance counters, cf. flashprog_stats_get(). */
+	struct flashprog_stats stats;
+	struct {
+		unsigned long long delay_base;	/* programmer_delay_total() at the last reset */
+		struct flashprog_usb_stats usb_base;	/* programmer_usb_stats() at the last reset */
+		struct flashprog_delay_stats delays_base;	/* internal_delay_stats() at the last reset */
+		unsigned long long stage_start;
+		bool stage_running;
+	} stats_state;
+
+	/* Flash contents read during this session, sorted by address. */
+	struct read_cache {
+		struct read_cache_entry *entries;
+		size_t count;
+		size_t bytes;
+	} read_cache;
+
+	/* Erase layout of the chip, reused by every erase and write, cf. get_erase_layout(). */
+	struct erase_layout_cache {
+		struct erase_layout *layouts;
+		int count;
+		/* The layout is created again if any of these change. */
+		const struct flashchip *chip;
+		struct block_eraser erasers[NUM_ERASEFUNCTIONS];
+		unsigned int usable;
+	} erase_layout_cache;
 };
 
 /* Timing used in probe routines. ZERO is -2 to differentiate between an unset
@@ -418,6 +618,14 @@ void print_banner(void);
 int print_supported(void);
 void print_supported_wiki(void);
 
+/* libflashprog.c, allocations that honor flashprog_set_allocator() and the memory limit */
+void *flashprog_malloc(size_t size);
+void *flashprog_calloc(size_t nmemb, size_t size);
+void *flashprog_realloc(void *ptr, size_t size);
+void flashprog_free(void *ptr);
+char *flashprog_strdup(const char *str);
+bool flashprog_memory_fits(size_t size);
+
 /* helpers.c */
 int flashprog_read_chunked(struct flashctx *, uint8_t *dst, unsigned int start, unsigned int len, unsigned int chunksize, readfunc_t *);
 uint32_t address_to_bits(uint32_t addr);
@@ -432,6 +640,7 @@ char *strcat_realloc(char *dest, const char *src);
 void tolower_string(char *str);
 uint8_t reverse_byte(uint8_t x);
 void reverse_bytes(uint8_t *dst, const uint8_t *src, size_t length);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
 #ifdef __MINGW32__
 char* strtok_r(char *str, const char *delim, char **nextp);
 char *strndup(const char *str, size_t size);
@@ -442,23 +651,60 @@ size_t strnlen(const char *str, size_t n);
 
 /* flashprog.c */
 extern const char flashprog_version[];
-extern const char *chip_to_probe;
 char *flashbuses_to_text(enum chipbustype bustype);
 int map_flash(struct flashctx *flash);
 void unmap_flash(struct flashctx *flash);
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int erase_flash(struct flashctx *flash);
 struct registered_master;
-int probe_flash(struct registered_master *mst, int startchip, struct flashctx *fill_flash, int force);
+int probe_flash(struct registered_master *mst, int startchip, struct flashctx *fill_flash, int force,
+		const char *chip_to_probe);
 int flashprog_read_range(struct flashctx *, uint8_t *buf, unsigned int start, unsigned int len);
+void read_cache_clear(struct flashctx *);
+void erase_layout_cache_clear(struct flashctx *);
+unsigned long long programmer_delay_total(const struct flashctx *);
+struct flashprog_usb_stats *programmer_usb_stats(void);
 int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start, unsigned int len);
-void emergency_help_message(void);
+int programmer_checksum(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
+/* Access restrictions of the programmer, e.g. by flash descriptor permissions. */
+struct flash_region {
+	chipoff_t start;
+	chipoff_t end;
+	bool read_prot;
+	bool write_prot;
+};
+void get_flash_region(const struct flashctx *, chipoff_t addr, struct flash_region *);
+bool flash_range_readable(const struct flashctx *, chipoff_t start, chipsize_t len);
+bool accessible_next_included_span(const struct flashctx *, const struct flashprog_layout *,
+				   chipoff_t where, chipoff_t *start, chipoff_t *end);
+void emergency_help_message(const struct flashctx *);
 void list_programmers_linebreak(int startcol, int cols, int paren);
 int selfcheck(void);
 int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename);
+typedef void (image_load_progress)(unsigned long loaded, void *arg);
+int read_buf_from_file_progress(unsigned char *buf, unsigned long size, const char *filename,
+				image_load_progress *, void *arg);
 int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename);
+struct image_buf {
+	unsigned char *buf;
+	unsigned long size;
+	const char *filename;
+	char *tmpname;		/* output that replaces `filename` when committed */
+	bool output;
+	bool mapped;
+};
+int image_buf_alloc(struct image_buf *, unsigned long size, const char *filename);
+int image_buf_open(struct image_buf *, unsigned long size, const char *filename);
+int image_buf_create(struct image_buf *, unsigned long size, const char *filename);
+int image_buf_close(struct image_buf *, bool commit);
+struct image_stream;
+struct image_stream *image_stream_create(const char *filename);
+int image_stream_write(struct image_stream *, const void *data, size_t len);
+int image_stream_close(struct image_stream *, bool commit);
+bool image_name_compressed(const char *filename);
 int prepare_flash_access(struct flashctx *, bool read_it, bool write_it, bool erase_it, bool verify_it);
 void finalize_flash_access(struct flashctx *);
+void print_lock_status(struct flashctx *);
 int register_chip_restore(chip_restore_fn_cb_t func, struct flashctx *flash, uint8_t status);
 
 /* Something happened that shouldn't happen, but we can go on. */
@@ -476,15 +722,113 @@ int register_chip_restore(chip_restore_fn_cb_t func, struct flashctx *flash, uin
 
 /* cli_common.c */
 void print_chip_support_status(const struct flashchip *chip);
+void print_sha256(const unsigned char digest[32]);
+int parse_sha256(const char *hex, uint8_t digest[32]);
+
+/* cli_gang.c */
+enum gang_result {
+	GANG_RESULT_OK = 0,
+	GANG_RESULT_SKIPPED,
+	GANG_RESULT_INIT,
+	GANG_RESULT_PROBE,
+	GANG_RESULT_MULTIPLE,
+	GANG_RESULT_IMAGE,
+	GANG_RESULT_SIZE,
+	GANG_RESULT_WRITE,
+};
+struct gang_device {
+	const char *prog_name;
+	char *prog_param;
+	bool multi_instance;		/* the driver may be used along with others */
+	enum gang_result result;
+};
+struct gang_config {
+	const char *chip_name;
+	unsigned int chip_selects;	/* chips written on each programmer */
+	struct flashprog_layout *layout;
+	bool force;
+	bool verify;
+	bool verify_all;
+	bool streaming;
+	bool show_progress;
+	enum flashprog_erase_check erase_check;
+};
+int gang_write(struct gang_device *, size_t count, const char *filename, const struct gang_config *);
+
+/* cli_manifest.c */
+struct manifest_id {
+	const char *prog_name;
+	const char *prog_param;
+};
+int manifest_prepare(struct flashctx *, const char *path, const struct manifest_id *,
+		     const uint8_t *newcontents, uint8_t *refcontents);
+int manifest_store(struct flashctx *, const char *path, const struct manifest_id *,
+		   const uint8_t *refcontents, const uint8_t *newcontents);
+int manifest_confirm_base(struct flashctx *, const char *path, const struct manifest_id *, const uint8_t base[32]);
+int manifest_store_patch(struct flashctx *, const char *path, const struct manifest_id *,
+			 const struct flashprog_extent *, size_t count, const uint8_t result[32]);
+void manifest_invalidate(const char *path);
+
+/* cli_journal.c */
+int journal_prepare(struct flashctx *, const char *path, const struct manifest_id *,
+		    const uint8_t *newcontents, uint8_t *refcontents, bool *resumed);
+int journal_start(struct flashctx *, const char *path, const struct manifest_id *,
+		  const uint8_t *newcontents, bool append);
+void journal_finish(struct flashctx *, const char *path, bool success);
+
+/* cli_batch.c */
+void batch_cancel(void);
+int batch_run_stream(struct flashctx *, const struct flashprog_layout *, FILE *, const char *name);
+int batch_run(struct flashctx *, const struct flashprog_layout *, const char *path);
+
+/* cli_benchmark.c */
+int benchmark_run(struct flashctx *, bool destructive);
+
+/* cli_serve.c */
+int serve_run(struct flashctx *, const struct flashprog_layout *, const char *path);
+
+/* cli_hotplug.c */
+struct programmer_entry;
+struct hotplug_config {
+	const struct programmer_entry *prog;
+	const char *prog_param;
+	const char *chip_name;
+	const char *script;		/* batch script run for every board */
+	struct flashprog_layout *layout;
+	bool force;
+	bool verify;
+	bool verify_all;
+	enum flashprog_erase_check erase_check;
+};
+int hotplug_run(const struct hotplug_config *);
+
+/* cli_realtime.c */
+int realtime_enter(void);
+
+/* cli_patch.c */
+struct patch {
+	size_t size;
+	uint8_t base[32];	/* SHA-256 of the image the patch applies to */
+	uint8_t result[32];	/* SHA-256 of the image after applying it */
+	size_t count;
+	struct flashprog_extent *extents;
+};
+int patch_load(struct patch *, const char *path);
+void patch_free(struct patch *);
 
 /* cli_output.c */
 extern enum flashprog_log_level verbose_screen;
 extern enum flashprog_log_level verbose_logfile;
+extern bool stdout_is_data;
+extern FILE *client_output;
 int open_logfile(const char * const filename);
 int close_logfile(void);
+int open_json_log(const char *filename);
+int close_json_log(void);
 void start_logging(void);
 int flashprog_print_cb(enum flashprog_log_level level, const char *fmt, va_list ap);
 void flashprog_progress_cb(enum flashprog_progress_stage, size_t current, size_t total, void *user_data);
+void flashprog_event_json_cb(const struct flashprog_event *, void *user_data);
 /* Let gcc and clang check for correct printf-style format strings. */
 int print(enum flashprog_log_level level, const char *fmt, ...)
 #ifdef __MINGW32__
@@ -495,25 +839,37 @@ __attribute__((format(__MINGW_PRINTF_FORMAT, 2, 3)));
 #else
 __attribute__((format(printf, 2, 3)));
 #endif
-#define msg_gerr(...)	print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* general errors */
-#define msg_perr(...)	print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* programmer errors */
-#define msg_cerr(...)	print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* chip errors */
-#define msg_gwarn(...)	print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* general warnings */
-#define msg_pwarn(...)	print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* programmer warnings */
-#define msg_cwarn(...)	print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* chip warnings */
-#define msg_ginfo(...)	print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* general info */
-#define msg_pinfo(...)	print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* programmer info */
-#define msg_cinfo(...)	print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* chip info */
-#define msg_gdbg(...)	print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* general debug */
-#define msg_pdbg(...)	print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* programmer debug */
-#define msg_cdbg(...)	print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* chip debug */
-#define msg_gdbg2(...)	print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* general debug2 */
-#define msg_pdbg2(...)	print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* programmer debug2 */
-#define msg_cdbg2(...)	print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* chip debug2 */
-#define msg_gspew(...)	print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* general debug spew  */
-#define msg_pspew(...)	print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* programmer debug spew  */
-#define msg_cspew(...)	print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* chip debug spew  */
+/*
+ * Messages above `print_level` (see flashprog_set_log_level()) are dropped
+ * before their arguments are evaluated and formatted. Builds can also drop
+ * them at compile time, e.g. with -DFLASHPROG_MSG_MAX=FLASHPROG_MSG_DEBUG.
+ */
+#ifndef FLASHPROG_MSG_MAX
+#define FLASHPROG_MSG_MAX	FLASHPROG_MSG_SPEW
+#endif
+extern enum flashprog_log_level print_level;
+#define msg_enabled(level)	((level) <= FLASHPROG_MSG_MAX && (level) <= print_level)
+#define msg_print(level, ...)	(msg_enabled(level) ? print(level, __VA_ARGS__) : 0)
+#define msg_gerr(...)	msg_print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* general errors */
+#define msg_perr(...)	msg_print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* programmer errors */
+#define msg_cerr(...)	msg_print(FLASHPROG_MSG_ERROR, __VA_ARGS__)	/* chip errors */
+#define msg_gwarn(...)	msg_print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* general warnings */
+#define msg_pwarn(...)	msg_print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* programmer warnings */
+#define msg_cwarn(...)	msg_print(FLASHPROG_MSG_WARN, __VA_ARGS__)	/* chip warnings */
+#define msg_ginfo(...)	msg_print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* general info */
+#define msg_pinfo(...)	msg_print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* programmer info */
+#define msg_cinfo(...)	msg_print(FLASHPROG_MSG_INFO, __VA_ARGS__)	/* chip info */
+#define msg_gdbg(...)	msg_print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* general debug */
+#define msg_pdbg(...)	msg_print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* programmer debug */
+#define msg_cdbg(...)	msg_print(FLASHPROG_MSG_DEBUG, __VA_ARGS__)	/* chip debug */
+#define msg_gdbg2(...)	msg_print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* general debug2 */
+#define msg_pdbg2(...)	msg_print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* programmer debug2 */
+#define msg_cdbg2(...)	msg_print(FLASHPROG_MSG_DEBUG2, __VA_ARGS__)	/* chip debug2 */
+#define msg_gspew(...)	msg_print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* general debug spew  */
+#define msg_pspew(...)	msg_print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* programmer debug spew  */
+#define msg_cspew(...)	msg_print(FLASHPROG_MSG_SPEW, __VA_ARGS__)	/* chip debug spew  */
 void flashprog_progress_add(struct flashprog_flashctx *, size_t progress);
+bool flashprog_cancelled(const struct flashprog_flashctx *);
 
 /* spi.c */
 struct spi_command {
@@ -521,10 +877,53 @@ struct spi_command {
 	unsigned int readcnt;
 	const unsigned char *writearr;
 	unsigned char *readarr;
+	/*
+	 * Only the opcode (first byte of `writearr`) is sent on a single line,
+	 * unless `io_mode` is QPI_4_4_4. The rest of `writearr` and the read
+	 * data use the lines given by `io_mode`, see spi_addr_lines() and
+	 * spi_data_lines(). While the chip is in QPI mode, spi_send_command()
+	 * and spi_send_multicommand() turn all single-I/O commands into 4-4-4.
+	 */
+	enum io_mode io_mode;
+	/*
+	 * Optional payload, sent right after `writearr` within the same
+	 * command. Only set for masters with SPI_MASTER_GATHER, so write
+	 * data doesn't have to be copied behind the command header first.
+	 * `writecnt` doesn't include it.
+	 */
+	unsigned int datacnt;
+	const unsigned char *dataarr;
 };
-#define NULL_SPI_CMD { 0, 0, NULL, NULL, }
+#define NULL_SPI_CMD { 0, 0, NULL, NULL, SINGLE_IO_1_1_1, 0, NULL, }
 int spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
 int spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds);
 
-enum chipbustype get_buses_supported(void);
+/*
+ * Commands added to a `struct spi_queue` are sent when the queue is flushed,
+ * with as few multicommand calls as the WIP polls in between allow. The
+ * command buffers have to stay valid until then.
+ */
+#define SPI_QUEUE_LEN 8
+struct spi_queue {
+	struct spi_command cmds[SPI_QUEUE_LEN];
+	/* If set, wait for WIP to clear after cmds[i], before any later command. */
+	const struct wip_timing *poll[SPI_QUEUE_LEN];
+	size_t count;
+};
+int spi_queue_add(struct flashctx *, struct spi_queue *, const unsigned char *writearr, unsigned int writecnt,
+		  unsigned char *readarr, unsigned int readcnt);
+int spi_queue_add_data(struct flashctx *, struct spi_queue *, const unsigned char *writearr, unsigned int writecnt,
+		       const unsigned char *dataarr, unsigned int datacnt);
+void spi_queue_poll(struct spi_queue *, const struct wip_timing *);
+int spi_queue_flush(struct flashctx *, struct spi_queue *);
+/* Longest status read that pads the time of a program operation. */
+#define SPI_MAX_PAD	512
+unsigned int spi_pad_len(const struct flashctx *, unsigned int usecs);
+
+/* spi_trace.c */
+bool spi_trace_enabled(void);
+int spi_trace_start(const char *path);
+void spi_trace_record(const struct spi_command *, bool chained, uint64_t start_us, int result);
+int spi_trace_stop(void);
+int spi_trace_replay(const struct flashctx *, const char *path);
 #endif				/* !__FLASH_H__ */
@@ -575,6 +575,9 @@
 #define MACRONIX_MX29SL800CB	0x6B	/* Same as MX29SL802CB */
 #define MACRONIX_MX29SL800CT	0xEA	/* Same as MX29SL802CT */
 
+#define MICRON_ID		0x2C	/* Micron (SPI NAND), the NOR chips use ST_ID */
+#define MICRON_MT29F1G01ABAFD	0x14
+
 /* Nantronics Semiconductors is listed in JEP106AJ in bank 7, so it should have 6 continuation codes in front
  * of the manufacturer ID of 0xD5. http://www.nantronicssemi.com */
 #define NANTRONICS_ID			0x7F7F7F7F7F7FD5	/* Nantronics */
@@ -971,6 +974,8 @@
 #define WINBOND_NEX_W25Q64JV	0x7017	/* W25Q64JV */
 #define WINBOND_NEX_W25Q128_V_M	0x7018	/* W25Q128JVSM */
 #define WINBOND_NEX_W25Q256JV_M	0x7019	/* W25Q256JV_M (QE=0) */
+#define WINBOND_NEX_W25M512JV	0x7119	/* W25M512JV, two W25Q256JV dies */
+#define WINBOND_NEX_W25N01GV	0xAA21	/* W25N01GV SPI NAND */
 #define WINBOND_NEX_W25Q32JW_M	0x8016  /* W25Q32JW...M */
 #define WINBOND_NEX_W25Q64JW_M	0x8017  /* W25Q64JW...M */
 #define WINBOND_NEX_W25Q128_DTR	0x8018	/* W25Q128JW_DTR */
@@ -22,6 +22,7 @@
 #ifndef __HWACCESS_X86_IO_H__
 #define __HWACCESS_X86_IO_H__ 1
 
+#include <stddef.h>
 #include <stdint.h>
 /**
  */
@@ -34,4 +35,8 @@ uint8_t INB(uint16_t port);
 uint16_t INW(uint16_t port);
 uint32_t INL(uint16_t port);
 
+/* Write or read `len' bytes to/from the same port. */
+void OUTSB(const uint8_t *buf, size_t len, uint16_t port);
+void INSB(uint8_t *buf, size_t len, uint16_t port);
+
 #endif /* __HWACCESS_X86_IO_H__ */
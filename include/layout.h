@@ -59,6 +59,7 @@ int process_include_args(struct flashprog_layout *, const struct layout_include_
 void cleanup_include_args(struct layout_include_args **);
 
 const struct romentry *layout_next_included_region(const struct flashprog_layout *, chipoff_t);
+bool layout_next_included_span(const struct flashprog_layout *, chipoff_t where, chipoff_t *start, chipoff_t *end);
 const struct romentry *layout_next_included(const struct flashprog_layout *, const struct romentry *);
 const struct romentry *layout_next(const struct flashprog_layout *, const struct romentry *);
 int layout_sanity_checks(const struct flashprog_flashctx *, bool write_it);
@@ -39,15 +39,60 @@ enum flashprog_log_level {
 /** @ingroup flashprog-general */
 typedef int(flashprog_log_callback)(enum flashprog_log_level, const char *format, va_list);
 void flashprog_set_log_callback(flashprog_log_callback *);
+void flashprog_set_log_level(enum flashprog_log_level);
+/** @ingroup flashprog-general */
+typedef void *(flashprog_malloc_fn)(size_t size, void *user_data);
+/** @ingroup flashprog-general */
+typedef void(flashprog_free_fn)(void *ptr, void *user_data);
+int flashprog_set_allocator(flashprog_malloc_fn *, flashprog_free_fn *, void *user_data);
+void flashprog_set_memory_limit(size_t limit);
 
 /** @ingroup flashprog-prog */
 struct flashprog_programmer;
 int flashprog_programmer_init(struct flashprog_programmer **, const char *prog_name, const char *prog_params);
 int flashprog_programmer_shutdown(struct flashprog_programmer *);
+/** @ingroup flashprog-prog */
+enum flashprog_io_mode {
+	FLASHPROG_IO_1_1_1,	/**< Single I/O. */
+	FLASHPROG_IO_1_1_2,	/**< Dual output, data on two lines. */
+	FLASHPROG_IO_1_2_2,	/**< Dual I/O, address and data on two lines. */
+	FLASHPROG_IO_1_1_4,	/**< Quad output, data on four lines. */
+	FLASHPROG_IO_1_4_4,	/**< Quad I/O, address and data on four lines. */
+	FLASHPROG_IO_4_4_4,	/**< QPI, whole commands on four lines. */
+};
+/** @ingroup flashprog-prog */
+enum flashprog_programmer_cap {
+	FLASHPROG_CAP_SPI		= 1 << 0,	/**< The chip is accessed with SPI commands. */
+	FLASHPROG_CAP_4BA		= 1 << 1,	/**< 4-byte addresses can be sent. */
+	FLASHPROG_CAP_MULTICOMMAND	= 1 << 2,	/**< Commands are batched into one transaction. */
+	FLASHPROG_CAP_BATCH_POLL	= 1 << 3,	/**< Status polls go with the write batch. */
+	FLASHPROG_CAP_QUEUED_ERASE	= 1 << 4,	/**< Erases can run in the background. */
+	FLASHPROG_CAP_POLL_BUSY		= 1 << 5,	/**< The programmer polls the busy status itself. */
+	FLASHPROG_CAP_BLANK_CHECK	= 1 << 6,	/**< Erased state is checked on the programmer. */
+	FLASHPROG_CAP_CHECKSUM		= 1 << 7,	/**< Checksums are calculated on the programmer. */
+	FLASHPROG_CAP_SET_SPEED		= 1 << 8,	/**< The SPI clock can be selected. */
+	FLASHPROG_CAP_ACCESS_REGIONS	= 1 << 9,	/**< Protected ranges are known and skipped. */
+};
+/** @ingroup flashprog-prog */
+struct flashprog_programmer_caps {
+	unsigned int flags;		/**< Combination of `enum flashprog_programmer_cap`. */
+	unsigned int io_modes;		/**< Bit (1 << mode) set for each usable `enum flashprog_io_mode`. */
+	enum flashprog_io_mode read_mode;	/**< I/O mode of reads of the chip. */
+	size_t max_data_read;		/**< Largest read per transaction in bytes, 0 if unspecified. */
+	size_t max_data_write;		/**< Largest write per transaction in bytes, 0 if unspecified. */
+	unsigned long clock_hz;		/**< Current SPI clock, 0 if unknown. */
+	const unsigned long *speeds;	/**< Selectable SPI clocks in Hz, ascending. */
+	size_t speed_count;		/**< Number of entries in `speeds`. */
+};
 
 struct flashprog_flashctx;
-int flashprog_flash_probe(struct flashprog_flashctx **, const struct flashprog_programmer *, const char *chip_name);
+int flashprog_flash_probe(struct flashprog_flashctx **, struct flashprog_programmer *, const char *chip_name);
+int flashprog_flash_probe_cs(struct flashprog_flashctx **, struct flashprog_programmer *,
+			     const char *chip_name, unsigned int chip_select);
 size_t flashprog_flash_getsize(const struct flashprog_flashctx *);
+unsigned long flashprog_flash_get_spi_clock(const struct flashprog_flashctx *);
+void flashprog_programmer_get_caps(const struct flashprog_flashctx *, struct flashprog_programmer_caps *);
+int flashprog_flash_sfdp_overlay(struct flashprog_flashctx *);
 int flashprog_flash_erase(struct flashprog_flashctx *);
 void flashprog_flash_release(struct flashprog_flashctx *);
 
@@ -58,6 +103,26 @@ enum flashprog_progress_stage {
 };
 typedef void(flashprog_progress_callback)(enum flashprog_progress_stage, size_t current, size_t total, void *user_data);
 void flashprog_set_progress_callback(struct flashprog_flashctx *, flashprog_progress_callback *, void *user_data);
+void flashprog_set_progress_interval(struct flashprog_flashctx *, unsigned int interval_ms, size_t granularity);
+int flashprog_progress_get_rate(const struct flashprog_flashctx *, unsigned long long *bytes_per_second,
+				unsigned long *eta_seconds);
+
+/** @ingroup flashprog-flash */
+enum flashprog_event_id {
+	FLASHPROG_EVENT_ERASE_BLOCK	= 1,	/**< A block was erased and checked. */
+	FLASHPROG_EVENT_WRITE		= 2,	/**< A range was programmed. */
+	FLASHPROG_EVENT_SKIP		= 3,	/**< A region was already up to date. */
+	FLASHPROG_EVENT_VERIFY		= 4,	/**< A range was verified. */
+};
+struct flashprog_event {
+	enum flashprog_event_id id;
+	size_t start;	/**< Offset of the range in the flash chip. */
+	size_t len;	/**< Length of the range. */
+	int result;	/**< 0 on success. */
+};
+typedef void(flashprog_event_callback)(const struct flashprog_event *, void *user_data);
+void flashprog_set_event_callback(struct flashprog_flashctx *, flashprog_event_callback *, void *user_data);
+const char *flashprog_event_name(enum flashprog_event_id);
 
 /** @ingroup flashprog-flash */
 enum flashprog_flag {
@@ -65,13 +130,123 @@ enum flashprog_flag {
 	FLASHPROG_FLAG_FORCE_BOARDMISMATCH,
 	FLASHPROG_FLAG_VERIFY_AFTER_WRITE,
 	FLASHPROG_FLAG_VERIFY_WHOLE_CHIP,
+	FLASHPROG_FLAG_STREAMING_WRITE,
+	FLASHPROG_FLAG_VERIFY_INLINE,
+	FLASHPROG_FLAG_CHECKED_READ,
 };
 void flashprog_flag_set(struct flashprog_flashctx *, enum flashprog_flag, bool value);
 bool flashprog_flag_get(const struct flashprog_flashctx *, enum flashprog_flag);
 
+/** @ingroup flashprog-flash */
+enum flashprog_erase_check {
+	FLASHPROG_ERASE_CHECK_FULL,	/**< Read back every erased block (default). */
+	FLASHPROG_ERASE_CHECK_SAMPLED,	/**< Read back a few samples of every erased block. */
+	FLASHPROG_ERASE_CHECK_NONE,	/**< Trust the erase commands. */
+};
+void flashprog_erase_check_set(struct flashprog_flashctx *, enum flashprog_erase_check);
+
+/** @ingroup flashprog-flash */
+struct flashprog_usb_stats {
+	unsigned long transfers;		/**< Synchronous USB transfers of the programmer. */
+	unsigned long timeouts;			/**< Transfers that timed out. */
+	unsigned long errors;			/**< Transfers that failed otherwise. */
+	unsigned long long bytes;		/**< Bytes actually transferred. */
+	unsigned long long time_us;		/**< Time spent in transfers. */
+	unsigned long by_size[8];		/**< Transfers of up to 64 << i bytes, the last entry counts larger ones. */
+	unsigned long by_latency[8];		/**< Transfers faster than 125 << i us, the last entry counts slower ones. */
+};
+/** @ingroup flashprog-flash */
+struct flashprog_delay_stats {
+	unsigned long count;			/**< Precise delays whose end could be measured. */
+	unsigned long by_lateness[8];		/**< Delays that ended less than 2 << i us late, the last entry counts later ones. */
+};
+struct flashprog_stats {
+	unsigned long spi_transactions;		/**< Calls into the SPI master. */
+	unsigned long spi_commands;		/**< SPI commands in these transactions. */
+	unsigned long long bytes_out;		/**< Bytes sent to the chip, including opcodes. */
+	unsigned long long bytes_in;		/**< Bytes received from the chip. */
+	unsigned long wip_polls;		/**< Status polls while the chip was busy. */
+	unsigned long long delay_us;		/**< Time spent in programmer delays. */
+	unsigned long long skipped_bytes;	/**< Bytes not written because they were up to date. */
+	unsigned long skipped_erased_pages;	/**< Whole pages of these that stay erased. */
+	struct {
+		unsigned int size;
+		unsigned long count;
+	} erased_blocks[8];			/**< Erased blocks by size, unused entries are zero. */
+	unsigned long long stage_us[3];		/**< Time per enum flashprog_progress_stage. */
+	struct flashprog_usb_stats usb;		/**< Zero for programmers without usbdev.c transfers. */
+	struct flashprog_delay_stats delays;	/**< Timing jitter of busy-waiting delays, zero without a precise clock. */
+};
+void flashprog_stats_get(const struct flashprog_flashctx *, struct flashprog_stats *);
+void flashprog_stats_reset(struct flashprog_flashctx *);
+
 int flashprog_image_read(struct flashprog_flashctx *, void *buffer, size_t buffer_len);
+typedef int(flashprog_read_sink)(const void *data, size_t offset, size_t len, void *user_data);
+int flashprog_image_read_stream(struct flashprog_flashctx *, flashprog_read_sink *, void *user_data);
+int flashprog_image_sha256(struct flashprog_flashctx *, unsigned char digest[32]);
 int flashprog_image_write(struct flashprog_flashctx *, void *buffer, size_t buffer_len, const void *refbuffer);
+typedef int(flashprog_image_wait)(size_t len, void *user_data);
+int flashprog_image_write_loading(struct flashprog_flashctx *, void *buffer, size_t buffer_len,
+				  flashprog_image_wait *, void *user_data);
+struct flashprog_extent {
+	size_t offset;
+	size_t len;
+	const void *data;
+};
+int flashprog_image_write_extents(struct flashprog_flashctx *, const struct flashprog_extent *, size_t count);
+struct flashprog_iovec {
+	const void *base;
+	size_t len;
+};
+int flashprog_image_writev(struct flashprog_flashctx *, const struct flashprog_iovec *, size_t iovcnt);
+int flashprog_image_write_multi(struct flashprog_flashctx *const flashctxs[], size_t count,
+				const void *buffer, size_t buffer_len);
+struct flashprog_plan {
+	size_t count;				/**< Number of planned operations. */
+	struct flashprog_event *ops;		/**< Erases and writes in order, all results are zero. */
+	unsigned long long erase_bytes;		/**< Total size of the planned erases. */
+	unsigned long long write_bytes;		/**< Total size of the planned writes. */
+	unsigned long long estimated_us;	/**< Estimated time of the whole write, with reading and verifying. */
+};
+int flashprog_image_plan(struct flashprog_flashctx *, const void *buffer, size_t buffer_len,
+			 const void *refbuffer, struct flashprog_plan **);
+void flashprog_plan_release(struct flashprog_plan *);
 int flashprog_image_verify(struct flashprog_flashctx *, const void *buffer, size_t buffer_len);
+int flashprog_image_verify_sha256(struct flashprog_flashctx *, const void *buffer, size_t buffer_len,
+				  unsigned char digest[32]);
+struct flashprog_sampled_verify {
+	unsigned int stride;	/**< In: read back every stride-th block, 1 reads all. */
+	unsigned int cursor;	/**< In/out: first block to read back, advanced for the next run. */
+	size_t blocks;		/**< Out: number of blocks with included data. */
+	size_t read;		/**< Out: blocks that were read back. */
+	size_t checksummed;	/**< Out: blocks that were compared by programmer checksum only. */
+	unsigned int coverage;	/**< Out: chance in percent that a single bad block would have been caught. */
+	bool escalated;		/**< Out: a mismatch was found and everything was verified again. */
+};
+int flashprog_image_verify_sampled(struct flashprog_flashctx *, const void *buffer, size_t buffer_len,
+				   struct flashprog_sampled_verify *);
+int flashprog_region_read(struct flashprog_flashctx *, const char *name, void *buffer, size_t buffer_len);
+int flashprog_region_write(struct flashprog_flashctx *, const char *name, const void *buffer, size_t buffer_len);
+int flashprog_region_verify(struct flashprog_flashctx *, const char *name, const void *buffer, size_t buffer_len);
+
+/** @ingroup flashprog-job */
+enum flashprog_job_type {
+	FLASHPROG_JOB_READ,
+	FLASHPROG_JOB_WRITE,
+	FLASHPROG_JOB_VERIFY,
+	FLASHPROG_JOB_ERASE,
+};
+struct flashprog_job;
+typedef void(flashprog_job_callback)(struct flashprog_job *, int result, void *user_data);
+int flashprog_job_submit(struct flashprog_job **, struct flashprog_flashctx *, enum flashprog_job_type,
+			 void *buffer, size_t buffer_len, const void *refbuffer,
+			 flashprog_job_callback *, void *user_data);
+int flashprog_job_poll(struct flashprog_job *, int *result);
+int flashprog_job_get_fd(const struct flashprog_job *);
+void flashprog_job_get_progress(struct flashprog_job *, enum flashprog_progress_stage *,
+				size_t *current, size_t *total);
+void flashprog_job_cancel(struct flashprog_job *);
+int flashprog_job_release(struct flashprog_job *);
 
 struct flashprog_layout;
 int flashprog_layout_new(struct flashprog_layout **);
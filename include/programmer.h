@@ -52,7 +52,11 @@ struct programmer_entry {
 
 	int (*init) (struct flashprog_programmer *);
 
-	void (*delay) (unsigned int usecs);
+	void (*delay) (struct flashprog_programmer *, unsigned int usecs);
+
+	/* Keeps all its state in the programmer context, so several
+	   programmers of this driver may be used at once. */
+	bool multi_instance;
 };
 
 extern const struct programmer_entry *const programmer_table[];
@@ -97,15 +101,6 @@ extern const struct programmer_entry programmer_stlinkv3_spi;
 extern const struct programmer_entry programmer_usbblaster_spi;
 extern const struct programmer_entry programmer_dirtyjtag_spi;
 
-struct flashprog_programmer {
-	const struct programmer_entry *driver;
-	char *param; /* TODO: Replace with flashprog_cfg (cf. flashrom/master) */
-	void *data;
-};
-
-int programmer_init(struct flashprog_programmer *);
-int programmer_shutdown(struct flashprog_programmer *);
-
 struct bitbang_spi_master {
 	/* Note that CS# is active low, so val=0 means the chip is active. */
 	void (*set_cs) (int val, void *spi_data);
@@ -117,6 +112,13 @@ struct bitbang_spi_master {
 	/* optional functions to optimize xfers */
 	void (*set_sck_set_mosi) (int sck, int mosi, void *spi_data);
 	int (*set_sck_get_miso) (int sck, void *spi_data);
+	/*
+	 * Optional: Shift `len` bytes MSB first with CS# asserted and SCK low.
+	 * `out` may be NULL to shift zeros, `in` may be NULL to discard the
+	 * data. SCK may be left high. The backend is responsible for the
+	 * timing, it's used instead of the per-bit callbacks above.
+	 */
+	void (*shift_bytes) (const uint8_t *out, uint8_t *in, size_t len, void *spi_data);
 	/* Length of half a clock period in usecs. */
 	unsigned int half_period;
 };
@@ -220,6 +222,9 @@ void myusec_delay(unsigned int usecs);
 void myusec_calibrate_delay(void);
 void internal_sleep(unsigned int usecs);
 void internal_delay(unsigned int usecs);
+uint64_t monotonic_us(void);
+struct flashprog_delay_stats;
+const struct flashprog_delay_stats *internal_delay_stats(void);
 
 #if CONFIG_INTERNAL == 1
 /* board_enable.c */
@@ -240,7 +245,7 @@ int board_flash_enable(struct flashprog_programmer *, const char *vendor, const
 int chipset_flash_enable(struct flashprog_programmer *);
 
 /* processor_enable.c */
-int processor_flash_enable(void);
+int processor_flash_enable(struct flashprog_programmer *);
 #endif
 
 #if CONFIG_INTERNAL == 1
@@ -258,6 +263,10 @@ int dmi_match(const char *pattern);
 /* internal.c */
 struct internal_data {
 	size_t max_rom_decode;
+	/* Size of the BIOS decode range below 4 GiB, regardless of FWH IDSEL. */
+	size_t bios_decode_len;
+	/* Access width for memory-mapped reads (4 or 8), 0 leaves it to memcpy(). */
+	size_t mmio_read_align;
 };
 struct superio {
 	uint16_t vendor;
@@ -286,9 +295,6 @@ int register_spi_bitbang_master(const struct bitbang_spi_master *master, void *s
 
 
 /* flashprog.c */
-// FIXME: These need to be local, not global
-extern bool programmer_may_write;
-extern unsigned long flashbase;
 char *extract_programmer_param(const char *param_name);
 
 /* spi.c */
@@ -299,6 +305,17 @@ char *extract_programmer_param(const char *param_name);
 #define SPI_MASTER_4BA			(1U << 0)  /**< Can handle 4-byte addresses */
 #define SPI_MASTER_NO_4BA_MODES		(1U << 1)  /**< Compatibility modes (i.e. extended address
 						        register, 4BA mode switch) don't work */
+#define SPI_MASTER_DUAL_OUT		(1U << 2)  /**< Can read data on two lines (1-1-2) */
+#define SPI_MASTER_DUAL_IO		(1U << 3)  /**< Can send address and read data on two lines (1-2-2) */
+#define SPI_MASTER_QUAD_OUT		(1U << 4)  /**< Can read data on four lines (1-1-4) */
+#define SPI_MASTER_QUAD_IO		(1U << 5)  /**< Can send address and read data on four lines (1-4-4) */
+#define SPI_MASTER_BATCH_POLL		(1U << 6)  /**< Multicommand queues reads too, so a status
+						        poll can go with the write command batch */
+#define SPI_MASTER_GATHER		(1U << 7)  /**< Multicommand sends `dataarr` of a command
+						        after its `writearr` */
+#define SPI_MASTER_QPI			(1U << 8)  /**< Can send whole commands on four lines (4-4-4) */
+#define SPI_MASTER_DUAL			(SPI_MASTER_DUAL_OUT | SPI_MASTER_DUAL_IO)
+#define SPI_MASTER_QUAD			(SPI_MASTER_QUAD_OUT | SPI_MASTER_QUAD_IO)
 
 struct spi_master {
 	uint32_t features;
@@ -314,6 +331,25 @@ struct spi_master {
 	int (*write_aai)(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 	int (*shutdown)(void *data);
 	bool (*probe_opcode)(const struct flashctx *flash, uint8_t opcode);
+	/* Optional, checks on the programmer if a range is erased (returns 0), not (1), or fails (<0) */
+	int (*blank_check)(struct flashctx *flash, unsigned int start, unsigned int len, uint8_t erased_value);
+	/* Optional, calculates a CRC-32 (see crc32_update()) of a range on the programmer, returns 0 on success */
+	int (*checksum)(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
+	/* Optional, narrows `region` around `addr` to where the access restrictions are the same */
+	void (*get_region)(const struct flashctx *flash, chipoff_t addr, struct flash_region *region);
+	/* Optional, waits for WIP to clear like spi_poll_wip(), returns 0 on success */
+	int (*poll_busy)(struct flashctx *flash, const struct wip_timing *timing);
+	/* Optional, lists the SPI clocks in Hz that set_speed() accepts, ascending, returns their number */
+	size_t (*list_speeds)(const struct flashctx *flash, const unsigned long **speeds);
+	/* Optional, switches to one of the clocks of list_speeds(), returns 0 on success */
+	int (*set_speed)(const struct flashctx *flash, unsigned long hz);
+	/* Set by masters for `spispeed=auto', spi_tune_speed() is then run after the first probe */
+	bool tune_speed;
+	/* Optional, the SPI clock in Hz if known, see flashprog_flash_get_spi_clock() */
+	unsigned long clock_hz;
+	/* Optional, number of chips the master can address. Its functions
+	   then have to talk to the one given by `flash->chip_select`. */
+	unsigned int chip_selects;
 	void *data;
 };
 
@@ -323,8 +359,12 @@ int default_spi_send_multicommand(const struct flashctx *flash, struct spi_comma
 int default_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
+int spi_write_aai_batched(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+			  size_t batch_words);
 bool default_spi_probe_opcode(const struct flashctx *flash, uint8_t opcode);
 int register_spi_master(const struct spi_master *mst, size_t max_rom_decode, void *data);
+int spi_tune_speed(struct flashctx *flash);
+int spi_slow_down(struct flashctx *flash);
 
 /* The following enum is needed by ich_descriptor_tool and ich* code as well as in chipset_enable.c. */
 enum ich_chipset {
@@ -359,11 +399,11 @@ enum ich_chipset {
 
 /* ichspi.c */
 #if CONFIG_INTERNAL == 1
-int ich_init_spi(void *spibar, enum ich_chipset ich_generation);
+int ich_init_spi(void *spibar, enum ich_chipset ich_generation, size_t bios_decode_len);
 int via_init_spi(uint32_t mmio_base);
 
 /* amd_imc.c */
-int handle_imc(struct pci_dev *);
+int handle_imc(struct flashprog_programmer *, struct pci_dev *);
 
 /* amd_spi100.c */
 int amd_spi100_probe(void *const spibar, void *const memory_mapping, const size_t mapped_len);
@@ -385,7 +425,7 @@ static inline int try_mtd(struct flashprog_programmer *prog) { return 1; };
 int mcp6x_spi_init(int want_spi);
 
 /* sb600spi.c */
-int sb600_probe_spi(struct pci_dev *dev);
+int sb600_probe_spi(struct flashprog_programmer *, struct pci_dev *dev);
 
 /* wbsio_spi.c */
 int wbsio_check_for_spi(struct flashprog_programmer *);
@@ -400,6 +440,18 @@ struct opaque_master {
 	int (*read) (struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 	int (*write) (struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 	int (*erase) (struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+	/*
+	 * Optional, queued erase: `erase_queue` may start the erase in the
+	 * background or collect it with the following ones, `erase_flush`
+	 * waits for all queued erases. Both return like `erase`, and no other
+	 * callback is called before the queue is flushed.
+	 */
+	int (*erase_queue)(struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+	int (*erase_flush)(struct flashctx *flash);
+	/* Optional, see `struct spi_master` */
+	int (*blank_check)(struct flashctx *flash, unsigned int start, unsigned int len, uint8_t erased_value);
+	int (*checksum)(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
+	void (*get_region)(const struct flashctx *flash, chipoff_t addr, struct flash_region *region);
 	int (*shutdown)(void *data);
 	void *data;
 };
@@ -443,10 +495,58 @@ struct registered_master {
 		struct spi_master spi;
 		struct opaque_master opaque;
 	};
+	/* The programmer that registered this master. */
+	struct flashprog_programmer *prog;
 };
-extern struct registered_master registered_masters[];
-extern int registered_master_count;
 int register_master(const struct registered_master *mst);
+enum chipbustype get_buses_supported(const struct flashprog_programmer *);
+
+/* The limit of 4 is totally arbitrary. */
+#define MASTERS_MAX 4
+#define SHUTDOWN_MAXFN 32
+#define SPI_ID_CACHE_SIZE 8
+struct flashprog_programmer {
+	const struct programmer_entry *driver;
+	char *param; /* TODO: Replace with flashprog_cfg (cf. flashrom/master) */
+	void *data;
+
+	/* Registered with register_master() during programmer init. */
+	int master_count;
+	struct registered_master masters[MASTERS_MAX];
+
+	/* Is writing allowed with this programmer? Broken programmers clear it. */
+	bool may_write;
+	/* If nonzero, used as the start address of bottom-aligned flash. */
+	unsigned long flashbase;
+
+	/* Time spent in programmer_delay() so far, for the statistics. */
+	unsigned long long delay_total_us;
+
+	/* A job of libflashprog_job.c runs on one of its chips. */
+	bool job_running;
+	/* Holds the slot of the single programmer that isn't multi_instance. */
+	bool exclusive;
+
+	/* ID responses of the SPI masters, cached while probing (spi25.c). */
+	unsigned int spi_id_cache_count;
+	struct spi_id_cache_entry {
+		const struct spi_master *mst;
+		uint8_t opcode;
+		int bytes;
+		unsigned char data[4];
+	} spi_id_cache[SPI_ID_CACHE_SIZE];
+
+	/* Registered with register_shutdown(), called in reverse order on shutdown. */
+	int shutdown_fn_count;
+	/** @private */
+	struct shutdown_func_data {
+		int (*func) (void *data);
+		void *data;
+	} shutdown_fn[SHUTDOWN_MAXFN];
+};
+
+int programmer_init(struct flashprog_programmer *);
+int programmer_shutdown(struct flashprog_programmer *);
 
 
 /* serial.c */
@@ -460,8 +560,11 @@ typedef int fdtype;
 
 void sp_flush_incoming(void);
 fdtype sp_openserport(char *dev, int baud);
+void sp_set_low_latency(const char *dev);
 extern fdtype sp_fd;
 int serialport_config(fdtype fd, int baud);
+int serialport_get_baud(fdtype fd);
+bool serialport_baud_supported(unsigned int baud);
 int serialport_shutdown(void *data);
 int serialport_write(const unsigned char *buf, unsigned int writecnt);
 int serialport_write_nonblock(const unsigned char *buf, unsigned int writecnt, unsigned int timeout, unsigned int *really_wrote);
@@ -493,6 +596,7 @@ enum SP_PIN {
 };
 
 void sp_set_pin(enum SP_PIN pin, int val);
+void sp_set_dtr_rts(int dtr, int rts);
 int sp_get_pin(enum SP_PIN pin);
 
 /* spi_master feature checks */
@@ -505,12 +609,54 @@ static inline bool spi_master_no_4ba_modes(const struct flashctx *const flash)
 	return flash->mst.spi->features & SPI_MASTER_NO_4BA_MODES;
 }
 
+/* Number of lines used for the opcode. */
+static inline unsigned int spi_opcode_lines(const enum io_mode io_mode)
+{
+	return io_mode == QPI_4_4_4 ? 4 : 1;
+}
+
+/* Number of lines used for address, mode and dummy bits. */
+static inline unsigned int spi_addr_lines(const enum io_mode io_mode)
+{
+	switch (io_mode) {
+	case DUAL_IO_1_2_2:	return 2;
+	case QUAD_IO_1_4_4:
+	case QPI_4_4_4:		return 4;
+	default:		return 1;
+	}
+}
+
+/* Number of lines used for data. */
+static inline unsigned int spi_data_lines(const enum io_mode io_mode)
+{
+	switch (io_mode) {
+	case DUAL_OUT_1_1_2:
+	case DUAL_IO_1_2_2:	return 2;
+	case QUAD_OUT_1_1_4:
+	case QUAD_IO_1_4_4:
+	case QPI_4_4_4:		return 4;
+	default:		return 1;
+	}
+}
+
 /* usbdev.c */
 struct libusb_device_handle;
 struct libusb_context;
+int usb_dev_init(struct libusb_context **);
+void usb_dev_exit(struct libusb_context *);
+int usb_dev_watch_start(const struct dev_entry *);
+int usb_dev_watch_wait(bool present, unsigned int timeout_ms);
+void usb_dev_watch_stop(void);
 struct libusb_device_handle *usb_dev_get_by_vid_pid_serial(
 		struct libusb_context *usb_ctx, uint16_t vid, uint16_t pid, const char *serialno);
 struct libusb_device_handle *usb_dev_get_by_vid_pid_number(
 		struct libusb_context *usb_ctx, uint16_t vid, uint16_t pid, unsigned int num);
+int usb_dev_bulk_transfer(struct libusb_device_handle *, unsigned char endpoint,
+			  unsigned char *data, int length, int *transferred, unsigned int timeout);
+int usb_dev_interrupt_transfer(struct libusb_device_handle *, unsigned char endpoint,
+			       unsigned char *data, int length, int *transferred, unsigned int timeout);
+int usb_dev_control_transfer(struct libusb_device_handle *, uint8_t request_type,
+			     uint8_t request, uint16_t value, uint16_t index,
+			     unsigned char *data, uint16_t length, unsigned int timeout);
 
 #endif				/* !__PROGRAMMER_H__ */
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SFDP_H__
+#define __SFDP_H__ 1
+
+#include <stdint.h>
+
+/*
+ * Layout of the Serial Flash Discoverable Parameters (JESD216), as far
+ * as we parse them in sfdp.c. The dummy programmer builds its emulated
+ * tables from the same definitions.
+ */
+
+#define SFDP_SIGNATURE		0x50444653	/* "SFDP", little endian */
+#define SFDP_HEADER_LEN		8		/* also the length of each parameter header */
+
+/* Parameter header, `id` is the LSB of the ID, `id_msb` its MSB. */
+struct sfdp_tbl_hdr {
+	uint8_t id;
+	uint8_t v_minor;
+	uint8_t v_major;
+	uint8_t len; /* in double words */
+	uint32_t ptp; /* 24b pointer */
+	uint8_t id_msb;
+};
+
+#define SFDP_JEDEC_ID_MSB	0xff
+#define SFDP_BFPT_ID		0x00	/* Basic Flash Parameter Table */
+#define SFDP_4BAIT_ID		0x84	/* 4-byte Address Instruction Table */
+
+/* Basic Flash Parameter Table, 1st double word */
+#define SFDP_BFPT_DW1_ERASE_4K		(1 << 0)	/* bits 0..1 are 01b: 4KiB erase supported, */
+#define SFDP_BFPT_DW1_ERASE_4K_OP_SHIFT	8		/* with this opcode */
+#define SFDP_BFPT_DW1_WRITE_64		(1 << 2)	/* write granularity of 64B or more */
+#define SFDP_BFPT_DW1_ADDR_SHIFT	17		/* addressing mode, 2 bits: */
+#define  SFDP_BFPT_ADDR_3		0
+#define  SFDP_BFPT_ADDR_3_OR_4		1
+#define  SFDP_BFPT_ADDR_4		2
+#define SFDP_BFPT_DW1_FAST_READ_112	(1 << 16)
+#define SFDP_BFPT_DW1_FAST_READ_122	(1 << 20)
+#define SFDP_BFPT_DW1_FAST_READ_144	(1 << 21)
+#define SFDP_BFPT_DW1_FAST_READ_114	(1 << 22)
+
+/* Fast-read parameters, half a double word in the 3rd and 4th double word */
+#define SFDP_FAST_READ_PARAMS(opcode, mode_clocks, dummy_clocks) \
+	((opcode) << 8 | ((mode_clocks) & 0x7) << 5 | ((dummy_clocks) & 0x1f))
+
+/* Basic Flash Parameter Table, 5th double word */
+#define SFDP_BFPT_DW5_FAST_READ_444	(1 << 4)
+/* The upper half of the 7th double word holds the 4-4-4 fast-read parameters. */
+
+/* Basic Flash Parameter Table, 15th double word */
+#define SFDP_BFPT_DW15_QPI_EXIT_SHIFT	0		/* methods to exit 4-4-4 mode, 4 bits */
+#define SFDP_BFPT_DW15_QPI_ENTER_SHIFT	4		/* methods to enter 4-4-4 mode, 5 bits */
+#define  SFDP_QPI_ENTER_QE_38		(1 << 0)	/* set QE, then 0x38 */
+#define  SFDP_QPI_ENTER_38		(1 << 1)
+#define  SFDP_QPI_ENTER_35		(1 << 2)
+#define  SFDP_QPI_EXIT_FF		(1 << 0)
+#define  SFDP_QPI_EXIT_F5		(1 << 1)
+#define SFDP_BFPT_DW15_QER_SHIFT	20		/* Quad Enable requirement, 3 bits, 0: none */
+
+/* Basic Flash Parameter Table, 16th double word */
+#define SFDP_BFPT_DW16_4BA_EXIT_SHIFT	14		/* methods to exit 4-byte addressing, 10 bits */
+#define SFDP_BFPT_DW16_4BA_ENTER_SHIFT	24		/* methods to enter 4-byte addressing, 8 bits */
+#define  SFDP_4BA_ENTER_B7		(1 << 0)
+#define  SFDP_4BA_ENTER_WREN_B7		(1 << 1)
+#define  SFDP_4BA_ENTER_EAR_C5C8	(1 << 2)
+#define  SFDP_4BA_ENTER_EAR_1716	(1 << 3)
+#define  SFDP_4BA_ONLY			(1 << 6)
+#define  SFDP_4BA_EXIT_E9		(1 << 0)
+
+/* 4-byte Address Instruction Table, 1st double word */
+#define SFDP_4BAIT_DW1_READ_13		(1 << 0)
+#define SFDP_4BAIT_DW1_FAST_READ_0C	(1 << 1)
+#define SFDP_4BAIT_DW1_PROGRAM_12	(1 << 6)
+#define SFDP_4BAIT_DW1_ERASE_TYPE_SHIFT	9		/* one bit per erase type */
+/* The 2nd double word holds one 4-byte erase opcode per erase type. */
+
+#endif /* !__SFDP_H__ */
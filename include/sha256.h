@@ -0,0 +1,33 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN	32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t len;		/* total bytes hashed */
+	uint8_t block[64];	/* the incomplete block, `len % 64` bytes */
+};
+
+void sha256_init(struct sha256_ctx *);
+void sha256_update(struct sha256_ctx *, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *, uint8_t digest[SHA256_DIGEST_LEN]);
+
+#endif /* !__SHA256_H__ */
@@ -167,6 +167,16 @@
 /* Exit 4-byte Address Mode */
 #define JEDEC_EXIT_4_BYTE_ADDR_MODE	0xE9
 
+/* Enter and exit QPI (4-4-4) mode, 0x35/0xf5 are used by Macronix chips */
+#define JEDEC_ENTER_QPI		0x38
+#define JEDEC_EXIT_QPI		0xff
+#define ALT_ENTER_QPI_35	0x35
+#define ALT_EXIT_QPI_F5		0xf5
+
+/* Read and write Status Register 2 where bit 7 is the Quad Enable bit */
+#define ALT_RDSR2_3F		0x3f
+#define ALT_WRSR2_3E		0x3e
+
 /* Write Extended Address Register */
 #define JEDEC_WRITE_EXT_ADDR_REG	0xC5
 #define ALT_WRITE_EXT_ADDR_REG_17	0x17
@@ -175,6 +185,10 @@
 #define JEDEC_READ_EXT_ADDR_REG		0xC8
 #define ALT_READ_EXT_ADDR_REG_16	0x16
 
+/* Software Die Select, switches between the dies of stacked-die chips */
+#define JEDEC_SELECT_DIE	0xC2
+#define JEDEC_SELECT_DIE_OUTSIZE	0x02
+
 /* Read the memory */
 #define JEDEC_READ		0x03
 #define JEDEC_READ_OUTSIZE	0x04
@@ -183,6 +197,12 @@
 /* Read the memory (with delay after sending address) */
 #define JEDEC_READ_FAST		0x0b
 
+/* Read the memory with multiple I/O lines (opcode-address-data) */
+#define JEDEC_READ_DUAL_OUT	0x3b	/* 1-1-2 */
+#define JEDEC_READ_DUAL_IO	0xbb	/* 1-2-2 */
+#define JEDEC_READ_QUAD_OUT	0x6b	/* 1-1-4 */
+#define JEDEC_READ_QUAD_IO	0xeb	/* 1-4-4 */
+
 /* Write memory byte */
 #define JEDEC_BYTE_PROGRAM		0x02
 #define JEDEC_BYTE_PROGRAM_OUTSIZE	0x05
@@ -193,6 +213,8 @@
 #define JEDEC_AAI_WORD_PROGRAM_OUTSIZE		0x06
 #define JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE	0x03
 #define JEDEC_AAI_WORD_PROGRAM_INSIZE		0x00
+/* Fixed wait for an AAI word that isn't polled, above the longest tBP of the SST25 data sheets. */
+#define JEDEC_AAI_WORD_PROGRAM_DELAY_US		40
 
 /* Read the memory with 4-byte address
    From ANY mode (3-bytes or 4-bytes) it works with 4-byte address */
@@ -206,6 +228,49 @@
    From ANY mode (3-bytes or 4-bytes) it works with 4-byte address */
 #define JEDEC_BYTE_PROGRAM_4BA	0x12
 
+/*
+ * SPI NAND. Pages are read from the array into the cache register and
+ * read or loaded from there by column, programmed and erased by row
+ * (page) address. Status and configuration are feature registers.
+ */
+#define SPI_NAND_GET_FEATURE		0x0f
+#define SPI_NAND_SET_FEATURE		0x1f
+#define SPI_NAND_FEATURE_PROT		0xa0
+#define SPI_NAND_FEATURE_CONFIG		0xb0
+#define SPI_NAND_FEATURE_STATUS		0xc0
+#define SPI_NAND_PROT_BP_TB		0x7c	/* block protection bits */
+#define SPI_NAND_SR_OIP			(1 << 0)
+#define SPI_NAND_SR_WEL			(1 << 1)
+#define SPI_NAND_SR_E_FAIL		(1 << 2)
+#define SPI_NAND_SR_P_FAIL		(1 << 3)
+#define SPI_NAND_SR_ECC_MASK		(3 << 4)
+#define SPI_NAND_SR_ECC_UNCORR		(2 << 4)
+
+/* Read ID, sent with a dummy byte */
+#define SPI_NAND_RDID_OUTSIZE		0x02
+
+/* Page Read to cache, followed by a 24-bit row address */
+#define SPI_NAND_PAGE_READ		0x13
+#define SPI_NAND_ROW_OUTSIZE		0x04
+
+/* Page Read Cache Sequential: read the next page while the cache is output */
+#define SPI_NAND_READ_CACHE_SEQ		0x31
+/*      Page Read Cache Last: end the sequence, without reading another page */
+#define SPI_NAND_READ_CACHE_END		0x3f
+
+/* Read from Cache, followed by a 16-bit column address and a dummy byte */
+#define SPI_NAND_READ_CACHE		0x03
+#define SPI_NAND_READ_CACHE_OUTSIZE	0x04
+
+/* Program Load (fills the cache with 0xff first) and Program Load Random Data */
+#define SPI_NAND_PROGRAM_LOAD		0x02
+#define SPI_NAND_PROGRAM_LOAD_RANDOM	0x84
+#define SPI_NAND_PROGRAM_LOAD_OUTSIZE	0x03
+
+/* Program Execute and Block Erase, followed by a 24-bit row address */
+#define SPI_NAND_PROGRAM_EXECUTE	0x10
+#define SPI_NAND_BLOCK_ERASE		0xd8
+
 /* Error codes */
 #define SPI_GENERIC_ERROR	-1
 #define SPI_INVALID_OPCODE	-2
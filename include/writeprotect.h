@@ -75,8 +75,24 @@ struct wp_bits  {
 	uint8_t bp[MAX_BP_BITS];
 };
 
+/*
+ * All protection ranges that can be selected with the writable range
+ * bits, sorted by length and start, without duplicates. Cached in the
+ * flash context, the key holds the values of the other range bits.
+ */
+struct wp_range_table {
+	struct wp_bits key;
+	size_t count;
+	struct wp_range_and_bits {
+		struct wp_bits bits;
+		struct wp_range range;
+	} entries[];
+};
+
 struct flashprog_flashctx;
 
+void spi_wp_release(struct flashprog_flashctx *);
+
 /* Write WP configuration to the chip */
 enum flashprog_wp_result spi_wp_write_cfg(struct flashprog_flashctx *, const struct flashprog_wp_cfg *);
 
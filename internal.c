@@ -191,6 +191,8 @@ static int internal_init(struct flashprog_programmer *const prog)
 		goto internal_init_exit;
 	}
 	internal->max_rom_decode = 0;
+	internal->bios_decode_len = 0;
+	internal->mmio_read_align = 0;
 	prog->data = internal;
 
 	/* Unconditionally reset global state from previous operation. */
@@ -213,7 +215,7 @@ static int internal_init(struct flashprog_programmer *const prog)
 		goto internal_init_exit;
 	}
 
-	if (processor_flash_enable()) {
+	if (processor_flash_enable(prog)) {
 		msg_perr("Processor detection/init failed.\n"
 			 "Aborting.\n");
 		ret = 1;
@@ -291,8 +293,15 @@ static int internal_init(struct flashprog_programmer *const prog)
 #endif
 
 	if (internal_buses_supported & BUS_NONSPI) {
+		/*
+		 * Map the top 16 MiB of the 32-bit address space once. Flash
+		 * chips and their registers on the parallel/LPC/FWH buses are
+		 * mapped there, probing them then only takes views into this
+		 * mapping instead of a new one for each chip.
+		 */
+		rphysmap_optional("flash decode window", 0x100000000ULL - 16 * MiB, 16 * MiB);
 		register_par_master(&par_master_internal, internal_buses_supported,
-				    internal->max_rom_decode, NULL);
+				    internal->max_rom_decode, internal);
 	}
 
 	/* Report if a non-whitelisted laptop is detected that likely uses a legacy bus. */
@@ -370,8 +379,12 @@ static uint32_t internal_chip_readl(const struct flashctx *flash,
 static void internal_chip_readn(const struct flashctx *flash, uint8_t *buf,
 				const chipaddr addr, size_t len)
 {
-	mmio_readn((void *)addr, buf, len);
-	return;
+	const struct internal_data *const internal = flash->mst.par->data;
+
+	if (internal->mmio_read_align)
+		mmio_readn_aligned((void *)addr, buf, len, internal->mmio_read_align);
+	else
+		mmio_readn((void *)addr, buf, len);
 }
 
 const struct programmer_entry programmer_internal = {
@@ -34,6 +34,9 @@
 
 const size_t it87spi_max_mmapped = 512*KiB; /* maximum of memory mapped flash this driver can handle */
 static unsigned char *it87spi_mmapped_flash;
+/* For chips bigger than the window, whether it was checked to map their top. */
+static bool it87spi_window_checked;
+static bool it87spi_window_ok;
 
 static uint16_t it8716f_flashport = 0;
 /* use fast 33MHz SPI (<>0) or slow 16MHz (0) */
@@ -230,6 +233,8 @@ static uint16_t it87spi_probe(uint16_t port)
 		return 1;
 
 	it8716f_flashport = flashport;
+	it87spi_window_checked = false;
+	it87spi_window_ok = false;
 	if (internal_buses_supported & BUS_SPI)
 		msg_pdbg("Overriding chipset SPI with IT87 SPI.\n");
 	/* FIXME: Add the SPI bus or replace the other buses with it? */
@@ -341,13 +346,65 @@ static int it8716f_spi_send_command(const struct flashctx *flash,
 	return 0;
 }
 
-/* Page size is usually 256 bytes */
-static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf, unsigned int start)
+/*
+ * The memory window covers the top 512 KiB of the chip. The IT87 forwards
+ * the lower address bits of LPC memory cycles, and bigger chips see the top
+ * of their address space there.
+ */
+static unsigned int it87spi_mapped_start(const struct flashctx *flash)
+{
+	const unsigned int chip_size = flashprog_flash_getsize(flash);
+
+	return chip_size > it87spi_max_mmapped ? chip_size - it87spi_max_mmapped : 0;
+}
+
+static unsigned char *it87spi_mapped_addr(const struct flashctx *flash, unsigned int addr)
+{
+	return it87spi_mmapped_flash + (addr + it87spi_max_mmapped - flashprog_flash_getsize(flash));
+}
+
+/*
+ * For chips bigger than the window, check once that it shows their top by
+ * comparing a few samples with command reads. The contents must differ
+ * from 512 KiB below, otherwise we couldn't tell.
+ */
+static bool it87spi_check_window(struct flashctx *flash)
+{
+	const unsigned int mapped_start = it87spi_mapped_start(flash);
+	bool match = true, distinct = false;
+	unsigned int i;
+
+	if (!mapped_start)
+		return true;
+	if (it87spi_window_checked)
+		return it87spi_window_ok;
+	it87spi_window_checked = true;
+
+	for (i = 0; i < 4; i++) {
+		const unsigned int addr = mapped_start + i * (it87spi_max_mmapped / 4);
+		uint8_t mapped[3], cmd[3], below[3];
+
+		mmio_readn(it87spi_mapped_addr(flash, addr), mapped, sizeof(mapped));
+		if (spi_nbyte_read(flash, cmd, addr, sizeof(cmd)) ||
+		    spi_nbyte_read(flash, below, addr - it87spi_max_mmapped, sizeof(below)))
+			return false;
+		match &= !memcmp(mapped, cmd, sizeof(cmd));
+		distinct |= memcmp(cmd, below, sizeof(cmd)) != 0;
+	}
+
+	it87spi_window_ok = match && distinct;
+	msg_pdbg("Memory window %s the top 512 KiB of the chip.\n",
+		 it87spi_window_ok ? "maps" : "can't be confirmed to map");
+	return it87spi_window_ok;
+}
+
+/* Programs up to 256 bytes within a page */
+static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf,
+				    unsigned int start, unsigned int len)
 {
 	unsigned int i;
 	int result;
-	unsigned char *const bios = it87spi_mmapped_flash +
-		it87spi_max_mmapped - flashprog_flash_getsize(flash);
+	unsigned char *const bios = it87spi_mapped_addr(flash, start);
 
 	result = spi_write_enable(flash);
 	if (result)
@@ -355,8 +412,8 @@ static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf,
 	/* FIXME: The command below seems to be redundant or wrong. */
 	OUTB(0x06, it8716f_flashport + 1);
 	OUTB(((2 + (fast_spi ? 1 : 0)) << 4), it8716f_flashport);
-	for (i = 0; i < flash->chip->page_size; i++)
-		mmio_writeb(buf[i], (void *)(bios + start + i));
+	for (i = 0; i < len; i++)
+		mmio_writeb(buf[i], (void *)(bios + i));
 	OUTB(0, it8716f_flashport);
 	/* Wait until the Write-In-Progress bit is cleared.
 	 * This usually takes 1-10 ms, so wait in 1 ms steps.
@@ -372,32 +429,48 @@ static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf,
 		if((status & SPI_SR_WIP) == 0)
 			return 0;
 
-		programmer_delay(1000);
+		programmer_delay(flash, 1000);
 	}
 	return 0;
 }
 
+static int it8716f_spi_mmap_read(struct flashctx *flash, uint8_t *buf,
+				 unsigned int start, unsigned int len)
+{
+	mmio_readn(it87spi_mapped_addr(flash, start), buf, len);
+	return 0;
+}
+
 /*
- * IT8716F only allows maximum of 512 kb SPI mapped to LPC memory cycles
- * Need to read this big flash using firmware cycles 3 byte at a time.
+ * IT8716F only allows maximum of 512 kb SPI mapped to LPC memory cycles.
+ * Below that, we need to read using firmware cycles 3 byte at a time.
  */
 static int it8716f_spi_chip_read(struct flashctx *flash, uint8_t *buf,
 				 unsigned int start, unsigned int len)
 {
+	const unsigned int mapped_start = it87spi_mapped_start(flash);
+	bool mapped;
+
 	fast_spi = 0;
+	mapped = it87spi_check_window(flash);
 
 	/* FIXME: Check if someone explicitly requested to use IT87 SPI although
 	 * the mainboard does not use IT87 SPI translation. This should be done
 	 * via a programmer parameter for the internal programmer.
 	 */
-	if ((flash->chip->total_size * 1024 > it87spi_max_mmapped)) {
-		default_spi_read(flash, buf, start, len);
-	} else {
-		unsigned char *const bios = it87spi_mmapped_flash +
-			it87spi_max_mmapped - flashprog_flash_getsize(flash);
-		mmio_readn(bios + start, buf, len);
+	if (!mapped || start < mapped_start) {
+		const unsigned int unmapped_len = mapped ? (unsigned int)min(len, mapped_start - start) : len;
+		const int ret = default_spi_read(flash, buf, start, unmapped_len);
+		if (ret)
+			return ret;
+		start += unmapped_len;
+		buf += unmapped_len;
+		len -= unmapped_len;
 	}
 
+	if (len)
+		return flashprog_read_chunked(flash, buf, start, len, MAX_DATA_READ_UNLIMITED,
+					      it8716f_spi_mmap_read);
 	return 0;
 }
 
@@ -407,41 +480,41 @@ static int it8716f_spi_chip_write_256(struct flashctx *flash, const uint8_t *buf
 	const struct flashchip *chip = flash->chip;
 	/*
 	 * IT8716F only allows maximum of 512 kb SPI chip size for memory
-	 * mapped access. It also can't write more than 1+3+256 bytes at once,
-	 * so page_size > 256 bytes needs a fallback.
-	 * FIXME: Split too big page writes into chunks IT87* can handle instead
-	 * of degrading to single-byte program.
+	 * mapped access, anything below the window degrades to single-byte
+	 * program. It also can't write more than 1+3+256 bytes at once, so
+	 * bigger pages are written in 256-byte chunks.
 	 * FIXME: Check if someone explicitly requested to use IT87 SPI although
 	 * the mainboard does not use IT87 SPI translation. This should be done
 	 * via a programmer parameter for the internal programmer.
 	 */
-	if ((chip->total_size * 1024 > it87spi_max_mmapped) || (chip->page_size > 256)) {
-		spi_chip_write_1(flash, buf, start, len);
-	} else {
-		unsigned int lenhere;
+	const unsigned int chunk = min(chip->page_size, 256);
+	const unsigned int mapped_start =
+		it87spi_check_window(flash) ? it87spi_mapped_start(flash) : flashprog_flash_getsize(flash);
+	int ret;
 
-		if (start % chip->page_size) {
-			/* start to the end of the page or to start + len,
-			 * whichever is smaller.
-			 */
-			lenhere = min(len, chip->page_size - start % chip->page_size);
-			spi_chip_write_1(flash, buf, start, lenhere);
-			start += lenhere;
-			len -= lenhere;
-			buf += lenhere;
-		}
+	while (len > 0) {
+		unsigned int lenhere;
 
-		while (len >= chip->page_size) {
-			int ret = it8716f_spi_page_program(flash, buf, start);
-			if (ret)
-				return ret;
-			flashprog_progress_add(flash, chip->page_size);
-			start += chip->page_size;
-			len -= chip->page_size;
-			buf += chip->page_size;
+		if (start < mapped_start || start % chunk || len < chunk) {
+			/* Up to the window, to the next chunk or to start + len, whichever is smaller. */
+			if (start < mapped_start)
+				lenhere = min(len, mapped_start - start);
+			else if (start % chunk)
+				lenhere = min(len, chunk - start % chunk);
+			else
+				lenhere = len;
+			ret = spi_chip_write_1(flash, buf, start, lenhere);
+		} else {
+			lenhere = chunk;
+			ret = it8716f_spi_page_program(flash, buf, start, chunk);
+			if (!ret)
+				flashprog_progress_add(flash, chunk);
 		}
-		if (len)
-			spi_chip_write_1(flash, buf, start, len);
+		if (ret)
+			return ret;
+		start += lenhere;
+		len -= lenhere;
+		buf += lenhere;
 	}
 
 	return 0;
@@ -44,7 +44,7 @@ static void toggle_ready_jedec_common(const struct flashctx *flash, chipaddr dst
 
 	while (i++ < 0xFFFFFFF) {
 		if (delay)
-			programmer_delay(delay);
+			programmer_delay(flash, delay);
 		tmp2 = chip_readb(flash, dst) & 0x40;
 		if (tmp1 == tmp2) {
 			break;
@@ -193,31 +193,31 @@ static int probe_jedec_common(struct flashctx *flash, unsigned int mask)
 	 * reset command.
 	 */
 	if (probe_timing_enter)
-		programmer_delay(probe_timing_enter);
+		programmer_delay(flash, probe_timing_enter);
 	/* Reset chip to a clean slate */
 	if ((chip->feature_bits & FEATURE_RESET_MASK) == FEATURE_LONG_RESET)
 	{
 		chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 		if (probe_timing_exit)
-			programmer_delay(10);
+			programmer_delay(flash, 10);
 		chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
 		if (probe_timing_exit)
-			programmer_delay(10);
+			programmer_delay(flash, 10);
 	}
 	chip_writeb(flash, 0xF0, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 	if (probe_timing_exit)
-		programmer_delay(probe_timing_exit);
+		programmer_delay(flash, probe_timing_exit);
 
 	/* Issue JEDEC Product ID Entry command */
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 	if (probe_timing_enter)
-		programmer_delay(10);
+		programmer_delay(flash, 10);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
 	if (probe_timing_enter)
-		programmer_delay(10);
+		programmer_delay(flash, 10);
 	chip_writeb(flash, 0x90, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 	if (probe_timing_enter)
-		programmer_delay(probe_timing_enter);
+		programmer_delay(flash, probe_timing_enter);
 
 	/* Read product ID */
 	id1 = chip_readb(flash, bios + (0x00 << shifted));
@@ -242,14 +242,14 @@ static int probe_jedec_common(struct flashctx *flash, unsigned int mask)
 	{
 		chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 		if (probe_timing_exit)
-			programmer_delay(10);
+			programmer_delay(flash, 10);
 		chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
 		if (probe_timing_exit)
-			programmer_delay(10);
+			programmer_delay(flash, 10);
 	}
 	chip_writeb(flash, 0xF0, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 	if (probe_timing_exit)
-		programmer_delay(probe_timing_exit);
+		programmer_delay(flash, probe_timing_exit);
 
 	msg_cdbg("%s: id1 0x%02x, id2 0x%02x", __func__, largeid1, largeid2);
 	if (!oddparity(id1))
@@ -293,18 +293,18 @@ static int erase_sector_jedec_common(struct flashctx *flash, unsigned int page,
 
 	/*  Issue the Sector Erase command   */
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x80, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x30, bios + page);
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	/* wait for Toggle bit ready         */
 	toggle_ready_jedec_slow(flash, bios);
@@ -325,18 +325,18 @@ static int erase_block_jedec_common(struct flashctx *flash, unsigned int block,
 
 	/*  Issue the Sector Erase command   */
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x80, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x50, bios + block);
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	/* wait for Toggle bit ready         */
 	toggle_ready_jedec_slow(flash, bios);
@@ -356,18 +356,18 @@ static int erase_chip_jedec_common(struct flashctx *flash, unsigned int mask)
 
 	/*  Issue the JEDEC Chip Erase command   */
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x80, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x55, bios + ((shifted ? 0x5555 : 0x2AAA) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 	chip_writeb(flash, 0x10, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
-	programmer_delay(delay_us);
+	programmer_delay(flash, delay_us);
 
 	toggle_ready_jedec_slow(flash, bios);
 
@@ -429,15 +429,103 @@ int write_jedec_1(struct flashctx *flash, const uint8_t *src, unsigned int start
 	return failed;
 }
 
+/*
+ * 29GL chips can program a whole write buffer with one command sequence.
+ * The buffer size differs between vendors and bus width, but all of them
+ * handle at least 16 bytes in byte mode.
+ */
+#define JEDEC_29GL_BUFFER_SIZE 16
+
+/* Poll DQ7 until it shows the true data, returns 1 if DQ5 (timeout) or DQ1 (abort) is set. */
+static int data_polling_29gl(const struct flashctx *flash, chipaddr dst, uint8_t data)
+{
+	unsigned int i = 0;
+	uint8_t tmp;
+
+	data &= 0x80;
+
+	while (i++ < 0xFFFFFFF) {
+		tmp = chip_readb(flash, dst);
+		if ((tmp & 0x80) == data)
+			return 0;
+		if (tmp & 0x22) {
+			/* DQ7 may change simultaneously with DQ5, check once more. */
+			return (chip_readb(flash, dst) & 0x80) != data;
+		}
+	}
+	msg_cdbg("%s: excessive loops, i=0x%x\n", __func__, i);
+	return 1;
+}
+
+static int write_buffer_29gl(struct flashctx *flash, const uint8_t *src,
+			     unsigned int start, unsigned int len, unsigned int mask)
+{
+	chipaddr bios = flash->virtual_memory;
+	chipaddr dst = bios + start;
+	unsigned int i;
+
+	chip_writeb(flash, 0xAA, bios + (0x5555 & mask));
+	chip_writeb(flash, 0x55, bios + (0x2AAA & mask));
+	chip_writeb(flash, 0x25, dst);
+	chip_writeb(flash, len - 1, dst);
+	for (i = 0; i < len; ++i)
+		chip_writeb(flash, src[i], dst + i);
+	chip_writeb(flash, 0x29, dst);
+
+	if (data_polling_29gl(flash, dst + len - 1, src[len - 1])) {
+		/* Write-to-Buffer-Abort Reset */
+		chip_writeb(flash, 0xAA, bios + (0x5555 & mask));
+		chip_writeb(flash, 0x55, bios + (0x2AAA & mask));
+		chip_writeb(flash, 0xF0, bios + (0x5555 & mask));
+		return 1;
+	}
+
+	return verify_range(flash, src, start, len);
+}
+
+/*
+ * Write with Write Buffer Programming, falling back to single byte programs
+ * for buffers that fail. Buffers that would be all 0xff are skipped.
+ */
+int write_jedec_29gl(struct flashctx *flash, const uint8_t *src, unsigned int start,
+		     unsigned int len)
+{
+	const unsigned int mask = getaddrmask(flash->chip);
+	const unsigned int end = start + len;
+	unsigned int i, failed = 0;
+
+	while (start < end) {
+		const unsigned int lenhere =
+			min(JEDEC_29GL_BUFFER_SIZE - start % JEDEC_29GL_BUFFER_SIZE, end - start);
+
+		for (i = 0; i < lenhere && src[i] == 0xff; ++i)
+			;
+		if (i < lenhere && write_buffer_29gl(flash, src, start, lenhere, mask)) {
+			msg_cdbg("Buffer program at 0x%06x failed, programming bytewise.\n", start);
+			for (i = 0; i < lenhere; ++i) {
+				if (write_byte_program_jedec_common(flash, src + i,
+								    flash->virtual_memory + start + i, mask))
+					failed = 1;
+			}
+		}
+		flashprog_progress_add(flash, lenhere);
+
+		src += lenhere;
+		start += lenhere;
+	}
+	if (failed)
+		msg_cerr(" writing sector at 0x%06x failed!\n", end - len);
+
+	return failed;
+}
+
 static int write_page_write_jedec_common(struct flashctx *flash, const uint8_t *src,
 					 unsigned int start, unsigned int page_size)
 {
-	unsigned int i;
+	unsigned int i, run;
 	int tried = 0, failed;
-	const uint8_t *s = src;
 	chipaddr bios = flash->virtual_memory;
-	chipaddr dst = bios + start;
-	chipaddr d = dst;
+	chipaddr d = bios + start;
 	unsigned int mask;
 
 	mask = getaddrmask(flash->chip);
@@ -446,19 +534,20 @@ retry:
 	/* Issue JEDEC Start Program command */
 	start_program_jedec_common(flash, mask);
 
-	/* transfer data from source to destination */
-	for (i = 0; i < page_size; i++) {
+	/* transfer data from source to destination, in runs for chip_writen() */
+	for (i = 0; i < page_size; i += run) {
 		/* If the data is 0xFF, don't program it */
-		if (*src != 0xFF)
-			chip_writeb(flash, *src, dst);
-		dst++;
-		src++;
+		if (src[i] == 0xFF) {
+			run = 1;
+			continue;
+		}
+		for (run = 1; i + run < page_size && src[i + run] != 0xFF; run++)
+			;
+		chip_writen(flash, src + i, d + i, run);
 	}
 
-	toggle_ready_jedec(flash, dst - 1);
+	toggle_ready_jedec(flash, d + page_size - 1);
 
-	dst = d;
-	src = s;
 	failed = verify_range(flash, src, start, page_size);
 
 	if (failed && tried++ < MAX_REFLASH_TRIES) {
@@ -640,81 +729,50 @@ int printlock_regspace2_block_eraser_1(struct flashctx *flash)
 	return regspace2_walk_unlockblocks(flash, unlockblocks, &printlock_regspace2_block);
 }
 
-/* Try to change the lock register at address lockreg from cur to new.
- *
- * - Try to unlock the lock bit if requested and it is currently set (although this is probably futile).
- * - Try to change the read/write bits if requested.
- * - Try to set the lockdown bit if requested.
- * Return an error immediately if any of this fails. */
-static int changelock_regspace2_block(const struct flashctx *flash, chipaddr lockreg, uint8_t cur, uint8_t new)
-{
-	/* Only allow changes to known read/write/lockdown bits */
-	if (((cur ^ new) & ~REG2_MASK) != 0) {
-		msg_cerr("Invalid lock change from 0x%02x to 0x%02x requested at 0x%0*" PRIxPTR "!\n"
-			 "Please report a bug at flashprog@flashprog.org\n",
-			 cur, new, PRIxPTR_WIDTH, lockreg);
-		return -1;
-	}
+/*
+ * Unlocking is done in two passes over the lock registers: first the
+ * read/write locks of all blocks are cleared without reading anything
+ * back, then all registers are checked at once. We don't care for the
+ * lockdown bit as long as the RW locks are 0 after we're done. With it
+ * set, the RW locks can't be changed, which shows in the second pass.
+ */
+static int clear_regspace2_block_rwlock(const struct flashctx *flash, chipaddr lockreg)
+{
+	const uint8_t old = chip_readb(flash, lockreg);
 
-	/* Exit early if no change (of read/write/lockdown bits) was requested. */
-	if (((cur ^ new) & REG2_MASK) == 0) {
+	if (!(old & REG2_RWLOCK)) {
 		msg_cdbg2("Lock bits at 0x%0*" PRIxPTR " not changed.\n", PRIxPTR_WIDTH, lockreg);
 		return 0;
 	}
+	chip_writeb(flash, old & ~REG2_RWLOCK, lockreg);
+	msg_cdbg("Clearing lock bits at 0x%0*" PRIxPTR " (0x%02x).\n", PRIxPTR_WIDTH, lockreg, old);
+	return 0;
+}
 
-	/* Normally the lockdown bit can not be cleared. Try nevertheless if requested. */
-	if ((cur & REG2_LOCKDOWN) && !(new & REG2_LOCKDOWN)) {
-		chip_writeb(flash, cur & ~REG2_LOCKDOWN, lockreg);
-		cur = chip_readb(flash, lockreg);
-		if ((cur & REG2_LOCKDOWN) == REG2_LOCKDOWN) {
-			msg_cwarn("Lockdown can't be removed at 0x%0*" PRIxPTR "! New value: 0x%02x.\n",
-				  PRIxPTR_WIDTH, lockreg, cur);
-			return -1;
-		}
-	}
+static int check_regspace2_block_unlocked(const struct flashctx *flash, chipaddr lockreg)
+{
+	const uint8_t cur = chip_readb(flash, lockreg);
 
-	/* Change read and/or write bit */
-	if ((cur ^ new) & REG2_RWLOCK) {
-		/* Do not lockdown yet. */
-		uint8_t wanted = (cur & ~REG2_RWLOCK) | (new & REG2_RWLOCK);
-		chip_writeb(flash, wanted, lockreg);
-		cur = chip_readb(flash, lockreg);
-		if (cur != wanted) {
-			msg_cerr("Changing lock bits failed at 0x%0*" PRIxPTR "! New value: 0x%02x.\n",
-				 PRIxPTR_WIDTH, lockreg, cur);
-			return -1;
-		}
-		msg_cdbg("Changed lock bits at 0x%0*" PRIxPTR " to 0x%02x.\n",
+	if (cur & REG2_RWLOCK) {
+		msg_cerr("Changing lock bits failed at 0x%0*" PRIxPTR "! New value: 0x%02x.\n",
 			 PRIxPTR_WIDTH, lockreg, cur);
+		return -1;
 	}
-
-	/* Eventually, enable lockdown if requested. */
-	if (!(cur & REG2_LOCKDOWN) && (new & REG2_LOCKDOWN)) {
-		chip_writeb(flash, new, lockreg);
-		cur = chip_readb(flash, lockreg);
-		if (cur != new) {
-			msg_cerr("Enabling lockdown FAILED at 0x%0*" PRIxPTR "! New value: 0x%02x.\n",
-				 PRIxPTR_WIDTH, lockreg, cur);
-			return -1;
-		}
-		msg_cdbg("Enabled lockdown at 0x%0*" PRIxPTR ".\n", PRIxPTR_WIDTH, lockreg);
-	}
-
 	return 0;
 }
 
-static int unlock_regspace2_block_generic(const struct flashctx *flash, chipaddr lockreg)
+static int unlock_regspace2_blocks(const struct flashctx *flash, const struct unlockblock *blocks)
 {
-	uint8_t old = chip_readb(flash, lockreg);
-	/* We don't care for the lockdown bit as long as the RW locks are 0 after we're done */
-	return changelock_regspace2_block(flash, lockreg, old, old & ~REG2_RWLOCK);
+	if (regspace2_walk_unlockblocks(flash, blocks, &clear_regspace2_block_rwlock))
+		return -1;
+	return regspace2_walk_unlockblocks(flash, blocks, &check_regspace2_block_unlocked);
 }
 
 static int unlock_regspace2_uniform(struct flashctx *flash, unsigned long block_size)
 {
 	const unsigned int elems = flash->chip->total_size * 1024 / block_size;
 	struct unlockblock blocks[2] = {{.size = block_size, .count = elems}};
-	return regspace2_walk_unlockblocks(flash, blocks, &unlock_regspace2_block_generic);
+	return unlock_regspace2_blocks(flash, blocks);
 }
 
 int unlock_regspace2_uniform_64k(struct flashctx *flash)
@@ -732,7 +790,7 @@ int unlock_regspace2_block_eraser_0(struct flashctx *flash)
 	// FIXME: this depends on the eraseblocks not to be filled up completely (i.e. to be null-terminated).
 	const struct unlockblock *unlockblocks =
 		(const struct unlockblock *)flash->chip->block_erasers[0].eraseblocks;
-	return regspace2_walk_unlockblocks(flash, unlockblocks, &unlock_regspace2_block_generic);
+	return unlock_regspace2_blocks(flash, unlockblocks);
 }
 
 int unlock_regspace2_block_eraser_1(struct flashctx *flash)
@@ -740,5 +798,5 @@ int unlock_regspace2_block_eraser_1(struct flashctx *flash)
 	// FIXME: this depends on the eraseblocks not to be filled up completely (i.e. to be null-terminated).
 	const struct unlockblock *unlockblocks =
 		(const struct unlockblock *)flash->chip->block_erasers[1].eraseblocks;
-	return regspace2_walk_unlockblocks(flash, unlockblocks, &unlock_regspace2_block_generic);
+	return unlock_regspace2_blocks(flash, unlockblocks);
 }
@@ -27,6 +27,7 @@
 #include <libjaylink/libjaylink.h>
 
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 
@@ -36,6 +37,12 @@
  */
 #define JTAG_MAX_TRANSFER_SIZE	(32768 / 8)
 
+/*
+ * Upper limit of a single jaylink_jtag_io() call, whose length is a
+ * 16-bit number of bits. Used if the device has enough free memory.
+ */
+#define JTAG_IO_MAX_SIZE	(65535 / 8)
+
 /*
  * Default base frequency in Hz. Used when the base frequency can not be
  * retrieved from the device.
@@ -56,6 +63,9 @@ struct jlink_spi_data {
 	struct jaylink_device_handle *devh;
 	bool reset_cs;
 	bool enable_target_power;
+	/* Transfer buffer of `transfer_size` bytes, the most a single jaylink_jtag_io() moves. */
+	uint8_t *buffer;
+	size_t transfer_size;
 };
 
 static bool assert_cs(struct jlink_spi_data *jlink_data)
@@ -108,30 +118,21 @@ static int jlink_spi_send_command(const struct flashctx *flash, unsigned int wri
 		const unsigned char *writearr, unsigned char *readarr)
 {
 	uint32_t length;
-	uint8_t *buffer;
 	struct jlink_spi_data *jlink_data = flash->mst.spi->data;
+	uint8_t *const buffer = jlink_data->buffer;
 
 	length = writecnt + readcnt;
 
-	if (length > JTAG_MAX_TRANSFER_SIZE)
+	if (length > jlink_data->transfer_size)
 		return SPI_INVALID_LENGTH;
 
-	buffer = malloc(length);
-
-	if (!buffer) {
-		msg_perr("Memory allocation failed.\n");
-		return SPI_GENERIC_ERROR;
-	}
-
 	/* Reverse all bytes because the device transfers data LSB first. */
 	reverse_bytes(buffer, writearr, writecnt);
 
 	memset(buffer + writecnt, 0x00, readcnt);
 
-	if (!assert_cs(jlink_data)) {
-		free(buffer);
+	if (!assert_cs(jlink_data))
 		return SPI_PROGRAMMER_ERROR;
-	}
 
 	int ret;
 
@@ -140,22 +141,77 @@ static int jlink_spi_send_command(const struct flashctx *flash, unsigned int wri
 
 	if (ret != JAYLINK_OK) {
 		msg_perr("jaylink_jtag_io() failed: %s.\n", jaylink_strerror(ret));
-		free(buffer);
 		return SPI_PROGRAMMER_ERROR;
 	}
 
-	if (!deassert_cs(jlink_data)) {
-		free(buffer);
+	if (!deassert_cs(jlink_data))
 		return SPI_PROGRAMMER_ERROR;
-	}
 
 	/* Reverse all bytes because the device transfers data LSB first. */
 	reverse_bytes(readarr, buffer + writecnt, readcnt);
-	free(buffer);
 
 	return 0;
 }
 
+/*
+ * Read with a single read command, keeping CS asserted while the data
+ * is clocked in with transfers of the maximum size. This saves the two
+ * CS requests and the command bytes that every chunk of default_spi_read()
+ * would cost.
+ */
+static int jlink_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct jlink_spi_data *jlink_data = flash->mst.spi->data;
+	uint8_t *const buffer = jlink_data->buffer;
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+	int ret = 0;
+
+	if (!len)
+		return 0;
+
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	if (!assert_cs(jlink_data))
+		return SPI_PROGRAMMER_ERROR;
+
+	while (done < len) {
+		const unsigned int to_read = min(jlink_data->transfer_size - cmdlen, len - done);
+
+		if (flashprog_cancelled(flash)) {
+			ret = 1;
+			break;
+		}
+
+		/* Reverse all bytes because the device transfers data LSB first. */
+		reverse_bytes(buffer, cmd, cmdlen);
+		memset(buffer + cmdlen, 0x00, to_read);
+
+		const int jret = jaylink_jtag_io(jlink_data->devh, buffer, buffer, buffer,
+						 (cmdlen + to_read) * 8, JAYLINK_JTAG_VERSION_2);
+		if (jret != JAYLINK_OK) {
+			msg_perr("jaylink_jtag_io() failed: %s.\n", jaylink_strerror(jret));
+			ret = SPI_PROGRAMMER_ERROR;
+			break;
+		}
+
+		reverse_bytes(buf + done, buffer + cmdlen, to_read);
+		flashprog_progress_add(flash, to_read);
+		done += to_read;
+		/* Only the first transfer carries the command. */
+		cmdlen = 0;
+	}
+
+	if (!deassert_cs(jlink_data))
+		return SPI_PROGRAMMER_ERROR;
+
+	return ret;
+}
+
 static int jlink_spi_shutdown(void *data);
 
 static const struct spi_master spi_master_jlink_spi = {
@@ -165,7 +221,7 @@ static const struct spi_master spi_master_jlink_spi = {
 	.max_data_write	= JTAG_MAX_TRANSFER_SIZE - 5,
 	.command	= jlink_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= jlink_spi_read,
 	.write_256	= default_spi_write_256,
 	.features	= SPI_MASTER_4BA,
 	.shutdown	= jlink_spi_shutdown,
@@ -191,6 +247,7 @@ static int jlink_spi_shutdown(void *data)
 	jaylink_exit(jlink_data->ctx);
 
 	/* jlink_data->ctx, jlink_data->devh are freed by jaylink_close and jaylink_exit */
+	free(jlink_data->buffer);
 	free(jlink_data);
 	return 0;
 }
@@ -502,12 +559,37 @@ static int jlink_spi_init(struct flashprog_programmer *const prog)
 
 	msg_pdbg("SPI speed: %lu kHz\n", speed);
 
+	/* Use larger transfers if the device has room for the TMS and TDI data. */
+	size_t transfer_size = JTAG_MAX_TRANSFER_SIZE;
+
+	if (jaylink_has_cap(caps, JAYLINK_DEV_CAP_GET_FREE_MEMORY)) {
+		uint32_t free_memory;
+
+		ret = jaylink_get_free_memory(jaylink_devh, &free_memory);
+
+		if (ret != JAYLINK_OK) {
+			msg_pwarn("jaylink_get_free_memory() failed: %s.\n", jaylink_strerror(ret));
+		} else {
+			msg_pdbg("Free memory: %" PRIu32 " bytes\n", free_memory);
+			transfer_size = MAX(transfer_size, MIN(free_memory / 2, JTAG_IO_MAX_SIZE));
+		}
+	}
+
+	msg_pdbg("Transfer size: %zu bytes\n", transfer_size);
+
 	jlink_data = calloc(1, sizeof(*jlink_data));
 	if (!jlink_data) {
 		msg_perr("Unable to allocate space for SPI master data\n");
 		goto init_err;
 	}
 
+	jlink_data->buffer = malloc(transfer_size);
+	if (!jlink_data->buffer) {
+		msg_perr("Unable to allocate space for SPI transfer buffer\n");
+		goto init_err;
+	}
+	jlink_data->transfer_size = transfer_size;
+
 	/* jaylink_ctx, jaylink_devh are allocated by jaylink_init and jaylink_open */
 	jlink_data->ctx = jaylink_ctx;
 	jlink_data->devh = jaylink_devh;
@@ -527,8 +609,10 @@ init_err:
 	jaylink_exit(jaylink_ctx);
 
 	/* jaylink_ctx, jaylink_devh are freed by jaylink_close and jaylink_exit */
-	if (jlink_data)
+	if (jlink_data) {
+		free(jlink_data->buffer);
 		free(jlink_data);
+	}
 
 	return 1;
 }
@@ -538,4 +622,5 @@ const struct programmer_entry programmer_jlink_spi = {
 	.type			= OTHER,
 	.init			= jlink_spi_init,
 	.devs.note		= "SEGGER J-Link and compatible devices\n",
+	.multi_instance		= true,
 };
@@ -26,6 +26,15 @@
 
 struct flashprog_layout {
 	struct romentry *head;
+
+	/*
+	 * Included regions sorted by start address. `included_end[i]` is the
+	 * highest end address of the first i + 1 of them, so the first region
+	 * that reaches a given address can be found with a binary search.
+	 */
+	const struct romentry **included;
+	chipoff_t *included_end;
+	size_t included_count;
 };
 
 struct layout_include_args {
@@ -230,18 +239,71 @@ int layout_sanity_checks(const struct flashprog_flashctx *const flash, const boo
 const struct romentry *layout_next_included_region(
 		const struct flashprog_layout *const l, const chipoff_t where)
 {
-	const struct romentry *entry = NULL, *lowest = NULL;
+	size_t lo = 0, hi = l->included_count;
+
+	/* Find the first included region that ends at or after `where`. */
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (l->included_end[mid] < where)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	while ((entry = layout_next(l, entry))) {
-		if (!entry->included)
-			continue;
-		if (entry->end < where)
-			continue;
-		if (!lowest || lowest->start > entry->start)
-			lowest = entry;
+	return lo < l->included_count ? l->included[lo] : NULL;
+}
+
+/*
+ * Find the next span of included regions that reaches `where`. Over-
+ * lapping and adjacent regions are merged into one span, so each byte
+ * is covered only once. Returns false if there is no such span.
+ */
+bool layout_next_included_span(const struct flashprog_layout *const l, const chipoff_t where,
+			       chipoff_t *const start, chipoff_t *const end)
+{
+	const struct romentry *entry = layout_next_included_region(l, where);
+	if (!entry)
+		return false;
+
+	*start = MAX(where, entry->start);
+	*end = entry->end;
+	while (*end + 1 != 0 && (entry = layout_next_included_region(l, *end + 1)) &&
+	       entry->start <= *end + 1)
+		*end = entry->end;
+
+	return true;
+}
+
+static int layout_index_included(struct flashprog_layout *const layout, const struct romentry *const entry)
+{
+	const size_t count = layout->included_count + 1;
+	size_t i, pos;
+
+	const struct romentry **const included = flashprog_realloc(layout->included, count * sizeof(*included));
+	if (!included)
+		goto _err_ret;
+	layout->included = included;
+
+	chipoff_t *const included_end = flashprog_realloc(layout->included_end, count * sizeof(*included_end));
+	if (!included_end)
+		goto _err_ret;
+	layout->included_end = included_end;
+
+	for (pos = layout->included_count; pos > 0 && included[pos - 1]->start > entry->start; --pos)
+		included[pos] = included[pos - 1];
+	included[pos] = entry;
+	layout->included_count = count;
+
+	for (i = pos; i < count; ++i) {
+		included_end[i] = included[i]->end;
+		if (i > 0 && included_end[i - 1] > included_end[i])
+			included_end[i] = included_end[i - 1];
 	}
+	return 0;
 
-	return lowest;
+_err_ret:
+	msg_gerr("Error including layout entry: %s\n", strerror(errno));
+	return 1;
 }
 
 const struct romentry *layout_next_included(
@@ -275,7 +337,7 @@ const struct romentry *layout_next(
  */
 int flashprog_layout_new(struct flashprog_layout **const layout)
 {
-	*layout = malloc(sizeof(**layout));
+	*layout = flashprog_malloc(sizeof(**layout));
 	if (!*layout) {
 		msg_gerr("Error creating layout: %s\n", strerror(errno));
 		return 1;
@@ -301,7 +363,7 @@ int flashprog_layout_add_region(
 		struct flashprog_layout *const layout,
 		const size_t start, const size_t end, const char *const name)
 {
-	struct romentry *const entry = malloc(sizeof(*entry));
+	struct romentry *const entry = flashprog_malloc(sizeof(*entry));
 	if (!entry)
 		goto _err_ret;
 
@@ -310,7 +372,7 @@ int flashprog_layout_add_region(
 		.start		= start,
 		.end		= end,
 		.included	= false,
-		.name		= strdup(name),
+		.name		= flashprog_strdup(name),
 	};
 	*entry = tmp;
 	if (!entry->name)
@@ -322,7 +384,7 @@ int flashprog_layout_add_region(
 
 _err_ret:
 	msg_gerr("Error adding layout entry: %s\n", strerror(errno));
-	free(entry);
+	flashprog_free(entry);
 	return 1;
 }
 
@@ -333,14 +395,18 @@ _err_ret:
  * @param name   The name of the region to include.
  *
  * @return 0 on success,
- *         1 if the given name can't be found.
+ *         1 if the given name can't be found or if out of memory.
  */
 int flashprog_layout_include_region(struct flashprog_layout *const layout, const char *name)
 {
 	struct romentry *entry = NULL;
 	while ((entry = mutable_layout_next(layout, entry))) {
 		if (!strcmp(entry->name, name)) {
-			entry->included = true;
+			if (!entry->included) {
+				if (layout_index_included(layout, entry))
+					return 1;
+				entry->included = true;
+			}
 			return 0;
 		}
 	}
@@ -360,10 +426,12 @@ void flashprog_layout_release(struct flashprog_layout *const layout)
 	while (layout->head) {
 		struct romentry *const entry = layout->head;
 		layout->head = entry->next;
-		free(entry->name);
-		free(entry);
+		flashprog_free(entry->name);
+		flashprog_free(entry);
 	}
-	free(layout);
+	flashprog_free(layout->included_end);
+	flashprog_free(layout->included);
+	flashprog_free(layout);
 }
 
 /** @} */ /* end flashprog-layout */
@@ -18,6 +18,35 @@
  * @mainpage
  *
  * Have a look at the Modules section for a function reference.
+ *
+ * @section reentrancy Thread safety
+ *
+ * Functions that only work on objects passed to them, i.e. the
+ * @ref flashprog-layout "layout" and write-protection configuration
+ * functions as well as the flag and progress-callback setters of a flash
+ * context, are reentrant. They may be called from different threads as
+ * long as no object is used by two threads at once.
+ *
+ * Everything that talks to a programmer, i.e. programmer init and
+ * shutdown, chip probing and all @ref flashprog-ops "flash operations",
+ * works on the programmer context and the flash contexts of its chips.
+ * The programmer context holds the registered masters, the shutdown
+ * functions, the SPI ID cache and the write permission, the flash
+ * context the per-chip state. Different programmers may be used from
+ * different threads at once, while each programmer and its chips must
+ * not be used by two threads at once. Use the @ref flashprog-job
+ * "asynchronous job API" to run a long operation without blocking the
+ * calling thread.
+ *
+ * This holds only for drivers that keep all their state in the programmer
+ * context, e.g. `dummy`, `linux_spi` and `linux_mtd`. Many others still
+ * use statics: e.g. serial.c's port, ichspi's `ich_prot_ranges` or
+ * serprog's `sp_streamed_transmit_ops`. Only one programmer of those
+ * drivers can be initialized at a time, flashprog_programmer_init()
+ * fails for a second one. Still global for all drivers are:
+ *  - the log callback and level, and the allocator and memory limit,
+ *  - the USB and delay statistics, which count the transfers and delays
+ *    of all programmers (cf. flashprog_stats_get()).
  */
 
 #include <errno.h>
@@ -26,6 +55,7 @@
 #include <stdarg.h>
 
 #include "flash.h"
+#include "chipdrivers.h"
 #include "fmap.h"
 #include "programmer.h"
 #include "layout.h"
@@ -40,6 +70,8 @@
 
 /** Pointer to log callback function. */
 static flashprog_log_callback *global_log_callback = NULL;
+/** @private */
+enum flashprog_log_level print_level = FLASHPROG_MSG_SPEW;
 
 /**
  * @brief Initialize libflashprog.
@@ -81,6 +113,179 @@ void flashprog_set_log_callback(flashprog_log_callback *const log_callback)
 {
 	global_log_callback = log_callback;
 }
+
+/**
+ * @brief Set the highest log level that is passed to the log callback.
+ *
+ * Messages above this level are dropped before they are formatted, so
+ * debug messages in hot paths cost next to nothing. Default is
+ * FLASHPROG_MSG_SPEW, i.e. every message is passed.
+ *
+ * @param level Highest log level to pass.
+ */
+void flashprog_set_log_level(const enum flashprog_log_level level)
+{
+	print_level = level;
+}
+
+/** Custom allocator, if set. */
+static flashprog_malloc_fn *global_malloc = NULL;
+static flashprog_free_fn *global_free = NULL;
+static void *global_alloc_data = NULL;
+/** Memory limit in bytes, 0 for none. */
+static size_t memory_limit = 0;
+/** Bytes currently allocated through flashprog_malloc() and friends. */
+static size_t memory_used = 0;
+
+/* Every allocation starts with its size, to account for it when it's freed. */
+union alloc_header {
+	size_t size;
+	long double align_ld;
+	long long align_ll;
+	void *align_p;
+};
+
+/**
+ * @brief Set the functions that libflashprog allocates memory with.
+ *
+ * Image and erase-block buffers, flash chip descriptions and layouts
+ * are allocated through these, programmer drivers still use malloc().
+ * `malloc_fn` shall return memory aligned like malloc() does, or NULL
+ * on failure. Use NULL for both to restore malloc() and free().
+ *
+ * The allocator can only be changed while nothing is allocated, i.e.
+ * before the first programmer is initialized or layout created.
+ *
+ * @param malloc_fn Called to allocate `size` bytes.
+ * @param free_fn   Called to free memory returned by `malloc_fn`.
+ * @param user_data Passed to both functions.
+ * @return 0 on success,
+ *         1 if only one function was given or memory is still allocated.
+ */
+int flashprog_set_allocator(flashprog_malloc_fn *const malloc_fn, flashprog_free_fn *const free_fn,
+			    void *const user_data)
+{
+	if (!malloc_fn != !free_fn || __atomic_load_n(&memory_used, __ATOMIC_RELAXED))
+		return 1;
+	global_malloc = malloc_fn;
+	global_free = free_fn;
+	global_alloc_data = user_data;
+	return 0;
+}
+
+/**
+ * @brief Limit the memory that libflashprog keeps allocated.
+ *
+ * Allocations that would exceed the limit fail. When a buffer of the
+ * chip's size doesn't fit, writes without a reference image are done
+ * one erase block at a time, like with FLASHPROG_FLAG_STREAMING_WRITE,
+ * and verification reads the chip in chunks. Buffers passed in by the
+ * caller don't count.
+ *
+ * @param limit Limit in bytes, 0 for none.
+ */
+void flashprog_set_memory_limit(const size_t limit)
+{
+	memory_limit = limit;
+}
+
+static bool memory_reserve(const size_t size)
+{
+	const size_t used = __atomic_add_fetch(&memory_used, size, __ATOMIC_RELAXED);
+	if (memory_limit && (used < size || used > memory_limit)) {
+		__atomic_sub_fetch(&memory_used, size, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+static void *alloc_accounted(const size_t size, const bool zero)
+{
+	const size_t total = sizeof(union alloc_header) + size;
+	union alloc_header *hdr;
+
+	if (total < size || !memory_reserve(total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (global_malloc) {
+		hdr = global_malloc(total, global_alloc_data);
+		if (hdr && zero)
+			memset(hdr, 0, total);
+	} else {
+		/* calloc() may get untouched pages zeroed for free. */
+		hdr = zero ? calloc(1, total) : malloc(total);
+	}
+	if (!hdr) {
+		__atomic_sub_fetch(&memory_used, total, __ATOMIC_RELAXED);
+		errno = ENOMEM;
+		return NULL;
+	}
+	hdr->size = size;
+	return hdr + 1;
+}
+
+void *flashprog_malloc(const size_t size)
+{
+	return alloc_accounted(size, false);
+}
+
+void *flashprog_calloc(const size_t nmemb, const size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return alloc_accounted(nmemb * size, true);
+}
+
+/* Unlike realloc(), this always moves the data, as custom allocators can't resize. */
+void *flashprog_realloc(void *const ptr, const size_t size)
+{
+	if (!ptr)
+		return flashprog_malloc(size);
+
+	void *const moved = flashprog_malloc(size);
+	if (!moved)
+		return NULL;
+	memcpy(moved, ptr, MIN(((union alloc_header *)ptr - 1)->size, size));
+	flashprog_free(ptr);
+	return moved;
+}
+
+void flashprog_free(void *const ptr)
+{
+	if (!ptr)
+		return;
+
+	union alloc_header *const hdr = (union alloc_header *)ptr - 1;
+	__atomic_sub_fetch(&memory_used, sizeof(*hdr) + hdr->size, __ATOMIC_RELAXED);
+	if (global_free)
+		global_free(hdr, global_alloc_data);
+	else
+		free(hdr);
+}
+
+char *flashprog_strdup(const char *const str)
+{
+	const size_t len = strlen(str) + 1;
+	char *const dup = flashprog_malloc(len);
+	if (dup)
+		memcpy(dup, str, len);
+	return dup;
+}
+
+/* Whether an allocation of `size` bytes would currently fit the memory limit. */
+bool flashprog_memory_fits(const size_t size)
+{
+	const size_t used = __atomic_load_n(&memory_used, __ATOMIC_RELAXED);
+
+	if (!memory_limit)
+		return true;
+	return used <= memory_limit && memory_limit - used >= size &&
+	       memory_limit - used - size >= sizeof(union alloc_header);
+}
+
 /** @private */
 int print(const enum flashprog_log_level level, const char *const fmt, ...)
 {
@@ -118,7 +323,9 @@ int print(const enum flashprog_log_level level, const char *const fmt, ...)
 /**
  * @brief Initialize the specified programmer.
  *
- * Currently, only one programmer may be initialized at a time.
+ * Several programmers may be initialized at a time, as long as at most
+ * one of them uses a driver that isn't able to run multiple instances
+ * (cf. @ref reentrancy "Thread safety").
  *
  * @param[out] flashprog Points to a pointer of type struct flashprog_programmer
  *                       that will be set if programmer initialization succeeds.
@@ -161,8 +368,11 @@ int flashprog_programmer_init(struct flashprog_programmer **const flashprog,
 		(*flashprog)->param = NULL;
 	}
 
-	if (programmer_init(*flashprog))
+	if (programmer_init(*flashprog)) {
+		/* Run shutdown functions that were registered before the failure. */
+		programmer_shutdown(*flashprog);
 		goto _free_err;
+	}
 
 	return 0;
 
@@ -186,7 +396,102 @@ int flashprog_programmer_shutdown(struct flashprog_programmer *const flashprog)
 	return 0;
 }
 
-/* TODO: flashprog_programmer_capabilities()? */
+static void spi_master_caps(const struct flashctx *const flash, struct flashprog_programmer_caps *const caps)
+{
+	static const struct {
+		uint32_t master_feature;
+		enum flashprog_io_mode io_mode;
+	} modes[] = {
+		{ SPI_MASTER_DUAL_OUT,	FLASHPROG_IO_1_1_2 },
+		{ SPI_MASTER_DUAL_IO,	FLASHPROG_IO_1_2_2 },
+		{ SPI_MASTER_QUAD_OUT,	FLASHPROG_IO_1_1_4 },
+		{ SPI_MASTER_QUAD_IO,	FLASHPROG_IO_1_4_4 },
+		{ SPI_MASTER_QPI,	FLASHPROG_IO_4_4_4 },
+	};
+	static const enum flashprog_io_mode io_modes[NUM_IO_MODES] = {
+		[SINGLE_IO_1_1_1]	= FLASHPROG_IO_1_1_1,
+		[DUAL_OUT_1_1_2]	= FLASHPROG_IO_1_1_2,
+		[DUAL_IO_1_2_2]		= FLASHPROG_IO_1_2_2,
+		[QUAD_OUT_1_1_4]	= FLASHPROG_IO_1_1_4,
+		[QUAD_IO_1_4_4]		= FLASHPROG_IO_1_4_4,
+		[QPI_4_4_4]		= FLASHPROG_IO_4_4_4,
+	};
+	const struct spi_master *const mst = flash->mst.spi;
+	size_t i;
+
+	caps->flags |= FLASHPROG_CAP_SPI;
+	if (mst->features & SPI_MASTER_4BA)
+		caps->flags |= FLASHPROG_CAP_4BA;
+	if (mst->multicommand != default_spi_send_multicommand)
+		caps->flags |= FLASHPROG_CAP_MULTICOMMAND;
+	if (mst->features & SPI_MASTER_BATCH_POLL)
+		caps->flags |= FLASHPROG_CAP_BATCH_POLL;
+	if (mst->poll_busy)
+		caps->flags |= FLASHPROG_CAP_POLL_BUSY;
+	if (mst->blank_check)
+		caps->flags |= FLASHPROG_CAP_BLANK_CHECK;
+	if (mst->checksum)
+		caps->flags |= FLASHPROG_CAP_CHECKSUM;
+	if (mst->get_region)
+		caps->flags |= FLASHPROG_CAP_ACCESS_REGIONS;
+	if (mst->list_speeds && mst->set_speed) {
+		caps->flags |= FLASHPROG_CAP_SET_SPEED;
+		caps->speed_count = mst->list_speeds(flash, &caps->speeds);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); ++i) {
+		if (mst->features & modes[i].master_feature)
+			caps->io_modes |= 1 << modes[i].io_mode;
+	}
+	caps->read_mode = io_modes[spi_read_io_mode(flash)];
+
+	caps->max_data_read = mst->max_data_read;
+	caps->max_data_write = mst->max_data_write;
+	caps->clock_hz = mst->clock_hz;
+}
+
+static void opaque_master_caps(const struct flashctx *const flash, struct flashprog_programmer_caps *const caps)
+{
+	const struct opaque_master *const mst = flash->mst.opaque;
+
+	if (mst->erase_queue && mst->erase_flush)
+		caps->flags |= FLASHPROG_CAP_QUEUED_ERASE;
+	if (mst->blank_check)
+		caps->flags |= FLASHPROG_CAP_BLANK_CHECK;
+	if (mst->checksum)
+		caps->flags |= FLASHPROG_CAP_CHECKSUM;
+	if (mst->get_region)
+		caps->flags |= FLASHPROG_CAP_ACCESS_REGIONS;
+
+	caps->max_data_read = MAX(mst->max_data_read, 0);
+	caps->max_data_write = MAX(mst->max_data_write, 0);
+}
+
+/**
+ * @brief Query what the programmer can do for a flash chip.
+ *
+ * A programmer may drive several buses, so the capabilities are those of
+ * the part of it that the given chip was found on. They can be used to
+ * size transfers, buffers and the scheduling of jobs. The read mode and
+ * the clock reflect the current state, e.g. after the SPI clock was
+ * tuned, or the chip's SFDP parameters were applied.
+ *
+ * @param flashctx The context of a probed flash chip.
+ * @param[out] caps The capabilities, `speeds` stays valid until the
+ *                  programmer is shut down.
+ */
+void flashprog_programmer_get_caps(const struct flashprog_flashctx *const flashctx,
+				   struct flashprog_programmer_caps *const caps)
+{
+	memset(caps, 0, sizeof(*caps));
+	caps->io_modes = 1 << FLASHPROG_IO_1_1_1;
+	caps->read_mode = FLASHPROG_IO_1_1_1;
+
+	if (flashctx->chip->bustype == BUS_SPI)
+		spi_master_caps(flashctx, caps);
+	else if (flashctx->chip->bustype == BUS_PROG)
+		opaque_master_caps(flashctx, caps);
+}
 
 /** @} */ /* end flashprog-prog */
 
@@ -216,27 +521,55 @@ int flashprog_programmer_shutdown(struct flashprog_programmer *const flashprog)
  *         or 1 on any other error.
  */
 int flashprog_flash_probe(struct flashprog_flashctx **const flashctx,
-			 const struct flashprog_programmer *const flashprog,
+			 struct flashprog_programmer *const flashprog,
 			 const char *const chip_name)
+{
+	return flashprog_flash_probe_cs(flashctx, flashprog, chip_name, 0);
+}
+
+/**
+ * @brief Probe for a flash chip on a specific chip select.
+ *
+ * Like @ref flashprog_flash_probe but for SPI masters that can address
+ * more than one chip. Chip select 0 is the one the programmer was set up
+ * to use, the others follow. The contexts of all chip selects can be used
+ * together, e.g. with @ref flashprog_image_write_multi.
+ *
+ * @param[out] flashctx Set if exactly one chip is found, see @ref flashprog_flash_probe.
+ * @param[in] flashprog The flash programmer used to access the chip.
+ * @param[in] chip_name Name of a chip to probe for, or NULL to probe for
+ *                      all known chips.
+ * @param[in] chip_select The chip select to probe on.
+ * @return 0 on success,
+ *         3 if multiple chips were found,
+ *         2 if no chip was found,
+ *         or 1 on any other error.
+ */
+int flashprog_flash_probe_cs(struct flashprog_flashctx **const flashctx,
+			     struct flashprog_programmer *const flashprog,
+			     const char *const chip_name, const unsigned int chip_select)
 {
 	int i, ret = 2;
 	struct flashprog_flashctx second_flashctx = { 0, };
 
-	chip_to_probe = chip_name; /* chip_to_probe is global in flashprog.c */
-
-	*flashctx = malloc(sizeof(**flashctx));
+	*flashctx = flashprog_malloc(sizeof(**flashctx));
 	if (!*flashctx)
 		return 1;
 	memset(*flashctx, 0, sizeof(**flashctx));
+	(*flashctx)->chip_select = second_flashctx.chip_select = chip_select;
 
-	for (i = 0; i < registered_master_count; ++i) {
+	for (i = 0; i < flashprog->master_count; ++i) {
+		struct registered_master *const mst = &flashprog->masters[i];
 		int flash_idx = -1;
-		if (!ret || (flash_idx = probe_flash(&registered_masters[i], 0, *flashctx, 0)) != -1) {
+		/* Other chip selects than the first exist only on SPI masters that tell so. */
+		if (chip_select && (!(mst->buses_supported & BUS_SPI) || chip_select >= mst->spi.chip_selects))
+			continue;
+		if (!ret || (flash_idx = probe_flash(mst, 0, *flashctx, 0, chip_name)) != -1) {
 			ret = 0;
 			/* We found one chip, now check that there is no second match. */
-			if (probe_flash(&registered_masters[i], flash_idx + 1, &second_flashctx, 0) != -1) {
+			if (probe_flash(mst, flash_idx + 1, &second_flashctx, 0, chip_name) != -1) {
 				flashprog_layout_release(second_flashctx.default_layout);
-				free(second_flashctx.chip);
+				flashprog_free(second_flashctx.chip);
 				ret = 3;
 				break;
 			}
@@ -260,6 +593,37 @@ size_t flashprog_flash_getsize(const struct flashprog_flashctx *const flashctx)
 	return flashctx->chip->total_size * 1024;
 }
 
+/**
+ * @brief Returns the SPI clock used for the specified flash chip.
+ *
+ * @param flashctx The queried flash context.
+ * @return The clock in Hz, or 0 if it's unknown or the chip isn't
+ *         accessed via SPI.
+ */
+unsigned long flashprog_flash_get_spi_clock(const struct flashprog_flashctx *const flashctx)
+{
+	if (flashctx->chip->bustype != BUS_SPI)
+		return 0;
+	return flashctx->mst.spi->clock_hz;
+}
+
+/**
+ * @brief Complete the parameters of a known flash chip with its SFDP data.
+ *
+ * Reads the chip's Serial Flash Discoverable Parameters and, if they match
+ * the static entry in size and erase block layout, adds fast-read modes,
+ * program and erase times and the page size that the entry lacks. Nothing
+ * the static entry specifies is changed.
+ *
+ * @param flashctx The context of a probed flash chip.
+ * @return 0 if SFDP parameters were applied,
+ *         1 if the chip has no usable SFDP data.
+ */
+int flashprog_flash_sfdp_overlay(struct flashprog_flashctx *const flashctx)
+{
+	return sfdp_overlay(flashctx);
+}
+
 /**
  * @brief Free a flash context.
  *
@@ -270,9 +634,12 @@ void flashprog_flash_release(struct flashprog_flashctx *const flashctx)
 	if (!flashctx)
 		return;
 
+	read_cache_clear(flashctx);
+	erase_layout_cache_clear(flashctx);
+	spi_wp_release(flashctx);
 	flashprog_layout_release(flashctx->default_layout);
-	free(flashctx->chip);
-	free(flashctx);
+	flashprog_free(flashctx->chip);
+	flashprog_free(flashctx);
 }
 
 /**
@@ -294,6 +661,93 @@ void flashprog_set_progress_callback(struct flashprog_flashctx *const flashctx,
 	flashctx->progress.user_data = user_data;
 }
 
+/**
+ * @brief Limit how often the progress callback is called.
+ *
+ * Reporting progress after every programmer transfer can take noticeable
+ * time with chatty callbacks. With a limit, the callback is only called
+ * again once `interval_ms` milliseconds passed and the progress advanced
+ * by `granularity` bytes. Zero values don't limit. The start and end of
+ * each stage are always reported. Default is no limit.
+ *
+ * @param flashctx Current flash context.
+ * @param interval_ms Minimum time between two calls, in milliseconds.
+ * @param granularity Minimum progress between two calls, in bytes.
+ */
+void flashprog_set_progress_interval(struct flashprog_flashctx *const flashctx,
+				     const unsigned int interval_ms, const size_t granularity)
+{
+	flashctx->progress.interval_ms = interval_ms;
+	flashctx->progress.granularity = granularity;
+}
+
+/**
+ * @brief Get the throughput of the current progress stage.
+ *
+ * The throughput is averaged over the whole stage so far. This may
+ * be called from the progress callback.
+ *
+ * @param flashctx Current flash context.
+ * @param[out] bytes_per_second Throughput of the current stage.
+ * @param[out] eta_seconds Estimated time until the current stage ends.
+ * @return 0 on success,
+ *         1 if nothing was transferred in the current stage yet.
+ */
+int flashprog_progress_get_rate(const struct flashprog_flashctx *const flashctx,
+				unsigned long long *const bytes_per_second,
+				unsigned long *const eta_seconds)
+{
+	const struct flashprog_progress *const p = &flashctx->progress;
+	const uint64_t elapsed_us = monotonic_us() - p->start_us;
+
+	if (!p->current || !elapsed_us)
+		return 1;
+
+	const unsigned long long rate = (unsigned long long)p->current * 1000000 / elapsed_us;
+	if (!rate)
+		return 1;
+
+	*bytes_per_second = rate;
+	*eta_seconds = (p->total - p->current + rate - 1) / rate;
+	return 0;
+}
+
+/**
+ * @brief Set the event callback function.
+ *
+ * The event callback is invoked for every block operation, e.g. each
+ * erased block, each programmed range and each verified range. It is
+ * meant for structured logging, the events carry stable numeric IDs.
+ *
+ * @param flashctx Current flash context.
+ * @param event_callback Pointer to the new event callback function, NULL to disable.
+ * @param user_data Pointer to any data the API user wants to have passed to the callback.
+ */
+void flashprog_set_event_callback(struct flashprog_flashctx *const flashctx,
+				  flashprog_event_callback *const event_callback,
+				  void *const user_data)
+{
+	flashctx->event.callback = event_callback;
+	flashctx->event.user_data = user_data;
+}
+
+/**
+ * @brief Get a stable, short name of an event.
+ *
+ * @param id The event's ID.
+ * @return A lower-case name, e.g. "erase_block", or "unknown".
+ */
+const char *flashprog_event_name(const enum flashprog_event_id id)
+{
+	switch (id) {
+	case FLASHPROG_EVENT_ERASE_BLOCK:	return "erase_block";
+	case FLASHPROG_EVENT_WRITE:		return "write";
+	case FLASHPROG_EVENT_SKIP:		return "skip";
+	case FLASHPROG_EVENT_VERIFY:		return "verify";
+	}
+	return "unknown";
+}
+
 /**
  * @brief Set a flag in the given flash context.
  *
@@ -309,6 +763,9 @@ void flashprog_flag_set(struct flashprog_flashctx *const flashctx,
 		case FLASHPROG_FLAG_FORCE_BOARDMISMATCH: flashctx->flags.force_boardmismatch = value; break;
 		case FLASHPROG_FLAG_VERIFY_AFTER_WRITE:	 flashctx->flags.verify_after_write = value; break;
 		case FLASHPROG_FLAG_VERIFY_WHOLE_CHIP:	 flashctx->flags.verify_whole_chip = value; break;
+		case FLASHPROG_FLAG_STREAMING_WRITE:	 flashctx->flags.streaming_write = value; break;
+		case FLASHPROG_FLAG_VERIFY_INLINE:	 flashctx->flags.verify_inline = value; break;
+		case FLASHPROG_FLAG_CHECKED_READ:	 flashctx->flags.checked_read = value; break;
 	}
 }
 
@@ -326,10 +783,79 @@ bool flashprog_flag_get(const struct flashprog_flashctx *const flashctx, const e
 		case FLASHPROG_FLAG_FORCE_BOARDMISMATCH: return flashctx->flags.force_boardmismatch;
 		case FLASHPROG_FLAG_VERIFY_AFTER_WRITE:	 return flashctx->flags.verify_after_write;
 		case FLASHPROG_FLAG_VERIFY_WHOLE_CHIP:	 return flashctx->flags.verify_whole_chip;
+		case FLASHPROG_FLAG_STREAMING_WRITE:	 return flashctx->flags.streaming_write;
+		case FLASHPROG_FLAG_VERIFY_INLINE:	 return flashctx->flags.verify_inline;
+		case FLASHPROG_FLAG_CHECKED_READ:	 return flashctx->flags.checked_read;
 		default:				 return false;
 	}
 }
 
+/**
+ * @brief Select how erased blocks are checked.
+ *
+ * Every erased block is read back by default. If the programmer
+ * can check for blank blocks itself, that is used instead.
+ *
+ * @param flashctx Flash context to alter.
+ * @param policy   Level of erase checks.
+ */
+void flashprog_erase_check_set(struct flashprog_flashctx *const flashctx,
+			       const enum flashprog_erase_check policy)
+{
+	flashctx->flags.erase_check = policy;
+}
+
+/**
+ * @brief Get the performance counters of a flash context.
+ *
+ * The counters start when probing for the chip begins and can be reset
+ * with flashprog_stats_reset(). SPI counters stay zero for other buses.
+ * The USB and delay statistics are shared by all programmers, they also
+ * count the transfers of other programmers used at the same time.
+ *
+ * @param flashctx   The queried flash context.
+ * @param[out] stats Set to the current counters.
+ */
+void flashprog_stats_get(const struct flashprog_flashctx *const flashctx, struct flashprog_stats *const stats)
+{
+	const struct flashprog_usb_stats *const usb = programmer_usb_stats();
+	const struct flashprog_usb_stats *const base = &flashctx->stats_state.usb_base;
+	size_t i;
+
+	*stats = flashctx->stats;
+	stats->delay_us = programmer_delay_total(flashctx) - flashctx->stats_state.delay_base;
+
+	stats->usb.transfers	= usb->transfers - base->transfers;
+	stats->usb.timeouts	= usb->timeouts - base->timeouts;
+	stats->usb.errors	= usb->errors - base->errors;
+	stats->usb.bytes	= usb->bytes - base->bytes;
+	stats->usb.time_us	= usb->time_us - base->time_us;
+	for (i = 0; i < ARRAY_SIZE(usb->by_size); ++i)
+		stats->usb.by_size[i] = usb->by_size[i] - base->by_size[i];
+	for (i = 0; i < ARRAY_SIZE(usb->by_latency); ++i)
+		stats->usb.by_latency[i] = usb->by_latency[i] - base->by_latency[i];
+
+	const struct flashprog_delay_stats *const delays = internal_delay_stats();
+	const struct flashprog_delay_stats *const delays_base = &flashctx->stats_state.delays_base;
+	stats->delays.count = delays->count - delays_base->count;
+	for (i = 0; i < ARRAY_SIZE(delays->by_lateness); ++i)
+		stats->delays.by_lateness[i] = delays->by_lateness[i] - delays_base->by_lateness[i];
+}
+
+/**
+ * @brief Reset the performance counters of a flash context.
+ *
+ * @param flashctx Flash context to alter.
+ */
+void flashprog_stats_reset(struct flashprog_flashctx *const flashctx)
+{
+	memset(&flashctx->stats, 0, sizeof(flashctx->stats));
+	flashctx->stats_state.delay_base = programmer_delay_total(flashctx);
+	flashctx->stats_state.usb_base = *programmer_usb_stats();
+	flashctx->stats_state.delays_base = *internal_delay_stats();
+	flashctx->stats_state.stage_running = false;
+}
+
 /** @} */ /* end flashprog-flash */
 
 
@@ -369,7 +895,7 @@ int flashprog_layout_read_from_ifd(struct flashprog_layout **const layout, struc
 	struct flashprog_layout *dump_layout = NULL, *chip_layout = NULL;
 	int ret = 1;
 
-	void *const desc = malloc(0x1000);
+	void *const desc = flashprog_malloc(0x1000);
 	if (prepare_flash_access(flashctx, true, false, false, false))
 		goto _free_ret;
 
@@ -388,7 +914,8 @@ int flashprog_layout_read_from_ifd(struct flashprog_layout **const layout, struc
 		goto _finalize_ret;
 	}
 
-	if (dump) {
+	/* An identical dump describes the same layout, no need to parse it again. */
+	if (dump && !(len >= 0x1000 && !memcmp(dump, desc, 0x1000))) {
 		if (layout_from_ich_descriptors(&dump_layout, dump, len)) {
 			msg_cerr("Couldn't parse the descriptor!\n");
 			ret = 4;
@@ -397,7 +924,8 @@ int flashprog_layout_read_from_ifd(struct flashprog_layout **const layout, struc
 
 		const struct romentry *chip_entry = layout_next(chip_layout, NULL);
 		const struct romentry *dump_entry = layout_next(dump_layout, NULL);
-		while (chip_entry && dump_entry && !memcmp(chip_entry, dump_entry, sizeof(*chip_entry))) {
+		while (chip_entry && dump_entry && chip_entry->start == dump_entry->start &&
+		       chip_entry->end == dump_entry->end && !strcmp(chip_entry->name, dump_entry->name)) {
 			chip_entry = layout_next(chip_layout, chip_entry);
 			dump_entry = layout_next(dump_layout, dump_entry);
 		}
@@ -417,7 +945,7 @@ _finalize_ret:
 _free_ret:
 	if (ret)
 		flashprog_layout_release(chip_layout);
-	free(desc);
+	flashprog_free(desc);
 	return ret;
 #endif
 }
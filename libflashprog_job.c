@@ -0,0 +1,332 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "flash.h"
+#include "programmer.h"
+#include "libflashprog.h"
+
+struct flashprog_job {
+	struct flashprog_flashctx *flashctx;
+	enum flashprog_job_type type;
+	void *buffer;
+	size_t buffer_len;
+	const void *refbuffer;
+	flashprog_job_callback *callback;
+	void *user_data;
+
+	/* The flash context's progress callback, restored when the job ends. */
+	flashprog_progress_callback *progress_callback;
+	void *progress_user_data;
+
+	pthread_t thread;
+	int fds[2];
+	/* Released from the completion callback, the thread frees the job itself. */
+	bool released;
+
+	/* Protects everything below. */
+	pthread_mutex_t lock;
+	bool done;
+	int result;
+	enum flashprog_progress_stage stage;
+	size_t current;
+	size_t total;
+};
+
+/* Only one job can run per programmer, this protects their `job_running`. */
+static pthread_mutex_t job_running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The job whose completion callback runs on this thread. */
+static __thread struct flashprog_job *callback_job;
+
+static void job_progress(enum flashprog_progress_stage stage, size_t current, size_t total, void *user_data)
+{
+	struct flashprog_job *const job = user_data;
+
+	pthread_mutex_lock(&job->lock);
+	job->stage = stage;
+	job->current = current;
+	job->total = total;
+	pthread_mutex_unlock(&job->lock);
+
+	if (job->progress_callback)
+		job->progress_callback(stage, current, total, job->progress_user_data);
+}
+
+static int job_execute(struct flashprog_job *const job)
+{
+	switch (job->type) {
+	case FLASHPROG_JOB_READ:
+		return flashprog_image_read(job->flashctx, job->buffer, job->buffer_len);
+	case FLASHPROG_JOB_WRITE:
+		return flashprog_image_write(job->flashctx, job->buffer, job->buffer_len, job->refbuffer);
+	case FLASHPROG_JOB_VERIFY:
+		return flashprog_image_verify(job->flashctx, job->buffer, job->buffer_len);
+	case FLASHPROG_JOB_ERASE:
+		return flashprog_flash_erase(job->flashctx);
+	default:
+		return 1;
+	}
+}
+
+static void job_free(struct flashprog_job *const job)
+{
+	pthread_mutex_destroy(&job->lock);
+	close(job->fds[0]);
+	close(job->fds[1]);
+	free(job);
+}
+
+static void *job_thread(void *const arg)
+{
+	struct flashprog_job *const job = arg;
+	const char c = 0;
+
+	const int result = job_execute(job);
+
+	flashprog_set_progress_callback(job->flashctx, job->progress_callback, job->progress_user_data);
+
+	/* Before we report `done`, the flash context may be gone afterwards. */
+	pthread_mutex_lock(&job_running_lock);
+	job->flashctx->prog->job_running = false;
+	pthread_mutex_unlock(&job_running_lock);
+
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	job->result = result;
+	__atomic_store_n(&job->flashctx->cancel_requested, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&job->lock);
+
+	if (job->callback) {
+		callback_job = job;
+		job->callback(job, result, job->user_data);
+		callback_job = NULL;
+	}
+
+	if (job->released) {
+		/* Nobody will join us. */
+		pthread_detach(pthread_self());
+		job_free(job);
+		return NULL;
+	}
+
+	if (write(job->fds[1], &c, 1) != 1)
+		msg_gerr("Failed to signal job completion.\n");
+
+	return NULL;
+}
+
+/**
+ * @defgroup flashprog-job Asynchronous operations
+ * @{
+ */
+
+/**
+ * @brief Start an operation in the background.
+ *
+ * The operation runs in a separate thread and behaves like the respective
+ * blocking call, i.e. flashprog_image_read(), flashprog_image_write(),
+ * flashprog_image_verify() or flashprog_flash_erase(). Its return value is
+ * reported as `result` by flashprog_job_poll() and the completion callback.
+ *
+ * Progress is recorded for flashprog_job_get_progress() and forwarded to
+ * the callback set with flashprog_set_progress_callback(). Note that both
+ * the progress and the completion callback are called from the job's
+ * thread. Only one job can run per programmer at a time, jobs on the
+ * chips of different programmers may run in parallel. The flash context
+ * must not be used otherwise until the job is done.
+ *
+ * @param[out] job     Points to a pointer of type struct flashprog_job that
+ *                     will be set if submission succeeds. *job has to be
+ *                     freed by the caller with @ref flashprog_job_release.
+ * @param flashctx     The context of the flash chip.
+ * @param type         The operation to perform.
+ * @param buffer       Buffer of the operation, unused for erase.
+ * @param buffer_len   Size of `buffer` in bytes.
+ * @param refbuffer    Optional reference contents for writes, cf. flashprog_image_write().
+ * @param callback     Called when the job is done, may be NULL. It may
+ *                     release the job, cf. @ref flashprog_job_release.
+ * @param user_data    Passed to `callback`.
+ * @return 0 on success,
+ *         2 if another job is running on the same programmer,
+ *         1 on any other error.
+ */
+int flashprog_job_submit(struct flashprog_job **const job, struct flashprog_flashctx *const flashctx,
+			 const enum flashprog_job_type type, void *const buffer, const size_t buffer_len,
+			 const void *const refbuffer, flashprog_job_callback *const callback,
+			 void *const user_data)
+{
+	struct flashprog_job *const j = calloc(1, sizeof(*j));
+	int ret = 1;
+
+	if (!j) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	j->flashctx	= flashctx;
+	j->type		= type;
+	j->buffer	= buffer;
+	j->buffer_len	= buffer_len;
+	j->refbuffer	= refbuffer;
+	j->callback	= callback;
+	j->user_data	= user_data;
+	j->progress_callback	= flashctx->progress.callback;
+	j->progress_user_data	= flashctx->progress.user_data;
+
+	if (pipe(j->fds)) {
+		msg_gerr("Failed to create job pipe.\n");
+		goto _free_ret;
+	}
+	fcntl(j->fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(j->fds[1], F_SETFD, FD_CLOEXEC);
+
+	if (pthread_mutex_init(&j->lock, NULL))
+		goto _close_ret;
+
+	pthread_mutex_lock(&job_running_lock);
+	if (flashctx->prog->job_running) {
+		pthread_mutex_unlock(&job_running_lock);
+		msg_gerr("Another job is already running on this programmer.\n");
+		ret = 2;
+		goto _destroy_ret;
+	}
+	flashctx->prog->job_running = true;
+	pthread_mutex_unlock(&job_running_lock);
+
+	flashctx->cancel_requested = false;
+	flashprog_set_progress_callback(flashctx, job_progress, j);
+
+	if (pthread_create(&j->thread, NULL, job_thread, j)) {
+		msg_gerr("Failed to start job thread.\n");
+		flashprog_set_progress_callback(flashctx, j->progress_callback, j->progress_user_data);
+		pthread_mutex_lock(&job_running_lock);
+		flashctx->prog->job_running = false;
+		pthread_mutex_unlock(&job_running_lock);
+		goto _destroy_ret;
+	}
+
+	*job = j;
+	return 0;
+
+_destroy_ret:
+	pthread_mutex_destroy(&j->lock);
+_close_ret:
+	close(j->fds[0]);
+	close(j->fds[1]);
+_free_ret:
+	free(j);
+	return ret;
+}
+
+/**
+ * @brief Check if a job is done.
+ *
+ * @param job          The job to check.
+ * @param[out] result  Set to the return value of the operation if the job
+ *                     is done, may be NULL.
+ * @return 0 if the job is done,
+ *         1 if it's still running.
+ */
+int flashprog_job_poll(struct flashprog_job *const job, int *const result)
+{
+	pthread_mutex_lock(&job->lock);
+	const bool done = job->done;
+	if (done && result)
+		*result = job->result;
+	pthread_mutex_unlock(&job->lock);
+
+	return !done;
+}
+
+/**
+ * @brief Get a file descriptor that becomes readable when the job is done.
+ *
+ * The descriptor can be watched with select(), poll() or similar in an
+ * event loop. It stays valid until the job is released.
+ *
+ * @param job The job to watch.
+ * @return A file descriptor.
+ */
+int flashprog_job_get_fd(const struct flashprog_job *const job)
+{
+	return job->fds[0];
+}
+
+/**
+ * @brief Get the last progress report of a job.
+ *
+ * @param job           The job to query.
+ * @param[out] stage    Current stage of the operation.
+ * @param[out] current  Bytes processed so far in this stage.
+ * @param[out] total    Total bytes of this stage.
+ */
+void flashprog_job_get_progress(struct flashprog_job *const job, enum flashprog_progress_stage *const stage,
+				size_t *const current, size_t *const total)
+{
+	pthread_mutex_lock(&job->lock);
+	*stage = job->stage;
+	*current = job->current;
+	*total = job->total;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * @brief Request to abort a job.
+ *
+ * The operation stops at the next block boundary and fails. This returns
+ * immediately, use flashprog_job_poll() or the completion callback to learn
+ * when the job is done. A cancelled write may leave the flash contents in
+ * an intermediate state.
+ *
+ * @param job The job to cancel.
+ */
+void flashprog_job_cancel(struct flashprog_job *const job)
+{
+	pthread_mutex_lock(&job->lock);
+	if (!job->done)
+		__atomic_store_n(&job->flashctx->cancel_requested, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * @brief Wait for a job to finish and free it.
+ *
+ * This may also be called from the completion callback, which runs on
+ * the job's thread. The thread can't wait for itself, so the job is
+ * then freed when the callback returns, and its file descriptor is
+ * closed without becoming readable.
+ *
+ * @param job The job to release.
+ * @return The return value of the operation.
+ */
+int flashprog_job_release(struct flashprog_job *const job)
+{
+	if (job == callback_job) {
+		job->released = true;
+		return job->result;
+	}
+
+	pthread_join(job->thread, NULL);
+	const int result = job->result;
+
+	job_free(job);
+	return result;
+}
+
+/** @} */ /* end flashprog-job */
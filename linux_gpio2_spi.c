@@ -21,6 +21,8 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
 #include <gpiod.h>
 #include "programmer.h"
 #include "spi.h"
@@ -40,6 +42,12 @@ struct linux_gpio_spi {
 	struct gpiod_chip *chip;
 	struct gpiod_line_request *lines;
 	unsigned int offsets[MAX_LINES];
+
+	/* For direct ioctls on the line request, cf. linux_gpio_spi_bitbang_shift_bytes(). */
+	int fd;
+	uint64_t sck_mask;
+	uint64_t mosi_mask;
+	uint64_t miso_mask;
 };
 
 static void linux_gpio_spi_bitbang_set_cs(int val, void *data)
@@ -86,12 +94,52 @@ static void linux_gpio_spi_bitbang_set_sck_set_mosi(int sck, int mosi, void *dat
 		msg_perr("Setting sck/mosi lines failed: %s\n", strerror(errno));
 }
 
+/*
+ * Shift whole buffers with GPIO v2 ioctls on the line request, bypassing
+ * libgpiod's per-call offset lookups. The falling edge and the next MOSI
+ * value go into a single GPIO_V2_LINE_SET_VALUES_IOCTL. There are no
+ * delays, the ioctls take longer than any supported clock period.
+ */
+static void linux_gpio_spi_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *data)
+{
+	const struct linux_gpio_spi *const gpio_spi = data;
+	struct gpio_v2_line_values falling = { .mask = gpio_spi->sck_mask | gpio_spi->mosi_mask };
+	struct gpio_v2_line_values rising = { .bits = gpio_spi->sck_mask, .mask = gpio_spi->sck_mask };
+	struct gpio_v2_line_values miso = { .mask = gpio_spi->miso_mask };
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t read = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			falling.bits = (val >> bit) & 1 ? gpio_spi->mosi_mask : 0;
+			if (ioctl(gpio_spi->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &falling) < 0 ||
+			    ioctl(gpio_spi->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &rising) < 0) {
+				msg_perr("Setting sck/mosi lines failed: %s\n", strerror(errno));
+				return;
+			}
+			if (!in)
+				continue;
+			if (ioctl(gpio_spi->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &miso) < 0) {
+				msg_perr("Getting miso line failed: %s\n", strerror(errno));
+				return;
+			}
+			read = read << 1 | !!(miso.bits & gpio_spi->miso_mask);
+		}
+		if (in)
+			in[i] = read;
+	}
+}
+
 static struct bitbang_spi_master bitbang_spi_master_gpiod = {
 	.set_cs			= linux_gpio_spi_bitbang_set_cs,
 	.set_sck		= linux_gpio_spi_bitbang_set_sck,
 	.set_mosi		= linux_gpio_spi_bitbang_set_mosi,
 	.get_miso		= linux_gpio_spi_bitbang_get_miso,
 	.set_sck_set_mosi	= linux_gpio_spi_bitbang_set_sck_set_mosi,
+	.shift_bytes		= linux_gpio_spi_bitbang_shift_bytes,
 };
 
 static int linux_gpio_spi_shutdown(void *data)
@@ -208,6 +256,15 @@ static int linux_gpio_spi_init(struct flashprog_programmer *const prog)
 
 	memcpy(gpio_spi->offsets, param_int, sizeof(gpio_spi->offsets));
 
+	/*
+	 * Lines are requested in the order they were added to the config,
+	 * CS, SCK, MOSI, then MISO. Bits of GPIO v2 line values follow it.
+	 */
+	gpio_spi->fd = gpiod_line_request_get_fd(gpio_spi->lines);
+	gpio_spi->sck_mask = 1ULL << SCK;
+	gpio_spi->mosi_mask = 1ULL << MOSI;
+	gpio_spi->miso_mask = 1ULL << MISO;
+
 	if (register_shutdown(linux_gpio_spi_shutdown, gpio_spi))
 		goto err_exit;
 
@@ -226,4 +283,5 @@ const struct programmer_entry programmer_linux_gpio_spi = {
 	.type		= OTHER,
 	.devs.note	= "Device file /dev/gpiochip<n>\n",
 	.init		= linux_gpio_spi_init,
+	.multi_instance	= true,
 };
@@ -180,4 +180,5 @@ const struct programmer_entry programmer_linux_gpio_spi = {
 	.type		= OTHER,
 	.devs.note	= "Device file /dev/gpiochip<n>\n",
 	.init		= linux_gpio_spi_init,
+	.multi_instance	= true,
 };
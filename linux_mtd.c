@@ -31,9 +31,13 @@
 
 #define LINUX_DEV_ROOT			"/dev"
 #define LINUX_MTD_SYSFS_ROOT		"/sys/class/mtd"
+/* Upper limit for a single read or write, rounded down to whole eraseblocks. */
+#define LINUX_MTD_IO_SIZE		(256 * KiB)
+/* Number of eraseblocks erased with a single MEMERASE64 call. */
+#define LINUX_MTD_ERASE_BATCH		16
 
 struct linux_mtd_data {
-	FILE *dev_fp;
+	int dev_fd;
 	bool device_is_writeable;
 	bool no_erase;
 	/* Size info is presented in bytes in sysfs. */
@@ -41,6 +45,11 @@ struct linux_mtd_data {
 	unsigned long int numeraseregions;
 	/* only valid if numeraseregions is 0 */
 	unsigned long int erasesize;
+	/* Eraseblocks that were found blank and haven't been written since. */
+	bool *erased;
+	/* Contiguous range of queued erases, see linux_mtd_erase_queue(). */
+	unsigned int queue_start;
+	unsigned int queue_len;
 };
 
 /* read a string from a sysfs file and sanitize it */
@@ -187,32 +196,51 @@ static int linux_mtd_probe(struct flashctx *flash)
 	return 1;
 }
 
+/*
+ * Split transfers at eraseblock boundaries, but allow multiple eraseblocks
+ * at once. Some MTD drivers don't handle arbitrarily large or unaligned
+ * transfers well.
+ */
+static unsigned int linux_mtd_step(const struct linux_mtd_data *data,
+				   unsigned int offset, unsigned int left)
+{
+	const unsigned int io_size = max(LINUX_MTD_IO_SIZE & ~(data->erasesize - 1), data->erasesize);
+
+	return min(io_size - offset % io_size, left);
+}
+
+/* Read `len` bytes at `start` in one go, retrying short reads. */
+static int linux_mtd_pread(const struct linux_mtd_data *data, uint8_t *buf,
+			   unsigned int start, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; ) {
+		const ssize_t ret = pread(data->dev_fd, buf + i, len - i, start + i);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			msg_perr("Cannot read 0x%06x bytes at 0x%06x: %s\n",
+				 len - i, start + i, ret ? strerror(errno) : "end of device");
+			return 1;
+		}
+		i += ret;
+	}
+
+	return 0;
+}
+
 static int linux_mtd_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len)
 {
 	struct linux_mtd_data *data = flash->mst.opaque->data;
-	unsigned int eb_size = flash->chip->block_erasers[0].eraseblocks[0].size;
 	unsigned int i;
 
-	if (fseek(data->dev_fp, start, SEEK_SET) != 0) {
-		msg_perr("Cannot seek to 0x%06x: %s\n", start, strerror(errno));
-		return 1;
-	}
-
 	for (i = 0; i < len; ) {
-		/*
-		 * Try to align reads to eraseblock size.
-		 * FIXME: Shouldn't actually be necessary, but not all MTD
-		 * drivers handle arbitrary large reads well.
-		 */
-		unsigned int step = eb_size - ((start + i) % eb_size);
-		step = min(step, len - i);
-
-		if (fread(buf + i, step, 1, data->dev_fp) != 1) {
-			msg_perr("Cannot read 0x%06x bytes at 0x%06x: %s\n",
-					step, start + i, strerror(errno));
+		const unsigned int step = linux_mtd_step(data, start + i, len - i);
+
+		if (linux_mtd_pread(data, buf + i, start + i, step))
 			return 1;
-		}
 
 		i += step;
 		flashprog_progress_add(flash, step);
@@ -221,44 +249,39 @@ static int linux_mtd_read(struct flashctx *flash, uint8_t *buf,
 	return 0;
 }
 
-/* this version assumes we must divide the write request into chunks ourselves */
+static void linux_mtd_mark_written(struct linux_mtd_data *data, unsigned int start, unsigned int len)
+{
+	unsigned long eb;
+
+	for (eb = start / data->erasesize; eb * data->erasesize < start + len; ++eb)
+		data->erased[eb] = false;
+}
+
 static int linux_mtd_write(struct flashctx *flash, const uint8_t *buf,
 				unsigned int start, unsigned int len)
 {
 	struct linux_mtd_data *data = flash->mst.opaque->data;
-	unsigned int chunksize = flash->chip->block_erasers[0].eraseblocks[0].size;
 	unsigned int i;
 
 	if (!data->device_is_writeable)
 		return 1;
 
-	if (fseek(data->dev_fp, start, SEEK_SET) != 0) {
-		msg_perr("Cannot seek to 0x%06x: %s\n", start, strerror(errno));
-		return 1;
-	}
+	linux_mtd_mark_written(data, start, len);
 
-	/*
-	 * Try to align writes to eraseblock size. We want these large enough
-	 * to give MTD room for optimizing performance.
-	 * FIXME: Shouldn't need to divide this up at all, but not all MTD
-	 * drivers handle arbitrary large writes well.
-	 */
 	for (i = 0; i < len; ) {
-		unsigned int step = chunksize - ((start + i) % chunksize);
-		step = min(step, len - i);
-
-		if (fwrite(buf + i, step, 1, data->dev_fp) != 1) {
-			msg_perr("Cannot write 0x%06x bytes at 0x%06x\n", step, start + i);
+		const unsigned int step = linux_mtd_step(data, start + i, len - i);
+
+		const ssize_t ret = pwrite(data->dev_fd, buf + i, step, start + i);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			msg_perr("Cannot write 0x%06x bytes at 0x%06x: %s\n",
+				 step, start + i, ret ? strerror(errno) : "end of device");
 			return 1;
 		}
 
-		if (fflush(data->dev_fp) == EOF) {
-			msg_perr("Failed to flush buffer: %s\n", strerror(errno));
-			return 1;
-		}
-
-		i += step;
-		flashprog_progress_add(flash, step);
+		i += ret;
+		flashprog_progress_add(flash, ret);
 	}
 
 	return 0;
@@ -268,7 +291,8 @@ static int linux_mtd_erase(struct flashctx *flash,
 			unsigned int start, unsigned int len)
 {
 	struct linux_mtd_data *data = flash->mst.opaque->data;
-	uint32_t u;
+	const unsigned long batch = LINUX_MTD_ERASE_BATCH * data->erasesize;
+	unsigned long u;
 
 	if (data->no_erase) {
 		msg_perr("%s: device does not support erasing.\n"
@@ -284,15 +308,29 @@ static int linux_mtd_erase(struct flashctx *flash,
 		return 1;
 	}
 
-	for (u = 0; u < len; u += data->erasesize) {
-		struct erase_info_user erase_info = {
-			.start = start + u,
-			.length = data->erasesize,
-		};
+	if (start % data->erasesize || len % data->erasesize) {
+		msg_perr("%s: 0x%06x bytes at 0x%06x are not eraseblock aligned\n",
+			 __func__, len, start);
+		return 1;
+	}
+
+	/* Let MTD erase multiple eraseblocks per call, skip those known to be blank. */
+	for (u = 0; u < len; ) {
+		struct erase_info_user64 erase_info = { .start = start + u };
+
+		if (data->erased[(start + u) / data->erasesize]) {
+			u += data->erasesize;
+			continue;
+		}
+		for (; u < len && erase_info.length < batch; u += data->erasesize) {
+			if (data->erased[(start + u) / data->erasesize])
+				break;
+			erase_info.length += data->erasesize;
+		}
 
-		int ret = ioctl(fileno(data->dev_fp), MEMERASE, &erase_info);
+		int ret = ioctl(data->dev_fd, MEMERASE64, &erase_info);
 		if (ret < 0) {
-		        msg_perr("%s: MEMERASE ioctl call returned %d, error: %s\n",
+		        msg_perr("%s: MEMERASE64 ioctl call returned %d, error: %s\n",
 		                 __func__, ret, strerror(errno));
 		        return 1;
 		}
@@ -301,6 +339,83 @@ static int linux_mtd_erase(struct flashctx *flash,
 	return 0;
 }
 
+static int linux_mtd_erase_flush(struct flashctx *flash)
+{
+	struct linux_mtd_data *data = flash->mst.opaque->data;
+	const unsigned int len = data->queue_len;
+
+	if (!len)
+		return 0;
+	data->queue_len = 0;
+	return linux_mtd_erase(flash, data->queue_start, len);
+}
+
+/*
+ * Collect adjacent eraseblocks, so linux_mtd_erase() can erase them with
+ * few MEMERASE64 calls. A range that doesn't continue the queued one
+ * flushes it first.
+ */
+static int linux_mtd_erase_queue(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	struct linux_mtd_data *data = flash->mst.opaque->data;
+
+	if (data->queue_len && start == data->queue_start + data->queue_len &&
+	    data->queue_len + len <= LINUX_MTD_ERASE_BATCH * data->erasesize) {
+		data->queue_len += len;
+		return 0;
+	}
+
+	const int ret = linux_mtd_erase_flush(flash);
+	data->queue_start = start;
+	data->queue_len = len;
+	return ret;
+}
+
+/*
+ * Scan eraseblocks for the erased value and remember blank ones, so that
+ * repeated checks and erases of the same blocks in this session are free.
+ */
+static int linux_mtd_blank_check(struct flashctx *flash, unsigned int start, unsigned int len,
+				 uint8_t erased_value)
+{
+	struct linux_mtd_data *data = flash->mst.opaque->data;
+	const unsigned int end = start + len;
+	uint8_t *buf = NULL;
+	unsigned int off;
+	int ret = 0;
+
+	if (start % data->erasesize || len % data->erasesize)
+		return -1;
+
+	for (off = start; off < end && !ret; off += data->erasesize) {
+		const unsigned long eb = off / data->erasesize;
+
+		if (data->erased[eb])
+			continue;
+
+		if (!buf) {
+			buf = malloc(data->erasesize);
+			if (!buf) {
+				msg_perr("Out of memory!\n");
+				return -1;
+			}
+		}
+		if (linux_mtd_pread(data, buf, off, data->erasesize)) {
+			ret = -1;
+			break;
+		}
+
+		/* Comparing the buffer with itself shifted by one byte lets memcmp() do the vectorizing. */
+		if (buf[0] != erased_value || memcmp(buf, buf + 1, data->erasesize - 1))
+			ret = 1;
+		else
+			data->erased[eb] = true;
+	}
+
+	free(buf);
+	return ret;
+}
+
 static int linux_mtd_shutdown(void *data);
 
 static const struct opaque_master linux_mtd_opaque_master = {
@@ -311,6 +426,9 @@ static const struct opaque_master linux_mtd_opaque_master = {
 	.read		= linux_mtd_read,
 	.write		= linux_mtd_write,
 	.erase		= linux_mtd_erase,
+	.erase_queue	= linux_mtd_erase_queue,
+	.erase_flush	= linux_mtd_erase_flush,
+	.blank_check	= linux_mtd_blank_check,
 	.shutdown	= linux_mtd_shutdown,
 };
 
@@ -349,14 +467,19 @@ static int linux_mtd_setup(int dev_num, struct linux_mtd_data *data)
 	if (get_mtd_info(sysfs_path, data))
 		goto linux_mtd_setup_exit;
 
-	/* open file stream and go! */
-	if ((data->dev_fp = fopen(dev_path, "r+")) == NULL) {
-		msg_perr("Cannot open file stream for %s\n", dev_path);
+	data->erased = calloc(data->total_size / data->erasesize, sizeof(*data->erased));
+	if (!data->erased) {
+		msg_perr("Out of memory!\n");
+		goto linux_mtd_setup_exit;
+	}
+
+	/* open device and go! */
+	data->dev_fd = open(dev_path, O_RDWR | O_CLOEXEC);
+	if (data->dev_fd < 0) {
+		msg_perr("Cannot open %s: %s\n", dev_path, strerror(errno));
+		free(data->erased);
 		goto linux_mtd_setup_exit;
 	}
-	ret = setvbuf(data->dev_fp, NULL, _IONBF, 0);
-	if (ret)
-		msg_pwarn("Failed to set MTD device to unbuffered: %d\n", ret);
 
 	msg_pinfo("Opened %s successfully\n", dev_path);
 
@@ -368,9 +491,8 @@ linux_mtd_setup_exit:
 static int linux_mtd_shutdown(void *data)
 {
 	struct linux_mtd_data *mtd_data = data;
-	if (mtd_data->dev_fp != NULL) {
-		fclose(mtd_data->dev_fp);
-	}
+	close(mtd_data->dev_fd);
+	free(mtd_data->erased);
 	free(data);
 
 	return 0;
@@ -434,7 +556,7 @@ linux_mtd_init_exit:
 	return ret;
 }
 
-static void linux_mtd_nop_delay(unsigned int usecs)
+static void linux_mtd_nop_delay(struct flashprog_programmer *prog, unsigned int usecs)
 {
 	/*
 	 * Ignore delay requests. The Linux MTD framework brokers all flash
@@ -448,4 +570,5 @@ const struct programmer_entry programmer_linux_mtd = {
 	.devs.note		= "Device files /dev/mtd*\n",
 	.init			= linux_mtd_init,
 	.delay			= linux_mtd_nop_delay,
+	.multi_instance		= true,
 };
@@ -44,6 +44,17 @@
 
 #define BUF_SIZE_FROM_SYSFS	"/sys/module/spidev/parameters/bufsiz"
 
+/* Upper bound of the transfers of one command, cf. linux_spi_add_command(). */
+#define LINUX_SPI_XFERS_PER_CMD	3
+/* Transfers per SPI_IOC_MESSAGE(n), far below the limit of the ioctl's size field. */
+#define LINUX_SPI_MAX_XFERS	48
+
+/* Clock steps tried by `spispeed=auto', in Hz. */
+static const unsigned long auto_speeds[] = {
+	1000000, 2000000, 4000000, 8000000, 10000000, 16000000,
+	20000000, 25000000, 33000000, 40000000, 50000000,
+};
+
 struct linux_spi_data {
 	int fd;
 	size_t max_kernel_buf_size;
@@ -54,17 +65,22 @@ static int linux_spi_send_command(const struct flashctx *flash, unsigned int wri
 				  unsigned int readcnt,
 				  const unsigned char *txbuf,
 				  unsigned char *rxbuf);
+static int linux_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds);
+static size_t linux_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds);
+static int linux_spi_set_master_speed(const struct flashctx *flash, unsigned long hz);
 
 static const struct spi_master spi_master_linux = {
-	.features	= SPI_MASTER_4BA,
+	.features	= SPI_MASTER_4BA | SPI_MASTER_BATCH_POLL | SPI_MASTER_GATHER,
 	.max_data_read	= MAX_DATA_UNSPECIFIED,
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
 	.command	= linux_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= linux_spi_send_multicommand,
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= linux_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= linux_spi_list_speeds,
+	.set_speed	= linux_spi_set_master_speed,
 };
 
 /* Read max buffer size from sysfs, or use page size as fallback. */
@@ -108,6 +124,28 @@ out:
 	return result;
 }
 
+static int linux_spi_set_speed(const int fd, uint32_t speed_hz)
+{
+	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1) {
+		msg_perr("%s: failed to set speed to %"PRIu32"Hz: %s\n",
+			 __func__, speed_hz, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static size_t linux_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	*speeds = auto_speeds;
+	return ARRAY_SIZE(auto_speeds);
+}
+
+static int linux_spi_set_master_speed(const struct flashctx *flash, unsigned long hz)
+{
+	const struct linux_spi_data *const spi_data = flash->mst.spi->data;
+	return linux_spi_set_speed(spi_data->fd, hz);
+}
+
 static int linux_spi_init(struct flashprog_programmer *const prog)
 {
 	char *p, *endp, *dev;
@@ -115,6 +153,7 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 	/* FIXME: make the following configurable by CLI options. */
 	/* SPI mode 0 (beware this also includes: MSB first, CS active low and others */
 	const uint8_t mode = SPI_MODE_0;
+	uint32_t mode32 = mode;
 	const uint8_t bits = 8;
 	int fd;
 	size_t max_kernel_buf_size;
@@ -122,7 +161,9 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 	struct spi_master spi_master = spi_master_linux;
 
 	p = extract_programmer_param("spispeed");
-	if (p && strlen(p)) {
+	if (p && !strcmp(p, "auto")) {
+		spi_master.tune_speed = true;
+	} else if (p && strlen(p)) {
 		speed_hz = (uint32_t)strtoul(p, &endp, 10) * 1000;
 		if (p == endp || speed_hz == 0) {
 			msg_perr("%s: invalid clock: %s kHz\n", __func__, p);
@@ -136,6 +177,28 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 	}
 	free(p);
 
+	p = extract_programmer_param("iomode");
+	if (p && strlen(p)) {
+		if (!strcmp(p, "single")) {
+			/* Nothing to do. */
+		} else if (!strcmp(p, "dual")) {
+			mode32 |= SPI_TX_DUAL | SPI_RX_DUAL;
+			spi_master.features |= SPI_MASTER_DUAL;
+		} else if (!strcmp(p, "quad")) {
+			mode32 |= SPI_TX_QUAD | SPI_RX_QUAD;
+			spi_master.features |= SPI_MASTER_DUAL | SPI_MASTER_QUAD;
+		} else if (!strcmp(p, "qpi")) {
+			mode32 |= SPI_TX_QUAD | SPI_RX_QUAD;
+			spi_master.features |= SPI_MASTER_DUAL | SPI_MASTER_QUAD | SPI_MASTER_QPI;
+		} else {
+			msg_perr("%s: invalid I/O mode: %s, use `single', `dual', `quad' or `qpi'.\n",
+				 __func__, p);
+			free(p);
+			return 1;
+		}
+	}
+	free(p);
+
 	dev = extract_programmer_param("dev");
 	if (!dev || !strlen(dev)) {
 		msg_perr("No SPI device given. Use flashprog -p "
@@ -153,14 +216,16 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 	}
 	free(dev);
 
-	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1) {
-		msg_perr("%s: failed to set speed to %"PRIu32"Hz: %s\n",
-			 __func__, speed_hz, strerror(errno));
+	if (linux_spi_set_speed(fd, speed_hz))
 		goto init_err;
-	}
-	msg_pdbg("Using %"PRIu32"kHz clock\n", speed_hz / 1000);
 
-	if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
+	if (mode32 != mode) {
+		if (ioctl(fd, SPI_IOC_WR_MODE32, &mode32) == -1) {
+			msg_perr("%s: failed to set SPI mode to 0x%08"PRIx32": %s\n",
+				 __func__, mode32, strerror(errno));
+			goto init_err;
+		}
+	} else if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
 		msg_perr("%s: failed to set SPI mode to 0x%02x: %s\n",
 			 __func__, mode, strerror(errno));
 		goto init_err;
@@ -172,6 +237,12 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 		goto init_err;
 	}
 
+	/* The controller may use a lower clock than requested. */
+	if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed_hz) == -1)
+		msg_pwarn("%s: failed to read back the SPI clock: %s\n", __func__, strerror(errno));
+	msg_pdbg("Using %"PRIu32"kHz clock\n", speed_hz / 1000);
+	spi_master.clock_hz = speed_hz;
+
 	max_kernel_buf_size = get_max_kernel_buf_size();
 	msg_pdbg("%s: max_kernel_buf_size: %zu\n", __func__, max_kernel_buf_size);
 
@@ -179,6 +250,9 @@ static int linux_spi_init(struct flashprog_programmer *const prog)
 	   data. So account for longest possible command + address, too. */
 	spi_master.max_data_read = max_kernel_buf_size - 5;
 	spi_master.max_data_write = max_kernel_buf_size - 5;
+	/* Multi-I/O reads also send mode and dummy bytes after the address. */
+	if (spi_master.features & (SPI_MASTER_DUAL | SPI_MASTER_QUAD))
+		spi_master.max_data_read = max_kernel_buf_size - 32;
 
 	spi_data = calloc(1, sizeof(*spi_data));
 	if (!spi_data) {
@@ -203,48 +277,140 @@ static int linux_spi_shutdown(void *data)
 	return 0;
 }
 
-static int linux_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
-				  unsigned int readcnt,
-				  const unsigned char *txbuf,
-				  unsigned char *rxbuf)
+/*
+ * Add the transfers of one command to `xfers`. Returns the number of
+ * transfers added or a negative SPI error code.
+ */
+static int linux_spi_add_command(struct spi_ioc_transfer *const xfers, const struct spi_command *const cmd)
 {
-	struct linux_spi_data *spi_data = flash->mst.spi->data;
-	int iocontrol_code;
-	struct spi_ioc_transfer msg[2] = {
-		{
-			.tx_buf = (uint64_t)(uintptr_t)txbuf,
-			.len = writecnt,
-		},
-		{
-			.rx_buf = (uint64_t)(uintptr_t)rxbuf,
-			.len = readcnt,
-		},
-	};
+	const unsigned int nbits = cmd->io_mode == QPI_4_4_4 ? 4 : 0;
+	int n = 0;
+
+	if (cmd->io_mode != SINGLE_IO_1_1_1 && cmd->io_mode != QPI_4_4_4) {
+		/* We expect at least an opcode and an address here. */
+		if (cmd->writecnt < 2 || cmd->readcnt == 0)
+			return SPI_INVALID_LENGTH;
+
+		memset(xfers, 0, 3 * sizeof(*xfers));
+		xfers[0].tx_buf = (uint64_t)(uintptr_t)cmd->writearr;
+		xfers[0].len = 1;
+		xfers[0].tx_nbits = 1;
+		xfers[1].tx_buf = (uint64_t)(uintptr_t)(cmd->writearr + 1);
+		xfers[1].len = cmd->writecnt - 1;
+		xfers[1].tx_nbits = spi_addr_lines(cmd->io_mode);
+		xfers[2].rx_buf = (uint64_t)(uintptr_t)cmd->readarr;
+		xfers[2].len = cmd->readcnt;
+		xfers[2].rx_nbits = spi_data_lines(cmd->io_mode);
+		return 3;
+	}
 
-	if (spi_data->fd == -1)
-		return -1;
 	/* The implementation currently does not support requests that
 	   don't start with sending a command. */
-	if (writecnt == 0)
+	if (cmd->writecnt == 0)
 		return SPI_INVALID_LENGTH;
 
-	/* Just submit the first (write) request in case there is nothing
-	   to read. Otherwise submit both requests. */
-	if (readcnt == 0)
-		iocontrol_code = SPI_IOC_MESSAGE(1);
-	else
-		iocontrol_code = SPI_IOC_MESSAGE(2);
+	/* In QPI mode, everything goes over four lines. */
+	memset(&xfers[n], 0, sizeof(*xfers));
+	xfers[n].tx_buf = (uint64_t)(uintptr_t)cmd->writearr;
+	xfers[n].len = cmd->writecnt;
+	xfers[n].tx_nbits = nbits;
+	++n;
+
+	if (cmd->datacnt) {
+		memset(&xfers[n], 0, sizeof(*xfers));
+		xfers[n].tx_buf = (uint64_t)(uintptr_t)cmd->dataarr;
+		xfers[n].len = cmd->datacnt;
+		xfers[n].tx_nbits = nbits;
+		++n;
+	}
+
+	if (cmd->readcnt) {
+		memset(&xfers[n], 0, sizeof(*xfers));
+		xfers[n].rx_buf = (uint64_t)(uintptr_t)cmd->readarr;
+		xfers[n].len = cmd->readcnt;
+		xfers[n].rx_nbits = nbits;
+		++n;
+	}
+	return n;
+}
 
-	if (ioctl(spi_data->fd, iocontrol_code, msg) == -1) {
+static int linux_spi_send_message(const struct linux_spi_data *spi_data, struct spi_ioc_transfer *xfers,
+				  const unsigned int n)
+{
+	/* No CS# toggling after the last command, that would keep it asserted. */
+	xfers[n - 1].cs_change = 0;
+
+	if (ioctl(spi_data->fd, SPI_IOC_MESSAGE(n), xfers) == -1) {
 		msg_cerr("%s: ioctl: %s\n", __func__, strerror(errno));
 		return -1;
 	}
 	return 0;
 }
 
+/*
+ * Send as many commands as possible with a single SPI_IOC_MESSAGE(n).
+ * The transfers of consecutive commands are separated by `cs_change`,
+ * which toggles CS# between them. All transfers of a message have to
+ * fit into spidev's buffer.
+ */
+static int linux_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	struct linux_spi_data *spi_data = flash->mst.spi->data;
+	struct spi_ioc_transfer xfers[LINUX_SPI_MAX_XFERS];
+	unsigned int n = 0;
+	size_t total = 0;
+
+	if (spi_data->fd == -1)
+		return -1;
+
+	for (; cmds->writecnt || cmds->readcnt; cmds++) {
+		const size_t len = cmds->writecnt + cmds->datacnt + cmds->readcnt;
+
+		if (n && (n + LINUX_SPI_XFERS_PER_CMD > ARRAY_SIZE(xfers) ||
+			  total + len > spi_data->max_kernel_buf_size)) {
+			if (linux_spi_send_message(spi_data, xfers, n))
+				return -1;
+			n = 0;
+			total = 0;
+		}
+
+		const int ret = linux_spi_add_command(xfers + n, cmds);
+		if (ret < 0) {
+			/* Send what's queued, like individual commands would have been. */
+			if (n && linux_spi_send_message(spi_data, xfers, n))
+				return -1;
+			return ret;
+		}
+		n += ret;
+		total += len;
+		xfers[n - 1].cs_change = 1;
+	}
+
+	return n ? linux_spi_send_message(spi_data, xfers, n) : 0;
+}
+
+static int linux_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
+				  unsigned int readcnt,
+				  const unsigned char *txbuf,
+				  unsigned char *rxbuf)
+{
+	struct spi_command cmds[] = {
+	{
+		.writecnt	= writecnt,
+		.writearr	= txbuf,
+		.readcnt	= readcnt,
+		.readarr	= rxbuf,
+	},
+		NULL_SPI_CMD,
+	};
+
+	return linux_spi_send_multicommand(flash, cmds);
+}
+
 const struct programmer_entry programmer_linux_spi = {
 	.name			= "linux_spi",
 	.type			= OTHER,
 	.devs.note		= "Device files /dev/spidev*.*\n",
 	.init			= linux_spi_init,
+	.multi_instance		= true,
 };
@@ -86,11 +86,39 @@ static int mcp6x_bitbang_get_miso(void *spi_data)
 	return (mcp_gpiostate >> MCP6X_SPI_MISO) & 0x1;
 }
 
+/*
+ * Shift whole buffers with one posted write per clock edge, SCK and MOSI
+ * change together. Only the reads that sample MISO wait for the writes.
+ */
+static void mcp6x_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			mcp_gpiostate &= ~(1 << MCP6X_SPI_SCK | 1 << MCP6X_SPI_MOSI);
+			mcp_gpiostate |= ((val >> bit) & 1) << MCP6X_SPI_MOSI;
+			mmio_writeb(mcp_gpiostate, mcp6x_spibar + 0x530);
+			mcp_gpiostate |= 1 << MCP6X_SPI_SCK;
+			mmio_writeb(mcp_gpiostate, mcp6x_spibar + 0x530);
+			if (in)
+				miso = miso << 1 | mcp6x_bitbang_get_miso(spi_data);
+		}
+		if (in)
+			in[i] = miso;
+	}
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_mcp6x = {
 	.set_cs		= mcp6x_bitbang_set_cs,
 	.set_sck	= mcp6x_bitbang_set_sck,
 	.set_mosi	= mcp6x_bitbang_set_mosi,
 	.get_miso	= mcp6x_bitbang_get_miso,
+	.shift_bytes	= mcp6x_bitbang_shift_bytes,
 	.request_bus	= mcp6x_request_spibus,
 	.release_bus	= mcp6x_release_spibus,
 	.half_period	= 0,
@@ -26,6 +26,7 @@
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 
@@ -148,79 +149,190 @@ out:
 	return ret;
 }
 
+/* i2c-dev rejects longer messages. */
+#define MSTARDDC_MAX_MSG_LEN	8192
+
+/* Length of the read messages of mstarddc_spi_read(), halved while the adapter rejects it. */
+static unsigned int mstarddc_read_len = MSTARDDC_MAX_MSG_LEN;
+
+static uint8_t mstarddc_read_cmd = MSTARDDC_SPI_READ;
+static uint8_t mstarddc_end_cmd = MSTARDDC_SPI_END;
+
+/*
+ * Messages of multiple SPI commands, sent in a single I2C_RDWR ioctl.
+ * Each SPI command is a write message with MSTARDDC_SPI_WRITE, a read
+ * command followed by the read message itself, and MSTARDDC_SPI_END.
+ */
+struct mstarddc_batch {
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned int count;
+};
+
+static void mstarddc_add_msg(struct mstarddc_batch *batch, uint8_t *buf, unsigned int len, uint16_t flags)
+{
+	batch->msgs[batch->count++] = (struct i2c_msg){
+		.addr	= mstarddc_addr,
+		.flags	= flags,
+		.len	= len,
+		.buf	= buf,
+	};
+}
+
 /* Returns 0 upon success, a negative number upon errors. */
-static int mstarddc_spi_send_command(const struct flashctx *flash,
-				     unsigned int writecnt,
-				     unsigned int readcnt,
-				     const unsigned char *writearr,
-				     unsigned char *readarr)
+static int mstarddc_flush(struct mstarddc_batch *batch)
 {
+	struct i2c_rdwr_ioctl_data i2c_data = {
+		.msgs	= batch->msgs,
+		.nmsgs	= batch->count,
+	};
+
+	if (!batch->count)
+		return 0;
+	batch->count = 0;
+	if (ioctl(mstarddc_fd, I2C_RDWR, &i2c_data) < 0)
+		return -1;
+	return 0;
+}
+
+/* Returns 0 upon success, a negative number upon errors. */
+static int mstarddc_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	struct mstarddc_batch batch = { .count = 0 };
+	struct spi_command *cmd;
+	size_t buf_len = 0, pos = 0;
 	int ret = 0;
-	uint8_t *cmd = malloc((writecnt + 1) * sizeof(uint8_t));
-	if (cmd == NULL) {
-		msg_perr("Error allocating memory: errno %d.\n", errno);
-		ret = -1;
-	}
 
-	if (!ret && writecnt) {
-		cmd[0] = MSTARDDC_SPI_WRITE;
-		memcpy(cmd + 1, writearr, writecnt);
-		if (write(mstarddc_fd, cmd, writecnt + 1) < 0) {
-			msg_perr("Error sending write command: errno %d.\n",
-				 errno);
-			ret = -1;
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; ++cmd) {
+		if (cmd->io_mode != SINGLE_IO_1_1_1) {
+			msg_perr("%s called with multi-I/O command.\n"
+				 "Please report a bug at flashprog@flashprog.org\n", __func__);
+			return SPI_FLASHPROG_BUG;
 		}
+		buf_len += cmd->writecnt + 1;
 	}
 
-	if (!ret && readcnt) {
-		struct i2c_rdwr_ioctl_data i2c_data;
-		struct i2c_msg msg[2];
-
-		cmd[0] = MSTARDDC_SPI_READ;
-		i2c_data.nmsgs = 2;
-		i2c_data.msgs = msg;
-		i2c_data.msgs[0].addr = mstarddc_addr;
-		i2c_data.msgs[0].len = 1;
-		i2c_data.msgs[0].flags = 0;
-		i2c_data.msgs[0].buf = cmd;
-		i2c_data.msgs[1].addr = mstarddc_addr;
-		i2c_data.msgs[1].len = readcnt;
-		i2c_data.msgs[1].flags = I2C_M_RD;
-		i2c_data.msgs[1].buf = readarr;
-
-		if (ioctl(mstarddc_fd, I2C_RDWR, &i2c_data) < 0) {
-			msg_perr("Error sending read command: errno %d.\n",
-				 errno);
-			ret = -1;
-		}
+	/* The write messages need the MSTARDDC_SPI_WRITE prefix. */
+	uint8_t *const buf = malloc(buf_len);
+	if (!buf) {
+		msg_perr("Error allocating memory: errno %d.\n", errno);
+		return -1;
 	}
 
-	if (!ret && (writecnt || readcnt)) {
-		cmd[0] = MSTARDDC_SPI_END;
-		if (write(mstarddc_fd, cmd, 1) < 0) {
-			msg_perr("Error sending end command: errno %d.\n",
-				 errno);
-			ret = -1;
+	for (cmd = cmds; !ret && (cmd->writecnt || cmd->readcnt); ++cmd) {
+		if (batch.count + 4 > I2C_RDWR_IOCTL_MAX_MSGS)
+			ret = mstarddc_flush(&batch);
+		if (cmd->writecnt) {
+			buf[pos] = MSTARDDC_SPI_WRITE;
+			memcpy(buf + pos + 1, cmd->writearr, cmd->writecnt);
+			mstarddc_add_msg(&batch, buf + pos, cmd->writecnt + 1, 0);
+			pos += cmd->writecnt + 1;
+		}
+		if (cmd->readcnt) {
+			mstarddc_add_msg(&batch, &mstarddc_read_cmd, 1, 0);
+			mstarddc_add_msg(&batch, cmd->readarr, cmd->readcnt, I2C_M_RD);
 		}
+		mstarddc_add_msg(&batch, &mstarddc_end_cmd, 1, 0);
 	}
+	if (!ret)
+		ret = mstarddc_flush(&batch);
+	if (ret)
+		msg_perr("Error sending SPI commands: errno %d.\n", errno);
 
 	/* Do not reset if something went wrong, as it might prevent from
 	 * retrying flashing. */
 	if (ret != 0)
 		mstarddc_doreset = 0;
 
-	if (cmd)
-		free(cmd);
-
+	free(buf);
 	return ret;
 }
 
+/* Returns 0 upon success, a negative number upon errors. */
+static int mstarddc_spi_send_command(const struct flashctx *flash,
+				     unsigned int writecnt,
+				     unsigned int readcnt,
+				     const unsigned char *writearr,
+				     unsigned char *readarr)
+{
+	struct spi_command cmds[] = {
+		{
+			.writecnt	= writecnt,
+			.writearr	= writearr,
+			.readcnt	= readcnt,
+			.readarr	= readarr,
+		},
+		NULL_SPI_CMD,
+	};
+
+	return mstarddc_spi_send_multicommand(flash, cmds);
+}
+
+/*
+ * Stream reads with as few ioctls as possible: a single READ command
+ * is followed by as many read messages as fit into one I2C_RDWR. The
+ * device keeps the SPI transaction running until MSTARDDC_SPI_END.
+ * Adapters may reject long messages, then their length is halved.
+ */
+static int mstarddc_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	/* One message for the SPI command, pairs of read command and data, and one for the end. */
+	const unsigned int max_pairs = (I2C_RDWR_IOCTL_MAX_MSGS - 2) / 2;
+	struct mstarddc_batch batch = { .count = 0 };
+	uint8_t cmd[1 + 1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+
+	cmd[0] = MSTARDDC_SPI_WRITE;
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd + 1, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	while (done < len) {
+		const unsigned int read_len = mstarddc_read_len;
+		const unsigned int addr = start + done;
+		unsigned int block = 0, p;
+
+		if (flashprog_cancelled(flash))
+			return 1;
+
+		if (spi_prepare_read_cmd(flash, cmd + 1, addr, len - done) != cmdlen)
+			return 1;
+		mstarddc_add_msg(&batch, cmd, 1 + cmdlen, 0);
+		for (p = 0; p < max_pairs && done + block < len; ++p) {
+			const unsigned int chunk = min(read_len, len - done - block);
+			mstarddc_add_msg(&batch, &mstarddc_read_cmd, 1, 0);
+			mstarddc_add_msg(&batch, buf + done + block, chunk, I2C_M_RD);
+			block += chunk;
+		}
+		mstarddc_add_msg(&batch, &mstarddc_end_cmd, 1, 0);
+
+		if (mstarddc_flush(&batch)) {
+			/* Length limits are checked before anything is sent. */
+			if ((errno == EINVAL || errno == EOPNOTSUPP) &&
+			    read_len / 2 >= flash->mst.spi->max_data_read) {
+				mstarddc_read_len = read_len / 2;
+				msg_pdbg("Adapter rejected %u byte reads, retrying with %u.\n",
+					 read_len, mstarddc_read_len);
+				continue;
+			}
+			msg_perr("Error sending read command: errno %d.\n", errno);
+			mstarddc_doreset = 0;
+			return -1;
+		}
+		flashprog_progress_add(flash, block);
+		done += block;
+	}
+
+	return 0;
+}
+
 static const struct spi_master spi_master_mstarddc = {
 	.max_data_read	= 256,
 	.max_data_write	= 256,
 	.command	= mstarddc_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.multicommand	= mstarddc_spi_send_multicommand,
+	.read		= mstarddc_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= mstarddc_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
@@ -24,11 +24,16 @@
 #include <unistd.h>
 
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 
 #define NI845x_FIND_DEVICE_NO_DEVICE_FOUND			-301701
 
+/* SPI commands per script run, and the length of each read of ni845x_spi_read(). */
+#define NI845X_SCRIPT_COMMANDS	64
+#define NI845X_READ_CHUNK	(64 * 1024)
+
 enum USB845x_type {
 	USB8451 = 0x7166,
 	USB8452 = 0x7514,
@@ -47,6 +52,8 @@ static enum USB845x_type device_pid = Unknown_NI845X_Device;
 
 static uInt32 device_handle;
 static NiHandle configuration_handle;
+static NiHandle script_handle;
+static uInt16 clock_rate_KHz;
 static uint16_t io_voltage_in_mV;
 static bool ignore_io_voltage_limits;
 
@@ -329,6 +336,7 @@ static int ni845x_spi_set_speed(uint16_t SCK_freq_in_KHz)
 	} else {
 		msg_pinfo("SPI clock frequency set to: %d KHz\n", (int)SCK_freq_in_KHz);
 	}
+	clock_rate_KHz = clock_freq_read_KHz;
 	return 0;
 }
 
@@ -465,6 +473,20 @@ int ni845x_spi_init(struct flashprog_programmer *const prog)
 		return 1;
 	}
 
+	tmp = ni845xSpiConfigurationSetChipSelect(configuration_handle, CS_number);
+	if (tmp != 0) {
+		ni845x_report_error("ni845xSpiConfigurationSetChipSelect", tmp);
+		ni845x_spi_shutdown(NULL);
+		return 1;
+	}
+
+	tmp = ni845xSpiScriptOpen(&script_handle);
+	if (tmp != 0) {
+		ni845x_report_error("ni845xSpiScriptOpen", tmp);
+		ni845x_spi_shutdown(NULL);
+		return 1;
+	}
+
 	if (usb8452_spi_set_io_voltage(requested_io_voltage_mV, &io_voltage_in_mV, USE_LOWER) < 0) {
 		ni845x_spi_shutdown(NULL);
 		return 1;	// no alert here usb8452_spi_set_io_voltage already printed that
@@ -483,6 +505,12 @@ static int ni845x_spi_shutdown(void *data)
 {
 	int32 ret = 0;
 
+	if (script_handle != 0) {
+		ret = ni845xSpiScriptClose(script_handle);
+		if (ret)
+			ni845x_report_error("ni845xSpiScriptClose", ret);
+	}
+
 	if (configuration_handle != 0) {
 		ret = ni845xSpiConfigurationClose(configuration_handle);
 		if (ret)
@@ -624,12 +652,186 @@ static int ni845x_spi_transmit(const struct flashctx *flash,
 	return 0;
 }
 
+/*
+ * Start a new script with the same settings as the configuration
+ * that ni845x_spi_transmit() uses.
+ */
+static int ni845x_script_start(void)
+{
+	int32 ret;
+
+	if ((ret = ni845xSpiScriptReset(script_handle)) < 0) {
+		ni845x_report_error("ni845xSpiScriptReset", ret);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptEnableSPI(script_handle)) < 0) {
+		ni845x_report_error("ni845xSpiScriptEnableSPI", ret);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptClockRate(script_handle, clock_rate_KHz)) < 0) {
+		ni845x_report_error("ni845xSpiScriptClockRate", ret);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptClockPolarityPhase(script_handle, kNI845xSpiClockPolarityIdleLow,
+						     kNI845xSpiClockPhaseFirstEdge)) < 0) {
+		ni845x_report_error("ni845xSpiScriptClockPolarityPhase", ret);
+		return -1;
+	}
+	return 0;
+}
+
+static int ni845x_script_add(uInt32 size, uInt8 *data, uInt32 *read_index)
+{
+	int32 ret;
+
+	if ((ret = ni845xSpiScriptCSLow(script_handle, CS_number)) < 0) {
+		ni845x_report_error("ni845xSpiScriptCSLow", ret);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptWriteRead(script_handle, size, data, read_index)) < 0) {
+		ni845x_report_error("ni845xSpiScriptWriteRead", ret);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptCSHigh(script_handle, CS_number)) < 0) {
+		ni845x_report_error("ni845xSpiScriptCSHigh", ret);
+		return -1;
+	}
+	return 0;
+}
+
+/* Extract the `read_cnt` bytes following `write_cnt` from the read at `read_index` of the last run. */
+static int ni845x_script_extract(uInt32 read_index, unsigned int write_cnt, unsigned int read_cnt,
+				 uInt8 *transfer_buffer, unsigned char *read_arr)
+{
+	uInt32 read_size = 0;
+	int32 ret;
+
+	if ((ret = ni845xSpiScriptExtractReadDataSize(script_handle, read_index, &read_size)) < 0) {
+		ni845x_report_error("ni845xSpiScriptExtractReadDataSize", ret);
+		return -1;
+	}
+	if (read_size != write_cnt + read_cnt) {
+		msg_perr("%s: expected and returned read count mismatch: %u expected, %ld received\n",
+			 __func__, read_cnt, read_size);
+		return -1;
+	}
+	if ((ret = ni845xSpiScriptExtractReadData(script_handle, read_index, transfer_buffer)) < 0) {
+		ni845x_report_error("ni845xSpiScriptExtractReadData", ret);
+		return -1;
+	}
+	memcpy(read_arr, transfer_buffer + write_cnt, read_cnt);
+	return 0;
+}
+
+/*
+ * Run the commands as scripts of up to NI845X_SCRIPT_COMMANDS each, so
+ * a whole sequence like WREN + PAGE PROGRAM takes a single USB round
+ * trip instead of one per command.
+ */
+static int ni845x_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	uInt32 read_index[NI845X_SCRIPT_COMMANDS];
+	uInt8 *transfer_buffer[NI845X_SCRIPT_COMMANDS];
+	unsigned int count, i;
+	int32 ret;
+	int result = 0;
+
+	if (ni845x_spi_io_voltage_check(flash))
+		return -1;
+
+	while (!result && (cmds->writecnt || cmds->readcnt)) {
+		for (count = 0; count < NI845X_SCRIPT_COMMANDS; ++count) {
+			if (!cmds[count].writecnt && !cmds[count].readcnt)
+				break;
+		}
+
+		if (ni845x_script_start())
+			return -1;
+
+		/* The scripts only run when they're complete, keep all buffers until then. */
+		for (i = 0; i < count; ++i) {
+			const unsigned int size = cmds[i].writecnt + cmds[i].readcnt;
+			transfer_buffer[i] = calloc(size, sizeof(uInt8));
+			if (transfer_buffer[i] == NULL) {
+				msg_gerr("Memory allocation failed!\n");
+				result = -1;
+				break;
+			}
+			memcpy(transfer_buffer[i], cmds[i].writearr, cmds[i].writecnt);
+			if (ni845x_script_add(size, transfer_buffer[i], &read_index[i])) {
+				free(transfer_buffer[i]);
+				result = -1;
+				break;
+			}
+		}
+		count = i;
+
+		if (!result) {
+			ret = ni845xSpiScriptRun(script_handle, device_handle, 0);
+			if (ret < 0) {
+				ni845x_report_error("ni845xSpiScriptRun", ret);
+				result = -1;
+			} else if (ret > 0) {
+				ni845x_report_warning("ni845xSpiScriptRun", ret);
+			}
+		}
+
+		for (i = 0; i < count; ++i) {
+			if (!result && cmds[i].readcnt && cmds[i].readarr)
+				result = ni845x_script_extract(read_index[i], cmds[i].writecnt,
+							       cmds[i].readcnt, transfer_buffer[i],
+							       cmds[i].readarr);
+			free(transfer_buffer[i]);
+		}
+		cmds += count;
+	}
+	return result;
+}
+
+/* Read in chunks of NI845X_READ_CHUNK, each a single script run. */
+static int ni845x_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	unsigned char cmd[1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	while (done < len) {
+		const unsigned int addr = start + done;
+		const unsigned int chunk = min(NI845X_READ_CHUNK, len - done);
+		struct spi_command cmds[] = {
+			{
+				.writecnt	= cmdlen,
+				.writearr	= cmd,
+				.readcnt	= chunk,
+				.readarr	= buf + done,
+			},
+			NULL_SPI_CMD,
+		};
+
+		if (flashprog_cancelled(flash))
+			return 1;
+
+		if (spi_prepare_read_cmd(flash, cmd, addr, chunk) != cmdlen)
+			return 1;
+		if (ni845x_spi_send_multicommand(flash, cmds))
+			return 1;
+		flashprog_progress_add(flash, chunk);
+		done += chunk;
+	}
+	return 0;
+}
+
 static const struct spi_master spi_programmer_ni845x = {
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= ni845x_spi_transmit,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.multicommand	= ni845x_spi_send_multicommand,
+	.read		= ni845x_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= ni845x_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
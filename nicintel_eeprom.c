@@ -205,7 +205,7 @@ static int nicintel_ee_write_word_i210(unsigned int addr, uint16_t data)
 	eewr |= BIT(EEWR_CMDV);
 	pci_mmio_writel(eewr, nicintel_eebar + EEWR);
 
-	programmer_delay(5);
+	programmer_delay(NULL, 5);
 	int i;
 	for (i = 0; i < MAX_ATTEMPTS; i++)
 		if (pci_mmio_readl(nicintel_eebar + EEWR) & BIT(EEWR_DONE))
@@ -333,7 +333,7 @@ static int nicintel_ee_ready(void)
 		nicintel_ee_bitbang(0x00, &rdsr);
 
 		nicintel_ee_bitset(EEC, EE_CS, 1);
-		programmer_delay(1);
+		programmer_delay(NULL, 1);
 		if (!(rdsr & SPI_SR_WIP)) {
 			return 0;
 		}
@@ -371,7 +371,7 @@ static int nicintel_ee_write_82580(struct flashctx *flash, const uint8_t *buf, u
 		nicintel_ee_bitset(EEC, EE_CS, 0);
 		nicintel_ee_bitbang(JEDEC_WREN, NULL);
 		nicintel_ee_bitset(EEC, EE_CS, 1);
-		programmer_delay(1);
+		programmer_delay(flash, 1);
 
 		/* data */
 		nicintel_ee_bitset(EEC, EE_CS, 0);
@@ -388,7 +388,7 @@ static int nicintel_ee_write_82580(struct flashctx *flash, const uint8_t *buf, u
 				break;
 		}
 		nicintel_ee_bitset(EEC, EE_CS, 1);
-		programmer_delay(1);
+		programmer_delay(flash, 1);
 		if (nicintel_ee_ready())
 			goto out;
 	}
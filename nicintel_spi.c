@@ -70,6 +70,9 @@
 #define FL_LOCKED  6
 #define FL_ABORT   7
 #define FL_CLR_ERR 8
+
+/* Length of half a clock period in usecs. */
+#define NICINTEL_HALF_PERIOD	1
 /* Currently unused */
 // #define FL_BUSY	30
 // #define FL_ER	31
@@ -189,6 +192,37 @@ static int nicintel_bitbang_set_sck_get_miso(int sck, void *spi_data)
 	return (tmp >> FL_SO) & 0x1;
 }
 
+/*
+ * Shift whole buffers. FLA is only read once, the writes are posted
+ * and only the reads that sample SO wait for them. SO is sampled while
+ * SCK is low, like in nicintel_bitbang_set_sck_get_miso().
+ */
+static void nicintel_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	uint32_t tmp = pci_mmio_readl(nicintel_spibar + FLA) & ~(BIT(FL_SCK) | BIT(FL_SI));
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			tmp &= ~(BIT(FL_SCK) | BIT(FL_SI));
+			tmp |= ((val >> bit) & 1) << FL_SI;
+			pci_mmio_writel(tmp, nicintel_spibar + FLA);
+			programmer_delay(NULL, NICINTEL_HALF_PERIOD);
+			if (in)
+				miso = miso << 1 | ((pci_mmio_readl(nicintel_spibar + FLA) >> FL_SO) & 0x1);
+			tmp |= BIT(FL_SCK);
+			pci_mmio_writel(tmp, nicintel_spibar + FLA);
+			programmer_delay(NULL, NICINTEL_HALF_PERIOD);
+		}
+		if (in)
+			in[i] = miso;
+	}
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_nicintel = {
 	.set_cs			= nicintel_bitbang_set_cs,
 	.set_sck		= nicintel_bitbang_set_sck,
@@ -198,7 +232,8 @@ static const struct bitbang_spi_master bitbang_spi_master_nicintel = {
 	.get_miso		= nicintel_bitbang_get_miso,
 	.request_bus		= nicintel_request_spibus,
 	.release_bus		= nicintel_release_spibus,
-	.half_period		= 1,
+	.shift_bytes		= nicintel_bitbang_shift_bytes,
+	.half_period		= NICINTEL_HALF_PERIOD,
 };
 
 static int nicintel_spi_shutdown(void *data)
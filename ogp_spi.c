@@ -83,11 +83,43 @@ static int ogp_bitbang_get_miso(void *spi_data)
 	return tmp & 0x1;
 }
 
+/*
+ * Shift whole buffers. SI and SCK are separate registers, so MOSI is
+ * only written when it changes. The writes are posted, only the reads
+ * that sample SO wait for them.
+ */
+static void ogp_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	int mosi = -1; /* unknown */
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			const int next = (val >> bit) & 1;
+
+			pci_mmio_writel(0, ogp_spibar + ogp_reg_sck);
+			if (next != mosi)
+				pci_mmio_writel(next, ogp_spibar + ogp_reg_siso);
+			mosi = next;
+			pci_mmio_writel(1, ogp_spibar + ogp_reg_sck);
+			if (in)
+				miso = miso << 1 | ogp_bitbang_get_miso(spi_data);
+		}
+		if (in)
+			in[i] = miso;
+	}
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_ogp = {
 	.set_cs		= ogp_bitbang_set_cs,
 	.set_sck	= ogp_bitbang_set_sck,
 	.set_mosi	= ogp_bitbang_set_mosi,
 	.get_miso	= ogp_bitbang_get_miso,
+	.shift_bytes	= ogp_bitbang_shift_bytes,
 	.request_bus	= ogp_request_spibus,
 	.release_bus	= ogp_release_spibus,
 	.half_period	= 0,
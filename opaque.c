@@ -46,6 +46,21 @@ int erase_opaque(struct flashctx *flash, unsigned int blockaddr, unsigned int bl
 	return flash->mst.opaque->erase(flash, blockaddr, blocklen);
 }
 
+bool opaque_can_queue_erase(const struct flashctx *flash)
+{
+	return flash->chip->bustype == BUS_PROG && flash->mst.opaque->erase_queue;
+}
+
+int erase_queue_opaque(struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen)
+{
+	return flash->mst.opaque->erase_queue(flash, blockaddr, blocklen);
+}
+
+int erase_flush_opaque(struct flashctx *flash)
+{
+	return flash->mst.opaque->erase_flush(flash);
+}
+
 int register_opaque_master(const struct opaque_master *mst, void *data)
 {
 	struct registered_master rmst;
@@ -57,7 +72,8 @@ int register_opaque_master(const struct opaque_master *mst, void *data)
 		}
 	}
 
-	if (!mst->probe || !mst->read || !mst->write || !mst->erase) {
+	if (!mst->probe || !mst->read || !mst->write || !mst->erase ||
+	    !mst->erase_queue != !mst->erase_flush) {
 		msg_perr("%s called with incomplete master definition.\n"
 			 "Please report a bug at flashprog@flashprog.org\n",
 			 __func__);
@@ -23,6 +23,24 @@
 
 struct pci_access *pacc;
 
+/*
+ * Index of the devices in `pacc`, sorted by PCI ID and then by their
+ * position in the device list. Built on the first lookup, as the list
+ * doesn't change after pci_scan_bus(). Subsystem IDs are read from the
+ * config space only when a lookup asks for them.
+ */
+struct pcidev_index_entry {
+	struct pci_dev *dev;
+	size_t position;
+	uint16_t vendor_id;
+	uint16_t device_id;
+	bool have_card_ids;
+	uint16_t card_vendor;
+	uint16_t card_device;
+};
+static struct pcidev_index_entry *pcidev_index;
+static size_t pcidev_index_len;
+
 enum pci_bartype {
 	TYPE_MEMBAR,
 	TYPE_IOBAR,
@@ -160,20 +178,83 @@ struct pci_dev *pcidev_scandev(struct pci_filter *filter, struct pci_dev *start)
 	return NULL;
 }
 
+static int pcidev_index_cmp(const void *const a, const void *const b)
+{
+	const struct pcidev_index_entry *const ea = a, *const eb = b;
+
+	if (ea->vendor_id != eb->vendor_id)
+		return ea->vendor_id < eb->vendor_id ? -1 : 1;
+	if (ea->device_id != eb->device_id)
+		return ea->device_id < eb->device_id ? -1 : 1;
+	return ea->position < eb->position ? -1 : ea->position > eb->position;
+}
+
+static int pcidev_index_build(void)
+{
+	struct pci_dev *dev;
+	size_t i;
+
+	if (pcidev_index)
+		return 0;
+
+	for (pcidev_index_len = 0, dev = pacc->devices; dev; dev = dev->next)
+		++pcidev_index_len;
+
+	pcidev_index = calloc(pcidev_index_len + 1, sizeof(*pcidev_index));
+	if (!pcidev_index) {
+		msg_perr("Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0, dev = pacc->devices; dev; dev = dev->next, ++i) {
+		pci_fill_info(dev, PCI_FILL_IDENT);
+		pcidev_index[i].dev		= dev;
+		pcidev_index[i].position	= i;
+		pcidev_index[i].vendor_id	= dev->vendor_id;
+		pcidev_index[i].device_id	= dev->device_id;
+	}
+	qsort(pcidev_index, pcidev_index_len, sizeof(*pcidev_index), pcidev_index_cmp);
+	return 0;
+}
+
+/* Returns the first index entry of the devices with the given ID, or NULL. */
+static struct pcidev_index_entry *pcidev_index_find(uint16_t vendor, uint16_t device)
+{
+	size_t lo = 0, hi = pcidev_index_len;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (pcidev_index[mid].vendor_id < vendor ||
+		    (pcidev_index[mid].vendor_id == vendor && pcidev_index[mid].device_id < device))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == pcidev_index_len ||
+	    pcidev_index[lo].vendor_id != vendor || pcidev_index[lo].device_id != device)
+		return NULL;
+	return &pcidev_index[lo];
+}
+
 struct pci_dev *pcidev_card_find(uint16_t vendor, uint16_t device,
 				 uint16_t card_vendor, uint16_t card_device)
 {
-	struct pci_dev *temp = NULL;
-	struct pci_filter filter;
+	struct pcidev_index_entry *entry;
 
-	pci_filter_init(NULL, &filter);
-	filter.vendor = vendor;
-	filter.device = device;
+	if (pcidev_index_build())
+		return NULL;
 
-	while ((temp = pcidev_scandev(&filter, temp))) {
-		if ((card_vendor == pci_read_word(temp, PCI_SUBSYSTEM_VENDOR_ID))
-		    && (card_device == pci_read_word(temp, PCI_SUBSYSTEM_ID)))
-			return temp;
+	entry = pcidev_index_find(vendor, device);
+	for (; entry && entry < pcidev_index + pcidev_index_len; ++entry) {
+		if (entry->vendor_id != vendor || entry->device_id != device)
+			break;
+		if (!entry->have_card_ids) {
+			entry->card_vendor = pci_read_word(entry->dev, PCI_SUBSYSTEM_VENDOR_ID);
+			entry->card_device = pci_read_word(entry->dev, PCI_SUBSYSTEM_ID);
+			entry->have_card_ids = true;
+		}
+		if (entry->card_vendor == card_vendor && entry->card_device == card_device)
+			return entry->dev;
 	}
 
 	return NULL;
@@ -181,13 +262,13 @@ struct pci_dev *pcidev_card_find(uint16_t vendor, uint16_t device,
 
 struct pci_dev *pcidev_find(uint16_t vendor, uint16_t device)
 {
-	struct pci_filter filter;
+	const struct pcidev_index_entry *entry;
 
-	pci_filter_init(NULL, &filter);
-	filter.vendor = vendor;
-	filter.device = device;
+	if (pcidev_index_build())
+		return NULL;
 
-	return pcidev_scandev(&filter, NULL);
+	entry = pcidev_index_find(vendor, device);
+	return entry ? entry->dev : NULL;
 }
 
 struct pci_dev *pcidev_find_vendorclass(uint16_t vendor, uint16_t devclass)
@@ -217,6 +298,9 @@ static int pcidev_shutdown(void *data)
 			 __func__);
 		return 1;
 	}
+	free(pcidev_index);
+	pcidev_index = NULL;
+	pcidev_index_len = 0;
 	pci_cleanup(pacc);
 	pacc = NULL;
 	return 0;
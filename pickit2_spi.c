@@ -50,10 +50,6 @@ static const struct dev_entry devs_pickit2_spi[] = {
 	{0}
 };
 
-struct pickit2_spi_data {
-	libusb_device_handle *pickit2_handle;
-};
-
 /* Default USB transaction timeout in ms */
 #define DFLT_TIMEOUT            10000
 
@@ -89,10 +85,55 @@ struct pickit2_spi_data {
 #define SCR_VDD_OFF             0xFE
 #define SCR_VDD_ON              0xFF
 
+/* Data bytes per CMD_UPLOAD_DATA reply, the first byte of a reply is the length. */
+#define PICKIT2_UPLOAD_LEN	63
+/* The firmware's upload buffer, a script must not read more before it is uploaded. */
+#define PICKIT2_UPLOAD_BUFFER	128
+/* Bytes read by one report: as many whole replies as fit into the upload buffer. */
+#define PICKIT2_REPORT_READ	(PICKIT2_UPLOAD_BUFFER / PICKIT2_UPLOAD_LEN * PICKIT2_UPLOAD_LEN)
+/* Writes have to fit into the first report of a transaction, next to 21 bytes of commands. */
+#define PICKIT2_MAX_WRITE	40
+/* Bytes per read transaction, between progress updates. */
+#define PICKIT2_READ_CHUNK	(16 * KiB)
+
+/*
+ * The firmware executes one report at a time and blocks in CMD_UPLOAD_DATA
+ * until the host picked up the previous reply. With the next report already
+ * queued, it runs the next script while the host receives the last reply.
+ */
+#define PICKIT2_REPORTS_IN_FLIGHT	2
+#define PICKIT2_REPLIES_IN_FLIGHT	(PICKIT2_REPORTS_IN_FLIGHT * PICKIT2_REPORT_READ / PICKIT2_UPLOAD_LEN)
+
+/*
+ * Reports and replies are kept in two rings of asynchronous transfers.
+ * Transfers on one endpoint complete in the order they were submitted,
+ * so a ring slot is free again when the transfer `count` places before
+ * it is done.
+ */
+struct pickit2_pipeline {
+	struct libusb_transfer *reports[PICKIT2_REPORTS_IN_FLIGHT];
+	struct libusb_transfer *replies[PICKIT2_REPLIES_IN_FLIGHT];
+	uint8_t report_buf[PICKIT2_REPORTS_IN_FLIGHT][CMD_LENGTH];
+	uint8_t reply_buf[PICKIT2_REPLIES_IN_FLIGHT][CMD_LENGTH];
+	unsigned int reports_sent, reports_done;
+	unsigned int replies_sent, replies_done;
+	int error;
+
+	/* Destination of the current transaction. */
+	uint8_t *dest;
+	unsigned int len;
+	unsigned int received;
+};
+
+struct pickit2_spi_data {
+	libusb_device_handle *pickit2_handle;
+	struct pickit2_pipeline pipeline;
+};
+
 static int pickit2_interrupt_transfer(libusb_device_handle *handle, unsigned char endpoint, unsigned char *data)
 {
 	int transferred;
-	return libusb_interrupt_transfer(handle, endpoint, data, CMD_LENGTH, &transferred, DFLT_TIMEOUT);
+	return usb_dev_interrupt_transfer(handle, endpoint, data, CMD_LENGTH, &transferred, DFLT_TIMEOUT);
 }
 
 static int pickit2_get_firmware_version(libusb_device_handle *pickit2_handle)
@@ -198,96 +239,283 @@ static int pickit2_set_spi_speed(libusb_device_handle *pickit2_handle, unsigned
 	return 0;
 }
 
-static int pickit2_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
-				     const unsigned char *writearr, unsigned char *readarr)
+/* The clocks of spispeeds[] in Hz, in reverse order. */
+static const unsigned long spispeeds_hz[] = { 250000, 333000, 500000, 1000000 };
+
+static size_t pickit2_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
 {
-	const unsigned int total_packetsize = writecnt + readcnt + 20;
-	struct pickit2_spi_data *pickit2_data = flash->mst.spi->data;
+	*speeds = spispeeds_hz;
+	return ARRAY_SIZE(spispeeds_hz);
+}
 
-	/* Maximum number of bytes per transaction (including command overhead) is 64. Lets play it safe
-	 * and always assume the worst case scenario of 20 bytes command overhead.
-	 */
-	if (total_packetsize > CMD_LENGTH) {
-		msg_perr("\nTotal packetsize (%i) is greater than %i supported, aborting.\n",
-			 total_packetsize, CMD_LENGTH);
+static int pickit2_spi_set_speed(const struct flashctx *flash, unsigned long hz)
+{
+	const struct pickit2_spi_data *const pickit2_data = flash->mst.spi->data;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(spispeeds_hz) && spispeeds_hz[i] != hz; ++i)
+		;
+	if (i == ARRAY_SIZE(spispeeds_hz))
 		return 1;
-	}
+	return pickit2_set_spi_speed(pickit2_data->pickit2_handle, ARRAY_SIZE(spispeeds_hz) - 1 - i);
+}
 
-	uint8_t buf[CMD_LENGTH] = {CMD_DOWNLOAD_DATA, writecnt};
-	unsigned int i = 2;
-	for (; i < writecnt + 2; i++) {
-		buf[i] = writearr[i - 2];
+/* Append a script instruction that is executed `count` times. */
+static unsigned int pickit2_script_repeat(uint8_t *const script, const uint8_t instruction, const unsigned int count)
+{
+	if (!count)
+		return 0;
+	script[0] = instruction;
+	if (count == 1)
+		return 1;
+	script[1] = SCR_LOOP;
+	script[2] = 1;		/* Loop back one instruction */
+	script[3] = count - 1;	/* Number of times to loop */
+	return 4;
+}
+
+/*
+ * Fill a report that writes `writecnt` bytes, reads `readcnt` bytes and
+ * requests the replies for them. CS# is asserted before and released
+ * after the transfer if requested, so a transaction can span reports.
+ */
+static void pickit2_fill_report(uint8_t *const buf, const uint8_t *const writearr, const unsigned int writecnt,
+				const unsigned int readcnt, const bool assert_cs, const bool release_cs)
+{
+	unsigned int i = 0, n;
+
+	memset(buf, 0, CMD_LENGTH);
+	if (writecnt) {
+		buf[i++] = CMD_DOWNLOAD_DATA;
+		buf[i++] = writecnt;
+		memcpy(buf + i, writearr, writecnt);
+		i += writecnt;
 	}
+	if (assert_cs)
+		buf[i++] = CMD_CLR_ULOAD_BUFF;
 
-	buf[i++] = CMD_CLR_ULOAD_BUFF;
 	buf[i++] = CMD_EXEC_SCRIPT;
+	const unsigned int script_len = i++;
 
-	/* Determine script length based on number of bytes to be read or written */
-	if (writecnt == 1 && readcnt == 1)
-		buf[i++] = 7;
-	else if (writecnt == 1 || readcnt == 1)
-		buf[i++] = 10;
-	else
-		buf[i++] = 13;
-
-	/* Assert CS# */
-	buf[i++] = SCR_VPP_OFF;
-	buf[i++] = SCR_MCLR_GND_ON;
+	if (assert_cs) {
+		buf[i++] = SCR_VPP_OFF;
+		buf[i++] = SCR_MCLR_GND_ON;
+	}
+	i += pickit2_script_repeat(buf + i, SCR_SPI_WRITE_BUF, writecnt);
+	i += pickit2_script_repeat(buf + i, SCR_SPI_READ_BUF, readcnt);
+	if (release_cs) {
+		buf[i++] = SCR_MCLR_GND_OFF;
+		buf[i++] = SCR_VPP_PWM_ON;
+		buf[i++] = SCR_VPP_ON;
+	}
+	buf[script_len] = i - script_len - 1;
 
-	buf[i++] = SCR_SPI_WRITE_BUF;
+	for (n = 0; n < readcnt; n += PICKIT2_UPLOAD_LEN)
+		buf[i++] = CMD_UPLOAD_DATA;
+	buf[i++] = CMD_END_OF_BUFFER;
+}
 
-	if (writecnt > 1) {
-		buf[i++] = SCR_LOOP;
-		buf[i++] = 1; /* Loop back one instruction */
-		buf[i++] = writecnt - 1; /* Number of times to loop */
+static void LIBUSB_CALL pickit2_report_cb(struct libusb_transfer *const transfer)
+{
+	struct pickit2_pipeline *const p = transfer->user_data;
+
+	++p->reports_done;
+	if (p->error)
+		return;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != CMD_LENGTH) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("Send SPI failed!\n");
+		p->error = 1;
 	}
+}
 
-	if (readcnt)
-		buf[i++] = SCR_SPI_READ_BUF;
+static void LIBUSB_CALL pickit2_reply_cb(struct libusb_transfer *const transfer)
+{
+	struct pickit2_pipeline *const p = transfer->user_data;
 
-	if (readcnt > 1) {
-		buf[i++] = SCR_LOOP;
-		buf[i++] = 1; /* Loop back one instruction */
-		buf[i++] = readcnt - 1; /* Number of times to loop */
+	++p->replies_done;
+	if (p->error)
+		return;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length == 0) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("Receive SPI failed\n");
+		p->error = 1;
+		return;
 	}
 
-	/* De-assert CS# */
-	buf[i++] = SCR_MCLR_GND_OFF;
-	buf[i++] = SCR_VPP_PWM_ON;
-	buf[i++] = SCR_VPP_ON;
+	/* First byte indicates number of bytes transferred from upload buffer */
+	const unsigned int expected = min(PICKIT2_UPLOAD_LEN, p->len - p->received);
+	if (transfer->buffer[0] != expected || (unsigned int)transfer->actual_length < expected + 1) {
+		msg_perr("Unexpected number of bytes transferred, expected %u, got %u!\n",
+			 expected, transfer->buffer[0]);
+		p->error = 1;
+		return;
+	}
 
-	buf[i++] = CMD_UPLOAD_DATA;
-	buf[i++] = CMD_END_OF_BUFFER;
+	/* Actual data starts at byte number two */
+	memcpy(p->dest + p->received, &transfer->buffer[1], expected);
+	p->received += expected;
+}
 
-	int ret = pickit2_interrupt_transfer(pickit2_data->pickit2_handle, ENDPOINT_OUT, buf);
+static unsigned int pickit2_pipeline_pending(const struct pickit2_pipeline *const p)
+{
+	return (p->reports_sent - p->reports_done) + (p->replies_sent - p->replies_done);
+}
 
-	if (ret != 0) {
-		msg_perr("Send SPI failed!\n");
+static int pickit2_pipeline_poll(struct pickit2_pipeline *const p, const bool finish)
+{
+	if (!pickit2_pipeline_pending(p))
+		return 0;
+
+	do {
+		struct timeval timeout = { 10, 0 };
+		const int ret = libusb_handle_events_timeout(NULL, &timeout);
+		if (ret < 0) {
+			msg_perr("Polling USB events failed: %i %s!\n", ret, libusb_error_name(ret));
+			p->error = 1;
+			return 1;
+		}
+	} while (finish && pickit2_pipeline_pending(p));
+	return 0;
+}
+
+/* Cancel anything left over after an error and wait for it. */
+static void pickit2_pipeline_cancel(struct pickit2_pipeline *const p)
+{
+	unsigned int i;
+
+	for (i = p->reports_done; i != p->reports_sent; ++i)
+		libusb_cancel_transfer(p->reports[i % PICKIT2_REPORTS_IN_FLIGHT]);
+	for (i = p->replies_done; i != p->replies_sent; ++i)
+		libusb_cancel_transfer(p->replies[i % PICKIT2_REPLIES_IN_FLIGHT]);
+	pickit2_pipeline_poll(p, true);
+}
+
+static int pickit2_pipeline_submit(struct pickit2_pipeline *const p, struct libusb_transfer *const transfer)
+{
+	const int ret = libusb_submit_transfer(transfer);
+	if (ret < 0) {
+		msg_perr("Submitting USB transfer failed: %s\n", libusb_error_name(ret));
+		p->error = 1;
 		return 1;
 	}
+	return 0;
+}
 
-	if (readcnt) {
-		int length = 0;
-		ret = libusb_interrupt_transfer(pickit2_data->pickit2_handle,
-					ENDPOINT_IN, buf, CMD_LENGTH, &length, DFLT_TIMEOUT);
-
-		if (length == 0 || ret != 0) {
-			msg_perr("Receive SPI failed\n");
-			return 1;
+/*
+ * Run a whole SPI transaction. The read is split into reports of up to
+ * PICKIT2_REPORT_READ bytes with CS# held asserted between them. Up to
+ * PICKIT2_REPORTS_IN_FLIGHT reports are queued ahead of the replies.
+ */
+static int pickit2_spi_transaction(struct pickit2_spi_data *const pickit2_data, const unsigned int writecnt,
+				   const unsigned int readcnt, const uint8_t *const writearr, uint8_t *const readarr)
+{
+	libusb_device_handle *const handle = pickit2_data->pickit2_handle;
+	struct pickit2_pipeline *const p = &pickit2_data->pipeline;
+	const unsigned int replies = (readcnt + PICKIT2_UPLOAD_LEN - 1) / PICKIT2_UPLOAD_LEN;
+	unsigned int scheduled = 0;
+
+	p->reports_sent = p->reports_done = 0;
+	p->replies_sent = p->replies_done = 0;
+	p->error = 0;
+	p->dest = readarr;
+	p->len = readcnt;
+	p->received = 0;
+
+	while (!p->error && (p->reports_sent == 0 || scheduled < readcnt || p->received < readcnt)) {
+		while (!p->error && (p->reports_sent == 0 || scheduled < readcnt) &&
+		       p->reports_sent - p->reports_done < PICKIT2_REPORTS_IN_FLIGHT) {
+			const bool first = p->reports_sent == 0;
+			const unsigned int chunk = min(PICKIT2_REPORT_READ, readcnt - scheduled);
+			struct libusb_transfer *const report = p->reports[p->reports_sent % PICKIT2_REPORTS_IN_FLIGHT];
+
+			pickit2_fill_report(report->buffer, writearr, first ? writecnt : 0, chunk,
+					    first, scheduled + chunk == readcnt);
+			if (pickit2_pipeline_submit(p, report))
+				break;
+			++p->reports_sent;
+			scheduled += chunk;
 		}
-
-		/* First byte indicates number of bytes transferred from upload buffer */
-		if (buf[0] != readcnt) {
-			msg_perr("Unexpected number of bytes transferred, expected %i, got %i!\n",
-				 readcnt, ret);
-			return 1;
+		while (!p->error && p->replies_sent < replies &&
+		       p->replies_sent - p->replies_done < PICKIT2_REPLIES_IN_FLIGHT) {
+			if (pickit2_pipeline_submit(p, p->replies[p->replies_sent % PICKIT2_REPLIES_IN_FLIGHT]))
+				break;
+			++p->replies_sent;
 		}
+		if (pickit2_pipeline_poll(p, false))
+			break;
+	}
+	if (!p->error)
+		pickit2_pipeline_poll(p, true);
+
+	if (!p->error)
+		return 0;
+
+	pickit2_pipeline_cancel(p);
+
+	/* Don't leave CS# asserted if the transaction was interrupted. */
+	uint8_t release[CMD_LENGTH];
+	pickit2_fill_report(release, NULL, 0, 0, false, true);
+	pickit2_interrupt_transfer(handle, ENDPOINT_OUT, release);
+	return 1;
+}
+
+static int pickit2_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+				     const unsigned char *writearr, unsigned char *readarr)
+{
+	struct pickit2_spi_data *pickit2_data = flash->mst.spi->data;
 
-		/* Actual data starts at byte number two */
-		memcpy(readarr, &buf[1], readcnt);
+	/* The whole write has to fit into the first report. */
+	if (writecnt > PICKIT2_MAX_WRITE) {
+		msg_perr("\nWrite size (%u) is greater than %u supported, aborting.\n",
+			 writecnt, PICKIT2_MAX_WRITE);
+		return 1;
 	}
 
+	return pickit2_spi_transaction(pickit2_data, writecnt, readcnt, writearr, readarr);
+}
+
+/* Read in large chunks, one transaction keeps the report pipeline full. */
+static int pickit2_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return flashprog_read_chunked(flash, buf, start, len, PICKIT2_READ_CHUNK, spi_nbyte_read);
+}
+
+static int pickit2_pipeline_init(struct pickit2_spi_data *const pickit2_data)
+{
+	struct pickit2_pipeline *const p = &pickit2_data->pipeline;
+	unsigned int i;
+
+	for (i = 0; i < PICKIT2_REPORTS_IN_FLIGHT; ++i) {
+		p->reports[i] = libusb_alloc_transfer(0);
+		if (!p->reports[i])
+			goto _alloc_failed;
+		libusb_fill_interrupt_transfer(p->reports[i], pickit2_data->pickit2_handle, ENDPOINT_OUT,
+					       p->report_buf[i], CMD_LENGTH, pickit2_report_cb, p, DFLT_TIMEOUT);
+	}
+	for (i = 0; i < PICKIT2_REPLIES_IN_FLIGHT; ++i) {
+		p->replies[i] = libusb_alloc_transfer(0);
+		if (!p->replies[i])
+			goto _alloc_failed;
+		libusb_fill_interrupt_transfer(p->replies[i], pickit2_data->pickit2_handle, ENDPOINT_IN,
+					       p->reply_buf[i], CMD_LENGTH, pickit2_reply_cb, p, DFLT_TIMEOUT);
+	}
 	return 0;
+
+_alloc_failed:
+	msg_perr("Allocating libusb transfers failed!\n");
+	return 1;
+}
+
+static void pickit2_pipeline_free(struct pickit2_spi_data *const pickit2_data)
+{
+	struct pickit2_pipeline *const p = &pickit2_data->pipeline;
+	unsigned int i;
+
+	for (i = 0; i < PICKIT2_REPORTS_IN_FLIGHT; ++i)
+		libusb_free_transfer(p->reports[i]);
+	for (i = 0; i < PICKIT2_REPLIES_IN_FLIGHT; ++i)
+		libusb_free_transfer(p->replies[i]);
 }
 
 /* Copied from dediprog.c */
@@ -343,14 +571,16 @@ static int parse_voltage(char *voltage)
 static int pickit2_shutdown(void *data);
 
 static const struct spi_master spi_master_pickit2 = {
-	.max_data_read	= 40,
-	.max_data_write	= 40,
+	.max_data_read	= MAX_DATA_READ_UNLIMITED,
+	.max_data_write	= PICKIT2_MAX_WRITE,
 	.command	= pickit2_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= pickit2_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= pickit2_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= pickit2_spi_list_speeds,
+	.set_speed	= pickit2_spi_set_speed,
 };
 
 static int pickit2_shutdown(void *data)
@@ -382,8 +612,9 @@ static int pickit2_shutdown(void *data)
 		msg_perr("Could not release USB interface!\n");
 		ret = 1;
 	}
+	pickit2_pipeline_free(pickit2_data);
 	libusb_close(pickit2_data->pickit2_handle);
-	libusb_exit(NULL);
+	usb_dev_exit(NULL);
 
 	free(data);
 	return ret;
@@ -410,9 +641,13 @@ static int pickit2_spi_init(struct flashprog_programmer *const prog)
 
 	libusb_device_handle *pickit2_handle;
 	struct pickit2_spi_data *pickit2_data;
+	struct spi_master mst = spi_master_pickit2;
 	int spispeed_idx = 0;
 	char *spispeed = extract_programmer_param("spispeed");
-	if (spispeed != NULL) {
+	if (spispeed != NULL && !strcasecmp(spispeed, "auto")) {
+		mst.tune_speed = true;
+		free(spispeed);
+	} else if (spispeed != NULL) {
 		int i = 0;
 		for (; spispeeds[i].name; i++) {
 			if (strcasecmp(spispeeds[i].name, spispeed) == 0) {
@@ -437,7 +672,7 @@ static int pickit2_spi_init(struct flashprog_programmer *const prog)
 			return 1;
 	}
 
-	if (libusb_init(NULL) < 0) {
+	if (usb_dev_init(NULL) < 0) {
 		msg_perr("Couldn't initialize libusb!\n");
 		return -1;
 	}
@@ -453,20 +688,20 @@ static int pickit2_spi_init(struct flashprog_programmer *const prog)
 	pickit2_handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
 	if (pickit2_handle == NULL) {
 		msg_perr("Could not open device PICkit2!\n");
-		libusb_exit(NULL);
+		usb_dev_exit(NULL);
 		return 1;
 	}
 
 	if (libusb_set_configuration(pickit2_handle, 1) != 0) {
 		msg_perr("Could not set USB device configuration.\n");
 		libusb_close(pickit2_handle);
-		libusb_exit(NULL);
+		usb_dev_exit(NULL);
 		return 1;
 	}
 	if (libusb_claim_interface(pickit2_handle, 0) != 0) {
 		msg_perr("Could not claim USB device interface\n");
 		libusb_close(pickit2_handle);
-		libusb_exit(NULL);
+		usb_dev_exit(NULL);
 		return 1;
 	}
 
@@ -474,11 +709,14 @@ static int pickit2_spi_init(struct flashprog_programmer *const prog)
 	if (!pickit2_data) {
 		msg_perr("Unable to allocate space for SPI master data\n");
 		libusb_close(pickit2_handle);
-		libusb_exit(NULL);
+		usb_dev_exit(NULL);
 		return 1;
 	}
 	pickit2_data->pickit2_handle = pickit2_handle;
 
+	if (pickit2_pipeline_init(pickit2_data))
+		goto init_err_cleanup_exit;
+
 	if (pickit2_get_firmware_version(pickit2_handle))
 		goto init_err_cleanup_exit;
 
@@ -498,7 +736,8 @@ static int pickit2_spi_init(struct flashprog_programmer *const prog)
 		goto init_err_cleanup_exit;
 	}
 
-	return register_spi_master(&spi_master_pickit2, 0, pickit2_data);
+	mst.clock_hz = spispeeds_hz[ARRAY_SIZE(spispeeds_hz) - 1 - spispeed_idx];
+	return register_spi_master(&mst, 0, pickit2_data);
 
 init_err_cleanup_exit:
 	pickit2_shutdown(pickit2_data);
@@ -510,4 +749,5 @@ const struct programmer_entry programmer_pickit2_spi = {
 	.type			= USB,
 	.devs.dev		= devs_pickit2_spi,
 	.init			= pickit2_spi_init,
+	.multi_instance		= true,
 };
@@ -90,11 +90,40 @@ static int pony_bitbang_get_miso(void *spi_data)
 	return tmp;
 }
 
+/*
+ * Shift whole buffers. SCK (RTS) and MOSI (DTR) are both modem control
+ * lines, so they are changed together and MOSI only when it changes.
+ */
+static void pony_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	int mosi = -1; /* unknown */
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			const int next = ((val >> bit) & 1) ^ pony_negate_mosi;
+
+			sp_set_dtr_rts(next != mosi ? next : -1, pony_negate_sck);
+			mosi = next;
+			sp_set_dtr_rts(-1, !pony_negate_sck);
+			if (in)
+				miso = miso << 1 | pony_bitbang_get_miso(spi_data);
+		}
+		if (in)
+			in[i] = miso;
+	}
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_pony = {
 	.set_cs		= pony_bitbang_set_cs,
 	.set_sck	= pony_bitbang_set_sck,
 	.set_mosi	= pony_bitbang_set_mosi,
 	.get_miso	= pony_bitbang_get_miso,
+	.shift_bytes	= pony_bitbang_shift_bytes,
 	.half_period	= 0,
 };
 
@@ -208,7 +237,7 @@ static int pony_spi_init(struct flashprog_programmer *const prog)
 		for (i = 1; i <= 10; i++) {
 			data_out = i & 1;
 			sp_set_pin(PIN_RTS, data_out);
-			programmer_delay(1000);
+			programmer_delay(NULL, 1000);
 
 			/* If DSR does not change, we are not connected to what we think */
 			if (data_out != sp_get_pin(PIN_DSR)) {
@@ -80,32 +80,13 @@ void fallback_chip_readn(const struct flashctx *flash, uint8_t *buf,
 	return;
 }
 
-/* The limit of 4 is totally arbitrary. */
-#define MASTERS_MAX 4
-struct registered_master registered_masters[MASTERS_MAX];
-int registered_master_count = 0;
-
-/* This function copies the struct registered_master parameter. */
-int register_master(const struct registered_master *mst)
-{
-	if (registered_master_count >= MASTERS_MAX) {
-		msg_perr("Tried to register more than %i master "
-			 "interfaces.\n", MASTERS_MAX);
-		return ERROR_FLASHPROG_LIMIT;
-	}
-	registered_masters[registered_master_count] = *mst;
-	registered_master_count++;
-
-	return 0;
-}
-
-enum chipbustype get_buses_supported(void)
+enum chipbustype get_buses_supported(const struct flashprog_programmer *const prog)
 {
 	int i;
 	enum chipbustype ret = BUS_NONE;
 
-	for (i = 0; i < registered_master_count; i++)
-		ret |= registered_masters[i].buses_supported;
+	for (i = 0; i < prog->master_count; i++)
+		ret |= prog->masters[i].buses_supported;
 
 	return ret;
 }
@@ -155,12 +155,84 @@ static int rayer_bitbang_get_miso(void *spi_data)
 	return tmp;
 }
 
+static void rayer_bitbang_set_sck_set_mosi(int sck, int mosi, void *spi_data)
+{
+	lpt_outbyte &= ~(1 << pinout->sck_bit | 1 << pinout->mosi_bit);
+	lpt_outbyte |= sck << pinout->sck_bit | mosi << pinout->mosi_bit;
+	OUTB(lpt_outbyte, lpt_iobase);
+}
+
+static int rayer_bitbang_set_sck_get_miso(int sck, void *spi_data)
+{
+	rayer_bitbang_set_sck(sck, spi_data);
+	return rayer_bitbang_get_miso(spi_data);
+}
+
+/*
+ * Shift whole buffers with two port writes and one port read per bit.
+ * Write-only transfers are sent with string I/O.
+ */
+static void rayer_bitbang_shift_bytes(const uint8_t *out, uint8_t *in, size_t len, void *spi_data)
+{
+	const uint8_t sck = 1 << pinout->sck_bit;
+	const uint8_t mosi = 1 << pinout->mosi_bit;
+	uint8_t outbyte = lpt_outbyte;
+	size_t i;
+	int bit;
+
+	if (!in && out) {
+		/* Nothing to sample, queue the port writes and send them in bulk. */
+		uint8_t queue[16 * 64];
+		size_t queued = 0;
+
+		for (i = 0; i < len; i++) {
+			for (bit = 7; bit >= 0; bit--) {
+				outbyte &= ~(sck | mosi);
+				if ((out[i] >> bit) & 1)
+					outbyte |= mosi;
+				queue[queued++] = outbyte;
+				outbyte |= sck;
+				queue[queued++] = outbyte;
+			}
+			if (queued == sizeof(queue)) {
+				OUTSB(queue, queued, lpt_iobase);
+				queued = 0;
+			}
+		}
+		OUTSB(queue, queued, lpt_iobase);
+		lpt_outbyte = outbyte;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		const uint8_t val = out ? out[i] : 0;
+		uint8_t miso = 0;
+
+		for (bit = 7; bit >= 0; bit--) {
+			outbyte &= ~(sck | mosi);
+			if ((val >> bit) & 1)
+				outbyte |= mosi;
+			OUTB(outbyte, lpt_iobase);
+			outbyte |= sck;
+			OUTB(outbyte, lpt_iobase);
+			if (in)
+				miso = miso << 1 | rayer_bitbang_get_miso(spi_data);
+		}
+		if (in)
+			in[i] = miso;
+	}
+	lpt_outbyte = outbyte;
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_rayer = {
-	.set_cs		= rayer_bitbang_set_cs,
-	.set_sck	= rayer_bitbang_set_sck,
-	.set_mosi	= rayer_bitbang_set_mosi,
-	.get_miso	= rayer_bitbang_get_miso,
-	.half_period	= 0,
+	.set_cs			= rayer_bitbang_set_cs,
+	.set_sck		= rayer_bitbang_set_sck,
+	.set_mosi		= rayer_bitbang_set_mosi,
+	.get_miso		= rayer_bitbang_get_miso,
+	.set_sck_set_mosi	= rayer_bitbang_set_sck_set_mosi,
+	.set_sck_get_miso	= rayer_bitbang_set_sck_get_miso,
+	.shift_bytes		= rayer_bitbang_shift_bytes,
+	.half_period		= 0,
 };
 
 static int rayer_spi_init(struct flashprog_programmer *const flashprog)
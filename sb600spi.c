@@ -40,7 +40,6 @@
  *};
  */
 
-static uint8_t *sb600_spibar = NULL;
 enum amd_chipset {
 	CHIPSET_AMD_UNKNOWN,
 	CHIPSET_SB6XX,
@@ -51,7 +50,10 @@ enum amd_chipset {
 	CHIPSET_YANGTZE,
 	CHIPSET_PROMONTORY,
 };
-static enum amd_chipset amd_gen = CHIPSET_AMD_UNKNOWN;
+
+struct sb600spi_data {
+	uint8_t *spibar;
+};
 
 #define FIFO_SIZE_OLD		8
 #define FIFO_SIZE_YANGTZE	71
@@ -69,6 +71,7 @@ static struct spi_master spi_master_sb600 = {
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.probe_opcode	= default_spi_probe_opcode,
+	.shutdown	= shutdown_free,
 };
 
 static struct spi_master spi_master_yangtze = {
@@ -79,6 +82,7 @@ static struct spi_master spi_master_yangtze = {
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.probe_opcode	= default_spi_probe_opcode,
+	.shutdown	= shutdown_free,
 };
 
 static int find_smbus_dev_rev(uint16_t vendor, uint16_t device)
@@ -93,9 +97,9 @@ static int find_smbus_dev_rev(uint16_t vendor, uint16_t device)
 }
 
 /* Determine the chipset's version and identify the respective SMBUS device. */
-static int determine_generation(struct pci_dev *dev)
+static int determine_generation(struct pci_dev *dev, enum amd_chipset *const gen)
 {
-	amd_gen = CHIPSET_AMD_UNKNOWN;
+	enum amd_chipset amd_gen = CHIPSET_AMD_UNKNOWN;
 	msg_pdbg2("Trying to determine the generation of the SPI interface... ");
 	if (dev->device_id == 0x438d) {
 		amd_gen = CHIPSET_SB6XX;
@@ -163,10 +167,11 @@ static int determine_generation(struct pci_dev *dev)
 		msg_perr("Could not determine chipset generation.");
 		return -1;
 	}
+	*gen = amd_gen;
 	return 0;
 }
 
-static void reset_internal_fifo_pointer(void)
+static void reset_internal_fifo_pointer(uint8_t *sb600_spibar)
 {
 	mmio_writeb(mmio_readb(sb600_spibar + 2) | 0x10, sb600_spibar + 2);
 
@@ -175,7 +180,7 @@ static void reset_internal_fifo_pointer(void)
 		msg_pspew("reset\n");
 }
 
-static int compare_internal_fifo_pointer(uint8_t want)
+static int compare_internal_fifo_pointer(uint8_t *sb600_spibar, uint8_t want)
 {
 	uint8_t have = mmio_readb(sb600_spibar + 0xd) & 0x07;
 	want %= FIFO_SIZE_OLD;
@@ -209,7 +214,7 @@ static int check_readwritecnt(const struct flashctx *flash, unsigned int writecn
 	return 0;
 }
 
-static void execute_command(void)
+static void execute_command(uint8_t *sb600_spibar)
 {
 	msg_pspew("Executing... ");
 	mmio_writeb(mmio_readb(sb600_spibar + 2) | 1, sb600_spibar + 2);
@@ -223,6 +228,9 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 				  const unsigned char *writearr,
 				  unsigned char *readarr)
 {
+	const struct sb600spi_data *const data = flash->mst.spi->data;
+	uint8_t *const sb600_spibar = data->spibar;
+
 	/* First byte is cmd which can not be sent through the FIFO. */
 	unsigned char cmd = *writearr++;
 	writecnt--;
@@ -243,7 +251,7 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 	uint8_t readwrite = (readcnt + readoffby1) << 4 | (writecnt);
 	mmio_writeb(readwrite, sb600_spibar + 1);
 
-	reset_internal_fifo_pointer();
+	reset_internal_fifo_pointer(sb600_spibar);
 	msg_pspew("Filling FIFO: ");
 	unsigned int count;
 	for (count = 0; count < writecnt; count++) {
@@ -251,16 +259,16 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 		mmio_writeb(writearr[count], sb600_spibar + 0xC);
 	}
 	msg_pspew("\n");
-	if (compare_internal_fifo_pointer(writecnt))
+	if (compare_internal_fifo_pointer(sb600_spibar, writecnt))
 		return SPI_PROGRAMMER_ERROR;
 
 	/*
 	 * We should send the data in sequence, which means we need to reset
 	 * the FIFO pointer to the first byte we want to send.
 	 */
-	reset_internal_fifo_pointer();
-	execute_command();
-	if (compare_internal_fifo_pointer(writecnt + readcnt))
+	reset_internal_fifo_pointer(sb600_spibar);
+	execute_command(sb600_spibar);
+	if (compare_internal_fifo_pointer(sb600_spibar, writecnt + readcnt))
 		return SPI_PROGRAMMER_ERROR;
 
 	/*
@@ -274,7 +282,7 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 	 * the opcode, the FIFO already stores the response from the chip.
 	 * Usually, the chip will respond with 0x00 or 0xff.
 	 */
-	reset_internal_fifo_pointer();
+	reset_internal_fifo_pointer(sb600_spibar);
 
 	/* Skip the bytes we sent. */
 	msg_pspew("Skipping: ");
@@ -282,7 +290,7 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 		msg_pspew("[%02x]", mmio_readb(sb600_spibar + 0xC));
 	}
 	msg_pspew("\n");
-	if (compare_internal_fifo_pointer(writecnt))
+	if (compare_internal_fifo_pointer(sb600_spibar, writecnt))
 		return SPI_PROGRAMMER_ERROR;
 
 	msg_pspew("Reading FIFO: ");
@@ -291,7 +299,7 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 		msg_pspew("[%02x]", readarr[count]);
 	}
 	msg_pspew("\n");
-	if (compare_internal_fifo_pointer(writecnt+readcnt))
+	if (compare_internal_fifo_pointer(sb600_spibar, writecnt+readcnt))
 		return SPI_PROGRAMMER_ERROR;
 
 	if (mmio_readb(sb600_spibar + 1) != readwrite) {
@@ -304,11 +312,27 @@ static int sb600_spi_send_command(const struct flashctx *flash, unsigned int wri
 	return 0;
 }
 
+/* The SPI100 buffer is dword aligned, fill it with 32-bit writes where possible. */
+static void spi100_fill_buffer(uint8_t *sb600_spibar, const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		const uint32_t val = data[i] | data[i + 1] << 8 | data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+		mmio_le_writel(val, sb600_spibar + 0x80 + i);
+	}
+	for (; i < len; i++)
+		mmio_writeb(data[i], sb600_spibar + 0x80 + i);
+}
+
 static int spi100_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
 				  unsigned int readcnt,
 				  const unsigned char *writearr,
 				  unsigned char *readarr)
 {
+	const struct sb600spi_data *const data = flash->mst.spi->data;
+	uint8_t *const sb600_spibar = data->spibar;
+
 	/* First byte is cmd which can not be sent through the buffer. */
 	unsigned char cmd = *writearr++;
 	writecnt--;
@@ -323,21 +347,24 @@ static int spi100_spi_send_command(const struct flashctx *flash, unsigned int wr
 	mmio_writeb(writecnt, sb600_spibar + 0x48);
 	mmio_writeb(readcnt, sb600_spibar + 0x4b);
 
-	msg_pspew("Filling buffer: ");
+	spi100_fill_buffer(sb600_spibar, writearr, writecnt);
+	msg_pspew("Filled buffer: ");
 	unsigned int count;
-	for (count = 0; count < writecnt; count++) {
+	for (count = 0; count < writecnt; count++)
 		msg_pspew("[%02x]", writearr[count]);
-		mmio_writeb(writearr[count], sb600_spibar + 0x80 + count);
-	}
 	msg_pspew("\n");
 
-	execute_command();
+	execute_command(sb600_spibar);
 
-	msg_pspew("Reading buffer: ");
-	for (count = 0; count < readcnt; count++) {
-		readarr[count] = mmio_readb(sb600_spibar + 0x80 + (writecnt + count) % FIFO_SIZE_YANGTZE);
-		msg_pspew("[%02x]", readarr[count]);
+	if (writecnt + readcnt <= FIFO_SIZE_YANGTZE) {
+		mmio_readn_aligned(sb600_spibar + 0x80 + writecnt, readarr, readcnt, 4);
+	} else {
+		for (count = 0; count < readcnt; count++)
+			readarr[count] = mmio_readb(sb600_spibar + 0x80 + (writecnt + count) % FIFO_SIZE_YANGTZE);
 	}
+	msg_pspew("Read buffer: ");
+	for (count = 0; count < readcnt; count++)
+		msg_pspew("[%02x]", readarr[count]);
 	msg_pspew("\n");
 
 	return 0;
@@ -359,7 +386,7 @@ static const struct spispeed spispeeds[] = {
 	{ "800 kHz",	0x07 },
 };
 
-static int set_speed(struct pci_dev *dev, const struct spispeed *spispeed)
+static int set_speed(uint8_t *sb600_spibar, enum amd_chipset amd_gen, const struct spispeed *spispeed)
 {
 	bool success = false;
 	uint8_t speed = spispeed->speed;
@@ -382,7 +409,7 @@ static int set_speed(struct pci_dev *dev, const struct spispeed *spispeed)
 	return 0;
 }
 
-static int set_mode(struct pci_dev *dev, uint8_t read_mode)
+static int set_mode(uint8_t *sb600_spibar, uint8_t read_mode)
 {
 	uint32_t tmp = mmio_readl(sb600_spibar + 0x00);
 	tmp &= ~(0x6 << 28 | 0x1 << 18); /* Clear mode bits */
@@ -393,7 +420,7 @@ static int set_mode(struct pci_dev *dev, uint8_t read_mode)
 	return 0;
 }
 
-static int handle_speed(struct pci_dev *dev)
+static int handle_speed(uint8_t *sb600_spibar, enum amd_chipset amd_gen)
 {
 	uint32_t tmp;
 	uint8_t spispeed_idx = 3; /* Default to 16.5 MHz */
@@ -443,7 +470,7 @@ static int handle_speed(struct pci_dev *dev)
 		msg_pdbg("SpiReadMode=%s (%i)\n", spireadmodes[read_mode], read_mode);
 		if (read_mode != 6) {
 			read_mode = 6; /* Default to "Normal (up to 66 MHz)" */
-			if (set_mode(dev, read_mode) != 0) {
+			if (set_mode(sb600_spibar, read_mode) != 0) {
 				msg_perr("Setting read mode to \"%s\" failed.\n", spireadmodes[read_mode]);
 				return 1;
 			}
@@ -482,12 +509,15 @@ static int handle_speed(struct pci_dev *dev)
 		tmp = (mmio_readb(sb600_spibar + 0xd) >> 4) & 0x3;
 		msg_pdbg("NormSpeed is %s\n", spispeeds[tmp].name);
 	}
-	return set_speed(dev, &spispeeds[spispeed_idx]);
+	return set_speed(sb600_spibar, amd_gen, &spispeeds[spispeed_idx]);
 }
 
-int sb600_probe_spi(struct pci_dev *dev)
+int sb600_probe_spi(struct flashprog_programmer *prog, struct pci_dev *dev)
 {
+	struct sb600spi_data *data;
+	enum amd_chipset amd_gen;
 	struct pci_dev *smbus_dev;
+	uint8_t *sb600_spibar;
 	uint32_t tmp;
 	uint8_t reg;
 
@@ -510,7 +540,7 @@ int sb600_probe_spi(struct pci_dev *dev)
 	 */
 	sb600_spibar += tmp & 0xfff;
 
-	if (determine_generation(dev) < 0)
+	if (determine_generation(dev, &amd_gen) < 0)
 		return ERROR_NONFATAL;
 
 	/* How to read the following table and similar ones in this file:
@@ -643,17 +673,24 @@ int sb600_probe_spi(struct pci_dev *dev)
 		return 0;
 	}
 
-	if (handle_speed(dev) != 0)
+	if (handle_speed(sb600_spibar, amd_gen) != 0)
 		return ERROR_FATAL;
 
 	/* Handle IMC everywhere but sb600 which does not have one. */
-	if (amd_gen != CHIPSET_SB6XX && handle_imc(dev) != 0)
+	if (amd_gen != CHIPSET_SB6XX && handle_imc(prog, dev) != 0)
+		return ERROR_FATAL;
+
+	data = calloc(1, sizeof(*data));
+	if (!data) {
+		msg_perr("Unable to allocate space for SPI master data\n");
 		return ERROR_FATAL;
+	}
+	data->spibar = sb600_spibar;
 
 	/* Starting with Yangtze the SPI controller got a different interface with a much bigger buffer. */
 	if (amd_gen < CHIPSET_YANGTZE)
-		register_spi_master(&spi_master_sb600, 0, NULL);
+		register_spi_master(&spi_master_sb600, 0, data);
 	else
-		register_spi_master(&spi_master_yangtze, 0, NULL);
+		register_spi_master(&spi_master_yangtze, 0, data);
 	return 0;
 }
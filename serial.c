@@ -31,12 +31,38 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #endif
 #include "flash.h"
 #include "programmer.h"
 #include "custom_baud.h"
 
 fdtype sp_fd = SER_INV_FD;
+#if IS_WINDOWS
+/*
+ * The port is opened for overlapped I/O. serialport_write() only queues
+ * the data to one of these slots and returns, so that the transmission
+ * continues while the caller already waits for the reply. The driver
+ * completes the queued writes in order.
+ */
+#define SP_TX_SLOTS	8
+static struct sp_tx_slot {
+	OVERLAPPED ov;
+	unsigned char *buf;
+	DWORD size;
+	DWORD len;
+	bool busy;
+} sp_tx_queue[SP_TX_SLOTS];
+static unsigned int sp_tx_next;
+#endif
+#if !IS_WINDOWS
+/* Last known modem control state of `sp_fd`, for sp_set_dtr_rts(). */
+static int sp_modem_ctl;
+static fdtype sp_modem_ctl_fd = SER_INV_FD;
+#endif
 
 /* There is no way defined by POSIX to use arbitrary baud rates. It only defines some macros that can be used to
  * specify respective baud rates and many implementations extend this list with further macros, cf. TERMIOS(3)
@@ -154,6 +180,99 @@ static void msg_perr_strerror(const char *msg)
 #endif
 }
 
+#if IS_WINDOWS
+/* Runs a single ReadFile() or WriteFile() on the overlapped port and waits for its completion. */
+static BOOL sp_win_io(bool write, void *buf, DWORD len, DWORD *done)
+{
+	OVERLAPPED ov = { 0 };
+	BOOL ok;
+
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!ov.hEvent)
+		return FALSE;
+
+	if (write)
+		ok = WriteFile(sp_fd, buf, len, done, &ov);
+	else
+		ok = ReadFile(sp_fd, buf, len, done, &ov);
+	if (!ok && GetLastError() == ERROR_IO_PENDING)
+		ok = GetOverlappedResult(sp_fd, &ov, done, TRUE);
+
+	CloseHandle(ov.hEvent);
+	return ok;
+}
+
+/* Waits for a queued write to finish and frees its slot. */
+static int sp_tx_wait(struct sp_tx_slot *const slot)
+{
+	DWORD done = 0;
+	int ret = 0;
+
+	if (!slot->busy)
+		return 0;
+
+	if (!GetOverlappedResult(sp_fd, &slot->ov, &done, TRUE)) {
+		msg_perr_strerror("Serial port write error: ");
+		ret = 1;
+	} else if (done != slot->len) {
+		msg_perr("Serial port is unresponsive!\n");
+		ret = 1;
+	}
+	CloseHandle(slot->ov.hEvent);
+	slot->busy = false;
+	return ret;
+}
+
+static int sp_tx_drain(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	/* Oldest first, `sp_tx_next` is the next slot to be reused. */
+	for (i = 0; i < SP_TX_SLOTS; ++i)
+		ret |= sp_tx_wait(&sp_tx_queue[(sp_tx_next + i) % SP_TX_SLOTS]);
+	return ret;
+}
+
+static int sp_tx_queue_write(const unsigned char *buf, unsigned int writecnt)
+{
+	struct sp_tx_slot *const slot = &sp_tx_queue[sp_tx_next];
+
+	if (sp_tx_wait(slot))
+		return 1;
+
+	if (slot->size < writecnt) {
+		unsigned char *const new_buf = realloc(slot->buf, writecnt);
+		if (!new_buf) {
+			msg_perr("Out of memory!\n");
+			return 1;
+		}
+		slot->buf = new_buf;
+		slot->size = writecnt;
+	}
+	memcpy(slot->buf, buf, writecnt);
+
+	memset(&slot->ov, 0, sizeof(slot->ov));
+	slot->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!slot->ov.hEvent) {
+		msg_perr_strerror("Could not create serial port event: ");
+		return 1;
+	}
+	slot->len = writecnt;
+	slot->busy = true;
+	sp_tx_next = (sp_tx_next + 1) % SP_TX_SLOTS;
+
+	if (!WriteFile(sp_fd, slot->buf, writecnt, NULL, &slot->ov) &&
+	    GetLastError() != ERROR_IO_PENDING) {
+		msg_perr_strerror("Serial port write error: ");
+		CloseHandle(slot->ov.hEvent);
+		slot->busy = false;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
 int serialport_config(fdtype fd, int baud)
 {
 	if (fd == SER_INV_FD) {
@@ -262,6 +381,50 @@ int serialport_config(fdtype fd, int baud)
 	return 0;
 }
 
+/* Returns the current baud rate of `fd`, or -1 if it can't be expressed as a number. */
+int serialport_get_baud(fdtype fd)
+{
+#if IS_WINDOWS
+	DCB dcb;
+	if (!GetCommState(fd, &dcb)) {
+		msg_perr_strerror("Could not fetch serial port configuration: ");
+		return -1;
+	}
+	return dcb.BaudRate;
+#else
+	struct termios observed;
+	unsigned int i;
+
+	if (tcgetattr(fd, &observed) != 0) {
+		msg_perr_strerror("Could not fetch serial port configuration: ");
+		return -1;
+	}
+	for (i = 0; sp_baudtable[i].baud; i++) {
+		if ((speed_t)sp_baudtable[i].flag == cfgetospeed(&observed))
+			return sp_baudtable[i].baud;
+	}
+	return -1;
+#endif
+}
+
+/* Returns true if serialport_config() can set `baud` exactly, without rounding. */
+bool serialport_baud_supported(unsigned int baud)
+{
+#if IS_WINDOWS
+	return true;
+#else
+	unsigned int i;
+
+	if (use_custom_baud(baud, sp_baudtable))
+		return true;
+	for (i = 0; sp_baudtable[i].baud; i++) {
+		if (sp_baudtable[i].baud == baud)
+			return true;
+	}
+	return false;
+#endif
+}
+
 fdtype sp_openserport(char *dev, int baud)
 {
 	fdtype fd;
@@ -280,13 +443,16 @@ fdtype sp_openserport(char *dev, int baud)
 		strcpy(dev2 + 4, dev);
 	}
 	fd = CreateFile(dev2, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-			OPEN_EXISTING, 0, NULL);
+			OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 	if (dev2 != dev)
 		free(dev2);
 	if (fd == INVALID_HANDLE_VALUE) {
 		msg_perr_strerror("Cannot open serial port: ");
 		return SER_INV_FD;
 	}
+	/* Let the driver buffer whole replies while we are still transmitting. */
+	if (!SetupComm(fd, 64 * KiB, 64 * KiB))
+		msg_pdbg("Could not enlarge the serial port buffers.\n");
 	if (serialport_config(fd, baud) != 0) {
 		CloseHandle(fd);
 		return SER_INV_FD;
@@ -351,10 +517,53 @@ void sp_set_pin(enum SP_PIN pin, int val) {
 			ctl &= ~s;
 		}
 		ioctl(sp_fd, TIOCMSET, &ctl);
+		sp_modem_ctl = ctl;
+		sp_modem_ctl_fd = sp_fd;
 	}
 #endif
 }
 
+/*
+ * Drive DTR and RTS, a negative value leaves the line unchanged. Unlike
+ * sp_set_pin(), this doesn't read the modem state every time. It's read
+ * once, then both lines are changed with a single TIOCMSET. If that
+ * fails, lines that go to the same level are changed with a single call.
+ */
+void sp_set_dtr_rts(int dtr, int rts)
+{
+#if IS_WINDOWS
+	if (dtr >= 0)
+		EscapeCommFunction(sp_fd, dtr ? SETDTR : CLRDTR);
+	if (rts >= 0)
+		EscapeCommFunction(sp_fd, rts ? SETRTS : CLRRTS);
+#else
+	int set = 0, clear = 0;
+
+	if (dtr >= 0)
+		*(dtr ? &set : &clear) |= TIOCM_DTR;
+	if (rts >= 0)
+		*(rts ? &set : &clear) |= TIOCM_RTS;
+
+	if (sp_modem_ctl_fd != sp_fd && !ioctl(sp_fd, TIOCMGET, &sp_modem_ctl))
+		sp_modem_ctl_fd = sp_fd;
+	if (sp_modem_ctl_fd == sp_fd) {
+		const int ctl = (sp_modem_ctl | set) & ~clear;
+		if (ctl == sp_modem_ctl)
+			return;
+		if (!ioctl(sp_fd, TIOCMSET, &ctl)) {
+			sp_modem_ctl = ctl;
+			return;
+		}
+		sp_modem_ctl_fd = SER_INV_FD;
+	}
+
+	if (set)
+		ioctl(sp_fd, TIOCMBIS, &set);
+	if (clear)
+		ioctl(sp_fd, TIOCMBIC, &clear);
+#endif
+}
+
 int sp_get_pin(enum SP_PIN pin) {
 	int s;
 #if IS_WINDOWS
@@ -383,12 +592,76 @@ void sp_flush_incoming(void)
 	return;
 }
 
+/*
+ * Make the port return received data as soon as possible, for protocols
+ * that wait for a reply to every command. Failures are only reported, the
+ * port keeps working with the normal latency.
+ *
+ * On Linux, this sets ASYNC_LOW_LATENCY and, for FTDI adapters, the 1ms
+ * latency timer. On Windows, reads return as soon as any data arrived.
+ */
+void sp_set_low_latency(const char *dev)
+{
+#if IS_WINDOWS
+	COMMTIMEOUTS timeouts;
+
+	if (!GetCommTimeouts(sp_fd, &timeouts)) {
+		msg_perr_strerror("Could not get serial port timeout settings: ");
+		return;
+	}
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant = 100;
+	if (!SetCommTimeouts(sp_fd, &timeouts))
+		msg_perr_strerror("Could not set serial port timeout settings: ");
+#elif defined(__linux__)
+	struct serial_struct serial;
+	char path[PATH_MAX], *real;
+
+	if (ioctl(sp_fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(sp_fd, TIOCSSERIAL, &serial) != 0)
+			msg_pdbg("Could not set the serial port to low latency: %s\n", strerror(errno));
+	} else {
+		msg_pdbg("Could not get serial port settings: %s\n", strerror(errno));
+	}
+
+	/* FTDI adapters hold back data for up to 16ms by default. */
+	real = realpath(dev, NULL);
+	if (!real)
+		return;
+	const char *const name = strrchr(real, '/') ? strrchr(real, '/') + 1 : real;
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", name);
+	free(real);
+
+	FILE *const timer = fopen(path, "w");
+	if (!timer)
+		return;
+	const bool written = fputs("1", timer) != EOF;
+	if (fclose(timer) != 0 || !written)
+		msg_pdbg("Could not set the latency timer in %s: %s\n", path, strerror(errno));
+	else
+		msg_pdbg("Set the latency timer in %s to 1ms.\n", path);
+#else
+	msg_pdbg("Low-latency serial mode isn't supported on this platform.\n");
+#endif
+}
+
 int serialport_shutdown(void *data)
 {
 #if IS_WINDOWS
+	unsigned int i;
+
+	sp_tx_drain();
+	for (i = 0; i < SP_TX_SLOTS; ++i) {
+		free(sp_tx_queue[i].buf);
+		sp_tx_queue[i].buf = NULL;
+		sp_tx_queue[i].size = 0;
+	}
 	CloseHandle(sp_fd);
 #else
 	close(sp_fd);
+	sp_modem_ctl_fd = SER_INV_FD;
 #endif
 	return 0;
 }
@@ -396,25 +669,19 @@ int serialport_shutdown(void *data)
 int serialport_write(const unsigned char *buf, unsigned int writecnt)
 {
 #if IS_WINDOWS
-	DWORD tmp = 0;
+	if (!writecnt)
+		return 0;
+	return sp_tx_queue_write(buf, writecnt);
 #else
 	ssize_t tmp = 0;
-#endif
 	unsigned int empty_writes = 250; /* results in a ca. 125ms timeout */
 
 	while (writecnt > 0) {
-#if IS_WINDOWS
-		if (!WriteFile(sp_fd, buf, writecnt, &tmp, NULL)) {
-			msg_perr("Serial port write error!\n");
-			return 1;
-		}
-#else
 		tmp = write(sp_fd, buf, writecnt);
 		if (tmp == -1) {
 			msg_perr("Serial port write error!\n");
 			return 1;
 		}
-#endif
 		if (!tmp) {
 			msg_pdbg2("Empty write\n");
 			empty_writes--;
@@ -429,6 +696,7 @@ int serialport_write(const unsigned char *buf, unsigned int writecnt)
 	}
 
 	return 0;
+#endif
 }
 
 int serialport_read(unsigned char *buf, unsigned int readcnt)
@@ -441,7 +709,7 @@ int serialport_read(unsigned char *buf, unsigned int readcnt)
 
 	while (readcnt > 0) {
 #if IS_WINDOWS
-		if (!ReadFile(sp_fd, buf, readcnt, &tmp, NULL)) {
+		if (!sp_win_io(false, buf, readcnt, &tmp)) {
 			msg_perr("Serial port read error!\n");
 			return 1;
 		}
@@ -504,7 +772,7 @@ int serialport_read_nonblock(unsigned char *c, unsigned int readcnt, unsigned in
 	for (i = 0; i < timeout; i++) {
 		msg_pspew("readcnt %u rd_bytes %u\n", readcnt, rd_bytes);
 #if IS_WINDOWS
-		if (!ReadFile(sp_fd, c + rd_bytes, readcnt - rd_bytes, &rv, NULL)) {
+		if (!sp_win_io(false, c + rd_bytes, readcnt - rd_bytes, &rv)) {
 			msg_perr_strerror("Serial port read error: ");
 			ret = -1;
 			break;
@@ -588,7 +856,7 @@ int serialport_write_nonblock(const unsigned char *buf, unsigned int writecnt, u
 	for (i = 0; i < timeout; i++) {
 		msg_pspew("writecnt %u wr_bytes %u\n", writecnt, wr_bytes);
 #if IS_WINDOWS
-		if (!WriteFile(sp_fd, buf + wr_bytes, writecnt - wr_bytes, &rv, NULL)) {
+		if (!sp_win_io(true, (void *)(buf + wr_bytes), writecnt - wr_bytes, &rv)) {
 			msg_perr_strerror("Serial port write error: ");
 			ret = -1;
 			break;
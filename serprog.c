@@ -35,9 +35,11 @@
 #endif
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include "flash.h"
 #include "programmer.h"
 #include "chipdrivers.h"
+#include "spi.h"
 
 /* According to Serial Flasher Protocol Specification - version 1 */
 #define S_ACK			0x06
@@ -65,6 +67,23 @@
 #define S_CMD_S_SPI_FREQ	0x14	/* Set SPI clock frequency			*/
 #define S_CMD_S_PIN_STATE	0x15	/* Enable/disable output drivers		*/
 #define S_CMD_S_SPI_CS		0x16	/* Set SPI chip select to use			*/
+#define S_CMD_O_SPI_CRC32	0x19	/* CRC-32 over data read by an SPI command	*/
+#define S_CMD_O_SPI_PROGRAM	0x1A	/* SPI page program with busy polling		*/
+#define S_CMD_O_SPIOP_MULTI	0x1B	/* Perform a list of SPI operations		*/
+#define S_CMD_Q_BAUDRATES	0x1C	/* Query supported UART baud rates		*/
+#define S_CMD_S_BAUDRATE	0x1D	/* Switch UART baud rate			*/
+#define S_CMD_O_SPI_PROGRAM_RLE	0x1E	/* Like O_SPI_PROGRAM, run-length coded data	*/
+
+/* Number of rates returned by S_CMD_Q_BAUDRATES. */
+#define SP_MAX_BAUDRATES	8
+/* Time after which the programmer falls back to the old rate. */
+#define SP_BAUD_REVERT_MS	1000
+
+/* Fallback for chips without known page-program timing. */
+#define SERPROG_PAGE_MAX_US	(10 * 1000)
+
+/* Longest run-length coding of `len` bytes, cf. sp_rle_encode(). */
+#define SP_RLE_MAX_LEN(len)	((len) + ((len) + 127) / 128)
 
 #define MSGHEADER "serprog: "
 
@@ -96,10 +115,51 @@ static uint32_t sp_max_read_n = 0;
 static uint8_t *sp_write_n_buf;
 static uint32_t sp_write_n_bytes = 0;
 
+/* Replies to streamed commands that are still to be read, oldest first. */
+#define SP_MAX_PENDING		256
+static struct sp_pending {
+	uint32_t reqlen;	/* bytes the command takes in the device's serial buffer */
+	uint32_t retlen;	/* return data read into `retbuf` after the ACK */
+	void *retbuf;
+} sp_pending[SP_MAX_PENDING];
+static unsigned int sp_pending_first = 0;
+
 /* sp_streamed_* used for flow control checking */
 static unsigned int sp_streamed_transmit_ops = 0;
 static unsigned int sp_streamed_transmit_bytes = 0;
 
+/* Maximum number of outstanding commands with return data, see sp_stream_reply_op(). */
+#define SP_NET_PIPELINE		16
+static unsigned int sp_pipeline_depth = 1;
+/*
+ * Reads keep at least the next request queued while the current data streams
+ * in, unless the `pipeline` parameter asks for strict request/response.
+ */
+#define SP_READ_PIPELINE	2
+static unsigned int sp_read_depth = SP_READ_PIPELINE;
+static bool sp_is_socket = false;
+/* Send page payloads run-length coded, and how much that saved. */
+static bool sp_use_rle = false;
+static struct {
+	unsigned int pages;
+	unsigned int coded_pages;
+	unsigned long long data_bytes;
+	unsigned long long sent_bytes;
+} sp_rle_stats;
+/* The chip select given by the `cs` parameter, and the one in use relative to it. */
+static unsigned int sp_cs_base = 0;
+static unsigned int sp_cs_selected = 0;
+/* Socket buffer size requested for the ip= transport. */
+#define SP_NET_BUFSIZE		(1 * MiB)
+/* Chunk size of pipelined SPI reads. */
+#define SP_READ_CHUNK		(64 * KiB)
+
+/* Transmit buffer, sized like the device's serial buffer, that
+	coalesces commands until a reply is expected or it's full. */
+static uint8_t *sp_txbuf;
+static size_t sp_txbuf_size = 0;
+static size_t sp_txbuf_len = 0;
+
 /* sp_opbuf_usage used for counting the amount of
 	on-device operation buffer used */
 static int sp_opbuf_usage = 0;
@@ -110,7 +170,7 @@ static int sp_check_avail_automatic = 0;
 #if ! IS_WINDOWS
 static int sp_opensocket(char *ip, unsigned int port)
 {
-	int flag = 1;
+	int flag = 1, bufsize = SP_NET_BUFSIZE;
 	struct hostent *hostPtr = NULL;
 	union { struct sockaddr_in si; struct sockaddr s; } sp = {};
 	int sock;
@@ -144,6 +204,10 @@ static int sp_opensocket(char *ip, unsigned int port)
 		msg_perr("Error: serprog cannot set socket options: %s\n", strerror(errno));
 		return -1;
 	}
+	/* Large buffers keep pipelined requests and replies flowing. */
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) ||
+	    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)))
+		msg_pwarn(MSGHEADER "Warning: cannot set socket buffer sizes: %s\n", strerror(errno));
 	return sock;
 }
 #endif
@@ -267,17 +331,56 @@ static int sp_automatic_cmdcheck(uint8_t cmd)
 	return 0;
 }
 
-static int sp_docommand(uint8_t command, uint32_t parmlen,
-			uint8_t *params, uint32_t retlen, void *retparms)
+static int sp_tx_flush(void)
+{
+	if (!sp_txbuf_len)
+		return 0;
+	const int ret = serialport_write(sp_txbuf, sp_txbuf_len);
+	sp_txbuf_len = 0;
+	return ret;
+}
+
+/* Queue data for transmission. Data that doesn't fit into the buffer at all is written directly. */
+static int sp_tx_queue(const uint8_t *data, size_t len)
+{
+	if (!len)
+		return 0;
+	if (sp_txbuf_len + len > sp_txbuf_size) {
+		if (sp_tx_flush() != 0)
+			return 1;
+		if (len > sp_txbuf_size)
+			return serialport_write(data, len);
+	}
+	memcpy(sp_txbuf + sp_txbuf_len, data, len);
+	sp_txbuf_len += len;
+	return 0;
+}
+
+static int sp_flush_stream(void);
+
+/*
+ * A command can be sent in pieces: sp_cmd_begin() queues the op code,
+ * the parameters are queued with sp_tx_queue() and sp_cmd_finish()
+ * sends everything and reads the response. This way, parameters that
+ * are scattered over multiple buffers don't have to be copied together.
+ */
+static int sp_cmd_begin(uint8_t command)
 {
-	unsigned char c;
 	if (sp_automatic_cmdcheck(command))
 		return 1;
-	if (serialport_write(&command, 1) != 0) {
+	if (sp_streamed_transmit_ops && sp_flush_stream() != 0)
+		return 1;
+	if (sp_tx_queue(&command, 1) != 0) {
 		msg_perr("Error: cannot write op code: %s\n", strerror(errno));
 		return 1;
 	}
-	if (serialport_write(params, parmlen) != 0) {
+	return 0;
+}
+
+static int sp_cmd_finish(uint8_t command, uint32_t retlen, void *retparms)
+{
+	unsigned char c;
+	if (sp_tx_flush() != 0) {
 		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
 		return 1;
 	}
@@ -300,75 +403,348 @@ static int sp_docommand(uint8_t command, uint32_t parmlen,
 	return 0;
 }
 
-static int sp_flush_stream(void)
+static int sp_docommand(uint8_t command, uint32_t parmlen,
+			uint8_t *params, uint32_t retlen, void *retparms)
 {
-	if (sp_streamed_transmit_ops)
-		do {
-			unsigned char c;
-			if (serialport_read(&c, 1) != 0) {
-				msg_perr("Error: cannot read from device (flushing stream)");
-				return 1;
-			}
-			if (c == S_NAK) {
-				msg_perr("Error: NAK to a stream buffer operation\n");
-				return 1;
-			}
-			if (c != S_ACK) {
-				msg_perr("Error: Invalid reply 0x%02X from device\n", c);
-				return 1;
-			}
-		} while (--sp_streamed_transmit_ops);
-	sp_streamed_transmit_ops = 0;
-	sp_streamed_transmit_bytes = 0;
+	if (sp_cmd_begin(command))
+		return 1;
+	if (sp_tx_queue(params, parmlen) != 0) {
+		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
+		return 1;
+	}
+	return sp_cmd_finish(command, retlen, retparms);
+}
+
+/*
+ * The programmer picks the closest clock it supports that isn't above the
+ * requested one, and tells us.
+ */
+static int sp_set_spi_freq(const uint32_t f_spi_req, uint32_t *const f_spi)
+{
+	uint8_t buf[4];
+
+	buf[0] = (f_spi_req >> (0 * 8)) & 0xFF;
+	buf[1] = (f_spi_req >> (1 * 8)) & 0xFF;
+	buf[2] = (f_spi_req >> (2 * 8)) & 0xFF;
+	buf[3] = (f_spi_req >> (3 * 8)) & 0xFF;
+
+	if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf)) {
+		msg_pwarn(MSGHEADER "Setting SPI clock rate to %u Hz failed!\n", f_spi_req);
+		return 1;
+	}
+	*f_spi = buf[0];
+	*f_spi |= buf[1] << (1 * 8);
+	*f_spi |= buf[2] << (2 * 8);
+	*f_spi |= buf[3] << (3 * 8);
+	msg_pdbg(MSGHEADER "Requested to set SPI clock frequency to %u Hz. "
+		 "It was actually set to %u Hz\n", f_spi_req, *f_spi);
 	return 0;
 }
 
-static int sp_stream_buffer_op(uint8_t cmd, uint32_t parmlen, uint8_t *parms)
+/*
+ * Switch the programmer and the host to `baud` and check that the link is
+ * in sync at the new rate. Returns 0 on success, 1 if the programmer NAKed
+ * the rate (it stays at the old one) and 2 if the new rate doesn't work.
+ */
+static int sp_set_baud(const uint32_t baud)
 {
-	uint8_t *sp;
-	if (sp_automatic_cmdcheck(cmd))
+	uint8_t buf[4];
+	int i;
+
+	buf[0] = (baud >> (0 * 8)) & 0xFF;
+	buf[1] = (baud >> (1 * 8)) & 0xFF;
+	buf[2] = (baud >> (2 * 8)) & 0xFF;
+	buf[3] = (baud >> (3 * 8)) & 0xFF;
+
+	/* The programmer switches after sending the ACK. */
+	if (sp_docommand(S_CMD_S_BAUDRATE, 4, buf, 0, NULL))
 		return 1;
+	if (serialport_config(sp_fd, baud))
+		return 2;
+	internal_delay(10 * 1000);
+	sp_flush_incoming();
+
+	/* It stays at the new rate once it received a SYNCNOP there. */
+	for (i = 0; i < 3; i++) {
+		const int ret = sp_test_sync();
+		if (ret < 0)
+			return 2;
+		if (ret == 0)
+			return 0;
+	}
+	return 2;
+}
 
-	sp = malloc(1 + parmlen);
-	if (!sp) {
-		msg_perr("Error: cannot malloc command buffer\n");
+/* Go back to `baud` after the programmer timed out at a failed new rate. */
+static int sp_revert_baud(const int baud)
+{
+	if (serialport_config(sp_fd, baud))
 		return 1;
+	internal_sleep((SP_BAUD_REVERT_MS + 100) * 1000);
+	sp_flush_incoming();
+	return sp_synchronize();
+}
+
+static int sp_compare_baud(const void *const a, const void *const b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x < y) - (x > y);
+}
+
+/* Try the common baud rates from the fastest down, and stay at the first one that works. */
+static int sp_ramp_baud(void)
+{
+	uint8_t buf[SP_MAX_BAUDRATES * 4];
+	uint32_t rates[SP_MAX_BAUDRATES];
+	unsigned int i;
+
+	if (!sp_check_commandavail(S_CMD_Q_BAUDRATES) || !sp_check_commandavail(S_CMD_S_BAUDRATE)) {
+		msg_pdbg(MSGHEADER "Programmer can't switch its baud rate.\n");
+		return 0;
+	}
+	const int old_baud = serialport_get_baud(sp_fd);
+	if (old_baud <= 0) {
+		msg_pwarn(MSGHEADER "Unknown current baud rate, not switching.\n");
+		return 0;
 	}
-	sp[0] = cmd;
-	if (parms)
-		memcpy(&(sp[1]), parms, parmlen);
+	if (sp_docommand(S_CMD_Q_BAUDRATES, 0, NULL, sizeof(buf), buf)) {
+		msg_pwarn(MSGHEADER "NAK to query supported baud rates.\n");
+		return 0;
+	}
+	for (i = 0; i < SP_MAX_BAUDRATES; ++i)
+		rates[i] = buf[4 * i] | buf[4 * i + 1] << 8 | buf[4 * i + 2] << 16 |
+			   (uint32_t)buf[4 * i + 3] << 24;
+	qsort(rates, SP_MAX_BAUDRATES, sizeof(rates[0]), sp_compare_baud);
+
+	for (i = 0; i < SP_MAX_BAUDRATES && rates[i] > (uint32_t)old_baud; ++i) {
+		if ((i > 0 && rates[i] == rates[i - 1]) || rates[i] > INT_MAX ||
+		    !serialport_baud_supported(rates[i]))
+			continue;
 
-	if (sp_streamed_transmit_bytes >= (1 + parmlen + sp_device_serbuf_size)) {
-		if (sp_flush_stream() != 0) {
-			free(sp);
+		const int ret = sp_set_baud(rates[i]);
+		if (ret == 0) {
+			msg_pdbg(MSGHEADER "Serial speed is %u baud.\n", rates[i]);
+			return 0;
+		}
+		if (ret == 1) {
+			msg_pdbg(MSGHEADER "Programmer refused %u baud.\n", rates[i]);
+			continue;
+		}
+		msg_pdbg(MSGHEADER "Serial speed %u baud is unstable, reverting.\n", rates[i]);
+		if (sp_revert_baud(old_baud)) {
+			msg_perr("Lost connection to the programmer while probing baud rates.\n"
+				 "Please reset it and specify a baud rate with `dev=path:baud'.\n");
 			return 1;
 		}
 	}
-	if (serialport_write(sp, 1 + parmlen) != 0) {
+	msg_pdbg(MSGHEADER "Serial speed is %d baud.\n", old_baud);
+	return 0;
+}
+
+/*
+ * Read the reply to the oldest streamed command. Returns 0 on ACK, 1 on
+ * NAK and -1 if the stream is out of sync.
+ */
+static int sp_read_reply(void)
+{
+	const struct sp_pending *const p = &sp_pending[sp_pending_first];
+	unsigned char c;
+
+	sp_pending_first = (sp_pending_first + 1) % SP_MAX_PENDING;
+	sp_streamed_transmit_ops -= 1;
+	sp_streamed_transmit_bytes -= p->reqlen;
+
+	if (serialport_read(&c, 1) != 0) {
+		msg_perr("Error: cannot read from device (flushing stream)");
+		return -1;
+	}
+	if (c == S_NAK) {
+		msg_perr("Error: NAK to a stream buffer operation\n");
+		return 1;
+	}
+	if (c != S_ACK) {
+		msg_perr("Error: Invalid reply 0x%02X from device\n", c);
+		return -1;
+	}
+	if (p->retlen && serialport_read(p->retbuf, p->retlen) != 0) {
+		msg_perr("Error: cannot read return parameters: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void sp_reset_stream(void)
+{
+	sp_pending_first = 0;
+	sp_streamed_transmit_ops = 0;
+	sp_streamed_transmit_bytes = 0;
+}
+
+/*
+ * Read the replies to the oldest streamed commands that don't return data,
+ * which are a single byte each, with one read. Returns like sp_read_reply()
+ * for all of them, or 2 if the oldest command returns data.
+ */
+static int sp_read_acks(void)
+{
+	unsigned char acks[SP_MAX_PENDING];
+	unsigned int count, i;
+	int ret = 0;
+
+	for (count = 0; count < sp_streamed_transmit_ops; ++count) {
+		if (sp_pending[(sp_pending_first + count) % SP_MAX_PENDING].retlen)
+			break;
+	}
+	if (!count)
+		return 2;
+
+	if (serialport_read(acks, count) != 0) {
+		msg_perr("Error: cannot read from device (flushing stream)");
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		const struct sp_pending *const p = &sp_pending[sp_pending_first];
+
+		sp_pending_first = (sp_pending_first + 1) % SP_MAX_PENDING;
+		sp_streamed_transmit_ops -= 1;
+		sp_streamed_transmit_bytes -= p->reqlen;
+
+		if (acks[i] == S_NAK) {
+			msg_perr("Error: NAK to a stream buffer operation\n");
+			ret = 1;
+		} else if (acks[i] != S_ACK) {
+			msg_perr("Error: Invalid reply 0x%02X from device\n", acks[i]);
+			return -1;
+		}
+	}
+	return ret;
+}
+
+static int sp_flush_stream(void)
+{
+	int ret = 0;
+
+	if (sp_tx_flush() != 0) {
 		msg_perr("Error: cannot write command\n");
-		free(sp);
+		sp_reset_stream();
 		return 1;
 	}
+	while (sp_streamed_transmit_ops) {
+		int reply = sp_read_acks();
+		if (reply == 2)
+			reply = sp_read_reply();
+		if (reply < 0) {
+			sp_reset_stream();
+			return 1;
+		}
+		ret |= reply;
+	}
+	sp_reset_stream();
+	return ret;
+}
+
+/*
+ * Wait for replies until the device's serial buffer has room for another
+ * `reqlen` bytes and less than `max_ops` commands are outstanding.
+ */
+static int sp_stream_wait(uint32_t reqlen, unsigned int max_ops)
+{
+	while (sp_streamed_transmit_ops &&
+	       (sp_streamed_transmit_ops >= max_ops ||
+		sp_streamed_transmit_bytes + reqlen > sp_device_serbuf_size)) {
+		if (sp_tx_flush() != 0) {
+			msg_perr("Error: cannot write command\n");
+			sp_reset_stream();
+			return 1;
+		}
+		const int reply = sp_read_reply();
+		if (reply) {
+			/* Read the remaining replies, to stay in sync. */
+			if (reply > 0)
+				sp_flush_stream();
+			else
+				sp_reset_stream();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void sp_stream_push(uint32_t reqlen, uint32_t retlen, void *retbuf)
+{
+	struct sp_pending *const p =
+		&sp_pending[(sp_pending_first + sp_streamed_transmit_ops) % SP_MAX_PENDING];
+
+	p->reqlen = reqlen;
+	p->retlen = retlen;
+	p->retbuf = retbuf;
 	sp_streamed_transmit_ops += 1;
-	sp_streamed_transmit_bytes += 1 + parmlen;
+	sp_streamed_transmit_bytes += reqlen;
+}
+
+static int sp_stream_op(uint8_t cmd, uint32_t parmlen, const uint8_t *parms,
+			uint32_t retlen, void *retbuf, unsigned int max_ops)
+{
+	if (sp_automatic_cmdcheck(cmd))
+		return 1;
+
+	if (sp_stream_wait(1 + parmlen, max_ops) != 0)
+		return 1;
+	if (sp_tx_queue(&cmd, 1) != 0 || sp_tx_queue(parms, parms ? parmlen : 0) != 0) {
+		msg_perr("Error: cannot write command\n");
+		return 1;
+	}
+	sp_stream_push(1 + parmlen, retlen, retbuf);
 
-	free(sp);
 	return 0;
 }
 
+static int sp_stream_buffer_op(uint8_t cmd, uint32_t parmlen, uint8_t *parms)
+{
+	return sp_stream_op(cmd, parmlen, parms, 0, NULL, SP_MAX_PENDING);
+}
+
+/*
+ * Send a command without waiting for its reply. The return data is read
+ * into `retbuf` later, at the latest by sp_flush_stream(). At most
+ * `sp_pipeline_depth` commands are outstanding.
+ */
+static int sp_stream_reply_op(uint8_t cmd, uint32_t parmlen, const uint8_t *parms,
+			      uint32_t retlen, void *retbuf)
+{
+	return sp_stream_op(cmd, parmlen, parms, retlen, retbuf, sp_pipeline_depth);
+}
+
+/* Like sp_stream_reply_op(), for reads, with at most `sp_read_depth` commands outstanding. */
+static int sp_stream_read_op(uint8_t cmd, uint32_t parmlen, const uint8_t *parms,
+			     uint32_t retlen, void *retbuf)
+{
+	return sp_stream_op(cmd, parmlen, parms, retlen, retbuf, sp_read_depth);
+}
+
 static int serprog_spi_send_command(const struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
 				    unsigned char *readarr);
+static int serprog_spi_checksum(struct flashctx *flash, unsigned int start,
+				unsigned int len, uint32_t *crc);
+static int serprog_spi_write_256(struct flashctx *flash, const uint8_t *buf,
+				 unsigned int start, unsigned int len);
+static int serprog_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds);
+static int serprog_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
+static size_t serprog_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds);
+static int serprog_spi_set_speed(const struct flashctx *flash, unsigned long hz);
 static struct spi_master spi_master_serprog = {
 	.features	= SPI_MASTER_4BA,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= serprog_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= serprog_spi_read,
 	.write_256	= default_spi_write_256,
 	.probe_opcode	= default_spi_probe_opcode,
+	.list_speeds	= serprog_spi_list_speeds,
+	.set_speed	= serprog_spi_set_speed,
 };
 
 static void serprog_chip_writeb(const struct flashctx *flash, uint8_t val,
@@ -400,6 +776,16 @@ static int serprog_init(struct flashprog_programmer *const prog)
 	unsigned char c;
 	char *device;
 	bool have_device = false;
+	bool auto_baud = false;
+
+	char *const lowlatency = extract_programmer_param("lowlatency");
+	const bool low_latency = lowlatency && !strcmp(lowlatency, "yes");
+	if (lowlatency && !low_latency && strcmp(lowlatency, "no")) {
+		msg_perr("Error: Invalid lowlatency value `%s', use yes or no.\n", lowlatency);
+		free(lowlatency);
+		return 1;
+	}
+	free(lowlatency);
 
 	/* the parameter is either of format "dev=/dev/device[:baud]" or "ip=ip:port" */
 	device = extract_programmer_param("dev");
@@ -417,6 +803,9 @@ static int serprog_init(struct flashprog_programmer *const prog)
 		if (baud_str == NULL || *baud_str == '\0') {
 			baud = -1;
 			msg_pdbg("No baudrate specified, using the hardware's defaults.\n");
+		} else if (!strcmp(baud_str, "auto")) {
+			baud = -1;
+			auto_baud = true;
 		} else {
 			baud = atoi(baud_str); // FIXME: replace atoi with strtoul
 		}
@@ -426,6 +815,8 @@ static int serprog_init(struct flashprog_programmer *const prog)
 				free(device);
 				return 1;
 			}
+			if (low_latency)
+				sp_set_low_latency(device);
 			have_device = true;
 		}
 	}
@@ -466,6 +857,7 @@ static int serprog_init(struct flashprog_programmer *const prog)
 				return 1;
 			}
 			have_device = true;
+			sp_is_socket = true;
 		}
 	}
 	if (device && !strlen(device)) {
@@ -489,6 +881,37 @@ static int serprog_init(struct flashprog_programmer *const prog)
 		return 1;
 	}
 
+	sp_pipeline_depth = sp_is_socket ? SP_NET_PIPELINE : 1;
+	char *const pipeline = extract_programmer_param("pipeline");
+	if (pipeline) {
+		char *endptr;
+		errno = 0;
+		const unsigned long depth = strtoul(pipeline, &endptr, 0);
+		if (!*pipeline || errno || *endptr || depth < 1 || depth > SP_MAX_PENDING) {
+			msg_perr("Error: Invalid pipeline depth `%s', use 1..%u.\n", pipeline, SP_MAX_PENDING);
+			free(pipeline);
+			goto init_err_cleanup_exit;
+		}
+		sp_pipeline_depth = depth;
+		sp_read_depth = depth;
+		free(pipeline);
+	} else {
+		sp_read_depth = max(sp_pipeline_depth, SP_READ_PIPELINE);
+	}
+
+	bool compress = true;
+	char *const compress_param = extract_programmer_param("compress");
+	if (compress_param) {
+		if (!strcmp(compress_param, "no")) {
+			compress = false;
+		} else if (strcmp(compress_param, "yes")) {
+			msg_perr("Error: compress can be `yes' or `no'.\n");
+			free(compress_param);
+			goto init_err_cleanup_exit;
+		}
+		free(compress_param);
+	}
+
 	msg_pdbg(MSGHEADER "connected");
 
 	sp_check_avail_automatic = 0;
@@ -517,6 +940,9 @@ static int serprog_init(struct flashprog_programmer *const prog)
 
 	sp_check_avail_automatic = 1;
 
+	if (auto_baud && sp_ramp_baud())
+		goto init_err_cleanup_exit;
+
 	/* FIXME: This assumes that serprog device bustypes are always
 	 * identical with flashprog bustype enums and that they all fit
 	 * in a single byte.
@@ -567,10 +993,16 @@ static int serprog_init(struct flashprog_programmer *const prog)
 			spi_master_serprog.max_data_read = v;
 			msg_pdbg(MSGHEADER "Maximum read-n length is %d\n", v);
 		}
+		spi_master_serprog.tune_speed = false;
+		spi_master_serprog.clock_hz = 0;
 		spispeed = extract_programmer_param("spispeed");
-		if (spispeed && strlen(spispeed)) {
+		if (spispeed && !strcasecmp(spispeed, "auto")) {
+			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0)
+				msg_pwarn(MSGHEADER "Warning: Setting the SPI clock rate is not supported!\n");
+			else
+				spi_master_serprog.tune_speed = true;
+		} else if (spispeed && strlen(spispeed)) {
 			uint32_t f_spi_req, f_spi;
-			uint8_t buf[4];
 			char *f_spi_suffix;
 
 			errno = 0;
@@ -596,25 +1028,13 @@ static int serprog_init(struct flashprog_programmer *const prog)
 				goto init_err_cleanup_exit;
 			}
 
-			buf[0] = (f_spi_req >> (0 * 8)) & 0xFF;
-			buf[1] = (f_spi_req >> (1 * 8)) & 0xFF;
-			buf[2] = (f_spi_req >> (2 * 8)) & 0xFF;
-			buf[3] = (f_spi_req >> (3 * 8)) & 0xFF;
-
-			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0) {
+			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0)
 				msg_pwarn(MSGHEADER "Warning: Setting the SPI clock rate is not supported!\n");
-			} else if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf) == 0) {
-				f_spi = buf[0];
-				f_spi |= buf[1] << (1 * 8);
-				f_spi |= buf[2] << (2 * 8);
-				f_spi |= buf[3] << (3 * 8);
-				msg_pdbg(MSGHEADER "Requested to set SPI clock frequency to %u Hz. "
-					 "It was actually set to %u Hz\n", f_spi_req, f_spi);
-			} else {
-				msg_pwarn(MSGHEADER "Setting SPI clock rate to %u Hz failed!\n", f_spi_req);
-			}
+			else if (!sp_set_spi_freq(f_spi_req, &f_spi))
+				spi_master_serprog.clock_hz = f_spi;
 		}
 		free(spispeed);
+		sp_cs_base = sp_cs_selected = 0;
 		cs = extract_programmer_param("cs");
 		if (cs) {
 			char *endptr = NULL;
@@ -638,6 +1058,31 @@ static int serprog_init(struct flashprog_programmer *const prog)
 				         "by programmer!\n", cs_num8);
 				goto init_err_cleanup_exit;
 			}
+			sp_cs_base = cs_num;
+		}
+		/* Further chip selects follow the first one, cf. sp_select_cs(). */
+		spi_master_serprog.chip_selects =
+			sp_check_commandavail(S_CMD_S_SPI_CS) ? 256 - sp_cs_base : 0;
+		if (sp_check_commandavail(S_CMD_O_SPI_CRC32)) {
+			msg_pdbg(MSGHEADER "Using on-programmer checksums for verification.\n");
+			spi_master_serprog.checksum = serprog_spi_checksum;
+		}
+		sp_use_rle = compress && sp_check_commandavail(S_CMD_O_SPI_PROGRAM_RLE);
+		memset(&sp_rle_stats, 0, sizeof(sp_rle_stats));
+		if (sp_check_commandavail(S_CMD_O_SPI_PROGRAM) || sp_use_rle) {
+			msg_pdbg(MSGHEADER "Using on-programmer page programming%s.\n",
+				 sp_use_rle ? " with run-length coded data" : "");
+			spi_master_serprog.write_256 = serprog_spi_write_256;
+		} else {
+			spi_master_serprog.write_256 = default_spi_write_256;
+		}
+		if (sp_check_commandavail(S_CMD_O_SPIOP_MULTI)) {
+			msg_pdbg(MSGHEADER "Using batched SPI operations.\n");
+			spi_master_serprog.multicommand = serprog_spi_send_multicommand;
+			spi_master_serprog.features |= SPI_MASTER_GATHER;
+		} else {
+			spi_master_serprog.multicommand = default_spi_send_multicommand;
+			spi_master_serprog.features &= ~SPI_MASTER_GATHER;
 		}
 		bt = serprog_buses_supported;
 		if (sp_docommand(S_CMD_S_BUSTYPE, 1, &bt, 0, NULL))
@@ -724,6 +1169,12 @@ static int serprog_init(struct flashprog_programmer *const prog)
 	msg_pdbg(MSGHEADER "Serial buffer size is %d\n",
 		     sp_device_serbuf_size);
 
+	sp_txbuf = malloc(sp_device_serbuf_size);
+	if (sp_txbuf)
+		sp_txbuf_size = sp_device_serbuf_size;
+	else
+		msg_pwarn("Warning: cannot allocate transmit buffer, writing commands one by one\n");
+
 	if (sp_check_commandavail(S_CMD_O_INIT)) {
 		/* This would be inconsistent. */
 		if (sp_check_commandavail(S_CMD_O_EXEC) == 0) {
@@ -803,16 +1254,17 @@ static int sp_pass_writen(void)
 	header[4] = (sp_write_n_addr >> 0) & 0xFF;
 	header[5] = (sp_write_n_addr >> 8) & 0xFF;
 	header[6] = (sp_write_n_addr >> 16) & 0xFF;
-	if (serialport_write(header, 7) != 0) {
+	if (sp_stream_wait(7 + sp_write_n_bytes, SP_MAX_PENDING) != 0)
+		return 1;
+	if (sp_tx_queue(header, 7) != 0) {
 		msg_perr(MSGHEADER "Error: cannot write write-n command\n");
 		return 1;
 	}
-	if (serialport_write(sp_write_n_buf, sp_write_n_bytes) != 0) {
+	if (sp_tx_queue(sp_write_n_buf, sp_write_n_bytes) != 0) {
 		msg_perr(MSGHEADER "Error: cannot write write-n data");
 		return 1;
 	}
-	sp_streamed_transmit_bytes += 7 + sp_write_n_bytes;
-	sp_streamed_transmit_ops += 1;
+	sp_stream_push(7 + sp_write_n_bytes, 0, NULL);
 	sp_opbuf_usage += 7 + sp_write_n_bytes;
 	sp_write_n_bytes = 0;
 	sp_prev_was_write = 0;
@@ -859,10 +1311,24 @@ static int serprog_shutdown(void *data)
 		else
 			msg_pwarn(MSGHEADER "%s: Warning: could not disable output buffers\n", __func__);
 	}
+	if (sp_rle_stats.pages) {
+		msg_pdbg(MSGHEADER "Sent %llu of %llu bytes of page data (%llu%%), "
+			 "%u of %u pages run-length coded.\n",
+			 sp_rle_stats.sent_bytes, sp_rle_stats.data_bytes,
+			 sp_rle_stats.sent_bytes * 100 / sp_rle_stats.data_bytes,
+			 sp_rle_stats.coded_pages, sp_rle_stats.pages);
+	}
+	sp_use_rle = false;
 	/* FIXME: fix sockets on windows(?), especially closing */
 	serialport_shutdown(&sp_fd);
 	if (sp_max_write_n)
 		free(sp_write_n_buf);
+	free(sp_txbuf);
+	sp_txbuf = NULL;
+	sp_txbuf_size = 0;
+	sp_txbuf_len = 0;
+	sp_reset_stream();
+	sp_is_socket = false;
 	return 0;
 }
 
@@ -929,24 +1395,19 @@ static uint8_t serprog_chip_readb(const struct flashctx *flash,
 	return c;
 }
 
-/* Local version that really does the job, doesn't care of max_read_n. */
+/* Local version that really does the job, doesn't care of max_read_n. The
+   data is read into `buf` when the reply comes in, see sp_stream_read_op(). */
 static int sp_do_read_n(uint8_t * buf, const chipaddr addr, size_t len)
 {
 	unsigned char sbuf[6];
 	msg_pspew("%s: addr=0x%" PRIxPTR " len=%zu\n", __func__, addr, len);
-	/* Stream the read-n -- as above. */
-	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes))
-		sp_execute_opbuf_noflush();
 	sbuf[0] = ((addr >> 0) & 0xFF);
 	sbuf[1] = ((addr >> 8) & 0xFF);
 	sbuf[2] = ((addr >> 16) & 0xFF);
 	sbuf[3] = ((len >> 0) & 0xFF);
 	sbuf[4] = ((len >> 8) & 0xFF);
 	sbuf[5] = ((len >> 16) & 0xFF);
-	sp_stream_buffer_op(S_CMD_R_NBYTES, 6, sbuf);
-	if (sp_flush_stream() != 0)
-		return 1;
-	if (serialport_read(buf, len) != 0) {
+	if (sp_stream_read_op(S_CMD_R_NBYTES, 6, sbuf, len, buf) != 0) {
 		msg_perr(MSGHEADER "Error: cannot read read-n data");
 		return 1;
 	}
@@ -959,16 +1420,21 @@ static void serprog_chip_readn(const struct flashctx *flash, uint8_t * buf,
 {
 	size_t lenm = len;
 	chipaddr addrm = addr;
+	/* Stream the read-n's -- as above. */
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes))
+		sp_execute_opbuf_noflush();
 	while ((sp_max_read_n != 0) && (lenm > sp_max_read_n)) {
-		sp_do_read_n(&(buf[addrm-addr]), addrm, sp_max_read_n); // FIXME: return error
+		if (sp_do_read_n(&(buf[addrm-addr]), addrm, sp_max_read_n))
+			return; // FIXME: return error
 		addrm += sp_max_read_n;
 		lenm -= sp_max_read_n;
 	}
-	if (lenm)
-		sp_do_read_n(&(buf[addrm-addr]), addrm, lenm); // FIXME: return error
+	if (lenm && sp_do_read_n(&(buf[addrm-addr]), addrm, lenm))
+		return; // FIXME: return error
+	sp_flush_stream(); // FIXME: return error
 }
 
-static void serprog_delay(unsigned int usecs)
+static void serprog_delay(struct flashprog_programmer *prog, unsigned int usecs)
 {
 	unsigned char buf[4];
 	msg_pspew("%s usecs=%d\n", __func__, usecs);
@@ -989,14 +1455,299 @@ static void serprog_delay(unsigned int usecs)
 	sp_prev_was_write = 0;
 }
 
+/* Switch to the chip select of `flash`, if we used another one last. */
+static int sp_select_cs(const struct flashctx *const flash)
+{
+	if (flash->chip_select == sp_cs_selected)
+		return 0;
+
+	uint8_t cs = sp_cs_base + flash->chip_select;
+	if (sp_docommand(S_CMD_S_SPI_CS, 1, &cs, 0, NULL)) {
+		msg_perr("Error: Chip select %u not supported by programmer!\n", cs);
+		return 1;
+	}
+	sp_cs_selected = flash->chip_select;
+	return 0;
+}
+
+/* Queue the length header and write data of a SPI operation. */
+static int sp_queue_spiop(const struct spi_command *cmd)
+{
+	const unsigned int writecnt = cmd->writecnt + cmd->datacnt;
+	const uint8_t header[6] = {
+		(writecnt >> 0) & 0xff, (writecnt >> 8) & 0xff, (writecnt >> 16) & 0xff,
+		(cmd->readcnt >> 0) & 0xff, (cmd->readcnt >> 8) & 0xff, (cmd->readcnt >> 16) & 0xff,
+	};
+
+	if (sp_tx_queue(header, sizeof(header)) != 0 ||
+	    sp_tx_queue(cmd->writearr, cmd->writecnt) != 0 ||
+	    sp_tx_queue(cmd->dataarr, cmd->datacnt) != 0) {
+		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int serprog_spi_send_op(const struct flashctx *flash, const struct spi_command *cmd)
+{
+	msg_pspew("%s, writecnt=%u, readcnt=%u\n", __func__, cmd->writecnt + cmd->datacnt, cmd->readcnt);
+	if (sp_select_cs(flash))
+		return 1;
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+
+	if (sp_cmd_begin(S_CMD_O_SPIOP) || sp_queue_spiop(cmd))
+		return 1;
+	return sp_cmd_finish(S_CMD_O_SPIOP, cmd->readcnt, cmd->readarr);
+}
+
 static int serprog_spi_send_command(const struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
 				    unsigned char *readarr)
 {
-	unsigned char *parmbuf;
-	int ret;
-	msg_pspew("%s, writecnt=%i, readcnt=%i\n", __func__, writecnt, readcnt);
+	const struct spi_command cmd = {
+		.writecnt	= writecnt,
+		.readcnt	= readcnt,
+		.writearr	= writearr,
+		.readarr	= readarr,
+	};
+
+	return serprog_spi_send_op(flash, &cmd);
+}
+
+/* Send up to `count` commands of the list in one O_SPIOP_MULTI frame. */
+static int serprog_spi_send_multi(const struct spi_command *cmds, unsigned int count)
+{
+	unsigned int i, total_read = 0, rpos;
+	unsigned char *readbuf = NULL;
+	const uint8_t count8 = count;
+	int ret = 1;
+
+	for (i = 0; i < count; ++i)
+		total_read += cmds[i].readcnt;
+
+	if (total_read) {
+		readbuf = malloc(total_read);
+		if (!readbuf) {
+			msg_perr("Error: could not allocate SPI multi-op buffer.\n");
+			return 1;
+		}
+	}
+
+	if (sp_cmd_begin(S_CMD_O_SPIOP_MULTI))
+		goto _free_ret;
+	if (sp_tx_queue(&count8, 1) != 0) {
+		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
+		goto _free_ret;
+	}
+	for (i = 0; i < count; ++i) {
+		if (sp_queue_spiop(&cmds[i]))
+			goto _free_ret;
+	}
+	if (sp_cmd_finish(S_CMD_O_SPIOP_MULTI, total_read, readbuf))
+		goto _free_ret;
+
+	for (i = 0, rpos = 0; i < count; ++i) {
+		if (cmds[i].readcnt)
+			memcpy(cmds[i].readarr, readbuf + rpos, cmds[i].readcnt);
+		rpos += cmds[i].readcnt;
+	}
+	ret = 0;
+
+_free_ret:
+	free(readbuf);
+	return ret;
+}
+
+/*
+ * Send as many commands per O_SPIOP_MULTI frame as the programmer's
+ * write-n and read-n limits allow. Commands that exceed these limits
+ * on their own are left to serprog_spi_send_command().
+ */
+static int serprog_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
+{
+	const struct spi_master *const mst = flash->mst.spi;
+	const struct spi_command *cmd;
+
+	if (sp_select_cs(flash))
+		return 1;
+
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; cmd++) {
+		if (cmd->io_mode != SINGLE_IO_1_1_1) {
+			msg_perr("%s called with multi-I/O command.\n"
+				 "Please report a bug at flashprog@flashprog.org\n", __func__);
+			return SPI_FLASHPROG_BUG;
+		}
+	}
+
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+
+	while (cmds->writecnt || cmds->readcnt) {
+		unsigned int count = 0, write_len = 0, read_len = 0;
+
+		for (; count < 255 && (cmds[count].writecnt || cmds[count].readcnt); ++count) {
+			const unsigned int writecnt = cmds[count].writecnt + cmds[count].datacnt;
+			if (write_len + writecnt > mst->max_data_write ||
+			    read_len + cmds[count].readcnt > mst->max_data_read)
+				break;
+			write_len += writecnt;
+			read_len += cmds[count].readcnt;
+		}
+
+		if (count == 0) {
+			if (serprog_spi_send_op(flash, cmds))
+				return 1;
+			++cmds;
+			continue;
+		}
+
+		if (serprog_spi_send_multi(cmds, count))
+			return 1;
+		cmds += count;
+	}
+	return 0;
+}
+
+static unsigned int sp_rle_literals(uint8_t *out, unsigned int pos, const uint8_t *data, unsigned int len)
+{
+	while (len) {
+		const unsigned int n = min(len, 128);
+		out[pos++] = n - 1;
+		memcpy(out + pos, data, n);
+		pos += n;
+		data += n;
+		len -= n;
+	}
+	return pos;
+}
+
+/*
+ * Run-length code `len` bytes of `data` into `out`, that has to hold
+ * SP_RLE_MAX_LEN(len) bytes. A control byte c < 0x80 is followed by
+ * c + 1 literal bytes, c >= 0x80 by a single byte that is repeated
+ * (c & 0x7f) + 3 times. Returns the coded length.
+ */
+static unsigned int sp_rle_encode(uint8_t *out, const uint8_t *data, const unsigned int len)
+{
+	unsigned int i = 0, literals = 0, pos = 0;
+
+	while (i < len) {
+		unsigned int run = 1;
+		while (i + run < len && run < 130 && data[i + run] == data[i])
+			++run;
+		if (run < 3) {
+			i += run;
+			continue;
+		}
+		pos = sp_rle_literals(out, pos, data + literals, i - literals);
+		out[pos++] = 0x80 | (run - 3);
+		out[pos++] = data[i];
+		i += run;
+		literals = i;
+	}
+	return sp_rle_literals(out, pos, data + literals, len - literals);
+}
+
+/*
+ * Queue an O_SPI_PROGRAM, its final status is read into `status` by sp_flush_stream() at the latest.
+ * With `sp_use_rle`, the data is sent run-length coded if that is shorter.
+ */
+static int serprog_spi_program(const uint8_t op, const unsigned int addr_len,
+			       const unsigned int addr, const uint8_t *data, const unsigned int len,
+			       const unsigned int timeout_us, uint8_t *status)
+{
+	unsigned char parmbuf[18 + SP_RLE_MAX_LEN(256)];
+
+	parmbuf[0] = op;
+	parmbuf[1] = addr_len;
+	parmbuf[2] = (addr >> 0) & 0xff;
+	parmbuf[3] = (addr >> 8) & 0xff;
+	parmbuf[4] = (addr >> 16) & 0xff;
+	parmbuf[5] = (addr >> 24) & 0xff;
+	parmbuf[6] = (len >> 0) & 0xff;
+	parmbuf[7] = (len >> 8) & 0xff;
+	parmbuf[8] = (len >> 16) & 0xff;
+	parmbuf[9] = JEDEC_RDSR;
+	parmbuf[10] = SPI_SR_WIP;
+	parmbuf[11] = (timeout_us >> 0) & 0xff;
+	parmbuf[12] = (timeout_us >> 8) & 0xff;
+	parmbuf[13] = (timeout_us >> 16) & 0xff;
+	parmbuf[14] = (timeout_us >> 24) & 0xff;
+
+	if (sp_use_rle) {
+		const unsigned int coded_len = sp_rle_encode(parmbuf + 18, data, len);
+
+		++sp_rle_stats.pages;
+		sp_rle_stats.data_bytes += len;
+		if (coded_len < len || !sp_check_commandavail(S_CMD_O_SPI_PROGRAM)) {
+			msg_pspew(MSGHEADER "Page data at 0x%06x coded from %u to %u bytes.\n",
+				  addr, len, coded_len);
+			++sp_rle_stats.coded_pages;
+			sp_rle_stats.sent_bytes += coded_len;
+			parmbuf[15] = (coded_len >> 0) & 0xff;
+			parmbuf[16] = (coded_len >> 8) & 0xff;
+			parmbuf[17] = (coded_len >> 16) & 0xff;
+			if (sp_stream_reply_op(S_CMD_O_SPI_PROGRAM_RLE, 18 + coded_len, parmbuf, 1, status)) {
+				msg_perr("Error: Programming 0x%06x failed.\n", addr);
+				return 1;
+			}
+			return 0;
+		}
+		sp_rle_stats.sent_bytes += len;
+	}
+
+	memcpy(parmbuf + 15, data, len);
+	if (sp_stream_reply_op(S_CMD_O_SPI_PROGRAM, 15 + len, parmbuf, 1, status)) {
+		msg_perr("Error: Programming 0x%06x failed.\n", addr);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Let the programmer issue WREN, the page program and the status polling
+ * itself, so that every page takes a single round trip only. Up to
+ * `sp_pipeline_depth` pages are sent before their results are checked.
+ */
+static int serprog_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const struct wip_timing *const timing = &flash->chip->spi_timing.page_program;
+	const unsigned int timeout_us = timing->max_us ? timing->max_us : SERPROG_PAGE_MAX_US;
+	const unsigned int page_size = flash->chip->page_size;
+	const unsigned int chunk_size = min(min(page_size, 256), flash->mst.spi->max_data_write);
+	const bool native_4ba = flash->chip->feature_bits & FEATURE_4BA_WRITE && spi_master_4ba(flash);
+	const uint8_t op = native_4ba ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
+	const unsigned int addr_len = native_4ba || flash->in_4ba_mode ? 4 : 3;
+	const unsigned int end = start + len;
+	unsigned int addrs[SP_MAX_PENDING];
+	uint8_t status[SP_MAX_PENDING];
+	unsigned int pos;
+
+	if (!page_size || !len)
+		return default_spi_write_256(flash, buf, start, len);
+	if (sp_select_cs(flash))
+		return 1;
+
+	if (addr_len == 3) {
+		/* spi_chip_write_256() doesn't cross 16 MiB boundaries. */
+		if (flash->chip->feature_bits & FEATURE_4BA_EAR_ANY) {
+			if (spi_set_extended_address(flash, start >> 24))
+				return 1;
+		} else if ((end - 1) >> 24) {
+			return default_spi_write_256(flash, buf, start, len);
+		}
+	}
+
 	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
 		if (sp_execute_opbuf() != 0) {
 			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
@@ -1004,22 +1755,172 @@ static int serprog_spi_send_command(const struct flashctx *flash,
 		}
 	}
 
-	parmbuf = malloc(writecnt + 6);
-	if (!parmbuf) {
-		msg_perr("Error: could not allocate SPI send param buffer.\n");
+	for (pos = start; pos < end; ) {
+		const unsigned int batch_start = pos;
+		unsigned int count, i;
+
+		if (flashprog_cancelled(flash))
+			return 1;
+
+		for (count = 0; count < sp_pipeline_depth && pos < end; ++count) {
+			/* Don't cross page boundaries. */
+			const unsigned int page_end = min((pos / page_size + 1) * page_size, end);
+			const unsigned int towrite = min(chunk_size, page_end - pos);
+
+			addrs[count] = pos;
+			if (serprog_spi_program(op, addr_len, pos, buf + pos - start, towrite,
+						timeout_us, &status[count]))
+				return 1;
+			pos += towrite;
+		}
+		if (sp_flush_stream() != 0)
+			return 1;
+
+		for (i = 0; i < count; ++i) {
+			if (status[i] & SPI_SR_WIP) {
+				msg_perr("Error: Timeout programming 0x%06x (status 0x%02x).\n",
+					 addrs[i], status[i]);
+				return 1;
+			}
+		}
+		flashprog_progress_add(flash, pos - batch_start);
+	}
+	return 0;
+}
+
+/*
+ * Write a read command for `len` bytes at `start` to `cmd`, that has to
+ * hold 5 bytes. Returns the length of the command or 0 if it would need
+ * an extended address register.
+ */
+static unsigned int serprog_spi_read_cmd(const struct flashctx *flash, uint8_t *cmd,
+					 unsigned int start, unsigned int len)
+{
+	if (flash->chip->feature_bits & FEATURE_4BA_READ || flash->in_4ba_mode) {
+		cmd[0] = flash->in_4ba_mode ? JEDEC_READ : JEDEC_READ_4BA;
+		cmd[1] = (start >> 24) & 0xff;
+		cmd[2] = (start >> 16) & 0xff;
+		cmd[3] = (start >> 8) & 0xff;
+		cmd[4] = (start >> 0) & 0xff;
+		return 5;
+	}
+	/* Don't try to handle extended address registers here. */
+	if (start + len > 16 * MiB ||
+	    (flash->chip->total_size * KiB > 16 * MiB && flash->address_high_byte != 0))
+		return 0;
+	cmd[0] = JEDEC_READ;
+	cmd[1] = (start >> 16) & 0xff;
+	cmd[2] = (start >> 8) & 0xff;
+	cmd[3] = (start >> 0) & 0xff;
+	return 4;
+}
+
+/*
+ * Keep up to `sp_pipeline_depth` reads in flight, so the round-trip
+ * time is paid once instead of once per chunk.
+ */
+static int serprog_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int chunk_size = min(flash->mst.spi->max_data_read, SP_READ_CHUNK);
+	unsigned int pos, to_read;
+
+	if (sp_read_depth < 2)
+		return default_spi_read(flash, buf, start, len);
+	if (sp_select_cs(flash))
 		return 1;
+
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
 	}
-	parmbuf[0] = (writecnt >> 0) & 0xFF;
-	parmbuf[1] = (writecnt >> 8) & 0xFF;
-	parmbuf[2] = (writecnt >> 16) & 0xFF;
-	parmbuf[3] = (readcnt >> 0) & 0xFF;
-	parmbuf[4] = (readcnt >> 8) & 0xFF;
-	parmbuf[5] = (readcnt >> 16) & 0xFF;
-	memcpy(parmbuf + 6, writearr, writecnt);
-	ret = sp_docommand(S_CMD_O_SPIOP, writecnt + 6, parmbuf, readcnt,
-			   readarr);
-	free(parmbuf);
-	return ret;
+
+	for (pos = 0; pos < len; pos += to_read) {
+		unsigned char parmbuf[6 + 5];
+		unsigned int slen;
+
+		to_read = min(chunk_size, len - pos);
+		slen = serprog_spi_read_cmd(flash, parmbuf + 6, start + pos, to_read);
+		if (flashprog_cancelled(flash) || !slen) {
+			if (sp_flush_stream() != 0)
+				return 1;
+			if (!slen)
+				return default_spi_read(flash, buf + pos, start + pos, len - pos);
+			return 1;
+		}
+		parmbuf[0] = (slen >> 0) & 0xff;
+		parmbuf[1] = (slen >> 8) & 0xff;
+		parmbuf[2] = (slen >> 16) & 0xff;
+		parmbuf[3] = (to_read >> 0) & 0xff;
+		parmbuf[4] = (to_read >> 8) & 0xff;
+		parmbuf[5] = (to_read >> 16) & 0xff;
+		if (sp_stream_read_op(S_CMD_O_SPIOP, 6 + slen, parmbuf, to_read, buf + pos) != 0)
+			return 1;
+		flashprog_progress_add(flash, to_read);
+	}
+	return sp_flush_stream();
+}
+
+/* Clock steps tried by `spispeed=auto', in Hz. */
+static const unsigned long auto_speeds[] = {
+	1000000, 2000000, 4000000, 8000000, 12000000, 16000000,
+	24000000, 32000000, 48000000, 64000000,
+};
+
+static size_t serprog_spi_list_speeds(const struct flashctx *flash, const unsigned long **speeds)
+{
+	*speeds = auto_speeds;
+	return ARRAY_SIZE(auto_speeds);
+}
+
+static int serprog_spi_set_speed(const struct flashctx *flash, unsigned long hz)
+{
+	uint32_t f_spi;
+
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+	return sp_set_spi_freq(hz, &f_spi);
+}
+
+/* Returns 0 on success, 1 if the checksum can't be calculated. */
+static int serprog_spi_checksum(struct flashctx *flash, unsigned int start,
+				unsigned int len, uint32_t *crc)
+{
+	unsigned char parmbuf[7 + 5];
+	unsigned char crcbuf[4];
+	unsigned int slen;
+
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+	if (sp_select_cs(flash))
+		return 1;
+
+	slen = serprog_spi_read_cmd(flash, parmbuf + 7, start, len);
+	if (!slen)
+		return 1;
+	parmbuf[0] = (slen >> 0) & 0xff;
+	parmbuf[1] = (slen >> 8) & 0xff;
+	parmbuf[2] = (slen >> 16) & 0xff;
+	parmbuf[3] = (len >> 0) & 0xff;
+	parmbuf[4] = (len >> 8) & 0xff;
+	parmbuf[5] = (len >> 16) & 0xff;
+	parmbuf[6] = (len >> 24) & 0xff;
+
+	if (sp_docommand(S_CMD_O_SPI_CRC32, 7 + slen, parmbuf, sizeof(crcbuf), crcbuf))
+		return 1;
+
+	*crc = (uint32_t)crcbuf[0] << 0 | (uint32_t)crcbuf[1] << 8 |
+	       (uint32_t)crcbuf[2] << 16 | (uint32_t)crcbuf[3] << 24;
+	return 0;
 }
 
 static void *serprog_map(const char *descr, uintptr_t phys_addr, size_t len)
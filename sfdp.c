@@ -13,11 +13,16 @@
  * GNU General Public License for more details.
  */
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include "flash.h"
+#include "flashchips.h"
 #include "spi.h"
+#include "sfdp.h"
 #include "chipdrivers.h"
 
 static int spi_sfdp_read_sfdp_chunk(struct flashctx *flash, uint32_t address, uint8_t *buf, int len)
@@ -69,14 +74,6 @@ static int spi_sfdp_read_sfdp(struct flashctx *flash, uint32_t address, uint8_t
 	return ret;
 }
 
-struct sfdp_tbl_hdr {
-	uint8_t id;
-	uint8_t v_minor;
-	uint8_t v_major;
-	uint8_t len;
-	uint32_t ptp; /* 24b pointer */
-};
-
 static int sfdp_add_uniform_eraser(struct flashchip *chip, uint8_t opcode, uint32_t block_size)
 {
 	int i;
@@ -121,10 +118,252 @@ static int sfdp_add_uniform_eraser(struct flashchip *chip, uint8_t opcode, uint3
 	return 1;
 }
 
-static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
+static uint32_t sfdp_read_dword(const uint8_t *buf, unsigned int idx)
+{
+	return (uint32_t)buf[4 * idx + 0]       | (uint32_t)buf[4 * idx + 1] << 8 |
+	       (uint32_t)buf[4 * idx + 2] << 16 | (uint32_t)buf[4 * idx + 3] << 24;
+}
+
+static void sfdp_add_fast_read(struct flashchip *chip, enum io_mode io_mode,
+			       int feature, uint16_t params, const char *name)
+{
+	const uint8_t dummy_clocks = params & 0x1f;
+	const uint8_t mode_clocks = (params >> 5) & 0x7;
+	const uint8_t opcode = params >> 8;
+
+	if (!opcode) {
+		msg_cdbg2("  %s fast read has no opcode, ignoring it.\n", name);
+		return;
+	}
+	msg_cdbg2("  %s fast read opcode 0x%02x, %u mode clocks, %u dummy clocks.\n",
+		  name, opcode, mode_clocks, dummy_clocks);
+
+	chip->feature_bits |= feature;
+	chip->fast_read[io_mode].opcode = opcode;
+	chip->fast_read[io_mode].mode_clocks = mode_clocks;
+	chip->fast_read[io_mode].dummy_clocks = dummy_clocks;
+}
+
+static void sfdp_fill_fast_read(struct flashchip *chip, const uint8_t *buf, uint16_t len, uint32_t dw1)
+{
+	const uint32_t dw3 = sfdp_read_dword(buf, 2);
+	const uint32_t dw4 = sfdp_read_dword(buf, 3);
+
+	if (dw1 & SFDP_BFPT_DW1_FAST_READ_112)
+		sfdp_add_fast_read(chip, DUAL_OUT_1_1_2, FEATURE_FAST_READ_DOUT, dw4 & 0xffff, "1-1-2");
+	if (dw1 & SFDP_BFPT_DW1_FAST_READ_122)
+		sfdp_add_fast_read(chip, DUAL_IO_1_2_2, FEATURE_FAST_READ_DIO, dw4 >> 16, "1-2-2");
+
+	if (!(dw1 & (SFDP_BFPT_DW1_FAST_READ_144 | SFDP_BFPT_DW1_FAST_READ_114)))
+		return;
+
+	/*
+	 * We don't know how to set the Quad Enable bit, unless the
+	 * table tells us that there is none (JESD216A and later).
+	 */
+	if (len < 15 * 4 || (sfdp_read_dword(buf, 14) >> SFDP_BFPT_DW15_QER_SHIFT & 0x7) != 0) {
+		msg_cdbg2("  Quad fast reads may need a Quad Enable bit, ignoring them.\n");
+		return;
+	}
+
+	if (dw1 & SFDP_BFPT_DW1_FAST_READ_114)
+		sfdp_add_fast_read(chip, QUAD_OUT_1_1_4, FEATURE_FAST_READ_QOUT, dw3 >> 16, "1-1-4");
+	if (dw1 & SFDP_BFPT_DW1_FAST_READ_144)
+		sfdp_add_fast_read(chip, QUAD_IO_1_4_4, FEATURE_FAST_READ_QIO, dw3 & 0xffff, "1-4-4");
+}
+
+/*
+ * QPI mode, if we know how to enter and exit it. We can set the Quad
+ * Enable bit in the status registers for this, cf. spi_set_quad_enable().
+ */
+static void sfdp_fill_qpi(struct flashchip *chip, const uint8_t *buf, uint16_t len)
+{
+	if (len < 15 * 4 || !(sfdp_read_dword(buf, 4) & SFDP_BFPT_DW5_FAST_READ_444))
+		return;
+
+	const uint32_t dw15 = sfdp_read_dword(buf, 14);
+	const uint8_t enter = dw15 >> SFDP_BFPT_DW15_QPI_ENTER_SHIFT & 0x1f;
+	const uint8_t exit = dw15 >> SFDP_BFPT_DW15_QPI_EXIT_SHIFT & 0xf;
+	const uint8_t qer = dw15 >> SFDP_BFPT_DW15_QER_SHIFT & 0x7;
+
+	if (enter & SFDP_QPI_ENTER_QE_38 && qer != 1 && qer != 7) {
+		chip->qpi.qer = qer;
+		chip->qpi.enter_op = JEDEC_ENTER_QPI;
+	} else if (enter & SFDP_QPI_ENTER_38) {
+		chip->qpi.enter_op = JEDEC_ENTER_QPI;
+	} else if (enter & SFDP_QPI_ENTER_35) {
+		chip->qpi.enter_op = ALT_ENTER_QPI_35;
+	}
+
+	if (exit & SFDP_QPI_EXIT_FF)
+		chip->qpi.exit_op = JEDEC_EXIT_QPI;
+	else if (exit & SFDP_QPI_EXIT_F5)
+		chip->qpi.exit_op = ALT_EXIT_QPI_F5;
+
+	if (!chip->qpi.enter_op || !chip->qpi.exit_op) {
+		msg_cdbg2("  Unsupported QPI mode switch (enter 0x%02x, exit 0x%x), ignoring it.\n",
+			  enter, exit);
+		memset(&chip->qpi, 0, sizeof(chip->qpi));
+		return;
+	}
+	msg_cdbg2("  QPI mode entered with 0x%02x (QER %u), left with 0x%02x.\n",
+		  chip->qpi.enter_op, chip->qpi.qer, chip->qpi.exit_op);
+	sfdp_add_fast_read(chip, QPI_4_4_4, FEATURE_QPI, sfdp_read_dword(buf, 6) >> 16, "4-4-4");
+}
+
+/* Maximum times are given as a multiplier of the typical times. */
+static void sfdp_set_timing(struct wip_timing *timing, unsigned int typ_us, unsigned int max_mult,
+			    const char *name)
+{
+	timing->typ_us = typ_us;
+	timing->max_us = typ_us * 2 * (max_mult + 1);
+	msg_cdbg2("  %s takes %u us typically, %u us at most.\n", name, timing->typ_us, timing->max_us);
+}
+
+static void sfdp_fill_timings(struct flashchip *chip, const uint8_t *buf)
+{
+	static const unsigned int erase_units_us[] = { 1000, 16 * 1000, 128 * 1000, 1000 * 1000 };
+	static const unsigned int chip_erase_units_us[] = {
+		16 * 1000, 256 * 1000, 4 * 1000 * 1000, 64 * 1000 * 1000 };
+	const uint32_t dw10 = sfdp_read_dword(buf, 9);
+	const uint32_t dw11 = sfdp_read_dword(buf, 10);
+	/* All erases, including the chip erase, share a multiplier in DWORD10 */
+	const unsigned int erase_max_mult = dw10 & 0xf;
+	unsigned int j;
+
+	for (j = 0; j < 4; j++) {
+		const unsigned int field = dw10 >> (4 + j * 7) & 0x7f;
+		const unsigned int count = (field & 0x1f) + 1;
+		const unsigned int unit = erase_units_us[field >> 5];
+
+		char name[32];
+
+		if (!chip->spi_timing.erase[j].block_size)
+			continue;
+		snprintf(name, sizeof(name), "Erase Sector Type %u", j + 1);
+		sfdp_set_timing(&chip->spi_timing.erase[j].timing, count * unit, erase_max_mult, name);
+	}
+
+	/* Page program time, in units of 8us or 64us */
+	sfdp_set_timing(&chip->spi_timing.page_program,
+			((dw11 >> 8 & 0x1f) + 1) * (dw11 & (1 << 13) ? 64 : 8), dw11 & 0xf,
+			"Page program");
+
+	/* Chip erase time, capped so the maximum still fits */
+	const unsigned int units = chip_erase_units_us[dw11 >> 29 & 0x3];
+	const unsigned int count = (dw11 >> 24 & 0x1f) + 1;
+	if ((uint64_t)count * units * 2 * (erase_max_mult + 1) <= UINT_MAX)
+		sfdp_set_timing(&chip->spi_timing.chip_erase, count * units, erase_max_mult, "Chip erase");
+}
+
+static void sfdp_fill_4ba_methods(struct flashchip *chip, uint32_t dw16, bool *four_byte_only)
+{
+	const uint8_t enter = dw16 >> SFDP_BFPT_DW16_4BA_ENTER_SHIFT;
+
+	if (enter & SFDP_4BA_ENTER_B7)
+		chip->feature_bits |= FEATURE_4BA_ENTER;
+	if (enter & SFDP_4BA_ENTER_WREN_B7)
+		chip->feature_bits |= FEATURE_4BA_ENTER_WREN;
+	if (enter & SFDP_4BA_ENTER_EAR_C5C8)
+		chip->feature_bits |= FEATURE_4BA_EAR_C5C8;
+	if (enter & SFDP_4BA_ENTER_EAR_1716)
+		chip->feature_bits |= FEATURE_4BA_EAR_1716;
+	if (enter & SFDP_4BA_ONLY)
+		*four_byte_only = true;
+	msg_cdbg2("  4-Byte address entry methods 0x%02x.\n", enter);
+}
+
+/* 4-byte Address Instruction Table (JESD216B) */
+static void sfdp_fill_4bait(struct flashchip *chip, const uint8_t *buf, uint16_t len)
+{
+	const uint32_t dw1 = sfdp_read_dword(buf, 0);
+	const uint32_t dw2 = sfdp_read_dword(buf, 1);
+	unsigned int i, j;
+
+	msg_cdbg("Parsing 4-byte address instruction table... ");
+	msg_cdbg2("\n");
+
+	if (len < 2 * 4) {
+		msg_cdbg("too short, skipping it.\n");
+		return;
+	}
+
+	if (dw1 & SFDP_4BAIT_DW1_READ_13)
+		chip->feature_bits |= FEATURE_4BA_READ;
+	if (dw1 & SFDP_4BAIT_DW1_FAST_READ_0C)
+		chip->feature_bits |= FEATURE_4BA_FAST_READ;
+	if (dw1 & SFDP_4BAIT_DW1_PROGRAM_12)
+		chip->feature_bits |= FEATURE_4BA_WRITE;
+
+	/* Replace the erasers of each supported erase type with its 4-byte instruction. */
+	for (j = 0; j < 4; j++) {
+		const uint32_t block_size = chip->spi_timing.erase[j].block_size;
+		const uint8_t opcode = dw2 >> (j * 8) & 0xff;
+
+		if (!(dw1 & (1 << (SFDP_4BAIT_DW1_ERASE_TYPE_SHIFT + j))) || !block_size)
+			continue;
+
+		erasefunc_t *const erasefn = spi25_get_erasefn_from_opcode(opcode);
+		if (!erasefn)
+			continue;
+
+		for (i = 0; i < NUM_ERASEFUNCTIONS; i++) {
+			struct block_eraser *const eraser = &chip->block_erasers[i];
+			if (eraser->block_erase && eraser->eraseblocks[0].size == block_size) {
+				eraser->block_erase = erasefn;
+				msg_cdbg2("  Block eraser %d uses 4-byte opcode 0x%02x.\n", i, opcode);
+			}
+		}
+	}
+
+	msg_cdbg("done.\n");
+}
+
+/*
+ * Chips bigger than 16 MiB or without 3-byte addressing need some
+ * form of 4-byte addressing. Returns 0 if we know one.
+ */
+static int sfdp_check_4ba(struct flashchip *chip, bool four_byte_only)
+{
+	unsigned int i;
+
+	if (four_byte_only) {
+		/* We can only use native 4-byte instructions. */
+		if ((chip->feature_bits & (FEATURE_4BA_READ | FEATURE_4BA_WRITE)) !=
+		    (FEATURE_4BA_READ | FEATURE_4BA_WRITE)) {
+			msg_cdbg("4-Byte only addressing without native instructions not supported.\n");
+			return 1;
+		}
+		chip->feature_bits &= ~(FEATURE_4BA_ENTER | FEATURE_4BA_ENTER_WREN | FEATURE_4BA_EAR_ANY);
+		chip->feature_bits &= ~FEATURE_FAST_READ_DUAL & ~FEATURE_FAST_READ_QUAD & ~FEATURE_QPI;
+		for (i = 0; i < NUM_ERASEFUNCTIONS; i++) {
+			struct block_eraser *const eraser = &chip->block_erasers[i];
+			bool native_4ba = false;
+
+			if (eraser->block_erase &&
+			    (spi_get_opcode_from_erasefn(eraser->block_erase, &native_4ba), !native_4ba))
+				memset(eraser, 0, sizeof(*eraser));
+		}
+	} else if (chip->total_size * 1024 > (1 << 24)) {
+		if (!(chip->feature_bits & (FEATURE_4BA_ENTER | FEATURE_4BA_ENTER_WREN)) &&
+		    (chip->feature_bits & (FEATURE_4BA_READ | FEATURE_4BA_WRITE)) !=
+		    (FEATURE_4BA_READ | FEATURE_4BA_WRITE)) {
+			msg_cdbg("Flash chip size is bigger than what 3-Byte addressing "
+				 "can access.\n");
+			return 1;
+		}
+	} else {
+		return 0;
+	}
+
+	chip->prepare_access = spi_prepare_4ba;
+	return 0;
+}
+
+static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len, bool *four_byte_only)
 {
 	uint8_t opcode_4k_erase = 0xFF;
-	uint32_t tmp32;
+	uint32_t dw1, tmp32;
 	uint8_t tmp8;
 	uint32_t total_size; /* in bytes */
 	uint32_t block_size;
@@ -138,19 +377,20 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	tmp32 |= ((unsigned int)buf[(4 * 0) + 1]) << 8;
 	tmp32 |= ((unsigned int)buf[(4 * 0) + 2]) << 16;
 	tmp32 |= ((unsigned int)buf[(4 * 0) + 3]) << 24;
+	dw1 = tmp32;
 
-	tmp8 = (tmp32 >> 17) & 0x3;
+	tmp8 = (tmp32 >> SFDP_BFPT_DW1_ADDR_SHIFT) & 0x3;
 	switch (tmp8) {
-	case 0x0:
+	case SFDP_BFPT_ADDR_3:
 		msg_cdbg2("  3-Byte only addressing.\n");
 		break;
-	case 0x1:
+	case SFDP_BFPT_ADDR_3_OR_4:
 		msg_cdbg2("  3-Byte (and optionally 4-Byte) addressing.\n");
 		break;
-	case 0x2:
-		msg_cdbg("  4-Byte only addressing (not supported by "
-			 "flashprog).\n");
-		return 1;
+	case SFDP_BFPT_ADDR_4:
+		msg_cdbg2("  4-Byte only addressing.\n");
+		*four_byte_only = true;
+		break;
 	default:
 		msg_cdbg("  Required addressing mode (0x%x) not supported.\n",
 			 tmp8);
@@ -176,7 +416,7 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 		}
 
 	msg_cdbg2("  Write chunk size is ");
-	if (tmp32 & (1 << 2)) {
+	if (tmp32 & SFDP_BFPT_DW1_WRITE_64) {
 		msg_cdbg2("at least 64 B.\n");
 		chip->page_size = 64;
 		chip->write = spi_chip_write_256;
@@ -186,8 +426,8 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 		chip->write = spi_chip_write_1;
 	}
 
-	if ((tmp32 & 0x3) == 0x1) {
-		opcode_4k_erase = (tmp32 >> 8) & 0xFF;
+	if ((tmp32 & 0x3) == SFDP_BFPT_DW1_ERASE_4K) {
+		opcode_4k_erase = (tmp32 >> SFDP_BFPT_DW1_ERASE_4K_OP_SHIFT) & 0xFF;
 		msg_cspew("  4kB erase opcode is 0x%02x.\n", opcode_4k_erase);
 		/* add the eraser later, because we don't know total_size yet */
 	} else
@@ -206,17 +446,10 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	total_size = ((tmp32 & 0x7FFFFFFF) + 1) / 8;
 	chip->total_size = total_size / 1024;
 	msg_cdbg2("  Flash chip size is %d kB.\n", chip->total_size);
-	if (total_size > (1 << 24)) {
-		msg_cdbg("Flash chip size is bigger than what 3-Byte addressing "
-			 "can access.\n");
-		return 1;
-	}
 
 	if (opcode_4k_erase != 0xFF)
 		sfdp_add_uniform_eraser(chip, opcode_4k_erase, 4 * 1024);
 
-	/* FIXME: double words 3-7 contain unused fast read information */
-
 	if (len == 4 * 4) {
 		msg_cdbg("  It seems like this chip supports the preliminary "
 			 "Intel version of SFDP, skipping processing of double "
@@ -224,6 +457,14 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 		goto done;
 	}
 
+	/* 3. and 4. double word, multi-I/O fast read */
+	sfdp_fill_fast_read(chip, buf, len, dw1);
+
+	/* 5., 7. and 15. double word, QPI mode */
+	sfdp_fill_qpi(chip, buf, len);
+
+	/* FIXME: double words 5-7 contain unused 2-2-2 fast read information */
+
 	/* 8. double word */
 	for (j = 0; j < 4; j++) {
 		/* 7 double words from the start + 2 bytes for every eraser */
@@ -240,6 +481,7 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 			continue;
 		}
 		block_size = 1 << (tmp8); /* block_size = 2 ^ field */
+		chip->spi_timing.erase[j].block_size = block_size;
 
 		tmp8 = buf[(4 * 7) + (j * 2) + 1];
 		msg_cspew("   Erase Sector Type %d Opcode: 0x%02x\n", j + 1,
@@ -247,12 +489,29 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 		sfdp_add_uniform_eraser(chip, tmp8, block_size);
 	}
 
+	/* 10. and 11. double word, typical and maximum times (JESD216B) */
+	if (len >= 11 * 4) {
+		sfdp_fill_timings(chip, buf);
+
+		/* Page size is 2^N bytes */
+		tmp8 = sfdp_read_dword(buf, 10) >> 4 & 0xf;
+		if (chip->write == spi_chip_write_256 && tmp8 >= 6 && tmp8 <= 12) {
+			chip->page_size = 1 << tmp8;
+			msg_cdbg2("  Page size is %u B.\n", chip->page_size);
+		}
+	}
+
+	/* 16. double word, 4-byte addressing methods (JESD216B) */
+	if (len >= 16 * 4)
+		sfdp_fill_4ba_methods(chip, sfdp_read_dword(buf, 15), four_byte_only);
+
 done:
 	msg_cdbg("done.\n");
 	return 0;
 }
 
-int probe_spi_sfdp(struct flashctx *flash)
+/* Parse the SFDP tables of the chip behind `flash` into `chip`. Returns 1 on success. */
+static int sfdp_parse(struct flashctx *flash, struct flashchip *chip, bool *four_byte_only)
 {
 	int ret = 0;
 	uint8_t buf[8];
@@ -273,8 +532,8 @@ int probe_spi_sfdp(struct flashctx *flash)
 	tmp32 |= ((unsigned int)buf[2]) << 16;
 	tmp32 |= ((unsigned int)buf[3]) << 24;
 
-	if (tmp32 != 0x50444653) {
-		msg_cdbg2("Signature = 0x%08x (should be 0x50444653)\n", tmp32);
+	if (tmp32 != SFDP_SIGNATURE) {
+		msg_cdbg2("Signature = 0x%08x (should be 0x%08x)\n", tmp32, SFDP_SIGNATURE);
 		msg_cdbg("No SFDP signature found.\n");
 		return 0;
 	}
@@ -295,13 +554,13 @@ int probe_spi_sfdp(struct flashctx *flash)
 		  nph + 1, nph);
 
 	/* Fetch all parameter headers, even if we don't use them all (yet). */
-	hbuf = malloc((nph + 1) * 8);
+	hbuf = malloc((nph + 1) * SFDP_HEADER_LEN);
 	hdrs = malloc((nph + 1) * sizeof(*hdrs));
 	if (hbuf == NULL || hdrs == NULL ) {
 		msg_gerr("Out of memory!\n");
 		goto cleanup_hdrs;
 	}
-	if (spi_sfdp_read_sfdp(flash, 0x08, hbuf, (nph + 1) * 8)) {
+	if (spi_sfdp_read_sfdp(flash, SFDP_HEADER_LEN, hbuf, (nph + 1) * SFDP_HEADER_LEN)) {
 		msg_cdbg("Receiving SFDP parameter table headers failed.\n");
 		goto cleanup_hdrs;
 	}
@@ -315,6 +574,7 @@ int probe_spi_sfdp(struct flashctx *flash)
 		hdrs[i].ptp = hbuf[(8 * i) + 4];
 		hdrs[i].ptp |= ((unsigned int)hbuf[(8 * i) + 5]) << 8;
 		hdrs[i].ptp |= ((unsigned int)hbuf[(8 * i) + 6]) << 16;
+		hdrs[i].id_msb = hbuf[(8 * i) + 7];
 		msg_cdbg2("\nSFDP parameter table header %d/%d:\n", i, nph);
 		msg_cdbg2("  ID 0x%02x, version %d.%d\n", hdrs[i].id,
 			  hdrs[i].v_major, hdrs[i].v_minor);
@@ -360,7 +620,7 @@ int probe_spi_sfdp(struct flashctx *flash)
 		msg_cspew("\n");
 
 		if (i == 0) { /* Mandatory JEDEC SFDP parameter table */
-			if (hdrs[i].id != 0)
+			if (hdrs[i].id != SFDP_BFPT_ID)
 				msg_cdbg("ID of the mandatory JEDEC SFDP "
 					 "parameter table is not 0 as demanded "
 					 "by JESD216 (warning only).\n");
@@ -373,8 +633,10 @@ int probe_spi_sfdp(struct flashctx *flash)
 				msg_cdbg("Length of the mandatory JEDEC SFDP "
 					 "parameter table is wrong (%d B), "
 					 "skipping it.\n", len);
-			} else if (sfdp_fill_flash(flash->chip, tbuf, len) == 0)
+			} else if (sfdp_fill_flash(chip, tbuf, len, four_byte_only) == 0)
 				ret = 1;
+		} else if (ret && hdrs[i].id == SFDP_4BAIT_ID && hdrs[i].id_msb == SFDP_JEDEC_ID_MSB) {
+			sfdp_fill_4bait(chip, tbuf, len);
 		}
 		free(tbuf);
 	}
@@ -384,3 +646,139 @@ cleanup_hdrs:
 	free(hbuf);
 	return ret;
 }
+
+int probe_spi_sfdp(struct flashctx *flash)
+{
+	bool four_byte_only = false;
+
+	if (!sfdp_parse(flash, flash->chip, &four_byte_only))
+		return 0;
+
+	return !sfdp_check_4ba(flash->chip, four_byte_only);
+}
+
+/* The static entry must describe the same chip as the SFDP data. */
+static bool sfdp_matches_chip(const struct flashchip *chip, const struct flashchip *sfdp)
+{
+	unsigned int i, j;
+
+	if (chip->total_size != sfdp->total_size) {
+		msg_cdbg("SFDP reports %u kB instead of %u kB.\n", sfdp->total_size, chip->total_size);
+		return false;
+	}
+
+	for (i = 0; i < NUM_ERASEFUNCTIONS; i++) {
+		const struct block_eraser *const sfdp_eraser = &sfdp->block_erasers[i];
+		if (!sfdp_eraser->block_erase)
+			continue;
+		for (j = 0; j < NUM_ERASEFUNCTIONS; j++) {
+			const struct block_eraser *const eraser = &chip->block_erasers[j];
+			if (eraser->block_erase != sfdp_eraser->block_erase || eraser->eraseblocks[1].count)
+				continue;
+			if (eraser->eraseblocks[0].size != sfdp_eraser->eraseblocks[0].size) {
+				msg_cdbg("SFDP reports %u B blocks instead of %u B for block eraser %u.\n",
+					 sfdp_eraser->eraseblocks[0].size, eraser->eraseblocks[0].size, j);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void sfdp_overlay_timing(struct wip_timing *timing, const struct wip_timing *sfdp)
+{
+	if (!timing->typ_us && !timing->max_us)
+		*timing = *sfdp;
+}
+
+static void sfdp_overlay_erase_timing(struct spi_timings *timings, const struct spi_erase_timing *sfdp)
+{
+	struct spi_erase_timing *free_slot = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(timings->erase); ++i) {
+		if (timings->erase[i].block_size == sfdp->block_size) {
+			sfdp_overlay_timing(&timings->erase[i].timing, &sfdp->timing);
+			return;
+		}
+		if (!timings->erase[i].block_size && !free_slot)
+			free_slot = &timings->erase[i];
+	}
+	if (free_slot)
+		*free_slot = *sfdp;
+}
+
+/*
+ * Complete the performance parameters of a chip that was found by its
+ * static entry with its SFDP data: multi-I/O fast reads, program and
+ * erase times and the page size. Everything the static entry already
+ * specifies, and everything that decides whether we can access the chip
+ * safely, like addressing modes and erasers, is kept.
+ *
+ * Returns 0 if SFDP data was applied, 1 otherwise.
+ */
+int sfdp_overlay(struct flashctx *flash)
+{
+	static const struct {
+		enum io_mode mode;
+		uint32_t feature;
+	} fast_reads[] = {
+		{ DUAL_OUT_1_1_2, FEATURE_FAST_READ_DOUT },
+		{ DUAL_IO_1_2_2,  FEATURE_FAST_READ_DIO },
+		{ QUAD_OUT_1_1_4, FEATURE_FAST_READ_QOUT },
+		{ QUAD_IO_1_4_4,  FEATURE_FAST_READ_QIO },
+	};
+	struct flashchip *const chip = flash->chip;
+	struct flashchip sfdp = { 0 };
+	bool four_byte_only = false;
+	size_t i;
+	int ret = 1;
+
+	if (chip->bustype != BUS_SPI || chip->spi_cmd_set != SPI25 ||
+	    chip->model_id == SFDP_DEVICE_ID || chip->model_id == GENERIC_DEVICE_ID)
+		return 1;
+
+	if (chip->prepare_access && chip->prepare_access(flash, PREPARE_PROBE))
+		return 1;
+
+	msg_cdbg("Reading SFDP to complete the parameters of %s %s.\n", chip->vendor, chip->name);
+	if (!sfdp_parse(flash, &sfdp, &four_byte_only) || !sfdp_matches_chip(chip, &sfdp)) {
+		msg_cinfo("No usable SFDP data, using the static parameters only.\n");
+		goto finish_ret;
+	}
+
+	/* Multi-I/O reads are sent with 3-byte addresses, unless the static entry knows better. */
+	for (i = 0; i < ARRAY_SIZE(fast_reads) && !four_byte_only; ++i) {
+		if (chip->feature_bits & fast_reads[i].feature || !(sfdp.feature_bits & fast_reads[i].feature))
+			continue;
+		chip->feature_bits |= fast_reads[i].feature;
+		chip->fast_read[fast_reads[i].mode] = sfdp.fast_read[fast_reads[i].mode];
+	}
+	if (!four_byte_only && !chip->qpi.enter_op && sfdp.feature_bits & FEATURE_QPI) {
+		chip->feature_bits |= FEATURE_QPI;
+		chip->qpi = sfdp.qpi;
+		chip->fast_read[QPI_4_4_4] = sfdp.fast_read[QPI_4_4_4];
+	}
+
+	sfdp_overlay_timing(&chip->spi_timing.page_program, &sfdp.spi_timing.page_program);
+	sfdp_overlay_timing(&chip->spi_timing.chip_erase, &sfdp.spi_timing.chip_erase);
+	for (i = 0; i < ARRAY_SIZE(sfdp.spi_timing.erase); ++i) {
+		if (sfdp.spi_timing.erase[i].block_size)
+			sfdp_overlay_erase_timing(&chip->spi_timing, &sfdp.spi_timing.erase[i]);
+	}
+
+	if (chip->write == spi_chip_write_256 && sfdp.write == spi_chip_write_256 &&
+	    sfdp.page_size > chip->page_size) {
+		msg_cdbg("Using the SFDP page size of %u B.\n", sfdp.page_size);
+		chip->page_size = sfdp.page_size;
+	}
+
+	msg_cinfo("Completed chip parameters with SFDP data.\n");
+	ret = 0;
+
+finish_ret:
+	if (chip->finish_access)
+		chip->finish_access(flash);
+	return ret;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SHA-256 as specified in FIPS 180-4, to hash flash contents for
+ * attestation without another pass over the chip.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror(const uint32_t x, const unsigned int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+static void sha256_block(struct sha256_ctx *const ctx, const uint8_t *const block)
+{
+	uint32_t w[64], s[8];
+	unsigned int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint32_t)block[i * 4] << 24 | block[i * 4 + 1] << 16 |
+		       block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (; i < 64; ++i) {
+		const uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3;
+		const uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10;
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, ctx->state, sizeof(s));
+	for (i = 0; i < 64; ++i) {
+		const uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) +
+				    ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		const uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) +
+				    ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(*s));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; ++i)
+		ctx->state[i] += s[i];
+}
+
+void sha256_init(struct sha256_ctx *const ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *const ctx, const void *const data, size_t len)
+{
+	const uint8_t *buf = data;
+	size_t fill = ctx->len % sizeof(ctx->block);
+
+	ctx->len += len;
+	if (fill) {
+		const size_t n = len < sizeof(ctx->block) - fill ? len : sizeof(ctx->block) - fill;
+		memcpy(ctx->block + fill, buf, n);
+		buf += n;
+		len -= n;
+		if (fill + n < sizeof(ctx->block))
+			return;
+		sha256_block(ctx, ctx->block);
+	}
+	for (; len >= sizeof(ctx->block); buf += sizeof(ctx->block), len -= sizeof(ctx->block))
+		sha256_block(ctx, buf);
+	memcpy(ctx->block, buf, len);
+}
+
+void sha256_final(struct sha256_ctx *const ctx, uint8_t digest[SHA256_DIGEST_LEN])
+{
+	const uint64_t bits = ctx->len * 8;
+	size_t fill = ctx->len % sizeof(ctx->block);
+	unsigned int i;
+
+	ctx->block[fill++] = 0x80;
+	if (fill > sizeof(ctx->block) - 8) {
+		memset(ctx->block + fill, 0, sizeof(ctx->block) - fill);
+		sha256_block(ctx, ctx->block);
+		fill = 0;
+	}
+	memset(ctx->block + fill, 0, sizeof(ctx->block) - 8 - fill);
+	for (i = 0; i < 8; ++i)
+		ctx->block[sizeof(ctx->block) - 1 - i] = bits >> (i * 8);
+	sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < SHA256_DIGEST_LEN; ++i)
+		digest[i] = ctx->state[i / 4] >> (24 - i % 4 * 8);
+}
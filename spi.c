@@ -18,6 +18,7 @@
  * Contains the generic SPI framework
  */
 
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include "flash.h"
@@ -26,17 +27,202 @@
 #include "programmer.h"
 #include "spi.h"
 
+/*
+ * The statistics are part of the flash context, but most SPI code only
+ * gets a const pointer to it. They don't affect how the chip is accessed,
+ * so we update them anyway.
+ */
+static struct flashprog_stats *spi_stats(const struct flashctx *flash)
+{
+	return &((struct flashctx *)flash)->stats;
+}
+
 int spi_send_command(const struct flashctx *flash, unsigned int writecnt,
 		     unsigned int readcnt, const unsigned char *writearr,
 		     unsigned char *readarr)
 {
-	return flash->mst.spi->command(flash, writecnt, readcnt, writearr,
-				       readarr);
+	struct flashprog_stats *const stats = spi_stats(flash);
+
+	/* Only multicommand knows about I/O modes. */
+	if (flash->in_qpi_mode) {
+		struct spi_command cmds[] = {
+			{ writecnt, readcnt, writearr, readarr, QPI_4_4_4, 0, NULL },
+			NULL_SPI_CMD,
+		};
+		return spi_send_multicommand(flash, cmds);
+	}
+
+	++stats->spi_transactions;
+	++stats->spi_commands;
+	stats->bytes_out += writecnt;
+	stats->bytes_in += readcnt;
+
+	if (!spi_trace_enabled())
+		return flash->mst.spi->command(flash, writecnt, readcnt, writearr,
+					       readarr);
+
+	const struct spi_command cmd = { writecnt, readcnt, writearr, readarr, SINGLE_IO_1_1_1, 0, NULL };
+	const uint64_t start_us = monotonic_us();
+	const int ret = flash->mst.spi->command(flash, writecnt, readcnt, writearr, readarr);
+	spi_trace_record(&cmd, false, start_us, ret);
+	return ret;
 }
 
 int spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
 {
-	return flash->mst.spi->multicommand(flash, cmds);
+	struct flashprog_stats *const stats = spi_stats(flash);
+	struct spi_command *cmd;
+
+	if (flash->in_qpi_mode) {
+		for (cmd = cmds; cmd->writecnt || cmd->readcnt; ++cmd) {
+			if (cmd->io_mode == SINGLE_IO_1_1_1)
+				cmd->io_mode = QPI_4_4_4;
+		}
+	}
+
+	++stats->spi_transactions;
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; ++cmd) {
+		++stats->spi_commands;
+		stats->bytes_out += cmd->writecnt + cmd->datacnt;
+		stats->bytes_in += cmd->readcnt;
+	}
+
+	if (!spi_trace_enabled())
+		return flash->mst.spi->multicommand(flash, cmds);
+
+	const uint64_t start_us = monotonic_us();
+	const int ret = flash->mst.spi->multicommand(flash, cmds);
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; ++cmd)
+		spi_trace_record(cmd, cmd != cmds, start_us, ret);
+	return ret;
+}
+
+/* Queue a command, a full queue is flushed first. */
+int spi_queue_add(struct flashctx *flash, struct spi_queue *queue,
+		  const unsigned char *writearr, unsigned int writecnt,
+		  unsigned char *readarr, unsigned int readcnt)
+{
+	if (queue->count == SPI_QUEUE_LEN) {
+		const int ret = spi_queue_flush(flash, queue);
+		if (ret)
+			return ret;
+	}
+
+	queue->cmds[queue->count] = (struct spi_command){
+		.writecnt	= writecnt,
+		.readcnt	= readcnt,
+		.writearr	= writearr,
+		.readarr	= readarr,
+		.io_mode	= SINGLE_IO_1_1_1,
+	};
+	queue->poll[queue->count] = NULL;
+	++queue->count;
+	return 0;
+}
+
+/*
+ * Queue a write command whose payload is kept separately, in `dataarr`.
+ * Only for masters with SPI_MASTER_GATHER.
+ */
+int spi_queue_add_data(struct flashctx *flash, struct spi_queue *queue,
+		       const unsigned char *writearr, unsigned int writecnt,
+		       const unsigned char *dataarr, unsigned int datacnt)
+{
+	const int ret = spi_queue_add(flash, queue, writearr, writecnt, NULL, 0);
+	if (ret)
+		return ret;
+
+	queue->cmds[queue->count - 1].datacnt = datacnt;
+	queue->cmds[queue->count - 1].dataarr = dataarr;
+	return 0;
+}
+
+/* Let the commands queued next wait until the last queued one is done. */
+void spi_queue_poll(struct spi_queue *queue, const struct wip_timing *timing)
+{
+	if (queue->count)
+		queue->poll[queue->count - 1] = timing;
+}
+
+/*
+ * Number of status bytes that take at least `usecs` to read at the
+ * master's clock. Returns 0 if the clock isn't known or the read would
+ * be too long.
+ */
+unsigned int spi_pad_len(const struct flashctx *flash, unsigned int usecs)
+{
+	const struct spi_master *const mst = flash->mst.spi;
+
+	if (!mst->clock_hz)
+		return 0;
+	const unsigned long long pad = (unsigned long long)usecs * mst->clock_hz / (8 * 1000 * 1000) + 1;
+	if (pad > SPI_MAX_PAD || (mst->max_data_read && pad > mst->max_data_read))
+		return 0;
+	return pad;
+}
+
+/*
+ * Send all queued commands. Each run of commands up to a WIP poll goes
+ * out in one multicommand call. With SPI_MASTER_BATCH_POLL, the poll
+ * starts in the same batch: chips repeat the status register as long
+ * as it is read, so one RDSR that reads for the typical duration of the
+ * operation stands in for the repeated status reads. Only the last byte
+ * is checked. If the operation takes longer, or that read would be too
+ * long, we poll as usual, without the initial sleep if the read already
+ * waited. If a batch fails, we still wait for the chip, but don't send
+ * any later commands.
+ */
+int spi_queue_flush(struct flashctx *flash, struct spi_queue *queue)
+{
+	const bool batch_poll = flash->mst.spi->features & SPI_MASTER_BATCH_POLL;
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	struct spi_command batch[SPI_QUEUE_LEN + 2];
+	uint8_t status[SPI_MAX_PAD];
+	size_t i = 0;
+	int ret = 0;
+
+	while (i < queue->count && !ret) {
+		const struct wip_timing *timing = NULL;
+		unsigned int status_len = 0;
+		size_t n = 0;
+
+		while (i < queue->count && !timing) {
+			timing = queue->poll[i];
+			batch[n++] = queue->cmds[i++];
+		}
+		if (timing && batch_poll) {
+			const unsigned int pad = spi_pad_len(flash, timing->typ_us);
+			status_len = pad ? pad : 1;
+			status[status_len - 1] = SPI_SR_WIP;
+			batch[n++] = (struct spi_command){
+				.writecnt	= sizeof(rdsr),
+				.writearr	= rdsr,
+				.readcnt	= status_len,
+				.readarr	= status,
+			};
+		}
+		batch[n] = (struct spi_command)NULL_SPI_CMD;
+
+		ret = spi_send_multicommand(flash, batch);
+		if (!timing || (!ret && status_len && !(status[status_len - 1] & SPI_SR_WIP)))
+			continue;
+
+		/*
+		 * The padded read already took the typical time. Skip the
+		 * initial sleep, but keep the typical time for the poll
+		 * intervals, and count the read against the maximum.
+		 */
+		struct wip_timing rest = *timing;
+		if (status_len > 1) {
+			rest.generic = true;
+			rest.max_us -= min(rest.max_us, rest.typ_us);
+		}
+		const int wip = spi_poll_wip(flash, &rest);
+		if (!ret)
+			ret = wip;
+	}
+	queue->count = 0;
+	return ret;
 }
 
 int default_spi_send_command(const struct flashctx *flash, unsigned int writecnt,
@@ -57,7 +243,7 @@ int default_spi_send_command(const struct flashctx *flash, unsigned int writecnt
 		.readarr = NULL,
 	}};
 
-	return spi_send_multicommand(flash, cmd);
+	return flash->mst.spi->multicommand(flash, cmd);
 }
 
 int default_spi_send_multicommand(const struct flashctx *flash,
@@ -65,8 +251,14 @@ int default_spi_send_multicommand(const struct flashctx *flash,
 {
 	int result = 0;
 	for (; (cmds->writecnt || cmds->readcnt) && !result; cmds++) {
-		result = spi_send_command(flash, cmds->writecnt, cmds->readcnt,
-					  cmds->writearr, cmds->readarr);
+		/* spi_send_command() has no notion of multi-I/O. */
+		if (cmds->io_mode != SINGLE_IO_1_1_1) {
+			msg_perr("%s called with multi-I/O command.\n"
+				 "Please report a bug at flashprog@flashprog.org\n", __func__);
+			return SPI_FLASHPROG_BUG;
+		}
+		result = flash->mst.spi->command(flash, cmds->writecnt, cmds->readcnt,
+						 cmds->writearr, cmds->readarr);
 	}
 	return result;
 }
@@ -97,6 +289,7 @@ int default_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned i
 int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 		  unsigned int len)
 {
+	const unsigned int die_size = spi_die_size(flash);
 	int ret;
 	size_t to_read;
 	for (; len; len -= to_read, buf += to_read, start += to_read) {
@@ -106,7 +299,11 @@ int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 		   o 4-byte-addressing chips that use an extended address reg,
 		   o dediprog that has a protocol limit of 32MiB-512B. */
 		to_read = min(ALIGN_DOWN(start + 16*MiB, 16*MiB) - start, len);
-		ret = flash->mst.spi->read(flash, buf, start, to_read);
+		/* The dies of stacked-die chips take addresses within the die. */
+		to_read = min(die_size - start % die_size, to_read);
+		ret = spi_select_die(flash, start / die_size);
+		if (!ret)
+			ret = flash->mst.spi->read(flash, buf, start % die_size, to_read);
 		if (ret)
 			return ret;
 	}
@@ -122,6 +319,7 @@ int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 /* real chunksize is up to 256, logical chunksize is 256 */
 int spi_chip_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
+	const unsigned int die_size = spi_die_size(flash);
 	int ret;
 	size_t to_write;
 	for (; len; len -= to_write, buf += to_write, start += to_write) {
@@ -130,7 +328,11 @@ int spi_chip_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int
 		   extended-address register that has to match the
 		   current 16MiB area. */
 		to_write = min(ALIGN_DOWN(start + 16*MiB, 16*MiB) - start, len);
-		ret = flash->mst.spi->write_256(flash, buf, start, to_write);
+		/* The dies of stacked-die chips take addresses within the die. */
+		to_write = min(die_size - start % die_size, to_write);
+		ret = spi_select_die(flash, start / die_size);
+		if (!ret)
+			ret = flash->mst.spi->write_256(flash, buf, start % die_size, to_write);
 		if (ret)
 			return ret;
 	}
@@ -162,6 +364,7 @@ int register_spi_master(const struct spi_master *mst, size_t max_rom_decode, voi
 
 	if (!mst->write_256 || !mst->read || !mst->command ||
 	    !mst->multicommand || !mst->probe_opcode ||
+	    (mst->tune_speed && (!mst->list_speeds || !mst->set_speed)) ||
 	    ((mst->command == default_spi_send_command) &&
 	     (mst->multicommand == default_spi_send_multicommand))) {
 		msg_perr("%s called with incomplete master definition.\n"
@@ -181,6 +384,127 @@ int register_spi_master(const struct spi_master *mst, size_t max_rom_decode, voi
 	return register_master(&rmst);
 }
 
+/* Signature reads that have to match at every clock step of spi_tune_speed(). */
+#define TUNE_SIGNATURE_READS	8
+#define TUNE_SAMPLE_LEN		(4 * KiB)
+
+struct spi_signature {
+	uint8_t id[3];
+	uint8_t sfdp[8];
+	uint32_t sample_crc;
+};
+
+/* Read the JEDEC ID, the SFDP header and a CRC-32 of the start of the chip. */
+static int spi_read_signature(struct flashctx *flash, struct spi_signature *sig, uint8_t *sample,
+			      unsigned int sample_len)
+{
+	static const uint8_t rdid[] = { JEDEC_RDID };
+	static const uint8_t rdsfdp[] = { JEDEC_SFDP, 0x00, 0x00, 0x00, 0x00 /* dummy */ };
+
+	memset(sig, 0, sizeof(*sig));
+	if (spi_send_command(flash, sizeof(rdid), sizeof(sig->id), rdid, sig->id) ||
+	    spi_send_command(flash, sizeof(rdsfdp), sizeof(sig->sfdp), rdsfdp, sig->sfdp) ||
+	    spi_chip_read(flash, sample, 0, sample_len))
+		return 1;
+	sig->sample_crc = crc32_update(0, sample, sample_len);
+	return 0;
+}
+
+static bool spi_signature_stable(struct flashctx *flash, const struct spi_signature *ref,
+				 uint8_t *sample, unsigned int sample_len)
+{
+	struct spi_signature sig;
+	unsigned int i;
+
+	for (i = 0; i < TUNE_SIGNATURE_READS; ++i) {
+		if (spi_read_signature(flash, &sig, sample, sample_len) || memcmp(&sig, ref, sizeof(sig)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Step the clock of the master up while the JEDEC ID, the SFDP header and
+ * a sample read back the same as at the lowest clock. Settle one step below
+ * the highest clock that worked, to leave a safety margin, or at the highest
+ * if all of them worked. Returns 0 on success. On failure, the master is left
+ * at its lowest clock.
+ */
+int spi_tune_speed(struct flashctx *flash)
+{
+	struct spi_master *const mst = flash->mst.spi;
+	const unsigned int sample_len = min(TUNE_SAMPLE_LEN, flash->chip->total_size * KiB);
+	const unsigned long *speeds;
+	struct spi_signature ref;
+	size_t count, i;
+	int ret = 1;
+
+	mst->tune_speed = false;
+	count = mst->list_speeds(flash, &speeds);
+	if (!count)
+		return 1;
+
+	uint8_t *const sample = malloc(sample_len);
+	if (!sample) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+
+	if (mst->set_speed(flash, speeds[0]) || spi_read_signature(flash, &ref, sample, sample_len))
+		goto _free_ret;
+	mst->clock_hz = speeds[0];
+	/* All ones or all zeros is what a floating or shorted MISO line reads. */
+	if (!memcmp(ref.id, "\xff\xff\xff", 3) || !memcmp(ref.id, "\x00\x00\x00", 3)) {
+		msg_gwarn("No flash chip responds to RDID, can't determine the SPI clock.\n");
+		goto _free_ret;
+	}
+
+	for (i = 1; i < count; ++i) {
+		const bool stable = !mst->set_speed(flash, speeds[i]) &&
+				    spi_signature_stable(flash, &ref, sample, sample_len);
+		msg_gdbg("%s: %lu kHz: %s\n", __func__, speeds[i] / 1000, stable ? "ok" : "failed");
+		if (!stable)
+			break;
+	}
+
+	/* `i' is the first step that failed, go back two steps for the margin. */
+	if (i < count)
+		i = i > 1 ? i - 2 : 0;
+	else
+		i = count - 1;
+	if (mst->set_speed(flash, speeds[i])) {
+		mst->set_speed(flash, speeds[0]);
+		goto _free_ret;
+	}
+	mst->clock_hz = speeds[i];
+	msg_ginfo("Selected %lu kHz SPI clock.\n", speeds[i] / 1000);
+	ret = 0;
+
+_free_ret:
+	free(sample);
+	return ret;
+}
+
+/* Switch the master to the next lower clock of list_speeds(). Returns 0 on success. */
+int spi_slow_down(struct flashctx *flash)
+{
+	struct spi_master *const mst = flash->mst.spi;
+	const unsigned long *speeds;
+	size_t i;
+
+	if (!mst->list_speeds || !mst->set_speed || !mst->clock_hz)
+		return 1;
+
+	const size_t count = mst->list_speeds(flash, &speeds);
+	for (i = count; i > 0 && speeds[i - 1] >= mst->clock_hz; --i)
+		;
+	if (i == 0 || mst->set_speed(flash, speeds[i - 1]))
+		return 1;
+	mst->clock_hz = speeds[i - 1];
+	msg_ginfo("Lowered the SPI clock to %lu kHz.\n", mst->clock_hz / 1000);
+	return 0;
+}
+
 /*
  * The following array has erasefn and opcode list pair. The opcode list pair is
  * 0 termintated and must have size one more than the maximum number of opcodes
@@ -213,6 +537,8 @@ static const struct {
 	{spi_erase_at45db_block, {0x50}, false},
 	{spi_erase_at45db_sector, {0x7c}, false},
 	{spi_erase_at45db_chip, {0xc7}, false},
+	//SPI NAND
+	{spi_nand_block_erase, {0xd8}, false},
 };
 
 const uint8_t *spi_get_opcode_from_erasefn(erasefunc_t *func, bool *native_4ba)
@@ -27,13 +27,66 @@
 #include "programmer.h"
 #include "spi.h"
 
+/*
+ * The ID commands are sent for many chips in a row while probing. As long
+ * as nothing else happens on the bus, their answers don't change. So we
+ * keep them until spi_id_cache_clear() is called when probing starts over.
+ * Probe functions that change the state of the chip, or rely on timing
+ * that differs from the commands cached, have to call it as well.
+ */
+void spi_id_cache_clear(struct flashprog_programmer *const prog)
+{
+	prog->spi_id_cache_count = 0;
+}
+
+static int spi_id_command(struct flashctx *flash, const unsigned char *cmd, unsigned int cmdlen,
+			  unsigned char *readarr, int bytes)
+{
+	struct flashprog_programmer *const prog = flash->prog;
+	struct spi_id_cache_entry *entry;
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < prog->spi_id_cache_count; i++) {
+		entry = &prog->spi_id_cache[i];
+		if (entry->mst == flash->mst.spi && entry->opcode == cmd[0] && entry->bytes == bytes) {
+			memcpy(readarr, entry->data, bytes);
+			msg_cspew("(cached) ");
+			return 0;
+		}
+	}
+
+	ret = spi_send_command(flash, cmdlen, bytes, cmd, readarr);
+	if (ret || bytes > (int)sizeof(entry->data))
+		return ret;
+
+	/* RES also releases chips from deep power-down, answers to other commands may change. */
+	if (cmd[0] == JEDEC_RES) {
+		for (i = 0, j = 0; i < prog->spi_id_cache_count; i++) {
+			if (prog->spi_id_cache[i].opcode == JEDEC_RES)
+				prog->spi_id_cache[j++] = prog->spi_id_cache[i];
+		}
+		prog->spi_id_cache_count = j;
+	}
+
+	if (prog->spi_id_cache_count < SPI_ID_CACHE_SIZE) {
+		entry = &prog->spi_id_cache[prog->spi_id_cache_count++];
+		entry->mst = flash->mst.spi;
+		entry->opcode = cmd[0];
+		entry->bytes = bytes;
+		memcpy(entry->data, readarr, bytes);
+	}
+
+	return 0;
+}
+
 static int spi_rdid(struct flashctx *flash, unsigned char *readarr, int bytes)
 {
 	static const unsigned char cmd[JEDEC_RDID_OUTSIZE] = { JEDEC_RDID };
 	int ret;
 	int i;
 
-	ret = spi_send_command(flash, sizeof(cmd), bytes, cmd, readarr);
+	ret = spi_id_command(flash, cmd, sizeof(cmd), readarr, bytes);
 	if (ret)
 		return ret;
 	msg_cspew("RDID returned");
@@ -48,7 +101,7 @@ static int spi_rems(struct flashctx *flash, unsigned char *readarr)
 	static const unsigned char cmd[JEDEC_REMS_OUTSIZE] = { JEDEC_REMS, };
 	int ret;
 
-	ret = spi_send_command(flash, sizeof(cmd), JEDEC_REMS_INSIZE, cmd, readarr);
+	ret = spi_id_command(flash, cmd, sizeof(cmd), readarr, JEDEC_REMS_INSIZE);
 	if (ret)
 		return ret;
 	msg_cspew("REMS returned 0x%02x 0x%02x. ", readarr[0], readarr[1]);
@@ -61,7 +114,7 @@ static int spi_res(struct flashctx *flash, unsigned char *readarr, int bytes)
 	int ret;
 	int i;
 
-	ret = spi_send_command(flash, sizeof(cmd), bytes, cmd, readarr);
+	ret = spi_id_command(flash, cmd, sizeof(cmd), readarr, bytes);
 	if (ret)
 		return ret;
 	msg_cspew("RES returned");
@@ -270,7 +323,7 @@ int probe_spi_at25f(struct flashctx *flash)
 	uint32_t id1;
 	uint32_t id2;
 
-	if (spi_send_command(flash, sizeof(cmd), sizeof(readarr), cmd, readarr))
+	if (spi_id_command(flash, cmd, sizeof(cmd), readarr, sizeof(readarr)))
 		return 0;
 
 	id1 = readarr[0];
@@ -284,9 +337,29 @@ int probe_spi_at25f(struct flashctx *flash)
 	return 0;
 }
 
-static int spi_poll_wip(struct flashctx *const flash, const unsigned int poll_delay)
+/*
+ * Wait for WIP to clear. We sleep through most of the typical time
+ * first and then poll with exponentially increasing intervals, so
+ * slow links don't waste too many transactions on status reads.
+ * Masters that can poll on their side provide their own implementation.
+ */
+int spi_poll_wip(struct flashctx *const flash, const struct wip_timing *const timing)
 {
-	/* FIXME: We don't time out. */
+	const unsigned int max_delay = min(max(timing->typ_us / 2, 1), 1000 * 1000);
+	unsigned int delay = max(timing->typ_us / 16, 1);
+	unsigned int waited = 0;
+
+	if (flash->mst.spi->poll_busy) {
+		++flash->stats.wip_polls;
+		return flash->mst.spi->poll_busy(flash, timing);
+	}
+
+	const uint64_t start = monotonic_us();
+	if (!timing->generic && timing->typ_us >= 4) {
+		waited = timing->typ_us / 4 * 3;
+		programmer_delay(flash, waited);
+	}
+
 	while (true) {
 		uint8_t status;
 		int ret = spi_read_register(flash, STATUS1, &status);
@@ -294,9 +367,42 @@ static int spi_poll_wip(struct flashctx *const flash, const unsigned int poll_de
 			return ret;
 		if (!(status & SPI_SR_WIP))
 			return 0;
+		++flash->stats.wip_polls;
+
+		/* Delays of virtual clocks (cf. dummy) don't show in the wall time. */
+		const uint64_t wall_us = monotonic_us() - start;
+		const unsigned long long elapsed = wall_us > waited ? wall_us : waited;
+		if (elapsed >= timing->max_us) {
+			msg_cerr("Timeout: WIP still set after %llu us, maximum time is %u us.\n",
+				 elapsed, timing->max_us);
+			return TIMEOUT_ERROR;
+		}
+
+		programmer_delay(flash, delay);
+		waited += delay;
+		delay = min(delay * 2, max_delay);
+	}
+}
+
+/* Use the chip's timing if known, the given default otherwise. */
+static const struct wip_timing *spi_timing_or(const struct wip_timing *const chip_timing,
+					      const struct wip_timing *const fallback)
+{
+	return chip_timing->typ_us && chip_timing->max_us ? chip_timing : fallback;
+}
+
+static const struct wip_timing *spi_erase_timing(const struct flashctx *const flash,
+						 const unsigned int blocklen,
+						 const struct wip_timing *const fallback)
+{
+	const struct spi_timings *const timings = &flash->chip->spi_timing;
+	size_t i;
 
-		programmer_delay(poll_delay);
+	for (i = 0; i < ARRAY_SIZE(timings->erase); ++i) {
+		if (timings->erase[i].block_size == blocklen)
+			return spi_timing_or(&timings->erase[i].timing, fallback);
 	}
+	return fallback;
 }
 
 /**
@@ -304,31 +410,24 @@ static int spi_poll_wip(struct flashctx *const flash, const unsigned int poll_de
  *
  * @param flash       the flash chip's context
  * @param op          the operation to execute
- * @param poll_delay  interval in us for polling WIP, don't poll if zero
+ * @param timing      expected duration of `op`, don't poll if NULL
  * @return 0 on success, non-zero otherwise
  */
-static int spi_simple_write_cmd(struct flashctx *const flash, const uint8_t op, const unsigned int poll_delay)
-{
-	struct spi_command cmds[] = {
-	{
-		.readarr = 0,
-		.writecnt = 1,
-		.writearr = (const unsigned char[]){ JEDEC_WREN },
-	}, {
-		.readarr = 0,
-		.writecnt = 1,
-		.writearr = (const unsigned char[]){ op },
-	},
-		NULL_SPI_CMD,
-	};
+static int spi_simple_write_cmd(struct flashctx *const flash, const uint8_t op,
+				const struct wip_timing *const timing)
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	const unsigned char cmd[] = { op };
+	struct spi_queue queue = { .count = 0 };
 
-	const int result = spi_send_multicommand(flash, cmds);
+	spi_queue_add(flash, &queue, wren, sizeof(wren), NULL, 0);
+	spi_queue_add(flash, &queue, cmd, sizeof(cmd), NULL, 0);
+	spi_queue_poll(&queue, timing);
+
+	const int result = spi_queue_flush(flash, &queue);
 	if (result)
 		msg_cerr("%s failed during command execution\n", __func__);
-
-	const int status = poll_delay ? spi_poll_wip(flash, poll_delay) : 0;
-
-	return result ? result : status;
+	return result;
 }
 
 static int spi_write_extended_address_register(struct flashctx *const flash, const uint8_t regdata)
@@ -343,20 +442,14 @@ static int spi_write_extended_address_register(struct flashctx *const flash, con
 		return -1;
 	}
 
-	struct spi_command cmds[] = {
-	{
-		.readarr = 0,
-		.writecnt = 1,
-		.writearr = (const unsigned char[]){ JEDEC_WREN },
-	}, {
-		.readarr = 0,
-		.writecnt = 2,
-		.writearr = (const unsigned char[]){ op, regdata },
-	},
-		NULL_SPI_CMD,
-	};
+	static const unsigned char wren[] = { JEDEC_WREN };
+	const unsigned char cmd[] = { op, regdata };
+	struct spi_queue queue = { .count = 0 };
 
-	const int result = spi_send_multicommand(flash, cmds);
+	spi_queue_add(flash, &queue, wren, sizeof(wren), NULL, 0);
+	spi_queue_add(flash, &queue, cmd, sizeof(cmd), NULL, 0);
+
+	const int result = spi_queue_flush(flash, &queue);
 	if (result)
 		msg_cerr("%s failed during command execution\n", __func__);
 	return result;
@@ -365,44 +458,191 @@ static int spi_write_extended_address_register(struct flashctx *const flash, con
 int spi_set_extended_address(struct flashctx *const flash, const uint8_t addr_high)
 {
 	if (flash->address_high_byte != addr_high &&
-	    spi_write_extended_address_register(flash, addr_high))
+	    spi_write_extended_address_register(flash, addr_high)) {
+		/* We don't know what the register holds now. */
+		flash->address_high_byte = -1;
 		return -1;
+	}
 	flash->address_high_byte = addr_high;
 	return 0;
 }
 
-static int spi_prepare_address(struct flashctx *const flash, uint8_t cmd_buf[],
-			       const bool native_4ba, const unsigned int addr)
+unsigned int spi_die_count(const struct flashctx *const flash)
 {
-	if (native_4ba || flash->in_4ba_mode) {
-		if (!spi_master_4ba(flash)) {
-			msg_cwarn("4-byte address requested but master can't handle 4-byte addresses.\n");
-			return -1;
-		}
+	return flash->chip->dies > 1 ? flash->chip->dies : 1;
+}
+
+unsigned int spi_die_size(const struct flashctx *const flash)
+{
+	return flash->chip->total_size * 1024 / spi_die_count(flash);
+}
+
+/* Select `die` of a stacked-die chip for the following commands. */
+static int spi_switch_die(struct flashctx *const flash, const unsigned int die)
+{
+	if (spi_die_count(flash) == 1 || flash->die.active == (int)die)
+		return 0;
+
+	const unsigned char cmd[JEDEC_SELECT_DIE_OUTSIZE] = { JEDEC_SELECT_DIE, die };
+	if (spi_send_command(flash, sizeof(cmd), 0, cmd, NULL)) {
+		msg_cerr("Failed to select die %u.\n", die);
+		flash->die.active = -1;
+		return 1;
+	}
+	flash->die.active = die;
+	/* Each die has its own status registers. */
+	memset(&flash->status_shadow, 0, sizeof(flash->status_shadow));
+	return 0;
+}
+
+/*
+ * Send the following commands to `die` of a stacked-die chip (single-
+ * die chips only have die 0). If an operation was posted on that die,
+ * wait until it is done. As the other dies, or other chips, kept the
+ * programmer busy meanwhile, it often is already.
+ */
+int spi_select_die(struct flashctx *const flash, const unsigned int die)
+{
+	if (spi_switch_die(flash, die))
+		return 1;
+
+	const struct wip_timing *const timing = flash->die.busy[die].timing;
+	if (!timing)
+		return 0;
+	flash->die.busy[die].timing = NULL;
+
+	uint8_t status;
+	if (spi_read_register(flash, STATUS1, &status))
+		return 1;
+	if (!(status & SPI_SR_WIP))
+		return 0;
+	++flash->stats.wip_polls;
+
+	/* Programmers with a simulated clock only account for our delays. */
+	const uint64_t elapsed = MAX(monotonic_us() - flash->die.busy[die].start_us,
+				     programmer_delay_total(flash) - flash->die.busy[die].start_delay_us);
+	const struct wip_timing rest = {
+		.typ_us = elapsed < timing->typ_us ? timing->typ_us - elapsed : 0,
+		.max_us = timing->max_us,
+	};
+	return spi_poll_wip(flash, &rest);
+}
+
+/*
+ * Check once, without waiting, if the operation posted on `die` is still
+ * running. Returns 1 if it is, 0 if it's done or there was none, and a
+ * negative value if the chip couldn't be asked.
+ */
+int spi_die_busy(struct flashctx *const flash, const unsigned int die)
+{
+	if (!flash->die.busy[die].timing)
+		return 0;
+
+	uint8_t status;
+	if (spi_switch_die(flash, die) || spi_read_register(flash, STATUS1, &status))
+		return -1;
+	if (status & SPI_SR_WIP) {
+		++flash->stats.wip_polls;
+		return 1;
+	}
+	flash->die.busy[die].timing = NULL;
+	return 0;
+}
+
+/* Leave an operation running on the selected die. spi_select_die() waits for it. */
+static void spi_post_die(struct flashctx *const flash, const struct wip_timing *const timing)
+{
+	const unsigned int die = spi_die_count(flash) > 1 ? flash->die.active : 0;
+
+	flash->die.busy[die].timing = timing;
+	flash->die.busy[die].start_us = monotonic_us();
+	flash->die.busy[die].start_delay_us = programmer_delay_total(flash);
+}
+
+/* Wait for the operations posted on all dies. */
+int spi_wait_dies(struct flashctx *const flash)
+{
+	unsigned int die;
+	int ret = 0;
+
+	for (die = 0; die < spi_die_count(flash); ++die) {
+		if (flash->die.busy[die].timing && spi_select_die(flash, die))
+			ret = 1;
+	}
+	return ret;
+}
+
+/* Put `addr_len` bytes of `addr` after the opcode, for 3 bytes set up the EAR if needed. */
+static int spi_put_address(struct flashctx *const flash, uint8_t cmd_buf[], const bool ear,
+			   const unsigned int addr_len, const unsigned int addr)
+{
+	if (addr_len == 4) {
 		cmd_buf[1] = (addr >> 24) & 0xff;
 		cmd_buf[2] = (addr >> 16) & 0xff;
 		cmd_buf[3] = (addr >>  8) & 0xff;
 		cmd_buf[4] = (addr >>  0) & 0xff;
 		return 4;
-	} else {
-		if (flash->chip->feature_bits & FEATURE_4BA_EAR_ANY) {
-			if (spi_set_extended_address(flash, addr >> 24))
-				return -1;
-		} else if (addr >> 24) {
-			msg_cerr("Can't handle 4-byte address for opcode '0x%02x'\n"
-				 "with this chip/programmer combination.\n", cmd_buf[0]);
+	}
+
+	if (ear) {
+		if (spi_set_extended_address(flash, addr >> 24))
 			return -1;
-		}
-		cmd_buf[1] = (addr >> 16) & 0xff;
-		cmd_buf[2] = (addr >>  8) & 0xff;
-		cmd_buf[3] = (addr >>  0) & 0xff;
-		return 3;
+	} else if (addr >> 24) {
+		msg_cerr("Can't handle 4-byte address for opcode '0x%02x'\n"
+			 "with this chip/programmer combination.\n", cmd_buf[0]);
+		return -1;
+	}
+	cmd_buf[1] = (addr >> 16) & 0xff;
+	cmd_buf[2] = (addr >>  8) & 0xff;
+	cmd_buf[3] = (addr >>  0) & 0xff;
+	return 3;
+}
+
+static int spi_prepare_address(struct flashctx *const flash, uint8_t cmd_buf[],
+			       const bool native_4ba, const unsigned int addr)
+{
+	if ((native_4ba || flash->in_4ba_mode) && !spi_master_4ba(flash)) {
+		msg_cwarn("4-byte address requested but master can't handle 4-byte addresses.\n");
+		return -1;
+	}
+	return spi_put_address(flash, cmd_buf, flash->chip->feature_bits & FEATURE_4BA_EAR_ANY,
+			       native_4ba || flash->in_4ba_mode ? 4 : 3, addr);
+}
+
+/* Send WREN and the write command `cmd` that already holds opcode and address. */
+static int spi_send_write_cmd(struct flashctx *const flash, uint8_t cmd[], const size_t cmd_size,
+			      const int addr_len, const unsigned int addr,
+			      const uint8_t *const out_bytes, const size_t out_len,
+			      const struct wip_timing *const timing)
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	struct spi_queue queue = { .count = 0 };
+
+	if (1 + addr_len + out_len > cmd_size) {
+		msg_cerr("%s called for too long a write\n", __func__);
+		return 1;
+	}
+	if (!out_bytes && out_len > 0)
+		return 1;
+
+	spi_queue_add(flash, &queue, wren, sizeof(wren), NULL, 0);
+	if (flash->mst.spi->features & SPI_MASTER_GATHER) {
+		spi_queue_add_data(flash, &queue, cmd, 1 + addr_len, out_bytes, out_len);
+	} else {
+		memcpy(cmd + 1 + addr_len, out_bytes, out_len);
+		spi_queue_add(flash, &queue, cmd, 1 + addr_len + out_len, NULL, 0);
 	}
+	spi_queue_poll(&queue, timing);
+
+	const int result = spi_queue_flush(flash, &queue);
+	if (result)
+		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
+	return result;
 }
 
 /**
  * Execute WREN plus another `op` that takes an address and
- * optional data, poll WIP afterwards.
+ * optional data, poll WIP afterwards (see spi_queue_flush()).
  *
  * @param flash       the flash chip's context
  * @param op          the operation to execute
@@ -411,74 +651,127 @@ static int spi_prepare_address(struct flashctx *const flash, uint8_t cmd_buf[],
  * @param out_bytes   bytes to send after the address,
  *                    may be NULL if and only if `out_bytes` is 0
  * @param out_bytes   number of bytes to send, 256 at most, may be zero
- * @param poll_delay  interval in us for polling WIP
+ * @param timing      expected duration of `op`, don't poll if NULL
  * @return 0 on success, non-zero otherwise
  */
 static int spi_write_cmd(struct flashctx *const flash, const uint8_t op,
 			 const bool native_4ba, const unsigned int addr,
 			 const uint8_t *const out_bytes, const size_t out_len,
-			 const unsigned int poll_delay)
+			 const struct wip_timing *const timing)
 {
 	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN + 256];
-	struct spi_command cmds[] = {
-	{
-		.readarr = 0,
-		.writecnt = 1,
-		.writearr = (const unsigned char[]){ JEDEC_WREN },
-	}, {
-		.readarr = 0,
-		.writearr = cmd,
-	},
-		NULL_SPI_CMD,
-	};
 
 	cmd[0] = op;
 	const int addr_len = spi_prepare_address(flash, cmd, native_4ba, addr);
 	if (addr_len < 0)
 		return 1;
 
-	if (1 + addr_len + out_len > sizeof(cmd)) {
-		msg_cerr("%s called for too long a write\n", __func__);
-		return 1;
-	}
-	if (!out_bytes && out_len > 0)
+	return spi_send_write_cmd(flash, cmd, sizeof(cmd), addr_len, addr, out_bytes, out_len, timing);
+}
+
+/*
+ * Erase commands take addresses of the whole chip. On stacked-die chips,
+ * they go to the respective die and are posted if `flash->die.post` is
+ * set, so the next die can start erasing right away.
+ */
+static int spi_erase_cmd(struct flashctx *const flash, const uint8_t op,
+			 const bool native_4ba, const unsigned int addr,
+			 const struct wip_timing *const timing)
+{
+	const unsigned int die_size = spi_die_size(flash);
+
+	if (spi_select_die(flash, addr / die_size))
 		return 1;
+	if (!flash->die.post)
+		return spi_write_cmd(flash, op, native_4ba, addr % die_size, NULL, 0, timing);
 
-	memcpy(cmd + 1 + addr_len, out_bytes, out_len);
-	cmds[1].writecnt = 1 + addr_len + out_len;
+	const int ret = spi_write_cmd(flash, op, native_4ba, addr % die_size, NULL, 0, NULL);
+	if (!ret)
+		spi_post_die(flash, timing);
+	return ret;
+}
 
-	const int result = spi_send_multicommand(flash, cmds);
-	if (result)
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
+/* Defaults for chips without known timings. */
+static const struct wip_timing
+	timing_program		= {         700,          10 * 1000, true },
+	timing_byte_program	= {          20,                100, true },
+	timing_aai_word		= {          10,           1 * 1000, true },
+	timing_erase_small	= {    8 * 1000,         200 * 1000, true }, /* 256B..4K, 0x50/0x81 */
+	timing_erase_page	= {   10 * 1000,        1000 * 1000, true }, /* 0xdb, worn out devices take long */
+	timing_erase_4k		= {   50 * 1000,        2000 * 1000, true },
+	timing_erase_block	= {  150 * 1000,        8000 * 1000, true },
+	timing_erase_die	= {  240 * 1000 * 1000, 1000 * 1000 * 1000, true },
+	timing_erase_chip	= {   10 * 1000 * 1000, 1000 * 1000 * 1000, true },
+	timing_erase_chip_62	= {    3 * 1000 * 1000,   20 * 1000 * 1000, true };
+
+/*
+ * The page-program time is for a full page. Shorter writes take less,
+ * down to the byte-program time for a single byte.
+ */
+static struct wip_timing spi_program_timing(const struct flashctx *const flash,
+					    const struct wip_timing *const page, const unsigned int len)
+{
+	const unsigned int page_size = flash->chip->page_size ? flash->chip->page_size : 256;
+	struct wip_timing timing = *page;
+
+	if (len < page_size && page->typ_us > timing_byte_program.typ_us)
+		timing.typ_us = timing_byte_program.typ_us +
+				(page->typ_us - timing_byte_program.typ_us) * len / page_size;
+	return timing;
+}
+
+static const struct wip_timing *spi_chip_erase_timing(const struct flashctx *const flash,
+						      const struct wip_timing *const fallback)
+{
+	return spi_timing_or(&flash->chip->spi_timing.chip_erase, fallback);
+}
+
+/* On stacked-die chips, the chip erase commands erase the selected die only. */
+static int spi_die_erase(struct flashctx *const flash, const uint8_t op,
+			 const unsigned int addr, const unsigned int blocklen,
+			 const struct wip_timing *const timing)
+{
+	const unsigned int die_size = spi_die_size(flash);
 
-	const int status = spi_poll_wip(flash, poll_delay);
+	if (addr % die_size || blocklen != die_size) {
+		msg_cerr("%s called with incorrect arguments\n", __func__);
+		return -1;
+	}
+	if (spi_select_die(flash, addr / die_size))
+		return 1;
+	if (!flash->die.post)
+		return spi_simple_write_cmd(flash, op, timing);
 
-	return result ? result : status;
+	const int ret = spi_simple_write_cmd(flash, op, NULL);
+	if (!ret)
+		spi_post_die(flash, timing);
+	return ret;
 }
 
 static int spi_chip_erase_60(struct flashctx *flash)
 {
-	/* This usually takes 1-85s, so wait in 1s steps. */
-	return spi_simple_write_cmd(flash, 0x60, 1000 * 1000);
+	/* This usually takes 1-85s. */
+	return spi_simple_write_cmd(flash, 0x60, spi_chip_erase_timing(flash, &timing_erase_chip));
 }
 
 static int spi_chip_erase_62(struct flashctx *flash)
 {
-	/* This usually takes 2-5s, so wait in 100ms steps. */
-	return spi_simple_write_cmd(flash, 0x62, 100 * 1000);
+	/* This usually takes 2-5s. */
+	return spi_simple_write_cmd(flash, 0x62, spi_chip_erase_timing(flash, &timing_erase_chip_62));
 }
 
 static int spi_chip_erase_c7(struct flashctx *flash)
 {
-	/* This usually takes 1-85s, so wait in 1s steps. */
-	return spi_simple_write_cmd(flash, 0xc7, 1000 * 1000);
+	/* This usually takes 1-85s. */
+	return spi_simple_write_cmd(flash, 0xc7, spi_chip_erase_timing(flash, &timing_erase_chip));
 }
 
 int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0x52, false, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0x52, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 /* Block size is usually
@@ -486,8 +779,9 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
  */
 int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 240-480s, so wait in 500ms steps. */
-	return spi_write_cmd(flash, 0xc4, false, addr, NULL, 0, 500 * 1000);
+	/* This usually takes 240-480s. */
+	return spi_erase_cmd(flash, 0xc4, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_die));
 }
 
 /* Block size is usually
@@ -498,8 +792,9 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
 int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0xd8, false, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0xd8, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 /* Block size is usually
@@ -508,41 +803,49 @@ int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
 int spi_block_erase_d7(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0xd7, false, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0xd7, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 /* Page erase (usually 256B blocks) */
 int spi_block_erase_db(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
 	/* This takes up to 20ms usually (on worn out devices
-	   up to the 0.5s range), so wait in 1ms steps. */
-	return spi_write_cmd(flash, 0xdb, false, addr, NULL, 0, 1 * 1000);
+	   up to the 0.5s range). */
+	return spi_erase_cmd(flash, 0xdb, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_page));
 }
 
 /* Sector size is usually 4k, though Macronix eliteflash has 64k */
 int spi_block_erase_20(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	/* This usually takes 15-800ms, so wait in 10ms steps. */
-	return spi_write_cmd(flash, 0x20, false, addr, NULL, 0, 10 * 1000);
+	/* This usually takes 15-800ms. */
+	return spi_erase_cmd(flash, 0x20, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_4k));
 }
 
 int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 10ms, so wait in 1ms steps. */
-	return spi_write_cmd(flash, 0x50, false, addr, NULL, 0, 1 * 1000);
+	/* This usually takes 10ms. */
+	return spi_erase_cmd(flash, 0x50, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_small));
 }
 
 int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 8ms, so wait in 1ms steps. */
-	return spi_write_cmd(flash, 0x81, false, addr, NULL, 0, 1 * 1000);
+	/* This usually takes 8ms. */
+	return spi_erase_cmd(flash, 0x81, false, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_small));
 }
 
 int spi_block_erase_60(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
+	if (spi_die_count(flash) > 1)
+		return spi_die_erase(flash, 0x60, addr, blocklen,
+				     spi_chip_erase_timing(flash, &timing_erase_chip));
 	if ((addr != 0) || (blocklen != flash->chip->total_size * 1024)) {
 		msg_cerr("%s called with incorrect arguments\n",
 			__func__);
@@ -553,6 +856,9 @@ int spi_block_erase_60(struct flashctx *flash, unsigned int addr,
 
 int spi_block_erase_62(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
+	if (spi_die_count(flash) > 1)
+		return spi_die_erase(flash, 0x62, addr, blocklen,
+				     spi_chip_erase_timing(flash, &timing_erase_chip_62));
 	if ((addr != 0) || (blocklen != flash->chip->total_size * 1024)) {
 		msg_cerr("%s called with incorrect arguments\n",
 			__func__);
@@ -564,6 +870,9 @@ int spi_block_erase_62(struct flashctx *flash, unsigned int addr, unsigned int b
 int spi_block_erase_c7(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
+	if (spi_die_count(flash) > 1)
+		return spi_die_erase(flash, 0xc7, addr, blocklen,
+				     spi_chip_erase_timing(flash, &timing_erase_chip));
 	if ((addr != 0) || (blocklen != flash->chip->total_size * 1024)) {
 		msg_cerr("%s called with incorrect arguments\n",
 			__func__);
@@ -575,29 +884,33 @@ int spi_block_erase_c7(struct flashctx *flash, unsigned int addr,
 /* Erase 4 KB of flash with 4-bytes address from ANY mode (3-bytes or 4-bytes) */
 int spi_block_erase_21(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 15-800ms, so wait in 10ms steps. */
-	return spi_write_cmd(flash, 0x21, true, addr, NULL, 0, 10 * 1000);
+	/* This usually takes 15-800ms. */
+	return spi_erase_cmd(flash, 0x21, true, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_4k));
 }
 
 /* Erase 32 KB of flash with 4-bytes address from ANY mode (3-bytes or 4-bytes) */
 int spi_block_erase_53(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0x53, true, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0x53, true, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 /* Erase 32 KB of flash with 4-bytes address from ANY mode (3-bytes or 4-bytes) */
 int spi_block_erase_5c(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0x5c, true, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0x5c, true, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 /* Erase 64 KB of flash with 4-bytes address from ANY mode (3-bytes or 4-bytes) */
 int spi_block_erase_dc(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	/* This usually takes 100-4000ms, so wait in 100ms steps. */
-	return spi_write_cmd(flash, 0xdc, true, addr, NULL, 0, 100 * 1000);
+	/* This usually takes 100-4000ms. */
+	return spi_erase_cmd(flash, 0xdc, true, addr,
+			     spi_erase_timing(flash, blocklen, &timing_erase_block));
 }
 
 static const struct {
@@ -633,17 +946,174 @@ erasefunc_t *spi25_get_erasefn_from_opcode(uint8_t opcode)
 	return NULL;
 }
 
-static int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes, unsigned int len)
+/* Put the program opcode and the address into `cmd`. Returns the address length or -1. */
+static int spi_prepare_program(struct flashctx *const flash, uint8_t cmd[], const unsigned int addr)
 {
+	if (flash->spi_ops.program_valid) {
+		cmd[0] = flash->spi_ops.program_op;
+		return spi_put_address(flash, cmd, flash->spi_ops.ear, flash->spi_ops.program_addr_len, addr);
+	}
+
 	const bool native_4ba = flash->chip->feature_bits & FEATURE_4BA_WRITE && spi_master_4ba(flash);
-	const uint8_t op = native_4ba ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
-	return spi_write_cmd(flash, op, native_4ba, addr, bytes, len, 10);
+	cmd[0] = native_4ba ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
+	return spi_prepare_address(flash, cmd, native_4ba, addr);
+}
+
+static int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes, unsigned int len)
+{
+	const struct wip_timing *const page_timing = flash->spi_ops.program_valid
+		? flash->spi_ops.program_timing
+		: spi_timing_or(&flash->chip->spi_timing.page_program, &timing_program);
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN + 256];
+
+	const int addr_len = spi_prepare_program(flash, cmd, addr);
+	if (addr_len < 0)
+		return 1;
+	const struct wip_timing timing = spi_program_timing(flash, page_timing, len);
+	return spi_send_write_cmd(flash, cmd, sizeof(cmd), addr_len, addr, bytes, len, &timing);
+}
+
+static const struct fast_read_params fast_read_defaults[NUM_IO_MODES] = {
+	[SINGLE_IO_1_1_1]	= { JEDEC_READ,		 0, 0 },
+	[DUAL_OUT_1_1_2]	= { JEDEC_READ_DUAL_OUT, 0, 8 },
+	[DUAL_IO_1_2_2]		= { JEDEC_READ_DUAL_IO,	 4, 0 },
+	[QUAD_OUT_1_1_4]	= { JEDEC_READ_QUAD_OUT, 0, 8 },
+	[QUAD_IO_1_4_4]		= { JEDEC_READ_QUAD_IO,	 2, 4 },
+	[QPI_4_4_4]		= { JEDEC_READ_QUAD_IO,	 2, 4 },
+};
+
+/* Fastest first. */
+static const struct {
+	enum io_mode io_mode;
+	int chip_feature;
+	uint32_t master_feature;
+} fast_read_modes[] = {
+	{ QUAD_IO_1_4_4,  FEATURE_FAST_READ_QIO,  SPI_MASTER_QUAD_IO },
+	{ QUAD_OUT_1_1_4, FEATURE_FAST_READ_QOUT, SPI_MASTER_QUAD_OUT },
+	{ DUAL_IO_1_2_2,  FEATURE_FAST_READ_DIO,  SPI_MASTER_DUAL_IO },
+	{ DUAL_OUT_1_1_2, FEATURE_FAST_READ_DOUT, SPI_MASTER_DUAL_OUT },
+};
+
+/*
+ * Look up the fast read of the chip in I/O mode `mode`. Returns the
+ * number of mode and dummy bytes to be sent after the address, or -1
+ * if they don't make full bytes.
+ */
+static int spi_fast_read_params(const struct flashchip *const chip, const enum io_mode mode,
+				uint8_t *const opcode)
+{
+	const struct fast_read_params *params = &chip->fast_read[mode];
+	if (!params->opcode)
+		params = &fast_read_defaults[mode];
+
+	const unsigned int bits = (params->mode_clocks + params->dummy_clocks) * spi_addr_lines(mode);
+	if (bits % 8) {
+		msg_cdbg2("Skipping I/O mode %d, %u mode/dummy bits don't make full bytes.\n", mode, bits);
+		return -1;
+	}
+
+	*opcode = params->opcode;
+	return bits / 8;
+}
+
+/*
+ * Select the fastest multi-I/O read that both the chip and the master
+ * support. Returns the number of mode and dummy bytes to be sent after
+ * the address, or -1 if we should fall back to a single-I/O read.
+ */
+static int spi_select_fast_read(const struct flashctx *const flash, const unsigned int address,
+				enum io_mode *const io_mode, uint8_t *const opcode)
+{
+	const struct flashchip *const chip = flash->chip;
+	size_t i;
+
+	/* Multi-I/O reads take a 3-byte address unless we are in 4BA mode. */
+	if ((address >> 24) && !flash->in_4ba_mode && !(chip->feature_bits & FEATURE_4BA_EAR_ANY))
+		return -1;
+
+	/* spi_prepare_qpi() made sure that this works. */
+	if (flash->in_qpi_mode) {
+		*io_mode = QPI_4_4_4;
+		return spi_fast_read_params(chip, QPI_4_4_4, opcode);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fast_read_modes); ++i) {
+		const enum io_mode mode = fast_read_modes[i].io_mode;
+
+		if (!(chip->feature_bits & fast_read_modes[i].chip_feature) ||
+		    !(flash->mst.spi->features & fast_read_modes[i].master_feature))
+			continue;
+
+		const int dummy_len = spi_fast_read_params(chip, mode, opcode);
+		if (dummy_len < 0)
+			continue;
+
+		*io_mode = mode;
+		return dummy_len;
+	}
+
+	return -1;
 }
 
 int spi_nbyte_read(struct flashctx *flash, uint8_t *dst, unsigned int address, unsigned int len)
 {
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN + 32];
+	enum io_mode io_mode;
+	uint8_t opcode;
+
+	if (flash->spi_ops.read_valid) {
+		cmd[0] = flash->spi_ops.read_op;
+		const int addr_len = spi_put_address(flash, cmd, flash->spi_ops.ear,
+						     flash->spi_ops.read_addr_len, address);
+		if (addr_len < 0)
+			return 1;
+		if (flash->spi_ops.read_io_mode == SINGLE_IO_1_1_1)
+			return spi_send_command(flash, 1 + addr_len, len, cmd, dst);
+		memset(cmd + 1 + addr_len, 0xff, flash->spi_ops.read_dummy_len);
+
+		struct spi_command cmds[] = {
+		{
+			.io_mode	= flash->spi_ops.read_io_mode,
+			.writecnt	= 1 + addr_len + flash->spi_ops.read_dummy_len,
+			.writearr	= cmd,
+			.readcnt	= len,
+			.readarr	= dst,
+		},
+			NULL_SPI_CMD,
+		};
+		return spi_send_multicommand(flash, cmds);
+	}
+
+	const int dummy_len = spi_select_fast_read(flash, address, &io_mode, &opcode);
+	if (dummy_len >= 0 && (size_t)dummy_len <= sizeof(cmd) - 1 - JEDEC_MAX_ADDR_LEN) {
+		cmd[0] = opcode;
+		const int addr_len = spi_prepare_address(flash, cmd, false, address);
+		if (addr_len < 0)
+			return 1;
+
+		/*
+		 * Send the mode byte as 0xff, so the chip never enters the
+		 * continuous-read ("XIP") mode. On Winbond parts, e.g., a mode
+		 * byte of 0xAx is what enters it.
+		 */
+		memset(cmd + 1 + addr_len, 0xff, dummy_len);
+
+		struct spi_command cmds[] = {
+		{
+			.io_mode	= io_mode,
+			.writecnt	= 1 + addr_len + dummy_len,
+			.writearr	= cmd,
+			.readcnt	= len,
+			.readarr	= dst,
+		},
+			NULL_SPI_CMD,
+		};
+
+		return spi_send_multicommand(flash, cmds);
+	}
+
 	const bool native_4ba = flash->chip->feature_bits & FEATURE_4BA_READ && spi_master_4ba(flash);
-	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN] = { native_4ba ? JEDEC_READ_4BA : JEDEC_READ, };
+	cmd[0] = native_4ba ? JEDEC_READ_4BA : JEDEC_READ;
 
 	const int addr_len = spi_prepare_address(flash, cmd, native_4ba, address);
 	if (addr_len < 0)
@@ -653,6 +1123,89 @@ int spi_nbyte_read(struct flashctx *flash, uint8_t *dst, unsigned int address, u
 	return spi_send_command(flash, 1 + addr_len, len, cmd, dst);
 }
 
+/*
+ * Prepare a single-I/O read of `len` bytes at `addr` for masters that
+ * implement their own read loop: Put opcode and address into `cmd`,
+ * which must hold 1 + JEDEC_MAX_ADDR_LEN bytes, and set up the extended
+ * address register for 3-byte addresses. The range must not cross a
+ * 16 MiB boundary, which spi_chip_read() guarantees.
+ *
+ * Returns the number of command bytes, 0 if the master should fall back
+ * to default_spi_read(), or -1 on error.
+ */
+int spi_prepare_read_cmd(struct flashctx *const flash, uint8_t cmd[],
+			 const unsigned int addr, const unsigned int len)
+{
+	const bool master_4ba = spi_master_4ba(flash);
+	unsigned int addr_len;
+	bool ear;
+
+	if (flash->spi_ops.read_valid && flash->spi_ops.read_io_mode == SINGLE_IO_1_1_1) {
+		cmd[0] = flash->spi_ops.read_op;
+		addr_len = flash->spi_ops.read_addr_len;
+		ear = flash->spi_ops.ear;
+	} else {
+		if (flash->in_4ba_mode && !master_4ba)
+			return 0;
+		const bool native_4ba = flash->chip->feature_bits & FEATURE_4BA_READ && master_4ba;
+		cmd[0] = native_4ba ? JEDEC_READ_4BA : JEDEC_READ;
+		addr_len = native_4ba || flash->in_4ba_mode ? 4 : 3;
+		ear = flash->chip->feature_bits & FEATURE_4BA_EAR_ANY;
+	}
+
+	if (addr_len == 3 && !ear && len && (addr + len - 1) >> 24)
+		return 0;
+
+	const int ret = spi_put_address(flash, cmd, ear, addr_len, addr);
+	return ret < 0 ? ret : 1 + ret;
+}
+
+/*
+ * Precompute opcodes and address lengths of page program and read for
+ * the current address mode, so that they aren't derived again for every
+ * page. They are invalidated when the address mode changes.
+ */
+void spi_prepare_ops(struct flashctx *const flash)
+{
+	const struct flashchip *const chip = flash->chip;
+	const bool master_4ba = spi_master_4ba(flash);
+	enum io_mode io_mode;
+	uint8_t opcode;
+
+	memset(&flash->spi_ops, 0, sizeof(flash->spi_ops));
+	if (chip->bustype != BUS_SPI || chip->spi_cmd_set != SPI25)
+		return;
+	/* Leave the complaint to spi_prepare_address(). */
+	if (flash->in_4ba_mode && !master_4ba)
+		return;
+
+	flash->spi_ops.ear = chip->feature_bits & FEATURE_4BA_EAR_ANY;
+
+	const bool native_write = chip->feature_bits & FEATURE_4BA_WRITE && master_4ba;
+	flash->spi_ops.program_op = native_write ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
+	flash->spi_ops.program_addr_len = native_write || flash->in_4ba_mode ? 4 : 3;
+	flash->spi_ops.program_timing = spi_timing_or(&chip->spi_timing.page_program, &timing_program);
+	flash->spi_ops.program_valid = true;
+
+	const int dummy_len = spi_select_fast_read(flash, 0, &io_mode, &opcode);
+	if (dummy_len >= 0) {
+		/* Above 16MiB, spi_nbyte_read() may have to fall back to single I/O. */
+		if (dummy_len > 32 || (chip->total_size * KiB > 16 * MiB &&
+				       !flash->in_4ba_mode && !flash->spi_ops.ear))
+			return;
+		flash->spi_ops.read_op = opcode;
+		flash->spi_ops.read_addr_len = flash->in_4ba_mode ? 4 : 3;
+		flash->spi_ops.read_dummy_len = dummy_len;
+		flash->spi_ops.read_io_mode = io_mode;
+	} else {
+		const bool native_read = chip->feature_bits & FEATURE_4BA_READ && master_4ba;
+		flash->spi_ops.read_op = native_read ? JEDEC_READ_4BA : JEDEC_READ;
+		flash->spi_ops.read_addr_len = native_read || flash->in_4ba_mode ? 4 : 3;
+		flash->spi_ops.read_io_mode = SINGLE_IO_1_1_1;
+	}
+	flash->spi_ops.read_valid = true;
+}
+
 /*
  * Write a part of the flash chip.
  * FIXME: Use the chunk code from Michael Karcher instead.
@@ -687,6 +1240,8 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 		for (j = 0; j < lenhere; j += chunksize) {
 			int rc;
 
+			if (flashprog_cancelled(flash))
+				return 1;
 			towrite = min(chunksize, lenhere - j);
 			rc = spi_nbyte_program(flash, starthere + j, buf + starthere - start + j, towrite);
 			if (rc)
@@ -698,27 +1253,173 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 	return 0;
 }
 
+/* Bytes programmed per multicommand by spi_chip_write_1(). */
+#define WRITE_1_BATCH	16
+
+/*
+ * Program `len` bytes with one multicommand: WREN, RDSR and BYTE PROGRAM
+ * for each, and every byte but the first preceded by a status read of
+ * `pad` bytes that waits for the previous one. A busy chip ignores the
+ * WREN, and without WEL the program, so a byte was only programmed if
+ * the RDSR before it shows WEL set and WIP cleared. That status of each
+ * byte is returned in `status`.
+ */
+static int spi_write_1_batch(struct flashctx *flash, const uint8_t *buf, unsigned int addr,
+			     unsigned int len, unsigned int pad, uint8_t status[])
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	unsigned char cmd[WRITE_1_BATCH][1 + JEDEC_MAX_ADDR_LEN + 1];
+	uint8_t wait[SPI_MAX_PAD];
+	struct spi_command cmds[4 * WRITE_1_BATCH + 1];
+	unsigned int i, n = 0;
+
+	for (i = 0; i < len; ++i) {
+		const int addr_len = spi_prepare_program(flash, cmd[i], addr + i);
+		if (addr_len < 0)
+			return 1;
+		cmd[i][1 + addr_len] = buf[i];
+		if (i > 0) {
+			cmds[n++] = (struct spi_command){
+				.writecnt	= sizeof(rdsr),
+				.writearr	= rdsr,
+				.readcnt	= pad,
+				.readarr	= wait,
+			};
+		}
+		cmds[n++] = (struct spi_command){
+			.writecnt	= sizeof(wren),
+			.writearr	= wren,
+		};
+		cmds[n++] = (struct spi_command){
+			.writecnt	= sizeof(rdsr),
+			.writearr	= rdsr,
+			.readcnt	= 1,
+			.readarr	= &status[i],
+		};
+		cmds[n++] = (struct spi_command){
+			.writecnt	= 1 + addr_len + 1,
+			.writearr	= cmd[i],
+		};
+	}
+	cmds[n] = (struct spi_command)NULL_SPI_CMD;
+
+	return spi_send_multicommand(flash, cmds);
+}
+
 /*
  * Program chip using byte programming. (SLOW!)
  * This is for chips which can only handle one byte writes
  * and for chips where memory mapped programming is impossible
  * (e.g. due to size constraints in IT87* for over 512 kB)
+ *
+ * If the SPI clock is known, up to WRITE_1_BATCH bytes are sent per
+ * multicommand, each waiting the maximum byte-program time for the
+ * previous one (see spi_write_1_batch()). The chip is only polled once
+ * per batch, and bytes that it didn't accept are programmed again, one
+ * by one.
  */
 /* real chunksize is 1, logical chunksize is 1 */
 int spi_chip_write_1(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
-	unsigned int i;
+	/* Chip timings are for whole pages, a batch waits the time of single bytes. */
+	const struct wip_timing *const timing = &timing_byte_program;
+	const unsigned int pad = spi_pad_len(flash, timing->max_us);
+	uint8_t status[WRITE_1_BATCH];
+	unsigned int i, j;
+
+	for (i = start; i < start + len; ) {
+		/* An extended address register is only set up once per batch. */
+		const unsigned int n = min(min(start + len - i, WRITE_1_BATCH), 0x1000000 - (i & 0xffffff));
+		if (!pad || n < 2) {
+			if (spi_nbyte_program(flash, i, buf + i - start, 1))
+				return 1;
+			flashprog_progress_add(flash, 1);
+			++i;
+			continue;
+		}
 
-	for (i = start; i < start + len; i++) {
-		if (spi_nbyte_program(flash, i, buf + i - start, 1))
+		if (spi_write_1_batch(flash, buf + i - start, i, n, pad, status) ||
+		    spi_poll_wip(flash, timing))
 			return 1;
-		flashprog_progress_add(flash, 1);
+		for (j = 0; j < n; ++j) {
+			if ((status[j] & (SPI_SR_WEL | SPI_SR_WIP)) == SPI_SR_WEL)
+				continue;
+			msg_cdbg2("Byte at 0x%06x not accepted (status 0x%02x), retrying.\n", i + j, status[j]);
+			if (spi_nbyte_program(flash, i + j, buf + i + j - start, 1))
+				return 1;
+		}
+		flashprog_progress_add(flash, n);
+		i += n;
 	}
 	return 0;
 }
 
+/* AAI words sent per multicommand by default_spi_write_aai(). */
+#define AAI_BATCH_WORDS	16
+
+/*
+ * Send `words` AAI continuation words in one multicommand, each followed
+ * by a status read of `pad` bytes. Chips repeat the status until CS# is
+ * de-asserted, so the read keeps the bus busy while the word is programmed.
+ * The last status byte, taken after the wait, has to show the chip ready,
+ * otherwise the next word may have been ignored.
+ */
+static int spi_aai_batch(struct flashctx *flash, const uint8_t *buf, unsigned int addr, size_t words,
+			 unsigned int pad)
+{
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	unsigned char cmd[AAI_BATCH_WORDS][JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE];
+	uint8_t status[AAI_BATCH_WORDS][SPI_MAX_PAD];
+	struct spi_command cmds[2 * AAI_BATCH_WORDS + 1];
+	size_t i;
+
+	for (i = 0; i < words; ++i) {
+		cmd[i][0] = JEDEC_AAI_WORD_PROGRAM;
+		cmd[i][1] = buf[2 * i];
+		cmd[i][2] = buf[2 * i + 1];
+		cmds[2 * i] = (struct spi_command){
+			.writecnt	= JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE,
+			.writearr	= cmd[i],
+		};
+		cmds[2 * i + 1] = (struct spi_command){
+			.writecnt	= sizeof(rdsr),
+			.writearr	= rdsr,
+			.readcnt	= pad,
+			.readarr	= status[i],
+		};
+	}
+	cmds[2 * words] = (struct spi_command)NULL_SPI_CMD;
+
+	int result = spi_send_multicommand(flash, cmds);
+	for (i = 0; i < words && !result; ++i) {
+		if ((status[i][pad - 1] & (SPI_SR_WIP | SPI_SR_AAI)) != SPI_SR_AAI) {
+			msg_cerr("%s: AAI word at 0x%06zx not done after %u us (status 0x%02x).\n", __func__,
+				 addr + 2 * i, JEDEC_AAI_WORD_PROGRAM_DELAY_US, status[i][pad - 1]);
+			result = SPI_GENERIC_ERROR;
+		}
+	}
+	/* Don't exit AAI mode while the chip is busy. */
+	if (result)
+		spi_poll_wip(flash, &timing_aai_word);
+	return result;
+}
+
 int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
+	return spi_write_aai_batched(flash, buf, start, len, AAI_BATCH_WORDS);
+}
+
+/*
+ * Program with AAI word commands. If the SPI clock is known, up to
+ * `batch_words` words are sent per multicommand, padded to the word-program
+ * time by status reads (see spi_aai_batch()). Otherwise, the chip is polled
+ * after every word.
+ */
+int spi_write_aai_batched(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+			  size_t batch_words)
+{
+	const unsigned int pad = spi_pad_len(flash, JEDEC_AAI_WORD_PROGRAM_DELAY_US);
 	uint32_t pos = start;
 	int result;
 	unsigned char cmd[JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE] = {
@@ -750,7 +1451,7 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 		//return SPI_GENERIC_ERROR;
 	}
 
-	result = spi_write_cmd(flash, JEDEC_AAI_WORD_PROGRAM, false, start, buf + pos - start, 2, 10);
+	result = spi_write_cmd(flash, JEDEC_AAI_WORD_PROGRAM, false, start, buf + pos - start, 2, &timing_aai_word);
 	if (result)
 		goto bailout;
 
@@ -760,6 +1461,16 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 
 	/* Are there at least two more bytes to write? */
 	while (pos < start + len - 1) {
+		const size_t words = min((start + len - pos) / 2, min(batch_words, AAI_BATCH_WORDS));
+		if (pad && words > 1) {
+			result = spi_aai_batch(flash, buf + pos - start, pos, words, pad);
+			if (result)
+				goto bailout;
+			pos += 2 * words;
+			flashprog_progress_add(flash, 2 * words);
+			continue;
+		}
+
 		cmd[1] = buf[pos++ - start];
 		cmd[2] = buf[pos++ - start];
 		result = spi_send_command(flash, JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE, 0, cmd, NULL);
@@ -767,7 +1478,7 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 			msg_cerr("%s failed during followup AAI command execution: %d\n", __func__, result);
 			goto bailout;
 		}
-		if (spi_poll_wip(flash, 10))
+		if (spi_poll_wip(flash, &timing_aai_word))
 			goto bailout;
 		flashprog_progress_add(flash, 2);
 	}
@@ -802,12 +1513,15 @@ static int spi_enter_exit_4ba(struct flashctx *const flash, const bool enter)
 	if (flash->chip->feature_bits & FEATURE_4BA_ENTER)
 		ret = spi_send_command(flash, sizeof(cmd), 0, &cmd, NULL);
 	else if (flash->chip->feature_bits & FEATURE_4BA_ENTER_WREN)
-		ret = spi_simple_write_cmd(flash, cmd, 0);
+		ret = spi_simple_write_cmd(flash, cmd, NULL);
 	else if (flash->chip->feature_bits & FEATURE_4BA_ENTER_EAR7)
 		ret = spi_set_extended_address(flash, enter ? 0x80 : 0x00);
 
 	if (!ret)
 		flash->in_4ba_mode = enter;
+	else
+		flash->address_mode_known = false;
+	flash->spi_ops.program_valid = flash->spi_ops.read_valid = false;
 	return ret;
 }
 
@@ -826,9 +1540,6 @@ int spi_prepare_4ba(struct flashctx *const flash, const enum preparation_steps p
 	if (prep != PREPARE_FULL)
 		return 0;
 
-	flash->address_high_byte = -1;
-	flash->in_4ba_mode = false;
-
 	/* Be careful about 4BA chips and broken masters */
 	if (flash->chip->total_size > 16 * 1024 && spi_master_no_4ba_modes(flash)) {
 		/* If we can't use native instructions, bail out */
@@ -839,6 +1550,18 @@ int spi_prepare_4ba(struct flashctx *const flash, const enum preparation_steps p
 		}
 	}
 
+	/*
+	 * The address mode and the extended address register keep their
+	 * state between operations, e.g. searching an FMAP, reading and
+	 * writing. So we only set them up for the first one.
+	 */
+	if (flash->address_mode_known)
+		return 0;
+
+	flash->address_high_byte = -1;
+	flash->in_4ba_mode = false;
+	flash->spi_ops.program_valid = flash->spi_ops.read_valid = false;
+
 	/* Enable/disable 4-byte addressing mode if flash chip supports it */
 	if (flash->chip->feature_bits & (FEATURE_4BA_ENTER | FEATURE_4BA_ENTER_WREN | FEATURE_4BA_ENTER_EAR7)) {
 		int ret;
@@ -852,5 +1575,86 @@ int spi_prepare_4ba(struct flashctx *const flash, const enum preparation_steps p
 		}
 	}
 
+	flash->address_mode_known = true;
 	return 0;
 }
+
+/* Can the chip be switched to QPI mode on this master? */
+static bool spi_qpi_usable(const struct flashctx *const flash)
+{
+	const struct flashchip *const chip = flash->chip;
+	uint8_t opcode;
+
+	if (chip->bustype != BUS_SPI || chip->spi_cmd_set != SPI25 ||
+	    !(chip->feature_bits & FEATURE_QPI) || !chip->qpi.enter_op ||
+	    !(flash->mst.spi->features & SPI_MASTER_QPI))
+		return false;
+
+	/* There is no single-I/O fallback for reads in QPI mode. */
+	if (spi_fast_read_params(chip, QPI_4_4_4, &opcode) < 0)
+		return false;
+	return chip->total_size * KiB <= 16 * MiB ||
+	       flash->in_4ba_mode || chip->feature_bits & FEATURE_4BA_EAR_ANY;
+}
+
+/*
+ * The I/O mode that reads use during flash operations, i.e. after
+ * spi_prepare_qpi(). Single I/O for chips that aren't SPI25.
+ */
+enum io_mode spi_read_io_mode(const struct flashctx *const flash)
+{
+	enum io_mode io_mode;
+	uint8_t opcode;
+
+	if (flash->chip->bustype != BUS_SPI || flash->chip->spi_cmd_set != SPI25)
+		return SINGLE_IO_1_1_1;
+	if (flash->in_qpi_mode || spi_qpi_usable(flash))
+		return QPI_4_4_4;
+	if (spi_select_fast_read(flash, 0, &io_mode, &opcode) < 0)
+		return SINGLE_IO_1_1_1;
+	return io_mode;
+}
+
+/*
+ * Switch the chip into QPI mode for the following operations, if both
+ * the chip and the master can do it. All commands are sent in 4-4-4
+ * mode then, see spi_send_multicommand(). If anything goes wrong, we
+ * stay in single-I/O mode, which works too, only slower.
+ */
+void spi_prepare_qpi(struct flashctx *const flash)
+{
+	const struct flashchip *const chip = flash->chip;
+
+	if (flash->in_qpi_mode || !spi_qpi_usable(flash))
+		return;
+
+	if (spi_set_quad_enable(flash)) {
+		msg_cinfo("Couldn't set the Quad Enable bit, not using QPI mode.\n");
+		return;
+	}
+
+	if (spi_send_command(flash, 1, 0, &chip->qpi.enter_op, NULL)) {
+		msg_cerr("Failed to enter QPI mode!\n");
+		return;
+	}
+	flash->in_qpi_mode = true;
+	spi_prepare_ops(flash);
+	msg_cdbg("Entered QPI mode.\n");
+}
+
+int spi_exit_qpi(struct flashctx *const flash)
+{
+	const uint8_t op = flash->chip->qpi.exit_op ? flash->chip->qpi.exit_op : JEDEC_EXIT_QPI;
+
+	if (!flash->in_qpi_mode)
+		return 0;
+
+	const int ret = spi_send_command(flash, 1, 0, &op, NULL);
+	flash->in_qpi_mode = false;
+	flash->spi_ops.program_valid = flash->spi_ops.read_valid = false;
+	if (ret)
+		msg_cerr("Failed to exit QPI mode!\n");
+	else
+		msg_cdbg("Left QPI mode.\n");
+	return ret;
+}
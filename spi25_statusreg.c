@@ -30,7 +30,7 @@
  */
 static int spi_prepare_wrsr_ext(
 		uint8_t write_cmd[4], size_t *const write_cmd_len,
-		const struct flashctx *const flash,
+		struct flashctx *const flash,
 		const enum flash_reg reg, const uint8_t value)
 {
 	enum flash_reg reg_it;
@@ -41,7 +41,7 @@ static int spi_prepare_wrsr_ext(
 	for (reg_it = STATUS1; reg_it < reg; ++reg_it) {
 		uint8_t sr;
 
-		if (spi_read_register(flash, reg_it, &sr)) {
+		if (spi_read_register_cached(flash, reg_it, &sr)) {
 			msg_cerr("Writing SR%d failed: failed to read SR%d for writeback.\n",
 				 reg - STATUS1 + 1, reg_it - STATUS1 + 1);
 			return 1;
@@ -55,7 +55,7 @@ static int spi_prepare_wrsr_ext(
 	return 0;
 }
 
-int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t value)
+int spi_write_register(struct flashctx *flash, enum flash_reg reg, uint8_t value)
 {
 	int feature_bits = flash->chip->feature_bits;
 
@@ -134,6 +134,13 @@ int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t
 		.readarr	= NULL,
 	}};
 
+	/*
+	 * The chip may ignore some or all of the bits written, e.g. if
+	 * they are locked. So we read the register back before we use
+	 * its shadow again. For SR1, the WIP polling below does that.
+	 */
+	flash->status_shadow.valid[reg] = false;
+
 	int result = spi_send_multicommand(flash, cmds);
 	if (result) {
 		msg_cerr("%s failed during command execution\n", __func__);
@@ -152,7 +159,7 @@ int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t
 	 */
 	int delay_ms = 5000;
 	if (reg == STATUS1) {
-		programmer_delay(100 * 1000);
+		programmer_delay(flash, 100 * 1000);
 		delay_ms -= 100;
 	}
 
@@ -163,7 +170,7 @@ int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t
 			return result;
 		if ((status & SPI_SR_WIP) == 0)
 			return 0;
-		programmer_delay(10 * 1000);
+		programmer_delay(flash, 10 * 1000);
 	}
 
 
@@ -171,7 +178,7 @@ int spi_write_register(const struct flashctx *flash, enum flash_reg reg, uint8_t
 	return TIMEOUT_ERROR;
 }
 
-int spi_read_register(const struct flashctx *flash, enum flash_reg reg, uint8_t *value)
+int spi_read_register(struct flashctx *flash, enum flash_reg reg, uint8_t *value)
 {
 	int feature_bits = flash->chip->feature_bits;
 	uint8_t read_cmd;
@@ -211,15 +218,130 @@ int spi_read_register(const struct flashctx *flash, enum flash_reg reg, uint8_t
 	}
 
 	*value = readarr[0];
+	flash->status_shadow.value[reg] = readarr[0];
+	flash->status_shadow.valid[reg] = true;
 	return 0;
 }
 
+/*
+ * Like spi_read_register(), but return the value last read if there is
+ * one. Only for the non-volatile bits, e.g. for write protection. The
+ * WIP and WEL bits in SR1 are likely stale.
+ */
+int spi_read_register_cached(struct flashctx *flash, enum flash_reg reg, uint8_t *value)
+{
+	if (reg < MAX_REGISTERS && flash->status_shadow.valid[reg]) {
+		*value = flash->status_shadow.value[reg];
+		return 0;
+	}
+	return spi_read_register(flash, reg, value);
+}
+
 static int spi_restore_status(struct flashctx *flash, uint8_t status)
 {
 	msg_cdbg("restoring chip status (0x%02x)\n", status);
 	return spi_write_register(flash, STATUS1, status);
 }
 
+/* Where the Quad Enable bit is, indexed by the JESD216 Quad Enable requirement. */
+static const struct {
+	uint8_t read_ops[2];	/* registers written, QE is in the last one */
+	uint8_t count;
+	uint8_t write_op;
+	uint8_t qe_mask;
+} quad_enable_regs[] = {
+	[2] = { { JEDEC_RDSR },			1, JEDEC_WRSR,	 1 << 6 },
+	[3] = { { ALT_RDSR2_3F },		1, ALT_WRSR2_3E, 1 << 7 },
+	[4] = { { JEDEC_RDSR, JEDEC_RDSR2 },	2, JEDEC_WRSR,	 1 << 1 },
+	[5] = { { JEDEC_RDSR, JEDEC_RDSR2 },	2, JEDEC_WRSR,	 1 << 1 },
+	[6] = { { JEDEC_RDSR2 },		1, JEDEC_WRSR2,	 1 << 1 },
+};
+
+/*
+ * Set or clear the Quad Enable bit of a chip with the Quad Enable
+ * requirement `qer`. The other bits are written back unchanged.
+ * `changed` tells if the bit had to be written.
+ */
+static int spi_write_quad_enable(struct flashctx *flash, const uint8_t qer, const bool enable,
+				 bool *const changed)
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	static const struct wip_timing timing_wrsr = { 15 * 1000, 5 * 1000 * 1000, true };
+	struct spi_queue queue = { .count = 0 };
+	uint8_t cmd[3], check;
+	unsigned int i;
+	int ret;
+
+	*changed = false;
+	if (qer >= ARRAY_SIZE(quad_enable_regs) || !quad_enable_regs[qer].count) {
+		msg_cerr("Unsupported Quad Enable requirement (%u).\n", qer);
+		return 1;
+	}
+	const unsigned int count = quad_enable_regs[qer].count;
+	const uint8_t qe_mask = quad_enable_regs[qer].qe_mask;
+
+	cmd[0] = quad_enable_regs[qer].write_op;
+	for (i = 0; i < count; ++i) {
+		ret = spi_send_command(flash, 1, 1, &quad_enable_regs[qer].read_ops[i], &cmd[1 + i]);
+		if (ret) {
+			msg_cerr("Reading the status registers failed!\n");
+			return ret;
+		}
+	}
+
+	if (!!(cmd[count] & qe_mask) == enable)
+		return 0;
+	if (enable)
+		cmd[count] |= qe_mask;
+	else
+		cmd[count] &= ~qe_mask;
+	msg_cdbg("%s the Quad Enable bit.\n", enable ? "Setting" : "Clearing");
+
+	flash->status_shadow.valid[STATUS1] = false;
+	flash->status_shadow.valid[STATUS2] = false;
+	*changed = true;
+
+	spi_queue_add(flash, &queue, wren, sizeof(wren), NULL, 0);
+	spi_queue_add(flash, &queue, cmd, 1 + count, NULL, 0);
+	spi_queue_poll(&queue, &timing_wrsr);
+	ret = spi_queue_flush(flash, &queue);
+	if (ret)
+		return ret;
+
+	/* The registers may be locked, check that the bit took. */
+	ret = spi_send_command(flash, 1, 1, &quad_enable_regs[qer].read_ops[count - 1], &check);
+	if (ret)
+		return ret;
+	if (!!(check & qe_mask) != enable) {
+		msg_cerr("Failed to %s the Quad Enable bit, are the status registers locked?\n",
+			 enable ? "set" : "clear");
+		return 1;
+	}
+	return 0;
+}
+
+static int spi_restore_quad_enable(struct flashctx *flash, uint8_t qer)
+{
+	bool changed;
+	return spi_write_quad_enable(flash, qer, false, &changed);
+}
+
+/*
+ * Set the Quad Enable bit, as given by the chip's `qpi.qer`. If we had
+ * to set it, it is cleared again by finalize_flash_access().
+ */
+int spi_set_quad_enable(struct flashctx *flash)
+{
+	const uint8_t qer = flash->chip->qpi.qer;
+	bool changed;
+
+	if (qer == 0)
+		return 0;
+	if (spi_write_quad_enable(flash, qer, true, &changed))
+		return 1;
+	return changed ? register_chip_restore(spi_restore_quad_enable, flash, qer) : 0;
+}
+
 /* A generic block protection disable.
  * Tests if a protection is enabled with the block protection mask (bp_mask) and returns success otherwise.
  * Tests if the register bits are locked with the lock_mask (lock_mask).
@@ -308,6 +430,21 @@ int spi_disable_blockprotect(struct flashctx *flash)
 	return spi_disable_blockprotect_generic(flash, 0x3C, 0, 0, 0xFF);
 }
 
+/* Stacked-die chips have status registers per die, unprotect them all. */
+int spi_disable_blockprotect_dies(struct flashctx *flash)
+{
+	unsigned int die;
+
+	for (die = 0; die < spi_die_count(flash); ++die) {
+		if (spi_select_die(flash, die))
+			return 1;
+		const int ret = spi_disable_blockprotect(flash);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 int spi_disable_blockprotect_sst26_global_unprotect(struct flashctx *flash)
 {
 	int result = spi_write_enable(flash);
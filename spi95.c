@@ -17,6 +17,7 @@
 /*
  * Contains SPI chip driver functions related to ST95XXX series (SPI EEPROM)
  */
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include "flashchips.h"
@@ -54,19 +55,42 @@ int probe_spi_st95(struct flashctx *flash)
 	return 0;
 }
 
-/* ST95XXX chips don't have erase operation and erase is made as part of write command */
+static bool page_is_erased(const struct flashctx *flash, const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; ++i) {
+		if (buf[i] != ERASED_VALUE(flash))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * ST95XXX chips don't have erase operation and erase is made as part of write command.
+ * They are overwritten in place, so writes skip this (see FEATURE_NO_ERASE) and only
+ * explicit erases end up here. Pages that already read as erased aren't written again.
+ */
 int spi_block_erase_emulation(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	uint8_t *erased_contents = NULL;
+	const unsigned int page_size = flash->chip->page_size;
+	uint8_t *contents = NULL;
+	unsigned int pos, len;
 	int result = 0;
 
-	erased_contents = (uint8_t *)malloc(blocklen * sizeof(uint8_t));
-	if (!erased_contents) {
+	contents = (uint8_t *)malloc(blocklen * sizeof(uint8_t));
+	if (!contents) {
 		msg_cerr("Out of memory!\n");
 		return 1;
 	}
-	memset(erased_contents, ERASED_VALUE(flash), blocklen * sizeof(uint8_t));
-	result = spi_write_chunked(flash, erased_contents, 0, blocklen, flash->chip->page_size);
-	free(erased_contents);
+	result = flash->chip->read(flash, contents, addr, blocklen);
+	for (pos = 0; !result && pos < blocklen; pos += len) {
+		len = min(page_size - (addr + pos) % page_size, blocklen - pos);
+		if (page_is_erased(flash, contents + pos, len))
+			continue;
+		memset(contents + pos, ERASED_VALUE(flash), len);
+		result = spi_write_chunked(flash, contents + pos, addr + pos, len, page_size);
+	}
+	free(contents);
 	return result;
 }
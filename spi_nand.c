@@ -0,0 +1,408 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SPI NAND chips with internal ECC. Only the main data area of each page
+ * is accessed, the pages are laid out back to back, so the chip looks
+ * like a NOR chip with large erase blocks and page-sized writes. The
+ * spare areas are only read for the factory bad-block markers: bad blocks
+ * read as erased, are never erased, and only erased data can be written
+ * to them. The markers are not changed, a block that fails to erase or
+ * program is reported, but not marked bad.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+#include "spi.h"
+
+/* Used when the chip's `spi_timing` is unknown. */
+static const struct wip_timing nand_page_read = { 25, 200, true };
+static const struct wip_timing nand_cache_read = { 3, 200, true };	/* can include the next tR */
+static const struct wip_timing nand_page_program = { 250, 1000, true };
+static const struct wip_timing nand_block_erase = { 2000, 10000, true };
+
+static const struct wip_timing *nand_timing_or(const struct wip_timing *const chip_timing,
+					       const struct wip_timing *const fallback)
+{
+	return chip_timing->typ_us && chip_timing->max_us ? chip_timing : fallback;
+}
+
+int probe_spi_nand(struct flashctx *flash)
+{
+	static const unsigned char cmd[SPI_NAND_RDID_OUTSIZE] = { JEDEC_RDID, 0x00 };
+	unsigned char id[3];
+	uint32_t model;
+
+	if (spi_send_command(flash, sizeof(cmd), sizeof(id), cmd, id))
+		return 0;
+
+	/* Some vendors use one device ID byte, others two. */
+	model = flash->chip->model_id > 0xff ? (uint32_t)id[1] << 8 | id[2] : id[1];
+	msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", __func__, id[0], model);
+
+	return id[0] == flash->chip->manufacture_id && model == flash->chip->model_id;
+}
+
+static int spi_nand_get_feature(struct flashctx *flash, uint8_t reg, uint8_t *value)
+{
+	const unsigned char cmd[] = { SPI_NAND_GET_FEATURE, reg };
+	return spi_send_command(flash, sizeof(cmd), 1, cmd, value);
+}
+
+static int spi_nand_set_feature(struct flashctx *flash, uint8_t reg, uint8_t value)
+{
+	const unsigned char cmd[] = { SPI_NAND_SET_FEATURE, reg, value };
+	return spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
+}
+
+/* Wait until the chip is done with the last operation, like spi_poll_wip(). */
+static int spi_nand_wait(struct flashctx *flash, const struct wip_timing *timing, uint8_t *status)
+{
+	const unsigned int max_delay = min(max(timing->typ_us / 2, 1), 1000 * 1000);
+	unsigned int delay = max(timing->typ_us / 16, 1);
+	const uint64_t start = monotonic_us();
+	unsigned int waited = 0;
+
+	if (!timing->generic && timing->typ_us >= 4) {
+		waited = timing->typ_us / 4 * 3;
+		programmer_delay(flash, waited);
+	}
+
+	while (true) {
+		const int ret = spi_nand_get_feature(flash, SPI_NAND_FEATURE_STATUS, status);
+		if (ret)
+			return ret;
+		if (!(*status & SPI_NAND_SR_OIP))
+			return 0;
+		++flash->stats.wip_polls;
+
+		/* Delays of virtual clocks (cf. dummy) don't show in the wall time. */
+		const uint64_t wall_us = monotonic_us() - start;
+		const unsigned long long elapsed = wall_us > waited ? wall_us : waited;
+		if (elapsed >= timing->max_us) {
+			msg_cerr("Timeout: OIP still set after %llu us, maximum time is %u us.\n",
+				 elapsed, timing->max_us);
+			return TIMEOUT_ERROR;
+		}
+
+		programmer_delay(flash, delay);
+		waited += delay;
+		delay = min(delay * 2, max_delay);
+	}
+}
+
+/* Send a command that takes a row (page) address and wait for it. */
+static int spi_nand_row_cmd(struct flashctx *flash, uint8_t opcode, unsigned int page,
+			    const struct wip_timing *timing, uint8_t *status)
+{
+	const unsigned char cmd[SPI_NAND_ROW_OUTSIZE] = { opcode, page >> 16, page >> 8, page };
+	const int ret = spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
+	return ret ? ret : spi_nand_wait(flash, timing, status);
+}
+
+static int spi_nand_check_ecc(const uint8_t status, const unsigned int page)
+{
+	if ((status & SPI_NAND_SR_ECC_MASK) != SPI_NAND_SR_ECC_UNCORR)
+		return 0;
+	msg_cerr("Uncorrectable ECC error in page %u.\n", page);
+	return 1;
+}
+
+static unsigned int spi_nand_max_read(const struct flashctx *flash)
+{
+	const unsigned int max_data = flash->mst.spi->max_data_read;
+	return max_data == MAX_DATA_UNSPECIFIED ? 64 : min(max_data, flash->chip->page_size);
+}
+
+static unsigned int spi_nand_max_write(const struct flashctx *flash)
+{
+	const unsigned int max_data = flash->mst.spi->max_data_write;
+	return max_data == MAX_DATA_UNSPECIFIED ? MAX_DATA_WRITE_UNLIMITED
+						: min(max_data, flash->chip->page_size);
+}
+
+static int spi_nand_read_cache(struct flashctx *flash, uint8_t *buf, unsigned int column, unsigned int len)
+{
+	const unsigned int chunk = spi_nand_max_read(flash);
+	unsigned int n;
+
+	for (; len; len -= n, buf += n, column += n) {
+		const unsigned char cmd[SPI_NAND_READ_CACHE_OUTSIZE] =
+			{ SPI_NAND_READ_CACHE, column >> 8, column, 0x00 };
+		n = min(len, chunk);
+		const int ret = spi_send_command(flash, sizeof(cmd), n, cmd, buf);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static bool spi_nand_block_bad(const struct flashctx *flash, unsigned int addr)
+{
+	return flash->nand.bad && flash->nand.bad[addr / flash->nand.block_size];
+}
+
+/* Scan the factory markers, the first spare byte of each block's first page. */
+int spi_nand_prepare_access(struct flashctx *flash, const enum preparation_steps step)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	const unsigned int block_size = flash->chip->block_erasers[0].eraseblocks[0].size;
+	const unsigned int blocks = flash->chip->total_size * KiB / block_size;
+	unsigned int i, bad = 0;
+	uint8_t status, marker;
+
+	if (step != PREPARE_FULL)
+		return 0;
+
+	free(flash->nand.bad);
+	flash->nand.block_size = block_size;
+	flash->nand.bad = calloc(blocks, sizeof(*flash->nand.bad));
+	if (!flash->nand.bad) {
+		msg_cerr("Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < blocks; ++i) {
+		if (spi_nand_row_cmd(flash, SPI_NAND_PAGE_READ, i * (block_size / page_size),
+				     &nand_page_read, &status) ||
+		    spi_nand_read_cache(flash, &marker, page_size, 1)) {
+			msg_cerr("Failed to read the bad-block marker of block %u.\n", i);
+			spi_nand_finish_access(flash);
+			return 1;
+		}
+		if (marker != 0xff) {
+			msg_cdbg("Block %u at 0x%08x is marked bad.\n", i, i * block_size);
+			flash->nand.bad[i] = true;
+			++bad;
+		}
+	}
+	if (bad)
+		msg_cinfo("%u of %u blocks are marked bad, they will be skipped.\n", bad, blocks);
+	return 0;
+}
+
+void spi_nand_finish_access(struct flashctx *flash)
+{
+	free(flash->nand.bad);
+	flash->nand.bad = NULL;
+}
+
+int spi_nand_printlock(struct flashctx *flash)
+{
+	uint8_t prot;
+
+	if (spi_nand_get_feature(flash, SPI_NAND_FEATURE_PROT, &prot))
+		return 1;
+	msg_cdbg("Block protection register is 0x%02x, blocks are %slocked.\n",
+		 prot, prot & SPI_NAND_PROT_BP_TB ? "" : "not ");
+	return 0;
+}
+
+int spi_nand_unlock(struct flashctx *flash)
+{
+	uint8_t prot;
+
+	if (spi_nand_get_feature(flash, SPI_NAND_FEATURE_PROT, &prot))
+		return 1;
+	if (!(prot & SPI_NAND_PROT_BP_TB))
+		return 0;
+	if (spi_nand_set_feature(flash, SPI_NAND_FEATURE_PROT, prot & ~SPI_NAND_PROT_BP_TB) ||
+	    spi_nand_get_feature(flash, SPI_NAND_FEATURE_PROT, &prot))
+		return 1;
+	if (prot & SPI_NAND_PROT_BP_TB) {
+		msg_cerr("Failed to unlock the blocks, is hardware write protection active?\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the pages [page, end) of a run of good blocks. With Page Read Cache
+ * Sequential, the chip reads each next page from the array while we read
+ * the previous one from the cache, instead of waiting tR for every page.
+ */
+static int spi_nand_read_pages(struct flashctx *flash, uint8_t *buf, unsigned int page, const unsigned int end,
+			       unsigned int column, unsigned int len)
+{
+	const bool sequential = flash->chip->feature_bits & FEATURE_NAND_CACHE_SEQ && end - page > 1;
+	const unsigned int page_size = flash->chip->page_size;
+	const unsigned int first = page;
+	uint8_t status;
+	int ret;
+
+	ret = spi_nand_row_cmd(flash, SPI_NAND_PAGE_READ, page, &nand_page_read, &status);
+	for (; !ret && page < end; ++page, column = 0) {
+		if (sequential) {
+			/* Moves `page` into the cache, all but the last start reading the next. */
+			const uint8_t op = page + 1 < end ? SPI_NAND_READ_CACHE_SEQ : SPI_NAND_READ_CACHE_END;
+			ret = spi_send_command(flash, 1, 0, &op, NULL);
+			if (!ret)
+				ret = spi_nand_wait(flash, &nand_cache_read, &status);
+		} else if (page > first) {
+			ret = spi_nand_row_cmd(flash, SPI_NAND_PAGE_READ, page, &nand_page_read, &status);
+		}
+		if (!ret)
+			ret = spi_nand_check_ecc(status, page);
+		if (ret)
+			break;
+
+		const unsigned int n = min(len, page_size - column);
+		ret = spi_nand_read_cache(flash, buf, column, n);
+		flashprog_progress_add(flash, n);
+		buf += n;
+		len -= n;
+	}
+	return ret;
+}
+
+int spi_nand_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	const unsigned int block_size = flash->nand.bad ? flash->nand.block_size : flash->chip->total_size * KiB;
+	unsigned int n;
+
+	for (; len; len -= n, buf += n, start += n) {
+		if (spi_nand_block_bad(flash, start)) {
+			n = min(len, block_size - start % block_size);
+			memset(buf, ERASED_VALUE(flash), n);
+			flashprog_progress_add(flash, n);
+			continue;
+		}
+
+		/* Up to the next bad block or the end of the range. */
+		unsigned int run_end = ALIGN_DOWN(start, block_size) + block_size;
+		while (run_end < start + len && !spi_nand_block_bad(flash, run_end))
+			run_end += block_size;
+		n = min(len, run_end - start);
+
+		const int ret = spi_nand_read_pages(flash, buf, start / page_size,
+						    (start + n + page_size - 1) / page_size,
+						    start % page_size, n);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static bool spi_nand_erased(const struct flashctx *flash, const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; ++i) {
+		if (buf[i] != ERASED_VALUE(flash))
+			return false;
+	}
+	return true;
+}
+
+static int spi_nand_program_page(struct flashctx *flash, unsigned char *cmd, const uint8_t *buf,
+				 unsigned int page, unsigned int column, unsigned int len)
+{
+	const unsigned int chunk = spi_nand_max_write(flash);
+	static const unsigned char wren = JEDEC_WREN;
+	uint8_t op = SPI_NAND_PROGRAM_LOAD;
+	uint8_t status;
+	unsigned int n;
+	int ret;
+
+	ret = spi_send_command(flash, 1, 0, &wren, NULL);
+	for (; !ret && len; len -= n, buf += n, column += n, op = SPI_NAND_PROGRAM_LOAD_RANDOM) {
+		n = min(len, chunk);
+		cmd[0] = op;
+		cmd[1] = column >> 8;
+		cmd[2] = column;
+		memcpy(cmd + SPI_NAND_PROGRAM_LOAD_OUTSIZE, buf, n);
+		ret = spi_send_command(flash, SPI_NAND_PROGRAM_LOAD_OUTSIZE + n, 0, cmd, NULL);
+	}
+	if (!ret)
+		ret = spi_nand_row_cmd(flash, SPI_NAND_PROGRAM_EXECUTE, page,
+				       nand_timing_or(&flash->chip->spi_timing.page_program,
+						      &nand_page_program), &status);
+	if (ret)
+		return ret;
+	if (status & SPI_NAND_SR_P_FAIL) {
+		msg_cerr("Programming page %u failed, its block may have gone bad.\n", page);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Pages are programmed once per erase. An erased page is not programmed,
+ * with internal ECC that would make it unusable until the next erase.
+ */
+int spi_nand_write(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	unsigned char *cmd;
+	unsigned int n;
+	int ret = 0;
+
+	cmd = malloc(SPI_NAND_PROGRAM_LOAD_OUTSIZE + spi_nand_max_write(flash));
+	if (!cmd) {
+		msg_cerr("Out of memory!\n");
+		return 1;
+	}
+
+	for (; !ret && len; len -= n, buf += n, start += n) {
+		n = min(len, page_size - start % page_size);
+		if (!spi_nand_erased(flash, buf, n)) {
+			if (spi_nand_block_bad(flash, start)) {
+				msg_cerr("Can't write to bad block at 0x%08x.\n",
+					 start - start % flash->nand.block_size);
+				ret = 1;
+				break;
+			}
+			ret = spi_nand_program_page(flash, cmd, buf, start / page_size, start % page_size, n);
+		}
+		flashprog_progress_add(flash, n);
+	}
+	free(cmd);
+	return ret;
+}
+
+int spi_nand_block_erase(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+{
+	const struct wip_timing *timing = &nand_block_erase;
+	static const unsigned char wren = JEDEC_WREN;
+	uint8_t status;
+	unsigned int i;
+	int ret;
+
+	if (spi_nand_block_bad(flash, addr)) {
+		msg_cdbg("Skipping bad block at 0x%08x.\n", addr);
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(flash->chip->spi_timing.erase); ++i) {
+		if (flash->chip->spi_timing.erase[i].block_size == blocklen)
+			timing = nand_timing_or(&flash->chip->spi_timing.erase[i].timing, timing);
+	}
+
+	ret = spi_send_command(flash, 1, 0, &wren, NULL);
+	if (!ret)
+		ret = spi_nand_row_cmd(flash, SPI_NAND_BLOCK_ERASE, addr / flash->chip->page_size,
+				       timing, &status);
+	if (ret)
+		return ret;
+	if (status & SPI_NAND_SR_E_FAIL) {
+		msg_cerr("Erasing block at 0x%08x failed, it may have gone bad.\n", addr);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * An SPI trace records every command sent through spi_send_command() and
+ * spi_send_multicommand(). The records are kept in a ring buffer in memory,
+ * so only the latest SPI_TRACE_RECORDS commands are kept, and written to a
+ * file when tracing stops. A trace can be replayed to see how a programmer
+ * handles the same traffic.
+ *
+ * File format, all numbers little endian:
+ *   header:  8 bytes magic, u32 record size, u32 capacity,
+ *            u32 stored records, u32 reserved, u64 total records
+ *   records: u64 start time (us since trace start), u32 duration (us),
+ *            u32 write count, u32 read count, u8 flags, u8 I/O mode,
+ *            s8 result, 5 bytes opcode and address
+ *
+ * Only the opcode and address are recorded, written data is replayed
+ * as zeros. The duration is that of the whole transaction, i.e. for
+ * chained commands, it is only meaningful for the first.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "flash.h"
+#include "programmer.h"
+
+#define SPI_TRACE_MAGIC		"FPTRACE1"
+#define SPI_TRACE_HEADER_SIZE	32
+#define SPI_TRACE_RECORD_SIZE	28
+#define SPI_TRACE_CMD_BYTES	5
+#define SPI_TRACE_RECORDS	(128 * 1024)
+/* Most chained commands in flashprog are WREN plus one more. */
+#define SPI_TRACE_MAX_CHAIN	8
+
+#define SPI_TRACE_CHAINED	(1 << 0)	/* Sent in the same transaction as the previous record. */
+
+struct spi_trace_record {
+	uint64_t time_us;
+	uint32_t duration_us;
+	uint32_t writecnt;
+	uint32_t readcnt;
+	uint8_t flags;
+	uint8_t io_mode;
+	int8_t result;
+	uint8_t cmd[SPI_TRACE_CMD_BYTES];
+};
+
+static struct {
+	char *path;
+	struct spi_trace_record *records;
+	size_t next;
+	uint64_t total;
+	uint64_t start_us;
+} trace;
+
+static void put_le(uint8_t *const buf, uint64_t val, const size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, val >>= 8)
+		buf[i] = val & 0xff;
+}
+
+static uint64_t get_le(const uint8_t *const buf, const size_t len)
+{
+	uint64_t val = 0;
+	size_t i;
+
+	for (i = len; i > 0; --i)
+		val = val << 8 | buf[i - 1];
+	return val;
+}
+
+static void record_serialize(uint8_t *const buf, const struct spi_trace_record *const rec)
+{
+	put_le(buf +  0, rec->time_us, 8);
+	put_le(buf +  8, rec->duration_us, 4);
+	put_le(buf + 12, rec->writecnt, 4);
+	put_le(buf + 16, rec->readcnt, 4);
+	buf[20] = rec->flags;
+	buf[21] = rec->io_mode;
+	buf[22] = (uint8_t)rec->result;
+	memcpy(buf + 23, rec->cmd, SPI_TRACE_CMD_BYTES);
+}
+
+static void record_deserialize(struct spi_trace_record *const rec, const uint8_t *const buf)
+{
+	rec->time_us	 = get_le(buf +  0, 8);
+	rec->duration_us = get_le(buf +  8, 4);
+	rec->writecnt	 = get_le(buf + 12, 4);
+	rec->readcnt	 = get_le(buf + 16, 4);
+	rec->flags	 = buf[20];
+	rec->io_mode	 = buf[21];
+	rec->result	 = (int8_t)buf[22];
+	memcpy(rec->cmd, buf + 23, SPI_TRACE_CMD_BYTES);
+}
+
+bool spi_trace_enabled(void)
+{
+	return trace.records;
+}
+
+/* Start recording SPI commands, they are written to `path` by spi_trace_stop(). */
+int spi_trace_start(const char *const path)
+{
+	if (trace.records) {
+		msg_gerr("SPI trace already running.\n");
+		return 1;
+	}
+
+	trace.path = strdup(path);
+	trace.records = calloc(SPI_TRACE_RECORDS, sizeof(*trace.records));
+	if (!trace.path || !trace.records) {
+		msg_gerr("Out of memory!\n");
+		free(trace.records);
+		free(trace.path);
+		trace.records = NULL;
+		trace.path = NULL;
+		return 1;
+	}
+	trace.next = 0;
+	trace.total = 0;
+	trace.start_us = monotonic_us();
+	return 0;
+}
+
+void spi_trace_record(const struct spi_command *const cmd, const bool chained,
+		      const uint64_t start_us, const int result)
+{
+	struct spi_trace_record *const rec = &trace.records[trace.next];
+	const uint64_t duration_us = monotonic_us() - start_us;
+
+	rec->time_us	 = start_us - trace.start_us;
+	rec->duration_us = duration_us > UINT32_MAX ? UINT32_MAX : duration_us;
+	rec->writecnt	 = cmd->writecnt + cmd->datacnt;
+	rec->readcnt	 = cmd->readcnt;
+	rec->flags	 = chained ? SPI_TRACE_CHAINED : 0;
+	rec->io_mode	 = cmd->io_mode;
+	rec->result	 = result < INT8_MIN ? INT8_MIN : result > INT8_MAX ? INT8_MAX : result;
+	memset(rec->cmd, 0, sizeof(rec->cmd));
+	memcpy(rec->cmd, cmd->writearr, min(cmd->writecnt, SPI_TRACE_CMD_BYTES));
+	if (cmd->writecnt < SPI_TRACE_CMD_BYTES)
+		memcpy(rec->cmd + cmd->writecnt, cmd->dataarr,
+		       min(cmd->datacnt, SPI_TRACE_CMD_BYTES - cmd->writecnt));
+
+	trace.next = (trace.next + 1) % SPI_TRACE_RECORDS;
+	++trace.total;
+}
+
+static int spi_trace_write(void)
+{
+	const size_t stored = trace.total < SPI_TRACE_RECORDS ? trace.total : SPI_TRACE_RECORDS;
+	/* The oldest record follows the newest one, once the ring buffer is full. */
+	const size_t first = trace.total < SPI_TRACE_RECORDS ? 0 : trace.next;
+	uint8_t buf[SPI_TRACE_HEADER_SIZE];
+	size_t i;
+
+	FILE *const f = fopen(trace.path, "wb");
+	if (!f) {
+		msg_gerr("Error: Can't write SPI trace `%s': %s\n", trace.path, strerror(errno));
+		return 1;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, SPI_TRACE_MAGIC, 8);
+	put_le(buf +  8, SPI_TRACE_RECORD_SIZE, 4);
+	put_le(buf + 12, SPI_TRACE_RECORDS, 4);
+	put_le(buf + 16, stored, 4);
+	put_le(buf + 24, trace.total, 8);
+	fwrite(buf, 1, SPI_TRACE_HEADER_SIZE, f);
+
+	for (i = 0; i < stored; ++i) {
+		record_serialize(buf, &trace.records[(first + i) % SPI_TRACE_RECORDS]);
+		fwrite(buf, 1, SPI_TRACE_RECORD_SIZE, f);
+	}
+
+	if (ferror(f) | fclose(f)) {
+		msg_gerr("Error: Can't write SPI trace `%s'.\n", trace.path);
+		return 1;
+	}
+	msg_ginfo("Wrote %zu SPI commands to trace `%s'", stored, trace.path);
+	if (trace.total > stored)
+		msg_ginfo(", %llu older ones were dropped", (unsigned long long)(trace.total - stored));
+	msg_ginfo(".\n");
+	return 0;
+}
+
+/* Stop recording and write the trace file. */
+int spi_trace_stop(void)
+{
+	int ret;
+
+	if (!trace.records)
+		return 0;
+
+	ret = spi_trace_write();
+
+	free(trace.records);
+	free(trace.path);
+	trace.records = NULL;
+	trace.path = NULL;
+	return ret;
+}
+
+struct replay_opcode_stats {
+	unsigned long commands;
+	unsigned long long bytes;
+	unsigned long long recorded_us;
+	unsigned long long replayed_us;
+};
+
+struct replay_stats {
+	unsigned long transactions;
+	unsigned long commands;
+	unsigned long mismatches;
+	unsigned long long recorded_us;
+	unsigned long long replayed_us;
+	struct replay_opcode_stats opcodes[256];
+};
+
+/* Send the `count` commands of one transaction and account them. */
+static int replay_transaction(const struct flashctx *const flash, const struct spi_trace_record *const recs,
+			      const size_t count, struct replay_stats *const stats)
+{
+	struct spi_command cmds[SPI_TRACE_MAX_CHAIN + 1];
+	size_t i, out_len = 0, in_len = 0;
+	int ret;
+
+	for (i = 0; i < count; ++i) {
+		out_len += recs[i].writecnt;
+		in_len += recs[i].readcnt;
+	}
+
+	uint8_t *const out = calloc(1, out_len + 1);
+	uint8_t *const in = malloc(in_len + 1);
+	if (!out || !in) {
+		msg_gerr("Out of memory!\n");
+		free(in);
+		free(out);
+		return 1;
+	}
+
+	out_len = in_len = 0;
+	for (i = 0; i < count; ++i) {
+		memcpy(out + out_len, recs[i].cmd, min(recs[i].writecnt, SPI_TRACE_CMD_BYTES));
+		cmds[i].writecnt = recs[i].writecnt;
+		cmds[i].readcnt	 = recs[i].readcnt;
+		cmds[i].writearr = out + out_len;
+		cmds[i].readarr	 = in + in_len;
+		cmds[i].io_mode	 = recs[i].io_mode < NUM_IO_MODES ? recs[i].io_mode : SINGLE_IO_1_1_1;
+		out_len += recs[i].writecnt;
+		in_len += recs[i].readcnt;
+	}
+	cmds[count] = (struct spi_command)NULL_SPI_CMD;
+
+	const uint64_t start_us = monotonic_us();
+	if (count == 1 && cmds[0].io_mode == SINGLE_IO_1_1_1)
+		ret = spi_send_command(flash, cmds[0].writecnt, cmds[0].readcnt, cmds[0].writearr,
+				       cmds[0].readarr);
+	else
+		ret = spi_send_multicommand(flash, cmds);
+	const uint64_t duration_us = monotonic_us() - start_us;
+
+	++stats->transactions;
+	stats->recorded_us += recs[0].duration_us;
+	stats->replayed_us += duration_us;
+	for (i = 0; i < count; ++i) {
+		struct replay_opcode_stats *const op = &stats->opcodes[recs[i].writecnt ? recs[i].cmd[0] : 0];
+
+		++stats->commands;
+		++op->commands;
+		op->bytes += recs[i].writecnt + recs[i].readcnt;
+		/* Attribute the transaction's time to its last command, the first is usually WREN. */
+		if (i == count - 1) {
+			op->recorded_us += recs[0].duration_us;
+			op->replayed_us += duration_us;
+		}
+	}
+	if ((ret != 0) != (recs[0].result != 0))
+		++stats->mismatches;
+
+	free(in);
+	free(out);
+	return 0;
+}
+
+static void replay_print(const struct replay_stats *const stats, const uint64_t span_us)
+{
+	unsigned int i;
+
+	msg_ginfo("Replayed %lu SPI commands in %lu transactions, %lu with a different result.\n",
+		  stats->commands, stats->transactions, stats->mismatches);
+	msg_ginfo("Recorded: %llu us in transactions, %llu us overall.\n",
+		  stats->recorded_us, (unsigned long long)span_us);
+	msg_ginfo("Replayed: %llu us in transactions.\n", stats->replayed_us);
+	msg_ginfo("Opcode  Commands        Bytes  Recorded us  Replayed us\n");
+	for (i = 0; i < ARRAY_SIZE(stats->opcodes); ++i) {
+		const struct replay_opcode_stats *const op = &stats->opcodes[i];
+		if (!op->commands)
+			continue;
+		msg_ginfo("  0x%02x  %8lu  %11llu  %11llu  %11llu\n",
+			  i, op->commands, op->bytes, op->recorded_us, op->replayed_us);
+	}
+}
+
+/*
+ * Send all commands of the trace in `path` to the SPI master of `flash`.
+ * Written data is replaced with zeros, so this must only be used with
+ * an emulated chip.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+int spi_trace_replay(const struct flashctx *const flash, const char *const path)
+{
+	struct spi_trace_record recs[SPI_TRACE_MAX_CHAIN];
+	uint8_t buf[SPI_TRACE_HEADER_SIZE];
+	uint64_t first_us = 0, end_us = 0;
+	struct replay_stats *stats;
+	size_t i, stored, count = 0;
+	int ret = 1;
+
+	if (flash->chip->bustype != BUS_SPI) {
+		msg_gerr("Error: SPI traces can only be replayed to SPI flash chips.\n");
+		return 1;
+	}
+
+	FILE *const f = fopen(path, "rb");
+	if (!f) {
+		msg_gerr("Error: Can't open SPI trace `%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fread(buf, 1, SPI_TRACE_HEADER_SIZE, f) != SPI_TRACE_HEADER_SIZE ||
+	    memcmp(buf, SPI_TRACE_MAGIC, 8) || get_le(buf + 8, 4) != SPI_TRACE_RECORD_SIZE) {
+		msg_gerr("Error: `%s' is not an SPI trace.\n", path);
+		goto _close_ret;
+	}
+	stored = get_le(buf + 16, 4);
+	if (get_le(buf + 24, 8) > stored)
+		msg_ginfo("Trace `%s' lacks its %llu oldest commands.\n", path,
+			  (unsigned long long)(get_le(buf + 24, 8) - stored));
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats) {
+		msg_gerr("Out of memory!\n");
+		goto _close_ret;
+	}
+
+	for (i = 0; i < stored; ++i) {
+		struct spi_trace_record rec;
+
+		if (fread(buf, 1, SPI_TRACE_RECORD_SIZE, f) != SPI_TRACE_RECORD_SIZE) {
+			msg_gerr("Error: SPI trace `%s' is truncated.\n", path);
+			goto _free_ret;
+		}
+		record_deserialize(&rec, buf);
+
+		if (i == 0)
+			first_us = rec.time_us;
+		if (rec.time_us + rec.duration_us > end_us)
+			end_us = rec.time_us + rec.duration_us;
+
+		if (count && (!(rec.flags & SPI_TRACE_CHAINED) || count == SPI_TRACE_MAX_CHAIN)) {
+			if (replay_transaction(flash, recs, count, stats))
+				goto _free_ret;
+			count = 0;
+		}
+		recs[count++] = rec;
+	}
+	if (count && replay_transaction(flash, recs, count, stats))
+		goto _free_ret;
+
+	replay_print(stats, end_us - first_us);
+	ret = 0;
+
+_free_ret:
+	free(stats);
+_close_ret:
+	fclose(f);
+	return ret;
+}
@@ -28,7 +28,7 @@ int erase_sector_49lfxxxc(struct flashctx *flash, unsigned int address,
 	chip_writeb(flash, 0x30, bios);
 	chip_writeb(flash, 0xD0, bios + address);
 
-	status = wait_82802ab(flash);
+	status = wait_82802ab(flash, WAIT_82802AB_ERASE_SECTOR);
 	print_status_82802ab(status);
 
 	/* FIXME: Check the status register for errors. */
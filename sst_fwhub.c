@@ -47,22 +47,14 @@ static int check_sst_fwhub_block_lock(struct flashctx *flash, unsigned int offse
 	return blockstatus & 0x1;
 }
 
-static int clear_sst_fwhub_block_lock(struct flashctx *flash, unsigned int offset)
+static void clear_sst_fwhub_block_lock(struct flashctx *flash, unsigned int offset)
 {
 	chipaddr registers = flash->virtual_registers;
-	uint8_t blockstatus;
-
-	blockstatus = check_sst_fwhub_block_lock(flash, offset);
 
-	if (blockstatus) {
-		msg_cdbg("Trying to clear lock for 0x%06x... ", offset);
+	if (check_sst_fwhub_block_lock(flash, offset)) {
+		msg_cdbg("Trying to clear lock for 0x%06x.\n", offset);
 		chip_writeb(flash, 0, registers + offset + 2);
-
-		blockstatus = check_sst_fwhub_block_lock(flash, offset);
-		msg_cdbg("%s\n", (blockstatus) ? "failed" : "OK");
 	}
-
-	return blockstatus;
 }
 
 int printlock_sst_fwhub(struct flashctx *flash)
@@ -75,15 +67,18 @@ int printlock_sst_fwhub(struct flashctx *flash)
 	return 0;
 }
 
+/* Clear the write locks of all blocks first, then check them all. */
 int unlock_sst_fwhub(struct flashctx *flash)
 {
+	const chipaddr registers = flash->virtual_registers;
 	unsigned int i;
 	int ret = 0;
 
 	for (i = 0; i < flash->chip->total_size * 1024; i += flash->chip->page_size)
-	{
-		if (clear_sst_fwhub_block_lock(flash, i))
-		{
+		clear_sst_fwhub_block_lock(flash, i);
+
+	for (i = 0; i < flash->chip->total_size * 1024; i += flash->chip->page_size) {
+		if (chip_readb(flash, registers + i + 2) & 0x1) {
 			msg_cwarn("Warning: Unlock Failed for block 0x%06x\n", i);
 			ret++;
 		}
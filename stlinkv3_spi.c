@@ -24,11 +24,13 @@
  */
 
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 
 #include <libusb.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -114,6 +116,9 @@ enum spi_nss_level {
 
 #define USB_TIMEOUT_IN_MS					5000
 
+/* Maximum length of a single bridge read or write, the length field is 16 bits wide. */
+#define STLINK_MAX_RW_LEN					UINT16_MAX
+
 static const struct dev_entry devs_stlinkv3_spi[] = {
 	{0x0483, 0x374E, NT, "STMicroelectronics", "STLINK-V3E"},
 	{0x0483, 0x374F, OK, "STMicroelectronics", "STLINK-V3S"},
@@ -122,16 +127,18 @@ static const struct dev_entry devs_stlinkv3_spi[] = {
 	{0}
 };
 
-static struct libusb_context *usb_ctx;
-static libusb_device_handle *stlinkv3_handle;
+struct stlinkv3_spi_data {
+	struct libusb_context *usb_ctx;
+	libusb_device_handle *handle;
+};
 
-static int stlinkv3_command(uint8_t *command, size_t command_length,
-		     uint8_t *answer, size_t answer_length, const char *command_name)
+static int stlinkv3_command(libusb_device_handle *stlinkv3_handle, uint8_t *command, size_t command_length,
+			    uint8_t *answer, size_t answer_length, const char *command_name)
 {
 	int actual_length = 0;
-	int rc = libusb_bulk_transfer(stlinkv3_handle, STLINK_EP_OUT,
-				  command, command_length,
-				  &actual_length, USB_TIMEOUT_IN_MS);
+	int rc = usb_dev_bulk_transfer(stlinkv3_handle, STLINK_EP_OUT,
+				   command, command_length,
+				   &actual_length, USB_TIMEOUT_IN_MS);
 	if (rc != LIBUSB_TRANSFER_COMPLETED || (size_t)actual_length != command_length) {
 		msg_perr("Failed to issue the %s command: '%s'\n",
 			 command_name,
@@ -139,9 +146,9 @@ static int stlinkv3_command(uint8_t *command, size_t command_length,
 		return -1;
 	}
 
-	rc = libusb_bulk_transfer(stlinkv3_handle, STLINK_EP_IN,
-				  answer, answer_length,
-				  &actual_length, USB_TIMEOUT_IN_MS);
+	rc = usb_dev_bulk_transfer(stlinkv3_handle, STLINK_EP_IN,
+				   answer, answer_length,
+				   &actual_length, USB_TIMEOUT_IN_MS);
 	if (rc != LIBUSB_TRANSFER_COMPLETED || (size_t)actual_length != answer_length) {
 		msg_perr("Failed to get %s answer: '%s'\n",
 			 command_name,
@@ -154,7 +161,7 @@ static int stlinkv3_command(uint8_t *command, size_t command_length,
 /**
  * @param[out] bridge_input_clk Current input frequency in kHz of the given com.
  */
-static int stlinkv3_get_clk(uint32_t *bridge_input_clk)
+static int stlinkv3_get_clk(libusb_device_handle *stlinkv3_handle, uint32_t *bridge_input_clk)
 {
 	uint8_t command[16] = { 0 };
 	uint8_t answer[12];
@@ -166,7 +173,7 @@ static int stlinkv3_get_clk(uint32_t *bridge_input_clk)
 	command[1] = STLINK_BRIDGE_GET_CLOCK;
 	command[2] = STLINK_SPI_COM;
 
-	if (stlinkv3_command(command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_GET_CLOCK") != 0)
+	if (stlinkv3_command(stlinkv3_handle, command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_GET_CLOCK") != 0)
 		return -1;
 
 	*bridge_input_clk = (uint32_t)answer[4]
@@ -177,7 +184,8 @@ static int stlinkv3_get_clk(uint32_t *bridge_input_clk)
 
 }
 
-static int stlinkv3_spi_calc_prescaler(uint16_t reqested_freq_in_kHz,
+static int stlinkv3_spi_calc_prescaler(libusb_device_handle *stlinkv3_handle,
+				       uint16_t reqested_freq_in_kHz,
 				       enum spi_prescaler *prescaler,
 				       uint16_t *calculated_freq_in_kHz)
 {
@@ -185,7 +193,7 @@ static int stlinkv3_spi_calc_prescaler(uint16_t reqested_freq_in_kHz,
 	uint32_t calculated_prescaler = 1;
 	uint16_t prescaler_value;
 
-	if (stlinkv3_get_clk(&bridge_clk_in_kHz))
+	if (stlinkv3_get_clk(stlinkv3_handle, &bridge_clk_in_kHz))
 		return -1;
 
 	calculated_prescaler  = bridge_clk_in_kHz/reqested_freq_in_kHz;
@@ -225,7 +233,7 @@ static int stlinkv3_spi_calc_prescaler(uint16_t reqested_freq_in_kHz,
 	return 0;
 }
 
-static int stlinkv3_check_version(enum fw_version_check_result *result)
+static int stlinkv3_check_version(libusb_device_handle *stlinkv3_handle, enum fw_version_check_result *result)
 {
 	uint8_t answer[12];
 	uint8_t command[16] = { 0 };
@@ -233,7 +241,7 @@ static int stlinkv3_check_version(enum fw_version_check_result *result)
 	command[0] = ST_GETVERSION_EXT;
 	command[1] = 0x80;
 
-	if (stlinkv3_command(command, sizeof(command), answer, sizeof(answer), "ST_GETVERSION_EXT") != 0)
+	if (stlinkv3_command(stlinkv3_handle, command, sizeof(command), answer, sizeof(answer), "ST_GETVERSION_EXT") != 0)
 		return -1;
 
 	msg_pinfo("Connected to STLink V3 with bridge FW version: %d\n", answer[4]);
@@ -243,7 +251,7 @@ static int stlinkv3_check_version(enum fw_version_check_result *result)
 	return 0;
 }
 
-static int stlinkv3_spi_open(uint16_t reqested_freq_in_kHz)
+static int stlinkv3_spi_open(libusb_device_handle *stlinkv3_handle, uint16_t reqested_freq_in_kHz)
 {
 	uint8_t command[16] = { 0 };
 	uint8_t answer[2];
@@ -251,7 +259,7 @@ static int stlinkv3_spi_open(uint16_t reqested_freq_in_kHz)
 	enum spi_prescaler prescaler;
 	enum fw_version_check_result fw_check_result;
 
-	if (stlinkv3_check_version(&fw_check_result)) {
+	if (stlinkv3_check_version(stlinkv3_handle, &fw_check_result)) {
 		msg_perr("Failed to query FW version\n");
 		return -1;
 	}
@@ -264,7 +272,7 @@ static int stlinkv3_spi_open(uint16_t reqested_freq_in_kHz)
 		return -1;
 	}
 
-	if (stlinkv3_spi_calc_prescaler(reqested_freq_in_kHz,
+	if (stlinkv3_spi_calc_prescaler(stlinkv3_handle, reqested_freq_in_kHz,
 					&prescaler,
 					&SCK_freq_in_kHz)) {
 		msg_perr("Failed to calculate SPI clock prescaler\n");
@@ -283,145 +291,267 @@ static int stlinkv3_spi_open(uint16_t reqested_freq_in_kHz)
 	command[5] = SPI_NSS_SOFT;
 	command[6] = (uint8_t)prescaler;
 
-	return stlinkv3_command(command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_INIT_SPI");
+	return stlinkv3_command(stlinkv3_handle, command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_INIT_SPI");
 }
 
-static int stlinkv3_get_last_readwrite_status(uint32_t *status)
+static int stlinkv3_spi_set_SPI_NSS(libusb_device_handle *stlinkv3_handle, enum spi_nss_level nss_level)
 {
 	uint8_t command[16] = { 0 };
-	uint16_t answer[4];
+	uint8_t answer[2];
 
 	command[0] = STLINK_BRIDGE_COMMAND;
-	command[1] = STLINK_BRIDGE_GET_RWCMD_STATUS;
+	command[1] = STLINK_BRIDGE_CS_SPI;
+	command[2] = (uint8_t) (nss_level);
 
-	if (stlinkv3_command(command, sizeof(command),
-			     (uint8_t *)answer, sizeof(answer),
-			     "STLINK_BRIDGE_GET_RWCMD_STATUS") != 0)
+	if (stlinkv3_command(stlinkv3_handle, command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_CS_SPI") != 0)
 		return -1;
+	return 0;
+}
 
-	*status = (uint32_t)answer[2] | (uint32_t)answer[3]<<16;
+static int stlinkv3_bulk_out(libusb_device_handle *stlinkv3_handle,
+			     const uint8_t *data, size_t length, const char *what)
+{
+	int actual_length = 0;
+	const int rc = usb_dev_bulk_transfer(stlinkv3_handle, STLINK_EP_OUT,
+					     (unsigned char *)data, (int)length,
+					     &actual_length, USB_TIMEOUT_IN_MS);
+	if (rc != LIBUSB_TRANSFER_COMPLETED || (size_t)actual_length != length) {
+		msg_perr("Failed to send %s: '%s'\n", what, libusb_error_name(rc));
+		return -1;
+	}
+	return 0;
+}
+
+static int stlinkv3_bulk_in(libusb_device_handle *stlinkv3_handle,
+			    uint8_t *data, size_t length, const char *what)
+{
+	int actual_length = 0;
+	const int rc = usb_dev_bulk_transfer(stlinkv3_handle, STLINK_EP_IN,
+					     data, (int)length,
+					     &actual_length, USB_TIMEOUT_IN_MS);
+	if (rc != LIBUSB_TRANSFER_COMPLETED || (size_t)actual_length != length) {
+		msg_perr("Failed to retrieve %s: '%s'\n", what, libusb_error_name(rc));
+		return -1;
+	}
 	return 0;
 }
 
-static int stlinkv3_spi_set_SPI_NSS(enum spi_nss_level nss_level)
+/*
+ * The functions below only issue bridge commands. Their answers, if
+ * any, are collected later. This way, a whole SPI transaction can be
+ * sent without waiting for the bridge in between. Only an answer that
+ * spans multiple USB packets (i.e. read data) has to be retrieved
+ * before the next command is sent, as the bridge wouldn't accept it
+ * until then.
+ */
+
+static int stlinkv3_issue_nss(libusb_device_handle *stlinkv3_handle, enum spi_nss_level nss_level)
 {
 	uint8_t command[16] = { 0 };
-	uint8_t answer[2];
 
 	command[0] = STLINK_BRIDGE_COMMAND;
 	command[1] = STLINK_BRIDGE_CS_SPI;
 	command[2] = (uint8_t) (nss_level);
 
-	if (stlinkv3_command(command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_CS_SPI") != 0)
-		return -1;
-	return 0;
+	return stlinkv3_bulk_out(stlinkv3_handle, command, sizeof(command), "the STLINK_BRIDGE_CS_SPI command");
 }
 
-static int stlinkv3_spi_transmit(const struct flashctx *flash,
-				 unsigned int write_cnt,
-				 unsigned int read_cnt,
-				 const unsigned char *write_arr,
-				 unsigned char *read_arr)
+static int stlinkv3_collect_nss(libusb_device_handle *stlinkv3_handle)
+{
+	uint8_t answer[2];
+
+	return stlinkv3_bulk_in(stlinkv3_handle, answer, sizeof(answer), "the STLINK_BRIDGE_CS_SPI answer");
+}
+
+static int stlinkv3_issue_write(libusb_device_handle *stlinkv3_handle,
+				unsigned int write_cnt, const unsigned char *write_arr)
 {
 	uint8_t command[16] = { 0 };
-	int rc = 0;
-	int actual_length = 0;
-	uint32_t rw_status = 0;
 	unsigned int i;
 
-	if (stlinkv3_spi_set_SPI_NSS(SPI_NSS_LOW)) {
-		msg_perr("Failed to set the NSS pin to low\n");
-		return -1;
-	}
-
 	command[0] = STLINK_BRIDGE_COMMAND;
 	command[1] = STLINK_BRIDGE_WRITE_SPI;
 	command[2] = (uint8_t)write_cnt;
 	command[3] = (uint8_t)(write_cnt >> 8);
 
+	/* The first 8 bytes are sent with the command. */
 	for (i = 0; (i < 8) && (i < write_cnt); i++)
 		command[4+i] = write_arr[i];
 
-	rc = libusb_bulk_transfer(stlinkv3_handle, STLINK_EP_OUT,
-				  command, sizeof(command),
-				  &actual_length, USB_TIMEOUT_IN_MS);
-	if (rc != LIBUSB_TRANSFER_COMPLETED || actual_length != sizeof(command)) {
-		msg_perr("Failed to issue the STLINK_BRIDGE_WRITE_SPI command: '%s'\n",
-			 libusb_error_name(rc));
-		goto transmit_err;
+	if (stlinkv3_bulk_out(stlinkv3_handle, command, sizeof(command), "the STLINK_BRIDGE_WRITE_SPI command"))
+		return -1;
+
+	if (write_cnt > 8 &&
+	    stlinkv3_bulk_out(stlinkv3_handle, &write_arr[8], write_cnt - 8, "the data after the STLINK_BRIDGE_WRITE_SPI command"))
+		return -1;
+
+	return 0;
+}
+
+static int stlinkv3_issue_read(libusb_device_handle *stlinkv3_handle, unsigned int read_cnt)
+{
+	uint8_t command[16] = { 0 };
+
+	command[0] = STLINK_BRIDGE_COMMAND;
+	command[1] = STLINK_BRIDGE_READ_SPI;
+	command[2] = (uint8_t)read_cnt;
+	command[3] = (uint8_t)(read_cnt >> 8);
+
+	return stlinkv3_bulk_out(stlinkv3_handle, command, sizeof(command), "the STLINK_BRIDGE_READ_SPI command");
+}
+
+static int stlinkv3_issue_status(libusb_device_handle *stlinkv3_handle)
+{
+	uint8_t command[16] = { 0 };
+
+	command[0] = STLINK_BRIDGE_COMMAND;
+	command[1] = STLINK_BRIDGE_GET_RWCMD_STATUS;
+
+	return stlinkv3_bulk_out(stlinkv3_handle, command, sizeof(command), "the STLINK_BRIDGE_GET_RWCMD_STATUS command");
+}
+
+static int stlinkv3_collect_status(libusb_device_handle *stlinkv3_handle)
+{
+	uint16_t answer[4];
+	uint32_t status;
+
+	if (stlinkv3_bulk_in(stlinkv3_handle, (uint8_t *)answer, sizeof(answer), "the STLINK_BRIDGE_GET_RWCMD_STATUS answer"))
+		return -1;
+
+	status = (uint32_t)answer[2] | (uint32_t)answer[3]<<16;
+	if (status != 0) {
+		msg_perr("SPI read/write failure: %d\n", status);
+		return -1;
 	}
+	return 0;
+}
 
-	if (write_cnt > 8) {
-		rc = libusb_bulk_transfer(stlinkv3_handle,
-					  STLINK_EP_OUT,
-					  (unsigned char *)&write_arr[8],
-					  (unsigned int)(write_cnt - 8),
-					  &actual_length,
-					  USB_TIMEOUT_IN_MS);
-		if (rc != LIBUSB_TRANSFER_COMPLETED || (unsigned int)actual_length != (write_cnt - 8)) {
-			msg_perr("Failed to send the  data after the  STLINK_BRIDGE_WRITE_SPI command: '%s'\n",
-				 libusb_error_name(rc));
-			goto transmit_err;
-		}
+/*
+ * Begin an SPI transaction: assert NSS and send the command bytes.
+ * The answer to the NSS command has to be collected by the caller.
+ */
+static int stlinkv3_spi_begin(libusb_device_handle *stlinkv3_handle,
+			      unsigned int write_cnt, const unsigned char *write_arr)
+{
+	if (stlinkv3_issue_nss(stlinkv3_handle, SPI_NSS_LOW)) {
+		msg_perr("Failed to set the NSS pin to low\n");
+		return -1;
 	}
+	return stlinkv3_issue_write(stlinkv3_handle, write_cnt, write_arr);
+}
 
-	if (stlinkv3_get_last_readwrite_status(&rw_status))
+/*
+ * End an SPI transaction: de-assert NSS and check the status of the
+ * last read/write command. `pending_nss` tells if the answer to the
+ * NSS command of stlinkv3_spi_begin() is still outstanding.
+ */
+static int stlinkv3_spi_end(libusb_device_handle *stlinkv3_handle, bool pending_nss)
+{
+	if (pending_nss && stlinkv3_collect_nss(stlinkv3_handle))
 		return -1;
 
-	if (rw_status != 0) {
-		msg_perr("SPI read/write failure: %d\n", rw_status);
-		goto transmit_err;
+	if (stlinkv3_issue_nss(stlinkv3_handle, SPI_NSS_HIGH) || stlinkv3_issue_status(stlinkv3_handle)) {
+		msg_perr("Failed to set the NSS pin to high\n");
+		return -1;
 	}
 
+	if (stlinkv3_collect_nss(stlinkv3_handle) || stlinkv3_collect_status(stlinkv3_handle))
+		return -1;
+
+	return 0;
+}
+
+static int stlinkv3_spi_transmit(const struct flashctx *flash,
+				 unsigned int write_cnt,
+				 unsigned int read_cnt,
+				 const unsigned char *write_arr,
+				 unsigned char *read_arr)
+{
+	const struct stlinkv3_spi_data *const stlinkv3_data = flash->mst.spi->data;
+	libusb_device_handle *const stlinkv3_handle = stlinkv3_data->handle;
+
+	if (stlinkv3_spi_begin(stlinkv3_handle, write_cnt, write_arr))
+		goto transmit_err;
+
 	if (read_cnt) {
-		command[1] = STLINK_BRIDGE_READ_SPI;
-		command[2] = (uint8_t)read_cnt;
-		command[3] = (uint8_t)(read_cnt >> 8);
-
-		rc = libusb_bulk_transfer(stlinkv3_handle, STLINK_EP_OUT,
-					  command, sizeof(command),
-					  &actual_length, USB_TIMEOUT_IN_MS);
-		if (rc != LIBUSB_TRANSFER_COMPLETED || (unsigned int)actual_length != sizeof(command)) {
-			msg_perr("Failed to issue the STLINK_BRIDGE_READ_SPI command: '%s'\n",
-				 libusb_error_name(rc));
+		if (stlinkv3_issue_read(stlinkv3_handle, read_cnt) || stlinkv3_collect_nss(stlinkv3_handle))
 			goto transmit_err;
-		}
 
-		rc = libusb_bulk_transfer(stlinkv3_handle,
-					  STLINK_EP_IN,
-					  (unsigned char *)read_arr,
-					  (int)read_cnt,
-					  &actual_length,
-					  USB_TIMEOUT_IN_MS);
-		if (rc != LIBUSB_TRANSFER_COMPLETED || (unsigned int)actual_length != read_cnt) {
-			msg_perr("Failed to retrieve the STLINK_BRIDGE_READ_SPI answer: '%s'\n",
-				 libusb_error_name(rc));
+		if (stlinkv3_bulk_in(stlinkv3_handle, read_arr, read_cnt, "the STLINK_BRIDGE_READ_SPI answer"))
 			goto transmit_err;
-		}
 	}
 
-	if (stlinkv3_get_last_readwrite_status(&rw_status))
-		goto transmit_err;
+	return stlinkv3_spi_end(stlinkv3_handle, !read_cnt);
 
-	if (rw_status != 0) {
-		msg_perr("SPI read/write failure: %d\n", rw_status);
-		goto transmit_err;
+transmit_err:
+	if (stlinkv3_spi_set_SPI_NSS(stlinkv3_handle, SPI_NSS_HIGH))
+		msg_perr("Failed to set the NSS pin to high\n");
+	return -1;
+}
+
+/*
+ * Read with a single read command and NSS asserted for the whole
+ * range. The data is retrieved with maximum-size bridge reads.
+ */
+static int stlinkv3_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const struct stlinkv3_spi_data *const stlinkv3_data = flash->mst.spi->data;
+	libusb_device_handle *const stlinkv3_handle = stlinkv3_data->handle;
+	uint8_t cmd[1 + JEDEC_MAX_ADDR_LEN];
+	unsigned int done = 0;
+	bool pending_nss = true;
+	int ret = 0;
+
+	if (!len)
+		return 0;
+
+	const int cmdlen = spi_prepare_read_cmd(flash, cmd, start, len);
+	if (cmdlen < 0)
+		return 1;
+	if (!cmdlen)
+		return default_spi_read(flash, buf, start, len);
+
+	if (stlinkv3_spi_begin(stlinkv3_handle, cmdlen, cmd))
+		goto read_err;
+
+	while (done < len) {
+		const unsigned int to_read = min(STLINK_MAX_RW_LEN, len - done);
+
+		if (flashprog_cancelled(flash)) {
+			ret = 1;
+			break;
+		}
+
+		if (stlinkv3_issue_read(stlinkv3_handle, to_read))
+			goto read_err;
+
+		if (pending_nss) {
+			if (stlinkv3_collect_nss(stlinkv3_handle))
+				goto read_err;
+			pending_nss = false;
+		}
+
+		if (stlinkv3_bulk_in(stlinkv3_handle, buf + done, to_read, "the STLINK_BRIDGE_READ_SPI answer"))
+			goto read_err;
+
+		flashprog_progress_add(flash, to_read);
+		done += to_read;
 	}
 
-	if (stlinkv3_spi_set_SPI_NSS(SPI_NSS_HIGH)) {
-		msg_perr("Failed to set the NSS pin to high\n");
+	if (stlinkv3_spi_end(stlinkv3_handle, pending_nss))
 		return -1;
-	}
-	return 0;
 
-transmit_err:
-	if (stlinkv3_spi_set_SPI_NSS(SPI_NSS_HIGH))
+	return ret;
+
+read_err:
+	if (stlinkv3_spi_set_SPI_NSS(stlinkv3_handle, SPI_NSS_HIGH))
 		msg_perr("Failed to set the NSS pin to high\n");
 	return -1;
 }
 
 static int stlinkv3_spi_shutdown(void *data)
 {
+	struct stlinkv3_spi_data *const stlinkv3_data = data;
 	uint8_t command[16] = { 0 };
 	uint8_t answer[2];
 
@@ -429,20 +559,22 @@ static int stlinkv3_spi_shutdown(void *data)
 	command[1] = STLINK_BRIDGE_CLOSE;
 	command[2] = STLINK_SPI_COM;
 
-	stlinkv3_command(command, sizeof(command), answer, sizeof(answer), "STLINK_BRIDGE_CLOSE");
+	stlinkv3_command(stlinkv3_data->handle, command, sizeof(command), answer, sizeof(answer),
+			 "STLINK_BRIDGE_CLOSE");
 
-	libusb_close(stlinkv3_handle);
-	libusb_exit(usb_ctx);
+	libusb_close(stlinkv3_data->handle);
+	usb_dev_exit(stlinkv3_data->usb_ctx);
+	free(data);
 
 	return 0;
 }
 
 static const struct spi_master spi_programmer_stlinkv3 = {
-	.max_data_read	= UINT16_MAX,
-	.max_data_write	= UINT16_MAX,
+	.max_data_read	= STLINK_MAX_RW_LEN,
+	.max_data_write	= STLINK_MAX_RW_LEN,
 	.command	= stlinkv3_spi_transmit,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= stlinkv3_spi_read,
 	.write_256	= default_spi_write_256,
 	.shutdown	= stlinkv3_spi_shutdown,
 	.probe_opcode	= default_spi_probe_opcode,
@@ -456,8 +588,11 @@ static int stlinkv3_spi_init(struct flashprog_programmer *const prog)
 	char *endptr = NULL;
 	int ret = 1;
 	int devIndex = 0;
+	struct libusb_context *usb_ctx;
+	libusb_device_handle *stlinkv3_handle = NULL;
+	struct stlinkv3_spi_data *stlinkv3_data;
 
-	if (libusb_init(&usb_ctx)) {
+	if (usb_dev_init(&usb_ctx)) {
 		msg_perr("Could not initialize libusb!\n");
 		return 1;
 	}
@@ -502,15 +637,23 @@ static int stlinkv3_spi_init(struct flashprog_programmer *const prog)
 		free(speed_str);
 	}
 
-	if (stlinkv3_spi_open(sck_freq_kHz))
+	if (stlinkv3_spi_open(stlinkv3_handle, sck_freq_kHz))
+		goto init_err_exit;
+
+	stlinkv3_data = calloc(1, sizeof(*stlinkv3_data));
+	if (!stlinkv3_data) {
+		msg_perr("Unable to allocate space for SPI master data\n");
 		goto init_err_exit;
+	}
+	stlinkv3_data->usb_ctx = usb_ctx;
+	stlinkv3_data->handle = stlinkv3_handle;
 
-	return register_spi_master(&spi_programmer_stlinkv3, 0, NULL);
+	return register_spi_master(&spi_programmer_stlinkv3, 0, stlinkv3_data);
 
 init_err_exit:
 	if (stlinkv3_handle)
 		libusb_close(stlinkv3_handle);
-	libusb_exit(usb_ctx);
+	usb_dev_exit(usb_ctx);
 	return ret;
 }
 
@@ -519,4 +662,5 @@ const struct programmer_entry programmer_stlinkv3_spi = {
 	.type			= USB,
 	.devs.dev		= devs_stlinkv3_spi,
 	.init			= stlinkv3_spi_init,
+	.multi_instance		= true,
 };
@@ -24,10 +24,20 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <limits.h>
+#if HAVE_PTHREAD == 1
+#include <pthread.h>
+#endif
 #include "flash.h"
 #include "programmer.h"
 
 static bool use_clock_gettime = false;
+/* Several programmers may run delays on their own threads, so these are updated atomically. */
+static struct flashprog_delay_stats delay_stats;
+#if HAVE_PTHREAD == 1
+static pthread_once_t delay_loop_calibrated = PTHREAD_ONCE_INIT;
+#else
+static bool delay_loop_calibrated = false;
+#endif
 
 #if HAVE_CLOCK_GETTIME == 1
 
@@ -37,19 +47,68 @@ static clockid_t clock_id = CLOCK_MONOTONIC;
 static clockid_t clock_id = CLOCK_REALTIME;
 #endif
 
-static void clock_usec_delay(int usecs)
+static uint64_t clock_nsec(void)
 {
 	struct timespec now;
 	clock_gettime(clock_id, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * How late the OS wakes us up from a sleep, as a running average. It
+ * grows fast and shrinks slowly, so we rather spin a little longer than
+ * overshoot a delay. Delays that are only spun because of a high
+ * estimate let it shrink too, otherwise a single late wakeup would
+ * keep us from sleeping for good.
+ */
+static unsigned int sleep_overshoot_us = 100;
+
+/* Upper bound for the estimate, more is not a scheduling hiccup anymore. */
+#define SLEEP_OVERSHOOT_MAX_US	10000
+
+/* Time to spin in addition to the expected overshoot of a sleep. */
+#define SPIN_MARGIN_US	20
 
-	const long end_nsec = now.tv_nsec + usecs * 1000L;
-	const struct timespec end = {
-		end_nsec / (1000 * 1000 * 1000) + now.tv_sec,
-		end_nsec % (1000 * 1000 * 1000)
-	};
-	do {
-		clock_gettime(clock_id, &now);
-	} while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+/* Account how late a delay ended, e.g. because we were preempted while spinning. */
+static void account_lateness(const uint64_t late_ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(delay_stats.by_lateness) - 1 && late_ns >= 2000ULL << i; ++i)
+		;
+	__atomic_fetch_add(&delay_stats.by_lateness[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&delay_stats.count, 1, __ATOMIC_RELAXED);
+}
+
+/* Sleep for most of the delay, then spin for the last few microseconds. */
+static void clock_usec_delay(unsigned int usecs)
+{
+	const uint64_t start = clock_nsec();
+	const uint64_t end = start + usecs * 1000ULL;
+	/* Concurrent delays may race on the estimate, any of their updates will do. */
+	unsigned int estimate = __atomic_load_n(&sleep_overshoot_us, __ATOMIC_RELAXED);
+	uint64_t now;
+
+	if (usecs > 2 * estimate + SPIN_MARGIN_US) {
+		const unsigned int sleep_us = usecs - estimate - SPIN_MARGIN_US;
+		internal_sleep(sleep_us);
+
+		const uint64_t slept_us = (clock_nsec() - start) / 1000;
+		const unsigned int overshoot =
+			slept_us > sleep_us ? MIN(slept_us - sleep_us, SLEEP_OVERSHOOT_MAX_US) : 0;
+		if (overshoot > estimate)
+			estimate = (estimate + overshoot) / 2;
+		else
+			estimate = (7 * estimate + overshoot) / 8;
+		__atomic_store_n(&sleep_overshoot_us, estimate, __ATOMIC_RELAXED);
+	} else if (usecs > 2 * SPIN_MARGIN_US) {
+		/* Stops shrinking below 64us, where spinning is cheap anyway. */
+		__atomic_store_n(&sleep_overshoot_us, estimate - estimate / 64, __ATOMIC_RELAXED);
+	}
+
+	while ((now = clock_nsec()) < end)
+		;
+	account_lateness(now - end);
 }
 
 static int clock_check_res(void)
@@ -71,7 +130,7 @@ static int clock_check_res(void)
 }
 #else
 
-static inline void clock_usec_delay(int usecs) {}
+static inline void clock_usec_delay(unsigned int usecs) {}
 static inline int clock_check_res(void) { return 0; }
 
 #endif /* HAVE_CLOCK_GETTIME == 1 */
@@ -133,11 +192,8 @@ static unsigned long measure_delay(unsigned int usecs)
 	return timeusec;
 }
 
-void myusec_calibrate_delay(void)
+static void calibrate_delay_loop(void)
 {
-	if (clock_check_res())
-		return;
-
 	unsigned long count = 1000;
 	unsigned long timeusec, resolution;
 	int i, tries = 0;
@@ -219,6 +275,20 @@ recalibrate:
 	msg_pdbg("%ld myus = %ld us, ", resolution * 4, timeusec);
 
 	msg_pinfo("OK.\n");
+#if HAVE_PTHREAD != 1
+	delay_loop_calibrated = true;
+#endif
+}
+
+/*
+ * Calibrating the delay loop takes up to a second, so we only do that
+ * when it is needed, i.e. when there is no precise clock and a short
+ * delay is requested.
+ */
+void myusec_calibrate_delay(void)
+{
+	if (!clock_check_res())
+		msg_pdbg("No precise clock found, the delay loop will be calibrated on first use.\n");
 }
 
 /* Not very precise sleep. */
@@ -230,33 +300,71 @@ void internal_sleep(unsigned int usecs)
 	sleep(usecs / 1000000);
 	usleep(usecs % 1000000);
 #else
-	nanosleep(&(struct timespec){usecs / 1000000, (usecs * 1000) % 1000000000UL}, NULL);
+	nanosleep(&(struct timespec){usecs / 1000000, (usecs % 1000000) * 1000L}, NULL);
+#endif
+}
+
+/* Lateness of the delays of all threads so far, for the statistics. */
+const struct flashprog_delay_stats *internal_delay_stats(void)
+{
+	return &delay_stats;
+}
+
+/* Microseconds since an arbitrary point in time, for measurements. */
+uint64_t monotonic_us(void)
+{
+#if HAVE_CLOCK_GETTIME == 1
+	struct timespec now;
+	clock_gettime(clock_id, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
 #endif
 }
 
 /* Precise delay. */
 void internal_delay(unsigned int usecs)
 {
-	/* If the delay is >0.1 s, use internal_sleep because timing does not need to be so precise. */
-	if (usecs > 100000) {
-		internal_sleep(usecs);
-	} else if (use_clock_gettime) {
+	if (use_clock_gettime) {
 		clock_usec_delay(usecs);
+	} else if (usecs > 100000) {
+		/* If the delay is >0.1 s, use internal_sleep because timing does not need to be so precise. */
+		internal_sleep(usecs);
 	} else {
+#if HAVE_PTHREAD == 1
+		pthread_once(&delay_loop_calibrated, calibrate_delay_loop);
+#else
+		if (!delay_loop_calibrated)
+			calibrate_delay_loop();
+#endif
 		myusec_delay(usecs);
 	}
 }
 
 #else
 #include <libpayload.h>
+#include "libflashprog.h"
 
 void myusec_calibrate_delay(void)
 {
 	get_cpu_speed();
 }
 
+uint64_t monotonic_us(void)
+{
+	return timer_us(0);
+}
+
 void internal_delay(unsigned int usecs)
 {
 	udelay(usecs);
 }
+
+const struct flashprog_delay_stats *internal_delay_stats(void)
+{
+	static const struct flashprog_delay_stats no_stats;
+	return &no_stats;
+}
 #endif
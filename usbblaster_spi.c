@@ -36,6 +36,7 @@
 #include <ctype.h>
 #include <ftdi.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 
@@ -63,13 +64,8 @@ static struct ftdi_context ftdic;
 
 #define BUF_SIZE	64
 
-/* The programmer shifts bits in the wrong order for SPI, so we use this method to reverse the bits when needed.
- * http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith32Bits */
-static uint8_t reverse(uint8_t b)
-{
-	return ((b * 0x0802LU & 0x22110LU) | (b * 0x8020LU & 0x88440LU)) * 0x10101LU >> 16;
-}
-
+/* Bytes read per SPI command by usbblaster_spi_read(). */
+#define USBBLASTER_READ_CHUNK	(64 * KiB)
 
 /* Returns 0 upon success, a negative number upon errors. */
 static int usbblaster_spi_init(struct flashprog_programmer *const prog)
@@ -114,100 +110,166 @@ static int usbblaster_spi_init(struct flashprog_programmer *const prog)
 	return 0;
 }
 
-static int send_write(unsigned int writecnt, const unsigned char *writearr)
+/* Bytes needed to shift `len` bytes, each packet has a one-byte header. */
+static size_t shift_len(const unsigned int len)
 {
-	uint8_t buf[BUF_SIZE] = { 0 };
+	return len + (len + BUF_SIZE - 2) / (BUF_SIZE - 1);
+}
 
-	while (writecnt) {
-		unsigned int i;
-		unsigned int n_write = min(writecnt, BUF_SIZE - 1);
-		msg_pspew("writing %d-byte packet\n", n_write);
+/* Bytes needed to send a whole command, including chip-select changes. */
+static size_t command_len(const struct spi_command *const cmd)
+{
+	return 1 + shift_len(cmd->writecnt) + shift_len(cmd->readcnt) + 1;
+}
 
-		buf[0] = BIT_BYTE | (uint8_t)n_write;
-		for (i = 0; i < n_write; i++) {
-			buf[i+1] = reverse(writearr[i]);
-		}
-		if (ftdi_write_data(&ftdic, buf, n_write + 1) < 0) {
-			msg_perr("USB-Blaster write failed\n");
-			return -1;
-		}
+/*
+ * Fill the shift-mode packets of a whole command into `buf`. The
+ * programmer shifts bits in the wrong order for SPI, so written data
+ * is bit-reversed on the way. Reads shift out zeros.
+ */
+static size_t fill_command(uint8_t *const buf, const struct spi_command *const cmd)
+{
+	unsigned int off, n;
+	size_t i = 0;
+
+	buf[i++] = BIT_LED; // asserts /CS
 
-		writearr += n_write;
-		writecnt -= n_write;
+	for (off = 0; off < cmd->writecnt; off += n) {
+		n = min(cmd->writecnt - off, BUF_SIZE - 1);
+		msg_pspew("writing %u-byte packet\n", n);
+		buf[i++] = BIT_BYTE | (uint8_t)n;
+		reverse_bytes(buf + i, cmd->writearr + off, n);
+		i += n;
 	}
-	return 0;
+
+	for (off = 0; off < cmd->readcnt; off += n) {
+		n = min(cmd->readcnt - off, BUF_SIZE - 1);
+		msg_pspew("reading %u-byte packet\n", n);
+		buf[i++] = BIT_BYTE | BIT_READ | (uint8_t)n;
+		memset(buf + i, 0, n);
+		i += n;
+	}
+
+	buf[i++] = BIT_CS;
+	return i;
 }
 
-static int send_read(unsigned int readcnt, unsigned char *readarr)
+/*
+ * Send `size` bytes of packets and read `readcnt` bytes of response. The
+ * read is submitted first, so the host fetches data as soon as the
+ * programmer provides it, while the rest of the packets are still sent.
+ */
+static int usbblaster_transfer(const uint8_t *const buf, const size_t size, uint8_t *const readarr,
+			       const unsigned int readcnt)
 {
-	int i;
-	unsigned int n_read;
-	uint8_t buf[BUF_SIZE] = { 0 };
-
-	n_read = readcnt;
-	while (n_read) {
-		unsigned int payload_size = min(n_read, BUF_SIZE - 1);
-		msg_pspew("reading %d-byte packet\n", payload_size);
-
-		buf[0] = BIT_BYTE | BIT_READ | (uint8_t)payload_size;
-		if (ftdi_write_data(&ftdic, buf, payload_size + 1) < 0) {
-			msg_perr("USB-Blaster write failed\n");
+	struct ftdi_transfer_control *tc = NULL;
+	int ret = 0;
+
+	if (readcnt) {
+		tc = ftdi_read_data_submit(&ftdic, readarr, readcnt);
+		if (!tc) {
+			msg_perr("USB-Blaster read failed: %s\n", ftdi_get_error_string(&ftdic));
 			return -1;
 		}
-		n_read -= payload_size;
 	}
 
-	n_read = readcnt;
-	while (n_read) {
-		int ret = ftdi_read_data(&ftdic, readarr, n_read);
-		if (ret < 0) {
-			msg_perr("USB-Blaster read failed\n");
+	if (ftdi_write_data(&ftdic, (unsigned char *)buf, size) < 0) {
+		msg_perr("USB-Blaster write failed: %s\n", ftdi_get_error_string(&ftdic));
+		ret = -1;
+	}
+
+	if (tc) {
+		/* Always reap the transfer, it times out if the packets didn't make it. */
+		const int r = ftdi_transfer_data_done(tc);
+		if (r < 0) {
+			msg_perr("USB-Blaster read failed: %s\n", ftdi_get_error_string(&ftdic));
 			return -1;
 		}
-		for (i = 0; i < ret; i++) {
-			readarr[i] = reverse(readarr[i]);
+		if (!ret && (unsigned int)r != readcnt) {
+			msg_perr("USB-Blaster short read: %d of %u bytes\n", r, readcnt);
+			return -1;
 		}
-		n_read -= ret;
-		readarr += ret;
+		reverse_bytes(readarr, readarr, readcnt);
 	}
-	return 0;
+
+	return ret;
 }
 
-/* Returns 0 upon success, a negative number upon errors. */
-static int usbblaster_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
-				       const unsigned char *writearr, unsigned char *readarr)
+/*
+ * Returns 0 upon success, a negative number upon errors.
+ *
+ * Commands are packed into a single write up to and including the next
+ * one that reads, so e.g. WREN and a page program take a single transfer.
+ */
+static int usbblaster_spi_send_multicommand(const struct flashctx *flash, struct spi_command *cmds)
 {
-	uint8_t cmd;
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
 	int ret = 0;
 
-	cmd = BIT_LED; // asserts /CS
-	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
-		msg_perr("USB-Blaster enable chip select failed\n");
-		ret = -1;
-	}
-
-	if (!ret && writecnt)
-		ret = send_write(writecnt, writearr);
+	while (!ret && (cmds->writecnt || cmds->readcnt)) {
+		struct spi_command *cmd;
+		size_t len = 0, i = 0;
 
-	if (!ret && readcnt)
-		ret = send_read(readcnt, readarr);
+		for (cmd = cmds; cmd->writecnt || cmd->readcnt; ++cmd) {
+			len += command_len(cmd);
+			if (cmd->readcnt)
+				break;
+		}
+		if (len > buf_size) {
+			uint8_t *const new_buf = realloc(buf, len);
+			if (!new_buf) {
+				msg_perr("Out of memory!\n");
+				ret = -1;
+				break;
+			}
+			buf = new_buf;
+			buf_size = len;
+		}
 
-	cmd = BIT_CS;
-	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
-		msg_perr("USB-Blaster disable chip select failed\n");
-		ret = -1;
+		for (; cmds->writecnt || cmds->readcnt; ++cmds) {
+			i += fill_command(buf + i, cmds);
+			if (cmds->readcnt)
+				break;
+		}
+		ret = usbblaster_transfer(buf, i, cmds->readarr, cmds->readcnt);
+		if (cmds->readcnt)
+			++cmds;
 	}
 
+	free(buf);
 	return ret;
 }
 
+/* Returns 0 upon success, a negative number upon errors. */
+static int usbblaster_spi_send_command(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+				       const unsigned char *writearr, unsigned char *readarr)
+{
+	struct spi_command cmds[] = {
+	{
+		.writecnt	= writecnt,
+		.writearr	= writearr,
+		.readcnt	= readcnt,
+		.readarr	= readarr,
+	},
+		NULL_SPI_CMD,
+	};
+
+	return usbblaster_spi_send_multicommand(flash, cmds);
+}
+
+/* Read in large chunks, so most of a read overlaps with sending its packets. */
+static int usbblaster_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return flashprog_read_chunked(flash, buf, start, len, USBBLASTER_READ_CHUNK, spi_nbyte_read);
+}
 
 static const struct spi_master spi_master_usbblaster = {
-	.max_data_read	= 256,
+	.max_data_read	= USBBLASTER_READ_CHUNK,
 	.max_data_write	= 256,
 	.command	= usbblaster_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.multicommand	= usbblaster_spi_send_multicommand,
+	.read		= usbblaster_spi_read,
 	.write_256	= default_spi_write_256,
 	.probe_opcode	= default_spi_probe_opcode,
 };
@@ -141,3 +141,195 @@ struct libusb_device_handle *usb_dev_get_by_vid_pid_number(
 {
 	return get_by_vid_pid_filter(usb_ctx, vid, pid, filter_by_number, &num);
 }
+
+/*
+ * While a hotplug watcher runs, it holds the default libusb context. The
+ * programmers then use it, too, instead of initializing a context (and
+ * enumerating the bus) of their own for every board.
+ */
+static bool watching;
+
+int usb_dev_init(struct libusb_context **usb_ctx)
+{
+	if (watching) {
+		if (usb_ctx)
+			*usb_ctx = NULL;
+		return 0;
+	}
+	return libusb_init(usb_ctx);
+}
+
+void usb_dev_exit(struct libusb_context *usb_ctx)
+{
+	if (!watching)
+		libusb_exit(usb_ctx);
+}
+
+static const struct dev_entry *watched_devs;
+static unsigned int watched_present;	/* matching devices currently attached */
+static libusb_hotplug_callback_handle watch_handle;
+
+static int LIBUSB_CALL watch_event(struct libusb_context *usb_ctx, struct libusb_device *dev,
+				   libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	const struct dev_entry *entry;
+
+	if (libusb_get_device_descriptor(dev, &desc))
+		return 0;
+
+	for (entry = watched_devs; entry->vendor_id; ++entry) {
+		if (entry->vendor_id != desc.idVendor || entry->device_id != desc.idProduct)
+			continue;
+		if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+			msg_pdbg("USB device %04x:%04x arrived.\n", desc.idVendor, desc.idProduct);
+			++watched_present;
+		} else if (watched_present) {
+			msg_pdbg("USB device %04x:%04x left.\n", desc.idVendor, desc.idProduct);
+			--watched_present;
+		}
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Start watching for devices listed in `devs` (terminated by a zero
+ * vendor id). Devices attached already count as arrived.
+ */
+int usb_dev_watch_start(const struct dev_entry *devs)
+{
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		msg_perr("USB hotplug events are not supported on this platform.\n");
+		return 1;
+	}
+
+	int ret = libusb_init(NULL);
+	if (ret) {
+		msg_perr("Could not initialize libusb (%s)!\n", libusb_error_name(ret));
+		return 1;
+	}
+
+	watched_devs = devs;
+	watched_present = 0;
+	ret = libusb_hotplug_register_callback(NULL,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, watch_event, NULL, &watch_handle);
+	if (ret != LIBUSB_SUCCESS) {
+		msg_perr("Could not register USB hotplug callback (%s)!\n", libusb_error_name(ret));
+		libusb_exit(NULL);
+		return 1;
+	}
+
+	watching = true;
+	return 0;
+}
+
+/*
+ * Wait up to `timeout_ms` until a watched device is attached (`present`)
+ * or all of them are gone (!`present`).
+ *
+ * Returns 0 once the state is reached, 1 on timeout, -1 on errors.
+ */
+int usb_dev_watch_wait(const bool present, const unsigned int timeout_ms)
+{
+	const uint64_t end_us = monotonic_us() + timeout_ms * 1000ull;
+
+	while ((watched_present > 0) != present) {
+		const uint64_t now_us = monotonic_us();
+		if (now_us >= end_us)
+			return 1;
+
+		struct timeval tv = {
+			.tv_sec = (end_us - now_us) / 1000000,
+			.tv_usec = (end_us - now_us) % 1000000,
+		};
+		const int ret = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		if (ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+			msg_perr("Handling USB events failed (%s)!\n", libusb_error_name(ret));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void usb_dev_watch_stop(void)
+{
+	if (!watching)
+		return;
+	libusb_hotplug_deregister_callback(NULL, watch_handle);
+	watching = false;
+	libusb_exit(NULL);
+}
+
+/*
+ * The transfer functions below wrap their libusb counterparts and
+ * account every transfer in the statistics (cf. flashprog_stats_get()).
+ */
+
+static void account_transfer(const int length, const int transferred,
+			     const uint64_t start_us, const int result)
+{
+	struct flashprog_usb_stats *const stats = programmer_usb_stats();
+	const uint64_t us = monotonic_us() - start_us;
+	size_t i;
+
+	/* Programmers on other threads may account their transfers concurrently. */
+	__atomic_fetch_add(&stats->transfers, 1, __ATOMIC_RELAXED);
+	if (result == LIBUSB_ERROR_TIMEOUT)
+		__atomic_fetch_add(&stats->timeouts, 1, __ATOMIC_RELAXED);
+	else if (result < 0)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+	if (transferred > 0)
+		__atomic_fetch_add(&stats->bytes, transferred, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->time_us, us, __ATOMIC_RELAXED);
+
+	for (i = 0; i < ARRAY_SIZE(stats->by_size) - 1 && length > 64 << i; ++i)
+		;
+	__atomic_fetch_add(&stats->by_size[i], 1, __ATOMIC_RELAXED);
+	for (i = 0; i < ARRAY_SIZE(stats->by_latency) - 1 && us >= 125u << i; ++i)
+		;
+	__atomic_fetch_add(&stats->by_latency[i], 1, __ATOMIC_RELAXED);
+
+	if (result == LIBUSB_ERROR_TIMEOUT)
+		msg_pdbg2("USB transfer of %d bytes timed out after %"PRIu64" us.\n", length, us);
+}
+
+int usb_dev_bulk_transfer(struct libusb_device_handle *handle, unsigned char endpoint,
+			  unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+	const uint64_t start_us = monotonic_us();
+	int actual = 0;
+
+	const int ret = libusb_bulk_transfer(handle, endpoint, data, length, &actual, timeout);
+	account_transfer(length, actual, start_us, ret);
+	if (transferred)
+		*transferred = actual;
+	return ret;
+}
+
+int usb_dev_interrupt_transfer(struct libusb_device_handle *handle, unsigned char endpoint,
+			       unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+	const uint64_t start_us = monotonic_us();
+	int actual = 0;
+
+	const int ret = libusb_interrupt_transfer(handle, endpoint, data, length, &actual, timeout);
+	account_transfer(length, actual, start_us, ret);
+	if (transferred)
+		*transferred = actual;
+	return ret;
+}
+
+int usb_dev_control_transfer(struct libusb_device_handle *handle, uint8_t request_type,
+			     uint8_t request, uint16_t value, uint16_t index,
+			     unsigned char *data, uint16_t length, unsigned int timeout)
+{
+	const uint64_t start_us = monotonic_us();
+
+	const int ret = libusb_control_transfer(handle, request_type, request, value, index,
+						data, length, timeout);
+	account_transfer(length, ret, start_us, ret);
+	return ret;
+}
@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# This file is part of the flashprog project.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# This script runs a fixed set of scenarios against an emulated 8MiB SPI
+# flash chip of the dummy programmer. The dummy's timing model runs on a
+# virtual clock, so the simulated time is the same on every machine and
+# the scenarios finish quickly. For every scenario, one line is printed
+# with the SPI traffic, the simulated time, and the CPU time and peak
+# memory use of flashprog itself. The output of two commits can be
+# compared with diff(1).
+#
+# Usage: flashprog_benchmark.sh [<flashprog binary>]
+
+set -e
+
+FLASHPROG=${1:-${FLASHPROG:-./flashprog}}
+case "${FLASHPROG}" in
+*/*)	FLASHPROG="$(cd "$(dirname "${FLASHPROG}")" && pwd)/$(basename "${FLASHPROG}")" ;;
+esac
+CHIP="MX25L6436E/MX25L6445E/MX25L6465E/MX25L6473E/MX25L6473F"
+BLOCKS=128	# of 64KiB
+# Roughly a USB programmer with a 20MHz SPI clock and a common 3.3V chip.
+MODEL="latency_us=100,bandwidth_kbps=20000,max_transfer=4096"
+MODEL="${MODEL},page_program_us=700,sector_erase_us=45000,block_erase_us=300000,virtual_time=yes"
+
+TEMP_DIR=$(mktemp -d)
+trap "rm -rf ${TEMP_DIR}" EXIT
+cd "${TEMP_DIR}"
+
+# Prints the number $1 as $2 little-endian bytes.
+le() {
+	n=$1
+	i=0
+	while [ $i -lt $2 ]; do
+		printf "\\$(printf %03o $((n & 255)))"
+		n=$((n >> 8))
+		i=$((i + 1))
+	done
+}
+
+# Prints the string $1 padded with zeros to 32 bytes.
+name32() {
+	printf "%s" "$1"
+	dd if=/dev/zero bs=1 count=$((32 - ${#1})) 2>/dev/null
+}
+
+# Deterministic test data, the same for every run.
+LC_ALL=C awk 'BEGIN { srand(1); for (i = 0; i < 65536; i++) printf "%c", 1 + int(rand() * 255) }' >block
+i=0
+while [ $i -lt $BLOCKS ]; do
+	cat block
+	i=$((i + 1))
+done >pattern
+dd if=/dev/zero bs=65536 count=$BLOCKS 2>/dev/null | tr '\000' '\377' >blank
+
+# 1KiB changed in every 100KiB, i.e. about 1%.
+cp pattern scattered
+i=0
+while [ $((i * 100)) -lt $((BLOCKS * 64)) ]; do
+	dd if=/dev/zero of=scattered bs=1024 seek=$((i * 100)) count=1 conv=notrunc 2>/dev/null
+	i=$((i + 1))
+done
+
+# The pattern shifted by one byte, so every byte of the region changes.
+{ tail -c +2 pattern; head -c 1 pattern; } >shifted
+printf "0x00100000:0x001fffff region\n" >layout
+
+# An FMAP at a 4KiB but not 64KiB aligned offset, so the search has to step down.
+FMAP_OFFSET=$((0x401000))
+{
+	printf "__FMAP__\001\001"
+	le 0 8
+	le $((BLOCKS * 65536)) 4
+	name32 BENCH
+	le 1 2
+	le $FMAP_OFFSET 4
+	le 4096 4
+	name32 FMAP
+	le 0 2
+} >fmap
+cp pattern fmapimage
+dd if=fmap of=fmapimage bs=1 seek=$FMAP_OFFSET conv=notrunc 2>/dev/null
+
+# Extracts the number of JSON field $1 from the standard input.
+field() {
+	sed -n "s/.*\"$1\": \([0-9]*\).*/\1/p"
+}
+
+# Runs scenario $1 on a chip with the contents of file $2, the remaining
+# arguments are passed to flashprog.
+run() {
+	name=$1
+	cp "$2" image
+	shift 2
+	if ! "${FLASHPROG}" -p "dummy:emulate=MX25L6436,image=image,${MODEL}" \
+			--stats=json "$@" >log 2>&1; then
+		# Probing without -c finds several matching definitions.
+		[ "$name" = probe ] || { cat log; echo "Scenario ${name} failed."; exit 1; }
+	fi
+	stats=$(grep '^{"spi_transactions"' log)
+	sim_us=$(sed -n 's/^Simulated time: \([0-9]*\) us$/\1/p' log)
+	printf "%-10s %12s %10s %10s %10s %8s %10s %8s %8s\n" "$name" \
+		"$(echo "$stats" | field spi_transactions)" "$(echo "$stats" | field spi_commands)" \
+		"$(echo "$stats" | field bytes_out)" "$(echo "$stats" | field bytes_in)" \
+		"$(echo "$stats" | field wip_polls)" "$((sim_us / 1000))" \
+		"$(($(echo "$stats" | field cpu_us) / 1000))" "$(echo "$stats" | field max_rss_kib)"
+}
+
+echo "flashprog binary: ${FLASHPROG}"
+echo "dummy timing: ${MODEL}"
+printf "%-10s %12s %10s %10s %10s %8s %10s %8s %8s\n" scenario transactions commands \
+	bytes_out bytes_in wip_polls sim_ms cpu_ms rss_kib
+
+run probe	blank
+run read	pattern	-c "$CHIP" -r out
+cmp out pattern
+run erase	pattern	-c "$CHIP" -E
+run write	blank	-c "$CHIP" -w pattern
+run rewrite	pattern	-c "$CHIP" -w scattered
+run region	pattern	-c "$CHIP" -l layout -i region -w shifted
+run fmap	fmapimage -c "$CHIP" --fmap -i FMAP -r out
@@ -0,0 +1,263 @@
+/*
+ * This file is part of the flashprog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This program measures the host-side work of libflashprog on synthetic
+ * images, without any flash traffic: planning a write (which compares the
+ * images, selects erase blocks and splits the writes), searching for an
+ * FMAP, and verifying against an emulated chip. Images of every given size
+ * are changed with different densities, in runs of different lengths. For
+ * every case, one line is printed with the time per byte of the image and
+ * the peak memory use so far. The output of two commits can be compared
+ * with diff(1), only the timing columns should differ.
+ *
+ * Usage: flashprog_kernel_benchmark [<size in MiB>...]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "libflashprog.h"
+
+#define MiB (1024 * 1024)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const unsigned int default_sizes[] = { 16, 64, 256 };
+/* Changed bytes per million, and the length of each changed run. */
+static const unsigned int densities[] = { 0, 1000, 10000, 100000, 1000000 };
+static const unsigned int run_lengths[] = { 1, 256, 4096, 65536 };
+
+static int quiet_log(enum flashprog_log_level level, const char *fmt, va_list args)
+{
+	if (level > FLASHPROG_MSG_WARN)
+		return 0;
+	return vfprintf(stderr, fmt, args);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long max_rss_kib(void)
+{
+	struct rusage usage;
+	return getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+}
+
+static void report(const char *kernel, size_t size, unsigned int density, unsigned int run,
+		   uint64_t ns, const char *result)
+{
+	printf("%-8s %8zu %8u %6u %10.3f %10ld  %s\n", kernel, size / MiB, density, run,
+	       (double)ns / size, max_rss_kib(), result);
+}
+
+/* Deterministic data, the same for every run. */
+static void fill_pattern(uint8_t *buf, size_t len)
+{
+	uint32_t x = 1;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+}
+
+/* Invert evenly spaced runs of `run' bytes, `density' bytes per million in total. */
+static void apply_changes(uint8_t *buf, const uint8_t *ref, size_t len, unsigned int density,
+			  unsigned int run)
+{
+	const size_t changed = (unsigned long long)len * density / 1000000;
+	const size_t runs = changed / run;
+	size_t i, j;
+
+	memcpy(buf, ref, len);
+	if (!runs)
+		return;
+	const size_t stride = len / runs;
+	for (i = 0; i < runs; ++i) {
+		for (j = 0; j < run; ++j)
+			buf[i * stride + j] = ~ref[i * stride + j];
+	}
+}
+
+static size_t put_le(uint8_t *buf, uint64_t value, size_t bytes)
+{
+	size_t i;
+
+	for (i = 0; i < bytes; ++i, value >>= 8)
+		buf[i] = value & 0xff;
+	return bytes;
+}
+
+/* An FMAP with a single area, 4KiB aligned at the end of the image, so the whole image is searched. */
+static void put_fmap(uint8_t *image, size_t len)
+{
+	uint8_t *const fmap = image + len - 4096;
+	size_t pos = 0;
+
+	memcpy(fmap, "__FMAP__\001\001", 10);
+	pos += 10;
+	pos += put_le(fmap + pos, 0, 8);
+	pos += put_le(fmap + pos, len, 4);
+	memset(fmap + pos, 0, 32);
+	strcpy((char *)fmap + pos, "BENCH");
+	pos += 32;
+	pos += put_le(fmap + pos, 1, 2);
+	pos += put_le(fmap + pos, len - 4096, 4);
+	pos += put_le(fmap + pos, 4096, 4);
+	memset(fmap + pos, 0, 32);
+	strcpy((char *)fmap + pos, "FMAP");
+	pos += 32;
+	put_le(fmap + pos, 0, 2);
+}
+
+static int bench_plan(struct flashprog_flashctx *flash, uint8_t *image, const uint8_t *ref, size_t size)
+{
+	struct flashprog_plan *plan;
+	unsigned int d, r;
+	char result[80];
+
+	for (d = 0; d < ARRAY_SIZE(densities); ++d) {
+		for (r = 0; r < ARRAY_SIZE(run_lengths); ++r) {
+			/* Runs don't matter if nothing or everything changes. */
+			if ((densities[d] == 0 || densities[d] == 1000000) && r > 0)
+				continue;
+			apply_changes(image, ref, size, densities[d], run_lengths[r]);
+
+			const uint64_t start = now_ns();
+			if (flashprog_image_plan(flash, image, size, ref, &plan)) {
+				fprintf(stderr, "Planning failed.\n");
+				return 1;
+			}
+			const uint64_t ns = now_ns() - start;
+
+			snprintf(result, sizeof(result), "%zu ops, %llu erased, %llu written",
+				 plan->count, plan->erase_bytes, plan->write_bytes);
+			report("plan", size, densities[d], run_lengths[r], ns, result);
+			flashprog_plan_release(plan);
+		}
+	}
+	return 0;
+}
+
+static int bench_fmap(struct flashprog_flashctx *flash, uint8_t *image, const uint8_t *ref, size_t size)
+{
+	struct flashprog_layout *layout;
+
+	memcpy(image, ref, size);
+	put_fmap(image, size);
+
+	const uint64_t start = now_ns();
+	if (flashprog_layout_read_fmap_from_buffer(&layout, flash, image, size)) {
+		fprintf(stderr, "FMAP not found.\n");
+		return 1;
+	}
+	const uint64_t ns = now_ns() - start;
+
+	flashprog_layout_release(layout);
+	report("fmap", size, 0, 0, ns, "found at the end");
+	return 0;
+}
+
+/* The emulated chip is erased, so this compares every byte. It includes the emulated reads. */
+static int bench_verify(struct flashprog_flashctx *flash, uint8_t *image, size_t size)
+{
+	memset(image, 0xff, size);
+
+	const uint64_t start = now_ns();
+	if (flashprog_image_verify(flash, image, size)) {
+		fprintf(stderr, "Verification failed.\n");
+		return 1;
+	}
+	report("verify", size, 0, 0, now_ns() - start, "includes emulated reads");
+	return 0;
+}
+
+static int bench_size(unsigned int size_mib)
+{
+	const size_t size = (size_t)size_mib * MiB;
+	struct flashprog_programmer *prog = NULL;
+	struct flashprog_flashctx *flash = NULL;
+	uint8_t *const ref = malloc(size);
+	uint8_t *const image = malloc(size);
+	char params[64];
+	int ret = 1;
+
+	if (!ref || !image) {
+		fprintf(stderr, "Out of memory!\n");
+		goto _free_ret;
+	}
+	fill_pattern(ref, size);
+
+	snprintf(params, sizeof(params), "emulate=sfdp_generic,size=%zu", size);
+	if (flashprog_programmer_init(&prog, "dummy", params)) {
+		fprintf(stderr, "Can't emulate a %u MiB chip.\n", size_mib);
+		goto _free_ret;
+	}
+	if (flashprog_flash_probe(&flash, prog, NULL) || flashprog_flash_getsize(flash) != size) {
+		fprintf(stderr, "Probing the emulated %u MiB chip failed.\n", size_mib);
+		goto _shutdown_ret;
+	}
+	/* Only the planning itself, not the verification reads it would estimate. */
+	flashprog_flag_set(flash, FLASHPROG_FLAG_VERIFY_AFTER_WRITE, false);
+
+	ret = bench_plan(flash, image, ref, size) ||
+	      bench_fmap(flash, image, ref, size) ||
+	      bench_verify(flash, image, size);
+
+_shutdown_ret:
+	if (flash)
+		flashprog_flash_release(flash);
+	flashprog_programmer_shutdown(prog);
+_free_ret:
+	free(image);
+	free(ref);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t count = argc > 1 ? (size_t)argc - 1 : ARRAY_SIZE(default_sizes);
+	size_t i;
+	int ret = 0;
+
+	if (flashprog_init(0))
+		return 1;
+	flashprog_set_log_callback(quiet_log);
+
+	printf("%-8s %8s %8s %6s %10s %10s  %s\n", "kernel", "size_mib", "density", "run",
+	       "ns_per_b", "rss_kib", "result");
+	for (i = 0; i < count && !ret; ++i) {
+		const unsigned int size_mib = argc > 1 ? strtoul(argv[i + 1], NULL, 0) : default_sizes[i];
+		if (size_mib < 1 || size_mib > 256) {
+			fprintf(stderr, "Sizes have to be between 1 and 256 MiB.\n");
+			ret = 1;
+			break;
+		}
+		ret = bench_size(size_mib);
+	}
+
+	flashprog_shutdown();
+	return ret;
+}
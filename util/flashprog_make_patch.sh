@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# This file is part of the flashprog project.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# This script creates a patch for `flashprog --patch` from two images of
+# the same size. Extents are aligned to ALIGN bytes, which must be a
+# multiple of the write granularity of the flash chip, and changes closer
+# than GAP bytes to each other are combined into one extent.
+#
+# Usage: flashprog_make_patch.sh <base image> <new image> <patch file>
+
+set -e
+
+ALIGN=${ALIGN:-4096}
+GAP=${GAP:-0}
+
+if [ $# -ne 3 ]; then
+	echo "Usage: $0 <base image> <new image> <patch file>" >&2
+	exit 1
+fi
+BASE=$1
+NEW=$2
+PATCH=$3
+
+SIZE=$(wc -c <"${BASE}")
+if [ "${SIZE}" -ne "$(wc -c <"${NEW}")" ]; then
+	echo "Images differ in size." >&2
+	exit 1
+fi
+
+# cmp -l lists every differing byte, with 1-based offsets.
+EXTENTS=$(cmp -l "${BASE}" "${NEW}" | awk -v align="${ALIGN}" -v gap="${GAP}" -v size="${SIZE}" '
+	{
+		off = $1 - 1
+		s = off - off % align
+		e = s + align
+		if (e > size)
+			e = size
+	}
+	NR == 1 { start = s; end = e; next }
+	s > end + gap { print start, end - start; start = s }
+	{ end = e }
+	END { if (NR) print start, end - start }')
+
+{
+	echo "# flashprog patch 1"
+	echo "size: ${SIZE}"
+	echo "base: $(sha256sum <"${BASE}" | cut -d' ' -f1)"
+	echo "result: $(sha256sum <"${NEW}" | cut -d' ' -f1)"
+	echo "${EXTENTS}" | while read -r start len; do
+		[ -n "${start}" ] || continue
+		printf "extent: 0x%08x 0x%x\n" "${start}" "${len}"
+		tail -c +$((start + 1)) "${NEW}" | head -c "${len}"
+	done
+} >"${PATCH}"
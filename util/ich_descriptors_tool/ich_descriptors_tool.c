@@ -18,6 +18,10 @@
 /*
  * dump information and binaries from BIOS images that are in descriptor mode
  */
+#ifdef __linux__
+/* for copy_file_range() */
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -35,6 +39,9 @@
 #define HAVE_MMAP 1
 #include <sys/mman.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 static const char *const region_names[] = {
 	"Descriptor", "BIOS", "ME", "GbE", "Platform",
@@ -43,7 +50,43 @@ static const char *const region_names[] = {
 	"Region15"
 };
 
-static void dump_file(const char *prefix, const uint32_t *dump, unsigned int len,
+/*
+ * Copy `len` bytes at `offset` of the image file `in` to `out`. On Linux,
+ * let the kernel copy the data, so we don't have to touch it. Otherwise,
+ * or if that fails (e.g. across file systems that don't support it),
+ * write the rest from the image in memory.
+ */
+static int copy_region(int out, int in, const uint8_t *image, off_t offset, size_t len)
+{
+#ifdef __linux__
+	ssize_t ret;
+
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)
+	while (len > 0) {
+		ret = copy_file_range(in, &offset, out, NULL, len, 0);
+		if (ret <= 0)
+			break;
+		len -= ret;
+	}
+#endif
+	while (len > 0) {
+		ret = sendfile(out, in, &offset, len);
+		if (ret <= 0)
+			break;
+		len -= ret;
+	}
+#endif
+	while (len > 0) {
+		const ssize_t written = write(out, image + offset, len);
+		if (written <= 0)
+			return 1;
+		offset += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static void dump_file(const char *prefix, int image_fd, const uint32_t *dump, unsigned int len,
 		      const struct ich_desc_region *const reg, unsigned int i)
 {
 	char *fn;
@@ -75,7 +118,7 @@ static void dump_file(const char *prefix, const uint32_t *dump, unsigned int len
 		 "%s.%s.bin", prefix, reg_name);
 	printf("Dumping %u bytes of the %s region from 0x%08x-0x%08x to %s... ",
 	       file_len, region_names[i], base, limit, fn);
-	int fh = open(fn, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	int fh = open(fn, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
 	if (fh < 0) {
 		fprintf(stderr,
 			"ERROR: couldn't open(%s): %s\n", fn, strerror(errno));
@@ -84,8 +127,7 @@ static void dump_file(const char *prefix, const uint32_t *dump, unsigned int len
 	}
 	free(fn);
 
-	const ssize_t ret = write(fh, &dump[base >> 2], file_len);
-	if (ret < 0 || (size_t)ret != file_len) {
+	if (copy_region(fh, image_fd, (const uint8_t *)dump, base, file_len)) {
 		fprintf(stderr, "FAILED.\n");
 		exit(1);
 	}
@@ -99,14 +141,14 @@ int min(int a, int b)
 	return (a < b) ? a : b;
 }
 
-static void dump_files(const char *name, const uint32_t *buf, unsigned int len,
+static void dump_files(const char *name, int image_fd, const uint32_t *buf, unsigned int len,
 		       const enum ich_chipset cs, const struct ich_descriptors *const desc)
 {
 	ssize_t i;
 	const ssize_t nr = min(ich_number_of_regions(cs, &desc->content), ARRAY_SIZE(region_names));
 	printf("=== Dumping region files ===\n");
 	for (i = 0; i < nr; i++)
-		dump_file(name, buf, len, &desc->region, i);
+		dump_file(name, image_fd, buf, len, &desc->region, i);
 	printf("\n");
 }
 
@@ -197,7 +239,6 @@ int main(int argc, char *argv[])
 			usage(argv, "Reading the descriptor image file failed");
 	}
 	printf("The flash image has a size of %d [0x%x] bytes.\n", len, len);
-	close(fd);
 
 	if (csn != NULL) {
 		if (strcmp(csn, "ich8") == 0)
@@ -271,8 +312,10 @@ int main(int argc, char *argv[])
 		       ICH_FREG_BASE(desc.region.FLREGs[3]),
 		       pMAC[0], pMAC[1], pMAC[2], pMAC[3], pMAC[4], pMAC[5]);
 
+	/* The regions are copied from the file, keep it open until then. */
 	if (dump == 1)
-		dump_files(fn, buf, len, cs, &desc);
+		dump_files(fn, fd, buf, len, cs, &desc);
+	close(fd);
 
 	return 0;
 }
@@ -189,7 +189,7 @@ static int wbsio_spi_send_command(const struct flashctx *flash, unsigned int wri
 
 	OUTB(writearr[0], wbsio_spibase);
 	OUTB(mode, wbsio_spibase + 1);
-	programmer_delay(10);
+	programmer_delay(flash, 10);
 
 	if (!readcnt)
 		return 0;
@@ -24,12 +24,20 @@
 #include "chipdrivers.h"
 #include "writeprotect.h"
 
+/** The chip's register layout, without any bits if it has none. */
+static const struct reg_bit_map *chip_reg_bits(const struct flashctx *flash)
+{
+	static const struct reg_bit_map no_bits;
+
+	return flash->chip->reg_bits ? flash->chip->reg_bits : &no_bits;
+}
+
 /** Read and extract a single bit from the chip's registers */
 static enum flashprog_wp_result read_bit(uint8_t *value, bool *present, struct flashctx *flash, struct reg_bit_info bit)
 {
 	*present = bit.reg != INVALID_REG;
 	if (*present) {
-		if (spi_read_register(flash, bit.reg, value))
+		if (spi_read_register_cached(flash, bit.reg, value))
 			return FLASHPROG_WP_ERR_READ_FAILED;
 		*value = (*value >> bit.bit_index) & 1;
 	} else {
@@ -48,7 +56,7 @@ static enum flashprog_wp_result read_wp_bits(struct wp_bits *bits, struct flashc
 	 * the register that contains it, extracts the bit's value, and assign
 	 * it to the appropriate field in the wp_bits structure.
 	 */
-	const struct reg_bit_map *bit_map = &flash->chip->reg_bits;
+	const struct reg_bit_map *bit_map = chip_reg_bits(flash);
 	bool ignored;
 	size_t i;
 	enum flashprog_wp_result ret;
@@ -150,7 +158,7 @@ static enum flashprog_wp_result write_wp_bits(struct flashctx *flash, struct wp_
 	uint8_t reg_values[MAX_REGISTERS];
 	uint8_t bit_masks[MAX_REGISTERS];	/* masks of valid bits */
 	uint8_t write_masks[MAX_REGISTERS];	/* masks of written bits */
-	get_wp_bits_reg_values(reg_values, bit_masks, write_masks, &flash->chip->reg_bits, bits);
+	get_wp_bits_reg_values(reg_values, bit_masks, write_masks, chip_reg_bits(flash), bits);
 
 	/* Write each register whose value was updated */
 	for (reg = STATUS1; reg < MAX_REGISTERS; reg++) {
@@ -158,7 +166,7 @@ static enum flashprog_wp_result write_wp_bits(struct flashctx *flash, struct wp_
 			continue;
 
 		uint8_t value;
-		if (spi_read_register(flash, reg, &value))
+		if (spi_read_register_cached(flash, reg, &value))
 			return FLASHPROG_WP_ERR_READ_FAILED;
 
 		/* Skip unnecessary register writes */
@@ -205,14 +213,8 @@ static enum flashprog_wp_result get_wp_range(struct wp_range *range, struct flas
 	return FLASHPROG_WP_OK;
 }
 
-/** Write protect bit values and the range they will activate. */
-struct wp_range_and_bits {
-	struct wp_bits bits;
-	struct wp_range range;
-};
-
 /**
- * Comparator used for sorting ranges in get_ranges_and_wp_bits().
+ * Comparator used for sorting ranges in build_range_table().
  *
  * Ranges are ordered by these attributes, in decreasing significance:
  *   (range length, range start, cmp bit, sec bit, tb bit, bp bits)
@@ -226,11 +228,11 @@ static int compare_ranges(const void *aa, const void *bb)
 
 	int ord = 0;
 
-	if (ord == 0)
-		ord = a->range.len - b->range.len;
+	if (a->range.len != b->range.len)
+		ord = a->range.len < b->range.len ? -1 : 1;
 
-	if (ord == 0)
-		ord = a->range.start - b->range.start;
+	if (ord == 0 && a->range.start != b->range.start)
+		ord = a->range.start < b->range.start ? -1 : 1;
 
 	if (ord == 0)
 		ord = a->bits.cmp - b->bits.cmp;
@@ -260,16 +262,40 @@ static bool can_write_bit(const struct reg_bit_info bit)
 	return bit.reg != INVALID_REG && bit.writability == RW;
 }
 
+/*
+ * The range bits that can't be written, and thus limit the available
+ * ranges. Built field by field, so the padding compares equal, too.
+ */
+static struct wp_bits range_table_key(const struct reg_bit_map *reg_bits, const struct wp_bits *bits)
+{
+	struct wp_bits key;
+	size_t i;
+
+	memset(&key, 0, sizeof(key));
+	key.bp_bit_count = bits->bp_bit_count;
+	for (i = 0; i < bits->bp_bit_count; i++)
+		key.bp[i] = can_write_bit(reg_bits->bp[i]) ? 0 : bits->bp[i];
+	key.tb_bit_present  = bits->tb_bit_present;
+	key.tb  = can_write_bit(reg_bits->tb)  ? 0 : bits->tb;
+	key.sec_bit_present = bits->sec_bit_present;
+	key.sec = can_write_bit(reg_bits->sec) ? 0 : bits->sec;
+	key.cmp_bit_present = bits->cmp_bit_present;
+	key.cmp = can_write_bit(reg_bits->cmp) ? 0 : bits->cmp;
+
+	return key;
+}
+
 /**
  * Enumerate all protection ranges that the chip supports and that are able to
  * be activated, given limitations such as OTP bits or programmer-enforced
- * restrictions. Returns a list of deduplicated wp_range_and_bits structures.
+ * restrictions. Returns a table of deduplicated wp_range_and_bits structures.
  *
  * Allocates a buffer that must be freed by the caller with free().
  */
-static enum flashprog_wp_result get_ranges_and_wp_bits(struct flashctx *flash, struct wp_bits bits, struct wp_range_and_bits **ranges, size_t *count)
+static struct wp_range_table *build_range_table(struct flashctx *flash, struct wp_bits bits)
 {
-	const struct reg_bit_map *reg_bits = &flash->chip->reg_bits;
+	const struct reg_bit_map *reg_bits = chip_reg_bits(flash);
+	struct wp_range_table *table;
 	size_t i;
 	/*
 	 * Create a list of bits that affect the chip's protection range in
@@ -299,13 +325,16 @@ static enum flashprog_wp_result get_ranges_and_wp_bits(struct flashctx *flash, s
 		range_bits[bit_count++] = &bits.cmp;
 
 	/* Allocate output buffer */
-	*count = 1 << bit_count;
-	*ranges = calloc(*count, sizeof(struct wp_range_and_bits));
+	const size_t count = 1 << bit_count;
+	table = malloc(sizeof(*table) + count * sizeof(table->entries[0]));
+	if (!table)
+		return NULL;
+	table->key = range_table_key(reg_bits, &bits);
 
 	/* TODO: take WPS bit into account. */
 
 	size_t range_index;
-	for (range_index = 0; range_index < *count; range_index++) {
+	for (range_index = 0; range_index < count; range_index++) {
 		/*
 		 * Extract bits from the range index and assign them to members
 		 * of the wp_bits structure. The loop bounds ensure that all
@@ -314,14 +343,10 @@ static enum flashprog_wp_result get_ranges_and_wp_bits(struct flashctx *flash, s
 		for (i = 0; i < bit_count; i++)
 			*range_bits[i] = (range_index >> i) & 1;
 
-		struct wp_range_and_bits *output = &(*ranges)[range_index];
+		struct wp_range_and_bits *output = &table->entries[range_index];
 
 		output->bits = bits;
-		enum flashprog_wp_result ret = get_wp_range(&output->range, flash, &bits);
-		if (ret != FLASHPROG_WP_OK) {
-			free(*ranges);
-			return ret;
-		}
+		get_wp_range(&output->range, flash, &bits);
 
 		/* Debug: print range bits and range */
 		msg_gspew("Enumerated range: ");
@@ -340,35 +365,56 @@ static enum flashprog_wp_result get_ranges_and_wp_bits(struct flashctx *flash, s
 	}
 
 	/* Sort ranges. Ensures consistency if there are duplicate ranges. */
-	qsort(*ranges, *count, sizeof(struct wp_range_and_bits), compare_ranges);
+	qsort(table->entries, count, sizeof(table->entries[0]), compare_ranges);
 
 	/* Remove duplicates */
 	size_t output_index = 0;
 	struct wp_range *last_range = NULL;
 
-	for (i = 0; i < *count; i++) {
+	for (i = 0; i < count; i++) {
 		bool different_to_last =
 			(last_range == NULL) ||
-			((*ranges)[i].range.start != last_range->start) ||
-			((*ranges)[i].range.len   != last_range->len);
+			(table->entries[i].range.start != last_range->start) ||
+			(table->entries[i].range.len   != last_range->len);
 
 		if (different_to_last) {
 			/* Move range to the next free position */
-			(*ranges)[output_index] = (*ranges)[i];
-			output_index++;
+			table->entries[output_index] = table->entries[i];
 			/* Keep track of last non-duplicate range */
-			last_range = &(*ranges)[i].range;
+			last_range = &table->entries[output_index].range;
+			output_index++;
 		}
 	}
 	/* Reduce count to only include non-duplicate ranges */
-	*count = output_index;
+	table->count = output_index;
+
+	return table;
+}
+
+/*
+ * Get the table of available ranges. It only depends on the chip and the
+ * bits that we can't change, so it's built only once for a flash context.
+ */
+static enum flashprog_wp_result get_range_table(
+		const struct wp_range_table **table, struct flashctx *flash, const struct wp_bits *bits)
+{
+	const struct wp_bits key = range_table_key(chip_reg_bits(flash), bits);
+
+	if (!flash->wp_ranges || memcmp(&flash->wp_ranges->key, &key, sizeof(key))) {
+		free(flash->wp_ranges);
+		flash->wp_ranges = build_range_table(flash, *bits);
+		if (!flash->wp_ranges)
+			return FLASHPROG_WP_ERR_OTHER;
+	}
 
+	*table = flash->wp_ranges;
 	return FLASHPROG_WP_OK;
 }
 
-static bool ranges_equal(struct wp_range a, struct wp_range b)
+void spi_wp_release(struct flashctx *flash)
 {
-	return (a.start == b.start) && (a.len == b.len);
+	free(flash->wp_ranges);
+	flash->wp_ranges = NULL;
 }
 
 /*
@@ -377,28 +423,34 @@ static bool ranges_equal(struct wp_range a, struct wp_range b)
  */
 static int set_wp_range(struct wp_bits *bits, struct flashctx *flash, const struct wp_range range)
 {
-	struct wp_range_and_bits *ranges = NULL;
-	size_t count;
-	size_t i;
+	const struct wp_range_table *table;
 
-	enum flashprog_wp_result ret = get_ranges_and_wp_bits(flash, *bits, &ranges, &count);
+	enum flashprog_wp_result ret = get_range_table(&table, flash, bits);
 	if (ret != FLASHPROG_WP_OK)
 		return ret;
 
-	/* Search for matching range */
-	ret = FLASHPROG_WP_ERR_RANGE_UNSUPPORTED;
-	for (i = 0; i < count; i++) {
-
-		if (ranges_equal(ranges[i].range, range)) {
-			*bits = ranges[i].bits;
-			ret = 0;
-			break;
+	/* Binary search, the table is sorted by length, then start. */
+	size_t lo = 0, hi = table->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const struct wp_range *const cand = &table->entries[mid].range;
+
+		if (cand->len == range.len && cand->start == range.start) {
+			const struct wp_bits *const found = &table->entries[mid].bits;
+			memcpy(bits->bp, found->bp, sizeof(bits->bp));
+			bits->tb  = found->tb;
+			bits->sec = found->sec;
+			bits->cmp = found->cmp;
+			return FLASHPROG_WP_OK;
 		}
-	}
 
-	free(ranges);
+		if (cand->len < range.len || (cand->len == range.len && cand->start < range.start))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return ret;
+	return FLASHPROG_WP_ERR_RANGE_UNSUPPORTED;
 }
 
 /** Get the mode selected by a WP configuration. */
@@ -502,9 +554,8 @@ enum flashprog_wp_result spi_wp_write_cfg(struct flashctx *flash, const struct f
 
 enum flashprog_wp_result spi_wp_get_available_ranges(struct flashprog_wp_ranges **list, struct flashprog_flashctx *flash)
 {
+	const struct wp_range_table *table;
 	struct wp_bits bits;
-	struct wp_range_and_bits *range_pairs = NULL;
-	size_t count;
 	size_t i;
 
 	if (!chip_supported(flash))
@@ -514,28 +565,25 @@ enum flashprog_wp_result spi_wp_get_available_ranges(struct flashprog_wp_ranges
 	if (ret != FLASHPROG_WP_OK)
 		return ret;
 
-	ret = get_ranges_and_wp_bits(flash, bits, &range_pairs, &count);
+	ret = get_range_table(&table, flash, &bits);
 	if (ret != FLASHPROG_WP_OK)
 		return ret;
 
 	*list = calloc(1, sizeof(struct flashprog_wp_ranges));
-	struct wp_range *ranges = calloc(count, sizeof(struct wp_range));
+	struct wp_range *ranges = calloc(table->count, sizeof(struct wp_range));
 
 	if (!(*list) || !ranges) {
 		free(*list);
 		free(ranges);
-		ret = FLASHPROG_WP_ERR_OTHER;
-		goto out;
+		return FLASHPROG_WP_ERR_OTHER;
 	}
-	(*list)->count = count;
+	(*list)->count = table->count;
 	(*list)->ranges = ranges;
 
-	for (i = 0; i < count; i++)
-		ranges[i] = range_pairs[i].range;
+	for (i = 0; i < table->count; i++)
+		ranges[i] = table->entries[i].range;
 
-out:
-	free(range_pairs);
-	return ret;
+	return FLASHPROG_WP_OK;
 }
 
 /** @} */ /* end flashprog-wp */